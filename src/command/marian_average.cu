@@ -0,0 +1,205 @@
+#include <iostream>
+#include <boost/program_options.hpp>
+
+#include "3rd_party/cnpy/cnpy.h"
+#include "common/logging.h"
+#include "graph/binary_model.h"
+#include "kernels/tensor_operators.h"
+#include "kernels/thrust_functions.h"
+#include "tensors/tensor_allocator.h"
+
+namespace {
+
+using namespace marian;
+
+/**
+ * @brief Reads the tensors of a checkpoint one at a time, an npz model by
+ * seeking to the tensor, a binary model from its memory map
+ */
+class Checkpoint {
+  private:
+    std::string path_;
+    Ptr<BinaryModel> binary_;
+    std::map<std::string, BinaryModel::Item> items_;
+    cnpy::NpyArray array_;
+    bool loaded_{false};
+
+  public:
+    Checkpoint(const std::string& path) : path_(path) {
+      if(BinaryModel::isBinary(path)) {
+        binary_ = New<BinaryModel>(path);
+        for(auto& item : binary_->items())
+          items_[item.name] = item;
+      }
+    }
+
+    ~Checkpoint() {
+      release();
+    }
+
+    /** @brief Tensor  name  with  rows  x  cols  floats, valid until the next read() */
+    const float* read(const std::string& name, size_t rows, size_t cols) {
+      release();
+      if(binary_) {
+        auto it = items_.find(name);
+        UTIL_THROW_IF2(it == items_.end(), "Tensor " << name << " is missing in " << path_);
+        UTIL_THROW_IF2(it->second.rows * it->second.cols != rows * cols,
+                       "Tensor " << name << " of " << path_ << " has a different shape");
+        return binary_->data() + it->second.offset;
+      }
+
+      array_ = cnpy::npz_load(path_, name);
+      loaded_ = true;
+      size_t elements = 1;
+      for(auto d : array_.shape)
+        elements *= d;
+      UTIL_THROW_IF2(array_.word_size != sizeof(float),
+                     "Tensor " << name << " of " << path_ << " is not float32");
+      UTIL_THROW_IF2(elements != rows * cols,
+                     "Tensor " << name << " of " << path_ << " has a different shape");
+      return (const float*)array_.data;
+    }
+
+    void release() {
+      if(loaded_)
+        array_.destruct();
+      loaded_ = false;
+    }
+};
+
+/** @brief  sum[i] += in[i] , written for the compiler to vectorize */
+void accumulate(float* __restrict__ sum, const float* __restrict__ in, size_t n) {
+  for(size_t i = 0; i < n; ++i)
+    sum[i] += in[i];
+}
+
+}
+
+/**
+ * Averages the parameters of several checkpoints of a model, e.g. the last
+ * .iterN.npz files, into a binary model. The first checkpoint is loaded as
+ * the sum, the others are read and added one tensor at a time, so memory use
+ * stays at one model and one tensor for any number of checkpoints. With
+ * --device the sums are kept and added on that GPU instead.
+ */
+int main(int argc, char** argv) {
+  namespace po = boost::program_options;
+
+  po::options_description desc("Allowed options");
+  desc.add_options()
+    ("from,f", po::value<std::vector<std::string>>()->multitoken()->required(),
+     "Checkpoints to average, in npz or the binary format")
+    ("to,t", po::value<std::string>()->required(),
+     "Path of the averaged binary model")
+    ("device,d", po::value<int>()->default_value(-1),
+     "GPU to add the tensors on (-1 = CPU)")
+    ("help,h", "Print this help message and exit");
+
+  po::variables_map vm;
+  try {
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    if(vm.count("help")) {
+      std::cerr << desc << std::endl;
+      return 0;
+    }
+    po::notify(vm);
+  }
+  catch(std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl << std::endl;
+    std::cerr << desc << std::endl;
+    return 1;
+  }
+
+  stderrLogger("info", "[%Y-%m-%d %T] %v", {});
+
+  auto from = vm["from"].as<std::vector<std::string>>();
+  auto to = vm["to"].as<std::string>();
+  int device = vm["device"].as<int>();
+
+  // the first checkpoint, all of it, is the sum of host tensors
+  std::vector<BinaryModel::Item> items;
+  std::vector<std::vector<float>> sums;
+  if(BinaryModel::isBinary(from[0])) {
+    BinaryModel first(from[0]);
+    for(auto item : first.items()) {
+      const float* data = first.data() + item.offset;
+      items.push_back(item);
+      sums.emplace_back(data, data + item.rows * item.cols);
+    }
+  }
+  else {
+    auto numpy = cnpy::npz_load(from[0]);
+    for(auto& it : numpy) {
+      UTIL_THROW_IF2(it.second.word_size != sizeof(float),
+                     "Tensor " << it.first << " of " << from[0] << " is not float32");
+      BinaryModel::Item item;
+      item.name = it.first;
+      item.rows = it.second.shape.size() == 2 ? it.second.shape[0] : 1;
+      item.cols = it.second.shape.empty() ? 1 : it.second.shape.back();
+      const float* data = (const float*)it.second.data;
+      items.push_back(item);
+      sums.emplace_back(data, data + item.rows * item.cols);
+    }
+    numpy.destruct();
+  }
+
+  // on a GPU the sums move to the device, the host keeps one tensor at a time
+  Ptr<TensorAllocator> alloc;
+  std::vector<Tensor> deviceSums;
+  Tensor staging;
+  if(device >= 0) {
+    cudaSetDevice(device);
+    size_t total = 0, largest = 0;
+    for(auto& sum : sums) {
+      total += BinaryModel::aligned(sum.size());
+      largest = std::max(largest, sum.size());
+    }
+    alloc = New<TensorAllocator>(device);
+    alloc->reserveExact(total + BinaryModel::aligned(largest));
+    for(auto& sum : sums) {
+      Tensor t;
+      alloc->allocate(t, {1, (int)sum.size()});
+      t->set(sum);
+      deviceSums.push_back(t);
+      std::vector<float>().swap(sum);
+    }
+    alloc->allocate(staging, {1, (int)largest});
+  }
+
+  for(size_t c = 1; c < from.size(); ++c) {
+    Checkpoint checkpoint(from[c]);
+    for(size_t i = 0; i < items.size(); ++i) {
+      size_t elements = items[i].rows * items[i].cols;
+      const float* data = checkpoint.read(items[i].name, items[i].rows, items[i].cols);
+      if(device >= 0) {
+        Tensor in = staging->subtensor(0, elements);
+        CUDA_CHECK(cudaMemcpy(in->data(), data, elements * sizeof(float),
+                              cudaMemcpyHostToDevice));
+        Element(_1 += _2, deviceSums[i], in);
+      }
+      else {
+        accumulate(sums[i].data(), data, elements);
+      }
+    }
+    LOG(info, "Added {}", from[c]);
+  }
+
+  float scale = 1.f / from.size();
+  std::vector<const float*> blobs;
+  for(size_t i = 0; i < items.size(); ++i) {
+    if(device >= 0) {
+      Element(_1 *= scale, deviceSums[i]);
+      deviceSums[i]->get(sums[i]);
+    }
+    else {
+      for(auto& v : sums[i])
+        v *= scale;
+    }
+    blobs.push_back(sums[i].data());
+  }
+
+  BinaryModel::create(to, items, blobs);
+  LOG(info, "Wrote the average of {} checkpoints, {} tensors, to {}",
+      from.size(), items.size(), to);
+  return 0;
+}
@@ -0,0 +1,76 @@
+#include <iostream>
+#include <boost/program_options.hpp>
+
+#include "common/logging.h"
+#include "data/binary_corpus.h"
+
+/**
+ * Converts aligned text corpora into a memory-mapped binary corpus that can be
+ * passed to --train-sets (or --inputs) as a single file instead of the texts.
+ * The same vocabularies have to be given to marian with --vocabs. With
+ * --vocab-outputs the vocabularies are also written in the binary format,
+ * which loads without parsing wherever a vocabulary is expected.
+ */
+int main(int argc, char** argv) {
+  using namespace marian;
+  namespace po = boost::program_options;
+
+  po::options_description desc("Allowed options");
+  desc.add_options()
+    ("texts,t", po::value<std::vector<std::string>>()->multitoken(),
+     "Aligned tokenized text files, one sentence per line")
+    ("vocabs,v", po::value<std::vector<std::string>>()->multitoken()->required(),
+     "Vocabulary files, one per text file")
+    ("output,o", po::value<std::string>(),
+     "Path of the binary corpus, required with --texts")
+    ("vocab-outputs", po::value<std::vector<std::string>>()->multitoken(),
+     "Paths of the binary vocabularies, one per vocabulary file")
+    ("help,h", "Print this help message and exit");
+
+  po::variables_map vm;
+  try {
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    if(vm.count("help")) {
+      std::cerr << desc << std::endl;
+      return 0;
+    }
+    po::notify(vm);
+    if(!vm.count("texts") && !vm.count("vocab-outputs"))
+      throw std::runtime_error("Nothing to do, give --texts or --vocab-outputs");
+    if(vm.count("texts") && !vm.count("output"))
+      throw std::runtime_error("--texts requires --output");
+  }
+  catch(std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl << std::endl;
+    std::cerr << desc << std::endl;
+    return 1;
+  }
+
+  stderrLogger("info", "[%Y-%m-%d %T] %v", {});
+  stderrLogger("data", "[%Y-%m-%d %T] [data] %v", {});
+
+  std::vector<Ptr<Vocab>> vocabs;
+  for(auto& path : vm["vocabs"].as<std::vector<std::string>>()) {
+    vocabs.push_back(New<Vocab>());
+    vocabs.back()->load(path);
+  }
+
+  if(vm.count("vocab-outputs")) {
+    auto outputs = vm["vocab-outputs"].as<std::vector<std::string>>();
+    UTIL_THROW_IF2(outputs.size() != vocabs.size(),
+                   "Got " << outputs.size() << " vocab outputs for " << vocabs.size() << " vocabs");
+    for(size_t i = 0; i < outputs.size(); ++i) {
+      vocabs[i]->saveBinary(outputs[i]);
+      LOG(info, "Wrote {} words to {}", vocabs[i]->size(), outputs[i]);
+    }
+  }
+
+  if(vm.count("texts")) {
+    auto output = vm["output"].as<std::string>();
+    size_t sentences = data::BinaryCorpus::create(output,
+                                                  vm["texts"].as<std::vector<std::string>>(),
+                                                  vocabs);
+    LOG(info, "Wrote {} sentence tuples to {}", sentences, output);
+  }
+  return 0;
+}
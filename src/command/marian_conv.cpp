@@ -0,0 +1,45 @@
+#include <iostream>
+#include <boost/program_options.hpp>
+
+#include "common/logging.h"
+#include "graph/binary_model.h"
+
+/**
+ * Converts an npz model into the binary model format, which marian and the
+ * translators load by memory-mapping it and uploading it with a single copy.
+ */
+int main(int argc, char** argv) {
+  using namespace marian;
+  namespace po = boost::program_options;
+
+  po::options_description desc("Allowed options");
+  desc.add_options()
+    ("from,f", po::value<std::string>()->required(),
+     "Model in npz format")
+    ("to,t", po::value<std::string>()->required(),
+     "Path of the binary model")
+    ("help,h", "Print this help message and exit");
+
+  po::variables_map vm;
+  try {
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    if(vm.count("help")) {
+      std::cerr << desc << std::endl;
+      return 0;
+    }
+    po::notify(vm);
+  }
+  catch(std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl << std::endl;
+    std::cerr << desc << std::endl;
+    return 1;
+  }
+
+  stderrLogger("info", "[%Y-%m-%d %T] %v", {});
+
+  auto from = vm["from"].as<std::string>();
+  auto to = vm["to"].as<std::string>();
+  size_t tensors = BinaryModel::fromNpz(from, to);
+  LOG(info, "Wrote {} tensors of {} to {}", tensors, from, to);
+  return 0;
+}
@@ -0,0 +1,137 @@
+#include <iostream>
+#include <set>
+#include <boost/program_options.hpp>
+
+#include "3rd_party/cnpy/cnpy.h"
+#include "common/logging.h"
+#include "common/npz_writer.h"
+
+namespace {
+
+struct Array {
+  const float* data;
+  unsigned rows;
+  unsigned cols;
+  unsigned dim;
+};
+
+Array array(cnpy::NpyArray& a) {
+  Array r;
+  r.data = (const float*)a.data;
+  r.dim = a.shape.size();
+  r.rows = r.dim == 2 ? a.shape[0] : 1;
+  r.cols = a.shape.empty() ? 1 : a.shape.back();
+  return r;
+}
+
+/** @brief Columns of  left  followed by those of  right , row by row */
+std::vector<float> concatColumns(const Array& left, const Array& right) {
+  std::vector<float> out;
+  out.reserve(left.rows * (left.cols + right.cols));
+  for(unsigned i = 0; i < left.rows; ++i) {
+    out.insert(out.end(), left.data + i * left.cols, left.data + (i + 1) * left.cols);
+    out.insert(out.end(), right.data + i * right.cols, right.data + (i + 1) * right.cols);
+  }
+  return out;
+}
+
+}
+
+/**
+ * Converts a trained npz model for inference: the parameters every GRU
+ * concatenates in each graph, U|Ux, W|Wx and b|bx, are stored concatenated
+ * as  _Ucat ,  _Wcat  and  _bcat , see GRU. The decoder then neither builds
+ * the concatenations nor keeps the parts next to them, and the recurrent
+ * products run on parameters, which int8 decoding requires. Models in the
+ * Nematus layout (--type dl4mt) load a fixed set of names and are rejected.
+ */
+int main(int argc, char** argv) {
+  using namespace marian;
+  namespace po = boost::program_options;
+
+  po::options_description desc("Allowed options");
+  desc.add_options()
+    ("from,f", po::value<std::string>()->required(),
+     "Trained model in npz format")
+    ("to,t", po::value<std::string>()->required(),
+     "Path of the frozen npz model")
+    ("help,h", "Print this help message and exit");
+
+  po::variables_map vm;
+  try {
+    po::store(po::parse_command_line(argc, argv, desc), vm);
+    if(vm.count("help")) {
+      std::cerr << desc << std::endl;
+      return 0;
+    }
+    po::notify(vm);
+  }
+  catch(std::exception& e) {
+    std::cerr << "Error: " << e.what() << std::endl << std::endl;
+    std::cerr << desc << std::endl;
+    return 1;
+  }
+
+  stderrLogger("info", "[%Y-%m-%d %T] %v", {});
+
+  auto from = vm["from"].as<std::string>();
+  auto to = vm["to"].as<std::string>();
+
+  auto numpy = cnpy::npz_load(from);
+  UTIL_THROW_IF2(numpy.count("decoder_U_nl"),
+                 from << " is a model in the Nematus layout, which cannot be frozen");
+  for(auto& it : numpy)
+    UTIL_THROW_IF2(it.second.word_size != sizeof(float),
+                   "Tensor " << it.first << " of " << from << " is not float32");
+
+  // prefixes of GRUs, whose six parameters are all present
+  std::set<std::string> cells;
+  for(auto& it : numpy) {
+    const std::string& name = it.first;
+    if(name.size() < 3 || name.compare(name.size() - 3, 3, "_Ux") != 0)
+      continue;
+    std::string prefix = name.substr(0, name.size() - 3);
+    bool complete = true;
+    for(auto part : {"_U", "_W", "_b", "_Wx", "_bx"})
+      complete = complete && numpy.count(prefix + part);
+    if(complete)
+      cells.insert(prefix);
+  }
+
+  NpzWriter npz(to);
+  std::set<std::string> folded;
+  for(auto& prefix : cells) {
+    for(auto part : {"U", "W", "b"}) {
+      std::string name = prefix + "_" + part;
+      Array left = array(numpy[name]);
+      Array right = array(numpy[name + "x"]);
+      UTIL_THROW_IF2(left.rows != right.rows,
+                     "Parameters " << name << " and " << name << "x do not match");
+
+      auto data = concatColumns(left, right);
+      unsigned shape[2] = {left.rows, left.cols + right.cols};
+      if(left.dim == 1) {
+        shape[0] = shape[1];
+        npz.add(name + "cat", data.data(), shape, 1);
+      }
+      else {
+        npz.add(name + "cat", data.data(), shape, 2);
+      }
+      folded.insert(name);
+      folded.insert(name + "x");
+    }
+  }
+
+  for(auto& it : numpy) {
+    if(folded.count(it.first))
+      continue;
+    Array a = array(it.second);
+    std::vector<unsigned> shape(it.second.shape.begin(), it.second.shape.end());
+    npz.add(it.first, a.data, shape.data(), shape.size());
+  }
+  npz.close();
+
+  LOG(info, "Froze {} recurrent cells of {} into {}", cells.size(), from, to);
+  numpy.destruct();
+  return 0;
+}
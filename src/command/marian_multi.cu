@@ -0,0 +1,63 @@
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "training/train_model.h"
+
+/**
+ * Trains several independent models in one process, e.g. small models that
+ * would each leave most of a GPU idle:
+ *
+ *     marian-multi tenant1.yml tenant2.yml tenant3.yml
+ *
+ * Every argument is the configuration of one training as taken by marian -c,
+ * with its own model, data and devices. Each training runs in its own thread
+ * with its own graph group, graphs, CUDA streams and batch generator, so
+ * trainings on the same device interleave their kernels. --workspace-limit
+ * bounds the memory a training takes from a shared device, it splits batches
+ * that do not fit instead of growing, and --device-share bounds the fraction
+ * of the wall time its forward passes take. All trainings log through the
+ * loggers of the first configuration. Returns 1 if any training failed.
+ */
+int main(int argc, char** argv) {
+  using namespace marian;
+
+  UTIL_THROW_IF2(argc < 2, "Usage: " << argv[0] << " config.yml [config.yml ...]");
+
+  // configurations are parsed before any training starts a thread
+  std::vector<Ptr<Config>> tenants;
+  for(int i = 1; i < argc; ++i) {
+    std::string path = argv[i];
+    std::vector<char*> args{argv[0], (char*)"-c", &path[0], nullptr};
+    auto options = New<Config>(3, args.data());
+    UTIL_THROW_IF2(options->get<size_t>("data-processes") > 0,
+                   path << ": --data-processes forks, which is not possible "
+                   "with several trainings in one process");
+    UTIL_THROW_IF2(options->get<size_t>("cluster-nodes") > 1,
+                   path << ": --cluster-nodes is not supported by marian-multi");
+    UTIL_THROW_IF2(!options->get<std::string>("trace").empty(),
+                   path << ": --trace is global to the process, not supported by marian-multi");
+    tenants.push_back(options);
+  }
+  // --seed is global to the process as well, the last configuration sets it
+  LOG(info, "Training {} models, random seed {}", tenants.size(), Config::seed);
+
+  std::atomic<size_t> failed{0};
+  std::vector<std::thread> threads;
+  for(size_t i = 0; i < tenants.size(); ++i) {
+    threads.emplace_back([&, i]() {
+      try {
+        TrainModel(tenants[i]);
+        LOG(info, "Training {} ({}) finished", i, argv[i + 1]);
+      }
+      catch(const std::exception& e) {
+        LOG(info, "Training {} ({}) failed: {}", i, argv[i + 1], e.what());
+        failed++;
+      }
+    });
+  }
+  for(auto& thread : threads)
+    thread.join();
+
+  return failed ? 1 : 0;
+}
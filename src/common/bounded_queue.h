@@ -0,0 +1,78 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+namespace marian {
+
+/**
+ * @brief Queue between pipeline stages holding at most  capacity  items.
+ * push() blocks while the queue is full, pop() while it is empty and open.
+ * After close() the remaining items can still be popped.
+ */
+template <class T>
+class BoundedQueue {
+  private:
+    std::deque<T> items_;
+    size_t capacity_;
+    bool closed_{false};
+
+    std::mutex mutex_;
+    std::condition_variable notEmpty_;
+    std::condition_variable notFull_;
+
+  public:
+    BoundedQueue(size_t capacity)
+     : capacity_(std::max(capacity, (size_t)1)) {}
+
+    void push(T item) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      notFull_.wait(lock, [this]() { return items_.size() < capacity_; });
+      items_.push_back(std::move(item));
+      lock.unlock();
+      notEmpty_.notify_one();
+    }
+
+    /** @brief Waits for an item, returns false once the queue is closed and drained */
+    bool pop(T& item) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      notEmpty_.wait(lock, [this]() { return closed_ || !items_.empty(); });
+      if(items_.empty())
+        return false;
+      item = std::move(items_.front());
+      items_.pop_front();
+      lock.unlock();
+      notFull_.notify_one();
+      return true;
+    }
+
+    /** @brief Pops an item only if one is waiting */
+    bool tryPop(T& item) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if(items_.empty())
+        return false;
+      item = std::move(items_.front());
+      items_.pop_front();
+      lock.unlock();
+      notFull_.notify_one();
+      return true;
+    }
+
+    /** @brief Number of waiting items */
+    size_t size() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return items_.size();
+    }
+
+    void close() {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+      }
+      notEmpty_.notify_all();
+    }
+};
+
+}
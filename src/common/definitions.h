@@ -110,6 +110,7 @@ namespace marian {
     KEY(activation, act);
     KEY(direction, dir);
     KEY(mask, Expr);
+    KEY(active_rows, std::vector<size_t>);
     KEY(dropout_prob, float);
     KEY(init, std::function<void(Tensor)>);
 
@@ -118,14 +119,18 @@ namespace marian {
     KEY(beta1, float);
     KEY(beta2, float);
     KEY(eps, float);
+    KEY(offload, bool);
+    KEY(states, std::string);
     KEY(optimizer, Ptr<OptimizerBase>);
     KEY(clip, Ptr<ClipperBase>);
     KEY(batch_size, int);
     KEY(normalize, bool);
+    KEY(transposed, bool);
     KEY(inference, bool);
     KEY(skip, bool);
     KEY(skip_first, bool);
     KEY(coverage, Expr);
+    KEY(window, int);
     KEY(max_epochs, int);
     KEY(valid, Ptr<RunBase>);
   }
@@ -4,21 +4,99 @@
 #include <boost/filesystem/fstream.hpp>
 #include <boost/iostreams/filtering_stream.hpp>
 #include <boost/iostreams/filter/gzip.hpp>
+#include <atomic>
+#include <exception>
 #include <iostream>
+#include <thread>
 
 #include "exception.h"
+#include "common/bounded_queue.h"
+#include "common/read_ahead.h"
+
+/**
+ * @brief Stream buffer that decompresses a gzipped stream on its own thread.
+ *
+ * The reader thread keeps up to  blocks  decompressed blocks of  blockSize
+ * bytes ready, so decompression overlaps with parsing on the reading thread.
+ */
+class GzipReaderBuffer : public std::streambuf {
+  private:
+    boost::iostreams::filtering_istream gzip_;
+    marian::BoundedQueue<std::string> blocks_;
+    std::string current_;
+    std::atomic<bool> stop_{false};
+    std::exception_ptr error_;
+    std::thread reader_;
+
+    void read(size_t blockSize) {
+      try {
+        while(!stop_) {
+          std::string block(blockSize, 0);
+          gzip_.read(&block[0], blockSize);
+          block.resize(gzip_.gcount());
+          if(block.empty())
+            break;
+          blocks_.push(std::move(block));
+        }
+      }
+      catch(...) {
+        error_ = std::current_exception();
+      }
+      blocks_.close();
+    }
+
+  protected:
+    int_type underflow() {
+      if(gptr() < egptr())
+        return traits_type::to_int_type(*gptr());
+      if(!blocks_.pop(current_)) {
+        if(error_)
+          std::rethrow_exception(error_);
+        return traits_type::eof();
+      }
+      setg(&current_[0], &current_[0], &current_[0] + current_.size());
+      return traits_type::to_int_type(*gptr());
+    }
+
+  public:
+    GzipReaderBuffer(std::istream& compressed,
+                     size_t blockSize = 1 << 20, size_t blocks = 16)
+     : blocks_(blocks) {
+      gzip_.push(boost::iostreams::gzip_decompressor());
+      gzip_.push(compressed, 0);
+      reader_ = std::thread([this, blockSize]() { read(blockSize); });
+    }
+
+    ~GzipReaderBuffer() {
+      stop_ = true;
+      // unblocks a reader waiting for room
+      std::string block;
+      while(blocks_.pop(block)) {}
+      reader_.join();
+    }
+};
 
+/**
+ * @brief Input stream of a local file or URL, see marian::io, read ahead
+ * asynchronously and decompressed on another thread if it ends in .gz
+ */
 class InputFileStream {
   public:
     InputFileStream(const std::string& file)
-     : file_(file), ifstream_(file_)
+     : file_(file)
     {
-      UTIL_THROW_IF2(!boost::filesystem::exists(file_),
+      UTIL_THROW_IF2(!marian::io::isRemote(file) && !boost::filesystem::exists(file_),
                      "File " << file << " does not exist");
 
-      if(file_.extension() == ".gz")
-        istream_.push(boost::iostreams::gzip_decompressor());
-      istream_.push(ifstream_);
+      readAhead_.reset(new marian::io::ReadAheadBuffer(marian::io::open(file)));
+      raw_.reset(new std::istream(readAhead_.get()));
+      if(file_.extension() == ".gz") {
+        gzipBuffer_.reset(new GzipReaderBuffer(*raw_));
+        istream_.push(*gzipBuffer_, 0);
+      }
+      else {
+        istream_.push(*readAhead_, 0);
+      }
     }
 
     InputFileStream(std::istream& strm)
@@ -46,7 +124,9 @@ class InputFileStream {
 
   private:
     boost::filesystem::path file_;
-    boost::filesystem::ifstream ifstream_;
+    std::unique_ptr<marian::io::ReadAheadBuffer> readAhead_;
+    std::unique_ptr<std::istream> raw_;
+    std::unique_ptr<GzipReaderBuffer> gzipBuffer_;
     boost::iostreams::filtering_istream istream_;
 };
 
@@ -3,7 +3,8 @@
 namespace marian {
 
 History::History(size_t lineNo)
- : normalize_(true),
+ : offsets_(1, 0),
+   normalize_(true),
    lineNo_(lineNo)
 {}
 
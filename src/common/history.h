@@ -1,11 +1,19 @@
 #pragma once
 
-#include <queue>
+#include <algorithm>
+#include <limits>
 
 #include "hypothesis.h"
 
 namespace marian {
 
+/**
+ * @brief Search history of one sentence in flat per-step arrays of words,
+ * back-pointers and costs. Step i occupies [offsets_[i], offsets_[i + 1]),
+ * the back-pointer of an entry is the position of its predecessor within the
+ * previous step. Finished hypotheses are remembered by step and position, the
+ * n-best list is found by backtracing indices.
+ */
 class History {
   private:
     struct HypothesisCoord {
@@ -22,53 +30,122 @@ class History {
     History(size_t lineNo);
 
     void Add(const Beam& beam, bool last = false) {
-      if (beam.back()->GetPrevHyp() != nullptr) {
+      size_t step = size();
+      if (step > 0) {
         for (size_t j = 0; j < beam.size(); ++j)
-          if(beam[j]->GetWord() == 0 || last) {
-            float cost = normalize_ ? beam[j]->GetCost() / history_.size() : beam[j]->GetCost();
-            topHyps_.push({ history_.size(), j, cost });
+          if(beam[j].GetWord() == 0 || last) {
+            float cost = normalize_ ? beam[j].GetCost() / step : beam[j].GetCost();
+            topHyps_.push_back({ step, j, cost });
+            if(beam[j].GetWord() == 0 && cost > bestFinished_) {
+              bestFinished_ = cost;
+              bestFinishedHyp_ = topHyps_.back();
+            }
           }
       }
-      history_.push_back(beam);
+
+      for(auto& hyp : beam) {
+        words_.push_back(hyp.GetWord());
+        backs_.push_back(hyp.GetBackPointer());
+        costs_.push_back(hyp.GetCost());
+      }
+      offsets_.push_back(words_.size());
     }
 
     size_t size() const {
-      return history_.size();
+      return offsets_.size() - 1;
     }
 
     NBestList NBest(size_t n) const {
-      NBestList nbest;
-      auto topHypsCopy = topHyps_;
-      while (nbest.size() < n && !topHypsCopy.empty()) {
-        auto bestHypCoord = topHypsCopy.top();
-        topHypsCopy.pop();
+      // best first
+      std::vector<HypothesisCoord> best(topHyps_);
+      n = std::min(n, best.size());
+      std::partial_sort(best.begin(), best.begin() + n, best.end(),
+                        [](const HypothesisCoord& a, const HypothesisCoord& b) {
+                          return b < a;
+                        });
 
-        size_t start = bestHypCoord.i;
-        size_t j  = bestHypCoord.j;
+      NBestList nbest;
+      for(size_t k = 0; k < n; ++k) {
+        size_t i = best[k].i;
+        size_t j = best[k].j;
+        float cost = costs_[offsets_[i] + j];
 
         Words targetWords;
-        Ptr<Hypothesis> bestHyp = history_[start][j];
-        while(bestHyp->GetPrevHyp() != nullptr) {
-          targetWords.push_back(bestHyp->GetWord());
-          bestHyp = bestHyp->GetPrevHyp();
+        for(; i > 0; --i) {
+          size_t pos = offsets_[i] + j;
+          targetWords.push_back(words_[pos]);
+          j = backs_[pos];
         }
 
         std::reverse(targetWords.begin(), targetWords.end());
-        nbest.emplace_back(targetWords, history_[bestHypCoord.i][bestHypCoord.j]);
+        nbest.emplace_back(targetWords, cost);
       }
       return nbest;
     }
 
+    /**
+     * @brief Words every translation that can still win starts with, i.e. the
+     * common prefix of the live hypotheses  live  of the last step and the
+     * best finished hypothesis. The back-pointers of all of them are followed
+     * until they meet, usually a few steps back. The prefix only grows from
+     * step to step, since all later hypotheses descend from the live ones.
+     */
+    Words Stable(const Beam& live) const {
+      std::vector<size_t> js;
+      for(auto& hyp : live)
+        js.push_back(hyp.GetIndex());
+      size_t i = size() - 1;
+      bool finished = bestFinishedHyp_.i > 0;
+      if(js.empty()) {
+        if(!finished)
+          return Words();
+        i = bestFinishedHyp_.i;
+      }
+
+      for(; i > 0; --i) {
+        if(finished && i == bestFinishedHyp_.i)
+          js.push_back(bestFinishedHyp_.j);
+        std::sort(js.begin(), js.end());
+        js.erase(std::unique(js.begin(), js.end()), js.end());
+        if(js.size() == 1 && (!finished || i <= bestFinishedHyp_.i))
+          break;
+        for(auto& j : js)
+          j = backs_[offsets_[i] + j];
+      }
+
+      Words stable;
+      for(size_t j = i > 0 ? js[0] : 0; i > 0; --i) {
+        size_t pos = offsets_[i] + j;
+        if(words_[pos] != 0)
+          stable.push_back(words_[pos]);
+        j = backs_[pos];
+      }
+      std::reverse(stable.begin(), stable.end());
+      return stable;
+    }
+
     Result Top() const {
       return NBest(1)[0];
     }
 
+    /** @brief Best normalized cost of the hypotheses which ended in EOS so far */
+    float BestFinished() const {
+      return bestFinished_;
+    }
+
     size_t GetLineNum() const
     { return lineNo_; }
 
   private:
-    std::vector<Beam> history_;
-    std::priority_queue<HypothesisCoord> topHyps_;
+    std::vector<size_t> words_;
+    std::vector<size_t> backs_;
+    std::vector<float> costs_;
+    std::vector<size_t> offsets_;
+
+    std::vector<HypothesisCoord> topHyps_;
+    // step 0 while no hypothesis finished
+    HypothesisCoord bestFinishedHyp_{0, 0, 0};
+    float bestFinished_{std::numeric_limits<float>::lowest()};
     bool normalize_;
     size_t lineNo_;
 
@@ -5,26 +5,36 @@
 
 namespace marian {
 
+/**
+ * @brief A hypothesis of the beam search, stored by value. Instead of a
+ * pointer to its predecessor it keeps the predecessor's position in the
+ * previous step of its History, the History backtraces by index.
+ */
 class Hypothesis {
   public:
     Hypothesis()
-     : prevHyp_(nullptr),
+     : word_(0),
        prevIndex_(0),
-       word_(0),
+       back_(0),
+       index_(0),
        cost_(0.0)
     {}
 
-    Hypothesis(const Ptr<Hypothesis> prevHyp, size_t word, size_t prevIndex, float cost)
-      : prevHyp_(prevHyp),
+    /**
+     * @param word  the word extending the hypothesis
+     * @param prevIndex  row of the decoder state it extends
+     * @param back  position of its predecessor in the previous History step
+     * @param index  its own position in the current History step
+     * @param cost  accumulated cost
+     */
+    Hypothesis(size_t word, size_t prevIndex, size_t back, size_t index, float cost)
+      : word_(word),
         prevIndex_(prevIndex),
-        word_(word),
+        back_(back),
+        index_(index),
         cost_(cost)
     {}
 
-    const Ptr<Hypothesis> GetPrevHyp() const {
-      return prevHyp_;
-    }
-
     size_t GetWord() const {
       return word_;
     }
@@ -33,26 +43,30 @@ class Hypothesis {
       return prevIndex_;
     }
 
-    float GetCost() const {
-      return cost_;
+    size_t GetBackPointer() const {
+      return back_;
     }
 
-    std::vector<float>& GetCostBreakdown() {
-      return costBreakdown_;
+    size_t GetIndex() const {
+      return index_;
+    }
+
+    float GetCost() const {
+      return cost_;
     }
 
   private:
-    const Ptr<Hypothesis> prevHyp_;
-    const size_t prevIndex_;
-    const size_t word_;
-    const float cost_;
-    std::vector<float> costBreakdown_;
+    size_t word_;
+    size_t prevIndex_;
+    size_t back_;
+    size_t index_;
+    float cost_;
 };
 
-typedef std::vector<Ptr<Hypothesis>> Beam;
+typedef std::vector<Hypothesis> Beam;
 typedef std::vector<Beam> Beams;
 typedef std::vector<size_t> Words;
-typedef std::pair<Words, Ptr<Hypothesis>> Result;
+typedef std::pair<Words, float> Result;
 typedef std::vector<Result> NBestList;
 
 }
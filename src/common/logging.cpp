@@ -1,9 +1,35 @@
 #include "logging.h"
+#include "spdlog/async_logger.h"
 #include "training/config.h"
 
-std::shared_ptr<spdlog::logger> stderrLogger(const std::string& name,
-                                             const std::string& pattern,
-                                             const std::vector<std::string>& files) {
+#include <map>
+
+namespace {
+struct Channel {
+  std::string pattern;
+  std::vector<std::string> files;
+};
+
+// pattern and files of every logger, for syncLoggers()
+std::map<std::string, Channel>& channels() {
+  static std::map<std::string, Channel> channels;
+  return channels;
+}
+}
+
+// with queue 0 the logger writes synchronously
+static Logger createLogger(const std::string& name,
+                           const std::string& pattern,
+                           const std::vector<std::string>& files,
+                           size_t queue,
+                           bool discard) {
+  // every Config of a process, e.g. the trainings of marian-multi, logs
+  // through the loggers of the first one
+  if(auto existing = spdlog::get(name))
+    return existing;
+
+  channels()[name] = Channel{pattern, files};
+
   std::vector<spdlog::sink_ptr> sinks;
 
   auto stderr_sink = spdlog::sinks::stderr_sink_mt::instance();
@@ -14,13 +40,34 @@ std::shared_ptr<spdlog::logger> stderrLogger(const std::string& name,
     sinks.push_back(file_sink);
   }
 
-  auto logger = std::make_shared<spdlog::logger>(name, begin(sinks), end(sinks));
+  Logger logger;
+  if(queue > 0)
+    logger = std::make_shared<spdlog::async_logger>(
+      name, begin(sinks), end(sinks), queue,
+      discard ? spdlog::async_overflow_policy::discard_log_msg
+              : spdlog::async_overflow_policy::block_retry);
+  else
+    logger = std::make_shared<spdlog::logger>(name, begin(sinks), end(sinks));
 
   spdlog::register_logger(logger);
   logger->set_pattern(pattern);
   return logger;
 }
 
+std::shared_ptr<spdlog::logger> stderrLogger(const std::string& name,
+                                             const std::string& pattern,
+                                             const std::vector<std::string>& files) {
+  return createLogger(name, pattern, files, 0, false);
+}
+
+Logger asyncLogger(const std::string& name,
+                   const std::string& pattern,
+                   const std::vector<std::string>& files,
+                   size_t queue,
+                   bool discard) {
+  return createLogger(name, pattern, files, queue, discard);
+}
+
 void createLoggers(const marian::Config& options) {
 
   std::vector<std::string> generalLogs;
@@ -34,9 +81,34 @@ void createLoggers(const marian::Config& options) {
     validLogs.push_back(options.get<std::string>("valid-log"));
   }
 
-  Logger info{stderrLogger("info", "[%Y-%m-%d %T] %v", generalLogs)};
-  Logger config{stderrLogger("config", "[%Y-%m-%d %T] [config] %v", generalLogs)};
-  Logger memory{stderrLogger("memory", "[%Y-%m-%d %T] [memory] %v", generalLogs)};
-  Logger data{stderrLogger("data", "[%Y-%m-%d %T] [data] %v", generalLogs)};
-  Logger valid{stderrLogger("valid", "[%Y-%m-%d %T] [valid] %v", validLogs)};
+  // channels written by workers mid-step drop messages when their queue is
+  // full, configuration and validation results are never dropped
+  size_t queue = options.get<size_t>("log-queue");
+  UTIL_THROW_IF2(queue & (queue - 1), "--log-queue must be a power of 2 or 0");
+
+  Logger info{createLogger("info", "[%Y-%m-%d %T] %v", generalLogs, queue, true)};
+  Logger config{createLogger("config", "[%Y-%m-%d %T] [config] %v", generalLogs, queue, false)};
+  Logger memory{createLogger("memory", "[%Y-%m-%d %T] [memory] %v", generalLogs, queue, true)};
+  Logger data{createLogger("data", "[%Y-%m-%d %T] [data] %v", generalLogs, queue, true)};
+  Logger valid{createLogger("valid", "[%Y-%m-%d %T] [valid] %v", validLogs, queue, false)};
+}
+
+void syncLoggers() {
+  for(auto& channel : channels()) {
+    // destroying an async logger joins its writer thread, which does not
+    // exist in a forked child, the old loggers are never released
+    if(auto old = spdlog::get(channel.first))
+      new Logger(old);
+    spdlog::drop(channel.first);
+
+    // the sinks of the parent may be locked by a thread it had at the fork
+    std::vector<spdlog::sink_ptr> sinks;
+    sinks.push_back(std::make_shared<spdlog::sinks::stderr_sink_mt>());
+    for(auto&& file : channel.second.files)
+      sinks.push_back(std::make_shared<spdlog::sinks::simple_file_sink_st>(file, true));
+
+    auto logger = std::make_shared<spdlog::logger>(channel.first, begin(sinks), end(sinks));
+    spdlog::register_logger(logger);
+    logger->set_pattern(channel.second.pattern);
+  }
 }
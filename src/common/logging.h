@@ -8,10 +8,25 @@ typedef std::shared_ptr<spdlog::logger> Logger;
 Logger stderrLogger(const std::string&, const std::string&,
                     const std::vector<std::string>& = {});
 
+/**
+ * @brief Like stderrLogger(), but a thread of the logger writes the messages,
+ * queued up to  queue  of them, a power of 2. With  discard  messages are
+ * dropped while the queue is full instead of blocking the caller.
+ */
+Logger asyncLogger(const std::string&, const std::string&,
+                   const std::vector<std::string>&, size_t queue, bool discard);
+
 namespace marian {
   class Config;
 }
 
 void createLoggers(const marian::Config& options);
 
+/**
+ * @brief Replaces all loggers by synchronous ones writing to the same sinks.
+ * Call right after fork() in a child, which does not inherit the writer
+ * threads of asynchronous loggers.
+ */
+void syncLoggers();
+
 
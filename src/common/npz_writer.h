@@ -0,0 +1,117 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "3rd_party/cnpy/cnpy.h"
+#include "3rd_party/exception.h"
+
+namespace marian {
+
+/**
+ * @brief Writes arrays into an uncompressed npz archive in a single pass.
+ *
+ * cnpy::npz_save(..., "a") reopens the archive and rewrites its central
+ * directory for every array, which makes saving a model quadratic in the
+ * number of parameters. Here every array is streamed once and the central
+ * directory is written by close(). The archives are the same as cnpy's.
+ */
+class NpzWriter {
+  private:
+    std::string path_;
+    FILE* file_;
+    std::vector<char> directory_;
+    unsigned short records_{0};
+    unsigned int offset_{0};
+
+  public:
+    NpzWriter(const std::string& path)
+     : path_(path), file_(std::fopen(path.c_str(), "wb")) {
+      UTIL_THROW_IF2(!file_, "Could not create " << path);
+    }
+
+    ~NpzWriter() {
+      if(file_)
+        std::fclose(file_);
+    }
+
+    NpzWriter(const NpzWriter&) = delete;
+
+    /** @brief Appends the array  name  of the given shape */
+    template <typename T>
+    void add(const std::string& name,
+             const T* data,
+             const unsigned int* shape,
+             unsigned int ndims) {
+      using cnpy::operator+=;
+      std::string fname = name + ".npy";
+      std::vector<char> npyHeader = cnpy::create_npy_header(data, shape, ndims);
+
+      unsigned long elements = 1;
+      for(unsigned int i = 0; i < ndims; ++i)
+        elements *= shape[i];
+      unsigned int bytes = elements * sizeof(T) + npyHeader.size();
+
+      unsigned int crc = crc32(0L, (unsigned char*)npyHeader.data(), npyHeader.size());
+      crc = crc32(crc, (unsigned char*)data, elements * sizeof(T));
+
+      std::vector<char> local;
+      local += "PK";
+      local += (unsigned short)0x0403;
+      local += (unsigned short)20;
+      local += (unsigned short)0;
+      local += (unsigned short)0;
+      local += (unsigned short)0;
+      local += (unsigned short)0;
+      local += (unsigned int)crc;
+      local += (unsigned int)bytes;
+      local += (unsigned int)bytes;
+      local += (unsigned short)fname.size();
+      local += (unsigned short)0;
+      local += fname;
+
+      directory_ += "PK";
+      directory_ += (unsigned short)0x0201;
+      directory_ += (unsigned short)20;
+      directory_.insert(directory_.end(), local.begin() + 4, local.begin() + 30);
+      directory_ += (unsigned short)0;
+      directory_ += (unsigned short)0;
+      directory_ += (unsigned short)0;
+      directory_ += (unsigned int)0;
+      directory_ += (unsigned int)offset_;
+      directory_ += fname;
+
+      std::fwrite(local.data(), 1, local.size(), file_);
+      std::fwrite(npyHeader.data(), 1, npyHeader.size(), file_);
+      std::fwrite(data, sizeof(T), elements, file_);
+      UTIL_THROW_IF2(std::ferror(file_), "Error writing " << path_);
+
+      offset_ += local.size() + bytes;
+      records_++;
+    }
+
+    /** @brief Writes the central directory and closes the archive */
+    void close() {
+      using cnpy::operator+=;
+      std::vector<char> footer;
+      footer += "PK";
+      footer += (unsigned short)0x0605;
+      footer += (unsigned short)0;
+      footer += (unsigned short)0;
+      footer += (unsigned short)records_;
+      footer += (unsigned short)records_;
+      footer += (unsigned int)directory_.size();
+      footer += (unsigned int)offset_;
+      footer += (unsigned short)0;
+
+      std::fwrite(directory_.data(), 1, directory_.size(), file_);
+      std::fwrite(footer.data(), 1, footer.size(), file_);
+      bool failed = std::ferror(file_) != 0;
+      failed = std::fclose(file_) != 0 || failed;
+      file_ = nullptr;
+      UTIL_THROW_IF2(failed, "Error writing " << path_);
+    }
+};
+
+}
@@ -0,0 +1,146 @@
+#include "common/numa.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#include <unistd.h>
+#include <cuda_runtime.h>
+
+#include "common/logging.h"
+
+namespace marian {
+namespace numa {
+
+namespace {
+
+std::atomic<bool> enabled_{false};
+
+// node the calling thread is bound to, -1 if it is not
+int& boundNode() {
+  thread_local int node = -1;
+  return node;
+}
+
+/** @brief CPUs of  node  from a sysfs list like "0-23,48-71" */
+bool nodeCpus(int node, cpu_set_t& cpus) {
+  std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+  std::string list;
+  if(!(in >> list))
+    return false;
+
+  CPU_ZERO(&cpus);
+  std::stringstream ranges(list);
+  std::string range;
+  bool any = false;
+  while(std::getline(ranges, range, ',')) {
+    size_t dash = range.find('-');
+    int first = std::stoi(range.substr(0, dash));
+    int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+    for(int cpu = first; cpu <= last && cpu < CPU_SETSIZE; ++cpu) {
+      CPU_SET(cpu, &cpus);
+      any = true;
+    }
+  }
+  return any;
+}
+
+int detect(size_t device) {
+  char busId[32];
+  if(cudaDeviceGetPCIBusId(busId, sizeof(busId), device) != cudaSuccess)
+    return -1;
+  std::string id = busId;
+  std::transform(id.begin(), id.end(), id.begin(), ::tolower);
+
+  std::ifstream in("/sys/bus/pci/devices/" + id + "/numa_node");
+  int node = -1;
+  if(!(in >> node))
+    return -1;
+  return node;
+}
+
+/** @brief Binds the calling thread to  node , false if that is not possible */
+bool bind(int node) {
+  cpu_set_t cpus;
+  if(node < 0 || !nodeCpus(node, cpus))
+    return false;
+  if(pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+    return false;
+  boundNode() = node;
+  return true;
+}
+
+}
+
+void enable(bool enabled) {
+  enabled_ = enabled;
+}
+
+bool enabled() {
+  return enabled_;
+}
+
+int node(size_t device) {
+  static std::mutex mutex;
+  static std::map<size_t, int> nodes;
+
+  std::lock_guard<std::mutex> guard(mutex);
+  auto it = nodes.find(device);
+  if(it != nodes.end())
+    return it->second;
+
+  int found = detect(device);
+  nodes[device] = found;
+  if(enabled_)
+    LOG(info, "Device {} is on NUMA node {}", device, found);
+  return found;
+}
+
+void bindThread(size_t device) {
+  if(!enabled_)
+    return;
+  int n = node(device);
+  if(n < 0 || n == boundNode())
+    return;
+  bind(n);
+}
+
+bool bindCores(size_t first, size_t count) {
+  long online = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t cpuCount = std::min((size_t)CPU_SETSIZE, (size_t)std::max(1L, online));
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  for(size_t i = 0; i < std::max((size_t)1, count); ++i)
+    CPU_SET((first + i) % cpuCount, &cpus);
+  if(pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+    return false;
+  boundNode() = -1;
+  return true;
+}
+
+DeviceScope::DeviceScope(size_t device) : node_(boundNode()) {
+  if(!enabled_)
+    return;
+  int n = node(device);
+  if(n < 0 || n == node_)
+    return;
+  if(pthread_getaffinity_np(pthread_self(), sizeof(saved_), &saved_) != 0)
+    return;
+  bound_ = bind(n);
+}
+
+DeviceScope::~DeviceScope() {
+  if(!bound_)
+    return;
+  pthread_setaffinity_np(pthread_self(), sizeof(saved_), &saved_);
+  boundNode() = node_;
+}
+
+}
+}
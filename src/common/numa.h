@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <sched.h>
+
+namespace marian {
+
+/**
+ * @brief Placement of host threads and memory next to the GPUs they serve.
+ *
+ * The NUMA node of a device is read from sysfs through its PCI bus id. With
+ * --numa, bindThread() restricts the calling thread to the CPUs of that node,
+ * and memory the thread touches first, e.g. pinned staging buffers, is then
+ * allocated on the node by the kernel's default policy. Without --numa, or
+ * where the topology is unknown, all functions leave threads where they are.
+ */
+namespace numa {
+
+void enable(bool enabled);
+
+bool enabled();
+
+/** @brief NUMA node of  device , -1 if unknown, detected once per device */
+int node(size_t device);
+
+/** @brief Binds the calling thread to the CPUs of the node of  device , cheap if bound already */
+void bindThread(size_t device);
+
+/**
+ * @brief Binds the calling thread to the  count  CPUs from  first  on, modulo
+ * the CPUs online, e.g. a CPU decoder thread and the helpers it creates later.
+ * Works without --numa, false if the CPUs cannot be set.
+ */
+bool bindCores(size_t first, size_t count);
+
+/**
+ * @brief Binds the calling thread to the node of  device  while it lives and
+ * restores its previous CPUs afterwards, e.g. around an allocation on a
+ * thread that serves several devices
+ */
+class DeviceScope {
+  private:
+    cpu_set_t saved_;
+    int node_;
+    bool bound_{false};
+
+  public:
+    explicit DeviceScope(size_t device);
+    ~DeviceScope();
+
+    DeviceScope(const DeviceScope&) = delete;
+    DeviceScope& operator=(const DeviceScope&) = delete;
+};
+
+}
+
+}
@@ -0,0 +1,355 @@
+#include "common/read_ahead.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <boost/filesystem.hpp>
+
+#ifdef CURL_FOUND
+#include <curl/curl.h>
+#endif
+
+#include "3rd_party/exception.h"
+#include "common/logging.h"
+
+namespace marian {
+namespace io {
+
+namespace {
+
+std::atomic<size_t> readAhead_{32 << 20};
+
+bool startsWith(const std::string& s, const std::string& prefix) {
+  return s.compare(0, prefix.size(), prefix) == 0;
+}
+
+class LocalSource : public Source {
+  private:
+    std::string path_;
+    int fd_;
+    size_t size_;
+
+  public:
+    LocalSource(const std::string& path) : path_(path) {
+      fd_ = ::open(path.c_str(), O_RDONLY);
+      UTIL_THROW_IF2(fd_ < 0, "File " << path << " does not exist");
+      struct stat st;
+      UTIL_THROW_IF2(fstat(fd_, &st) != 0, "Cannot stat " << path);
+      size_ = st.st_size;
+    }
+
+    ~LocalSource() {
+      ::close(fd_);
+    }
+
+    size_t size() {
+      return size_;
+    }
+
+    size_t read(char* buffer, size_t offset, size_t length) {
+      size_t done = 0;
+      while(done < length) {
+        ssize_t got = pread(fd_, buffer + done, length - done, offset + done);
+        UTIL_THROW_IF2(got < 0, "Error reading " << path_);
+        if(got == 0)
+          break;
+        done += got;
+      }
+      return done;
+    }
+};
+
+#ifdef CURL_FOUND
+
+/**
+ * Range requests against an HTTP(S) URL, a handle per request so any thread
+ * can read. Failed requests are retried a few times before throwing.
+ */
+class HttpSource : public Source {
+  private:
+    std::string url_;
+    size_t size_;
+
+    static const int RETRIES = 3;
+
+    struct Sink {
+      char* buffer;
+      size_t length;
+      size_t filled;
+    };
+
+    static size_t write(char* data, size_t size, size_t count, void* user) {
+      Sink* sink = (Sink*)user;
+      size_t bytes = size * count;
+      size_t take = std::min(bytes, sink->length - sink->filled);
+      std::memcpy(sink->buffer + sink->filled, data, take);
+      sink->filled += take;
+      return bytes;
+    }
+
+    static size_t discard(char*, size_t size, size_t count, void*) {
+      return size * count;
+    }
+
+    CURL* handle() {
+      static std::once_flag init;
+      std::call_once(init, []() { curl_global_init(CURL_GLOBAL_DEFAULT); });
+
+      CURL* curl = curl_easy_init();
+      UTIL_THROW_IF2(!curl, "Cannot create a request for " << url_);
+      curl_easy_setopt(curl, CURLOPT_URL, url_.c_str());
+      curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+      curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+      curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 30L);
+      return curl;
+    }
+
+  public:
+    HttpSource(const std::string& url) : url_(url) {
+      double length = -1;
+      long status = 0;
+      CURLcode code = CURLE_OK;
+      for(int attempt = 0; attempt < RETRIES; ++attempt) {
+        CURL* curl = handle();
+        curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, discard);
+        code = curl_easy_perform(curl);
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+        curl_easy_getinfo(curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &length);
+        curl_easy_cleanup(curl);
+        if(code == CURLE_OK && status < 500)
+          break;
+      }
+      UTIL_THROW_IF2(code != CURLE_OK,
+                     "Cannot reach " << url << ": " << curl_easy_strerror(code));
+      UTIL_THROW_IF2(status >= 400, "File " << url << " does not exist (HTTP " << status << ")");
+      UTIL_THROW_IF2(length < 0, "Size of " << url << " is unknown");
+      size_ = (size_t)length;
+    }
+
+    size_t size() {
+      return size_;
+    }
+
+    size_t read(char* buffer, size_t offset, size_t length) {
+      length = std::min(length, size_ - std::min(offset, size_));
+      if(length == 0)
+        return 0;
+
+      std::stringstream range;
+      range << offset << "-" << offset + length - 1;
+      std::string bytes = range.str();
+
+      for(int attempt = 0; ; ++attempt) {
+        Sink sink{buffer, length, 0};
+        CURL* curl = handle();
+        curl_easy_setopt(curl, CURLOPT_RANGE, bytes.c_str());
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write);
+        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &sink);
+        CURLcode code = curl_easy_perform(curl);
+        long status = 0;
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+        curl_easy_cleanup(curl);
+
+        // a server ignoring the range sends the file from its start
+        bool ranged = status == 206 || (status == 200 && offset == 0);
+        if(code == CURLE_OK && ranged && sink.filled == length)
+          return length;
+        UTIL_THROW_IF2(attempt + 1 >= RETRIES,
+                       "Reading bytes " << bytes << " of " << url_ << " failed: "
+                       << (code != CURLE_OK ? curl_easy_strerror(code) : "HTTP status")
+                       << " " << status);
+        std::this_thread::sleep_for(std::chrono::milliseconds(200 << attempt));
+      }
+    }
+};
+
+#endif
+
+std::string url(const std::string& path) {
+  if(!startsWith(path, "s3://"))
+    return path;
+  const char* endpoint = std::getenv("MARIAN_S3_ENDPOINT");
+  std::string base = endpoint ? endpoint : "https://s3.amazonaws.com";
+  if(!base.empty() && base.back() == '/')
+    base.pop_back();
+  return base + "/" + path.substr(5);
+}
+
+}
+
+bool isRemote(const std::string& path) {
+  return startsWith(path, "http://") || startsWith(path, "https://")
+         || startsWith(path, "s3://");
+}
+
+Ptr<Source> open(const std::string& path) {
+  if(!isRemote(path))
+    return New<LocalSource>(path);
+#ifdef CURL_FOUND
+  return New<HttpSource>(url(path));
+#else
+  UTIL_THROW2("Cannot read " << path << ", compiled without libcurl");
+#endif
+}
+
+std::string fetch(const std::string& path) {
+  if(!isRemote(path))
+    return path;
+
+  static std::mutex mutex;
+  static std::map<std::string, std::string> fetched;
+  std::lock_guard<std::mutex> guard(mutex);
+  auto it = fetched.find(path);
+  if(it != fetched.end())
+    return it->second;
+
+  namespace fs = boost::filesystem;
+  auto source = open(path);
+  std::stringstream name;
+  name << "marian-" << std::hex << std::hash<std::string>()(path) << "-"
+       << fs::path(path).filename().string();
+  std::string local = (fs::temp_directory_path() / name.str()).string();
+
+  boost::system::error_code ec;
+  if(!fs::exists(local, ec) || fs::file_size(local, ec) != source->size()) {
+    LOG(info, "Fetching {} to {}", path, local);
+    std::string part = local + ".part";
+    int fd = ::open(part.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    UTIL_THROW_IF2(fd < 0, "Cannot write " << part);
+
+    // ranges of 64MB with 8 in flight
+    const size_t range = 64 << 20;
+    size_t total = source->size();
+    std::exception_ptr error;
+    {
+      ThreadPool pool(8);
+      std::vector<std::future<void>> done;
+      for(size_t offset = 0; offset < total; offset += range) {
+        done.push_back(pool.enqueue([&source, fd, offset, range, total, &part]() {
+          std::vector<char> buffer(std::min(range, total - offset));
+          size_t got = source->read(buffer.data(), offset, buffer.size());
+          UTIL_THROW_IF2(got != buffer.size(), "Short read at " << offset);
+          UTIL_THROW_IF2(pwrite(fd, buffer.data(), got, offset) != (ssize_t)got,
+                         "Cannot write " << part);
+        }));
+      }
+      for(auto& d : done) {
+        try {
+          d.get();
+        }
+        catch(...) {
+          error = std::current_exception();
+        }
+      }
+    }
+    ::close(fd);
+    if(error)
+      std::rethrow_exception(error);
+    fs::rename(part, local);
+  }
+
+  fetched[path] = local;
+  return local;
+}
+
+void setReadAhead(size_t mb) {
+  readAhead_ = std::max((size_t)1, mb) << 20;
+}
+
+ReadAheadBuffer::ReadAheadBuffer(Ptr<Source> source,
+                                 size_t blockSize,
+                                 size_t requests)
+ : source_(source),
+   size_(source->size()),
+   blockSize_(blockSize),
+   blocks_(std::max((size_t)1, readAhead_ / blockSize)),
+   pool_(requests) {
+  request();
+}
+
+void ReadAheadBuffer::request() {
+  while(window_.size() < blocks_ && next_ < size_) {
+    size_t offset = next_;
+    size_t length = std::min(blockSize_, size_ - next_);
+    next_ += length;
+    auto source = source_;
+    window_.push_back(pool_.enqueue([source, offset, length]() {
+      std::string block(length, 0);
+      size_t got = source->read(&block[0], offset, length);
+      block.resize(got);
+      return block;
+    }));
+  }
+}
+
+void ReadAheadBuffer::restart(size_t position) {
+  // blocks in flight finish on the pool and are dropped
+  window_.clear();
+  current_.clear();
+  setg(nullptr, nullptr, nullptr);
+  start_ = position;
+  next_ = position;
+  request();
+}
+
+ReadAheadBuffer::int_type ReadAheadBuffer::underflow() {
+  if(gptr() < egptr())
+    return traits_type::to_int_type(*gptr());
+
+  start_ += current_.size();
+  current_.clear();
+  setg(nullptr, nullptr, nullptr);
+  if(window_.empty())
+    return traits_type::eof();
+
+  current_ = window_.front().get();
+  window_.pop_front();
+  request();
+  if(current_.empty())
+    return traits_type::eof();
+
+  setg(&current_[0], &current_[0], &current_[0] + current_.size());
+  return traits_type::to_int_type(*gptr());
+}
+
+ReadAheadBuffer::pos_type ReadAheadBuffer::seekoff(off_type off,
+                                                   std::ios_base::seekdir dir,
+                                                   std::ios_base::openmode which) {
+  size_t current = start_ + (gptr() - eback());
+  if(dir == std::ios_base::cur) {
+    if(off == 0)
+      return pos_type(current);
+    return seekpos(pos_type(current + off), which);
+  }
+  if(dir == std::ios_base::end)
+    return seekpos(pos_type(size_ + off), which);
+  return seekpos(pos_type(off), which);
+}
+
+ReadAheadBuffer::pos_type ReadAheadBuffer::seekpos(pos_type pos,
+                                                   std::ios_base::openmode which) {
+  if(!(which & std::ios_base::in) || pos < 0 || (size_t)pos > size_)
+    return pos_type(off_type(-1));
+
+  size_t position = pos;
+  if(!current_.empty() && position >= start_ && position < start_ + current_.size())
+    setg(&current_[0], &current_[0] + (position - start_), &current_[0] + current_.size());
+  else
+    restart(position);
+  return pos;
+}
+
+}
+}
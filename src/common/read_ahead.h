@@ -0,0 +1,95 @@
+#pragma once
+
+#include <deque>
+#include <future>
+#include <streambuf>
+#include <string>
+
+#include "common/definitions.h"
+#include "common/thread_pool.h"
+
+namespace marian {
+
+/**
+ * @brief Input from local files, network filesystems and object stores.
+ *
+ * A Source reads byte ranges of a file from any thread. Local paths are read
+ * with pread, http://, https:// and s3:// URLs by HTTP range requests when
+ * built with libcurl. s3://bucket/key is requested path-style and unsigned
+ * from $MARIAN_S3_ENDPOINT, https://s3.amazonaws.com by default, i.e. from
+ * public buckets or an endpoint that authorizes by itself.
+ */
+namespace io {
+
+class Source {
+  public:
+    virtual ~Source() {}
+
+    virtual size_t size() = 0;
+
+    /** @brief Reads up to  length  bytes at  offset  into  buffer , returns how many */
+    virtual size_t read(char* buffer, size_t offset, size_t length) = 0;
+};
+
+/** @brief Whether  path  is a URL rather than a local path */
+bool isRemote(const std::string& path);
+
+/** @brief Source of the local file or URL  path , throws if it cannot be read */
+Ptr<Source> open(const std::string& path);
+
+/**
+ * @brief A local path with the contents of  path , for readers that map their
+ * files, e.g. binary corpora and models. A URL is downloaded once per process
+ * by parallel range requests into the temporary directory and reused by later
+ * runs while its size matches.
+ */
+std::string fetch(const std::string& path);
+
+/** @brief Sets the bytes read ahead of every ReadAheadBuffer created later, in MB */
+void setReadAhead(size_t mb);
+
+/**
+ * @brief Stream buffer that reads a Source sequentially with several range
+ * requests in flight.
+ *
+ * Blocks of  blockSize  bytes are requested on a pool of  requests  threads,
+ * up to the read-ahead ahead of the reading position, so the latency of the
+ * storage is hidden behind the consumer. Seeking restarts the read-ahead at
+ * the new position unless it stays within the current block.
+ */
+class ReadAheadBuffer : public std::streambuf {
+  private:
+    Ptr<Source> source_;
+    size_t size_;
+    size_t blockSize_;
+    size_t blocks_;
+
+    // file offset of the next block to request and of the current block
+    size_t next_{0};
+    size_t start_{0};
+    std::string current_;
+    std::deque<std::future<std::string>> window_;
+
+    // destroyed first, finishes the requests in flight
+    ThreadPool pool_;
+
+    void request();
+    void restart(size_t position);
+
+  protected:
+    int_type underflow();
+
+    pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                     std::ios_base::openmode which);
+
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which);
+
+  public:
+    ReadAheadBuffer(Ptr<Source> source,
+                    size_t blockSize = 4 << 20,
+                    size_t requests = 4);
+};
+
+}
+
+}
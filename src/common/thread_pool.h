@@ -0,0 +1,279 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace marian {
+
+/**
+ * @brief Move-only callable without arguments. Callables of up to 64 bytes,
+ * e.g. a std::packaged_task, are stored in place, larger ones on the heap.
+ */
+class Task {
+  private:
+    static const size_t INLINE = 64;
+    typedef typename std::aligned_storage<INLINE, alignof(std::max_align_t)>::type Storage;
+
+    struct Ops {
+      void (*invoke)(void*);
+      void (*move)(void* from, void* to);
+      void (*destroy)(void*);
+    };
+
+    template <class F>
+    static const Ops* inlineOps() {
+      static const Ops ops = {
+        [](void* f) { (*(F*)f)(); },
+        [](void* from, void* to) { new(to) F(std::move(*(F*)from)); ((F*)from)->~F(); },
+        [](void* f) { ((F*)f)->~F(); }
+      };
+      return &ops;
+    }
+
+    template <class F>
+    static const Ops* heapOps() {
+      static const Ops ops = {
+        [](void* f) { (**(F**)f)(); },
+        [](void* from, void* to) { *(F**)to = *(F**)from; },
+        [](void* f) { delete *(F**)f; }
+      };
+      return &ops;
+    }
+
+    Storage storage_;
+    const Ops* ops_{nullptr};
+
+  public:
+    Task() {}
+
+    template <class F, class = typename std::enable_if<
+                         !std::is_same<typename std::decay<F>::type, Task>::value>::type>
+    Task(F&& f) {
+      typedef typename std::decay<F>::type T;
+      if(sizeof(T) <= INLINE && alignof(T) <= alignof(Storage)
+         && std::is_nothrow_move_constructible<T>::value) {
+        new(&storage_) T(std::forward<F>(f));
+        ops_ = inlineOps<T>();
+      }
+      else {
+        *(T**)&storage_ = new T(std::forward<F>(f));
+        ops_ = heapOps<T>();
+      }
+    }
+
+    Task(Task&& other) : ops_(other.ops_) {
+      if(ops_)
+        ops_->move(&other.storage_, &storage_);
+      other.ops_ = nullptr;
+    }
+
+    Task& operator=(Task&& other) {
+      if(this != &other) {
+        if(ops_)
+          ops_->destroy(&storage_);
+        ops_ = other.ops_;
+        if(ops_)
+          ops_->move(&other.storage_, &storage_);
+        other.ops_ = nullptr;
+      }
+      return *this;
+    }
+
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+
+    ~Task() {
+      if(ops_)
+        ops_->destroy(&storage_);
+    }
+
+    explicit operator bool() const {
+      return ops_ != nullptr;
+    }
+
+    void operator()() {
+      ops_->invoke(&storage_);
+    }
+};
+
+/**
+ * @brief Work-stealing thread pool, every worker has its own task queue.
+ *
+ * Tasks enqueued by a worker of the pool go to its own queue, tasks from
+ * other threads to the queue of enqueueAt()'s  hint  or round-robin. Workers
+ * take the oldest task of their own queue and, when it is empty, steal the
+ * oldest task of another one, so queues only contend when they run dry. With
+ * a single worker tasks run in the order they were enqueued.
+ *
+ * With a  bound , enqueue() blocks while about that many tasks wait to be
+ * started. A task costs one allocation, the state of its std::future, the
+ * callable is stored in place in the queue. The destructor runs all tasks
+ * enqueued so far and joins the workers.
+ */
+class ThreadPool {
+  private:
+    struct Queue {
+      std::mutex mutex;
+      std::deque<Task> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> workers_;
+    size_t bound_;
+
+    // tasks enqueued and not yet started
+    std::atomic<size_t> pending_{0};
+    std::atomic<size_t> next_{0};
+
+    // sleeping workers and blocked producers, only they take mutex_
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable space_;
+    std::atomic<size_t> sleeping_{0};
+    std::atomic<size_t> blocked_{0};
+    std::atomic<bool> stop_{false};
+
+    /** @brief The pool and worker index of the calling thread, nullptr outside of pools */
+    static std::pair<ThreadPool*, size_t>& current() {
+      thread_local std::pair<ThreadPool*, size_t> worker{nullptr, 0};
+      return worker;
+    }
+
+    bool take(size_t queue, Task& task) {
+      Queue& q = *queues_[queue];
+      std::lock_guard<std::mutex> lock(q.mutex);
+      if(q.tasks.empty())
+        return false;
+      task = std::move(q.tasks.front());
+      q.tasks.pop_front();
+      return true;
+    }
+
+    /** @brief A task of the worker's own queue or, failing that, a stolen one */
+    bool next(size_t worker, Task& task) {
+      size_t n = queues_.size();
+      for(size_t i = 0; i < n; ++i)
+        if(take((worker + i) % n, task))
+          return true;
+      return false;
+    }
+
+    void started() {
+      pending_--;
+      if(blocked_ > 0) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        space_.notify_all();
+      }
+    }
+
+    void run(size_t worker) {
+      current() = {this, worker};
+      for(;;) {
+        Task task;
+        if(next(worker, task)) {
+          started();
+          task();
+          continue;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        sleeping_++;
+        wake_.wait(lock, [this]() { return stop_ || pending_ > 0; });
+        sleeping_--;
+        if(stop_ && pending_ == 0)
+          return;
+      }
+    }
+
+    void push(size_t queue, Task task) {
+      if(bound_ > 0 && pending_ >= bound_) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        blocked_++;
+        space_.wait(lock, [this]() { return pending_ < bound_ || stop_; });
+        blocked_--;
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(queues_[queue]->mutex);
+        queues_[queue]->tasks.push_back(std::move(task));
+      }
+      pending_++;
+      if(sleeping_ > 0) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        wake_.notify_one();
+      }
+    }
+
+  public:
+    /** @brief  threads  workers,  bound  on waiting tasks or 0 for unbounded */
+    explicit ThreadPool(size_t threads, size_t bound = 0)
+     : bound_(bound) {
+      threads = std::max(threads, (size_t)1);
+      for(size_t i = 0; i < threads; ++i)
+        queues_.emplace_back(new Queue());
+      for(size_t i = 0; i < threads; ++i)
+        workers_.emplace_back([this, i]() { run(i); });
+    }
+
+    ~ThreadPool() {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+      }
+      wake_.notify_all();
+      space_.notify_all();
+      for(auto& worker : workers_)
+        worker.join();
+    }
+
+    size_t size() const {
+      return workers_.size();
+    }
+
+    /** @brief Tasks waiting to be started */
+    size_t getNumTasks() const {
+      return pending_;
+    }
+
+    /**
+     * @brief Runs  f(args...)  on a worker preferably  hint  modulo the number
+     * of workers, e.g. a device index, other workers take it only when idle.
+     * Arguments are copied or moved like by std::bind.
+     */
+    template <class F, class... Args>
+    auto enqueueAt(size_t hint, F&& f, Args&&... args)
+        -> std::future<typename std::result_of<F(Args...)>::type> {
+      typedef typename std::result_of<F(Args...)>::type Result;
+
+      std::packaged_task<Result()> task(std::bind(std::forward<F>(f),
+                                                  std::forward<Args>(args)...));
+      auto result = task.get_future();
+      if(stop_)
+        throw std::runtime_error("enqueue on stopped ThreadPool");
+      push(hint % queues_.size(), Task(std::move(task)));
+      return result;
+    }
+
+    /** @brief Runs  f(args...)  on the calling worker's queue or the next one round-robin */
+    template <class F, class... Args>
+    auto enqueue(F&& f, Args&&... args)
+        -> std::future<typename std::result_of<F(Args...)>::type> {
+      auto& worker = current();
+      size_t queue = worker.first == this ? worker.second : next_++;
+      return enqueueAt(queue, std::forward<F>(f), std::forward<Args>(args)...);
+    }
+};
+
+}
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifdef NVTX_FOUND
+#include <nvToolsExt.h>
+#endif
+
+#include "common/logging.h"
+
+namespace marian {
+
+/**
+ * @brief Records the phases of the training loop, see TraceRange, and writes
+ * them as a Chrome trace (chrome://tracing or Perfetto).
+ *
+ * Recording is off until enable() is called, a disabled range costs a load.
+ * Every event carries the thread it ran on, one row per thread in the trace,
+ * and the device and batch of the thread's current context, see context().
+ * Recording stops after  limit  events. Built with NVTX, every range is also
+ * an NVTX range for Nsight Systems, whether recording or not.
+ */
+class Tracer {
+  private:
+    struct Event {
+      const char* name;
+      uint32_t thread;
+      int device;
+      int64_t batch;
+      double start;
+      double duration;
+    };
+
+    typedef std::chrono::steady_clock clock;
+
+    std::mutex mutex_;
+    std::vector<Event> events_;
+    std::string file_;
+    size_t limit_{0};
+    std::atomic<bool> enabled_{false};
+    clock::time_point epoch_{clock::now()};
+
+    struct Context {
+      int device{-1};
+      int64_t batch{-1};
+    };
+
+    static Context& current() {
+      thread_local Context context;
+      return context;
+    }
+
+    static uint32_t thread() {
+      static std::atomic<uint32_t> next{0};
+      thread_local uint32_t id = next++;
+      return id;
+    }
+
+  public:
+    static Tracer& get() {
+      static Tracer tracer;
+      return tracer;
+    }
+
+    /** @brief Starts recording, the trace is written to  file  by write() */
+    void enable(const std::string& file, size_t limit = 1 << 22) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      file_ = file;
+      limit_ = limit;
+      events_.reserve(std::min(limit, (size_t)1 << 16));
+      enabled_ = true;
+    }
+
+    bool enabled() const {
+      return enabled_;
+    }
+
+    /** @brief Microseconds since the tracer was created */
+    double now() const {
+      return std::chrono::duration<double, std::micro>(clock::now() - epoch_).count();
+    }
+
+    /** @brief Device and batch of the later ranges of the calling thread, -1 for none */
+    static void context(int device, int64_t batch = -1) {
+      current().device = device;
+      current().batch = batch;
+    }
+
+    void record(const char* name, double start) {
+      double end = now();
+      std::lock_guard<std::mutex> lock(mutex_);
+      if(events_.size() >= limit_)
+        return;
+      events_.push_back({name, thread(), current().device, current().batch,
+                         start, end - start});
+    }
+
+    /** @brief Writes all events recorded so far, once */
+    void write() {
+      if(!enabled_)
+        return;
+      enabled_ = false;
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      std::ofstream out(file_);
+      UTIL_THROW_IF2(!out, "Could not open trace file " << file_);
+      out << "{\"traceEvents\":[\n";
+      for(size_t i = 0; i < events_.size(); ++i) {
+        auto& e = events_[i];
+        out << "{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"ts\":" << e.start
+            << ",\"dur\":" << e.duration << ",\"pid\":0,\"tid\":" << e.thread
+            << ",\"args\":{\"device\":" << e.device << ",\"batch\":" << e.batch << "}}"
+            << (i + 1 < events_.size() ? ",\n" : "\n");
+      }
+      out << "]}\n";
+      LOG(info, "Wrote {} trace events to {}", events_.size(), file_);
+      events_.clear();
+    }
+};
+
+/**
+ * @brief Times the enclosing scope as the phase  name , a string literal,
+ * see Tracer
+ */
+class TraceRange {
+  private:
+    const char* name_;
+    double start_{-1};
+
+  public:
+    TraceRange(const char* name) : name_(name) {
+#ifdef NVTX_FOUND
+      nvtxRangePushA(name);
+#endif
+      if(Tracer::get().enabled())
+        start_ = Tracer::get().now();
+    }
+
+    ~TraceRange() {
+#ifdef NVTX_FOUND
+      nvtxRangePop();
+#endif
+      if(start_ >= 0 && Tracer::get().enabled())
+        Tracer::get().record(name_, start_);
+    }
+};
+
+}
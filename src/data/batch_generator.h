@@ -1,17 +1,48 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <deque>
-#include <queue>
+#include <iomanip>
+#include <numeric>
+#include <sstream>
+#include <thread>
 
 #include <boost/timer/timer.hpp>
 
+#include "common/bounded_queue.h"
+#include "common/numa.h"
+#include "data/batch_ring.h"
 #include "data/dataset.h"
+#include "data/pipeline_stats.h"
+#include "data/sample_arena.h"
 #include "training/config.h"
 
 namespace marian {
 
 namespace data {
 
+/**
+ * @brief Groups samples into length-sorted mini-batches, --maxi-batch of them
+ * at a time.
+ *
+ * With --mini-batch-words a batch is cut before its padded size, the number
+ * of sentences times the longest sentence summed over all streams, would
+ * exceed the given number of words instead of after --mini-batch sentences.
+ * --mini-batch then only sizes the pool of sentences sorted at once.
+ *
+ * With --prefetch n a background thread reads, sorts and converts the samples
+ * and keeps up to n batches ready, next() only waits when none is ready. The
+ * dataset is then only accessed from that thread until the next prepare().
+ *
+ * With --stream-epochs as well, and a dataset that prepares its shuffles in
+ * the background, that thread goes on with the next epoch when one ends and
+ * marks the boundary with a null batch. prepare() then returns at once.
+ *
+ * With setRing() the batches are instead read by other processes, see
+ * BatchRing, and an epoch ends once every reader marked its end. Readers that
+ * are faster than others may already contribute batches of their next epoch.
+ */
 template <class DataSet>
 class BatchGenerator {
   public:
@@ -31,65 +62,313 @@ class BatchGenerator {
     std::deque<BatchPtr> bufferedBatches_;
     BatchPtr currentBatch_;
 
-    void fillBatches(bool shuffle=true) {
-      auto cmp = [](const sample& a, const sample& b) {
-        return a[0].size() < b[0].size();
-      };
+    // number of samples read since the last prepare()
+    size_t position_{0};
+    bool shuffle_{true};
 
-      std::priority_queue<sample, samples, decltype(cmp)> maxiBatch(cmp);
+    // prefetching: the producer fills ready_, next_ is the batch next() returns
+    size_t prefetch_{0};
+    Ptr<BoundedQueue<BatchPtr>> ready_;
+    std::thread producer_;
+    std::atomic<bool> stop_{false};
+    BatchPtr next_;
+    bool streaming_{false};
 
-      int maxSize = options_->get<int>("mini-batch") * options_->get<int>("maxi-batch");
-      while(current_ != data_->end() && maxiBatch.size() < maxSize) {
-        maxiBatch.push(*current_);
+    // --data-processes: batches of the reader processes, ends of their epochs
+    Ptr<BatchRing> ring_;
+    size_t ringEnds_{0};
+
+    // real and padded words per stream of the batches created since prepare()
+    std::vector<size_t> words_;
+    std::vector<size_t> paddedWords_;
+
+    // shared with the dataset, which counts reading and parsing
+    Ptr<PipelineStats> stats_;
+
+    // the current maxi-batch, kept between calls of fillBatches() so that
+    // batching does not allocate once they are as large as the largest one
+    SampleArena arena_;
+    // corpus position of every sample in arena_
+    std::vector<size_t> positions_;
+    // samples of arena_ in batch order
+    std::vector<size_t> order_;
+    std::vector<size_t> ids_;
+    std::vector<size_t> lengths_;
+
+    /** @brief Batch of the  n  samples of arena_ at the positions  order  */
+    BatchPtr toBatch(const size_t* order, size_t n) {
+      words_.resize(arena_.streams(), 0);
+      ids_.clear();
+      for(size_t i = 0; i < n; ++i) {
+        for(size_t s = 0; s < arena_.streams(); ++s)
+          words_[s] += arena_.length(order[i], s);
+        ids_.push_back(positions_[order[i]]);
+      }
+      auto batch = data_->toBatch(arena_, order, n);
+      paddedWords_.resize(batch->sets(), 0);
+      for(size_t i = 0; i < batch->sets(); ++i) {
+        paddedWords_[i] += (*batch)[i].indices().size();
+        stats_->paddedWords += (*batch)[i].indices().size();
+      }
+      stats_->words += batch->words();
+      stats_->batch.items++;
+
+      batch->setSentenceIds(ids_);
+      return batch;
+    }
+
+    void fillBatches(std::deque<BatchPtr>& batches, bool shuffle) {
+      auto& opt = options_->snapshot();
+      size_t maxSize = opt.miniBatch * opt.maxiBatch;
+
+      // samples are appended to the arena, never copied as vectors
+      arena_.clear();
+      positions_.clear();
+      while(current_ != data_->end() && arena_.size() < maxSize) {
+        arena_.add(*current_);
+        positions_.push_back(position_++);
         current_++;
       }
 
-      samples batchVector;
-      while(!maxiBatch.empty()) {
-        batchVector.push_back(maxiBatch.top());
-        maxiBatch.pop();
-        if(batchVector.size() == options_->get<int>("mini-batch")) {
-          bufferedBatches_.push_back(data_->toBatch(batchVector));
-          batchVector.clear();
+      // reading and parsing above are counted by the dataset
+      StageTimer timer(stats_->batch.micros);
+
+      // longest first by source length, then by the lengths of the other
+      // streams, so that neighbouring sentences match in all streams as far as
+      // possible. Ties keep the corpus order.
+      const SampleArena& arena = arena_;
+      order_.resize(arena.size());
+      std::iota(order_.begin(), order_.end(), 0);
+      std::sort(order_.begin(), order_.end(), [&arena](size_t a, size_t b) {
+        for(size_t s = 0; s < arena.streams(); ++s)
+          if(arena.length(a, s) != arena.length(b, s))
+            return arena.length(a, s) > arena.length(b, s);
+        return a < b;
+      });
+
+      size_t maxWords = opt.miniBatchWords;
+
+      // the batch being collected is order_[begin, i), lengths_ holds its
+      // longest sentence per stream for padded word counts
+      size_t begin = 0;
+      lengths_.assign(arena.streams(), 0);
+      size_t first = batches.size();
+      for(size_t i = 0; i < order_.size(); ++i) {
+        size_t next = order_[i];
+        if(maxWords > 0) {
+          size_t padded = 0;
+          for(size_t s = 0; s < arena.streams(); ++s)
+            padded += std::max(lengths_[s], arena.length(next, s));
+          padded *= i - begin + 1;
+
+          if(padded > maxWords && i > begin) {
+            batches.push_back(toBatch(order_.data() + begin, i - begin));
+            begin = i;
+            std::fill(lengths_.begin(), lengths_.end(), 0);
+          }
+          for(size_t s = 0; s < arena.streams(); ++s)
+            lengths_[s] = std::max(lengths_[s], arena.length(next, s));
+        }
+
+        if(maxWords == 0 && i + 1 - begin == opt.miniBatch) {
+          batches.push_back(toBatch(order_.data() + begin, i + 1 - begin));
+          begin = i + 1;
         }
       }
-      if(!batchVector.empty())
-        bufferedBatches_.push_back(data_->toBatch(batchVector));
+      if(begin < order_.size())
+        batches.push_back(toBatch(order_.data() + begin, order_.size() - begin));
 
       if(shuffle) {
-        std::random_shuffle(bufferedBatches_.begin(), bufferedBatches_.end());
+        std::random_shuffle(batches.begin() + first, batches.end());
       }
     }
 
+    /** @brief Logs and clears the padding counters, see paddingEfficiency() */
+    void logPadding() {
+      auto efficiency = paddingEfficiency();
+      if(!efficiency.empty()) {
+        std::stringstream ss;
+        for(auto e : efficiency)
+          ss << " " << std::fixed << std::setprecision(1) << 100 * e << "%";
+        LOG(data, "Padding efficiency per stream:{}", ss.str());
+      }
+      words_.clear();
+      paddedWords_.clear();
+    }
+
+    /** @brief Reads the dataset from its beginning, reshuffled if  shuffle_  */
+    void restart() {
+      if(shuffle_)
+        data_->shuffle();
+      else
+        data_->reset();
+      current_ = data_->begin();
+      position_ = 0;
+    }
+
+    /** @brief The next batch of the readers, null at the end of the epoch */
+    BatchPtr popRing() {
+      BatchPtr batch;
+      while(ring_->pop(batch)) {
+        if(batch) {
+          stats_->words += batch->words();
+          stats_->batch.items++;
+          return batch;
+        }
+        if(++ringEnds_ == ring_->processes()) {
+          ringEnds_ = 0;
+          return nullptr;
+        }
+      }
+      return nullptr;
+    }
+
+    void produce() {
+      // next to the device that receives the batches first
+      if(options_->has("devices"))
+        numa::bindThread(options_->get<std::vector<size_t>>("devices")[0]);
+
+      std::deque<BatchPtr> batches;
+      while(!stop_) {
+        fillBatches(batches, shuffle_);
+        if(batches.empty() && streaming_) {
+          // the end of the epoch, Train() counts it when next() returns null
+          ready_->push(nullptr);
+          logPadding();
+          restart();
+          continue;
+        }
+        if(batches.empty())
+          break;
+        while(!batches.empty() && !stop_) {
+          ready_->push(batches.front());
+          batches.pop_front();
+        }
+      }
+      ready_->close();
+    }
+
+    void stopProducer() {
+      if(!producer_.joinable())
+        return;
+      stop_ = true;
+      // unblocks a producer waiting for room
+      BatchPtr batch;
+      while(ready_->pop(batch)) {}
+      producer_.join();
+      stop_ = false;
+    }
+
   public:
     BatchGenerator(Ptr<DataSet> data,
                    Ptr<Config> options)
     : data_(data),
-      options_(options) { }
+      options_(options),
+      prefetch_(options->has("prefetch") ? options->get<size_t>("prefetch") : 0),
+      stats_(data->stats()) { }
+
+    ~BatchGenerator() {
+      stopProducer();
+    }
 
     operator bool() const {
-      return !bufferedBatches_.empty();
+      return ring_ || prefetch_ ? (bool)next_ : !bufferedBatches_.empty();
+    }
+
+    /**
+     * @brief Takes the batches from the reader processes of  ring  instead of
+     * the dataset, which is then not read by this generator
+     */
+    void setRing(Ptr<BatchRing> ring) {
+      stopProducer();
+      ring_ = ring;
     }
 
     BatchPtr next() {
+      stats_->nexts++;
+      StageTimer timer(stats_->waitMicros);
+
+      if(ring_) {
+        UTIL_THROW_IF2(!next_, "No batches to fetch, run prepare()");
+        currentBatch_ = next_;
+        next_ = popRing();
+        return currentBatch_;
+      }
+
+      if(prefetch_) {
+        UTIL_THROW_IF2(!next_, "No batches to fetch, run prepare()");
+        currentBatch_ = next_;
+        next_ = nullptr;
+        stats_->queued += ready_->size();
+        BatchPtr batch;
+        if(ready_->pop(batch))
+          next_ = batch;
+        return currentBatch_;
+      }
+
       UTIL_THROW_IF2(bufferedBatches_.empty(),
                      "No batches to fetch, run prepare()");
       currentBatch_ = bufferedBatches_.front();
       bufferedBatches_.pop_front();
+      stats_->queued += bufferedBatches_.size();
 
       if(bufferedBatches_.empty())
-        fillBatches();
+        fillBatches(bufferedBatches_, shuffle_);
 
       return currentBatch_;
     }
 
+    /** @brief Pipeline counters of this generator and its dataset */
+    Ptr<PipelineStats> stats() {
+      return stats_;
+    }
+
+    /**
+     * @brief Real words per stream over padded batch positions per stream of
+     * the batches created since the last prepare(), 1 means no padding
+     */
+    std::vector<float> paddingEfficiency() const {
+      std::vector<float> efficiency;
+      for(size_t i = 0; i < words_.size() && i < paddedWords_.size(); ++i)
+        efficiency.push_back(paddedWords_[i] ? words_[i] / (float)paddedWords_[i] : 1.f);
+      return efficiency;
+    }
+
     void prepare(bool shuffle=true) {
-      if(shuffle)
-        data_->shuffle();
-      else
-        data_->reset();
-      current_ = data_->begin();
-      fillBatches(shuffle);
+      // the readers shuffle by themselves
+      if(ring_) {
+        next_ = popRing();
+        return;
+      }
+
+      // the producer already started this epoch after the marked end of the last
+      if(streaming_ && producer_.joinable() && shuffle == shuffle_) {
+        BatchPtr batch;
+        if(ready_->pop(batch))
+          next_ = batch;
+        return;
+      }
+
+      stopProducer();
+      logPadding();
+
+      shuffle_ = shuffle;
+      restart();
+
+      if(prefetch_) {
+        streaming_ = options_->has("stream-epochs")
+                     && options_->get<bool>("stream-epochs") && data_->streaming();
+        next_ = nullptr;
+        ready_ = New<BoundedQueue<BatchPtr>>(prefetch_);
+        producer_ = std::thread([this]() { produce(); });
+        BatchPtr batch;
+        if(ready_->pop(batch))
+          next_ = batch;
+        return;
+      }
+
+      bufferedBatches_.clear();
+      fillBatches(bufferedBatches_, shuffle);
     }
 };
 
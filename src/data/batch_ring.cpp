@@ -0,0 +1,298 @@
+#include "data/batch_ring.h"
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <ctime>
+#include <new>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "3rd_party/exception.h"
+#include "common/logging.h"
+
+namespace marian {
+namespace data {
+
+/**
+ * Start of the mapping, followed by the records. A record is a RecordHeader,
+ * the width of every stream, per stream the word ids and the mask, each padded
+ * to 8 bytes, and the sentence ids. The end of an epoch is a record of 0
+ * sentences. A record does not wrap around the end of the buffer, a writer
+ * skips the remaining bytes instead and marks them with a header of 0 bytes
+ * if one fits.
+ */
+struct BatchRing::Shared {
+  pthread_mutex_t mutex;
+  pthread_cond_t readable;
+  pthread_cond_t writable;
+
+  // read and write offsets, bytes between them including skipped ones
+  size_t head;
+  size_t tail;
+  size_t used;
+
+  bool closed;
+  // a reader died holding the mutex
+  bool broken;
+};
+
+namespace {
+
+struct RecordHeader {
+  uint64_t bytes;
+  uint64_t streams;
+  uint64_t size;
+  uint64_t words;
+  uint64_t ids;
+};
+
+size_t align(size_t bytes) {
+  return (bytes + 7) & ~(size_t)7;
+}
+
+size_t recordBytes(const CorpusBatch* batch) {
+  if(!batch)
+    return sizeof(RecordHeader);
+  size_t bytes = sizeof(RecordHeader)
+                 + (batch->sets() + batch->getSentenceIds().size()) * sizeof(uint64_t);
+  for(size_t s = 0; s < batch->sets(); ++s) {
+    size_t n = (*batch)[s].indices().size();
+    bytes += align(n * sizeof(Word)) + align(n * sizeof(float));
+  }
+  return bytes;
+}
+
+void write(char*& out, const void* data, size_t bytes) {
+  std::memcpy(out, data, bytes);
+  out += align(bytes);
+}
+
+}
+
+BatchRing::BatchRing(size_t bytes)
+ : capacity_(align(bytes)), owner_(getpid()) {
+  size_t offset = (sizeof(Shared) + 63) & ~(size_t)63;
+  mapped_ = offset + capacity_;
+  void* memory = mmap(nullptr, mapped_, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  UTIL_THROW_IF2(memory == MAP_FAILED,
+                 "Cannot map a batch ring of " << (mapped_ >> 20) << " MB");
+  shared_ = new(memory) Shared();
+  data_ = (char*)memory + offset;
+
+  pthread_mutexattr_t mutexAttr;
+  pthread_mutexattr_init(&mutexAttr);
+  pthread_mutexattr_setpshared(&mutexAttr, PTHREAD_PROCESS_SHARED);
+  pthread_mutexattr_setrobust(&mutexAttr, PTHREAD_MUTEX_ROBUST);
+  pthread_mutex_init(&shared_->mutex, &mutexAttr);
+  pthread_mutexattr_destroy(&mutexAttr);
+
+  pthread_condattr_t condAttr;
+  pthread_condattr_init(&condAttr);
+  pthread_condattr_setpshared(&condAttr, PTHREAD_PROCESS_SHARED);
+  pthread_cond_init(&shared_->readable, &condAttr);
+  pthread_cond_init(&shared_->writable, &condAttr);
+  pthread_condattr_destroy(&condAttr);
+}
+
+BatchRing::~BatchRing() {
+  if(getpid() != owner_)
+    return;
+  close();
+  for(auto pid : readers_) {
+    kill(pid, SIGTERM);
+    waitpid(pid, nullptr, 0);
+  }
+  munmap(shared_, mapped_);
+}
+
+bool BatchRing::lock() {
+  int status = pthread_mutex_lock(&shared_->mutex);
+  if(status == EOWNERDEAD) {
+    pthread_mutex_consistent(&shared_->mutex);
+    shared_->broken = true;
+  }
+  return !shared_->broken;
+}
+
+void BatchRing::unlock() {
+  pthread_mutex_unlock(&shared_->mutex);
+}
+
+void BatchRing::checkReaders() {
+  for(auto pid : readers_) {
+    int status = 0;
+    if(waitpid(pid, &status, WNOHANG) == pid) {
+      close();
+      UTIL_THROW2("Data reader process " << pid << " exited"
+                  << (WIFSIGNALED(status) ? " on a signal" : " with an error"));
+    }
+  }
+}
+
+void BatchRing::spawn(size_t processes, std::function<void(size_t)> body) {
+  for(size_t process = 0; process < processes; ++process) {
+    pid_t pid = fork();
+    UTIL_THROW_IF2(pid < 0, "Cannot fork data reader " << process);
+    if(pid == 0) {
+      // readers do not outlive the trainer
+      prctl(PR_SET_PDEATHSIG, SIGTERM);
+      // the async loggers of the trainer lost their threads in the fork
+      syncLoggers();
+      int status = 0;
+      try {
+        body(process);
+      }
+      catch(const std::exception& e) {
+        LOG(info, "Data reader {} failed: {}", process, e.what());
+        status = 1;
+      }
+      _exit(status);
+    }
+    readers_.push_back(pid);
+  }
+  LOG(info, "Reading training data in {} processes", processes);
+}
+
+bool BatchRing::push(const CorpusBatch* batch) {
+  size_t bytes = recordBytes(batch);
+  UTIL_THROW_IF2(bytes > capacity_,
+                 "A batch of " << bytes << " bytes does not fit into the batch ring, "
+                 "increase --data-ring-mb");
+
+  if(!lock()) {
+    unlock();
+    return false;
+  }
+  size_t skip = 0;
+  while(!shared_->closed) {
+    size_t end = capacity_ - shared_->tail;
+    skip = bytes <= end ? 0 : end;
+    if(shared_->used + skip + bytes <= capacity_)
+      break;
+    pthread_cond_wait(&shared_->writable, &shared_->mutex);
+  }
+  if(shared_->closed) {
+    unlock();
+    return false;
+  }
+
+  if(skip) {
+    if(skip >= sizeof(RecordHeader))
+      ((RecordHeader*)(data_ + shared_->tail))->bytes = 0;
+    shared_->used += skip;
+    shared_->tail = 0;
+  }
+
+  char* out = data_ + shared_->tail;
+  RecordHeader header{bytes, 0, 0, 0, 0};
+  if(batch) {
+    header.streams = batch->sets();
+    header.size = batch->size();
+    header.words = batch->words();
+    header.ids = batch->getSentenceIds().size();
+  }
+  write(out, &header, sizeof(header));
+  for(size_t s = 0; s < header.streams; ++s) {
+    uint64_t width = (*batch)[s].batchWidth();
+    write(out, &width, sizeof(width));
+  }
+  for(size_t s = 0; s < header.streams; ++s) {
+    auto& sub = (*batch)[s];
+    write(out, sub.indices().data(), sub.indices().size() * sizeof(Word));
+    write(out, sub.mask().data(), sub.mask().size() * sizeof(float));
+  }
+  for(size_t i = 0; i < header.ids; ++i) {
+    uint64_t id = batch->getSentenceIds()[i];
+    write(out, &id, sizeof(id));
+  }
+
+  shared_->tail = (shared_->tail + bytes) % capacity_;
+  shared_->used += bytes;
+  pthread_cond_signal(&shared_->readable);
+  unlock();
+  return true;
+}
+
+bool BatchRing::pop(Ptr<CorpusBatch>& batch) {
+  bool consistent = lock();
+  while(consistent && !shared_->closed && shared_->used == 0) {
+    timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += 1;
+    if(pthread_cond_timedwait(&shared_->readable, &shared_->mutex, &until) == ETIMEDOUT) {
+      unlock();
+      checkReaders();
+      consistent = lock();
+    }
+  }
+  if(!consistent || shared_->closed) {
+    unlock();
+    checkReaders();
+    UTIL_THROW_IF2(!consistent, "A data reader process died while writing a batch");
+    return false;
+  }
+
+  // bytes skipped by the writer at the end of the buffer
+  size_t end = capacity_ - shared_->head;
+  if(end < sizeof(RecordHeader) || ((RecordHeader*)(data_ + shared_->head))->bytes == 0) {
+    shared_->used -= end;
+    shared_->head = 0;
+  }
+
+  const char* in = data_ + shared_->head;
+  RecordHeader header;
+  std::memcpy(&header, in, sizeof(header));
+  in += sizeof(header);
+
+  batch = nullptr;
+  if(header.size > 0) {
+    std::vector<uint64_t> widths(header.streams);
+    std::memcpy(widths.data(), in, header.streams * sizeof(uint64_t));
+    in += header.streams * sizeof(uint64_t);
+
+    std::vector<SubBatch> subBatches;
+    subBatches.reserve(header.streams);
+    for(size_t s = 0; s < header.streams; ++s) {
+      subBatches.emplace_back(header.size, widths[s]);
+      auto& sub = subBatches.back();
+      std::memcpy(sub.indices().data(), in, sub.indices().size() * sizeof(Word));
+      in += align(sub.indices().size() * sizeof(Word));
+      std::memcpy(sub.mask().data(), in, sub.mask().size() * sizeof(float));
+      in += align(sub.mask().size() * sizeof(float));
+    }
+
+    std::vector<size_t> ids(header.ids);
+    for(size_t i = 0; i < header.ids; ++i) {
+      uint64_t id;
+      std::memcpy(&id, in, sizeof(id));
+      in += sizeof(id);
+      ids[i] = id;
+    }
+
+    batch = New<CorpusBatch>(subBatches, header.words);
+    if(!ids.empty())
+      batch->setSentenceIds(ids);
+  }
+
+  shared_->head = (shared_->head + header.bytes) % capacity_;
+  shared_->used -= header.bytes;
+  pthread_cond_broadcast(&shared_->writable);
+  unlock();
+  return true;
+}
+
+void BatchRing::close() {
+  lock();
+  shared_->closed = true;
+  pthread_cond_broadcast(&shared_->readable);
+  pthread_cond_broadcast(&shared_->writable);
+  unlock();
+}
+
+}
+}
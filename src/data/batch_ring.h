@@ -0,0 +1,84 @@
+#pragma once
+
+#include <functional>
+#include <vector>
+#include <sys/types.h>
+
+#include "common/definitions.h"
+#include "data/corpus.h"
+
+namespace marian {
+namespace data {
+
+/**
+ * @brief Batches handed from reader processes to the trainer through a ring
+ * buffer in shared memory.
+ *
+ * The ring is mapped before spawn() forks the readers, which then push
+ * finished batches in the layout of their SubBatches, so the trainer only
+ * copies the word and mask buffers out of the ring. Readers block while the
+ * ring is full and stop when it is closed. Every reader marks the end of each
+ * of its epochs with pushEnd().
+ *
+ * The ring belongs to the process that created it: destroying it there
+ * closes it and terminates the readers. A reader that fails makes pop() throw.
+ */
+class BatchRing {
+  private:
+    struct Shared;
+
+    Shared* shared_;
+    char* data_;
+    size_t capacity_;
+    size_t mapped_;
+
+    pid_t owner_;
+    std::vector<pid_t> readers_;
+
+    bool lock();
+    void unlock();
+    void checkReaders();
+    bool push(const CorpusBatch* batch);
+
+  public:
+    /** @brief A ring of  bytes  bytes of batches */
+    BatchRing(size_t bytes);
+
+    ~BatchRing();
+
+    /**
+     * @brief Forks  processes  readers that each run  body  with their number
+     * and exit when it returns or throws. Call before this process starts any
+     * thread other than those of the loggers, a forked child only inherits
+     * the calling one. The readers log through synchronous loggers, see
+     * syncLoggers().
+     */
+    void spawn(size_t processes, std::function<void(size_t)> body);
+
+    /** @brief Number of readers started by spawn() */
+    size_t processes() const {
+      return readers_.size();
+    }
+
+    /** @brief Copies  batch  into the ring, false once the ring is closed */
+    bool push(const CorpusBatch& batch) {
+      return push(&batch);
+    }
+
+    /** @brief Marks the end of an epoch of the calling reader */
+    bool pushEnd() {
+      return push(nullptr);
+    }
+
+    /**
+     * @brief The oldest batch in the ring, null for the end of an epoch of one
+     * reader. Waits for one, returns false once the ring is closed.
+     */
+    bool pop(Ptr<CorpusBatch>& batch);
+
+    /** @brief Wakes and stops readers and a waiting pop() */
+    void close();
+};
+
+}
+}
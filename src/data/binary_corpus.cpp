@@ -0,0 +1,110 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <limits>
+
+#include "data/binary_corpus.h"
+#include "common/file_stream.h"
+#include "common/logging.h"
+#include "common/read_ahead.h"
+
+namespace marian {
+namespace data {
+
+static const char MAGIC[8] = {'M', 'A', 'R', 'I', 'A', 'N', 'B', '1'};
+static const size_t HEADER = sizeof(MAGIC) + 2 * sizeof(uint64_t);
+
+BinaryCorpus::BinaryCorpus(const std::string& path)
+  : file_(io::fetch(path)) {
+  UTIL_THROW_IF2(!file_.is_open(), "Could not map binary corpus " << path);
+  UTIL_THROW_IF2(file_.size() < HEADER || std::memcmp(file_.data(), MAGIC, sizeof(MAGIC)),
+                 "File " << path << " is not a binary corpus");
+
+  const uint64_t* header = (const uint64_t*)(file_.data() + sizeof(MAGIC));
+  streams_ = header[0];
+  sentences_ = header[1];
+  offsets_ = header + 2;
+
+  size_t indexSize = (sentences_ * streams_ + 1) * sizeof(uint64_t);
+  UTIL_THROW_IF2(file_.size() < HEADER + indexSize, "Truncated binary corpus " << path);
+  words_ = (const uint32_t*)(file_.data() + HEADER + indexSize);
+
+  size_t expected = HEADER + indexSize + offsets_[sentences_ * streams_] * sizeof(uint32_t);
+  UTIL_THROW_IF2(file_.size() != expected, "Truncated binary corpus " << path);
+
+  LOG(data, "Mapped binary corpus {} with {} sentence tuples", path, sentences_);
+}
+
+bool BinaryCorpus::isBinary(const std::string& path) {
+  // the magic alone, without fetching a remote file
+  char magic[sizeof(MAGIC)];
+  try {
+    return io::open(path)->read(magic, 0, sizeof(magic)) == sizeof(magic)
+           && !std::memcmp(magic, MAGIC, sizeof(MAGIC));
+  }
+  catch(util::Exception&) {
+    return false;
+  }
+}
+
+size_t BinaryCorpus::create(const std::string& path,
+                            const std::vector<std::string>& textPaths,
+                            const std::vector<Ptr<Vocab>>& vocabs) {
+  UTIL_THROW_IF2(textPaths.empty() || textPaths.size() != vocabs.size(),
+                 "Number of corpus files and vocab files does not agree");
+
+  // first pass: the index size has to be known before writing the words
+  uint64_t sentences = std::numeric_limits<uint64_t>::max();
+  for(auto& textPath : textPaths) {
+    InputFileStream text(textPath);
+    uint64_t lines = 0;
+    std::string line;
+    while(std::getline((std::istream&)text, line))
+      lines++;
+    if(sentences != std::numeric_limits<uint64_t>::max() && lines != sentences)
+      LOG(data, "Warning: {} has {} lines, truncating corpus to the shortest file",
+          textPath, lines);
+    sentences = std::min(sentences, lines);
+  }
+  uint64_t streams = textPaths.size();
+
+  {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    UTIL_THROW_IF2(!out, "Could not create binary corpus " << path);
+    out.write(MAGIC, sizeof(MAGIC));
+    out.write((const char*)&streams, sizeof(streams));
+    out.write((const char*)&sentences, sizeof(sentences));
+  }
+
+  // offsets and words are written in one pass through two streams
+  std::fstream offsets(path, std::ios::binary | std::ios::in | std::ios::out);
+  std::fstream words(path, std::ios::binary | std::ios::in | std::ios::out);
+  offsets.seekp(HEADER);
+  words.seekp(HEADER + (sentences * streams + 1) * sizeof(uint64_t));
+
+  std::vector<UPtr<InputFileStream>> texts;
+  for(auto& textPath : textPaths)
+    texts.emplace_back(new InputFileStream(textPath));
+
+  uint64_t offset = 0;
+  std::vector<uint32_t> ids;
+  std::string line;
+  for(uint64_t i = 0; i < sentences; ++i) {
+    for(size_t s = 0; s < streams; ++s) {
+      std::getline((std::istream&)*texts[s], line);
+      Words sentence = (*vocabs[s])(line);
+      ids.assign(sentence.begin(), sentence.end());
+
+      offsets.write((const char*)&offset, sizeof(offset));
+      words.write((const char*)ids.data(), ids.size() * sizeof(uint32_t));
+      offset += ids.size();
+    }
+  }
+  offsets.write((const char*)&offset, sizeof(offset));
+
+  UTIL_THROW_IF2(!offsets || !words, "Error writing binary corpus " << path);
+  return sentences;
+}
+
+}
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <boost/iostreams/device/mapped_file.hpp>
+
+#include "common/definitions.h"
+#include "data/vocab.h"
+
+namespace marian {
+namespace data {
+
+/**
+ * @brief Read-only, memory-mapped corpus of pre-tokenized sentence tuples.
+ *
+ * Created once from aligned text files and their vocabularies with create(),
+ * reading it again costs no tokenization or vocabulary lookups. The file
+ * layout, in host byte order, is
+ *
+ *     char     magic[8]                        "MARIANB1"
+ *     uint64_t streams                         files per sentence tuple
+ *     uint64_t sentences
+ *     uint64_t offsets[sentences * streams + 1] into words, tuple-major
+ *     uint32_t words[offsets[sentences * streams]]
+ *
+ * Sentences are stored with their trailing </s> and without length filtering.
+ */
+class BinaryCorpus {
+  private:
+    boost::iostreams::mapped_file_source file_;
+    size_t streams_;
+    size_t sentences_;
+    const uint64_t* offsets_;
+    const uint32_t* words_;
+
+  public:
+    BinaryCorpus(const std::string& path);
+
+    /** @brief Number of sentence tuples */
+    size_t size() const {
+      return sentences_;
+    }
+
+    /** @brief Number of sentences per tuple */
+    size_t streams() const {
+      return streams_;
+    }
+
+    /** @brief Length of the  s-th  sentence of tuple  i  */
+    size_t length(size_t i, size_t s) const {
+      size_t k = i * streams_ + s;
+      return offsets_[k + 1] - offsets_[k];
+    }
+
+    /** @brief Word ids of the  s-th  sentence of tuple  i , valid while the corpus lives */
+    const uint32_t* sentence(size_t i, size_t s) const {
+      return words_ + offsets_[i * streams_ + s];
+    }
+
+    /** @brief True if the file starts with the magic of a binary corpus */
+    static bool isBinary(const std::string& path);
+
+    /**
+     * @brief Converts aligned text files with one vocabulary each into a binary
+     * corpus at  path . Returns the number of sentence tuples written.
+     */
+    static size_t create(const std::string& path,
+                         const std::vector<std::string>& textPaths,
+                         const std::vector<Ptr<Vocab>>& vocabs);
+};
+
+}
+}
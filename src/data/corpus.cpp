@@ -1,17 +1,18 @@
+#include <cstring>
+#include <future>
+#include <limits>
+#include <numeric>
 #include <random>
 
+#include <boost/filesystem.hpp>
+
+#include "common/numa.h"
+#include "common/read_ahead.h"
 #include "data/corpus.h"
 
 namespace marian {
 namespace data {
 
-typedef std::vector<size_t> WordBatch;
-typedef std::vector<float> MaskBatch;
-typedef std::pair<WordBatch, MaskBatch> WordMask;
-typedef std::vector<WordMask> SentBatch;
-
-typedef std::vector<Words> SentenceTuple;
-
 CorpusIterator::CorpusIterator() : pos_(-1) {}
 
 CorpusIterator::CorpusIterator(Corpus& corpus)
@@ -37,7 +38,8 @@ const SentenceTuple& CorpusIterator::dereference() const {
 Corpus::Corpus(Ptr<Config> options, bool translate)
   : options_(options),
     maxLength_(options_->get<size_t>("max-length")),
-    g_(rd_()) {
+    g_(rd_()),
+    index_(New<Index>()) {
 
   if(!translate)
     textPaths_ = options_->get<std::vector<std::string>>("train-sets");
@@ -45,38 +47,57 @@ Corpus::Corpus(Ptr<Config> options, bool translate)
     textPaths_ = options_->get<std::vector<std::string>>("inputs");
 
   g_.seed(Config::seed);
+  bindOptions();
 
   std::vector<std::string> vocabPaths;
   if(options_->has("vocabs"))
     vocabPaths = options_->get<std::vector<std::string>>("vocabs");
 
-  UTIL_THROW_IF2(!vocabPaths.empty() && textPaths_.size() != vocabPaths.size(),
-                 "Number of corpus files and vocab files does not agree");
-
   std::vector<int> maxVocabs =
     options_->get<std::vector<int>>("dim-vocabs");
 
-  std::vector<Vocab> vocabs;
-  if(vocabPaths.empty()) {
-    for(int i = 0; i < textPaths_.size(); ++i) {
-      Ptr<Vocab> vocab = New<Vocab>();
-      vocab->loadOrCreate("", textPaths_[i], maxVocabs[i]);
-      options_->get()["vocabs"].push_back(textPaths_[i] + ".yml");
-      vocabs_.emplace_back(vocab);
-    }
-  }
-  else {
+  if(textPaths_.size() == 1 && BinaryCorpus::isBinary(textPaths_[0])) {
+    binary_ = New<BinaryCorpus>(textPaths_[0]);
+    UTIL_THROW_IF2(vocabPaths.size() != binary_->streams(),
+                   "Binary corpus " << textPaths_[0] << " requires one vocab per stream");
     for(int i = 0; i < vocabPaths.size(); ++i) {
       Ptr<Vocab> vocab = New<Vocab>();
-      vocab->loadOrCreate(vocabPaths[i], textPaths_[i], maxVocabs[i]);
+      vocab->load(vocabPaths[i], maxVocabs[i]);
       vocabs_.emplace_back(vocab);
     }
+    return;
   }
 
+  // only for training data, binary corpora know their lengths anyway
+  lengthIndex_ = !translate && options_->has("length-index")
+    && options_->get<bool>("length-index");
+  UTIL_THROW_IF2(lengthIndex_ && compressed(),
+                 "--length-index requires uncompressed text files");
 
-  for(auto path : textPaths_) {
-    files_.emplace_back(new InputFileStream(path));
+  UTIL_THROW_IF2(!vocabPaths.empty() && textPaths_.size() != vocabPaths.size(),
+                 "Number of corpus files and vocab files does not agree");
+
+  size_t sample = options_->has("vocab-sample")
+    ? options_->get<size_t>("vocab-sample") : 0;
+
+  // vocabularies of all streams are loaded or created concurrently
+  std::vector<std::future<void>> loaded;
+  for(int i = 0; i < textPaths_.size(); ++i) {
+    Ptr<Vocab> vocab = New<Vocab>();
+    std::string vocabPath = vocabPaths.empty() ? "" : vocabPaths[i];
+    loaded.push_back(std::async(std::launch::async,
+                                [=]() {
+                                  vocab->loadOrCreate(vocabPath, textPaths_[i], maxVocabs[i],
+                                                      threads_, sample);
+                                }));
+    if(vocabPaths.empty())
+      options_->get()["vocabs"].push_back(textPaths_[i] + ".yml");
+    vocabs_.emplace_back(vocab);
   }
+  for(auto& l : loaded)
+    l.get();
+
+  openFiles();
 }
 
 Corpus::Corpus(std::vector<std::string> paths,
@@ -85,80 +106,518 @@ Corpus::Corpus(std::vector<std::string> paths,
   : options_(options),
     textPaths_(paths),
     vocabs_(vocabs),
-    maxLength_(options_->get<size_t>("max-length")) {
+    maxLength_(options_->get<size_t>("max-length")),
+    index_(New<Index>()) {
+
+  bindOptions();
+  if(textPaths_.size() == 1 && BinaryCorpus::isBinary(textPaths_[0])) {
+    binary_ = New<BinaryCorpus>(textPaths_[0]);
+    UTIL_THROW_IF2(binary_->streams() != vocabs_.size(),
+                   "Number of corpus streams and vocab files does not agree");
+    return;
+  }
 
   UTIL_THROW_IF2(textPaths_.size() != vocabs_.size(),
                  "Number of corpus files and vocab files does not agree");
 
-  for(auto path : textPaths_) {
+  openFiles();
+}
+
+void Corpus::bindOptions() {
+  if(options_->has("data-threads"))
+    threads_ = std::max((size_t)1, options_->get<size_t>("data-threads"));
+  if(threads_ > 1)
+    pool_.reset(new ThreadPool(threads_));
+  streaming_ = options_->has("stream-epochs") && options_->get<bool>("stream-epochs");
+}
+
+bool Corpus::compressed() const {
+  return std::any_of(textPaths_.begin(), textPaths_.end(),
+                     [](const std::string& path) {
+                       return boost::filesystem::path(path).extension() == ".gz";
+                     });
+}
+
+Corpus::Corpus(Corpus& master, size_t shard)
+  : options_(master.options_),
+    textPaths_(master.textPaths_),
+    vocabs_(master.vocabs_),
+    maxLength_(master.maxLength_),
+    binary_(master.binary_),
+    index_(master.index_),
+    pos_(shard),
+    shard_(shard),
+    shards_(master.shards_),
+    master_(false),
+    lengthIndex_(master.lengthIndex_) {
+  UTIL_THROW_IF2(shard >= shards_, "Shard " << shard << " of a corpus with " << shards_ << " shards");
+  bindOptions();
+}
+
+void Corpus::setShard(size_t shard, size_t shards) {
+  UTIL_THROW_IF2(!binary_ && compressed(),
+                 "Sharded reading requires a binary or an uncompressed text corpus");
+  UTIL_THROW_IF2(shard >= shards, "Shard " << shard << " of a corpus with " << shards << " shards");
+  shard_ = shard;
+  shards_ = shards;
+  pos_ = shard;
+}
+
+void Corpus::openRawFiles() {
+  rawFiles_.clear();
+  for(auto& path : textPaths_)
+    rawFiles_.emplace_back(new std::ifstream(io::fetch(path), std::ios::binary));
+}
+
+void Corpus::openFiles() {
+  files_.clear();
+  for(auto& path : textPaths_) {
     files_.emplace_back(new InputFileStream(path));
   }
+}
+
+bool Corpus::nextBinary(SentenceTuple& tup) {
+  StageTimer timer(stats_->read.micros);
+  size_t sentences = index_->order.empty() ? binary_->size() : index_->order.size();
+  while(pos_ < sentences) {
+    size_t i = index_->order.empty() ? pos_ : index_->order[pos_];
+    pos_ += shards_;
+
+    bool keep = true;
+    for(size_t s = 0; s < binary_->streams(); ++s)
+      keep = keep && binary_->length(i, s) <= maxLength_;
+    if(!keep)
+      continue;
+
+    stats_->read.items++;
+    tup.resize(binary_->streams());
+    for(size_t s = 0; s < binary_->streams(); ++s) {
+      const uint32_t* ids = binary_->sentence(i, s);
+      size_t dimVocab = vocabs_[s]->size();
+      tup[s].resize(binary_->length(i, s));
+      // ids beyond a vocabulary cut with --dim-vocabs become <unk>
+      for(size_t k = 0; k < tup[s].size(); ++k)
+        tup[s][k] = ids[k] < dimVocab ? ids[k] : UNK_ID;
+    }
+    return true;
+  }
+  return false;
+}
+
+bool Corpus::nextLines(std::vector<std::string>& lines) {
+  StageTimer timer(stats_->read.micros);
+  if(!index_->order.empty() || lengthIndex_) {
+    if(pos_ >= index_->order.size())
+      return false;
+    size_t i = index_->order[pos_];
+    pos_ += shards_;
+    if(rawFiles_.empty())
+      openRawFiles();
+    for(int j = 0; j < rawFiles_.size(); ++j) {
+      rawFiles_[j]->seekg(index_->lineOffsets[j][i]);
+      std::getline(*rawFiles_[j], lines[j]);
+    }
+    stats_->read.items++;
+    return true;
+  }
 
+  // shards read only through the index of their master
+  if(!master_)
+    return false;
+
+  for(int j = 0; j < files_.size(); ++j)
+    if(!std::getline((std::istream&)*files_[j], lines[j]))
+      return false;
+  stats_->read.items++;
+  return true;
+}
+
+bool Corpus::toTuple(const std::vector<std::string>& lines,
+                     SentenceTuple& tup) const {
+  tup.clear();
+  for(int i = 0; i < lines.size(); ++i) {
+    Words words = (*vocabs_[i])(lines[i]);
+    if(words.empty())
+      words.push_back(0);
+    tup.push_back(std::move(words));
+  }
+  return std::all_of(tup.begin(), tup.end(),
+                     [=](const Words& words) {
+                       return words.size() > 0 &&
+                       words.size() <= maxLength_;
+                      });
+}
+
+bool Corpus::parseChunk() {
+  const size_t linesPerTask = 1000;
+
+  std::vector<std::vector<std::string>> chunk;
+  std::vector<std::string> lines(textPaths_.size());
+  while(chunk.size() < threads_ * linesPerTask && nextLines(lines)) {
+    chunk.push_back(std::move(lines));
+    lines.resize(textPaths_.size());
+  }
+  if(chunk.empty())
+    return false;
+
+  // parsers run next to the device that receives the batches first
+  size_t device = 0;
+  if(numa::enabled() && options_->has("devices"))
+    device = options_->get<std::vector<size_t>>("devices")[0];
+
+  std::vector<std::future<std::vector<SentenceTuple>>> parts;
+  for(size_t first = 0; first < chunk.size(); first += linesPerTask) {
+    size_t last = std::min(first + linesPerTask, chunk.size());
+    parts.push_back(pool_->enqueue([this, &chunk, first, last, device]() {
+      numa::bindThread(device);
+      StageTimer timer(stats_->parse.micros);
+      stats_->parse.items += last - first;
+      std::vector<SentenceTuple> tups;
+      SentenceTuple tup;
+      for(size_t i = first; i < last; ++i)
+        if(toTuple(chunk[i], tup))
+          tups.push_back(std::move(tup));
+      return tups;
+    }));
+  }
+
+  // futures are collected in submission order, so the corpus order is kept
+  for(auto& part : parts)
+    for(auto& tup : part.get())
+      parsed_.push_back(std::move(tup));
+  return true;
 }
 
 SentenceTuple Corpus::next() {
-  bool cont = true;
-  while(cont) {
-    SentenceTuple tup;
-    for(int i = 0; i < files_.size(); ++i) {
-      std::string line;
-      if(std::getline((std::istream&)*files_[i], line)) {
-        Words words = (*vocabs_[i])(line);
-        if(words.empty())
-          words.push_back(0);
-        tup.push_back(words);
+  SentenceTuple tup;
+  next(tup);
+  return tup;
+}
+
+bool Corpus::next(SentenceTuple& tup) {
+  if(binary_) {
+    if(nextBinary(tup))
+      return true;
+    tup.clear();
+    return false;
+  }
+
+  if(pool_) {
+    while(parsed_.empty()) {
+      if(!parseChunk()) {
+        tup.clear();
+        return false;
       }
     }
-    cont = tup.size() == files_.size();
-    if(cont && std::all_of(tup.begin(), tup.end(),
-                           [=](const Words& words) {
-                             return words.size() > 0 &&
-                             words.size() <= maxLength_;
-                            }))
-      return tup;
+    tup = std::move(parsed_.front());
+    parsed_.pop_front();
+    return true;
+  }
+
+  lines_.resize(textPaths_.size());
+  while(nextLines(lines_)) {
+    StageTimer timer(stats_->parse.micros);
+    stats_->parse.items++;
+    if(toTuple(lines_, tup))
+      return true;
   }
-  return SentenceTuple();
+  tup.clear();
+  return false;
 }
 
 void Corpus::shuffle() {
-  shuffleFiles(textPaths_);
+  parsed_.clear();
+  if(!master_) {
+    pos_ = shard_;
+    return;
+  }
+
+  // the line index is built once, before any shuffle runs in the background
+  if(!binary_ && !compressed() && index_->lineOffsets.empty())
+    indexFiles();
+
+  Shuffled next = nextShuffle_.valid() ? nextShuffle_.get() : shuffled(".shuf");
+  if(next.files.empty()) {
+    index_->order = std::move(next.order);
+  }
+  else {
+    // closes the files of the previous shuffle before they are replaced
+    files_.clear();
+    for(size_t i = 0; i < textPaths_.size(); ++i) {
+      std::string path = textPaths_[i] + ".shuf";
+      if(next.files[i] != path)
+        boost::filesystem::rename(next.files[i], path);
+      files_.emplace_back(new InputFileStream(path));
+    }
+  }
+  pos_ = shard_;
+
+  // the random generator is only used by the shuffles, which run one at a time
+  if(streaming())
+    nextShuffle_ = std::async(std::launch::async, [this]() {
+      return shuffled(".shuf.next");
+    });
+}
+
+/**
+ * A new order of the sentences, or for compressed text files shuffled copies
+ * written to their paths plus  suffix . Does not change what is being read.
+ */
+Corpus::Shuffled Corpus::shuffled(const std::string& suffix) {
+  Shuffled next;
+  if(binary_) {
+    LOG(data, "Shuffling binary corpus index");
+    next.order = permutation(binary_->size());
+  }
+  // compressed files cannot be read at random offsets
+  else if(compressed()) {
+    next.files = shuffleFiles(textPaths_, suffix);
+  }
+  else {
+    LOG(data, "Shuffling line index");
+    if(lengthIndex_) {
+      next.order = permutation(index_->valid.size());
+      for(auto& i : next.order)
+        i = index_->valid[i];
+    }
+    else {
+      next.order = permutation(index_->lineOffsets[0].size());
+    }
+  }
+  return next;
 }
 
 void Corpus::reset() {
-  files_.clear();
-  for(auto& path : textPaths_) {
-    files_.emplace_back(new InputFileStream(path));
+  parsed_.clear();
+  pos_ = shard_;
+  if(!master_)
+    return;
+
+  index_->order.clear();
+  if(lengthIndex_) {
+    if(index_->lineOffsets.empty())
+      indexFiles();
+    index_->order = index_->valid;
+  }
+  else if(!binary_ && shards_ > 1) {
+    // shards of a text corpus read through the line index in corpus order
+    if(index_->lineOffsets.empty())
+      indexFiles();
+    index_->order.resize(index_->lineOffsets[0].size());
+    std::iota(index_->order.begin(), index_->order.end(), 0);
+  }
+  else if(!binary_) {
+    openFiles();
   }
 }
 
-void Corpus::shuffleFiles(const std::vector<std::string>& paths) {
+void Corpus::indexFiles() {
+  // next to the local copy of a remote corpus
+  std::string cache = io::fetch(textPaths_[0]) + ".index";
+  if(!lengthIndex_ || !loadIndex(cache)) {
+    LOG(data, "Indexing line offsets");
+    size_t lines = std::numeric_limits<size_t>::max();
+    index_->lineOffsets.clear();
+    index_->lengths.clear();
+    for(auto& path : textPaths_) {
+      std::ifstream in(io::fetch(path), std::ios::binary);
+      UTIL_THROW_IF2(!in, "File " << path << " does not exist");
+      std::vector<uint64_t> offsets;
+      std::vector<uint32_t> lengths;
+      std::vector<char> buffer(1 << 20);
+      uint64_t position = 0;
+      bool lineStart = true;
+      // words counted like Vocab splits lines, on single spaces
+      uint32_t words = 0;
+      bool inWord = false;
+      while(in.read(buffer.data(), buffer.size()) || in.gcount() > 0) {
+        size_t read = in.gcount();
+        for(size_t k = 0; k < read; ++k) {
+          char c = buffer[k];
+          if(lineStart)
+            offsets.push_back(position + k);
+          lineStart = c == '\n';
+          if(!lengthIndex_)
+            continue;
+          if(c == '\n') {
+            lengths.push_back(words + 1);
+            words = 0;
+            inWord = false;
+          }
+          else if(c == ' ') {
+            inWord = false;
+          }
+          else if(!inWord) {
+            words++;
+            inWord = true;
+          }
+        }
+        position += read;
+      }
+      if(lengthIndex_ && lengths.size() < offsets.size())
+        lengths.push_back(words + 1);
+      lines = std::min(lines, offsets.size());
+      index_->lineOffsets.push_back(std::move(offsets));
+      if(lengthIndex_)
+        index_->lengths.push_back(std::move(lengths));
+    }
+    // like reading sequentially, stop at the end of the shortest file
+    for(auto& offsets : index_->lineOffsets)
+      offsets.resize(lines);
+    for(auto& lengths : index_->lengths)
+      lengths.resize(lines);
+    if(lengthIndex_)
+      saveIndex(cache);
+    LOG(data, "Done");
+  }
+
+  if(lengthIndex_) {
+    index_->valid.clear();
+    size_t lines = index_->lineOffsets[0].size();
+    for(size_t i = 0; i < lines; ++i) {
+      bool keep = true;
+      for(auto& lengths : index_->lengths)
+        keep = keep && lengths[i] <= maxLength_;
+      if(keep)
+        index_->valid.push_back(i);
+    }
+    LOG(data, "{} of {} sentence tuples within --max-length {}",
+        index_->valid.size(), lines, maxLength_);
+  }
+}
+
+/**
+ * The cached index is written native-endian as
+ *
+ *     char     magic[8]                 "MARIANI1"
+ *     uint64_t streams, lines
+ *     uint64_t size[streams]            of the text files when indexed
+ *     uint64_t mtime[streams]
+ *     uint64_t offsets[streams][lines]
+ *     uint32_t lengths[streams][lines]
+ *
+ * and is ignored if the files it was built from changed.
+ */
+static const char INDEX_MAGIC[8] = {'M', 'A', 'R', 'I', 'A', 'N', 'I', '1'};
+
+bool Corpus::loadIndex(const std::string& path) {
+  std::ifstream in(path, std::ios::binary);
+  char magic[sizeof(INDEX_MAGIC)];
+  if(!in.read(magic, sizeof(magic)) || std::memcmp(magic, INDEX_MAGIC, sizeof(magic)))
+    return false;
+
+  uint64_t streams, lines;
+  in.read((char*)&streams, sizeof(streams));
+  in.read((char*)&lines, sizeof(lines));
+  if(!in || streams != textPaths_.size())
+    return false;
+
+  std::vector<uint64_t> sizes(streams), mtimes(streams);
+  in.read((char*)sizes.data(), streams * sizeof(uint64_t));
+  in.read((char*)mtimes.data(), streams * sizeof(uint64_t));
+  for(size_t j = 0; j < streams; ++j)
+    if(sizes[j] != boost::filesystem::file_size(textPaths_[j])
+       || mtimes[j] != (uint64_t)boost::filesystem::last_write_time(textPaths_[j]))
+      return false;
+
+  index_->lineOffsets.assign(streams, std::vector<uint64_t>(lines));
+  index_->lengths.assign(streams, std::vector<uint32_t>(lines));
+  for(auto& offsets : index_->lineOffsets)
+    in.read((char*)offsets.data(), lines * sizeof(uint64_t));
+  for(auto& lengths : index_->lengths)
+    in.read((char*)lengths.data(), lines * sizeof(uint32_t));
+  if(!in) {
+    index_->lineOffsets.clear();
+    index_->lengths.clear();
+    return false;
+  }
+
+  LOG(data, "Loaded line index {}", path);
+  return true;
+}
+
+void Corpus::saveIndex(const std::string& path) const {
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  uint64_t streams = textPaths_.size();
+  uint64_t lines = index_->lineOffsets[0].size();
+  out.write(INDEX_MAGIC, sizeof(INDEX_MAGIC));
+  out.write((const char*)&streams, sizeof(streams));
+  out.write((const char*)&lines, sizeof(lines));
+  for(auto& textPath : textPaths_) {
+    uint64_t size = boost::filesystem::file_size(textPath);
+    out.write((const char*)&size, sizeof(size));
+  }
+  for(auto& textPath : textPaths_) {
+    uint64_t mtime = boost::filesystem::last_write_time(textPath);
+    out.write((const char*)&mtime, sizeof(mtime));
+  }
+  for(auto& offsets : index_->lineOffsets)
+    out.write((const char*)offsets.data(), lines * sizeof(uint64_t));
+  for(auto& lengths : index_->lengths)
+    out.write((const char*)lengths.data(), lines * sizeof(uint32_t));
+
+  if(!out)
+    LOG(data, "Warning: could not write line index {}", path);
+}
+
+std::vector<size_t> Corpus::permutation(size_t sentences) {
+  size_t block = options_->has("shuffle-block")
+    ? options_->get<size_t>("shuffle-block") : 0;
+
+  std::vector<size_t> order(sentences);
+  if(block == 0 || block >= sentences) {
+    std::iota(order.begin(), order.end(), 0);
+    std::shuffle(order.begin(), order.end(), g_);
+  }
+  else {
+    // shuffle whole blocks of consecutive sentences, then each block in place
+    std::vector<size_t> blocks((sentences + block - 1) / block);
+    std::iota(blocks.begin(), blocks.end(), 0);
+    std::shuffle(blocks.begin(), blocks.end(), g_);
+
+    auto it = order.begin();
+    for(auto b : blocks) {
+      size_t first = b * block;
+      size_t last = std::min(first + block, sentences);
+      auto start = it;
+      for(size_t i = first; i < last; ++i)
+        *it++ = i;
+      std::shuffle(start, it, g_);
+    }
+  }
+  return order;
+}
+
+std::vector<std::string> Corpus::shuffleFiles(const std::vector<std::string>& paths,
+                                              const std::string& suffix) {
   LOG(data, "Shuffling files");
   std::vector<std::vector<std::string>> corpus;
 
-  files_.clear();
+  std::vector<UPtr<InputFileStream>> ins;
   for(auto path : paths) {
-    files_.emplace_back(new InputFileStream(path));
+    ins.emplace_back(new InputFileStream(path));
   }
 
   bool cont = true;
   while(cont) {
-    std::vector<std::string> lines(files_.size());
-    for(int i = 0; i < files_.size(); ++i) {
-      cont = cont && std::getline((std::istream&)*files_[i],
+    std::vector<std::string> lines(ins.size());
+    for(int i = 0; i < ins.size(); ++i) {
+      cont = cont && std::getline((std::istream&)*ins[i],
                                   lines[i]);
     }
     if(cont)
       corpus.push_back(lines);
   }
+  ins.clear();
 
   std::shuffle(corpus.begin(), corpus.end(), g_);
 
+  std::vector<std::string> shuffled;
   std::vector<UPtr<OutputFileStream>> outs;
-  for(int i = 0; i < files_.size(); ++i) {
-    auto path = files_[i]->path();
-    outs.emplace_back(new OutputFileStream(path + ".shuf"));
+  for(auto& path : paths) {
+    shuffled.push_back(path + suffix);
+    outs.emplace_back(new OutputFileStream(shuffled.back()));
   }
-  files_.clear();
 
   for(auto& lines : corpus) {
     size_t i = 0;
@@ -166,14 +625,10 @@ void Corpus::shuffleFiles(const std::vector<std::string>& paths) {
       (std::ostream&)*outs[i++] << line << std::endl;
     }
   }
-
-  for(int i = 0; i < outs.size(); ++i) {
-    auto path = outs[i]->path();
-    outs[i].reset();
-    files_.emplace_back(new InputFileStream(path));
-  }
+  outs.clear();
 
   LOG(data, "Done");
+  return shuffled;
 }
 
 }
@@ -1,41 +1,154 @@
 #pragma once
 
+#include <algorithm>
+#include <deque>
 #include <iostream>
 #include <fstream>
+#include <future>
+#include <numeric>
 #include <boost/iterator/iterator_facade.hpp>
 
+#include "common/thread_pool.h"
 #include "training/config.h"
 #include "common/definitions.h"
 #include "data/vocab.h"
+#include "data/binary_corpus.h"
+#include "data/sample_arena.h"
+#include "data/pipeline_stats.h"
 #include "common/file_stream.h"
 
 namespace marian {
 namespace data {
 
-typedef std::vector<size_t> WordBatch;
-typedef std::vector<float> MaskBatch;
-typedef std::pair<WordBatch, MaskBatch> WordMask;
-typedef std::vector<WordMask> SentBatch;
-
 typedef std::vector<Words> SentenceTuple;
 
+/**
+ * @brief Word ids and masks of one stream of a batch in two contiguous,
+ * time-major buffers: position  t  of sentence  b  is at t * batchSize() + b.
+ * Models pass these buffers to the graph as they are.
+ */
+class SubBatch {
+  private:
+    std::vector<Word> indices_;
+    std::vector<float> mask_;
+    size_t size_;
+    size_t width_;
+
+  public:
+    SubBatch(size_t size, size_t width)
+    : indices_(size * width, 0), mask_(size * width, 0), size_(size), width_(width) {}
+
+    std::vector<Word>& indices() {
+      return indices_;
+    }
+
+    const std::vector<Word>& indices() const {
+      return indices_;
+    }
+
+    std::vector<float>& mask() {
+      return mask_;
+    }
+
+    const std::vector<float>& mask() const {
+      return mask_;
+    }
+
+    /** @brief Number of sentences */
+    size_t batchSize() const {
+      return size_;
+    }
+
+    /** @brief Number of timesteps, the length of the longest sentence */
+    size_t batchWidth() const {
+      return width_;
+    }
+
+    /**
+     * @brief For every timestep the number of leading sentences up to the
+     * last one that is not masked there. Batches sort sentences longest first,
+     * so the later rows of a step are padding, see RNN::applySteps().
+     */
+    std::vector<size_t> activeRows() const {
+      std::vector<size_t> active(width_, 0);
+      for(size_t t = 0; t < width_; ++t)
+        for(size_t b = size_; b > 0; --b)
+          if(mask_[t * size_ + b - 1] != 0) {
+            active[t] = b;
+            break;
+          }
+      return active;
+    }
+
+    /**
+     * @brief Sentences  start  to  end  (exclusive), without trailing
+     * timesteps that are masked in all of them
+     */
+    /** @brief Positions of sentence  b  that are not masked */
+    size_t length(size_t b) const {
+      size_t length = 0;
+      for(size_t t = 0; t < width_; ++t)
+        if(mask_[t * size_ + b] != 0)
+          length++;
+      return length;
+    }
+
+    /**
+     * @brief Sentence  rows[i].second  of  *rows[i].first  as sentence  i , the
+     * width is that of the longest of them
+     */
+    static SubBatch gather(const std::vector<std::pair<const SubBatch*, size_t>>& rows) {
+      size_t width = 1;
+      for(auto& row : rows)
+        width = std::max(width, row.first->width_);
+
+      SubBatch sub(rows.size(), width);
+      for(size_t i = 0; i < rows.size(); ++i) {
+        const SubBatch& from = *rows[i].first;
+        for(size_t t = 0; t < from.width_; ++t) {
+          sub.indices_[t * rows.size() + i] = from.indices_[t * from.size_ + rows[i].second];
+          sub.mask_[t * rows.size() + i] = from.mask_[t * from.size_ + rows[i].second];
+        }
+      }
+      return sub;
+    }
+
+    SubBatch slice(size_t start, size_t end) const {
+      size_t size = end - start;
+      size_t width = 1;
+      for(size_t t = 0; t < width_; ++t)
+        for(size_t b = start; b < end; ++b)
+          if(mask_[t * size_ + b] != 0)
+            width = t + 1;
+
+      SubBatch sub(size, width);
+      for(size_t t = 0; t < width; ++t) {
+        std::copy(indices_.begin() + t * size_ + start, indices_.begin() + t * size_ + end,
+                  sub.indices_.begin() + t * size);
+        std::copy(mask_.begin() + t * size_ + start, mask_.begin() + t * size_ + end,
+                  sub.mask_.begin() + t * size);
+      }
+      return sub;
+    }
+};
+
 class CorpusBatch {
   public:
-    CorpusBatch(const std::vector<SentBatch>& batches, size_t words = 0)
+    CorpusBatch(const std::vector<SubBatch>& batches, size_t words = 0)
     : batches_(batches), words_(words) {}
 
-    const SentBatch& operator[](size_t i) const {
+    const SubBatch& operator[](size_t i) const {
       return batches_[i];
     }
 
     void debug() {
       size_t i = 0;
-      for(auto l : batches_) {
+      for(auto& sub : batches_) {
         std::cerr << "input " << i++ << ": " << std::endl;
-        for(auto b : l) {
+        for(size_t t = 0; t < sub.batchWidth(); ++t) {
           std::cerr << "\t w: ";
-          for(auto w : b.first) {
-            std::cerr << w << " ";
+          for(size_t b = 0; b < sub.batchSize(); ++b) {
+            std::cerr << sub.indices()[t * sub.batchSize() + b] << " ";
           }
           std::cerr << std::endl;
         }
@@ -43,7 +156,7 @@ class CorpusBatch {
     }
 
     size_t size() const {
-      return batches_[0][0].first.size();
+      return batches_[0].batchSize();
     }
 
     size_t words() const {
@@ -54,9 +167,177 @@ class CorpusBatch {
       return batches_.size();
     }
 
+    /**
+     * @brief Positions of the sentences in the order they were read from the
+     * corpus, e.g. line numbers when translating. Batches sort by length.
+     */
+    const std::vector<size_t>& getSentenceIds() const {
+      return sentenceIds_;
+    }
+
+    void setSentenceIds(const std::vector<size_t>& ids) {
+      sentenceIds_ = ids;
+    }
+
+    /**
+     * @brief Splits the sentences into at most  n  batches of nearly equal size.
+     *
+     * Trailing positions that are masked in all sentences of a part are dropped,
+     * so parts without the longest sentences are also shorter.
+     */
+    std::vector<Ptr<CorpusBatch>> split(size_t n) const {
+      size_t dimBatch = size();
+      n = std::max((size_t)1, std::min(n, dimBatch));
+
+      std::vector<Ptr<CorpusBatch>> parts;
+      size_t start = 0;
+      for(size_t p = 0; p < n; ++p) {
+        size_t end = start + (dimBatch - start) / (n - p);
+        parts.push_back(part(start, end));
+        start = end;
+      }
+      return parts;
+    }
+
+    /**
+     * @brief The sentences of all  batches  in one batch, sorted by length like
+     * the batches of a BatchGenerator, the longest first. Sentence ids are
+     * kept if all batches have them.
+     */
+    static Ptr<CorpusBatch> merge(const std::vector<Ptr<CorpusBatch>>& batches) {
+      typedef std::pair<size_t, size_t> Row;
+      std::vector<Row> rows;
+      std::vector<std::vector<size_t>> lengths;
+      bool ids = true;
+      size_t words = 0;
+      for(size_t i = 0; i < batches.size(); ++i) {
+        for(size_t b = 0; b < batches[i]->size(); ++b) {
+          rows.push_back(Row(i, b));
+          std::vector<size_t> length;
+          for(auto& sub : batches[i]->batches_)
+            length.push_back(sub.length(b));
+          lengths.push_back(length);
+        }
+        ids = ids && !batches[i]->sentenceIds_.empty();
+        words += batches[i]->words();
+      }
+
+      std::vector<size_t> order(rows.size());
+      std::iota(order.begin(), order.end(), 0);
+      std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return lengths[a] > lengths[b];
+      });
+
+      std::vector<SubBatch> subs;
+      for(size_t j = 0; j < batches[0]->sets(); ++j) {
+        std::vector<std::pair<const SubBatch*, size_t>> gathered;
+        for(auto o : order)
+          gathered.push_back(std::make_pair(&batches[rows[o].first]->batches_[j],
+                                            rows[o].second));
+        subs.push_back(SubBatch::gather(gathered));
+      }
+
+      auto merged = New<CorpusBatch>(subs, words);
+      if(ids) {
+        std::vector<size_t> sentenceIds;
+        for(auto o : order)
+          sentenceIds.push_back(batches[rows[o].first]->sentenceIds_[rows[o].second]);
+        merged->setSentenceIds(sentenceIds);
+      }
+      return merged;
+    }
+
+    /**
+     * @brief Splits the sentences, sorted longest first, into at most  n
+     * consecutive batches whose largest padded size, sentences times the longest
+     * sentence summed over all streams, is as small as possible. Parts then take
+     * about the same time to train on, see split() for parts of equal size.
+     */
+    std::vector<Ptr<CorpusBatch>> splitBalanced(size_t n) const {
+      size_t dimBatch = size();
+      n = std::max((size_t)1, std::min(n, dimBatch));
+
+      std::vector<std::vector<size_t>> lengths(batches_.size());
+      for(size_t j = 0; j < batches_.size(); ++j)
+        for(size_t b = 0; b < dimBatch; ++b)
+          lengths[j].push_back(batches_[j].length(b));
+
+      // ends of the parts of at most  limit  padded words each, greedily
+      auto cut = [&](size_t limit) {
+        std::vector<size_t> ends;
+        std::vector<size_t> widths(batches_.size(), 0);
+        size_t start = 0;
+        for(size_t b = 0; b < dimBatch; ++b) {
+          size_t padded = 0;
+          for(size_t j = 0; j < batches_.size(); ++j)
+            padded += std::max(widths[j], lengths[j][b]) * (b - start + 1);
+          if(padded > limit && b > start) {
+            ends.push_back(b);
+            start = b;
+            std::fill(widths.begin(), widths.end(), 0);
+          }
+          for(size_t j = 0; j < batches_.size(); ++j)
+            widths[j] = std::max(widths[j], lengths[j][b]);
+        }
+        ends.push_back(dimBatch);
+        return ends;
+      };
+
+      // the smallest limit that needs no more than n parts
+      size_t low = 1;
+      size_t high = 0;
+      for(auto& sub : batches_)
+        high += sub.batchWidth() * dimBatch;
+      while(low < high) {
+        size_t mid = low + (high - low) / 2;
+        if(cut(mid).size() <= n)
+          high = mid;
+        else
+          low = mid + 1;
+      }
+
+      // every part gets sentences, the largest parts are halved for missing ones
+      auto ends = cut(high);
+      while(ends.size() < n) {
+        size_t widest = 0;
+        for(size_t p = 1; p < ends.size(); ++p)
+          if(ends[p] - ends[p - 1] > ends[widest] - (widest ? ends[widest - 1] : 0))
+            widest = p;
+        size_t start = widest ? ends[widest - 1] : 0;
+        ends.insert(ends.begin() + widest, start + (ends[widest] - start) / 2);
+      }
+
+      std::vector<Ptr<CorpusBatch>> parts;
+      size_t start = 0;
+      for(auto end : ends) {
+        parts.push_back(part(start, end));
+        start = end;
+      }
+      return parts;
+    }
+
   private:
-    std::vector<SentBatch> batches_;
+    std::vector<SubBatch> batches_;
     size_t words_;
+    std::vector<size_t> sentenceIds_;
+
+    /** @brief Sentences  start  to  end  (exclusive) as a batch of their own */
+    Ptr<CorpusBatch> part(size_t start, size_t end) const {
+      std::vector<SubBatch> batches;
+      for(auto& sub : batches_)
+        batches.push_back(sub.slice(start, end));
+
+      size_t words = 0;
+      for(auto m : batches[0].mask())
+        if(m != 0)
+          words++;
+
+      auto part = New<CorpusBatch>(batches, words);
+      if(!sentenceIds_.empty())
+        part->setSentenceIds(std::vector<size_t>(sentenceIds_.begin() + start,
+                                                 sentenceIds_.begin() + end));
+      return part;
+    }
 };
 
 class Corpus;
@@ -85,6 +366,11 @@ class CorpusIterator
     long long int pos_;
 };
 
+/**
+ * @brief Aligned training or input data, read either from text files or,
+ * if a single path names a file created by marian-binarize, from a
+ * memory-mapped BinaryCorpus.
+ */
 class Corpus {
   private:
     Ptr<Config> options_;
@@ -97,7 +383,65 @@ class Corpus {
     std::random_device rd_;
     std::mt19937 g_;
 
-    void shuffleFiles(const std::vector<std::string>& paths);
+    Ptr<BinaryCorpus> binary_;
+
+    // sentences are read in the order of order if not empty, text files then
+    // through rawFiles_ at the line offsets of lineOffsets. With --length-index
+    // lengths holds the words per line and stream including </s>, and order
+    // only contains the lines in valid, those within --max-length
+    struct Index {
+      std::vector<size_t> order;
+      std::vector<std::vector<uint64_t>> lineOffsets;
+      std::vector<std::vector<uint32_t>> lengths;
+      std::vector<size_t> valid;
+    };
+    Ptr<Index> index_;
+    size_t pos_{0};
+    std::vector<UPtr<std::ifstream>> rawFiles_;
+
+    // this instance reads positions shard_, shard_ + shards_, ... of the
+    // index, which only the master shuffles or resets
+    size_t shard_{0};
+    size_t shards_{1};
+    bool master_{true};
+
+    bool lengthIndex_{false};
+
+    // with --data-threads > 1 lines are converted to tuples in chunks by pool_
+    UPtr<ThreadPool> pool_;
+    size_t threads_{1};
+    std::deque<SentenceTuple> parsed_;
+
+    Ptr<PipelineStats> stats_{New<PipelineStats>()};
+
+    // the result of a shuffle, a sentence order or shuffled copies of the
+    // text files, see shuffled()
+    struct Shuffled {
+      std::vector<size_t> order;
+      std::vector<std::string> files;
+    };
+    // --stream-epochs: the next shuffle, computed while this one is read
+    bool streaming_{false};
+    std::future<Shuffled> nextShuffle_;
+
+    void openFiles();
+    void openRawFiles();
+    void bindOptions();
+    void indexFiles();
+    bool loadIndex(const std::string& path);
+    void saveIndex(const std::string& path) const;
+    bool compressed() const;
+    std::vector<size_t> permutation(size_t sentences);
+    std::vector<std::string> shuffleFiles(const std::vector<std::string>& paths,
+                                          const std::string& suffix);
+    Shuffled shuffled(const std::string& suffix);
+    bool nextLines(std::vector<std::string>& lines);
+    bool toTuple(const std::vector<std::string>& lines, SentenceTuple& tup) const;
+    bool parseChunk();
+    bool nextBinary(SentenceTuple& tup);
+
+    // lines of the text files read by next()
+    std::vector<std::string> lines_;
 
   public:
     typedef CorpusBatch batch_type;
@@ -112,10 +456,44 @@ class Corpus {
            std::vector<Ptr<Vocab>> vocabs,
            Ptr<Config> options);
 
+    /**
+     * @brief Shard  shard  of  master , see setShard(). Shares the vocabularies,
+     * the binary corpus and the sentence index with  master .
+     */
+    Corpus(Corpus& master, size_t shard);
+
+    /**
+     * @brief Reads only every  shards -th sentence of the (shuffled) corpus,
+     * starting with the  shard -th. Further shards of this corpus are created
+     * with Corpus(master, shard) and read disjoint sentences; shuffle() and
+     * reset() of the master change the order for all of them, and must not run
+     * while they read. Requires a binary or an uncompressed text corpus.
+     */
+    void setShard(size_t shard, size_t shards);
+
     sample next();
 
+    /**
+     * @brief Reads the next sample into  tup , reusing its buffers where the
+     * format allows. Returns false and leaves  tup  empty at the end.
+     */
+    bool next(sample& tup);
+
+    /**
+     * @brief Restarts reading in a new random order. With --stream-epochs the
+     * order of the following shuffle() is then computed in the background.
+     */
     void shuffle();
 
+    /**
+     * @brief True if shuffle() only takes over an order computed in the
+     * background, see --stream-epochs. Needs a single shard, as a master
+     * cannot shuffle while its other shards read.
+     */
+    bool streaming() const {
+      return streaming_ && shards_ == 1;
+    }
+
     void reset();
 
     iterator begin() {
@@ -130,38 +508,78 @@ class Corpus {
       return vocabs_;
     }
 
-    batch_ptr toBatch(const std::vector<sample>& batchVector) {
-      int batchSize = batchVector.size();
+    /** @brief Counters for reading and parsing, shared with a BatchGenerator */
+    Ptr<PipelineStats> stats() {
+      return stats_;
+    }
+
+    void setStats(Ptr<PipelineStats> stats) {
+      stats_ = stats;
+    }
+
+    static batch_ptr toBatch(const std::vector<sample>& batchVector) {
+      size_t batchSize = batchVector.size();
       size_t words = 0;
 
-      std::vector<int> maxDims;
+      std::vector<size_t> maxDims;
       for(auto& ex : batchVector) {
         if(maxDims.size() < ex.size())
           maxDims.resize(ex.size(), 0);
-        for(int i = 0; i < ex.size(); ++i) {
+        for(size_t i = 0; i < ex.size(); ++i) {
           if(ex[i].size() > maxDims[i])
           maxDims[i] = ex[i].size();
         }
       }
 
-      std::vector<SentBatch> langs;
-      for(auto m : maxDims) {
-        langs.push_back(SentBatch(m,
-                                  { WordBatch(batchSize, 0),
-                                    MaskBatch(batchSize, 0) } ));
-      }
-
-      for(int i = 0; i < batchSize; ++i) {
-        for(int j = 0; j < maxDims.size(); ++j) {
-          for(int k = 0; k < batchVector[i][j].size(); ++k) {
-            langs[j][k].first[i] = batchVector[i][j][k];
-            langs[j][k].second[i] = 1.f;
+      std::vector<SubBatch> subBatches;
+      for(auto m : maxDims)
+        subBatches.emplace_back(batchSize, m);
+
+      for(size_t i = 0; i < batchSize; ++i) {
+        for(size_t j = 0; j < maxDims.size(); ++j) {
+          auto& indices = subBatches[j].indices();
+          auto& mask = subBatches[j].mask();
+          for(size_t k = 0; k < batchVector[i][j].size(); ++k) {
+            indices[k * batchSize + i] = batchVector[i][j][k];
+            mask[k * batchSize + i] = 1.f;
             if(j == 0)
               words++;
           }
         }
       }
-      return batch_ptr(new batch_type(langs, words));
+      return batch_ptr(new batch_type(subBatches, words));
+    }
+
+    /** @brief Batch of the  n  samples of  arena  at the positions  samples  */
+    static batch_ptr toBatch(const SampleArena& arena,
+                             const size_t* samples,
+                             size_t n) {
+      size_t words = 0;
+
+      std::vector<SubBatch> subBatches;
+      subBatches.reserve(arena.streams());
+      for(size_t j = 0; j < arena.streams(); ++j) {
+        size_t width = 0;
+        for(size_t i = 0; i < n; ++i)
+          width = std::max(width, arena.length(samples[i], j));
+        subBatches.emplace_back(n, width);
+      }
+
+      for(size_t j = 0; j < arena.streams(); ++j) {
+        auto& indices = subBatches[j].indices();
+        auto& mask = subBatches[j].mask();
+        for(size_t i = 0; i < n; ++i) {
+          const Word* sentence = arena.words(samples[i], j);
+          size_t length = arena.length(samples[i], j);
+          for(size_t k = 0; k < length; ++k) {
+            indices[k * n + i] = sentence[k];
+            mask[k * n + i] = 1.f;
+          }
+          if(j == 0)
+            words += length;
+        }
+      }
+      return batch_ptr(new batch_type(subBatches, words));
     }
 };
 
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+namespace marian {
+namespace data {
+
+/**
+ * @brief Counters of the training data pipeline, filled by the corpus and the
+ * batch generator and read and reset by the Reporter every --disp-freq
+ * batches.
+ *
+ * Each stage counts the items it produced and the microseconds it was busy,
+ * so items / busy time is what the stage could deliver if it never waited.
+ * Time spent in BatchGenerator::next() is time the trainer was starved.
+ */
+struct PipelineStats {
+  struct Stage {
+    std::atomic<uint64_t> items{0};
+    std::atomic<uint64_t> micros{0};
+  };
+
+  Stage read;   // lines read from the files or the binary corpus
+  Stage parse;  // sentence tuples created from lines
+  Stage batch;  // batches sorted and converted
+
+  std::atomic<uint64_t> waitMicros{0};
+  std::atomic<uint64_t> nexts{0};
+  // sum over next() calls of the batches ready in the prefetch queue
+  std::atomic<uint64_t> queued{0};
+
+  std::atomic<uint64_t> words{0};
+  std::atomic<uint64_t> paddedWords{0};
+};
+
+/** @brief Adds the lifetime of the timer in microseconds to  micros  */
+class StageTimer {
+  private:
+    std::atomic<uint64_t>& micros_;
+    std::chrono::steady_clock::time_point start_;
+
+  public:
+    StageTimer(std::atomic<uint64_t>& micros)
+     : micros_(micros), start_(std::chrono::steady_clock::now()) {}
+
+    ~StageTimer() {
+      micros_ += std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start_).count();
+    }
+};
+
+}
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <vector>
+
+#include "3rd_party/exception.h"
+#include "data/types.h"
+
+namespace marian {
+namespace data {
+
+/**
+ * @brief The words of a maxi-batch of samples in one flat buffer.
+ *
+ * Samples are sorted and grouped into batches through their positions in the
+ * arena instead of being copied around as vectors per sentence. clear() keeps
+ * the capacity, so an arena that is reused for every maxi-batch stops
+ * allocating once it held the largest one.
+ */
+class SampleArena {
+  private:
+    std::vector<Word> words_;
+    // end of every stream of every sample in words_, streams_ per sample
+    std::vector<size_t> ends_;
+    size_t streams_{0};
+    size_t size_{0};
+
+  public:
+    void clear() {
+      words_.clear();
+      ends_.clear();
+      size_ = 0;
+    }
+
+    /** @brief Appends the streams of  tup , which all samples must have as many of */
+    template <class Tuple>
+    void add(const Tuple& tup) {
+      if(size_ == 0)
+        streams_ = tup.size();
+      UTIL_THROW_IF2(tup.size() != streams_,
+                     "Sample with " << tup.size() << " streams, expected " << streams_);
+      for(auto& words : tup) {
+        words_.insert(words_.end(), words.begin(), words.end());
+        ends_.push_back(words_.size());
+      }
+      size_++;
+    }
+
+    size_t size() const {
+      return size_;
+    }
+
+    size_t streams() const {
+      return streams_;
+    }
+
+    /** @brief Number of words of stream  s  of sample  i  */
+    size_t length(size_t i, size_t s) const {
+      size_t k = i * streams_ + s;
+      return ends_[k] - (k ? ends_[k - 1] : 0);
+    }
+
+    /** @brief First word of stream  s  of sample  i  */
+    const Word* words(size_t i, size_t s) const {
+      size_t k = i * streams_ + s;
+      return words_.data() + (k ? ends_[k - 1] : 0);
+    }
+};
+
+}
+}
@@ -0,0 +1,73 @@
+#include <algorithm>
+#include <sstream>
+
+#include "data/shortlist.h"
+#include "common/file_stream.h"
+#include "common/logging.h"
+
+namespace marian {
+namespace data {
+
+Shortlist::Shortlist(const std::string& path,
+                     Ptr<Vocab> srcVocab,
+                     Ptr<Vocab> trgVocab,
+                     size_t best,
+                     size_t frequent)
+  : frequent_(std::max(frequent, (size_t)UNK_ID + 1)) {
+
+  std::unordered_map<size_t, std::vector<std::pair<float, size_t>>> scored;
+
+  InputFileStream in(path);
+  std::string line;
+  while(std::getline((std::istream&)in, line)) {
+    std::istringstream fields(line);
+    std::string src, trg;
+    float prob;
+    if(!(fields >> src >> trg >> prob))
+      continue;
+
+    size_t srcId = (*srcVocab)[src];
+    size_t trgId = (*trgVocab)[trg];
+    if(srcId == UNK_ID || trgId == UNK_ID)
+      continue;
+    scored[srcId].emplace_back(prob, trgId);
+  }
+
+  size_t entries = 0;
+  for(auto& s : scored) {
+    auto& candidates = s.second;
+    size_t n = std::min(best, candidates.size());
+    std::partial_sort(candidates.begin(), candidates.begin() + n, candidates.end(),
+                      [](const std::pair<float, size_t>& a,
+                         const std::pair<float, size_t>& b) {
+                        return a.first > b.first;
+                      });
+
+    auto& ids = translations_[s.first];
+    for(size_t i = 0; i < n; ++i)
+      ids.push_back(candidates[i].second);
+    entries += n;
+  }
+
+  LOG(info, "Loaded shortlist with {} translations of {} source words",
+      entries, translations_.size());
+}
+
+std::vector<size_t> Shortlist::generate(Ptr<CorpusBatch> batch) const {
+  std::vector<size_t> ids;
+  for(size_t i = 0; i < frequent_; ++i)
+    ids.push_back(i);
+
+  for(auto w : (*batch)[0].indices()) {
+    auto it = translations_.find(w);
+    if(it != translations_.end())
+      ids.insert(ids.end(), it->second.begin(), it->second.end());
+  }
+
+  std::sort(ids.begin(), ids.end());
+  ids.erase(std::unique(ids.begin(), ids.end()), ids.end());
+  return ids;
+}
+
+}
+}
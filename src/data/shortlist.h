@@ -0,0 +1,41 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common/definitions.h"
+#include "data/corpus.h"
+#include "data/vocab.h"
+
+namespace marian {
+namespace data {
+
+/**
+ * @brief Candidate target words of a batch for decoding with a reduced output
+ * layer.
+ *
+ * Reads a lexical table with one "source target probability" triple of words
+ * per line and keeps the  best  most probable translations of every source
+ * word. The candidates of a batch are these translations of all its source
+ * words plus the  frequent  most frequent target words, i.e. the first ids of
+ * the frequency-sorted vocabulary, which always include EOS and UNK.
+ */
+class Shortlist {
+  private:
+    std::unordered_map<size_t, std::vector<size_t>> translations_;
+    size_t frequent_;
+
+  public:
+    Shortlist(const std::string& path,
+              Ptr<Vocab> srcVocab,
+              Ptr<Vocab> trgVocab,
+              size_t best,
+              size_t frequent);
+
+    /** @brief Sorted target ids for the sentences of the first input of  batch  */
+    std::vector<size_t> generate(Ptr<CorpusBatch> batch) const;
+};
+
+}
+}
@@ -1,23 +1,80 @@
 
 #include <sstream>
 #include <algorithm>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <future>
 #include <unordered_map>
 
 #include "data/vocab.h"
 #include "common/utils.h"
 #include "common/file_stream.h"
 #include "3rd_party/exception.h"
+#include "common/thread_pool.h"
 #include "3rd_party/yaml-cpp/yaml.h"
 #include "common/logging.h"
 
+static const Word NO_WORD = (Word)-1;
+
+static const char MAGIC[8] = {'M', 'A', 'R', 'I', 'A', 'N', 'V', '1'};
+static const size_t HEADER = sizeof(MAGIC) + 2 * sizeof(uint64_t);
+
+// FNV-1a
+static inline uint64_t hashWord(const char* word, size_t length) {
+  uint64_t hash = 14695981039346656037ull;
+  for(size_t i = 0; i < length; ++i) {
+    hash ^= (unsigned char)word[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
 Vocab::Vocab() {}
 
-size_t Vocab::operator[](const std::string& word) const {
-  auto it = str2id_.find(word);
-  if(it != str2id_.end())
-    return it->second;
-  else
+void Vocab::buildTable(const std::vector<std::pair<std::string, Word>>& entries) {
+  size_t capacity = 16;
+  while(capacity < 2 * entries.size())
+    capacity *= 2;
+
+  table_.assign(capacity, {0, 0, 0, NO_WORD});
+  names_.assign(2 * size_, 0);
+  keys_.clear();
+  for(auto& entry : entries) {
+    const std::string& key = entry.first;
+    uint64_t hash = hashWord(key.data(), key.size());
+    size_t i = hash & (capacity - 1);
+    while(table_[i].id != NO_WORD)
+      i = (i + 1) & (capacity - 1);
+    table_[i] = {hash, keys_.size(), key.size(), entry.second};
+    names_[2 * entry.second] = keys_.size();
+    names_[2 * entry.second + 1] = key.size();
+    keys_ += key;
+  }
+
+  slots_ = table_.data();
+  capacity_ = capacity;
+  pool_ = keys_.data();
+  nameIndex_ = names_.data();
+}
+
+Word Vocab::lookup(const char* word, size_t length) const {
+  if(capacity_ == 0)
     return UNK_ID;
+
+  uint64_t hash = hashWord(word, length);
+  size_t mask = capacity_ - 1;
+  for(size_t i = hash & mask; slots_[i].id != NO_WORD; i = (i + 1) & mask) {
+    const Slot& slot = slots_[i];
+    if(slot.hash == hash && slot.length == length
+       && !std::memcmp(pool_ + slot.offset, word, length))
+      return slot.id < max_ ? slot.id : UNK_ID;
+  }
+  return UNK_ID;
+}
+
+size_t Vocab::operator[](const std::string& word) const {
+  return lookup(word.data(), word.size());
 }
 
 Words Vocab::operator()(const std::vector<std::string>& lineTokens, bool addEOS) const {
@@ -30,9 +87,22 @@ Words Vocab::operator()(const std::vector<std::string>& lineTokens, bool addEOS)
 }
 
 Words Vocab::operator()(const std::string& line, bool addEOS) const {
-  std::vector<std::string> lineTokens;
-  Split(line, lineTokens, " ");
-  return (*this)(lineTokens, addEOS);
+  // splits on single spaces in place, like Split(line, tokens, " ")
+  Words words;
+  const char* data = line.data();
+  size_t end = line.size();
+  size_t begin = 0;
+  while(begin < end) {
+    size_t pos = line.find(' ', begin);
+    if(pos == std::string::npos)
+      pos = end;
+    if(pos > begin)
+      words.push_back(lookup(data + begin, pos - begin));
+    begin = pos + 1;
+  }
+  if(addEOS)
+    words.push_back(EOS_ID);
+  return words;
 }
 
 std::vector<std::string> Vocab::operator()(const Words& sentence, bool ignoreEOS) const {
@@ -47,17 +117,26 @@ std::vector<std::string> Vocab::operator()(const Words& sentence, bool ignoreEOS
 
 
 const std::string& Vocab::operator[](size_t id) const {
-  UTIL_THROW_IF2(id >= id2str_.size(), "Unknown word id: " << id);
+  UTIL_THROW_IF2(id >= size_, "Unknown word id: " << id);
+  std::call_once(*reverse_, [this]() {
+    id2str_.resize(size_);
+    for(size_t i = 0; i < size_; ++i)
+      id2str_[i].assign(pool_ + nameIndex_[2 * i], nameIndex_[2 * i + 1]);
+    id2str_[EOS_ID] = EOS_STR;
+    id2str_[UNK_ID] = UNK_STR;
+  });
   return id2str_[id];
 }
 
 size_t Vocab::size() const {
-  return id2str_.size();
+  return size_;
 }
 
 void Vocab::loadOrCreate(const std::string& vocabPath,
                          const std::string& trainPath,
-                         int max)
+                         int max,
+                         size_t threads,
+                         size_t sample)
 {
   if(vocabPath.empty()) {
     if(boost::filesystem::exists(trainPath + ".json")) {
@@ -68,12 +147,12 @@ void Vocab::loadOrCreate(const std::string& vocabPath,
       load(trainPath + ".yml", max);
       return;
     }
-    create(trainPath + ".yml", max, trainPath);
+    create(trainPath + ".yml", max, trainPath, threads, sample);
     load(trainPath + ".yml", max);
   }
   else {
     if(!boost::filesystem::exists(vocabPath))
-      create(vocabPath, max, trainPath);
+      create(vocabPath, max, trainPath, threads, sample);
     load(vocabPath, max);
   }
 }
@@ -81,21 +160,110 @@ void Vocab::loadOrCreate(const std::string& vocabPath,
 void Vocab::load(const std::string& vocabPath, int max)
 {
   LOG(data, "Loading vocabulary from {} (max: {})", vocabPath, max);
+  id2str_.clear();
+  reverse_.reset(new std::once_flag);
+  max_ = NO_WORD;
+
+  if(isBinary(vocabPath)) {
+    loadBinary(vocabPath);
+    if(max && size_ > (size_t)max) {
+      max_ = max;
+      size_ = std::max((size_t)max, (size_t)UNK_ID + 1);
+    }
+    return;
+  }
+
+  std::vector<std::pair<std::string, Word>> entries;
   YAML::Node vocab = YAML::Load(InputFileStream(vocabPath));
+  size_ = 0;
   for(auto&& pair : vocab) {
-    auto str = pair.first.as<std::string>();
     auto id = pair.second.as<Word>();
     if(!max || id < (Word)max) {
-      str2id_[str] = id;
-      if(id >= id2str_.size())
-        id2str_.resize(id + 1);
-      id2str_[id] = str;
+      entries.emplace_back(pair.first.as<std::string>(), id);
+      size_ = std::max(size_, (size_t)id + 1);
     }
   }
-  UTIL_THROW_IF2(id2str_.empty(), "Empty vocabulary " << vocabPath);
+  UTIL_THROW_IF2(entries.empty(), "Empty vocabulary " << vocabPath);
 
-  id2str_[EOS_ID] = EOS_STR;
-  id2str_[UNK_ID] = UNK_STR;
+  size_ = std::max(size_, (size_t)UNK_ID + 1);
+  buildTable(entries);
+}
+
+bool Vocab::isBinary(const std::string& path) {
+  std::ifstream in(path, std::ios::binary);
+  char magic[sizeof(MAGIC)];
+  return in.read(magic, sizeof(magic)) && !std::memcmp(magic, MAGIC, sizeof(MAGIC));
+}
+
+void Vocab::loadBinary(const std::string& vocabPath) {
+  file_.open(vocabPath);
+  UTIL_THROW_IF2(!file_.is_open(), "Could not map vocabulary " << vocabPath);
+  UTIL_THROW_IF2(file_.size() < HEADER, "Truncated vocabulary " << vocabPath);
+
+  const uint64_t* header = (const uint64_t*)(file_.data() + sizeof(MAGIC));
+  size_ = header[0];
+  capacity_ = header[1];
+  UTIL_THROW_IF2(capacity_ & (capacity_ - 1), "Corrupt vocabulary " << vocabPath);
+
+  size_t keys = HEADER + capacity_ * sizeof(Slot) + 2 * size_ * sizeof(uint64_t);
+  UTIL_THROW_IF2(size_ <= UNK_ID || file_.size() < keys,
+                 "Truncated vocabulary " << vocabPath);
+  slots_ = (const Slot*)(file_.data() + HEADER);
+  nameIndex_ = (const uint64_t*)(slots_ + capacity_);
+  pool_ = file_.data() + keys;
+
+  size_t poolSize = file_.size() - keys;
+  for(size_t i = 0; i < size_; ++i)
+    UTIL_THROW_IF2(nameIndex_[2 * i] + nameIndex_[2 * i + 1] > poolSize,
+                   "Corrupt vocabulary " << vocabPath);
+
+  table_.clear();
+  keys_.clear();
+  names_.clear();
+}
+
+void Vocab::saveBinary(const std::string& path) const {
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  UTIL_THROW_IF2(!out, "Could not create vocabulary " << path);
+
+  // keys are written in id order, the table and names point into them
+  std::vector<Slot> table(slots_, slots_ + capacity_);
+  std::vector<uint64_t> names(2 * size_, 0);
+  std::string keys;
+  std::vector<uint64_t> offsets(size_, NO_WORD);
+  for(size_t id = 0; id < size_; ++id) {
+    if(nameIndex_[2 * id + 1] == 0)
+      continue;
+    names[2 * id] = keys.size();
+    names[2 * id + 1] = nameIndex_[2 * id + 1];
+    offsets[id] = keys.size();
+    keys.append(pool_ + nameIndex_[2 * id], nameIndex_[2 * id + 1]);
+  }
+  for(auto& slot : table) {
+    if(slot.id == NO_WORD)
+      continue;
+    // words cut off by max stay in the table as unknown, removing them would break probing
+    if(slot.id >= max_)
+      slot.id = UNK_ID;
+    if(slot.id < size_ && offsets[slot.id] != NO_WORD
+       && !std::memcmp(keys.data() + offsets[slot.id], pool_ + slot.offset, slot.length)) {
+      slot.offset = offsets[slot.id];
+    }
+    else {
+      // several words with one id, the names keep one of them
+      keys.append(pool_ + slot.offset, slot.length);
+      slot.offset = keys.size() - slot.length;
+    }
+  }
+
+  uint64_t size = size_, capacity = capacity_;
+  out.write(MAGIC, sizeof(MAGIC));
+  out.write((const char*)&size, sizeof(size));
+  out.write((const char*)&capacity, sizeof(capacity));
+  out.write((const char*)table.data(), table.size() * sizeof(Slot));
+  out.write((const char*)names.data(), names.size() * sizeof(uint64_t));
+  out.write(keys.data(), keys.size());
+  UTIL_THROW_IF2(!out, "Error writing vocabulary " << path);
 }
 
 class Vocab::VocabFreqOrderer {
@@ -106,12 +274,25 @@ class Vocab::VocabFreqOrderer {
     VocabFreqOrderer(std::unordered_map<std::string, size_t>& counter)
     : counter_(counter) {}
 
+    // ties are broken alphabetically, so ids do not depend on hash
+    // table order or on the number of counting threads
     bool operator()(const std::string& a, const std::string& b) const {
-      return counter_[a] > counter_[b];
+      size_t ca = counter_[a], cb = counter_[b];
+      return ca > cb || (ca == cb && a < b);
     }
 };
 
-void Vocab::create(const std::string& vocabPath, int max, const std::string& trainPath)
+typedef std::unordered_map<std::string, size_t> WordCounter;
+
+static void countWords(const std::string& line, WordCounter& counter) {
+  std::vector<std::string> toks;
+  Split(line, toks);
+  for(const std::string &tok: toks)
+    counter[tok]++;
+}
+
+void Vocab::create(const std::string& vocabPath, int max, const std::string& trainPath,
+                   size_t threads, size_t sample)
 {
   LOG(data,"Creating vocabulary {} from {} (max: {})", vocabPath, trainPath, max);
 
@@ -121,21 +302,56 @@ void Vocab::create(const std::string& vocabPath, int max, const std::string& tra
   InputFileStream trainStrm(trainPath);
 
   std::string line;
-  std::unordered_map<std::string, size_t> counter;
-
-  while (getline((std::istream&)trainStrm, line)) {
-    std::vector<std::string> toks;
-    Split(line, toks);
-
-    for (const std::string &tok: toks) {
-      auto iter = counter.find(tok);
-      if (iter == counter.end())
-        counter[tok] = 1;
-      else
-        iter->second++;
+  WordCounter counter;
+  size_t lines = 0;
+  auto more = [&]() {
+    return (!sample || lines < sample) && getline((std::istream&)trainStrm, line);
+  };
+
+  if(threads <= 1) {
+    while(more()) {
+      countWords(line, counter);
+      lines++;
+    }
+  }
+  else {
+    // the reading thread fills chunks of lines, each worker counts into its
+    // own table, tables are merged in the order the chunks were read
+    const size_t chunkSize = 100000;
+    marian::ThreadPool pool(threads, 2 * threads);
+    std::deque<std::future<WordCounter>> counts;
+    auto merge = [&]() {
+      for(auto& count : counts.front().get())
+        counter[count.first] += count.second;
+      counts.pop_front();
+    };
+
+    std::vector<std::string> chunk;
+    bool cont = true;
+    while(cont) {
+      chunk.clear();
+      while(chunk.size() < chunkSize && (cont = more())) {
+        chunk.push_back(std::move(line));
+        lines++;
+      }
+      if(chunk.empty())
+        break;
+      counts.push_back(pool.enqueue([](const std::vector<std::string>& chunk) {
+        WordCounter local;
+        for(auto& line : chunk)
+          countWords(line, local);
+        return local;
+      }, std::move(chunk)));
+      if(counts.size() > 2 * threads)
+        merge();
     }
+    while(!counts.empty())
+      merge();
   }
 
+  if(sample)
+    LOG(data, "Counted words in the first {} lines of {}", lines, trainPath);
+
   std::vector<std::string> vocabVec;
   for(auto& p: counter)
     vocabVec.push_back(p.first);
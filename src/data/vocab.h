@@ -1,11 +1,29 @@
 #pragma once
 
-#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <utility>
 #include <vector>
+#include <boost/iostreams/device/mapped_file.hpp>
 
 #include "data/types.h"
 
+/**
+ * @brief Mapping between words and ids, loaded from YAML or JSON or mapped
+ * from the binary format written by saveBinary(), in host byte order
+ *
+ *     char     magic[8]                        "MARIANV1"
+ *     uint64_t size                            ids, the largest one plus 1
+ *     uint64_t capacity                        slots of the hash table, a power of 2
+ *     Slot     table[capacity]                 hash, offset, length, id, empty: id -1
+ *     uint64_t names[2 * size]                 offset and length by id
+ *     char     keys[]                          the words back to back
+ *
+ * Lookups probe the hash table in place, so a mapped vocabulary is ready
+ * without parsing. Id to word strings are only built on first use, when
+ * output is decoded.
+ */
 class Vocab {
   public:
     Vocab();
@@ -22,16 +40,59 @@ class Vocab {
 
     size_t size() const;
 
-    void loadOrCreate(const std::string& vocabPath, const std::string& textPath, int max=0);
+    void loadOrCreate(const std::string& vocabPath, const std::string& textPath, int max=0,
+                      size_t threads=1, size_t sample=0);
+    /** @brief Loads a YAML, JSON or binary vocabulary, keeping ids below  max  if not 0 */
     void load(const std::string& vocabPath, int max=0);
-    void create(const std::string& vocabPath, int max, const std::string& trainPath);
+
+    /** @brief Writes the vocabulary in the binary format, see load() */
+    void saveBinary(const std::string& path) const;
+
+    /** @brief True if the file starts with the magic of a binary vocabulary */
+    static bool isBinary(const std::string& path);
+
+    /**
+     * @brief Creates a vocabulary ordered by word frequency in  trainPath . Words
+     * are counted in chunks of lines by  threads  threads and, if  sample  is not
+     * 0, only over the first  sample  lines. After EOS and UNK ids follow the
+     * counts, ties alphabetically, so the most frequent words form one block
+     * of low ids, see --shortlist-frequent and --embedding-hot-rows.
+     */
+    void create(const std::string& vocabPath, int max, const std::string& trainPath,
+                size_t threads=1, size_t sample=0);
 
   private:
-    typedef std::map<std::string, size_t> Str2Id;
-    Str2Id str2id_;
+    // open-addressing hash table over the words, which are stored back to
+    // back in a pool, so that lines map to ids without allocations
+    struct Slot {
+      uint64_t hash;
+      uint64_t offset;
+      uint64_t length;
+      uint64_t id;
+    };
+
+    // the table, pool and names of loaded vocabularies, unused when mapped
+    std::vector<Slot> table_;
+    std::string keys_;
+    std::vector<uint64_t> names_;
+    boost::iostreams::mapped_file_source file_;
+
+    // the table, pool and names in use, owned or mapped
+    const Slot* slots_{nullptr};
+    size_t capacity_{0};
+    const char* pool_{nullptr};
+    const uint64_t* nameIndex_{nullptr};
+    size_t size_{0};
+    Word max_{(Word)-1};
+
+    void buildTable(const std::vector<std::pair<std::string, Word>>& entries);
+    void loadBinary(const std::string& vocabPath);
+    Word lookup(const char* word, size_t length) const;
 
+    // built from the pool by the first operator[](size_t)
     typedef std::vector<std::string> Id2Str;
-    Id2Str id2str_;
+    mutable Id2Str id2str_;
+    mutable std::unique_ptr<std::once_flag> reverse_{new std::once_flag};
 
     class VocabFreqOrderer;
 };
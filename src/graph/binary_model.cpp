@@ -0,0 +1,131 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+#include "graph/binary_model.h"
+#include "3rd_party/cnpy/cnpy.h"
+#include "3rd_party/exception.h"
+#include "common/read_ahead.h"
+
+namespace marian {
+
+static const char MAGIC[8] = {'M', 'A', 'R', 'I', 'A', 'N', 'M', '1'};
+
+BinaryModel::BinaryModel(const std::string& path)
+  : file_(io::fetch(path)) {
+  UTIL_THROW_IF2(!file_.is_open(), "Could not map binary model " << path);
+  UTIL_THROW_IF2(file_.size() < sizeof(MAGIC) + 2 * sizeof(uint64_t)
+                 || std::memcmp(file_.data(), MAGIC, sizeof(MAGIC)),
+                 "File " << path << " is not a binary model");
+
+  const char* pos = file_.data() + sizeof(MAGIC);
+  const char* end = file_.data() + file_.size();
+  auto read = [&]() {
+    UTIL_THROW_IF2(pos + sizeof(uint64_t) > end, "Truncated binary model " << path);
+    uint64_t value;
+    std::memcpy(&value, pos, sizeof(value));
+    pos += sizeof(value);
+    return value;
+  };
+
+  uint64_t tensors = read();
+  uint64_t data = read();
+  UTIL_THROW_IF2(data % (ALIGNMENT * sizeof(float)) || data > file_.size(),
+                 "Invalid blob offset in binary model " << path);
+
+  size_ = 0;
+  for(uint64_t i = 0; i < tensors; ++i) {
+    Item item;
+    uint64_t length = read();
+    UTIL_THROW_IF2(pos + length > end, "Truncated binary model " << path);
+    item.name.assign(pos, length);
+    pos += length;
+    item.rows = read();
+    item.cols = read();
+    item.offset = read();
+    size_ = std::max(size_, (size_t)(item.offset + aligned(item.rows * item.cols)));
+    items_.push_back(item);
+  }
+
+  data_ = (const float*)(file_.data() + data);
+  UTIL_THROW_IF2(data + size_ * sizeof(float) > file_.size(),
+                 "Truncated binary model " << path);
+}
+
+bool BinaryModel::isBinary(const std::string& path) {
+  // the magic alone, without fetching a remote file
+  char magic[sizeof(MAGIC)];
+  try {
+    return io::open(path)->read(magic, 0, sizeof(magic)) == sizeof(magic)
+           && !std::memcmp(magic, MAGIC, sizeof(MAGIC));
+  }
+  catch(util::Exception&) {
+    return false;
+  }
+}
+
+void BinaryModel::create(const std::string& path,
+                         std::vector<Item> items,
+                         const std::vector<const float*>& blobs) {
+  UTIL_THROW_IF2(items.size() != blobs.size(), "Every tensor needs a blob");
+
+  std::vector<char> header(MAGIC, MAGIC + sizeof(MAGIC));
+  auto write = [&header](uint64_t value) {
+    header.insert(header.end(), (const char*)&value, (const char*)&value + sizeof(value));
+  };
+
+  size_t headerSize = sizeof(MAGIC) + 2 * sizeof(uint64_t);
+  for(auto& item : items)
+    headerSize += 4 * sizeof(uint64_t) + item.name.size();
+  size_t unit = ALIGNMENT * sizeof(float);
+  uint64_t data = (headerSize + unit - 1) / unit * unit;
+
+  write(items.size());
+  write(data);
+  size_t offset = 0;
+  for(auto& item : items) {
+    item.offset = offset;
+    offset += aligned(item.rows * item.cols);
+    write(item.name.size());
+    header.insert(header.end(), item.name.begin(), item.name.end());
+    write(item.rows);
+    write(item.cols);
+    write(item.offset);
+  }
+  header.resize(data, 0);
+
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  UTIL_THROW_IF2(!out, "Could not create binary model " << path);
+  out.write(header.data(), header.size());
+
+  std::vector<float> padding(ALIGNMENT, 0.f);
+  for(size_t i = 0; i < items.size(); ++i) {
+    size_t elements = items[i].rows * items[i].cols;
+    out.write((const char*)blobs[i], elements * sizeof(float));
+    out.write((const char*)padding.data(), (aligned(elements) - elements) * sizeof(float));
+  }
+  UTIL_THROW_IF2(!out, "Error writing binary model " << path);
+}
+
+size_t BinaryModel::fromNpz(const std::string& npzPath, const std::string& path) {
+  auto numpy = cnpy::npz_load(npzPath);
+
+  std::vector<Item> items;
+  std::vector<const float*> blobs;
+  for(auto& it : numpy) {
+    UTIL_THROW_IF2(it.second.word_size != sizeof(float),
+                   "Tensor " << it.first << " of " << npzPath << " is not float32");
+    Item item;
+    item.name = it.first;
+    item.rows = it.second.shape.size() == 2 ? it.second.shape[0] : 1;
+    item.cols = it.second.shape.empty() ? 1 : it.second.shape.back();
+    items.push_back(item);
+    blobs.push_back((const float*)it.second.data);
+  }
+
+  create(path, items, blobs);
+  numpy.destruct();
+  return items.size();
+}
+
+}
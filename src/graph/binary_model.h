@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <boost/iostreams/device/mapped_file.hpp>
+
+#include "common/definitions.h"
+
+namespace marian {
+
+/**
+ * @brief Read-only, memory-mapped model in the native binary format.
+ *
+ * Loading parses no npz and decompresses nothing, and the blobs are laid out
+ * like the parameters in the Parameters arena of a graph, so the whole model
+ * can be uploaded with a single copy. The file layout, in host byte order, is
+ *
+ *     char     magic[8]                        "MARIANM1"
+ *     uint64_t tensors
+ *     uint64_t data                            byte offset of the first blob
+ *     per tensor:
+ *       uint64_t length, char name[length]
+ *       uint64_t rows, uint64_t cols
+ *       uint64_t offset                        in floats from the first blob
+ *     float    blobs                           each starting on a 256 byte boundary
+ *
+ * Vectors are stored as a single row, as ExpressionGraph::load() creates them.
+ */
+class BinaryModel {
+  public:
+    struct Item {
+      std::string name;
+      size_t rows;
+      size_t cols;
+      size_t offset;
+    };
+
+    /** @brief Floats per alignment unit of the blobs, see Parameters::aligned() */
+    static const size_t ALIGNMENT = 64;
+
+    static size_t aligned(size_t elements) {
+      return (elements + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    }
+
+  private:
+    boost::iostreams::mapped_file_source file_;
+    std::vector<Item> items_;
+    const float* data_;
+    size_t size_;
+
+  public:
+    BinaryModel(const std::string& path);
+
+    const std::vector<Item>& items() const {
+      return items_;
+    }
+
+    /** @brief First blob, valid while the model lives */
+    const float* data() const {
+      return data_;
+    }
+
+    /** @brief Floats from the first blob to the end of the last, including padding */
+    size_t size() const {
+      return size_;
+    }
+
+    /** @brief True if the file starts with the magic of a binary model */
+    static bool isBinary(const std::string& path);
+
+    /**
+     * @brief Writes the tensors  items  into a binary model at  path , blob
+     * i  read from  blobs[i] . Offsets of the items are assigned here.
+     */
+    static void create(const std::string& path,
+                       std::vector<Item> items,
+                       const std::vector<const float*>& blobs);
+
+    /** @brief Converts an npz model into a binary model, returns the number of tensors */
+    static size_t fromNpz(const std::string& npzPath, const std::string& path);
+};
+
+}
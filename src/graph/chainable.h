@@ -33,6 +33,13 @@
 namespace marian {
 
 
+/**
+ * Kernels of a node. A node builds them once with forwardOps() and
+ * backwardOps() and runs them for every forward() and backward() of the node,
+ * e.g. again when a checkpointed node is recomputed. Ops therefore read the
+ * tensors of the node and its children when they run, through the node,
+ * instead of capturing them when they are built.
+ */
 #define NodeOp(op) [=]() { op ; }
 typedef std::vector<std::function<void()>> NodeOps;
 
@@ -44,6 +51,7 @@ typedef std::shared_ptr<Chainable<Tensor>> Expr;
 
 
 class ExpressionGraph;
+struct ElementProgram;
 typedef std::shared_ptr<ExpressionGraph> ExpressionGraphPtr;
 
 /**
@@ -79,6 +87,21 @@ struct Chainable {
     virtual bool trainable() = 0;
     virtual void setTrainable(bool) = 0;
 
+    /** @brief True for nodes that do not own memory but reinterpret the memory of their first child */
+    virtual bool view() { return false; }
+
+    /** @brief False for nodes whose kernels depend on host data uploaded while they run */
+    virtual bool capturable() { return true; }
+
+    /**
+     * @brief Number of instructions this node adds to a fused elementwise program,
+     * 0 for nodes that cannot be fused, see ExpressionGraph::fuse()
+     */
+    virtual size_t fusable() { return 0; }
+
+    /** @brief Appends this node to  program , reading its children from  args ; returns the result register */
+    virtual int fuse(ElementProgram& program, const std::vector<int>& args) { return -1; }
+
     virtual void setId(size_t) = 0;
     virtual size_t getId() = 0;
 
@@ -1,25 +1,63 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <map>
+#include <set>
+#include <deque>
 #include <unordered_set>
 #include <fstream>
+#include <functional>
+#include <mutex>
+#include <numeric>
+#include <chrono>
+#include <thread>
 
 #include "common/definitions.h"
 #include "training/config.h"
 #include "graph/chainable.h"
+#include "graph/binary_model.h"
 #include "graph/parameters.h"
+#include "graph/profiler.h"
+#include "graph/node_pool.h"
 #include "graph/node_operators.h"
 #include "data/batch_generator.h"
 #include "tensors/tensor_allocator.h"
+#include "tensors/memory_planner.h"
 #include "layers/param_initializers.h"
+#include "kernels/block_sparse.h"
 #include "kernels/dropout.h"
-#include "3rd_party/threadpool.h"
+#include "kernels/cuda_helpers.h"
+#include "kernels/element_program.h"
+#include "kernels/gemm_tuner.h"
+#include "kernels/launch_tuner.h"
+#include "kernels/ranges.h"
+#include "common/thread_pool.h"
+#include "common/read_ahead.h"
 #include "3rd_party/cnpy/cnpy.h"
+#include "common/npz_writer.h"
 
 namespace marian {
 
-template <class T, typename ...Args>
-Expr Expression(Args&& ... args);
+template <class T, class First, typename ...Args>
+Expr Expression(First&& first, Args&& ... args);
+
+/**
+ * @brief Granularity of gradient checkpointing, see ExpressionGraph::checkpoint()
+ */
+enum struct checkpoints { none, layer, step };
+
+/**
+ * @brief Device memory of a training step in bytes, see ExpressionGraph::estimate()
+ */
+struct MemoryEstimate {
+  size_t params{0};
+  size_t gradients{0};
+  size_t optimizer{0};
+  size_t workspace{0};
+  /** @brief Workspace without reuse between tensors of disjoint lifetimes */
+  size_t unshared{0};
+};
 
 /**
  * @brief Represents a computation graph of expressions, over which algorithmic differentiation may be performed.
@@ -27,132 +65,2044 @@ Expr Expression(Args&& ... args);
 class ExpressionGraph : public std::enable_shared_from_this<ExpressionGraph> {
   private:
 
-    /** @brief The full list of nodes */
+    /** @brief The full list of nodes */
+
+    size_t count_{0};
+
+    std::vector<Expr> nodes_;
+    std::vector<std::vector<Expr>> tapes_;
+
+    /** @brief Tape group and whether a node is a top node, indexed by node id */
+    std::vector<size_t> groups_;
+    std::vector<bool> top_;
+
+    /** @brief Whether the loss needs a node, see prune(), empty if all are needed */
+    std::vector<bool> live_;
+
+    /** @brief Memory of all nodes created for this graph, see Expression() */
+    Ptr<NodePool> nodePool_{New<NodePool>()};
+
+    /** @brief Maps from name to expression node. */
+    std::map<std::string, Expr> named_;
+
+    /** @brief List of all input nodes of this expression graph. */
+    std::vector<Expr> inputs_;
+
+
+    Parameters params_;
+    Ptr<TensorAllocator> tensors_;
+
+    cublasHandle_t cublasHandle_;
+    size_t device_{0};
+
+    /** @brief Number of dropout seeds handed out, never reset, see dropoutSeed() */
+    size_t dropoutSeeds_{0};
+
+    /** @brief Stream owned by this graph, cuBLAS is bound to it */
+    cudaStream_t stream_{nullptr};
+    cudaEvent_t enter_{nullptr};
+    cudaEvent_t leave_{nullptr};
+
+    /** @brief Scheduling class of stream_, see setPriority() */
+    priority priority_{priority::normal};
+    float share_{1.f};
+
+    /**
+     * @brief Binds the graph's stream as currentStream() of the calling thread for its lifetime.
+     *
+     * Work already enqueued by the caller is ordered before the graph's kernels and
+     * the caller's stream waits for them on exit, both through events, so the host
+     * never blocks. Nested scopes of the same graph are no-ops.
+     */
+    class StreamScope {
+      private:
+        ExpressionGraph* graph_;
+        cudaStream_t previous_;
+        bool bound_{false};
+
+      public:
+        StreamScope(ExpressionGraph* graph)
+          : graph_(graph), previous_(currentStream()) {
+          if(!graph_->stream_ || previous_ == graph_->stream_)
+            return;
+          CUDA_CHECK(cudaEventRecord(graph_->enter_, previous_));
+          CUDA_CHECK(cudaStreamWaitEvent(graph_->stream_, graph_->enter_, 0));
+          currentStream() = graph_->stream_;
+          bound_ = true;
+        }
+
+        ~StreamScope() {
+          if(!bound_)
+            return;
+          cudaEventRecord(graph_->leave_, graph_->stream_);
+          cudaStreamWaitEvent(previous_, graph_->leave_, 0);
+          currentStream() = previous_;
+        }
+    };
+
+    /**
+     * @brief Bounds the device time of a low-priority graph: on exit it waits
+     * for the pass and pauses long enough that the pass took at most the
+     * graph's share of the wall time since entry, see setPriority()
+     */
+    class ThrottleScope {
+      private:
+        ExpressionGraph* graph_;
+        std::chrono::steady_clock::time_point start_;
+
+      public:
+        ThrottleScope(ExpressionGraph* graph)
+          : graph_(graph), start_(std::chrono::steady_clock::now()) {}
+
+        ~ThrottleScope() {
+          if(graph_->priority_ != priority::low || graph_->share_ >= 1.f || !graph_->stream_)
+            return;
+          cudaStreamSynchronize(graph_->stream_);
+          auto busy = std::chrono::steady_clock::now() - start_;
+          std::this_thread::sleep_for(busy * ((1.f - graph_->share_) / graph_->share_));
+        }
+    };
+
+    std::unordered_map<size_t, Expr> hashMap_;
+
+    /**
+     * @brief No-grad execution, see setInference(). Per node id, the number of
+     * forward steps still to read its value and the references held by its
+     * consumers and fused chains.
+     */
+    bool inference_{false};
+    std::vector<size_t> pending_;
+    std::vector<size_t> refs_;
+
+    /** @brief Nodes to be freed by sweep() once they are no longer referenced, nodes before swept_ are known to it */
+    std::vector<size_t> retained_;
+    size_t swept_{0};
+
+    /**
+     * @brief Parameter-derived nodes kept across clear() in inference mode, by
+     * hash, with their values in a separate allocator. Per node id, whether the
+     * node is pinned and whether it was taken over from an earlier graph with
+     * its value already computed.
+     */
+    std::unordered_map<size_t, Expr> pins_;
+    Ptr<TensorAllocator> pinned_;
+    std::vector<bool> isPinned_;
+    std::vector<bool> reused_;
+
+    /** @brief Per node id, whether keep() holds its value for replay() */
+    std::vector<bool> kept_;
+
+    /** @brief Separate arena for node adjoints, cleared with a single memset per backward() */
+    bool adjointArena_{false};
+    bool persistentRnn_{false};
+    size_t hotRows_{0};
+    bool arenaPass_{false};
+
+    // --pad-dims: parameters stored with columns rounded up, see padColumns(),
+    // and the columns they are saved with
+    struct ColumnPadding {
+      size_t multiple;
+      float fill;
+    };
+    std::map<std::string, ColumnPadding> padRules_;
+    std::map<std::string, int> realCols_;
+
+    // see workspacePeakMB(), read by other threads while this one trains
+    std::atomic<size_t> workspaceExtent_{0};
+    Ptr<TensorAllocator> adjoints_;
+
+    /** @brief Planned workspace offsets of node values and adjoints, indexed by node id */
+    bool planMemory_{false};
+    size_t planPeak_{0};
+    MemoryPlanner planner_;
+    std::vector<size_t> planVals_;
+    std::vector<size_t> planAdjs_;
+
+    // a hit on the hash of planSignature() is only reused for an equal signature
+    struct CachedPlan {
+      size_t total;
+      std::vector<size_t> vals;
+      std::vector<size_t> adjs;
+      std::vector<size_t> signature;
+    };
+
+    const size_t PLAN_CACHE_SIZE = 256;
+    std::unordered_map<size_t, CachedPlan> planCache_;
+
+    /** @brief Gradient checkpointing: segment boundaries and values recomputed during backward() */
+    checkpoints checkpointing_{checkpoints::none};
+    std::set<size_t> checkpoints_;
+    std::vector<bool> droppable_;
+    std::vector<std::vector<size_t>> dropAfter_;
+    std::map<size_t, std::vector<size_t>> recompute_;
+
+    /** @brief Elementwise fusion, see fuse(): programs by root node id and the root of every inlined node */
+    bool fusion_{false};
+    struct Fused {
+      ElementProgram program;
+      std::vector<Expr> inputs;
+    };
+    std::unordered_map<size_t, Fused> fused_;
+    std::vector<size_t> inlinedInto_;
+
+    /**
+     * @brief Recorded kernel sequences, see setCudaGraphs(). Per plan signature,
+     * runs of capturable nodes are keyed by their first node id.
+     */
+    bool cudaGraphs_{false};
+    bool replaying_{false};
+    bool capturing_{false};
+    size_t signature_{0};
+    size_t recordKey_{0};
+    std::vector<std::function<void()>> captured_;
+    std::vector<std::pair<size_t, bool>> deferred_;
+
+    struct Recording {
+      float* base{nullptr};
+      bool failed{false};
+#if CUDA_VERSION >= 11040
+      std::map<size_t, cudaGraphExec_t> forward;
+      std::map<size_t, cudaGraphExec_t> backward;
+#endif
+    };
+    std::unordered_map<size_t, Recording> recordings_;
+
+    /**
+     * @brief Concurrent forward execution: nodes of one tape group run on worker
+     * threads, each launching on its own per-thread default stream. Node events
+     * order consumers after their children across streams.
+     */
+    size_t streams_{1};
+    Ptr<ThreadPool> workers_;
+    std::vector<cudaEvent_t> events_;
+    cudaEvent_t levelEvent_{nullptr};
+
+    /** @brief cuBLAS handle of the current worker thread, null on all other threads */
+    static cublasHandle_t& workerHandle() {
+      thread_local cublasHandle_t handle = nullptr;
+      return handle;
+    }
+
+    /**
+     * @brief Gradient buckets, see setGradientBuckets(). While bucketing_,
+     * paramUses_ counts the consumers of every parameter whose backward step
+     * is still to come and bucketPending_ the unfinished parameters per bucket.
+     */
+    size_t bucketSize_{0};
+    std::function<void(size_t, size_t, cudaEvent_t)> bucketReady_;
+    bool bucketing_{false};
+    std::unordered_map<Chainable<Tensor>*, size_t> paramUses_;
+    std::unordered_map<Chainable<Tensor>*, size_t> paramBucket_;
+    std::vector<size_t> bucketPending_;
+    std::vector<std::pair<size_t, size_t>> bucketRange_;
+    std::vector<cudaEvent_t> bucketEvents_;
+    size_t bucketsTotal_{0};
+    size_t bucketsReported_{0};
+
+    /** @brief Mixed precision: fp16 matrix products and the scale applied to the loss adjoint */
+    bool halfPrecision_{false};
+    float lossScale_{1.f};
+
+    /**
+     * @brief fp16 mirror of the parameter values for ProdHalf, see halfParam().
+     * Maps the start of every converted tensor to the number of converted floats.
+     */
+    __half* halfParams_{nullptr};
+    size_t halfCapacity_{0};
+    float* halfBase_{nullptr};
+    std::map<float*, size_t> halfReady_;
+    std::mutex halfMutex_;
+
+    /** @brief Int8 inference: per-column quantized weights for ProdInt8, see quantizedParam() */
+    struct QuantizedParam {
+      int8_t* data;
+      float* scales;
+      size_t size;
+    };
+
+    bool quantized_{false};
+    std::map<float*, QuantizedParam> quantParams_;
+    std::mutex quantMutex_;
+
+    void freeQuantized(QuantizedParam& q) {
+      if(isCPU(device_)) {
+        delete[] q.data;
+        delete[] q.scales;
+      }
+      else {
+        cudaFree(q.data);
+        cudaFree(q.scales);
+      }
+    }
+
+    /**
+     * @brief Block-sparse inference: parameters converted on their first
+     * product, or found too dense, see blockSparseParam()
+     */
+    struct SparseParam {
+      bool sparse;
+      BlockSparse matrix;
+      size_t size;
+    };
+
+    float blockSparse_{0};
+    std::map<float*, SparseParam> sparseParams_;
+
+    bool halfContext_{false};
+    std::mutex sparseMutex_;
+
+    /** @brief Memory instrumentation: workspace high-water mark and optional allocation timeline */
+    size_t memoryPeak_{0};
+    size_t batches_{0};
+    size_t step_{0};
+    Ptr<std::ofstream> trace_;
+
+    /** @brief Per-node kernel timing, see setProfiling() */
+    Ptr<Profiler> profiler_;
+
+    bool profiling() {
+      return profiler_ && profiler_->active();
+    }
+
+    std::string profileLabel(Expr v) {
+      return fused_.count(v->getId()) ? "fused " + v->type() : v->type();
+    }
+
+    void trace(const char* event, Tensor t, size_t id, bool adjoint) {
+      if(!trace_ || !t)
+        return;
+      std::string type = id < nodes_.size() ? nodes_[id]->type() : "unknown";
+      *trace_ << batches_ << "\t" << step_ << "\t" << event << "\t" << id
+              << "\t" << type << "\t" << (adjoint ? "adj" : "val")
+              << "\t" << t->size() * sizeof(float) << "\n";
+    }
+
+    /** @brief Reports peak usage of the batch that is about to be cleared */
+    void reportMemory() {
+      if(nodes_.empty())
+        return;
+
+      size_t peak = tensors_->peak() * sizeof(float);
+      if(peak > memoryPeak_) {
+        memoryPeak_ = peak;
+        LOG(memory, "New workspace high-water mark at batch {} (device {}): {}",
+            batches_, device_, tensors_->statistics());
+        LOG(memory, "Parameters (device {}): values {}, gradients {}",
+            device_, params_.valsAllocator()->statistics(),
+            params_.gradsAllocator()->statistics());
+      }
+
+      if(trace_) {
+        *trace_ << batches_ << "\t" << step_ << "\tbatch\t-\t-\tpeak\t" << peak << "\n"
+                << batches_ << "\t" << step_ << "\tbatch\t-\t-\treserved\t"
+                << tensors_->capacity() * sizeof(float) << "\n"
+                << batches_ << "\t" << step_ << "\tbatch\t-\t-\tgrowths\t"
+                << tensors_->growths() << "\n";
+        trace_->flush();
+      }
+      batches_++;
+    }
+
+    static Expr storage(Expr e) {
+      while(e->view())
+        e = e->children()[0];
+      return e;
+    }
+
+    bool isParam(Expr e) {
+      return e->name() != "none" && params_.get(e->name()) == e;
+    }
+
+    /** @brief False for nodes prune() found the loss does not depend on */
+    bool live(size_t id) {
+      return id >= live_.size() || live_[id];
+    }
+
+    /**
+     * @brief Reachability pass before a training pass. Nodes are live if the
+     * loss, named or debugged nodes depend on them; the loss is the only top
+     * node or else topNode(), other top nodes and the branches only they use
+     * are skipped by forward() and backward(). A live inner node is trainable
+     * if it depends on a trainable leaf, as parameters may have been frozen
+     * after their consumers were built, so backward() runs and allocates
+     * adjoints only for nodes on a path from the loss to a trainable
+     * parameter. Inference graphs keep all nodes.
+     */
+    void prune() {
+      live_.clear();
+      if(inference_ || nodes_.empty())
+        return;
+
+      live_.assign(nodes_.size(), false);
+      size_t tops = std::count(top_.begin(), top_.end(), true);
+      for(size_t id = 0; id < nodes_.size(); ++id) {
+        auto& v = nodes_[id];
+        if((tops == 1 && top_[id]) || v->marked_for_debug()
+           || (v->name() != "none" && !isParam(v)))
+          live_[id] = true;
+      }
+      live_.back() = true;
+
+      for(size_t id = nodes_.size(); id-- > 0;) {
+        if(!live_[id])
+          continue;
+        for(auto&& child : nodes_[id]->children())
+          if(contains(child))
+            live_[child->getId()] = true;
+      }
+
+      for(auto&& v : nodes_) {
+        auto& children = v->children();
+        if(children.empty())
+          continue;
+        v->setTrainable(live_[v->getId()]
+                        && std::any_of(children.begin(), children.end(),
+                                       [](Expr c) { return c->trainable(); }));
+      }
+    }
+
+    /**
+     * @brief Everything a memory plan depends on: node order, shapes,
+     * connectivity and the flags that decide whether and how long a node
+     * holds memory. Graphs built for batches of identical shape share a signature.
+     */
+    std::vector<size_t> planSignature() {
+      std::vector<size_t> signature;
+      signature.reserve(8 * nodes_.size() + 1);
+      signature.push_back(nodes_.size());
+      for(auto&& v : nodes_) {
+        signature.push_back(v->getId());
+        for(auto d : v->shape())
+          signature.push_back(d);
+        size_t flags = 1;
+        if(!v->view())
+          flags = v->trainable() << 1
+                | (v->name() == "none") << 2
+                | isParam(v) << 3
+                | !v->val() << 4
+                | !v->grad() << 5
+                | isDroppable(v->getId()) << 6
+                | inlined(v->getId()) << 7;
+        signature.push_back(flags);
+        for(auto&& child : v->children())
+          signature.push_back(storage(child)->getId());
+      }
+      return signature;
+    }
+
+  protected:
+    /** @brief Constructs a new expression graph
+     * Constructor is protected to force use of New<ExpressionGraph>()
+    */
+    ExpressionGraph() { }
+
+    // delete copy and move constructors
+    ExpressionGraph(const ExpressionGraph&) = delete;
+    ExpressionGraph(ExpressionGraph&&) = delete;
+
+    friend Ptr<ExpressionGraph> New<ExpressionGraph>();
+
+  public:
+
+    ~ExpressionGraph() {
+      clear();
+      clearRecordings();
+      workers_.reset();
+      for(auto event : events_)
+        cudaEventDestroy(event);
+      if(levelEvent_)
+        cudaEventDestroy(levelEvent_);
+      if(halfParams_)
+        cudaFree(halfParams_);
+      for(auto& q : quantParams_)
+        freeQuantized(q.second);
+      for(auto& p : sparseParams_)
+        FreeBlockSparse(p.second.matrix);
+      if(stream_) {
+        cudaStreamSynchronize(stream_);
+        cudaEventDestroy(enter_);
+        cudaEventDestroy(leave_);
+        cudaStreamDestroy(stream_);
+      }
+    }
+
+    void setDevice(size_t device = 0,
+                   allocation strategy = allocation::sizeclass) {
+      device_ = device;
+      params_.init(device);
+      tensors_ = New<TensorAllocator>(device, strategy);
+      adjoints_ = New<TensorAllocator>(device, allocation::bestfit);
+      pinned_ = New<TensorAllocator>(device, allocation::bestfit);
+      if(isCPU(device)) {
+        // inference only, see kernels/tensor_operators_cpu.h
+        cublasHandle_ = nullptr;
+        return;
+      }
+      cublasHandle_ = create_handle(device);
+
+      if(!stream_) {
+        stream_ = createStream(priority_);
+        CUDA_CHECK(cudaEventCreateWithFlags(&enter_, cudaEventDisableTiming));
+        CUDA_CHECK(cudaEventCreateWithFlags(&leave_, cudaEventDisableTiming));
+      }
+      cublasSetStream(cublasHandle_, stream_);
+    }
+
+    /**
+     * @brief Moves the graph's kernels to a stream of scheduling class  cls ,
+     * normal by default, so that e.g. background validation yields to training
+     * and training to translation on the same device. A low-priority graph
+     * additionally takes at most  share  of the wall time with its forward
+     * passes, since kernels already running are not preempted by priorities.
+     * Kernels of --streams workers keep the default priority.
+     */
+    void setPriority(priority cls, float share = 1.f) {
+      priority_ = cls;
+      share_ = std::min(1.f, std::max(share, 0.01f));
+      if(!stream_)
+        return;
+      cudaSetDevice(device_);
+      CUDA_CHECK(cudaStreamSynchronize(stream_));
+      CUDA_CHECK(cudaStreamDestroy(stream_));
+      stream_ = createStream(cls);
+      cublasSetStream(cublasHandle_, stream_);
+    }
+
+    priority getPriority() {
+      return priority_;
+    }
+
+    /** @brief Share of the wall time of a low-priority graph, see setPriority() */
+    float getShare() {
+      return share_;
+    }
+
+    /** @brief Stream the graph's kernels run on, the per-thread default stream on the CPU */
+    cudaStream_t getStream() {
+      return stream_ ? stream_ : cudaStreamPerThread;
+    }
+
+    cublasHandle_t getCublasHandle() {
+      if(workerHandle())
+        return workerHandle();
+      return cublasHandle_;
+    }
+
+    /**
+     * @brief A fresh seed for counter-based dropout. Nodes built with the same
+     * seed draw the same mask, e.g. a recurrent cell across time steps.
+     */
+    size_t dropoutSeed() {
+      size_t seed = Config::seed;
+      boost::hash_combine(seed, device_);
+      boost::hash_combine(seed, dropoutSeeds_++);
+      return seed;
+    }
+
+    /** @brief Dropout seeds handed out so far */
+    size_t dropoutSeeds() {
+      return dropoutSeeds_;
+    }
+
+    /**
+     * @brief Continues handing out seeds after  n  of them, e.g. to rebuild a
+     * graph that was built from  n  on with the same dropout masks
+     */
+    void setDropoutSeeds(size_t n) {
+      dropoutSeeds_ = n;
+    }
+
+    size_t getDevice() {
+      return device_;
+    }
+
+    void reserveWorkspaceMB(size_t num) {
+      size_t elements = num * 1024 * 1024 / 4 - 1;
+      tensors_->reserve(elements);
+    }
+
+    /**
+     * @brief Bounds the workspace to  num  MB, 0 for no bound, e.g. for a share
+     * of a device used by several trainings. Growing beyond it throws
+     * OutOfMemoryException like a full device.
+     */
+    void setWorkspaceLimitMB(size_t num) {
+      tensors_->setLimit(num * 1024 * 1024 / 4);
+    }
+
+    /** @brief Reserves exactly  num  MB of workspace, e.g. a peak measured before */
+    void reserveWorkspaceExactMB(size_t num) {
+      tensors_->reserveExact(num * 1024 * 1024 / 4);
+    }
+
+    /**
+     * @brief Workspace in MB up to the furthest tensor of all batches so far,
+     * the size reserveWorkspaceExactMB() needs for them without growing
+     */
+    size_t workspacePeakMB() {
+      return (workspaceExtent_ * sizeof(float) + 1024 * 1024 - 1) / (1024 * 1024);
+    }
+
+    /**
+     * @brief Enables planning of the workspace layout before each full forward pass.
+     *
+     * See plan() for details.
+     */
+    void setMemoryPlanning(bool planMemory) {
+      planMemory_ = planMemory;
+    }
+
+    /**
+     * @brief Enables no-grad execution: forward() returns the value of a node to
+     * the allocator as soon as its last consumer has run, so peak memory follows
+     * the width of the graph rather than its size. backward() is not available.
+     *
+     * Values of named nodes, leaves and nodes with views are kept, as are values
+     * of nodes still referenced outside of the graph, e.g. decoder states kept by
+     * the caller for incremental forward(pos) calls. Top nodes are kept until a
+     * later forward(pos) call finds them unreferenced, see sweep().
+     *
+     * Nodes computed from parameters only, e.g. the concatenated GRU matrices,
+     * are pinned: after clear() an identical expression resolves to the pinned
+     * node and its value is reused without running it again. Switching the mode
+     * drops all pins, parameters may have changed in between.
+     */
+    void setInference(bool inference) {
+      if(inference != inference_)
+        unpin();
+      inference_ = inference;
+    }
+
+    /** @brief Forgets all pinned nodes and releases their values, see setInference() */
+    void unpin() {
+      pins_.clear();
+      if(pinned_)
+        pinned_->clear();
+    }
+
+    bool pinned(size_t id) {
+      return id < isPinned_.size() && isPinned_[id];
+    }
+
+    bool kept(size_t id) {
+      return id < kept_.size() && kept_[id];
+    }
+
+    /** @brief Number of nodes added since the last clear() */
+    size_t size() {
+      return nodes_.size();
+    }
+
+    /**
+     * @brief Keeps the values of nodes  begin  to  end  allocated after their
+     * last consumer ran, so that replay() can run them again. With  kept  false
+     * the values are freed by later forward passes again.
+     */
+    void keep(size_t begin, size_t end, bool kept = true) {
+      end = std::min(end, nodes_.size());
+      if(kept_.size() < end)
+        kept_.resize(end, false);
+      for(size_t id = begin; id < end; ++id)
+        kept_[id] = kept;
+    }
+
+    /**
+     * @brief Runs nodes  begin  to  end  of earlier forward passes again on
+     * their tensors, after copying every  inputs[i].second  into the value of
+     * inputs[i].first , e.g. a constant of the range. Nothing is built, hashed
+     * or allocated, the range has to be kept, see keep(). Pinned nodes keep
+     * their values.
+     */
+    void replay(size_t begin, size_t end,
+                const std::vector<std::pair<Expr, const float*>>& inputs) {
+      ThrottleScope throttle(this);
+      StreamScope scope(this);
+      for(auto& input : inputs) {
+        Tensor t = input.first->val();
+        if(isCPU(device_)) {
+          std::copy(input.second, input.second + t->size(), t->data());
+          continue;
+        }
+        CUDA_CHECK(cudaSetDevice(device_));
+        CUDA_CHECK(cudaMemcpyAsync(t->data(), input.second, t->size() * sizeof(float),
+                                   cudaMemcpyDefault, currentStream()));
+      }
+      for(size_t id = begin; id < end && id < nodes_.size(); ++id)
+        if(live(id) && !pinned(id))
+          runForward(nodes_[id]);
+    }
+
+    bool getInference() {
+      return inference_;
+    }
+
+    /**
+     * @brief Allocates all node adjoints of a batch contiguously in a separate
+     * arena at the start of backward() and zeroes them with a single memset
+     * instead of one fill per node.
+     *
+     * Adjoints then stay allocated until clear(), which trades memory for
+     * launches. Ignored while memory planning is enabled, plans place adjoints
+     * themselves.
+     */
+    void setAdjointArena(bool adjointArena) {
+      adjointArena_ = adjointArena;
+    }
+
+    /**
+     * @brief Lets RNN layers whose cells support it, currently GRU without layer
+     * normalization or state dropout, run all timesteps in one persistent kernel
+     * instead of a product and a gate kernel per step.
+     */
+    void setPersistentRnn(bool persistentRnn) {
+      persistentRnn_ = persistentRnn;
+    }
+
+    bool getPersistentRnn() {
+      return persistentRnn_;
+    }
+
+    /**
+     * @brief Keeps the first  hotRows  rows of parameters gathered by rows(),
+     * the embeddings of the most frequent words in vocabularies created by
+     * marian, persisting in L2 during lookups and their gradients, see
+     * CopyRows(). 0 turns it off.
+     */
+    void setHotRows(size_t hotRows) {
+      hotRows_ = hotRows;
+    }
+
+    size_t getHotRows() {
+      return hotRows_;
+    }
+
+    /**
+     * @brief Lets row-wise kernels measure their block size on first use and
+     * keep the winners in  cache , shared by all graphs of the process. An
+     * empty path keeps the fixed launch configurations. See LaunchTuner.
+     */
+    void setAutotune(const std::string& cache) {
+      LaunchTuner::instance().setCache(cache);
+    }
+
+    /**
+     * @brief Lets matrix products pick their cuBLASLt algorithm by measurement
+     * once per shape, with the winners kept in  cache  if it is not empty,
+     * shared by all graphs of the process. See GemmTuner.
+     */
+    void setGemmAutotune(bool enabled, const std::string& cache) {
+      GemmTuner::instance().setup(enabled, cache);
+    }
+
+    /**
+     * @brief Keeps the parameters whose names match one of the glob  patterns
+     * fixed. They get no gradients and lie outside params()->vals(), so
+     * optimizers, shards and gradient exchange never see them. See
+     * Parameters::setFrozen().
+     */
+    void setFrozen(const std::vector<std::string>& patterns) {
+      params_.setFrozen(patterns);
+      for(auto p : params_)
+        p->setTrainable(!params_.frozen(p));
+    }
+
+    /**
+     * @brief Keeps parameter values and gradients in CUDA managed memory,
+     * those matching one of the glob  patterns  on the host, so that e.g.
+     * giant embeddings need not fit into the device. forward() prefetches
+     * the rows of the batch's words, see prefetchManaged(). See
+     * Parameters::setManaged().
+     */
+    void setManaged(const std::vector<std::string>& patterns) {
+      params_.setManaged(patterns);
+    }
+
+    /**
+     * @brief Records the kernels of forward() and backward() into CUDA graphs per plan
+     * signature and replays them for later batches with the same signature.
+     *
+     * Only effective with memory planning, without gradient checkpointing and fp16.
+     * Nodes that upload host data while running (see Chainable::capturable()) split
+     * the recording and run eagerly in between.
+     */
+    void setCudaGraphs(bool cudaGraphs) {
+      cudaGraphs_ = cudaGraphs;
+    }
+
+    /**
+     * @brief Runs independent nodes of the forward and backward pass on up to
+     *  streams  CUDA streams.
+     *
+     * Nodes of one tape group (see add()) do not depend on each other and are
+     * launched concurrently from a pool of worker threads. 1 keeps the serial pass.
+     * Backward only runs concurrently without gradient buckets and memory planning.
+     */
+    void setStreams(size_t streams) {
+      streams_ = std::max((size_t)1, streams);
+      workers_.reset();
+      if(streams_ > 1 && !isCPU(device_))
+        workers_ = New<ThreadPool>(streams_, streams_ * 64);
+    }
+
+    size_t getStreams() {
+      return streams_;
+    }
+
+    /**
+     * @brief Merges chains of elementwise nodes into single kernels before each
+     * full forward pass, see fuse().
+     *
+     * Inlined nodes have no values, so this is only safe for graphs that are
+     * built completely before forward() and read through their top node, as in training.
+     */
+    void setFusion(bool fusion) {
+      fusion_ = fusion;
+    }
+
+    /** @brief True if node  id  is evaluated as part of a fused kernel and holds no memory */
+    bool inlined(size_t id) {
+      return id < inlinedInto_.size() && inlinedInto_[id] != (size_t)-1;
+    }
+
+    /**
+     * @brief Runs matrix products of DotNodeOp and AffineNodeOp in fp16 with fp32
+     * accumulation. Values, gradients and parameters stay fp32.
+     */
+    void setHalfPrecision(bool half) {
+      halfPrecision_ = half;
+    }
+
+    bool getHalfPrecision() {
+      return halfPrecision_;
+    }
+
+    /** Sizes the fp16 buffer to the parameter values, holding halfMutex_ */
+    void reserveHalfParams() {
+      Tensor vals = params_.allVals();
+      if(halfBase_ != vals->data() || halfCapacity_ < vals->size()) {
+        if(halfCapacity_ < vals->size()) {
+          if(halfParams_)
+            CUDA_CHECK(cudaFree(halfParams_));
+          cudaSetDevice(device_);
+          CUDA_CHECK(cudaMalloc(&halfParams_, vals->size() * sizeof(__half)));
+          halfCapacity_ = vals->size();
+        }
+        halfBase_ = vals->data();
+        halfReady_.clear();
+      }
+    }
+
+    /**
+     * @brief fp16 copy of  t  if it lies inside the parameter values, null
+     * otherwise. Every parameter is converted once and reused by all products
+     * until invalidateHalfParams(), so weights are not rounded again per call.
+     * Not used with CUDA graphs, replays would not notice invalidation.
+     */
+    const __half* halfParam(Tensor t) {
+      Tensor vals = params_.allVals();
+      if(!halfPrecision_ || cudaGraphs_ || !vals || isCPU(device_)
+         || t->data() < vals->data() || t->data() >= vals->data() + vals->size())
+        return nullptr;
+
+      std::lock_guard<std::mutex> guard(halfMutex_);
+      reserveHalfParams();
+
+      __half* half = halfParams_ + (t->data() - vals->data());
+      size_t& ready = halfReady_[t->data()];
+      if(ready < t->size()) {
+        ToHalf(half, t);
+        ready = t->size();
+        // concurrent forward, other workers read the copy on their own streams
+        if(workerHandle())
+          CUDA_CHECK(cudaStreamSynchronize(currentStream()));
+      }
+      return half;
+    }
+
+    /**
+     * @brief Runs matrix products with a parameter as right operand in int8,
+     * see ProdInt8. Meant for inference, parameters must not change after
+     * their first product.
+     */
+    void setQuantized(bool quantized) {
+      quantized_ = quantized;
+    }
+
+    bool getQuantized() {
+      return quantized_;
+    }
+
+    /**
+     * @brief Int8 copy of  t  with per-column scales if  t  lies inside the
+     * parameter values. Every parameter is quantized on its first product,
+     * so a model is converted while translating its first batch. Returns
+     * false for other tensors and with CUDA graphs, whose replays would
+     * repeat the conversion.
+     */
+    bool quantizedParam(Tensor t, const int8_t*& data, const float*& scales) {
+      Tensor vals = params_.allVals();
+      if(!quantized_ || cudaGraphs_ || !vals
+         || t->data() < vals->data() || t->data() >= vals->data() + vals->size())
+        return false;
+
+      std::lock_guard<std::mutex> guard(quantMutex_);
+      auto it = quantParams_.find(t->data());
+      if(it == quantParams_.end() || it->second.size != t->size()) {
+        if(it != quantParams_.end())
+          freeQuantized(it->second);
+
+        size_t cols = t->shape()[1];
+        QuantizedParam q{nullptr, nullptr, t->size()};
+        if(isCPU(device_)) {
+          q.data = new int8_t[t->size()];
+          q.scales = new float[cols];
+        }
+        else {
+          CUDA_CHECK(cudaMalloc(&q.data, t->size() * sizeof(int8_t)));
+          CUDA_CHECK(cudaMalloc(&q.scales, cols * sizeof(float)));
+        }
+        QuantizeColumns(q.data, q.scales, t);
+        // concurrent forward, other workers read the copy on their own streams
+        if(workerHandle() && !isCPU(device_))
+          CUDA_CHECK(cudaStreamSynchronize(currentStream()));
+        it = quantParams_.insert(std::make_pair(t->data(), q)).first;
+      }
+
+      data = it->second.data;
+      scales = it->second.scales;
+      return true;
+    }
+
+    /**
+     * @brief Runs matrix products with a pruned parameter as right operand as
+     * block-sparse GEMMs if at most the fraction  density  of its blocks is
+     * nonzero, see ProdBlockSparse. Meant for inference, 0 disables it.
+     */
+    void setBlockSparse(float density) {
+      blockSparse_ = density;
+    }
+
+    float getBlockSparse() {
+      return blockSparse_;
+    }
+
+    /**
+     * @brief Keeps the encoder context and its attention projections in fp16
+     * for decoding, read by the fused attention kernel, see GlobalAttention
+     */
+    void setHalfContext(bool half) {
+      halfContext_ = half;
+    }
+
+    bool getHalfContext() {
+      return halfContext_;
+    }
+
+    /**
+     * @brief Block-sparse copy of the 2D  t  if  t  lies inside the parameter
+     * values and is sparse enough. Every parameter is checked on its first
+     * product, like quantizedParam(). Returns false on the CPU and with CUDA
+     * graphs.
+     */
+    bool blockSparseParam(Tensor t, const BlockSparse*& sparse) {
+      Tensor vals = params_.allVals();
+      if(blockSparse_ <= 0 || cudaGraphs_ || isCPU(device_) || !vals
+         || t->shape()[2] * t->shape()[3] != 1
+         || t->data() < vals->data() || t->data() >= vals->data() + vals->size())
+        return false;
+
+      std::lock_guard<std::mutex> guard(sparseMutex_);
+      auto it = sparseParams_.find(t->data());
+      if(it == sparseParams_.end() || it->second.size != t->size()) {
+        if(it != sparseParams_.end()) {
+          FreeBlockSparse(it->second.matrix);
+          sparseParams_.erase(it);
+        }
+
+        std::vector<float> dense;
+        t->get(dense);
+        SparseParam p;
+        p.size = t->size();
+        p.sparse = ToBlockSparse(p.matrix, dense, t->shape()[0], t->shape()[1],
+                                 blockSparse_);
+        it = sparseParams_.insert(std::make_pair(t->data(), p)).first;
+      }
+
+      sparse = &it->second.matrix;
+      return it->second.sparse;
+    }
+
+    /** @brief Call whenever the parameter values change, e.g. after an update */
+    void invalidateHalfParams() {
+      std::lock_guard<std::mutex> guard(halfMutex_);
+      halfReady_.clear();
+    }
+
+    /**
+     * @brief Buffer for the parameter values in fp16, e.g. as received from
+     * parameter shards, see setHalfParamsReceived(). It is the cache of
+     * halfParam(), so with fp16 compute received parameters are not converted
+     * again.
+     */
+    __half* halfParamsBuffer() {
+      std::lock_guard<std::mutex> guard(halfMutex_);
+      reserveHalfParams();
+      return halfParams_;
+    }
+
+    /**
+     * @brief Declares halfParamsBuffer() the fp16 copy of the current values,
+     * which were set from it. Replaces invalidateHalfParams() after such a copy.
+     */
+    void setHalfParamsReceived() {
+      std::lock_guard<std::mutex> guard(halfMutex_);
+      halfReady_.clear();
+      // frozen parameters are not exchanged and keep their own conversions
+      for(auto p : params_)
+        if(!params_.frozen(p))
+          halfReady_[p->val()->data()] = p->val()->size();
+    }
+
+    /**
+     * @brief Seeds backward() with  scale  instead of 1, gradients come out
+     * multiplied by  scale  and have to be unscaled before the update.
+     */
+    void setLossScale(float scale) {
+      lossScale_ = scale;
+    }
+
+    float getLossScale() {
+      return lossScale_;
+    }
+
+    /**
+     * @brief Writes every workspace allocation and release to  file  as tab-separated
+     * lines: batch, step, event (alloc, free, batch), node id, node type, tensor, bytes.
+     *
+     * Steps count nodes visited by forward() and backward() within a batch,
+     * "batch" lines summarize the peak, reserved bytes and growths of a batch.
+     */
+    void setMemoryTrace(const std::string& file) {
+      if(file.empty()) {
+        trace_.reset();
+        return;
+      }
+      trace_.reset(new std::ofstream(file));
+      UTIL_THROW_IF2(!*trace_, "Could not open memory trace file " << file);
+      *trace_ << "batch\tstep\tevent\tnode\ttype\ttensor\tbytes\n";
+    }
+
+    /**
+     * @brief Times the kernels of every node over the next  batches  batches, see Profiler.
+     *
+     * Logs the most expensive node types and names afterwards and writes a Chrome
+     * trace to  traceFile  unless empty. While profiling, forward() runs serially
+     * and CUDA graphs are neither recorded nor replayed.
+     */
+    void setProfiling(size_t batches, const std::string& traceFile = "") {
+      profiler_.reset();
+      if(batches > 0)
+        profiler_ = New<Profiler>(device_, batches, traceFile);
+    }
+
+    /** @brief Workspace and parameter memory statistics of this graph */
+    std::string memoryStatistics() {
+      std::stringstream ss;
+      ss << "workspace: " << tensors_->statistics()
+         << "; parameter values: " << params_.valsAllocator()->statistics()
+         << "; gradients: " << params_.gradsAllocator()->statistics();
+      return ss.str();
+    }
+
+    /**
+     * @brief Performs backpropogation on this expression graph.
+     *
+     * Backpropogation is implemented by performing first the forward pass
+     *    and then the backward pass of algorithmic differentiation (AD) on the nodes of the graph.
+     *
+     */
+    void backprop() {
+      forward();
+      backward();
+    }
+
+    /**
+     * @brief Perform the forward pass of algorithmic differentiation (AD) on this graph.
+     *
+     * This pass traverses the nodes of this graph in the order they were created;
+     *    as each node is traversed, its <code>allocate()</code> method is called.
+     *
+     * Once allocation is complete for all nodes, this pass again traverses the nodes, in creation order;
+     *    as each node is traversed, its <code>forward()</code> method is called.
+     *
+     * After this method has successfully completed,
+     *    it is guaranteed that all node allocation has been completed,
+     *    and that all forward pass computations have been performed.
+     *
+     * @param batchSize       XXX Marcin, could you provide a description of this param?
+     */
+
+    size_t forward() {
+      StreamScope scope(this);
+      params_.allocateForward();
+      prefetchManaged();
+      prune();
+      prepareCheckpoints();
+      fuse();
+      if(inference_)
+        countConsumers();
+      if(planMemory_)
+        plan();
+      return forward(0);
+    }
+
+    /**
+     * @brief Sets the granularity at which layers mark checkpoints.
+     *
+     * With checkpoints::layer only the outputs of whole RNN layers are kept,
+     * with checkpoints::step also every RNN state.
+     */
+    void setCheckpointing(checkpoints granularity) {
+      checkpointing_ = granularity;
+    }
+
+    checkpoints getCheckpointing() {
+      return checkpointing_;
+    }
+
+    /**
+     * @brief Marks  e  as a segment boundary for gradient checkpointing.
+     *
+     * Ignored unless checkpointing at the given or a finer granularity is enabled.
+     * Nodes between two boundaries whose consumers all lie in the same segment
+     * release their values as soon as the forward pass no longer needs them and
+     * are recomputed from the segment's inputs when backward() reaches the
+     * segment. Leaves, views, named nodes and nodes of the last segment are
+     * always kept.
+     */
+    void checkpoint(Expr e, checkpoints granularity = checkpoints::layer) {
+      if(checkpointing_ != checkpoints::none && granularity <= checkpointing_)
+        checkpoints_.insert(e->getId());
+    }
+
+    bool isDroppable(size_t id) {
+      return id < droppable_.size() && droppable_[id];
+    }
+
+    void prepareCheckpoints() {
+      droppable_.clear();
+      dropAfter_.clear();
+      recompute_.clear();
+
+      if(checkpoints_.empty())
+        return;
+
+      // segment k contains the nodes after the (k-1)-th and up to the k-th boundary
+      size_t n = nodes_.size();
+      std::vector<size_t> segment(n);
+      auto boundary = checkpoints_.begin();
+      size_t k = 0;
+      for(size_t id = 0; id < n; ++id) {
+        segment[id] = k;
+        if(boundary != checkpoints_.end() && *boundary == id) {
+          boundary++;
+          k++;
+        }
+      }
+      size_t lastSegment = segment[n - 1];
+
+      // last consumer and whether all consumers share the segment of the node
+      std::vector<size_t> consumer(n, 0);
+      std::vector<bool> local(n, true);
+      for(auto&& v : nodes_)
+        for(auto&& child : v->children()) {
+          size_t id = storage(child)->getId();
+          consumer[id] = std::max(consumer[id], v->getId());
+          if(segment[id] != segment[v->getId()])
+            local[id] = false;
+        }
+
+      droppable_.resize(n, false);
+      dropAfter_.resize(n);
+      for(auto&& v : nodes_) {
+        size_t id = v->getId();
+        if(segment[id] == lastSegment || !local[id] || consumer[id] == 0
+           || v->children().empty() || v->view() || v->name() != "none"
+           || isTop(v) || checkpoints_.count(id))
+          continue;
+
+        droppable_[id] = true;
+        dropAfter_[consumer[id]].push_back(id);
+
+        // recompute when backward() enters the segment, i.e. at its last node
+        auto next = checkpoints_.lower_bound(id);
+        recompute_[*next].push_back(id);
+      }
+    }
+
+    /**
+     * @brief Merges chains of elementwise nodes into single kernels, see setFusion().
+     *
+     * An elementwise node (see Chainable::fusable()) is inlined into its consumer
+     * if that is its only consumer, is elementwise as well and has the same shape.
+     * Inlined nodes hold neither value nor adjoint. The root of a chain evaluates
+     * the whole chain from the chain's inputs in forward() and propagates its
+     * adjoint straight to the inputs in backward(), recomputing the intermediate
+     * values per element. Named, debugged and top nodes are never inlined, their
+     * values are read outside of the graph. Chains are grown breadth-first from
+     * the root as long as the program fits into ElementProgram. Disabled with
+     * gradient checkpointing, which recomputes single nodes.
+     */
+    void fuse() {
+      const size_t none = (size_t)-1;
+      size_t n = nodes_.size();
+      fused_.clear();
+      inlinedInto_.assign(n, none);
+      if(!fusion_ || !checkpoints_.empty())
+        return;
+
+      // number of distinct consumers of every node
+      std::vector<size_t> consumers(n, 0), last(n, none);
+      for(auto&& v : nodes_)
+        for(auto&& child : v->children()) {
+          size_t id = child->getId();
+          if(id < n && last[id] != v->getId()) {
+            consumers[id]++;
+            last[id] = v->getId();
+          }
+        }
+
+      auto inlinable = [&](Expr e, Expr root) {
+        size_t id = e->getId();
+        return id < n && consumers[id] == 1 && e->fusable() > 0
+          && inlinedInto_[id] == none && e->shape() == root->shape()
+          && e->name() == "none" && !e->marked_for_debug()
+          && !isTop(e) && !e->val() && !pinned(id);
+      };
+
+      for(auto it = nodes_.rbegin(); it != nodes_.rend(); ++it) {
+        auto root = *it;
+        size_t rootId = root->getId();
+        if(rootId >= n || inlinedInto_[rootId] != none || !root->fusable()
+           || root->marked_for_debug())
+          continue;
+
+        std::vector<Expr> members = { root };
+        std::vector<Expr> inputs;
+        std::deque<Expr> frontier;
+        std::set<size_t> seen = { rootId };
+        size_t ops = root->fusable();
+
+        auto expand = [&](Expr e) {
+          for(auto&& child : e->children())
+            if(seen.insert(child->getId()).second)
+              frontier.push_back(child);
+        };
+        // inputs not yet seen if  e  were inlined
+        auto unseen = [&](Expr e) {
+          std::set<size_t> ids;
+          for(auto&& child : e->children())
+            if(!seen.count(child->getId()))
+              ids.insert(child->getId());
+          return ids.size();
+        };
+
+        expand(root);
+        while(!frontier.empty()) {
+          auto e = frontier.front();
+          frontier.pop_front();
+          if(inlinable(e, root)
+             && ops + e->fusable() <= ElementProgram::MAX_OPS
+             && inputs.size() + frontier.size() + unseen(e) <= ElementProgram::MAX_INPUTS) {
+            members.push_back(e);
+            ops += e->fusable();
+            expand(e);
+          }
+          else {
+            inputs.push_back(e);
+          }
+        }
+
+        if(members.size() < 2 || inputs.size() > ElementProgram::MAX_INPUTS)
+          continue;
+
+        // children are created before their consumers, so ascending ids are a valid order
+        std::sort(members.begin(), members.end(),
+                  [](Expr a, Expr b) { return a->getId() < b->getId(); });
+
+        Fused fused;
+        fused.program.inputs = inputs.size();
+        fused.program.ops = 0;
+        fused.inputs = inputs;
+
+        std::map<size_t, int> registers;
+        for(size_t k = 0; k < inputs.size(); ++k)
+          registers[inputs[k]->getId()] = k;
+        for(auto&& e : members) {
+          std::vector<int> args;
+          for(auto&& child : e->children())
+            args.push_back(registers[child->getId()]);
+          registers[e->getId()] = e->fuse(fused.program, args);
+          if(e != root)
+            inlinedInto_[e->getId()] = rootId;
+        }
+        fused_.emplace(rootId, fused);
+      }
+    }
+
+    /**
+     * @brief Registers the lifetimes of all unallocated node values and adjoints
+     * of the current graph with  planner, see plan(). Stores the planner index
+     * per node id in  vals  and  adjs, or -1 for tensors that are not planned.
+     */
+    void addLifetimes(MemoryPlanner& planner,
+                      std::vector<size_t>& vals,
+                      std::vector<size_t>& adjs) {
+      const size_t none = (size_t)-1;
+      size_t n = nodes_.size();
+      size_t end = 2 * n;
+      auto bwd = [n](size_t id) { return 2 * n - 1 - id; };
+
+      // last consumer of a node in creation order, looking through views;
+      // inputs of a fused chain are consumed by its root
+      std::vector<size_t> consumer(n, none);
+      for(auto&& v : nodes_) {
+        size_t user = inlined(v->getId()) ? inlinedInto_[v->getId()] : v->getId();
+        for(auto&& child : v->children()) {
+          size_t id = storage(child)->getId();
+          if(id < n && (consumer[id] == none || consumer[id] < user))
+            consumer[id] = user;
+        }
+      }
+
+      vals.assign(n, none);
+      adjs.assign(n, none);
+      for(auto&& v : nodes_) {
+        size_t id = v->getId();
+        if(id >= n || v->view() || isParam(v) || inlined(id))
+          continue;
+
+        size_t elements = v->shape().elements();
+        size_t last = v->name() == "none" ? bwd(id) : end;
+
+        // recomputed values are allocated dynamically, see checkpoint()
+        if(!v->val() && !isDroppable(id) && !pinned(id))
+          vals[id] = planner.add(elements, id, last);
+
+        if(v->trainable() && !v->grad()) {
+          size_t first = consumer[id] == none ? n : bwd(consumer[id]);
+          adjs[id] = planner.add(elements, first, last);
+        }
+      }
+    }
+
+    /**
+     * @brief Estimates the device memory a training step of the current graph
+     * needs, without allocating anything or launching kernels.
+     *
+     * The graph only needs to be built, shapes are known at construction. The
+     * workspace is the arena plan() would reserve; without memory planning the
+     * allocator needs at least as much, plus rounding and fragmentation.
+     */
+    MemoryEstimate estimate() {
+      prepareCheckpoints();
+      fuse();
+
+      MemoryPlanner planner;
+      std::vector<size_t> vals, adjs;
+      addLifetimes(planner, vals, adjs);
+
+      MemoryEstimate estimate;
+      estimate.params = params_.totalSize() * sizeof(float);
+      estimate.gradients = estimate.params;
+      estimate.workspace = planner.plan() * sizeof(float);
+      estimate.unshared = planner.unshared() * sizeof(float);
+      return estimate;
+    }
+
+    /**
+     * @brief Assigns fixed workspace offsets to all node values and adjoints of the current graph.
+     *
+     * Lifetimes are derived from the same rules that govern allocation in
+     * forward() and backward(): a value lives from the forward step of its node
+     * until the backward step of its node, an adjoint from the backward
+     * step of its last consumer until the backward step of its node. Named nodes
+     * are never freed before clear(). Tensors with disjoint lifetimes share
+     * memory in a single arena at the front of the workspace. Nodes added after
+     * planning, e.g. during incremental forward(pos) calls, are allocated
+     * dynamically behind the arena.
+     */
+    void plan() {
+      planner_.clear();
+      planVals_.clear();
+      planAdjs_.clear();
+      signature_ = 0;
+
+      // the arena has to be placed at the front of an empty workspace
+      if(!tensors_->empty() || nodes_.empty())
+        return;
+
+      auto signature = planSignature();
+      size_t key = boost::hash_range(signature.begin(), signature.end());
+      signature_ = key;
+      auto it = planCache_.find(key);
+      if(it != planCache_.end()) {
+        if(it->second.signature == signature) {
+          tensors_->reservePlanned(it->second.total);
+          planVals_ = it->second.vals;
+          planAdjs_ = it->second.adjs;
+          return;
+        }
+        // a collision, recordings under this key belong to the other graph
+        clearRecordings();
+      }
+
+      const size_t none = (size_t)-1;
+      size_t n = nodes_.size();
+      std::vector<size_t> vals, adjs;
+      addLifetimes(planner_, vals, adjs);
+
+      size_t total = planner_.plan();
+      tensors_->reservePlanned(total);
+
+      planVals_.resize(n, none);
+      planAdjs_.resize(n, none);
+      for(size_t id = 0; id < n; ++id) {
+        if(vals[id] != none)
+          planVals_[id] = planner_.offset(vals[id]);
+        if(adjs[id] != none)
+          planAdjs_[id] = planner_.offset(adjs[id]);
+      }
+
+      // batches are bucketed by length, so only a limited number of signatures recur
+      if(planCache_.size() >= PLAN_CACHE_SIZE)
+        planCache_.clear();
+      planCache_[key] = { total, planVals_, planAdjs_, std::move(signature) };
+
+      if(total > planPeak_) {
+        planPeak_ = total;
+        LOG(memory, "Planned workspace arena of {} MB for {} tensors, {} MB without reuse (device {})",
+            total * sizeof(float) / (1024 * 1024), planner_.size(),
+            planner_.unshared() * sizeof(float) / (1024 * 1024), device_);
+      }
+    }
+
+    size_t forward(size_t pos) {
+      // @TODO: check if allocation works properly
+      ThrottleScope throttle(this);
+      StreamScope scope(this);
+      if(inference_ && pos > 0)
+        sweep(pos);
+
+      if(pos == 0 && recordable()) {
+        // inputs are uploaded before any recorded kernel runs
+        std::vector<Expr> order;
+        for(auto&& v : nodes_) {
+          if(!live(v->getId()))
+            continue;
+          v->allocate();
+          v->init();
+          order.push_back(v);
+        }
+        auto& recording = recordings_[recordKey_];
+#if CUDA_VERSION >= 11040
+        runRecorded(order, recording.forward, [this](Expr v) { forwardNode(v); });
+#endif
+        return nodes_.size();
+      }
+
+      // also for incremental passes, e.g. the independent attentions of a
+      // decoder step over several sources
+      if(concurrent()) {
+        forwardConcurrent(pos);
+        return nodes_.size();
+      }
+
+      auto it = nodes_.begin() + pos;
+      while(it != nodes_.end()) {
+        auto v = *it;
+        if(live(v->getId())) {
+          v->allocate();
+          v->init();
+          forwardNode(v);
+        }
+        it++;
+      }
+      return std::distance(nodes_.begin(), it);
+    }
+
+    bool concurrent() {
+      if(!workers_ || checkpointing_ != checkpoints::none || profiling())
+        return false;
+      for(auto&& v : nodes_)
+        if(v->marked_for_debug())
+          return false;
+      return true;
+    }
+
+    /**
+     * @brief Forward pass by tape group over the nodes from  pos  on, earlier
+     * nodes have been computed by previous passes. Allocation, uploads and all
+     * host-side bookkeeping stay on the calling thread, workers only launch
+     * kernels.
+     */
+    void forwardConcurrent(size_t pos = 0) {
+      CUDA_CHECK(cudaSetDevice(device_));
+      while(events_.size() < nodes_.size()) {
+        cudaEvent_t event;
+        CUDA_CHECK(cudaEventCreateWithFlags(&event, cudaEventDisableTiming));
+        events_.push_back(event);
+      }
+      if(!levelEvent_)
+        CUDA_CHECK(cudaEventCreateWithFlags(&levelEvent_, cudaEventDisableTiming));
+
+      for(auto&& tape : tapes_) {
+        if(tape.back()->getId() < pos)
+          continue;
+        for(auto&& v : tape) {
+          if(v->getId() < pos || !live(v->getId()))
+            continue;
+          v->allocate();
+          v->init();
+        }
+        // uploads of this group were issued on the calling thread's stream
+        CUDA_CHECK(cudaEventRecord(levelEvent_, currentStream()));
+
+        std::vector<std::future<void>> launched;
+        for(auto&& v : tape) {
+          if(v->getId() < pos || reused(v->getId()) || !live(v->getId()))
+            continue;
+          launched.emplace_back(workers_->enqueue([this, v]() {
+            CUDA_CHECK(cudaSetDevice(device_));
+            workerHandle() = threadHandle();
+
+            cudaStream_t stream = cudaStreamPerThread;
+            CUDA_CHECK(cudaStreamWaitEvent(stream, levelEvent_, 0));
+            for(auto&& child : v->children())
+              CUDA_CHECK(cudaStreamWaitEvent(stream, events_[child->getId()], 0));
+            runForward(v);
+            CUDA_CHECK(cudaEventRecord(events_[v->getId()], stream));
+
+            workerHandle() = nullptr;
+          }));
+        }
+        for(auto&& f : launched)
+          f.get();
+      }
+
+      // kernels are already launched, only do the bookkeeping
+      replaying_ = true;
+      for(auto it = nodes_.begin() + pos; it != nodes_.end(); ++it)
+        forwardNode(*it);
+      replaying_ = false;
+
+      // later work on this thread's stream sees the results of every node
+      for(auto&& v : topNodes())
+        CUDA_CHECK(cudaStreamWaitEvent(currentStream(), events_[v->getId()], 0));
+    }
+
+    /** @brief The node whose memory  e  refers to, the child of a chain of views */
+    static Chainable<Tensor>* storage(Expr e) {
+      while(e->view() && !e->children().empty())
+        e = e->children()[0];
+      return e.get();
+    }
+
+    /**
+     * @brief Backward pass by tape group in reverse order, the counterpart of
+     * forwardConcurrent(), e.g. both directions of a bidirectional RNN run
+     * side by side. Nodes of a group that accumulate into the same adjoint,
+     * directly or through views, run one after the other on one worker. A
+     * group starts once the previous one has finished on all streams.
+     * Adjoints are allocated on the calling thread before their group, the
+     * bookkeeping of backwardNode() follows after all kernels are launched.
+     */
+    void backwardConcurrent() {
+      CUDA_CHECK(cudaSetDevice(device_));
+      while(events_.size() < nodes_.size()) {
+        cudaEvent_t event;
+        CUDA_CHECK(cudaEventCreateWithFlags(&event, cudaEventDisableTiming));
+        events_.push_back(event);
+      }
+      if(!levelEvent_)
+        CUDA_CHECK(cudaEventCreateWithFlags(&levelEvent_, cudaEventDisableTiming));
+
+      for(auto tape = tapes_.rbegin(); tape != tapes_.rend(); ++tape) {
+        std::vector<Expr> run;
+        for(auto&& v : *tape) {
+          if(!v->trainable() || inlined(v->getId()))
+            continue;
+          for(auto&& child : operands(v))
+            if(child->trainable())
+              child->set_zero_adjoint();
+          run.push_back(v);
+        }
+        if(run.empty())
+          continue;
+
+        // nodes writing into the same memory end up in one part
+        std::vector<size_t> part(run.size());
+        std::iota(part.begin(), part.end(), 0);
+        std::function<size_t(size_t)> find = [&](size_t i) {
+          return part[i] == i ? i : part[i] = find(part[i]);
+        };
+        std::unordered_map<Chainable<Tensor>*, size_t> writer;
+        for(size_t i = 0; i < run.size(); ++i) {
+          for(auto&& child : operands(run[i])) {
+            if(!child->trainable())
+              continue;
+            auto it = writer.emplace(storage(child), i).first;
+            part[find(i)] = find(it->second);
+          }
+        }
+        std::map<size_t, std::vector<Expr>> parts;
+        for(size_t i = 0; i < run.size(); ++i)
+          parts[find(i)].push_back(run[i]);
+
+        // adjoints of this group were zeroed on the calling thread's stream
+        CUDA_CHECK(cudaEventRecord(levelEvent_, currentStream()));
+
+        std::vector<std::future<void>> launched;
+        for(auto&& p : parts) {
+          std::vector<Expr> nodes = p.second;
+          launched.emplace_back(workers_->enqueue([this, nodes]() {
+            CUDA_CHECK(cudaSetDevice(device_));
+            workerHandle() = threadHandle();
+
+            cudaStream_t stream = cudaStreamPerThread;
+            CUDA_CHECK(cudaStreamWaitEvent(stream, levelEvent_, 0));
+            for(auto&& v : nodes)
+              runBackward(v);
+            CUDA_CHECK(cudaEventRecord(events_[nodes.back()->getId()], stream));
+
+            workerHandle() = nullptr;
+          }));
+        }
+        for(auto&& f : launched)
+          f.get();
+        for(auto&& p : parts)
+          CUDA_CHECK(cudaStreamWaitEvent(currentStream(),
+                                         events_[p.second.back()->getId()], 0));
+      }
 
-    size_t count_{0};
+      // kernels are already launched, only do the bookkeeping
+      replaying_ = true;
+      for(auto it = nodes_.rbegin(); it != nodes_.rend(); ++it)
+        backwardNode(*it);
+      replaying_ = false;
+    }
 
-    std::vector<Expr> nodes_;
-    std::vector<std::vector<Expr>> tapes_;
-    std::map<Expr, size_t> tapeMap_;
+    /** @brief cuBLAS handle for the calling worker thread, bound to its per-thread stream */
+    cublasHandle_t threadHandle() {
+      thread_local std::map<size_t, cublasHandle_t> handles;
+      auto it = handles.find(device_);
+      if(it == handles.end()) {
+        cublasHandle_t handle = create_handle(device_);
+        cublasSetStream(handle, cudaStreamPerThread);
+        it = handles.emplace(device_, handle).first;
+      }
+      return it->second;
+    }
 
-    /** @brief Maps from name to expression node. */
-    std::map<std::string, Expr> named_;
+    /** @brief Runs the kernels of  v , nothing for inlined nodes, the whole chain for roots of fused chains */
+    void runForward(Expr v) {
+      if(inlined(v->getId()))
+        return;
+      auto it = fused_.find(v->getId());
+      if(it == fused_.end()) {
+        v->forward();
+        return;
+      }
+      std::vector<Tensor> vals;
+      for(auto&& input : it->second.inputs)
+        vals.push_back(input->val());
+      FusedForward(it->second.program, v->val(), vals);
+    }
 
-    /** @brief List of all input nodes of this expression graph. */
-    std::vector<Expr> inputs_;
+    void runBackward(Expr v) {
+      if(inlined(v->getId()))
+        return;
+      auto it = fused_.find(v->getId());
+      if(it == fused_.end()) {
+        v->backward();
+        return;
+      }
+      std::vector<Tensor> vals, grads;
+      for(auto&& input : it->second.inputs) {
+        vals.push_back(input->val());
+        grads.push_back(input->trainable() ? input->grad() : nullptr);
+      }
+      FusedBackward(it->second.program, v->grad(), vals, grads);
+    }
 
-    /** @brief Contains all nodes with regard to which we want to calculate derivatives */
-    std::unordered_set<Expr> topNodes_;
+    /** @brief Nodes whose adjoints backward() of  v  accumulates into */
+    const std::vector<Expr>& operands(Expr v) {
+      static const std::vector<Expr> nothing;
+      if(inlined(v->getId()))
+        return nothing;
+      auto it = fused_.find(v->getId());
+      return it == fused_.end() ? v->children() : it->second.inputs;
+    }
 
-    Parameters params_;
-    Ptr<TensorAllocator> tensors_;
+    /** @brief Recounts pending_ and refs_ after fuse() has replaced chains by their inputs */
+    void countConsumers() {
+      size_t n = nodes_.size();
+      pending_.assign(n, 0);
+      refs_.assign(n, 0);
+      for(auto&& v : nodes_) {
+        if(v->view())
+          continue;
+        for(auto&& child : v->children())
+          if(contains(child))
+            refs_[child->getId()]++;
+        for(auto&& child : operands(v))
+          if(contains(child))
+            pending_[child->getId()]++;
+      }
+      for(auto&& f : fused_)
+        for(auto&& input : f.second.inputs)
+          if(contains(input))
+            refs_[input->getId()]++;
+    }
 
-    cublasHandle_t cublasHandle_;
-    curandGenerator_t curandGenerator_;
-    size_t device_{0};
+    /** @brief Called once per consuming forward step, frees the value of  e  after the last one */
+    void release(const Expr& e) {
+      if(!contains(e))
+        return;
+      size_t id = e->getId();
+      if(pending_[id] == 0 || --pending_[id] > 0)
+        return;
+      if(!tryFree(e, false))
+        retained_.push_back(id);
+    }
 
-    std::unordered_map<size_t, Expr> hashMap_;
+    /**
+     * @brief Frees the value of  e  if no consumer is pending and nothing outside
+     * of the graph refers to it. Returns false if the value may become free later,
+     * i.e. it is still referenced or a top node while  top  is false.
+     */
+    bool tryFree(const Expr& e, bool top) {
+      size_t id = e->getId();
+      if(!e->val() || e->view() || e->children().empty() || e->name() != "none"
+         || e->marked_for_debug() || pinned(id))
+        return true;
+      if(pending_[id] > 0 || (isTop(e) && !top) || kept(id))
+        return false;
+
+      // apart from nodes_, tapes_ and hashMap_ only consumers may hold the node
+      auto it = hashMap_.find(e->hash());
+      bool hashed = it != hashMap_.end() && it->second == e;
+      if((size_t)e.use_count() > 2 + refs_[id] + hashed)
+        return false;
+
+      // an identical expression added later must not resolve to a freed node
+      if(hashed)
+        hashMap_.erase(it);
+      free(e->val(), id);
+      return true;
+    }
 
-  protected:
-    /** @brief Constructs a new expression graph
-     * Constructor is protected to force use of New<ExpressionGraph>()
-    */
-    ExpressionGraph() { }
+    /**
+     * @brief Called by forward(pos), frees what earlier calls left behind: top
+     * nodes of earlier steps, e.g. the scores of the previous beam search step,
+     * and nodes that were still referenced when their last consumer ran, once
+     * the caller has dropped them. Keeps memory constant per decoding step.
+     */
+    void sweep(size_t pos) {
+      for(size_t id = swept_; id < pos && id < nodes_.size(); ++id)
+        if(isTop(nodes_[id]))
+          retained_.push_back(id);
+      swept_ = std::max(swept_, pos);
+
+      size_t kept = 0;
+      for(auto id : retained_)
+        if(!tryFree(nodes_[id], true))
+          retained_[kept++] = id;
+      retained_.resize(kept);
+    }
 
-    // delete copy and move constructors
-    ExpressionGraph(const ExpressionGraph&) = delete;
-    ExpressionGraph(ExpressionGraph&&) = delete;
+    void forwardNode(Expr v) {
+      step_++;
+      if(!replaying_ && !reused(v->getId())) {
+        bool timed = profiling() && !inlined(v->getId());
+        if(timed)
+          profiler_->start(profileLabel(v), v->name(), false);
+        runForward(v);
+        if(timed)
+          profiler_->stop();
+        if(capturing_)
+          captured_.push_back([this, v]() { runForward(v); });
+      }
 
-    friend Ptr<ExpressionGraph> New<ExpressionGraph>();
+      // @TODO: should be done in node
+      for(auto&& child : v->children()) {
+        v->decreaseEdges(1);
+        child->decreaseEdges(1);
+      }
 
-  public:
+      if(v->marked_for_debug()) {
+        std::cerr << "Debug: " << v->debug_message() << std::endl;
+        std::cerr << v->val()->debug() << std::endl;
+      }
 
-    ~ExpressionGraph() {
-      clear();
-    }
+      if(v->getId() < dropAfter_.size())
+        for(auto id : dropAfter_[v->getId()])
+          free(nodes_[id]->val(), id);
 
-    void setDevice(size_t device = 0) {
-      device_ = device;
-      params_.init(device);
-      tensors_ = New<TensorAllocator>(device);
-      cublasHandle_ = create_handle(device);
-      curandGenerator_ = createCurandGenerator(device, Config::seed);
+      // kernels of other streams or of replayed CUDA graphs may still read values
+      if(inference_ && !replaying_ && !v->view())
+        for(auto&& child : operands(v))
+          release(child);
     }
 
-    cublasHandle_t getCublasHandle() {
-      return cublasHandle_;
+    /**
+     * @brief Allocates the adjoints of all nodes that receive gradients from the
+     * adjoint arena and clears the arena at once. The per-node zero fills in
+     * backwardNode() then find their adjoints allocated and do nothing.
+     */
+    void allocateAdjoints() {
+      arenaPass_ = true;
+      for(auto it = nodes_.rbegin(); it != nodes_.rend(); ++it)
+        if((*it)->trainable())
+          for(auto&& child : operands(*it))
+            if(child->trainable())
+              child->set_zero_adjoint();
+      arenaPass_ = false;
+
+      if(adjoints_->size() > 0)
+        adjoints_->asTensor()->set(0);
     }
 
-    curandGenerator_t getCurandGenerator() {
-      return curandGenerator_;
-    }
+    void backwardNode(Expr v) {
+      step_++;
 
-    size_t getDevice() {
-      return device_;
+      auto seg = recompute_.find(v->getId());
+      if(seg != recompute_.end()) {
+        for(auto id : seg->second) {
+          if(!live(id))
+            continue;
+          nodes_[id]->allocate();
+          nodes_[id]->forward();
+        }
+      }
+
+      if(v->trainable())
+        for(auto&& child: operands(v))
+          if(child->trainable())
+            child->set_zero_adjoint();
+      if(v->trainable() && !replaying_) {
+        bool timed = profiling() && !inlined(v->getId());
+        if(timed)
+          profiler_->start(profileLabel(v), v->name(), true);
+        runBackward(v);
+        if(timed)
+          profiler_->stop();
+        if(capturing_)
+          captured_.push_back([this, v]() { runBackward(v); });
+      }
+      if(bucketing_) {
+        for(auto&& child : operands(v)) {
+          auto it = paramUses_.find(child.get());
+          if(it != paramUses_.end() && --it->second == 0)
+            paramDone(child.get());
+        }
+      }
+      for(auto&& child : v->children()) {
+        v->decreaseEdges(1);
+        child->decreaseEdges(1);
+      }
+
+      if(v->trainable() && v->marked_for_debug()) {
+        std::cerr << "Debug Grad: " << v->debug_message() << std::endl;
+        std::cerr << v->grad()->debug() << std::endl;
+      }
+
+      // delete unnamed nodes
+      if(v->edges() == 0 && v->name() == "none")
+        v->free();
     }
 
-    void reserveWorkspaceMB(size_t num) {
-      size_t elements = num * 1024 * 1024 / 4 - 1;
-      tensors_->reserve(elements);
+    void startBuckets(bool accumulate) {
+      bucketing_ = bucketReady_ && !accumulate && !isCPU(device_) && params_.size() > 0;
+      if(!bucketing_)
+        return;
+
+      // a bucket holds the parameters starting within its bucketSize_ floats
+      Tensor grads = params_.grads();
+      size_t buckets = (grads->size() + bucketSize_ - 1) / bucketSize_;
+      bucketPending_.assign(buckets, 0);
+      bucketRange_.assign(buckets, {grads->size(), 0});
+      paramUses_.clear();
+      paramBucket_.clear();
+      for(auto& p : params_) {
+        if(!p->grad())
+          continue;
+        size_t offset = p->grad()->data() - grads->data();
+        size_t b = offset / bucketSize_;
+        bucketPending_[b]++;
+        bucketRange_[b].first = std::min(bucketRange_[b].first, offset);
+        bucketRange_[b].second = std::max(bucketRange_[b].second, offset + p->grad()->size());
+        paramBucket_[p.get()] = b;
+        paramUses_[p.get()] = 0;
+      }
+      bucketsTotal_ = buckets - std::count(bucketPending_.begin(), bucketPending_.end(), 0);
+      while(bucketEvents_.size() < buckets) {
+        cudaEvent_t event;
+        CUDA_CHECK(cudaEventCreateWithFlags(&event, cudaEventDisableTiming));
+        bucketEvents_.push_back(event);
+      }
+
+      for(auto&& v : nodes_)
+        for(auto&& child : operands(v)) {
+          auto it = paramUses_.find(child.get());
+          if(it != paramUses_.end())
+            it->second++;
+        }
+      // unused parameters keep their zero gradient
+      for(auto& use : paramUses_)
+        if(use.second == 0)
+          paramDone(use.first);
     }
 
-    /**
-     * @brief Performs backpropogation on this expression graph.
-     *
-     * Backpropogation is implemented by performing first the forward pass
-     *    and then the backward pass of algorithmic differentiation (AD) on the nodes of the graph.
-     *
-     */
-    void backprop() {
-      forward();
-      backward();
+    void paramDone(Chainable<Tensor>* p) {
+      size_t b = paramBucket_[p];
+      if(--bucketPending_[b] == 0) {
+        CUDA_CHECK(cudaEventRecord(bucketEvents_[b], stream_));
+        bucketReady_(bucketRange_[b].first,
+                     bucketRange_[b].second - bucketRange_[b].first,
+                     bucketEvents_[b]);
+        bucketsReported_++;
+      }
     }
 
     /**
-     * @brief Perform the forward pass of algorithmic differentiation (AD) on this graph.
-     *
-     * This pass traverses the nodes of this graph in the order they were created;
-     *    as each node is traversed, its <code>allocate()</code> method is called.
-     *
-     * Once allocation is complete for all nodes, this pass again traverses the nodes, in creation order;
-     *    as each node is traversed, its <code>forward()</code> method is called.
-     *
-     * After this method has successfully completed,
-     *    it is guaranteed that all node allocation has been completed,
-     *    and that all forward pass computations have been performed.
+     * @brief True if this pass can be replayed from, or recorded into, CUDA graphs.
      *
-     * @param batchSize       XXX Marcin, could you provide a description of this param?
+     * Requires a planned workspace so that every tensor address depends only on
+     * the plan signature. Recordings are dropped if the workspace moved.
      */
-
-    size_t forward() {
-      params_.allocateForward();
-      return forward(0);
+    bool recordable() {
+#if CUDA_VERSION >= 11040
+      if(!cudaGraphs_ || isCPU(device_) || !planMemory_ || !signature_
+         || checkpointing_ != checkpoints::none || halfPrecision_ || profiling())
+        return false;
+      for(auto&& v : nodes_)
+        if(v->marked_for_debug())
+          return false;
+
+      // plans only depend on shapes and connectivity, kernels also on the node types
+      recordKey_ = signature_;
+      for(auto&& v : nodes_)
+        boost::hash_combine(recordKey_, v->type());
+
+      auto it = recordings_.find(recordKey_);
+      if(it != recordings_.end() && it->second.base != tensors_->memory()) {
+        clearRecordings();
+        it = recordings_.end();
+      }
+      if(it == recordings_.end()) {
+        if(recordings_.size() >= PLAN_CACHE_SIZE)
+          clearRecordings();
+        recordings_[recordKey_].base = tensors_->memory();
+        return true;
+      }
+      return !it->second.failed;
+#else
+      return false;
+#endif
     }
 
-    size_t forward(size_t pos) {
-      // @TODO: check if allocation works properly
+    void clearRecordings() {
+#if CUDA_VERSION >= 11040
+      for(auto&& r : recordings_) {
+        for(auto&& e : r.second.forward)
+          cudaGraphExecDestroy(e.second);
+        for(auto&& e : r.second.backward)
+          cudaGraphExecDestroy(e.second);
+      }
+#endif
+      recordings_.clear();
+    }
 
-      auto it = nodes_.begin() + pos;
-      while(it != nodes_.end()) {
-        auto v = *it;
-        v->allocate();
-        v->init();
-        v->forward();
+#if CUDA_VERSION >= 11040
+    /**
+     * @brief Executes  step  for every node of  order . Runs of capturable nodes
+     * are captured into a CUDA graph the first time and replayed afterwards,
+     * with  step  only doing the host-side bookkeeping. Other nodes run eagerly.
+     */
+    template <class Step>
+    void runRecorded(const std::vector<Expr>& order,
+                     std::map<size_t, cudaGraphExec_t>& execs,
+                     Step step) {
+      auto& recording = recordings_[recordKey_];
+      cudaStream_t stream = currentStream();
+
+      size_t i = 0;
+      while(i < order.size()) {
+        if(!order[i]->capturable() || recording.failed) {
+          step(order[i++]);
+          continue;
+        }
 
-        // @TODO: should be done in node
-        for(auto&& child : v->children()) {
-          v->decreaseEdges(1);
-          child->decreaseEdges(1);
+        size_t j = i;
+        while(j < order.size() && order[j]->capturable())
+          j++;
+
+        size_t key = order[i]->getId();
+        auto it = execs.find(key);
+        if(it != execs.end()) {
+          replaying_ = true;
+          for(size_t k = i; k < j; ++k)
+            step(order[k]);
+          replaying_ = false;
+          CUDA_CHECK(cudaGraphLaunch(it->second, stream));
+          i = j;
+          continue;
         }
 
-        if(v->marked_for_debug()) {
-          std::cerr << "Debug: " << v->debug_message() << std::endl;
-          std::cerr << v->val()->debug() << std::endl;
+        cudaStream_t cublasStream;
+        cublasGetStream(cublasHandle_, &cublasStream);
+        cublasSetStream(cublasHandle_, stream);
+
+        cudaGraph_t graph = nullptr;
+        cudaGraphExec_t exec = nullptr;
+        bool captured = cudaStreamBeginCapture(stream, cudaStreamCaptureModeRelaxed) == cudaSuccess;
+        capturing_ = true;
+        for(size_t k = i; k < j; ++k)
+          step(order[k]);
+        capturing_ = false;
+        captured = cudaStreamEndCapture(stream, &graph) == cudaSuccess && captured;
+        captured = captured && cudaGraphInstantiateWithFlags(&exec, graph, 0) == cudaSuccess;
+        if(graph)
+          cudaGraphDestroy(graph);
+        cublasSetStream(cublasHandle_, cublasStream);
+
+        if(captured) {
+          execs[key] = exec;
+          CUDA_CHECK(cudaGraphLaunch(exec, stream));
         }
-        it++;
+        else {
+          // nothing of the failed capture has run, issue the same work eagerly
+          cudaGetLastError();
+          recording.failed = true;
+          LOG(info, "Kernels for graph signature {} could not be captured, running eagerly",
+              recordKey_);
+          for(auto&& op : captured_)
+            op();
+        }
+        captured_.clear();
+
+        // tensors released during capture had to stay alive for the eager fallback
+        auto deferred = std::move(deferred_);
+        deferred_.clear();
+        for(auto&& d : deferred) {
+          auto v = nodes_[d.first];
+          free(d.second ? v->grad() : v->val(), d.first, d.second);
+        }
+        i = j;
       }
-      return std::distance(nodes_.begin(), it);
     }
+#endif
 
     /**
      * @brief Perform the backward pass of algorithmic differentiation (AD) on this graph.
@@ -165,41 +2115,170 @@ class ExpressionGraph : public std::enable_shared_from_this<ExpressionGraph> {
      *
      * After this method has successfully completed,
      *    and that all backward pass computations have been performed.
+     *
+     * @param accumulate      add to the parameter gradients of the previous backward pass instead of resetting them
+     * @param seed            fills the adjoint of the top node instead of the loss scale, e.g. with the gradient
+     *                        that a later pipeline stage computed for this graph's output
      */
-    void backward() {
-      UTIL_THROW_IF2(topNodes_.size() > 1,
+    void backward(bool accumulate = false, std::function<void(Tensor)> seed = nullptr) {
+      // top nodes the loss does not need were pruned by forward()
+      auto tops = topNodes();
+      tops.erase(std::remove_if(tops.begin(), tops.end(),
+                                [this](Expr v) { return !live(v->getId()); }),
+                 tops.end());
+      UTIL_THROW_IF2(tops.size() > 1,
         "There are more than one top most node for backward step");
+      UTIL_THROW_IF2(inference_, "backward() is not available in inference mode");
 
+      StreamScope scope(this);
       params_.allocateBackward();
-      params_.set_zero_adjoint();
+      if(!accumulate)
+        params_.set_zero_adjoint();
+      if(adjointArena_ && !planMemory_)
+        allocateAdjoints();
 
-      for(auto&& v : topNodes_)
+      for(auto&& v : tops) {
         v->init_dependent();
+        if(seed)
+          seed(v->grad());
+        else if(lossScale_ != 1.f)
+          v->grad()->set(lossScale_);
+      }
+
+      bucketsTotal_ = 0;
+      bucketsReported_ = 0;
+#if CUDA_VERSION >= 11040
+      auto rec = recordings_.find(recordKey_);
+      if(rec != recordings_.end() && !rec->second.failed && recordable()) {
+        std::vector<Expr> order(nodes_.rbegin(), nodes_.rend());
+        runRecorded(order, recordings_[recordKey_].backward,
+                    [this](Expr v) { backwardNode(v); });
+        return;
+      }
+#endif
 
+      startBuckets(accumulate);
+      // planned adjoints share memory in the order of the serial pass
+      if(!bucketing_ && !planMemory_ && concurrent()) {
+        backwardConcurrent();
+        return;
+      }
       auto it = nodes_.rbegin();
       while(it != nodes_.rend()) {
-        auto v = *it;
+        backwardNode(*it);
+        it++;
+      }
+      bucketing_ = false;
+    }
 
-        for(auto&& child: v->children())
-          if(child->trainable())
-            child->set_zero_adjoint();
-        if(v->trainable())
-          v->backward();
-        for(auto&& child : v->children()) {
-          v->decreaseEdges(1);
-          child->decreaseEdges(1);
+    /**
+     * @brief Calls  ready(offset, size, event)  from backward() as soon as the
+     * gradients of a bucket of parameters are final, while backward continues.
+     *
+     * Buckets group the parameters starting within consecutive  elements
+     * floats of params().grads(), offset and size are in floats. event is
+     * recorded on the graph's stream, readers of the bucket have to wait for
+     * it. Only backward passes without accumulation that run eagerly on a GPU
+     * report buckets, bucketsComplete() tells if the last one reported all.
+     */
+    void setGradientBuckets(size_t elements,
+                            std::function<void(size_t, size_t, cudaEvent_t)> ready) {
+      bucketSize_ = std::max((size_t)1, elements);
+      bucketReady_ = ready;
+    }
+
+    bool bucketsComplete() {
+      return bucketsTotal_ > 0 && bucketsReported_ == bucketsTotal_;
+    }
+
+    /**
+     * @brief Migrates the rows of managed parameters that rows() with indices
+     * on the host reads, i.e. the embeddings of the batch's words, and their
+     * gradients to the device, ahead of the kernels on the graph's stream.
+     * Rows less than a page apart are moved as one range.
+     */
+    void prefetchManaged() {
+      if(!params_.managing() || isCPU(device_))
+        return;
+
+      std::map<Chainable<Tensor>*, std::vector<size_t>> rows;
+      for(auto&& v : nodes_) {
+        auto op = dynamic_cast<RowsNodeOp*>(v.get());
+        if(!op || op->indeces_.empty())
+          continue;
+        auto child = v->children()[0];
+        if(child->type() == "param" && params_.managed(child)) {
+          auto& r = rows[child.get()];
+          r.insert(r.end(), op->indeces_.begin(), op->indeces_.end());
         }
+      }
 
-        if(v->trainable() && v->marked_for_debug()) {
-          std::cerr << "Debug Grad: " << v->debug_message() << std::endl;
-          std::cerr << v->grad()->debug() << std::endl;
+      const size_t PAGE = 64 * 1024 / sizeof(float);
+      for(auto&& entry : rows) {
+        auto p = entry.first;
+        auto& r = entry.second;
+        std::sort(r.begin(), r.end());
+        r.erase(std::unique(r.begin(), r.end()), r.end());
+        size_t cols = p->shape().elements() / p->shape()[0];
+        size_t gap = std::max((size_t)1, PAGE / cols);
+        for(size_t i = 0; i < r.size();) {
+          size_t j = i + 1;
+          while(j < r.size() && r[j] - r[j - 1] <= gap)
+            j++;
+          size_t floats = (r[j - 1] - r[i] + 1) * cols;
+          params_.valsAllocator()->prefetch(p->val()->data() + r[i] * cols, floats);
+          if(p->grad())
+            params_.gradsAllocator()->prefetch(p->grad()->data() + r[i] * cols, floats);
+          i = j;
         }
+      }
+    }
 
-        // delete unnamed nodes
-        if(v->edges() == 0 && v->name() == "none")
-          v->free();
+    /**
+     * @brief The parts of params().grads() the last backward() can have made
+     * nonzero, in increasing order, the same offsets hold for params().vals().
+     *
+     * These are the parameters the graph uses, but of a parameter that is only
+     * read by rows() with indices given on the host, e.g. an embedding, just
+     * the rows it looked up. Unused parameters are left out.
+     */
+    void updateRanges(Ranges& ranges) {
+      std::unordered_set<Chainable<Tensor>*> dense;
+      std::map<Chainable<Tensor>*, std::vector<size_t>> rows;
+      for(auto&& v : nodes_) {
+        auto op = dynamic_cast<RowsNodeOp*>(v.get());
+        for(auto&& child : v->children()) {
+          if(child->type() != "param")
+            continue;
+          if(op && !op->indeces_.empty() && child == v->children()[0]) {
+            auto& r = rows[child.get()];
+            r.insert(r.end(), op->indeces_.begin(), op->indeces_.end());
+          }
+          else {
+            dense.insert(child.get());
+          }
+        }
+      }
 
-        it++;
+      ranges.clear();
+      const float* base = params_.vals()->data();
+      for(auto p : params_) {
+        if(params_.frozen(p))
+          continue;
+        size_t offset = p->val()->data() - base;
+        size_t elements = p->shape().elements();
+        auto it = rows.find(p.get());
+        if(dense.count(p.get())) {
+          ranges.add(offset, elements);
+        }
+        else if(it != rows.end()) {
+          auto& r = it->second;
+          std::sort(r.begin(), r.end());
+          r.erase(std::unique(r.begin(), r.end()), r.end());
+          size_t cols = elements / p->shape()[0];
+          for(auto row : r)
+            ranges.add(offset + row * cols, cols);
+        }
       }
     }
 
@@ -284,17 +2363,96 @@ class ExpressionGraph : public std::enable_shared_from_this<ExpressionGraph> {
                      << name
                      << "already exists");
 
-      // create parameter node (adds to tape)
-      p = Expression<ParamNode>(shared_from_this(),
-                                keywords::shape=shape,
-                                args...);
+      // create parameter node (adds to tape), with padded columns the init
+      // given last replaces the caller's
+      auto rule = padRules_.find(name);
+      if(rule != padRules_.end() && shape[1] % rule->second.multiple != 0) {
+        int cols = shape[1];
+        int multiple = rule->second.multiple;
+        shape.set(1, (cols + multiple - 1) / multiple * multiple);
+        realCols_[name] = cols;
+        auto init = Get(keywords::init, std::function<void(Tensor)>(), args...);
+        p = Expression<ParamNode>(shared_from_this(),
+                                  keywords::shape=shape,
+                                  args...,
+                                  keywords::init=inits::padded(init, cols,
+                                                               rule->second.fill));
+      }
+      else {
+        p = Expression<ParamNode>(shared_from_this(),
+                                  keywords::shape=shape,
+                                  args...);
+      }
 
       // add to list of parameters
       p->set_name(name);
       params_.add(p, name);
+      if(params_.frozen(p))
+        p->setTrainable(false);
       return p;
     }
 
+    /**
+     * @brief Allocates and initializes all parameters now instead of in the
+     * first forward pass, and waits until their values are on the device
+     */
+    void initParams() {
+      {
+        StreamScope scope(this);
+        params_.allocateForward();
+        for(auto p : params_)
+          p->init();
+      }
+      // leaving the scope ordered this thread's stream after the uploads
+      if(!isCPU(device_))
+        CUDA_CHECK(cudaStreamSynchronize(currentStream()));
+    }
+
+    /**
+     * @brief Creates parameters with the names and shapes of those of  other ,
+     * in the same order and thus the same layout, without initializing them,
+     * e.g. for replicas that receive the values of  other  by a copy
+     */
+    void copyParamLayout(Ptr<ExpressionGraph> other) {
+      UTIL_THROW_IF2(params_.size() > 0,
+                     "The parameter layout must be copied before any are created");
+      for(auto p : other->params())
+        param(p->name(), p->shape());
+    }
+
+    /**
+     * @brief Reads the parameters of  owner  on the same device instead of
+     * own ones, e.g. for several translators of one model on a device, each
+     * graph then only holds its workspace. Creates a parameter node for every
+     * parameter of  owner  with the same name and shape, which takes the
+     * place of load(). The shared values must not be updated.
+     */
+    void shareParams(Ptr<ExpressionGraph> owner) {
+      UTIL_THROW_IF2(owner->getDevice() != device_,
+                     "Parameters can only be shared on the same device");
+      UTIL_THROW_IF2(params_.size() > 0,
+                     "Parameters must be shared before any are created");
+      owner->initParams();
+      for(auto p : owner->params()) {
+        auto mine = param(p->name(), p->shape());
+        mine->val() = p->val();
+        mine->setTrainable(false);
+      }
+      params_.share(owner->params());
+    }
+
+    /**
+     * @brief Drops the parameters the current graph does not use, e.g. those
+     * of a loaded model that belong to another pipeline stage. Only between
+     * building the graph and its first forward pass.
+     */
+    void pruneParams() {
+      std::unordered_set<Chainable<Tensor>*> used;
+      for(auto&& v : nodes_)
+        used.insert(v.get());
+      params_.prune([&used](Expr p) { return !used.count(p.get()); });
+    }
+
     /**
      * @brief Constructs a new node representing a constant in an expression graph.
      *
@@ -341,8 +2499,9 @@ class ExpressionGraph : public std::enable_shared_from_this<ExpressionGraph> {
 
     template <typename ...Args>
     inline Expr dropout(float prob, Shape shape) {
-      auto dropoutInit = [prob, this](Tensor t) {
-        Dropout(t, prob, getCurandGenerator());
+      size_t seed = dropoutSeed();
+      auto dropoutInit = [prob, seed](Tensor t) {
+        Dropout(t, prob, seed);
       };
 
       return Expression<ConstantNode>(shared_from_this(),
@@ -404,27 +2563,87 @@ class ExpressionGraph : public std::enable_shared_from_this<ExpressionGraph> {
       if(it != hashMap_.end())
         return it->second;
 
+      bool reuse = false;
+      if(inference_) {
+        auto pin = pins_.find(hash);
+        if(pin != pins_.end()) {
+          node = pin->second;
+          reuse = true;
+        }
+      }
+
       hashMap_[hash] = node;
 
       node->setId(count_++);
 
+      bool pin = reuse || (inference_ && derivedFromParams(node));
+      isPinned_.push_back(pin);
+      reused_.push_back(reuse);
+      if(pin && !reuse)
+        pins_[hash] = node;
+
+      pending_.push_back(0);
+      refs_.push_back(0);
       for(auto& child: node->children()) {
-        group = std::max(group, tapeMap_[child] + 1);
+        group = std::max(group, (contains(child) ? groups_[child->getId()] : 0) + 1);
         child->increaseEdges(2);
         node->increaseEdges(2);
+        if(contains(child) && !node->view()) {
+          pending_[child->getId()]++;
+          refs_[child->getId()]++;
+        }
       }
-      tapeMap_[node] = group;
+      groups_.push_back(group);
       if(group >= tapes_.size())
         tapes_.resize(group + 1);
       tapes_[group].push_back(node);
       nodes_.push_back(node);
-      topNodes_.insert(node);
+      top_.push_back(true);
 
       return node;
     }
 
+    /** @brief True for nodes that are computed from parameters and pinned nodes only */
+    bool derivedFromParams(Expr node) {
+      if(node->children().empty())
+        return false;
+      for(auto&& child : node->children())
+        if(!isParam(child) && !(contains(child) && pinned(child->getId())))
+          return false;
+      return true;
+    }
+
+    /** @brief True if node  id  is a pinned node whose value was computed for an earlier graph */
+    bool reused(size_t id) {
+      return id < reused_.size() && reused_[id];
+    }
+
+    /** @brief True if  node  has been added to this graph since the last clear() */
+    bool contains(Expr node) {
+      size_t id = node->getId();
+      return id < nodes_.size() && nodes_[id] == node;
+    }
+
     void remove_top_node(Expr node) {
-      topNodes_.erase(node);
+      if(contains(node))
+        top_[node->getId()] = false;
+    }
+
+    /** @brief True for nodes that are not consumed by any other node */
+    bool isTop(Expr node) {
+      return contains(node) && top_[node->getId()];
+    }
+
+    std::vector<Expr> topNodes() {
+      std::vector<Expr> tops;
+      for(size_t id = 0; id < nodes_.size(); ++id)
+        if(top_[id])
+          tops.push_back(nodes_[id]);
+      return tops;
+    }
+
+    Ptr<NodePool> nodePool() {
+      return nodePool_;
     }
 
     template <class ...Args>
@@ -432,34 +2651,156 @@ class ExpressionGraph : public std::enable_shared_from_this<ExpressionGraph> {
       tensors_->allocate(t, args...);
     }
 
+    /**
+     * @brief Allocates the value or adjoint of node  id , at its planned offset if a plan exists.
+     */
+    void nodeTensor(Tensor& t, Shape shape, size_t id, bool adjoint = false) {
+      bool fresh = !t || t->shape() != shape;
+      auto& offsets = adjoint ? planAdjs_ : planVals_;
+      if(!adjoint && pinned(id))
+        pinned_->allocate(t, shape);
+      else if(id < offsets.size() && offsets[id] != (size_t)-1)
+        tensors_->allocateAt(t, shape, offsets[id]);
+      else if(arenaPass_ && adjoint)
+        adjoints_->allocate(t, shape);
+      else
+        tensors_->allocate(t, shape);
+      if(fresh)
+        trace("alloc", t, id, adjoint);
+    }
+
     void free(Tensor& t) {
       tensors_->free(t);
     }
 
+    /** @brief Fills a node tensor, recorded into the current CUDA graph capture if any */
+    void fill(Tensor t, float value) {
+      if(replaying_ || arenaPass_)
+        return;
+      t->set(value);
+      if(capturing_)
+        captured_.push_back([t, value]() { t->set(value); });
+    }
+
+    /** @brief Releases the value or adjoint of node  id  */
+    void free(Tensor& t, size_t id, bool adjoint = false) {
+      if(capturing_) {
+        deferred_.emplace_back(id, adjoint);
+        return;
+      }
+      trace("free", t, id, adjoint);
+      // arena adjoints are released as a whole in clear()
+      float* arena = adjoints_ ? adjoints_->memory() : nullptr;
+      if(adjoint && arena && t->data() >= arena && t->data() < arena + adjoints_->capacity())
+        t.reset();
+      else
+        tensors_->free(t);
+    }
+
     void clear() {
+      reportMemory();
+      if(profiler_)
+        profiler_->batch();
+      step_ = 0;
+
       // clear everything apart from parameters
       count_ = 0;
       nodes_.clear();
       tapes_.clear();
-      tapeMap_.clear();
+      groups_.clear();
 
       named_.clear();
       inputs_.clear();
-      topNodes_.clear();
+      top_.clear();
+      live_.clear();
+      if(tensors_->extent() > workspaceExtent_)
+        workspaceExtent_ = tensors_->extent();
       tensors_->clear();
+      tensors_->resetPeak();
+      if(adjoints_)
+        adjoints_->clear();
       hashMap_.clear();
+      pending_.clear();
+      refs_.clear();
+      isPinned_.clear();
+      reused_.clear();
+      kept_.clear();
+      retained_.clear();
+      swept_ = 0;
+
+      planner_.clear();
+      planVals_.clear();
+      planAdjs_.clear();
+
+      checkpoints_.clear();
+      droppable_.clear();
+      dropAfter_.clear();
+      recompute_.clear();
+
+      fused_.clear();
+      inlinedInto_.clear();
     }
 
     Expr topNode() {
       return nodes_.back();
     }
 
+    /**
+     * @brief Creates the parameters of a BinaryModel. In a graph without
+     * parameters they get the layout of the file, and whichever is initialized
+     * first uploads the whole model into the arena with one copy.
+     */
+    void loadBinary(const std::string& name) {
+      using namespace keywords;
+
+      LOG(info, "Loading binary model from {}", name);
+
+      auto model = New<BinaryModel>(name);
+      // released once uploaded, the parameters keep their init functions
+      auto source = New<Ptr<BinaryModel>>(model);
+      // frozen parameters are laid out after the trained ones
+      bool whole = params_.size() == 0 && !params_.freezing();
+      // padded parameters do not match the layout of the blob
+      for(auto& item : model->items()) {
+        auto rule = padRules_.find(item.name);
+        if(rule != padRules_.end() && item.cols % rule->second.multiple != 0)
+          whole = false;
+      }
+
+      for(auto& item : model->items()) {
+        Shape shape({(int)item.rows, (int)item.cols});
+        std::function<void(Tensor)> init;
+        if(whole) {
+          init = [source, item](Tensor t) {
+            if(!*source)
+              return;
+            CUDA_CHECK(cudaMemcpy(t->data() - item.offset, (*source)->data(),
+                                  (*source)->size() * sizeof(float),
+                                  cudaMemcpyHostToDevice));
+            source->reset();
+          };
+        }
+        else {
+          init = [model, item](Tensor t) {
+            const float* blob = model->data() + item.offset;
+            t->set(std::vector<float>(blob, blob + item.rows * item.cols));
+          };
+        }
+        param(item.name, shape, init=init);
+      }
+    }
+
     void load(const std::string& name) {
       using namespace keywords;
 
+      if(BinaryModel::isBinary(name)) {
+        loadBinary(name);
+        return;
+      }
+
       LOG(info, "Loading model from {}", name);
 
-      auto numpy = cnpy::npz_load(name);
+      auto numpy = cnpy::npz_load(io::fetch(name));
 
       for(auto it : numpy) {
         auto name = it.first;
@@ -483,36 +2824,118 @@ class ExpressionGraph : public std::enable_shared_from_this<ExpressionGraph> {
       LOG(info, "Saving model to {}", name);
 
       unsigned shape[2];
-      std::string mode = "w";
+      NpzWriter npz(name);
 
-      cudaSetDevice(getDevice());
+      if(!isCPU(getDevice()))
+        cudaSetDevice(getDevice());
       for(auto p : params().getMap()) {
-        std::vector<float> v;
-        p.second->val() >> v;
-
         unsigned dim;
-        if(p.second->shape()[0] == 1) {
-          shape[0] = p.second->shape()[1];
-          dim = 1;
-        }
-        else {
-          shape[0] = p.second->shape()[0];
-          shape[1] = p.second->shape()[1];
-          dim = 2;
-        }
-        std::string pName = p.first;
-        cnpy::npz_save(name, pName, v.data(), shape, dim, mode);
-        mode = "a";
+        auto v = savedValues(p.first, p.second, shape, dim);
+        npz.add(p.first, v.data(), shape, dim);
+      }
+      npz.close();
+    }
+
+    /**
+     * @brief Stores parameter  name  with its columns rounded up to a multiple
+     * of  multiple  and the added columns set to  fill , e.g. for GEMMs on
+     * tensor cores. Callers keep requesting the unpadded shape, loading pads
+     * and saving strips the columns. Only affects parameters created later.
+     */
+    void padColumns(const std::string& name, size_t multiple, float fill) {
+      padRules_[name] = {std::max((size_t)1, multiple), fill};
+    }
+
+    /** @brief Columns of parameter  name  without padding, see padColumns() */
+    int realColumns(const std::string& name, int cols) {
+      auto it = realCols_.find(name);
+      return it == realCols_.end() ? cols : it->second;
+    }
+
+    /**
+     * @brief Values of parameter  p  named  name  as they are saved, without
+     * padded columns, and their  shape  with  dim  1 for a single row
+     */
+    std::vector<float> savedValues(const std::string& name, Expr p,
+                                   unsigned shape[2], unsigned& dim) {
+      std::vector<float> v;
+      p->val() >> v;
+
+      int rows = p->shape()[0];
+      int width = p->shape()[1];
+      int cols = realColumns(name, width);
+      if(cols != width) {
+        for(int i = 1; i < rows; ++i)
+          std::copy(v.begin() + i * width, v.begin() + i * width + cols,
+                    v.begin() + i * cols);
+        v.resize(rows * cols);
       }
+
+      if(rows == 1) {
+        shape[0] = cols;
+        dim = 1;
+      }
+      else {
+        shape[0] = rows;
+        shape[1] = cols;
+        dim = 2;
+      }
+      return v;
     }
 };
 
-template <class T, typename ...Args>
-Expr Expression(Args&& ... args) {
+/**
+ * @brief Reserves the workspace of  graph , on the i-th device of --devices,
+ * exactly as large as the i-th MB value of workspace-peak, recorded in the
+ * model's .yml by an earlier run, or --workspace MB if there is none. With
+ *  fallback  false the workspace is then left to grow on demand, up to
+ * --workspace-limit MB in any case.
+ */
+inline void reserveWorkspace(ExpressionGraphPtr graph, Ptr<Config> options,
+                             bool fallback = true) {
+  if(options->has("workspace-limit"))
+    graph->setWorkspaceLimitMB(options->get<size_t>("workspace-limit"));
+  if(options->has("workspace-peak") && options->has("devices")) {
+    auto devices = options->get<std::vector<size_t>>("devices");
+    auto peaks = options->get<std::vector<size_t>>("workspace-peak");
+    auto it = std::find(devices.begin(), devices.end(), graph->getDevice());
+    size_t i = it - devices.begin();
+    if(i < peaks.size() && peaks[i] > 0) {
+      graph->reserveWorkspaceExactMB(peaks[i]);
+      return;
+    }
+  }
+  if(fallback)
+    graph->reserveWorkspaceMB(options->get<size_t>("workspace"));
+}
+
+inline ExpressionGraphPtr graphOf(ExpressionGraphPtr graph) {
+  return graph;
+}
+
+inline ExpressionGraphPtr graphOf(Expr e) {
+  return e->graph();
+}
+
+inline ExpressionGraphPtr graphOf(const std::vector<Expr>& nodes) {
+  return nodes.front()->graph();
+}
+
+/**
+ * @brief Creates a node of type T in the graph of its first argument.
+ *
+ * Node and reference count share one block from the graph's NodePool, so graphs
+ * rebuilt for every batch reuse the memory of the previous ones.
+ */
+template <class T, class First, typename ...Args>
+Expr Expression(First&& first, Args&& ... args) {
   // @TODO check hash, if exists do not add and return
   // cached node to minimize calculations
-  auto e = Expr(new T(std::forward<Args>(args)...));
-  return e->graph()->add(e);
+  auto graph = graphOf(first);
+  Expr e = std::allocate_shared<T>(NodeAllocator<T>(graph->nodePool()),
+                                   std::forward<First>(first),
+                                   std::forward<Args>(args)...);
+  return graph->add(e);
 }
 
 }
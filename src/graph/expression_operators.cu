@@ -35,8 +35,46 @@ Expr name(Expr a, const std::string& name) {
   return a;
 }
 
+Expr dropout(Expr x, float prob, Shape maskShape, size_t seed) {
+  return Expression<DropoutNodeOp>(x, prob, maskShape, seed);
+}
+
 Expr rows(Expr a, const std::vector<size_t>& indeces) {
-  return Expression<RowsNodeOp>(a, indeces);
+  // indices live on the device as a constant, exact as floats below 2^24
+  std::vector<float> idx(indeces.begin(), indeces.end());
+  auto indices = a->graph()->constant(keywords::shape={(int)idx.size(), 1},
+                                      keywords::init=inits::from_vector(idx));
+  return Expression<RowsNodeOp>(a, indices, indeces);
+}
+
+Expr rows(Expr a, Expr indices) {
+  return Expression<RowsNodeOp>(a, indices);
+}
+
+Expr cols(Expr a, const std::vector<size_t>& indeces) {
+  std::vector<float> idx(indeces.begin(), indeces.end());
+  auto indices = a->graph()->constant(keywords::shape={(int)idx.size(), 1},
+                                      keywords::init=inits::from_vector(idx));
+  return Expression<ColsNodeOp>(a, indices, indeces);
+}
+
+Expr argmax(Expr a, int exclude) {
+  return Expression<ArgmaxNodeOp>(a, exclude);
+}
+
+Expr select_batch(Expr a, const std::vector<size_t>& batchIndices) {
+  Shape shape = a->shape();
+  int dimBatch = shape[0];
+  int others = shape[2] * shape[3];
+
+  // batch entry b of slice s is row s * dimBatch + b
+  std::vector<size_t> indeces;
+  for(int s = 0; s < others; ++s)
+    for(auto b : batchIndices)
+      indeces.push_back(s * dimBatch + b);
+
+  auto selected = rows(reshape(a, {dimBatch * others, shape[1]}), indeces);
+  return reshape(selected, {(int)batchIndices.size(), shape[1], shape[2], shape[3]});
 }
 
 Expr logit(Expr a) {
@@ -85,8 +123,12 @@ Expr operator/(Expr a, Expr b) {
   return Expression<DivNodeOp>(a, b);
 }
 
-Expr dot(Expr a, Expr b) {
-  return Expression<DotNodeOp>(a, b);
+Expr dot(Expr a, Expr b, bool transA, bool transB) {
+  return Expression<DotNodeOp>(a, b, transA, transB);
+}
+
+Expr bdot(Expr a, Expr b) {
+  return Expression<DotBatchedNodeOp>(a, b);
 }
 
 Expr transpose(Expr a) {
@@ -97,6 +139,12 @@ Expr step(Expr a, size_t step) {
   return Expression<TimestepNodeOp>(a, step);
 }
 
+Expr step(Expr a, size_t step, size_t rows) {
+  if(rows == a->shape()[0])
+    return Expression<TimestepNodeOp>(a, step);
+  return Expression<TimestepNodeOp>(a, step, rows);
+}
+
 Expr cross_entropy(Expr a, Expr b) {
   auto sOrig = a->shape();
   auto sOut = a->shape();
@@ -105,9 +153,19 @@ Expr cross_entropy(Expr a, Expr b) {
   return reshape(Expression<CrossEntropyNodeOp>(reshape(a, sTemp), b), sOut);
 }
 
-Expr affine(Expr a, Expr b, Expr c) {
+Expr sharded_cross_entropy(Expr in, Expr W, Expr b, Expr picks, int shards, int chunks,
+                           bool transW) {
+  auto sOrig = in->shape();
+  auto sOut = in->shape();
+  Shape sTemp({sOrig[0] * sOrig[2] * sOrig[3], sOrig[1], 1, 1});
+  sOut.set(1, 1);
+  return reshape(Expression<ShardedCrossEntropyNodeOp>(reshape(in, sTemp), W, b,
+                                                       picks, shards, chunks, transW), sOut);
+}
+
+Expr affine(Expr a, Expr b, Expr c, bool transA, bool transB) {
   std::vector<Expr> nodes = {a, b, c};
-  return Expression<AffineNodeOp>(nodes);
+  return Expression<AffineNodeOp>(nodes, transA, transB);
 }
 
 Expr plus(const std::vector<Expr>&) {
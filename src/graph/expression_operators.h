@@ -42,6 +42,21 @@ Expr name(Expr a, const std::string& name);
 
 Expr rows(Expr a, const std::vector<size_t>& indeces);
 
+/** @brief Rows of  a  at the float indices computed by  indices , without a host copy */
+Expr rows(Expr a, Expr indices);
+
+/** @brief The columns  indeces  of the 2D  a , e.g. a slice of output layer weights */
+Expr cols(Expr a, const std::vector<size_t>& indeces);
+
+/** @brief Column of the largest value per row, never  exclude , see ArgmaxNodeOp */
+Expr argmax(Expr a, int exclude = -1);
+
+/**
+ * @brief Keeps the given entries of the batch dimension (axis 0) of a
+ * {batch, dim, words, beam} expression, in this order.
+ */
+Expr select_batch(Expr a, const std::vector<size_t>& batchIndices);
+
 Expr plus(const std::vector<Expr>&);
 
 Expr logit(Expr a);
@@ -93,7 +108,14 @@ Expr operator*(Expr a, Expr b);
 Expr operator/(Expr a, Expr b);
 //Expr operator/=(Expr a, Expr b);
 
-Expr dot(Expr a, Expr b);
+/**
+ * @brief Matrix product op(a) * op(b), op transposes a 2D operand if its flag
+ * is set, without copying it
+ */
+Expr dot(Expr a, Expr b, bool transA = false, bool transB = false);
+
+/** @brief Matrix product for every slice of dimensions 2 and 3, which must match */
+Expr bdot(Expr a, Expr b);
 
 Expr transpose(Expr a);
 
@@ -125,9 +147,18 @@ Expr mean(Expr a, Args ...args) {
 
 Expr cross_entropy(Expr a, Expr b);
 
+/**
+ * @brief cross_entropy(affine(in, W, b, false, transW), picks) computed in
+ *  shards  slices of the vocabulary and  chunks  blocks of target positions,
+ * so that the logits are never held at once
+ */
+Expr sharded_cross_entropy(Expr in, Expr W, Expr b, Expr picks, int shards, int chunks = 1,
+                           bool transW = false);
+
 //Expr tanh(Expr a, Expr b, Expr c);
 
-Expr affine(Expr a, Expr b, Expr c);
+/** @brief op(a) * op(b) + c, see dot() */
+Expr affine(Expr a, Expr b, Expr c, bool transA = false, bool transB = false);
 
 template <typename ...Args>
 Expr scalar_product(Expr a, Expr b, Args ...args) {
@@ -143,12 +174,22 @@ Expr weighted_average(Expr in, Expr weights, Args ...args) {
 
 Expr step(Expr a, size_t step);
 
+/** @brief The first  rows  rows of timestep  step , a view like step(a, step) */
+Expr step(Expr a, size_t step, size_t rows);
+
 Expr sqrt(Expr a, float eps = 0.f);
 Expr square(Expr a);
 
 Expr layer_norm(Expr x, Expr gamma, Expr beta = nullptr);
 //Expr batch_norm(Expr x, Expr gamma, Expr beta = nullptr);
 
+/**
+ * Dropout with a mask of shape  maskShape  broadcast over  x . The mask is
+ * drawn from  seed  inside the kernels and never materialized, so calls with
+ * the same seed share one mask.
+ */
+Expr dropout(Expr x, float prob, Shape maskShape, size_t seed);
+
 template <typename ...Args>
 Expr dropout(Expr x, Args ...args) {
   auto mask = Get(keywords::mask, nullptr, args...);
@@ -156,10 +197,8 @@ Expr dropout(Expr x, Args ...args) {
 
   UTIL_THROW_IF2(!mask && !dropout_prob,
                  "Neither mask nor dropout prob given");
-  if(!mask) {
-    auto graph = x->graph();
-    mask = graph->dropout(dropout_prob, x->shape());
-  }
+  if(!mask)
+    return dropout(x, dropout_prob, x->shape(), x->graph()->dropoutSeed());
   return x * mask;
 }
 
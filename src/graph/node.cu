@@ -6,8 +6,8 @@ namespace marian {
 
 size_t Node::allocate() {
   size_t elements = 0;
-  if(!val_) {
-    graph_->tensor(val_, shape_);
+  if(!val_ && !graph_->inlined(id_)) {
+    graph_->nodeTensor(val_, shape_, id_);
     elements = val_->shape().elements();
   }
   return elements;
@@ -15,22 +15,22 @@ size_t Node::allocate() {
 
 void Node::free() {
   if(val_)
-    graph_->free(val_);
+    graph_->free(val_, id_);
   if(adj_)
-    graph_->free(adj_);
+    graph_->free(adj_, id_, true);
 }
 
 void Node::init_dependent() {
   if(!adj_) {
-    graph_->tensor(adj_, shape_);
-    adj_->set(1);
+    graph_->nodeTensor(adj_, shape_, id_, true);
+    graph_->fill(adj_, 1);
   }
 }
 
 void Node::set_zero_adjoint() {
   if(!adj_) {
-    graph_->tensor(adj_, shape_);
-    adj_->set(0);
+    graph_->nodeTensor(adj_, shape_, id_, true);
+    graph_->fill(adj_, 0);
   }
 }
 
@@ -43,6 +43,24 @@ cublasHandle_t Node::getCublasHandle() {
   return graph_->getCublasHandle();
 }
 
+void Node::prod(Tensor C, const Tensor A, const Tensor B,
+                bool transA, bool transB, Float beta) {
+  const int8_t* quantB;
+  const float* scalesB;
+  const BlockSparse* sparseB;
+  if(graph_->getQuantized() && !transA && !transB
+     && graph_->quantizedParam(B, quantB, scalesB))
+    ProdInt8(getCublasHandle(), C, A, B, transA, transB, beta, quantB, scalesB);
+  else if(graph_->getBlockSparse() > 0 && !transA && !transB
+          && graph_->blockSparseParam(B, sparseB))
+    ProdBlockSparse(C, A, *sparseB, beta);
+  else if(graph_->getHalfPrecision())
+    ProdHalf(getCublasHandle(), C, A, B, transA, transB, beta,
+             graph_->halfParam(A), graph_->halfParam(B));
+  else
+    Prod(getCublasHandle(), C, A, B, transA, transB, beta);
+}
+
 void NaryNodeOp::remove_children_from_top_nodes() {
   for(auto child : children_)
     graph_->remove_top_node(child);
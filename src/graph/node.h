@@ -53,6 +53,12 @@ class Node : public Chainable<Tensor>,
     bool markedForDebug_{false};
     std::string debugMessage_;
 
+    // built by the first forward() and backward(), see NodeOps
+    NodeOps forward_;
+    NodeOps backward_;
+    bool forwardBuilt_{false};
+    bool backwardBuilt_{false};
+
   public:
     template <typename ...Args>
     Node(ExpressionGraphPtr graph, Args ...args)
@@ -81,11 +87,19 @@ class Node : public Chainable<Tensor>,
     }
 
     virtual void forward() {
-      runForward(forwardOps());
+      if(!forwardBuilt_) {
+        forward_ = forwardOps();
+        forwardBuilt_ = true;
+      }
+      runForward(forward_);
     }
 
     virtual void backward() {
-      runBackward(backwardOps());
+      if(!backwardBuilt_) {
+        backward_ = backwardOps();
+        backwardBuilt_ = true;
+      }
+      runBackward(backward_);
     }
 
 
@@ -183,11 +197,21 @@ class Node : public Chainable<Tensor>,
     }
 
     cublasHandle_t getCublasHandle();
+
+    /**
+     * @brief Matrix product, in int8 for quantized parameters of a quantized
+     * graph, block-sparse for pruned parameters if the graph allows it, else
+     * in fp16 with fp32 accumulation if the graph runs in half precision
+     */
+    void prod(Tensor C, const Tensor A, const Tensor B,
+              bool transA, bool transB, Float beta = 0);
 };
 
 struct NaryNodeOp : public Node {
   size_t hash_{0};
   std::vector<Expr> children_;
+  std::vector<Tensor> childValues_;
+  std::vector<Tensor> childGrads_;
 
   template <typename ...Args>
   NaryNodeOp(const std::vector<Expr>& nodes, Args ...args)
@@ -206,6 +230,22 @@ struct NaryNodeOp : public Node {
     return children_;
   }
 
+  /** @brief Values of the children, gathered again on every call into the same buffer */
+  const std::vector<Tensor>& childValues() {
+    childValues_.clear();
+    for(auto&& child : children_)
+      childValues_.push_back(child->val());
+    return childValues_;
+  }
+
+  /** @brief Gradients of the children, null for those that are not trainable */
+  const std::vector<Tensor>& childGrads() {
+    childGrads_.clear();
+    for(auto&& child : children_)
+      childGrads_.push_back(child->trainable() ? child->grad() : nullptr);
+    return childGrads_;
+  }
+
   virtual size_t hash() {
     if(!hash_) {
       std::size_t seed = boost::hash<std::string>()(name());
@@ -28,7 +28,7 @@ namespace marian {
     // @TODO params
     size_t elements = 0;
     if(!val_) {
-      graph()->tensor(val_, shape_);
+      graph()->nodeTensor(val_, shape_, id_);
       elements = val_->shape().elements();
     }
     return elements;
@@ -8,58 +8,162 @@
 
 namespace marian {
 
+/**
+ * Matrix product op(A) * op(B), where op transposes a 2D operand if its flag
+ * is set. cuBLAS reads the operand transposed in place, so a transposed
+ * matrix never needs to be copied.
+ */
 struct DotNodeOp : public NaryNodeOp {
+  bool transA_;
+  bool transB_;
+
   template <typename ...Args>
-  DotNodeOp(Expr a, Expr b, Args ...args)
+  DotNodeOp(Expr a, Expr b, bool transA, bool transB, Args ...args)
+  : NaryNodeOp({a, b},
+               keywords::shape=newShape(a, b, transA, transB),
+               args...),
+    transA_(transA), transB_(transB) { }
+
+  Shape newShape(Expr a, Expr b, bool transA, bool transB) {
+    return productShape(a->shape(), b->shape(), transA, transB);
+  }
+
+  /** @brief Shape of op(A) * op(B), only 2D operands can be transposed */
+  static Shape productShape(Shape shapeA, Shape shapeB,
+                            bool transA, bool transB) {
+    UTIL_THROW_IF2((transA && shapeA[2] * shapeA[3] != 1)
+                   || (transB && shapeB[2] * shapeB[3] != 1),
+                   "only 2D operands can be transposed");
+    if(transA) {
+      int temp = shapeA[0];
+      shapeA.set(0, shapeA[1]);
+      shapeA.set(1, temp);
+    }
+    int rowsB = transB ? shapeB[1] : shapeB[0];
+    int colsB = transB ? shapeB[0] : shapeB[1];
+
+    Shape outShape = shapeA;
+    outShape.set(1, colsB);
+    UTIL_THROW_IF2(shapeA[1] != rowsB,
+                 "matrix product requires dimensions to match");
+    return outShape;
+  }
+
+  NodeOps forwardOps() {
+    // C = op(A)*op(B)
+    return {
+      NodeOp(prod(val_,
+                  children_[0]->val(),
+                  children_[1]->val(),
+                  transA_, transB_))
+    };
+  }
+
+  NodeOps backwardOps() {
+    return productGrads(this, children_[0], children_[1], transA_, transB_);
+  }
+
+  /**
+   * @brief Gradients of C = op(A)*op(B) for the adjoint D of C, added to those
+   * of A and B: for plain operands df/dA += D*B.T and df/dB += A.T*D, the
+   * transposed cases swap the factors, e.g. df/dA += B*D.T for C = A.T*B.
+   * beta set to 1.0 in gemm, C = dot(A,B) + beta * C, to sum gradients from
+   * different graph parts
+   */
+  static NodeOps productGrads(Node* node, Expr a, Expr b,
+                              bool transA, bool transB) {
+    if(!transA && !transB)
+      return {
+        NodeOp(node->prod(a->grad(), node->grad(), b->val(), false, true, 1.0)),
+        NodeOp(node->prod(b->grad(), a->val(), node->grad(), true, false, 1.0))
+      };
+    if(transA && !transB)
+      return {
+        NodeOp(node->prod(a->grad(), b->val(), node->grad(), false, true, 1.0)),
+        NodeOp(node->prod(b->grad(), a->val(), node->grad(), false, false, 1.0))
+      };
+    if(!transA && transB)
+      return {
+        NodeOp(node->prod(a->grad(), node->grad(), b->val(), false, false, 1.0)),
+        NodeOp(node->prod(b->grad(), node->grad(), a->val(), true, false, 1.0))
+      };
+    return {
+      NodeOp(node->prod(a->grad(), b->val(), node->grad(), true, true, 1.0)),
+      NodeOp(node->prod(b->grad(), node->grad(), a->val(), true, true, 1.0))
+    };
+  }
+
+  virtual size_t hash() {
+    if(!hash_) {
+      hash_ = NaryNodeOp::hash();
+      boost::hash_combine(hash_, transA_);
+      boost::hash_combine(hash_, transB_);
+    }
+    return hash_;
+  }
+
+  const std::string type() {
+    return "•";
+  }
+
+  const std::string color() {
+    return "orange";
+  }
+};
+
+/**
+ * Matrix product per slice of dimensions 2 and 3, e.g. one product per beam
+ * entry or timestep, computed in a single batched GEMM.
+ */
+struct DotBatchedNodeOp : public NaryNodeOp {
+  template <typename ...Args>
+  DotBatchedNodeOp(Expr a, Expr b, Args ...args)
   : NaryNodeOp({a, b},
                keywords::shape=newShape(a, b),
                args...) { }
 
   Shape newShape(Expr a, Expr b) {
-
     auto shapeA = a->shape();
     auto shapeB = b->shape();
 
+    UTIL_THROW_IF2(shapeA[1] != shapeB[0],
+                   "matrix product requires dimensions to match");
+    UTIL_THROW_IF2(shapeA[2] != shapeB[2] || shapeA[3] != shapeB[3],
+                   "batched matrix product requires batch dimensions to match");
+
     Shape outShape = shapeA;
     outShape.set(1, shapeB[1]);
-    UTIL_THROW_IF2(shapeA[1] != shapeB[0],
-                 "matrix product requires dimensions to match");
     return outShape;
   }
 
   NodeOps forwardOps() {
-    // C = A*B
     return {
-      NodeOp(Prod(getCublasHandle(),
-                  val_,
-                  children_[0]->val(),
-                  children_[1]->val(),
-                  false, false))
+      NodeOp(ProdBatched(getCublasHandle(),
+                         val_,
+                         children_[0]->val(),
+                         children_[1]->val(),
+                         false, false))
     };
   }
 
   NodeOps backwardOps() {
-    // D is the adjoint, the matrix of derivatives
-    // df/dA += D*B.T
-    // df/dB += A.T*D
-    // beta set to 1.0 in gemm, C = dot(A,B) + beta * C
-    // to sum gradients from different graph parts
+    // same as DotNodeOp, per slice
     return {
-      NodeOp(Prod(getCublasHandle(),
-                  children_[0]->grad(),
-                  adj_,
-                  children_[1]->val(),
-                  false, true, 1.0)),
-      NodeOp(Prod(getCublasHandle(),
-                  children_[1]->grad(),
-                  children_[0]->val(),
-                  adj_,
-                  true, false, 1.0))
+      NodeOp(ProdBatched(getCublasHandle(),
+                         children_[0]->grad(),
+                         adj_,
+                         children_[1]->val(),
+                         false, true, 1.0)),
+      NodeOp(ProdBatched(getCublasHandle(),
+                         children_[1]->grad(),
+                         children_[0]->val(),
+                         adj_,
+                         true, false, 1.0))
     };
   }
 
   const std::string type() {
-    return "•";
+    return "bdot";
   }
 
   const std::string color() {
@@ -175,6 +279,12 @@ struct PlusNodeOp : public ElementBinaryNodeOp {
     return "+";
   }
 
+  size_t fusable() { return 1; }
+
+  int fuse(ElementProgram& program, const std::vector<int>& args) {
+    return program.emit(ElementOp::plus, args[0], args[1]);
+  }
+
 };
 
 struct MinusNodeOp : public ElementBinaryNodeOp {
@@ -200,6 +310,12 @@ struct MinusNodeOp : public ElementBinaryNodeOp {
     return "-";
   }
 
+  size_t fusable() { return 1; }
+
+  int fuse(ElementProgram& program, const std::vector<int>& args) {
+    return program.emit(ElementOp::minus, args[0], args[1]);
+  }
+
 };
 
 struct MultNodeOp : public ElementBinaryNodeOp {
@@ -226,6 +342,12 @@ struct MultNodeOp : public ElementBinaryNodeOp {
   const std::string type() {
     return "×";
   }
+
+  size_t fusable() { return 1; }
+
+  int fuse(ElementProgram& program, const std::vector<int>& args) {
+    return program.emit(ElementOp::mult, args[0], args[1]);
+  }
 };
 
 struct DivNodeOp : public ElementBinaryNodeOp {
@@ -260,6 +382,12 @@ struct DivNodeOp : public ElementBinaryNodeOp {
     return "÷";
   }
 
+  size_t fusable() { return 1; }
+
+  int fuse(ElementProgram& program, const std::vector<int>& args) {
+    return program.emit(ElementOp::div, args[0], args[1]);
+  }
+
 };
 
 // Cross-entropy node. It computes -b*log(softmax(a)), summing rowwise.
@@ -301,6 +429,74 @@ struct CrossEntropyNodeOp : public NaryNodeOp {
   }
 };
 
+/**
+ * @brief Cross-entropy of the output layer  in * W + b  against the picked
+ * words, see ShardedCrossEntropy(). The backward pass recomputes the logits.
+ * With  transW  the output layer is  in * W^T + b .
+ */
+struct ShardedCrossEntropyNodeOp : public NaryNodeOp {
+  ShardedCrossEntropyNodeOp(Expr in, Expr W, Expr b, Expr picks, int shards, int chunks = 1,
+                            bool transW = false)
+    : NaryNodeOp({in, W, b, picks}, keywords::shape=newShape(in, W, transW)),
+      shards_(shards), chunks_(chunks), transW_(transW) { }
+
+  Shape newShape(Expr in, Expr W, bool transW) {
+    UTIL_THROW_IF2(in->shape()[1] != W->shape()[transW ? 1 : 0],
+                   "matrix product requires dimensions to match");
+    Shape shape1 = in->shape();
+    shape1.set(1, 1);
+    return shape1;
+  }
+
+  NodeOps forwardOps() {
+    return {
+      NodeOp(ShardedCrossEntropy(getCublasHandle(),
+                                 val_,
+                                 children_[0]->val(),
+                                 children_[1]->val(),
+                                 children_[2]->val(),
+                                 children_[3]->val(),
+                                 shards_,
+                                 chunks_,
+                                 transW_))
+    };
+  }
+
+  NodeOps backwardOps() {
+    return {
+      NodeOp(ShardedCrossEntropyBackward(getCublasHandle(),
+                                         children_[0]->grad(),
+                                         children_[1]->grad(),
+                                         children_[2]->grad(),
+                                         adj_,
+                                         val_,
+                                         children_[0]->val(),
+                                         children_[1]->val(),
+                                         children_[2]->val(),
+                                         children_[3]->val(),
+                                         shards_,
+                                         chunks_,
+                                         transW_))
+    };
+  }
+
+  virtual size_t hash() {
+    size_t seed = NaryNodeOp::hash();
+    boost::hash_combine(seed, shards_);
+    boost::hash_combine(seed, chunks_);
+    boost::hash_combine(seed, transW_);
+    return seed;
+  }
+
+  const std::string type() {
+    return "sharded-x-ent";
+  }
+
+  int shards_;
+  int chunks_;
+  bool transW_;
+};
+
 struct ConcatenateNodeOp : public NaryNodeOp {
   template <typename ...Args>
   ConcatenateNodeOp(const std::vector<Expr>& nodes, Args ...args)
@@ -385,52 +581,47 @@ struct TanhPlus3NodeOp : public NaryNodeOp {
 
 };
 
+/** @brief op(A) * op(B) + c, see DotNodeOp for the transposed operands */
 struct AffineNodeOp : public NaryNodeOp {
-  AffineNodeOp(const std::vector<Expr>& nodes)
-    : NaryNodeOp(nodes, keywords::shape=newShape(nodes)) { }
+  bool transA_;
+  bool transB_;
 
-  Shape newShape(const std::vector<Expr>& nodes) {
-    Shape shape1 = nodes[0]->shape();
-    Shape shape2 = nodes[1]->shape();
-    UTIL_THROW_IF2(shape1[1] != shape2[0],
-                   "matrix product requires dimensions to match");
-    shape1.set(1, shape2[1]);
-    return shape1;
+  AffineNodeOp(const std::vector<Expr>& nodes,
+               bool transA = false, bool transB = false)
+    : NaryNodeOp(nodes, keywords::shape=newShape(nodes, transA, transB)),
+      transA_(transA), transB_(transB) { }
+
+  Shape newShape(const std::vector<Expr>& nodes, bool transA, bool transB) {
+    return DotNodeOp::productShape(nodes[0]->shape(), nodes[1]->shape(),
+                                   transA, transB);
   }
 
   NodeOps forwardOps() {
     return {
       NodeOp(
-        Prod(getCublasHandle(),
-             val_,
+        prod(val_,
              children_[0]->val(),
              children_[1]->val(),
-             false, false);
+             transA_, transB_);
         Add(_1, val_, children_[2]->val());
       )
     };
   }
 
   NodeOps backwardOps() {
-    // D is the adjoint, the matrix of derivatives
-    // df/dA += D*B.T
-    // df/dB += A.T*D
-    // beta set to 1.0 in gemm, C = dot(A,B) + beta * C
-    // to sum gradients from different graph parts
+    auto ops = DotNodeOp::productGrads(this, children_[0], children_[1],
+                                       transA_, transB_);
+    ops.push_back(NodeOp(Add(_1, children_[2]->grad(), adj_)));
+    return ops;
+  }
 
-    return {
-      NodeOp(Prod(getCublasHandle(),
-                  children_[0]->grad(),
-                  adj_,
-                  children_[1]->val(),
-                  false, true, 1.0)),
-      NodeOp(Prod(getCublasHandle(),
-                  children_[1]->grad(),
-                  children_[0]->val(),
-                  adj_,
-                  true, false, 1.0)),
-      NodeOp(Add(_1, children_[2]->grad(), adj_))
-    };
+  virtual size_t hash() {
+    if(!hash_) {
+      hash_ = NaryNodeOp::hash();
+      boost::hash_combine(hash_, transA_);
+      boost::hash_combine(hash_, transB_);
+    }
+    return hash_;
   }
 
   const std::string type() {
@@ -3,6 +3,7 @@
 #include "graph/node.h"
 #include "tensors/tensor.h"
 #include "kernels/tensor_operators.h"
+#include "kernels/dropout.h"
 #include "kernels/thrust_functions.h"
 
 namespace marian {
@@ -43,6 +44,12 @@ struct LogitNodeOp : public UnaryNodeOp {
   const std::string type() {
     return "logit";
   }
+
+  size_t fusable() { return 1; }
+
+  int fuse(ElementProgram& program, const std::vector<int>& args) {
+    return program.emit(ElementOp::sigma, args[0]);
+  }
 };
 
 struct TanhNodeOp : public NaryNodeOp {
@@ -114,6 +121,15 @@ struct TanhNodeOp : public NaryNodeOp {
   const std::string type() {
     return "tanh";
   }
+
+  size_t fusable() { return children_.size(); }
+
+  int fuse(ElementProgram& program, const std::vector<int>& args) {
+    int sum = args[0];
+    for(size_t i = 1; i < args.size(); ++i)
+      sum = program.emit(ElementOp::plus, sum, args[i]);
+    return program.emit(ElementOp::tanh, sum);
+  }
 };
 
 /**
@@ -155,61 +171,68 @@ struct ReLUNodeOp : public UnaryNodeOp {
   const std::string type() {
     return "ReLU";
   }
+
+  size_t fusable() { return 1; }
+
+  int fuse(ElementProgram& program, const std::vector<int>& args) {
+    return program.emit(ElementOp::relu, args[0]);
+  }
 };
 
 /**
  * @brief Represents a <a href="https://en.wikipedia.org/wiki/Dropout_(neural_networks)">dropout</a> node
  *        in an expression graph.
  *
+ * The mask of shape  maskShape  is broadcast over the input and never stored:
+ * forward and backward regenerate it from  seed  with philox(), see
+ * DropoutForward().
+ *
  * @see \cite dropout
- * @see \cite cudnn
  */
-//struct DropoutNodeOp : public UnaryNodeOp {
-//  template <typename ...Args>
-//  DropoutNodeOp(Args ...args)
-//  : UnaryNodeOp(args...),
-//    allocated_(false), p_(Get(keywords::value, 0.5)) {}
-//
-//  ~DropoutNodeOp() {
-//    if(allocated_)
-//      CudnnDropoutDestroy(dropDesc_, space_, states_);
-// }
-//
-//  void inference() {
-//    Element(_1 = _2, val_, children_[0]->val());
-//  }
-//
-//  void forward() {
-//    if(!allocated_) {
-//        CudnnDropoutPrepare(children_[0]->val(), p_,
-//                            &dropDesc_,
-//                            &space_, &spaceSize_,
-//                            &states_, (size_t)this); // seeding with pointer address
-//        allocated_ = true;
-//    }
-//
-//    CudnnDropoutForward(dropDesc_, space_, spaceSize_,
-//                        val_, children_[0]->val());
-//  }
-//
-//  void backward() {
-//    if(children_[0]->trainable())
-//        CudnnDropoutBackward(dropDesc_, space_, spaceSize_,
-//                             children_[0]->grad(), adj_);
-//  }
-//
-//  const std::string type() {
-//    return "dropout";
-//  }
-//
-//  private:
-//    bool allocated_;
-//    float p_;
-//    void* states_;
-//    void* space_;
-//    size_t spaceSize_;
-//    cudnnDropoutDescriptor_t dropDesc_;
-//};
+struct DropoutNodeOp : public UnaryNodeOp {
+  template <typename ...Args>
+  DropoutNodeOp(Expr a, float prob, Shape maskShape, size_t seed, Args ...args)
+  : UnaryNodeOp(a, args...),
+    prob_(prob), maskShape_(maskShape), seed_(seed) {}
+
+  NodeOps forwardOps() {
+    return {
+      NodeOp(DropoutForward(val_, children_[0]->val(),
+                            prob_, maskShape_, seed_))
+    };
+  }
+
+  NodeOps backwardOps() {
+    return {
+      NodeOp(DropoutBackward(children_[0]->grad(), adj_,
+                             prob_, maskShape_, seed_))
+    };
+  }
+
+  const std::string type() {
+    return "dropout";
+  }
+
+  // the seed is a launch argument and changes from batch to batch
+  bool capturable() { return false; }
+
+  virtual size_t hash() {
+    if(!hash_) {
+      size_t seed = NaryNodeOp::hash();
+      boost::hash_combine(seed, prob_);
+      boost::hash_combine(seed, seed_);
+      for(auto d : maskShape_)
+        boost::hash_combine(seed, d);
+      hash_ = seed;
+    }
+    return hash_;
+  }
+
+  private:
+    float prob_;
+    Shape maskShape_;
+    size_t seed_;
+};
 
 struct SoftmaxNodeOp : public NaryNodeOp {
   template <typename ...Args>
@@ -299,11 +322,11 @@ struct SumNodeOp : public UnaryNodeOp {
       ax_(keywords::Get(keywords::axis, -1, args...)) { }
 
   NodeOps forwardOps() {
-    return { NodeOp(Reduce(_1, val_, children_[0]->val())) };
+    return { NodeOp(ReduceSum(val_, children_[0]->val())) };
   }
 
   NodeOps backwardOps() {
-    return { NodeOp(Add(_1, children_[0]->grad(), adj_)) };
+    return { NodeOp(AddBroadcast(children_[0]->grad(), adj_)) };
   }
 
   template <class ...Args>
@@ -354,7 +377,7 @@ struct MeanNodeOp : public UnaryNodeOp {
     float scale = 1.f / left;
 
     return {
-      NodeOp(Reduce(_1, val_, children_[0]->val(), scale))
+      NodeOp(ReduceSum(val_, children_[0]->val(), scale))
     };
   }
 
@@ -363,7 +386,7 @@ struct MeanNodeOp : public UnaryNodeOp {
     float scale = 1.f / left;
 
     return {
-      NodeOp(Add(_1, children_[0]->grad(), adj_, scale))
+      NodeOp(AddBroadcast(children_[0]->grad(), adj_, scale))
     };
   }
 
@@ -427,6 +450,12 @@ struct LogNodeOp : public UnaryNodeOp {
   const std::string type() {
     return "log";
   }
+
+  size_t fusable() { return 1; }
+
+  int fuse(ElementProgram& program, const std::vector<int>& args) {
+    return program.emit(ElementOp::log, args[0]);
+  }
 };
 
 struct ExpNodeOp : public UnaryNodeOp {
@@ -455,6 +484,12 @@ struct ExpNodeOp : public UnaryNodeOp {
     return "exp";
   }
 
+  size_t fusable() { return 1; }
+
+  int fuse(ElementProgram& program, const std::vector<int>& args) {
+    return program.emit(ElementOp::exp, args[0]);
+  }
+
 };
 
 struct SqrtNodeOp : public UnaryNodeOp {
@@ -486,6 +521,12 @@ struct SqrtNodeOp : public UnaryNodeOp {
     return "sqrt";
   }
 
+  size_t fusable() { return 1; }
+
+  int fuse(ElementProgram& program, const std::vector<int>& args) {
+    return program.emit(ElementOp::sqrt, args[0], -1, epsilon_);
+  }
+
   virtual size_t hash() {
     if(!hash_) {
       size_t seed = NaryNodeOp::hash();
@@ -526,6 +567,12 @@ struct SquareNodeOp : public UnaryNodeOp {
     return "square";
   }
 
+  size_t fusable() { return 1; }
+
+  int fuse(ElementProgram& program, const std::vector<int>& args) {
+    return program.emit(ElementOp::mult, args[0], args[0]);
+  }
+
 };
 
 
@@ -553,22 +600,38 @@ struct NegNodeOp : public UnaryNodeOp {
   const std::string type() {
     return "-";
   }
+
+  size_t fusable() { return 1; }
+
+  int fuse(ElementProgram& program, const std::vector<int>& args) {
+    return program.emit(ElementOp::neg, args[0]);
+  }
 };
 
-struct RowsNodeOp : public UnaryNodeOp {
+/**
+ * Gathers rows of its first child. The indices are the second child, a
+ * constant uploaded together with the other inputs, so the kernels neither
+ * copy from the host nor allocate. The host copy is kept for hashing.
+ */
+struct RowsNodeOp : public NaryNodeOp {
   template <typename ...Args>
-  RowsNodeOp(Expr a, const std::vector<size_t>& indeces, Args ...args)
-    : UnaryNodeOp(a, keywords::shape=newShape(a, indeces), args...),
+  RowsNodeOp(Expr a, Expr indices, const std::vector<size_t>& indeces, Args ...args)
+    : NaryNodeOp({a, indices}, keywords::shape=newShape(a, indeces), args...),
       indeces_(indeces) {
   }
 
-  NodeOps forwardOps() {
-    // @TODO: solve this with a tensor!
+  /** @brief Rows given only on the device, e.g. computed by an earlier node */
+  template <typename ...Args>
+  RowsNodeOp(Expr a, Expr indices, Args ...args)
+    : NaryNodeOp({a, indices}, keywords::shape=newShape(a, indices), args...) {
+  }
 
+  NodeOps forwardOps() {
     return {
       NodeOp(CopyRows(val_,
                       children_[0]->val(),
-                      indeces_))
+                      children_[1]->val(),
+                      hotRows()))
     };
   }
 
@@ -576,10 +639,16 @@ struct RowsNodeOp : public UnaryNodeOp {
     return {
       NodeOp(PasteRows(children_[0]->grad(),
                        adj_,
-                       indeces_))
+                       children_[1]->val(),
+                       hotRows()))
     };
   }
 
+  /** @brief Frequent rows kept in L2, for lookups in parameters, i.e. embeddings */
+  size_t hotRows() {
+    return children_[0]->type() == "param" ? graph()->getHotRows() : 0;
+  }
+
   template <class ...Args>
   Shape newShape(Expr a, const std::vector<size_t>& indeces) {
     Shape shape = a->shape();
@@ -587,6 +656,12 @@ struct RowsNodeOp : public UnaryNodeOp {
     return shape;
   }
 
+  Shape newShape(Expr a, Expr indices) {
+    Shape shape = a->shape();
+    shape.set(0, indices->shape().elements());
+    return shape;
+  }
+
   const std::string type() {
     return "rows";
   }
@@ -595,9 +670,14 @@ struct RowsNodeOp : public UnaryNodeOp {
     return "orange";
   }
 
+  // the index constant is hashed by address, use its content instead
   virtual size_t hash() {
     if(!hash_) {
-      size_t seed = NaryNodeOp::hash();
+      size_t seed = boost::hash<std::string>()(name());
+      boost::hash_combine(seed, type());
+      boost::hash_combine(seed, children_[0]->hash());
+      if(indeces_.empty())
+        boost::hash_combine(seed, children_[1]->hash());
       for(auto i : indeces_)
         boost::hash_combine(seed, i);
       hash_ = seed;
@@ -609,6 +689,104 @@ struct RowsNodeOp : public UnaryNodeOp {
   std::vector<size_t> indeces_;
 };
 
+/**
+ * @brief Columns of a 2D node, e.g. the output layer weights of a shortlist,
+ * gathered directly instead of transposing  a  for rows() and back
+ */
+struct ColsNodeOp : public NaryNodeOp {
+  template <typename ...Args>
+  ColsNodeOp(Expr a, Expr indices, const std::vector<size_t>& indeces, Args ...args)
+    : NaryNodeOp({a, indices}, keywords::shape=newShape(a, indeces), args...),
+      indeces_(indeces) {
+  }
+
+  NodeOps forwardOps() {
+    return {
+      NodeOp(CopyCols(val_,
+                      children_[0]->val(),
+                      children_[1]->val()))
+    };
+  }
+
+  NodeOps backwardOps() {
+    return {
+      NodeOp(PasteCols(children_[0]->grad(),
+                       adj_,
+                       children_[1]->val()))
+    };
+  }
+
+  Shape newShape(Expr a, const std::vector<size_t>& indeces) {
+    Shape shape = a->shape();
+    UTIL_THROW_IF2(shape[2] * shape[3] != 1, "cols() requires a 2D node");
+    shape.set(1, indeces.size());
+    return shape;
+  }
+
+  const std::string type() {
+    return "cols";
+  }
+
+  const std::string color() {
+    return "orange";
+  }
+
+  virtual size_t hash() {
+    if(!hash_) {
+      size_t seed = boost::hash<std::string>()(name());
+      boost::hash_combine(seed, type());
+      boost::hash_combine(seed, children_[0]->hash());
+      for(auto i : indeces_)
+        boost::hash_combine(seed, i);
+      hash_ = seed;
+    }
+    return hash_;
+  }
+
+  std::vector<size_t> indeces_;
+};
+
+/**
+ * @brief Column of the largest value of every row as a float, e.g. the word
+ * ids of greedy decoding. Column  exclude  is never chosen. Forward only.
+ */
+struct ArgmaxNodeOp : public UnaryNodeOp {
+  template <typename ...Args>
+  ArgmaxNodeOp(Expr a, int exclude, Args ...args)
+    : UnaryNodeOp(a, keywords::shape=newShape(a), args...),
+      exclude_(exclude) { }
+
+  Shape newShape(Expr a) {
+    Shape shape = a->shape();
+    return {shape[0] * shape[2] * shape[3], 1};
+  }
+
+  NodeOps forwardOps() {
+    return {
+      NodeOp(Argmax(val_, children_[0]->val(), exclude_))
+    };
+  }
+
+  NodeOps backwardOps() {
+    UTIL_THROW2("Argmax has no backward pass");
+    return {};
+  }
+
+  const std::string type() {
+    return "argmax";
+  }
+
+  virtual size_t hash() {
+    if(!hash_) {
+      hash_ = NaryNodeOp::hash();
+      boost::hash_combine(hash_, exclude_);
+    }
+    return hash_;
+  }
+
+  int exclude_;
+};
+
 struct TransposeNodeOp : public UnaryNodeOp {
   template <typename ...Args>
   TransposeNodeOp(Expr a, Args ...args)
@@ -653,6 +831,7 @@ struct ReshapeNodeOp : public UnaryNodeOp {
 
   size_t allocate() { return 0; }
   void free() {}
+  bool view() { return true; }
 
   void forward() {}
   void backward() {}
@@ -699,14 +878,25 @@ struct ReshapeNodeOp : public UnaryNodeOp {
 
 struct TimestepNodeOp : public UnaryNodeOp {
   size_t step_;
+  // size of a whole timestep of the child, the view may hold fewer rows
+  size_t stride_;
 
   TimestepNodeOp(Expr a, size_t step)
-    : UnaryNodeOp(a, keywords::shape=newShape(a)),
-      step_(step)
+    : UnaryNodeOp(a, keywords::shape=newShape(a, a->shape()[0])),
+      step_(step),
+      stride_(a->shape()[0] * a->shape()[1])
     { }
 
-  Shape newShape(Expr a) {
+  /** @brief Only the first  rows  rows of the timestep, e.g. its unpadded sentences */
+  TimestepNodeOp(Expr a, size_t step, size_t rows)
+    : UnaryNodeOp(a, keywords::shape=newShape(a, rows)),
+      step_(step),
+      stride_(a->shape()[0] * a->shape()[1])
+    { }
+
+  Shape newShape(Expr a, size_t rows) {
     Shape outShape = a->shape();
+    outShape.set(0, rows);
     outShape.set(2, 1);
     outShape.set(3, 1);
     return outShape;
@@ -714,6 +904,7 @@ struct TimestepNodeOp : public UnaryNodeOp {
 
   size_t allocate() { return 0; }
   void free() {}
+  bool view() { return true; }
 
   void forward() {}
   void backward() {}
@@ -728,14 +919,14 @@ struct TimestepNodeOp : public UnaryNodeOp {
 
   Tensor& val()  {
     auto childVal = children_[0]->val();
-    size_t offset = step_ * shape().elements();
+    size_t offset = step_ * stride_;
     val_.reset(new TensorBase(childVal->data() + offset, shape(), childVal->getDevice()));
     return val_;
   };
 
   Tensor& grad() {
     auto childGrad = children_[0]->grad();
-    size_t offset = step_ * shape().elements();
+    size_t offset = step_ * stride_;
     adj_.reset(new TensorBase(childGrad->data() + offset, shape(), childGrad->getDevice()));
     return adj_;
   };
@@ -752,6 +943,7 @@ struct TimestepNodeOp : public UnaryNodeOp {
     if(!hash_) {
        hash_ = NaryNodeOp::hash();
        boost::hash_combine(hash_, step_);
+       boost::hash_combine(hash_, shape()[0]);
     }
     return hash_;
   }
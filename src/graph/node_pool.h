@@ -0,0 +1,129 @@
+#pragma once
+
+// This file is part of the Marian toolkit.
+
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <mutex>
+#include <memory>
+#include <vector>
+#include <unordered_map>
+
+namespace marian {
+
+/**
+ * @brief Recycles the memory of expression nodes.
+ *
+ * Graphs are rebuilt for every batch from nodes of a small set of types, so
+ * blocks of a few distinct sizes are requested over and over. Released blocks
+ * go to a free list per size and are handed out again, new blocks are carved
+ * from large chunks. Memory only returns to the system when the pool is
+ * destroyed, which happens after the last node allocated from it: every node
+ * keeps the pool alive through its allocator.
+ */
+class NodePool {
+  private:
+    static const size_t CHUNK = 1 << 20;
+    static const size_t ALIGN = 16;
+
+    std::mutex mutex_;
+    std::unordered_map<size_t, std::vector<void*>> free_;
+    std::vector<std::unique_ptr<char[]>> chunks_;
+    char* next_{nullptr};
+    size_t left_{0};
+
+    static size_t align(size_t bytes) {
+      return (bytes + ALIGN - 1) / ALIGN * ALIGN;
+    }
+
+  public:
+    void* allocate(size_t bytes) {
+      bytes = align(bytes);
+      if(bytes > CHUNK / 16)
+        return ::operator new(bytes);
+
+      std::lock_guard<std::mutex> guard(mutex_);
+      auto& blocks = free_[bytes];
+      if(!blocks.empty()) {
+        void* p = blocks.back();
+        blocks.pop_back();
+        return p;
+      }
+      if(left_ < bytes) {
+        // new[] of char is aligned for any fundamental type
+        chunks_.emplace_back(new char[CHUNK]);
+        next_ = chunks_.back().get();
+        left_ = CHUNK;
+      }
+      void* p = next_;
+      next_ += bytes;
+      left_ -= bytes;
+      return p;
+    }
+
+    void deallocate(void* p, size_t bytes) {
+      bytes = align(bytes);
+      if(bytes > CHUNK / 16) {
+        ::operator delete(p);
+        return;
+      }
+      std::lock_guard<std::mutex> guard(mutex_);
+      free_[bytes].push_back(p);
+    }
+
+    /** @brief Bytes held in chunks, in use or free */
+    size_t reserved() {
+      std::lock_guard<std::mutex> guard(mutex_);
+      return chunks_.size() * CHUNK;
+    }
+};
+
+/** @brief Standard allocator over a NodePool, for std::allocate_shared */
+template <class T>
+struct NodeAllocator {
+  typedef T value_type;
+
+  std::shared_ptr<NodePool> pool;
+
+  NodeAllocator(std::shared_ptr<NodePool> p) : pool(p) {}
+
+  template <class U>
+  NodeAllocator(const NodeAllocator<U>& other) : pool(other.pool) {}
+
+  T* allocate(size_t n) {
+    return static_cast<T*>(pool->allocate(n * sizeof(T)));
+  }
+
+  void deallocate(T* p, size_t n) {
+    pool->deallocate(p, n * sizeof(T));
+  }
+
+  template <class U>
+  bool operator==(const NodeAllocator<U>& other) const {
+    return pool == other.pool;
+  }
+
+  template <class U>
+  bool operator!=(const NodeAllocator<U>& other) const {
+    return pool != other.pool;
+  }
+};
+
+}
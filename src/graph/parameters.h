@@ -26,6 +26,7 @@
 #include <fstream>
 
 #include "common/definitions.h"
+#include "graph/binary_model.h"
 #include "tensors/tensor_allocator.h"
 
 namespace marian {
@@ -38,9 +39,51 @@ class Parameters {
 
     Ptr<TensorAllocator> vals_;
     Ptr<TensorAllocator> grads_;
+    bool shared_{false};
+
+    // glob patterns of parameter names that are not trained, see setFrozen()
+    std::vector<std::string> freeze_;
+    // glob patterns of parameter names kept in managed memory, see setManaged()
+    std::vector<std::string> managed_;
+    size_t device_{0};
+
+    static bool matches(const char* pattern, const char* name) {
+      if(*pattern == '*')
+        return matches(pattern + 1, name) || (*name && matches(pattern, name + 1));
+      if(!*pattern)
+        return !*name;
+      return (*pattern == '?' ? *name != 0 : *pattern == *name)
+             && matches(pattern + 1, name + 1);
+    }
+
+    // values and gradients share offsets, the sharded optimizers rely on it.
+    // Frozen parameters follow all others and have no gradients.
+    template <class Get>
+    void allocate(Ptr<TensorAllocator> arena, Get get, bool withFrozen) {
+      size_t total = withFrozen ? totalSize() : trainedSize();
+      arena->reserveExact(total);
+      arena->reservePlanned(total);
+      size_t offset = 0;
+      for(bool pass : {false, true}) {
+        if(pass && !withFrozen)
+          break;
+        for(auto p : params_) {
+          if(frozen(p) != pass)
+            continue;
+          if(!get(p))
+            arena->allocateAt(get(p), p->shape(), offset);
+          offset += BinaryModel::aligned(p->shape().elements());
+        }
+      }
+      if(managing())
+        for(auto p : params_)
+          if(get(p))
+            arena->advise(get(p), !managed(p));
+    }
 
   public:
     void init(size_t device) {
+      device_ = device;
       vals_  = New<TensorAllocator>(device);
       grads_ = New<TensorAllocator>(device);
     }
@@ -71,13 +114,76 @@ class Parameters {
       return params_.size();
     }
 
+    /**
+     * @brief Floats of the parameter values. Every parameter starts on a 256 byte
+     * boundary, in the order of creation, which is the layout of a BinaryModel
+     * unless parameters are frozen.
+     */
     size_t totalSize() {
       size_t sum = 0;
       for(auto p : params_)
-        sum += p->shape().elements();
+        sum += BinaryModel::aligned(p->shape().elements());
       return sum;
     }
 
+    /** @brief Floats of the trained parameters, the prefix of the values that has gradients */
+    size_t trainedSize() {
+      size_t sum = 0;
+      for(auto p : params_)
+        if(!frozen(p))
+          sum += BinaryModel::aligned(p->shape().elements());
+      return sum;
+    }
+
+    /**
+     * @brief Excludes the parameters whose names match one of the glob
+     *  patterns , e.g. "encoder_*", from training. Frozen parameters are
+     * laid out after the trained ones, get no gradients, and vals() and
+     * grads(), which optimizers and shards work on, stop before them. Set
+     * before the parameters are allocated.
+     */
+    void setFrozen(const std::vector<std::string>& patterns) {
+      UTIL_THROW_IF2(vals_->capacity() > 0, "Parameters must be frozen before they are allocated");
+      freeze_ = patterns;
+    }
+
+    bool freezing() {
+      return !freeze_.empty();
+    }
+
+    /**
+     * @brief Places values and gradients in CUDA managed memory, which may
+     * exceed the device, e.g. for giant vocabularies. Parameters matching one
+     * of the glob  patterns , e.g. Wemb*, live on the host and migrate to the
+     * device as they are used or prefetched, all others stay on the device.
+     * Set before the parameters are allocated.
+     */
+    void setManaged(const std::vector<std::string>& patterns) {
+      UTIL_THROW_IF2(vals_->capacity() > 0, "Parameters must be managed before they are allocated");
+      managed_ = patterns;
+      bool managed = managing() && !isCPU(device_);
+      vals_  = New<TensorAllocator>(device_, allocation::bestfit, managed);
+      grads_ = New<TensorAllocator>(device_, allocation::bestfit, managed);
+    }
+
+    bool managing() {
+      return !managed_.empty();
+    }
+
+    bool managed(Expr p) {
+      for(auto& pattern : managed_)
+        if(matches(pattern.c_str(), p->name().c_str()))
+          return true;
+      return false;
+    }
+
+    bool frozen(Expr p) {
+      for(auto& pattern : freeze_)
+        if(matches(pattern.c_str(), p->name().c_str()))
+          return true;
+      return false;
+    }
+
     void add(Expr p, const std::string& name) {
       params_.push_back(p);
       UTIL_THROW_IF2(named_.count(name),
@@ -85,35 +191,75 @@ class Parameters {
       named_[name] = p;
     }
 
-    void allocateForward() {
-      if(vals_->capacity() == 0) {
-        vals_->reserveExact(totalSize());
-        for(auto p: params_)
-          if(!p->val())
-            vals_->allocate(p->val(), p->shape());
+    /** @brief Drops every parameter  p  with  unused(p) , only before they are allocated */
+    template <class Unused>
+    void prune(Unused unused) {
+      UTIL_THROW_IF2(vals_->capacity() > 0, "Cannot drop allocated parameters");
+      std::vector<Expr> kept;
+      for(auto p : params_) {
+        if(unused(p))
+          named_.erase(p->name());
+        else
+          kept.push_back(p);
       }
+      params_.swap(kept);
+    }
+
+    void allocateForward() {
+      if(vals_->capacity() == 0)
+        allocate(vals_, [](Expr p) -> Tensor& { return p->val(); }, true);
+    }
+
+    /**
+     * @brief Uses the values of  owner , which must be allocated, e.g. one
+     * model read by several translator graphs of a device. The arena lives
+     * as long as any of them, the values are read-only here.
+     */
+    void share(Parameters& owner) {
+      UTIL_THROW_IF2(owner.vals_->capacity() == 0,
+                     "Only allocated parameters can be shared");
+      vals_ = owner.vals_;
+      shared_ = true;
+    }
+
+    bool shared() {
+      return shared_;
     }
 
     void allocateBackward() {
-      if(grads_->capacity() == 0) {
-        grads_->reserveExact(totalSize());
-        for(auto p: params_)
-          if(!p->grad())
-            grads_->allocate(p->grad(), p->shape());
-      }
+      UTIL_THROW_IF2(shared_, "Shared parameters are read-only");
+      if(grads_->capacity() == 0)
+        allocate(grads_, [](Expr p) -> Tensor& { return p->grad(); }, false);
     }
 
     void set_zero_adjoint() {
       grads()->set(0);
     }
 
+    /** @brief Values of the trained parameters, all values if none are frozen */
     Tensor vals() {
+      Tensor all = vals_->asTensor();
+      if(!freezing() || !all)
+        return all;
+      return all->subtensor(0, trainedSize());
+    }
+
+    /** @brief Values of all parameters, including frozen ones */
+    Tensor allVals() {
       return vals_->asTensor();
     }
 
     Tensor grads() {
       return grads_->asTensor();
     }
+
+    Ptr<TensorAllocator> valsAllocator() {
+      return vals_;
+    }
+
+    Ptr<TensorAllocator> gradsAllocator() {
+      return grads_;
+    }
 };
 
 }
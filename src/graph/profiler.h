@@ -0,0 +1,215 @@
+#pragma once
+
+// This file is part of the Marian toolkit.
+
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <map>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <fstream>
+#include <algorithm>
+#include <cuda_runtime.h>
+
+#include "common/logging.h"
+#include "tensors/tensor.h"
+#include "kernels/cuda_helpers.h"
+
+namespace marian {
+
+/**
+ * @brief Times the kernels of every node visited by forward() and backward().
+ *
+ * On the GPU each node is bracketed by two CUDA events on the calling thread's
+ * stream, so kernels run undisturbed and are only synchronized once at the end
+ * of a batch. On the CPU, where kernels are synchronous, host time is measured.
+ * Times are aggregated by node type and by node name over a fixed number of
+ * batches. Then a ranked report is logged and, optionally, all measurements are
+ * written as a Chrome trace (chrome://tracing, one row per direction).
+ */
+class Profiler {
+  private:
+    struct Record {
+      std::string type;
+      std::string name;
+      bool backward;
+      size_t event;
+      double start;
+      double ms;
+    };
+
+    struct Stat {
+      size_t calls{0};
+      double ms{0};
+    };
+
+    typedef std::chrono::steady_clock clock;
+
+    size_t device_;
+    size_t batches_;
+    size_t done_{0};
+    std::string traceFile_;
+
+    std::vector<cudaEvent_t> events_;
+    std::vector<Record> records_;
+    size_t used_{0};
+
+    clock::time_point epoch_{clock::now()};
+    clock::time_point host_;
+    double base_{0};
+
+    std::map<std::string, Stat> byType_;
+    std::map<std::string, Stat> byName_;
+    double total_{0};
+    std::vector<Record> trace_;
+
+    double now() {
+      return std::chrono::duration<double, std::micro>(clock::now() - epoch_).count();
+    }
+
+    cudaEvent_t event(size_t i) {
+      while(events_.size() <= i) {
+        cudaEvent_t e;
+        CUDA_CHECK(cudaEventCreate(&e));
+        events_.push_back(e);
+      }
+      return events_[i];
+    }
+
+    void table(const std::string& title, const std::map<std::string, Stat>& stats, size_t k) {
+      std::vector<std::pair<std::string, Stat>> ranked(stats.begin(), stats.end());
+      std::sort(ranked.begin(), ranked.end(),
+                [](const std::pair<std::string, Stat>& a, const std::pair<std::string, Stat>& b) {
+                  return a.second.ms > b.second.ms;
+                });
+
+      LOG(info, "{:<32} {:>8} {:>12} {:>10} {:>7}", title, "calls", "total ms", "avg us", "share");
+      for(size_t i = 0; i < std::min(k, ranked.size()); ++i) {
+        auto& s = ranked[i].second;
+        LOG(info, "{:<32} {:>8} {:>12.3f} {:>10.1f} {:>6.1f}%",
+            ranked[i].first, s.calls, s.ms, 1000 * s.ms / s.calls,
+            total_ > 0 ? 100 * s.ms / total_ : 0.0);
+      }
+    }
+
+    void writeTrace() {
+      std::ofstream out(traceFile_);
+      UTIL_THROW_IF2(!out, "Could not open profiler trace file " << traceFile_);
+      out << "{\"traceEvents\":[\n";
+      for(size_t i = 0; i < trace_.size(); ++i) {
+        auto& r = trace_[i];
+        out << "{\"name\":\"" << r.type << "\",\"cat\":\""
+            << (r.backward ? "backward" : "forward")
+            << "\",\"ph\":\"X\",\"ts\":" << r.start << ",\"dur\":" << 1000 * r.ms
+            << ",\"pid\":" << device_ << ",\"tid\":" << r.backward
+            << ",\"args\":{\"name\":\"" << r.name << "\"}}"
+            << (i + 1 < trace_.size() ? ",\n" : "\n");
+      }
+      out << "]}\n";
+    }
+
+  public:
+    Profiler(size_t device, size_t batches, const std::string& traceFile)
+      : device_(device), batches_(batches), traceFile_(traceFile) {}
+
+    ~Profiler() {
+      for(auto e : events_)
+        cudaEventDestroy(e);
+    }
+
+    bool active() {
+      return done_ < batches_;
+    }
+
+    void start(const std::string& type, const std::string& name, bool backward) {
+      records_.push_back({type, name, backward, 0, 0, 0});
+      auto& r = records_.back();
+      if(isCPU(device_)) {
+        r.start = now();
+        return;
+      }
+      if(used_ == 0) {
+        // device times of this batch are offsets to the first event
+        CUDA_CHECK(cudaEventRecord(event(used_++), currentStream()));
+        base_ = now();
+      }
+      r.event = used_;
+      CUDA_CHECK(cudaEventRecord(event(used_++), currentStream()));
+    }
+
+    void stop() {
+      auto& r = records_.back();
+      if(isCPU(device_)) {
+        r.ms = (now() - r.start) / 1000;
+        return;
+      }
+      CUDA_CHECK(cudaEventRecord(event(used_++), currentStream()));
+    }
+
+    /** @brief Ends a batch: collects its measurements, reports after the last profiled batch */
+    void batch() {
+      if(!active() || records_.empty())
+        return;
+
+      if(!isCPU(device_)) {
+        CUDA_CHECK(cudaEventSynchronize(events_[used_ - 1]));
+        for(auto& r : records_) {
+          float offset, ms;
+          CUDA_CHECK(cudaEventElapsedTime(&offset, events_[0], events_[r.event]));
+          CUDA_CHECK(cudaEventElapsedTime(&ms, events_[r.event], events_[r.event + 1]));
+          r.start = base_ + 1000 * offset;
+          r.ms = ms;
+        }
+      }
+
+      for(auto& r : records_) {
+        std::string label = r.type + (r.backward ? " (bwd)" : "");
+        byType_[label].calls++;
+        byType_[label].ms += r.ms;
+        if(r.name != "none") {
+          byName_[r.name].calls++;
+          byName_[r.name].ms += r.ms;
+        }
+        total_ += r.ms;
+      }
+      if(!traceFile_.empty())
+        trace_.insert(trace_.end(), records_.begin(), records_.end());
+
+      records_.clear();
+      used_ = 0;
+
+      if(++done_ == batches_)
+        report();
+    }
+
+    /** @brief Logs the  k  most expensive node types and named nodes, writes the trace */
+    void report(size_t k = 20) {
+      LOG(info, "Profile of {} batches on device {}: {:.3f} ms in nodes",
+          done_, device_, total_);
+      table("node type", byType_, k);
+      if(!byName_.empty())
+        table("node name", byName_, k);
+      if(!traceFile_.empty())
+        writeTrace();
+    }
+};
+
+}
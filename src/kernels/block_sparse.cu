@@ -0,0 +1,109 @@
+#include <algorithm>
+
+#include "kernels/block_sparse.h"
+#include "kernels/cuda_helpers.h"
+
+namespace marian {
+
+bool ToBlockSparse(BlockSparse& out, const std::vector<float>& dense,
+                   int rows, int cols, float maxDensity) {
+  out = BlockSparse();
+  int blockRows = (rows + SPARSE_BLOCK - 1) / SPARSE_BLOCK;
+  int blockCols = (cols + SPARSE_BLOCK - 1) / SPARSE_BLOCK;
+
+  std::vector<int> colStart(1, 0);
+  std::vector<int> rowIndex;
+  std::vector<float> values;
+  for(int bc = 0; bc < blockCols; ++bc) {
+    for(int br = 0; br < blockRows; ++br) {
+      bool nonzero = false;
+      for(int i = br * SPARSE_BLOCK; i < std::min(rows, (br + 1) * SPARSE_BLOCK) && !nonzero; ++i)
+        for(int j = bc * SPARSE_BLOCK; j < std::min(cols, (bc + 1) * SPARSE_BLOCK); ++j)
+          if(dense[(size_t)i * cols + j] != 0.f) {
+            nonzero = true;
+            break;
+          }
+      if(!nonzero)
+        continue;
+
+      rowIndex.push_back(br);
+      for(int i = 0; i < SPARSE_BLOCK; ++i)
+        for(int j = 0; j < SPARSE_BLOCK; ++j) {
+          int r = br * SPARSE_BLOCK + i, c = bc * SPARSE_BLOCK + j;
+          values.push_back(r < rows && c < cols ? dense[(size_t)r * cols + c] : 0.f);
+        }
+    }
+    colStart.push_back(rowIndex.size());
+  }
+
+  if(rowIndex.size() > maxDensity * blockRows * blockCols)
+    return false;
+
+  out.rows = rows;
+  out.cols = cols;
+  out.blocks = rowIndex.size();
+  CUDA_CHECK(cudaMalloc(&out.colStart, colStart.size() * sizeof(int)));
+  CUDA_CHECK(cudaMalloc(&out.rowIndex, std::max(rowIndex.size(), (size_t)1) * sizeof(int)));
+  CUDA_CHECK(cudaMalloc(&out.values, std::max(values.size(), (size_t)1) * sizeof(float)));
+  CUDA_CHECK(cudaMemcpy(out.colStart, colStart.data(), colStart.size() * sizeof(int),
+                        cudaMemcpyHostToDevice));
+  CUDA_CHECK(cudaMemcpy(out.rowIndex, rowIndex.data(), rowIndex.size() * sizeof(int),
+                        cudaMemcpyHostToDevice));
+  CUDA_CHECK(cudaMemcpy(out.values, values.data(), values.size() * sizeof(float),
+                        cudaMemcpyHostToDevice));
+  return true;
+}
+
+void FreeBlockSparse(BlockSparse& sparse) {
+  cudaFree(sparse.colStart);
+  cudaFree(sparse.rowIndex);
+  cudaFree(sparse.values);
+  sparse = BlockSparse();
+}
+
+// one thread block per SPARSE_BLOCK x SPARSE_BLOCK tile of C, which sums the
+// products of the tiles of A with the nonzero blocks of its block column of B
+__global__
+void gProdBlockSparse(float* C, const float* A, int m, int k, int n,
+                      const int* colStart, const int* rowIndex,
+                      const float* values, float beta) {
+  __shared__ float tileA[SPARSE_BLOCK][SPARSE_BLOCK + 1];
+  __shared__ float tileB[SPARSE_BLOCK][SPARSE_BLOCK + 1];
+
+  int tx = threadIdx.x, ty = threadIdx.y;
+  int row = blockIdx.y * SPARSE_BLOCK + ty;
+  int col = blockIdx.x * SPARSE_BLOCK + tx;
+
+  float sum = 0;
+  for(int p = colStart[blockIdx.x]; p < colStart[blockIdx.x + 1]; ++p) {
+    int kk = rowIndex[p] * SPARSE_BLOCK + tx;
+    tileA[ty][tx] = row < m && kk < k ? A[(size_t)row * k + kk] : 0.f;
+    tileB[ty][tx] = values[(size_t)p * SPARSE_BLOCK * SPARSE_BLOCK + ty * SPARSE_BLOCK + tx];
+    __syncthreads();
+    for(int i = 0; i < SPARSE_BLOCK; ++i)
+      sum += tileA[ty][i] * tileB[i][tx];
+    __syncthreads();
+  }
+
+  if(row < m && col < n) {
+    float* out = C + (size_t)row * n + col;
+    *out = beta ? sum + beta * *out : sum;
+  }
+}
+
+void ProdBlockSparse(Tensor C, const Tensor A, const BlockSparse& B, float beta) {
+  cudaSetDevice(C->getDevice());
+
+  int m = A->shape()[0] * A->shape()[2] * A->shape()[3];
+  int k = A->shape()[1];
+  UTIL_THROW_IF2(k != B.rows, "matrix product requires dimensions to match");
+
+  dim3 threads(SPARSE_BLOCK, SPARSE_BLOCK);
+  dim3 blocks((B.cols + SPARSE_BLOCK - 1) / SPARSE_BLOCK,
+              (m + SPARSE_BLOCK - 1) / SPARSE_BLOCK);
+  gProdBlockSparse<<<blocks, threads, 0, currentStream()>>>(
+    C->data(), A->data(), m, k, B.cols,
+    B.colStart, B.rowIndex, B.values, beta);
+}
+
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <vector>
+
+#include "tensors/tensor.h"
+
+namespace marian {
+
+/** @brief Side of the square blocks of BlockSparse matrices */
+const int SPARSE_BLOCK = 16;
+
+/**
+ * @brief A matrix in block compressed sparse column format on the device:
+ * the nonzero SPARSE_BLOCK x SPARSE_BLOCK blocks of every block column, with
+ * their block rows in  rowIndex[colStart[j], colStart[j + 1]) . Blocks are
+ * stored row-major one after the other, edge blocks padded with zeros.
+ */
+struct BlockSparse {
+  int rows{0};
+  int cols{0};
+  int blocks{0};
+  int* colStart{nullptr};
+  int* rowIndex{nullptr};
+  float* values{nullptr};
+};
+
+/**
+ * @brief Converts the row-major  rows x cols  matrix  dense  on the host into
+ *  out  on the current device if at most the fraction  maxDensity  of its
+ * blocks has a nonzero entry, else leaves  out  empty and returns false
+ */
+bool ToBlockSparse(BlockSparse& out, const std::vector<float>& dense,
+                   int rows, int cols, float maxDensity);
+
+void FreeBlockSparse(BlockSparse& sparse);
+
+/** @brief C = A * B + beta * C for a dense A, which is read as a matrix of A->shape()[1] columns */
+void ProdBlockSparse(Tensor C, const Tensor A, const BlockSparse& B, float beta);
+
+}
@@ -1,5 +1,9 @@
 #pragma once
 
+#include <cstdio>
+#include <cuda.h>
+#include <cuda_runtime.h>
+
 #define CUDA_CHECK(ans) { gpuAssert((ans), __FILE__, __LINE__); }
 
 inline void gpuAssert(cudaError_t code, const char *file, int line, bool abort=true)
@@ -10,3 +14,71 @@ inline void gpuAssert(cudaError_t code, const char *file, int line, bool abort=t
       if (abort) exit(code);
    }
 }
+
+#define CU_CHECK(ans) { cuAssert((ans), __FILE__, __LINE__); }
+
+inline void cuAssert(CUresult code, const char *file, int line, bool abort=true)
+{
+   if (code != CUDA_SUCCESS)
+   {
+      const char* msg = "unknown error";
+      cuGetErrorString(code, &msg);
+      fprintf(stderr,"CUassert: %s %s %d\n", msg, file, line);
+      if (abort) exit(code);
+   }
+}
+
+#ifdef NCCL_FOUND
+#include <nccl.h>
+
+#define NCCL_CHECK(ans) { ncclAssert((ans), __FILE__, __LINE__); }
+
+inline void ncclAssert(ncclResult_t code, const char *file, int line, bool abort=true)
+{
+   if (code != ncclSuccess)
+   {
+      fprintf(stderr,"NCCLassert: %s %s %d\n", ncclGetErrorString(code), file, line);
+      if (abort) exit(code);
+   }
+}
+#endif
+
+/**
+ * @brief Stream on which kernel wrappers and transfers of the calling thread
+ * are enqueued. The per-thread default stream unless an ExpressionGraph has
+ * bound its own stream, see ExpressionGraph::StreamScope.
+ */
+inline cudaStream_t& currentStream() {
+  thread_local cudaStream_t stream = cudaStreamPerThread;
+  return stream;
+}
+
+/**
+ * @brief Scheduling class of work on a device: high for latency-sensitive
+ * translation, normal for training and its communication, low for background
+ * jobs such as asynchronous validation
+ */
+enum struct priority { high, normal, low };
+
+/**
+ * @brief CUDA stream priority of  cls  on the current device, the greatest for
+ * high and the least for low. Normal lies in between on devices with more than
+ * two levels and shares the greatest otherwise, so training stays ahead of
+ * background work.
+ */
+inline int streamPriority(priority cls) {
+  int least, greatest;
+  CUDA_CHECK(cudaDeviceGetStreamPriorityRange(&least, &greatest));
+  if(cls == priority::high)
+    return greatest;
+  if(cls == priority::low)
+    return least;
+  return least - greatest >= 2 ? (least + greatest) / 2 : greatest;
+}
+
+/** @brief Non-blocking stream of scheduling class  cls  on the current device */
+inline cudaStream_t createStream(priority cls = priority::normal) {
+  cudaStream_t stream;
+  CUDA_CHECK(cudaStreamCreateWithPriority(&stream, cudaStreamNonBlocking, streamPriority(cls)));
+  return stream;
+}
@@ -2,53 +2,73 @@
 #include <stdlib.h>
 
 #include "kernels/dropout.h"
+#include "kernels/philox.h"
+#include "kernels/cuda_helpers.h"
 
+namespace marian {
 
-#define CUDA_CALL(x) do { if((x)!=cudaSuccess) { \
-    printf("Error at %s:%d\n",__FILE__,__LINE__);\
-    exit(1);}} while(0)
+__global__
+void gDropoutMask(float* data, int n, float keep, size_t seed) {
+  int index = threadIdx.x + blockIdx.x * blockDim.x;
 
-#define CURAND_CALL(x) do { if((x)!=CURAND_STATUS_SUCCESS) { \
-    printf("Error at %s:%d\n",__FILE__,__LINE__);\
-    exit(1);}} while(0)
+  while (index < n) {
+    data[index] = dropoutScale(seed, index, keep);
+    index += gridDim.x * blockDim.x;
+  }
+}
 
-namespace marian {
+void Dropout(Tensor tensor, float p, size_t seed) {
+  UTIL_THROW_IF2(isCPU(tensor->getDevice()), "Dropout is not implemented on CPU");
 
-curandGenerator_t createCurandGenerator(size_t device,
-                                        size_t seed) {
-  cudaSetDevice(device);
-  curandGenerator_t generator;
-  CURAND_CALL(curandCreateGenerator(&generator,
-                                    CURAND_RNG_PSEUDO_DEFAULT));
-  CURAND_CALL(curandSetPseudoRandomGeneratorSeed(generator, seed));
-
-  //cudaStream_t stream = 0;
-  //CURAND_CALL(curandSetStream(generator, stream));
-  //CURAND_CALL(curandDestroyGenerator(generator));
-  return generator;
-}
+  int n = tensor->size();
+  int numThreads = std::min(n, 512);
+  int numBlocks = std::min(65535, n / numThreads + (n % numThreads != 0));
 
+  gDropoutMask<<<numBlocks, numThreads, 0, currentStream()>>>(tensor->data(), n, 1.f - p, seed);
+}
 
+template <bool add>
 __global__
-void gScale(float* data, int n, float p) {
+void gDropoutApply(float* out, const float* in, Shape shape, Shape maskShape,
+                   float keep, size_t seed) {
+  int n = shape.elements();
+  int dims[4];
   int index = threadIdx.x + blockIdx.x * blockDim.x;
 
   while (index < n) {
-    data[index] = (data[index] < p) / p;
+    shape.dims(index, dims);
+    float scale = dropoutScale(seed, maskShape.bindex(dims), keep);
+    if(add)
+      out[index] += in[index] * scale;
+    else
+      out[index] = in[index] * scale;
     index += gridDim.x * blockDim.x;
   }
 }
 
-void Dropout(Tensor tensor, float p,
-             curandGenerator_t gen) {
+template <bool add>
+void DropoutApply(Tensor out, const Tensor in, float p,
+                  const Shape& maskShape, size_t seed) {
+  UTIL_THROW_IF2(isCPU(out->getDevice()), "Dropout is not implemented on CPU");
 
-  int n = tensor->size();
-  CURAND_CALL(curandGenerateUniform(gen, tensor->data(), n));
+  cudaSetDevice(out->getDevice());
 
+  int n = out->size();
   int numThreads = std::min(n, 512);
-  int numBlocks = n / numThreads + (n % numThreads != 0);
+  int numBlocks = std::min(65535, n / numThreads + (n % numThreads != 0));
+
+  gDropoutApply<add><<<numBlocks, numThreads, 0, currentStream()>>>(
+    out->data(), in->data(), out->shape(), maskShape, 1.f - p, seed);
+}
+
+void DropoutForward(Tensor out, const Tensor in, float p,
+                    const Shape& maskShape, size_t seed) {
+  DropoutApply<false>(out, in, p, maskShape, seed);
+}
 
-  gScale<<<numBlocks, numThreads>>>(tensor->data(), n, 1.f - p);
+void DropoutBackward(Tensor grad, const Tensor adj, float p,
+                     const Shape& maskShape, size_t seed) {
+  DropoutApply<true>(grad, adj, p, maskShape, seed);
 }
 
 }
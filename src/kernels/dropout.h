@@ -1,15 +1,26 @@
+#pragma once
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <cuda.h>
-#include <curand.h>
 
 #include "tensors/tensor.h"
 
 namespace marian {
 
-curandGenerator_t createCurandGenerator(size_t device, size_t seed=1234);
+/** @brief Fills  tensor  with an inverted dropout mask drawn from  seed  */
+void Dropout(Tensor tensor, float h, size_t seed);
+
+/**
+ * @brief out = in * mask without materializing the mask. The mask has shape
+ *  maskShape  and is broadcast over  in , element i of the mask is drawn from
+ * (seed, i) by philox(), so all uses of the same seed see the same mask.
+ */
+void DropoutForward(Tensor out, const Tensor in, float h,
+                    const Shape& maskShape, size_t seed);
 
-void Dropout(Tensor tensor, float h,
-             curandGenerator_t gen);
+/** @brief grad += adj * mask for the mask of DropoutForward() */
+void DropoutBackward(Tensor grad, const Tensor adj, float h,
+                     const Shape& maskShape, size_t seed);
 
 }
@@ -0,0 +1,122 @@
+#pragma once
+
+// This file is part of the Marian toolkit.
+
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <cmath>
+#include <cuda_runtime.h>
+
+namespace marian {
+
+/** @brief Operations of a fused elementwise program, see ElementProgram */
+enum struct ElementOp : int {
+  plus, minus, mult, div, neg, tanh, sigma, relu, exp, log, sqrt
+};
+
+/**
+ * @brief A chain of elementwise operations evaluated per element by a single kernel.
+ *
+ * Registers 0 to inputs-1 hold the input values, instruction i writes register
+ * inputs+i and reads one or two earlier registers. The last instruction is the
+ * result. backward() recomputes nothing on its own: it expects the registers of
+ * forward() and propagates the adjoint of the result back to all registers,
+ * so the adjoints of the input registers are the gradients of the inputs.
+ *
+ * Built by ExpressionGraph::fuse() from the nodes it merges, trivially copyable
+ * so that it can be passed to kernels by value.
+ */
+struct ElementProgram {
+  static const int MAX_INPUTS = 8;
+  static const int MAX_OPS = 16;
+  static const int MAX_REGISTERS = MAX_INPUTS + MAX_OPS;
+
+  struct Instruction {
+    ElementOp op;
+    int a;
+    int b;
+    float c;
+  };
+
+  int inputs;
+  int ops;
+  Instruction code[MAX_OPS];
+
+  /** @brief Appends an instruction, returns the register it writes */
+  int emit(ElementOp op, int a, int b = -1, float c = 0.f) {
+    code[ops] = {op, a, b, c};
+    return inputs + ops++;
+  }
+
+  __host__ __device__
+  inline void forward(float* r) const {
+    for(int i = 0; i < ops; ++i) {
+      const Instruction& in = code[i];
+      float x = r[in.a];
+      float y = in.b >= 0 ? r[in.b] : 0.f;
+      float& out = r[inputs + i];
+      switch(in.op) {
+        case ElementOp::plus:  out = x + y; break;
+        case ElementOp::minus: out = x - y; break;
+        case ElementOp::mult:  out = x * y; break;
+        case ElementOp::div:   out = x / y; break;
+        case ElementOp::neg:   out = -x; break;
+        case ElementOp::tanh:  out = tanhf(x); break;
+        case ElementOp::sigma: out = 1.f / (1.f + expf(-x)); break;
+        case ElementOp::relu:  out = x > 0.f ? x : 0.f; break;
+        case ElementOp::exp:   out = expf(x); break;
+        case ElementOp::log:   out = logf(x); break;
+        case ElementOp::sqrt:  out = sqrtf(x + in.c); break;
+      }
+    }
+  }
+
+  __host__ __device__
+  inline void backward(const float* r, float* g, float adj) const {
+    for(int i = 0; i < inputs + ops; ++i)
+      g[i] = 0.f;
+    g[inputs + ops - 1] = adj;
+
+    for(int i = ops - 1; i >= 0; --i) {
+      const Instruction& in = code[i];
+      float d = g[inputs + i];
+      float x = r[in.a];
+      float y = r[inputs + i];
+      switch(in.op) {
+        case ElementOp::plus:  g[in.a] += d; g[in.b] += d; break;
+        case ElementOp::minus: g[in.a] += d; g[in.b] -= d; break;
+        case ElementOp::mult:  g[in.a] += d * r[in.b]; g[in.b] += d * x; break;
+        case ElementOp::div:
+          g[in.a] += d / r[in.b];
+          g[in.b] -= d * x / (r[in.b] * r[in.b]);
+          break;
+        case ElementOp::neg:   g[in.a] -= d; break;
+        case ElementOp::tanh:  g[in.a] += d * (1.f - y * y); break;
+        case ElementOp::sigma: g[in.a] += d * y * (1.f - y); break;
+        case ElementOp::relu:  g[in.a] += x > 0.f ? d : 0.f; break;
+        case ElementOp::exp:   g[in.a] += d * y; break;
+        case ElementOp::log:   g[in.a] += d / x; break;
+        case ElementOp::sqrt:  g[in.a] += 0.5f * d / y; break;
+      }
+    }
+  }
+};
+
+}
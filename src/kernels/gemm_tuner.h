@@ -0,0 +1,364 @@
+#pragma once
+
+// This file is part of the Marian toolkit.
+
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cuda_runtime.h>
+#include <cublas_v2.h>
+
+#if CUDA_VERSION >= 10010
+#include <cublasLt.h>
+#endif
+
+#include "common/logging.h"
+#include "kernels/cuda_helpers.h"
+
+namespace marian {
+
+/**
+ * @brief Picks the cuBLASLt algorithm of fp32 GEMMs by measurement.
+ *
+ * Disabled by default, in which case sgemm() returns false and the caller
+ * runs cublasSgemm. When enabled, the first GEMM of a signature, the device
+ * type, sizes, transpositions and operand alignment, times the candidates of
+ * the cuBLASLt heuristic and keeps the fastest with its descriptors, later
+ * GEMMs of the signature only launch. With a cache file the winners are
+ * appended to it and read back by later runs, each GPU model and cuBLAS
+ * version is then benchmarked only once.
+ *
+ * Every thread has a workspace of WORKSPACE bytes per device, algorithms
+ * needing more are not considered. Timing writes into scratch memory, the
+ * output of the GEMM being tuned is written once by the winner.
+ */
+class GemmTuner {
+  public:
+    static const size_t WORKSPACE = 32 << 20;
+    static const int CANDIDATES = 16;
+
+  private:
+    std::mutex mutex_;
+    bool enabled_{false};
+    std::string path_;
+
+#if CUDA_VERSION >= 10010
+    struct Plan {
+      cublasLtMatmulDesc_t op;
+      cublasLtMatrixLayout_t a, b, c;
+      cublasLtMatmulAlgo_t algo;
+    };
+
+    std::map<std::string, Plan> plans_;
+    // winners read from the cache file, turned into plans on first use
+    std::map<std::string, cublasLtMatmulAlgo_t> stored_;
+    std::map<int, cublasLtHandle_t> handles_;
+
+    cublasLtHandle_t handle(int device) {
+      auto it = handles_.find(device);
+      if(it != handles_.end())
+        return it->second;
+      cublasLtHandle_t handle;
+      cublasLtCreate(&handle);
+      handles_[device] = handle;
+      return handle;
+    }
+
+    static void* workspace(int device) {
+      thread_local std::map<int, void*> workspaces;
+      void*& space = workspaces[device];
+      if(!space)
+        CUDA_CHECK(cudaMalloc(&space, WORKSPACE));
+      return space;
+    }
+
+    static std::string deviceName(int device) {
+      cudaDeviceProp prop;
+      cudaGetDeviceProperties(&prop, device);
+      std::string name = prop.name;
+      std::replace(name.begin(), name.end(), ' ', '_');
+      return name + "_sm" + std::to_string(prop.major * 10 + prop.minor)
+             + "_lt" + std::to_string(cublasLtGetVersion());
+    }
+
+    /** @brief Largest power of two up to 16 bytes dividing the address  p  */
+    static uint32_t alignment(const void* p) {
+      uint32_t align = 16;
+      while(align > 4 && (uintptr_t)p % align != 0)
+        align /= 2;
+      return align;
+    }
+
+    static std::string encode(const cublasLtMatmulAlgo_t& algo) {
+      std::stringstream ss;
+      for(auto d : algo.data)
+        ss << std::hex << std::setw(16) << std::setfill('0') << d;
+      return ss.str();
+    }
+
+    static bool decode(const std::string& s, cublasLtMatmulAlgo_t& algo) {
+      const size_t words = sizeof(algo.data) / sizeof(algo.data[0]);
+      if(s.size() != words * 16)
+        return false;
+      for(size_t i = 0; i < words; ++i)
+        algo.data[i] = std::stoull(s.substr(i * 16, 16), nullptr, 16);
+      return true;
+    }
+
+    /** @brief Descriptors for  C = op(A) * op(B)  in column-major order, no algorithm yet */
+    static Plan describe(cublasOperation_t opA, cublasOperation_t opB,
+                         int m, int n, int k, int lda, int ldb, int ldc) {
+      Plan plan;
+#if CUDA_VERSION >= 11000
+      cublasLtMatmulDescCreate(&plan.op, CUBLAS_COMPUTE_32F, CUDA_R_32F);
+#else
+      cublasLtMatmulDescCreate(&plan.op, CUDA_R_32F);
+#endif
+      cublasLtMatmulDescSetAttribute(plan.op, CUBLASLT_MATMUL_DESC_TRANSA, &opA, sizeof(opA));
+      cublasLtMatmulDescSetAttribute(plan.op, CUBLASLT_MATMUL_DESC_TRANSB, &opB, sizeof(opB));
+
+      bool tA = opA != CUBLAS_OP_N;
+      bool tB = opB != CUBLAS_OP_N;
+      cublasLtMatrixLayoutCreate(&plan.a, CUDA_R_32F, tA ? k : m, tA ? m : k, lda);
+      cublasLtMatrixLayoutCreate(&plan.b, CUDA_R_32F, tB ? n : k, tB ? k : n, ldb);
+      cublasLtMatrixLayoutCreate(&plan.c, CUDA_R_32F, m, n, ldc);
+      return plan;
+    }
+
+    static void destroy(Plan& plan) {
+      cublasLtMatrixLayoutDestroy(plan.a);
+      cublasLtMatrixLayoutDestroy(plan.b);
+      cublasLtMatrixLayoutDestroy(plan.c);
+      cublasLtMatmulDescDestroy(plan.op);
+    }
+
+    /**
+     * @brief Candidates of the heuristic for  plan  and the operand alignments
+     * in  align , at most CANDIDATES
+     */
+    static int candidates(cublasLtHandle_t handle, const Plan& plan,
+                          const uint32_t align[3],
+                          cublasLtMatmulHeuristicResult_t* results) {
+      cublasLtMatmulPreference_t pref;
+      cublasLtMatmulPreferenceCreate(&pref);
+      uint64_t space = WORKSPACE;
+      cublasLtMatmulPreferenceSetAttribute(pref, CUBLASLT_MATMUL_PREF_MAX_WORKSPACE_BYTES,
+                                           &space, sizeof(space));
+      cublasLtMatmulPreferenceSetAttribute(pref, CUBLASLT_MATMUL_PREF_MIN_ALIGNMENT_A_BYTES,
+                                           &align[0], sizeof(align[0]));
+      cublasLtMatmulPreferenceSetAttribute(pref, CUBLASLT_MATMUL_PREF_MIN_ALIGNMENT_B_BYTES,
+                                           &align[1], sizeof(align[1]));
+      cublasLtMatmulPreferenceSetAttribute(pref, CUBLASLT_MATMUL_PREF_MIN_ALIGNMENT_C_BYTES,
+                                           &align[2], sizeof(align[2]));
+      cublasLtMatmulPreferenceSetAttribute(pref, CUBLASLT_MATMUL_PREF_MIN_ALIGNMENT_D_BYTES,
+                                           &align[2], sizeof(align[2]));
+
+      int found = 0;
+      cublasStatus_t status
+        = cublasLtMatmulAlgoGetHeuristic(handle, plan.op, plan.a, plan.b, plan.c, plan.c,
+                                         pref, CANDIDATES, results, &found);
+      cublasLtMatmulPreferenceDestroy(pref);
+      return status == CUBLAS_STATUS_SUCCESS ? found : 0;
+    }
+
+    static cublasStatus_t launch(cublasLtHandle_t handle, const Plan& plan,
+                                 const cublasLtMatmulAlgo_t& algo,
+                                 const float* alpha, const float* A, const float* B,
+                                 const float* beta, float* C,
+                                 void* space, cudaStream_t stream) {
+      return cublasLtMatmul(handle, plan.op, alpha, A, plan.a, B, plan.b,
+                            beta, C, plan.c, C, plan.c, &algo,
+                            space, WORKSPACE, stream);
+    }
+
+    /**
+     * @brief Fastest of the candidates, timed into a scratch copy of C of
+     *  ldc * n  floats, or the heuristic's first if timing is not allowed
+     */
+    static bool measure(cublasLtHandle_t handle, const Plan& plan,
+                        cublasLtMatmulHeuristicResult_t* results, int found,
+                        const float* alpha, const float* A, const float* B,
+                        const float* beta, size_t sizeC, void* space,
+                        cublasLtMatmulAlgo_t& best) {
+      cudaStream_t stream = currentStream();
+
+      // timing synchronizes, which is not allowed while recording CUDA graphs
+      cudaStreamCaptureStatus status;
+      cudaStreamIsCapturing(stream, &status);
+      if(status != cudaStreamCaptureStatusNone) {
+        best = results[0].algo;
+        return false;
+      }
+
+      float* scratch;
+      CUDA_CHECK(cudaMalloc(&scratch, sizeC * sizeof(float)));
+      CUDA_CHECK(cudaMemsetAsync(scratch, 0, sizeC * sizeof(float), stream));
+
+      cudaEvent_t start, stop;
+      CUDA_CHECK(cudaEventCreate(&start));
+      CUDA_CHECK(cudaEventCreate(&stop));
+
+      float bestTime = 0;
+      bool timed = false;
+      for(int i = 0; i < found; ++i) {
+        if(results[i].state != CUBLAS_STATUS_SUCCESS)
+          continue;
+        if(launch(handle, plan, results[i].algo, alpha, A, B, beta, scratch,
+                  space, stream) != CUBLAS_STATUS_SUCCESS)
+          continue;
+        cudaEventRecord(start, stream);
+        for(int r = 0; r < 5; ++r)
+          launch(handle, plan, results[i].algo, alpha, A, B, beta, scratch, space, stream);
+        cudaEventRecord(stop, stream);
+        cudaEventSynchronize(stop);
+
+        float time;
+        cudaEventElapsedTime(&time, start, stop);
+        if(!timed || time < bestTime) {
+          best = results[i].algo;
+          bestTime = time;
+          timed = true;
+        }
+      }
+
+      cudaEventDestroy(start);
+      cudaEventDestroy(stop);
+      CUDA_CHECK(cudaFree(scratch));
+      return timed;
+    }
+#endif
+
+  public:
+    static GemmTuner& instance() {
+      static GemmTuner tuner;
+      return tuner;
+    }
+
+    /**
+     * @brief Enables tuning, with winners cached in  path  unless it is empty.
+     * Disabling keeps the winners found so far for a later enable.
+     */
+    void setup(bool enabled, const std::string& path) {
+      std::lock_guard<std::mutex> guard(mutex_);
+      enabled_ = enabled;
+      if(!enabled || path == path_)
+        return;
+      path_ = path;
+
+#if CUDA_VERSION >= 10010
+      std::ifstream in(path_);
+      std::string key, algo;
+      while(in >> key >> algo) {
+        cublasLtMatmulAlgo_t stored;
+        if(decode(algo, stored))
+          stored_[key] = stored;
+      }
+#endif
+    }
+
+    bool enabled() {
+      return enabled_;
+    }
+
+    /**
+     * @brief Runs the column-major  C = alpha * op(A) * op(B) + beta * C  of
+     * cublasSgemm with the tuned cuBLASLt algorithm for its signature on the
+     * current device and stream. Returns false if tuning is disabled or no
+     * algorithm applies, the caller then runs cublasSgemm.
+     */
+    bool sgemm(cublasOperation_t opA, cublasOperation_t opB,
+               int m, int n, int k,
+               const float* alpha, const float* A, int lda,
+               const float* B, int ldb,
+               const float* beta, float* C, int ldc) {
+#if CUDA_VERSION >= 10010
+      if(!enabled_)
+        return false;
+
+      int device;
+      cudaGetDevice(&device);
+      uint32_t align[3] = {alignment(A), alignment(B), alignment(C)};
+
+      std::stringstream key;
+      key << deviceName(device) << ":sgemm"
+          << ":" << (opA == CUBLAS_OP_N ? "n" : "t") << (opB == CUBLAS_OP_N ? "n" : "t")
+          << ":m" << m << ":n" << n << ":k" << k
+          << ":ld" << lda << "," << ldb << "," << ldc
+          << ":a" << align[0] << "," << align[1] << "," << align[2];
+
+      void* space = workspace(device);
+      cublasLtHandle_t lt;
+      Plan plan;
+      // an untimed choice, while capturing, is used once and tuned later
+      bool keep = true;
+      {
+        std::lock_guard<std::mutex> guard(mutex_);
+        lt = handle(device);
+        auto it = plans_.find(key.str());
+        if(it != plans_.end()) {
+          plan = it->second;
+        }
+        else {
+          plan = describe(opA, opB, m, n, k, lda, ldb, ldc);
+          auto stored = stored_.find(key.str());
+          if(stored != stored_.end()) {
+            plan.algo = stored->second;
+          }
+          else {
+            cublasLtMatmulHeuristicResult_t results[CANDIDATES];
+            int found = candidates(lt, plan, align, results);
+            if(found == 0) {
+              destroy(plan);
+              return false;
+            }
+            keep = measure(lt, plan, results, found, alpha, A, B, beta,
+                           (size_t)ldc * n, space, plan.algo);
+            if(keep && !path_.empty()) {
+              std::ofstream out(path_, std::ios::app);
+              out << key.str() << " " << encode(plan.algo) << std::endl;
+              LOG(info, "Tuned {} to cuBLASLt algorithm {}",
+                  key.str(), encode(plan.algo));
+            }
+          }
+          if(keep)
+            plans_[key.str()] = plan;
+        }
+      }
+
+      bool done = launch(lt, plan, plan.algo, alpha, A, B, beta, C,
+                         space, currentStream()) == CUBLAS_STATUS_SUCCESS;
+      if(!keep)
+        destroy(plan);
+      return done;
+#else
+      return false;
+#endif
+    }
+};
+
+}
@@ -0,0 +1,131 @@
+#include <thrust/binary_search.h>
+#include <thrust/copy.h>
+#include <thrust/count.h>
+#include <thrust/device_ptr.h>
+#include <thrust/device_vector.h>
+#include <thrust/execution_policy.h>
+#include <thrust/gather.h>
+#include <thrust/iterator/counting_iterator.h>
+#include <thrust/sort.h>
+
+#include "kernels/gradient_dropping.h"
+#include "kernels/cuda_helpers.h"
+
+namespace marian {
+
+struct AtLeast {
+  const float* data;
+  float threshold;
+
+  __device__ bool operator()(uint32_t i) const {
+    return fabsf(data[i]) >= threshold;
+  }
+};
+
+__global__
+void gSampleMagnitudes(float* sample, int m, const float* data, int n) {
+  int index = threadIdx.x + blockIdx.x * blockDim.x;
+  while(index < m) {
+    sample[index] = fabsf(data[(size_t)index * n / m]);
+    index += gridDim.x * blockDim.x;
+  }
+}
+
+__global__
+void gZeroAt(float* data, const uint32_t* indices, int n) {
+  int index = threadIdx.x + blockIdx.x * blockDim.x;
+  while(index < n) {
+    data[indices[index]] = 0.f;
+    index += gridDim.x * blockDim.x;
+  }
+}
+
+__global__
+void gScatter(float* grads, const uint32_t* indices, const float* values,
+              int n, uint32_t offset) {
+  int index = threadIdx.x + blockIdx.x * blockDim.x;
+  while(index < n) {
+    grads[indices[index] - offset] = values[index];
+    index += gridDim.x * blockDim.x;
+  }
+}
+
+static void launchSize(int n, int& blocks, int& threads) {
+  threads = std::max(1, std::min(n, 512));
+  blocks = std::max(1, std::min(65535, n / threads + (n % threads != 0)));
+}
+
+float DropThreshold(Tensor t, Tensor sample, float rate) {
+  int n = t->size();
+  int m = std::min(n, (int)sample->size());
+  if(m == 0)
+    return 0.f;
+
+  int blocks, threads;
+  launchSize(m, blocks, threads);
+  gSampleMagnitudes<<<blocks, threads, 0, currentStream()>>>(sample->data(), m, t->data(), n);
+
+  thrust::device_ptr<float> begin(sample->data());
+  thrust::sort(thrust::cuda::par.on(currentStream()), begin, begin + m);
+
+  int k = std::min(m - 1, (int)(rate * m));
+  float threshold;
+  CUDA_CHECK(cudaMemcpyAsync(&threshold, sample->data() + k, sizeof(float),
+                             cudaMemcpyDeviceToHost, currentStream()));
+  CUDA_CHECK(cudaStreamSynchronize(currentStream()));
+  return threshold;
+}
+
+size_t DropGradients(Tensor residual, float threshold,
+                     uint32_t* indices, float* values, size_t capacity) {
+  auto policy = thrust::cuda::par.on(currentStream());
+  thrust::counting_iterator<uint32_t> first(0), last(residual->size());
+
+  // a sample can underestimate the threshold, raise it until the entries fit
+  AtLeast pred{residual->data(), threshold};
+  size_t n = thrust::count_if(policy, first, last, pred);
+  while(n > capacity) {
+    pred.threshold = pred.threshold > 0 ? pred.threshold * 1.5f : 1e-8f;
+    n = thrust::count_if(policy, first, last, pred);
+  }
+  if(n == 0)
+    return 0;
+
+  thrust::device_ptr<uint32_t> idx(indices);
+  thrust::copy_if(policy, first, last, idx, pred);
+  thrust::device_ptr<float> data(residual->data());
+  thrust::gather(policy, idx, idx + n, data, thrust::device_ptr<float>(values));
+
+  int blocks, threads;
+  launchSize(n, blocks, threads);
+  gZeroAt<<<blocks, threads, 0, currentStream()>>>(residual->data(), indices, n);
+  return n;
+}
+
+std::vector<size_t> SplitSorted(const uint32_t* indices, size_t n,
+                                const std::vector<uint32_t>& bounds) {
+  auto policy = thrust::cuda::par.on(currentStream());
+  thrust::device_vector<uint32_t> b(bounds.begin(), bounds.end());
+  thrust::device_vector<size_t> positions(bounds.size());
+  thrust::device_ptr<const uint32_t> idx(indices);
+  thrust::lower_bound(policy, idx, idx + n, b.begin(), b.end(), positions.begin());
+  CUDA_CHECK(cudaStreamSynchronize(currentStream()));
+
+  std::vector<size_t> result(bounds.size());
+  thrust::copy(positions.begin(), positions.end(), result.begin());
+  return result;
+}
+
+void ScatterGradients(Tensor grads, const uint32_t* indices, const float* values,
+                      size_t n, size_t offset) {
+  CUDA_CHECK(cudaMemsetAsync(grads->data(), 0, grads->size() * sizeof(float),
+                             currentStream()));
+  if(n == 0)
+    return;
+  int blocks, threads;
+  launchSize(n, blocks, threads);
+  gScatter<<<blocks, threads, 0, currentStream()>>>(grads->data(), indices, values,
+                                                    n, offset);
+}
+
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "tensors/tensor.h"
+
+namespace marian {
+
+/**
+ * @brief Estimates the magnitude below which the fraction  rate  of the
+ * entries of  t  lies from a strided sample that fills  sample , which is
+ * overwritten. Only the threshold is copied back to the host.
+ */
+float DropThreshold(Tensor t, Tensor sample, float rate);
+
+/**
+ * @brief Moves the entries of  residual  with a magnitude of at least
+ *  threshold  into  indices  and  values  in increasing index order and zeroes
+ * them in  residual . The threshold is raised until at most  capacity
+ * entries qualify. Returns their number.
+ */
+size_t DropGradients(Tensor residual, float threshold,
+                     uint32_t* indices, float* values, size_t capacity);
+
+/**
+ * @brief Positions of the first index not below every bound in the sorted
+ *  indices[0, n) , i.e. where the entries of consecutive shards start
+ */
+std::vector<size_t> SplitSorted(const uint32_t* indices, size_t n,
+                                const std::vector<uint32_t>& bounds);
+
+/** @brief Zeroes  grads  and sets grads[indices[i] - offset] = values[i] for i < n */
+void ScatterGradients(Tensor grads, const uint32_t* indices, const float* values,
+                      size_t n, size_t offset);
+
+}
@@ -0,0 +1,72 @@
+#include "kernels/half_comm.h"
+#include "kernels/cuda_helpers.h"
+#include "kernels/tensor_operators.h"
+
+namespace marian {
+
+HalfBuffer::HalfBuffer(size_t device, size_t size) : device(device) {
+  cudaSetDevice(device);
+  CUDA_CHECK(cudaMalloc(&data, std::max(size, (size_t)1) * sizeof(__half)));
+}
+
+HalfBuffer::~HalfBuffer() {
+  cudaSetDevice(device);
+  cudaFree(data);
+}
+
+#if CUDA_VERSION >= 9000
+__global__
+void gCompressHalf(__half* out, const float* in, float* residual, size_t n, float scale) {
+  for(size_t index = threadIdx.x + (size_t)blockIdx.x * blockDim.x; index < n;
+      index += (size_t)gridDim.x * blockDim.x) {
+    float v = scale * in[index];
+    if(residual)
+      v += residual[index];
+    v = fminf(fmaxf(v, -65504.f), 65504.f);
+    __half h = __float2half(v);
+    out[index] = h;
+    if(residual)
+      residual[index] = v - __half2float(h);
+  }
+}
+
+__global__
+void gExpandHalf(float* out, const __half* in, size_t n, float scale, bool accumulate) {
+  for(size_t index = threadIdx.x + (size_t)blockIdx.x * blockDim.x; index < n;
+      index += (size_t)gridDim.x * blockDim.x) {
+    float v = scale * __half2float(in[index]);
+    out[index] = accumulate ? out[index] + v : v;
+  }
+}
+
+static void launchSize(size_t n, int& blocks, int& threads) {
+  threads = (int)std::min(n, (size_t)MAX_THREADS);
+  blocks = (int)std::min((size_t)MAX_BLOCKS, n / threads + (n % threads != 0));
+}
+#endif
+
+void CompressHalf(__half* out, const float* in, float* residual, size_t n, float scale) {
+  if(n == 0)
+    return;
+#if CUDA_VERSION >= 9000
+  int blocks, threads;
+  launchSize(n, blocks, threads);
+  gCompressHalf<<<blocks, threads, 0, currentStream()>>>(out, in, residual, n, scale);
+#else
+  UTIL_THROW2("fp16 communication requires CUDA 9 or newer");
+#endif
+}
+
+void ExpandHalf(float* out, const __half* in, size_t n, float scale, bool accumulate) {
+  if(n == 0)
+    return;
+#if CUDA_VERSION >= 9000
+  int blocks, threads;
+  launchSize(n, blocks, threads);
+  gExpandHalf<<<blocks, threads, 0, currentStream()>>>(out, in, n, scale, accumulate);
+#else
+  UTIL_THROW2("fp16 communication requires CUDA 9 or newer");
+#endif
+}
+
+}
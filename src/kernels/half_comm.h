@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cuda_fp16.h>
+
+namespace marian {
+
+/** @brief fp16 buffer of  size  elements on  device , freed with it */
+struct HalfBuffer {
+  size_t device;
+  __half* data{nullptr};
+
+  HalfBuffer(size_t device, size_t size);
+  ~HalfBuffer();
+
+  HalfBuffer(const HalfBuffer&) = delete;
+  HalfBuffer& operator=(const HalfBuffer&) = delete;
+};
+
+/**
+ * @brief Converts  scale * in[0, n)  to fp16 in  out  for sending, saturated
+ * to the largest finite fp16 value. With  residual  the error is fed back:
+ * the residual is added before rounding and receives what the rounding lost,
+ * so nothing is dropped for good. Runs on the current stream of the current
+ * device, where all pointers must live.
+ */
+void CompressHalf(__half* out, const float* in, float* residual, size_t n, float scale);
+
+/** @brief out[i] = scale * in[i] , or  out[i] += scale * in[i]  with  accumulate  */
+void ExpandHalf(float* out, const __half* in, size_t n, float scale, bool accumulate = false);
+
+}
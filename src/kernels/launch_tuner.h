@@ -0,0 +1,159 @@
+#pragma once
+
+// This file is part of the Marian toolkit.
+
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cuda_runtime.h>
+
+#include "common/logging.h"
+#include "kernels/cuda_helpers.h"
+
+namespace marian {
+
+/**
+ * @brief Picks the block size of row-wise kernels by measurement.
+ *
+ * Disabled by default, in which case threads() returns the fallback. Once a
+ * cache file is set, the first launch of a kernel for a shape class (powers of
+ * two of rows and columns) on a device type times every candidate block size
+ * and keeps the fastest. Winners are appended to the file and read back by
+ * later runs, so each GPU generation is benchmarked only once.
+ *
+ * The launch functor is run repeatedly while tuning and must not accumulate
+ * into its output.
+ */
+class LaunchTuner {
+  private:
+    std::mutex mutex_;
+    std::string path_;
+    std::map<std::string, int> best_;
+
+    static int bucket(int n) {
+      int b = 0;
+      while((1 << b) < n)
+        ++b;
+      return b;
+    }
+
+    static std::string deviceName() {
+      int device;
+      cudaGetDevice(&device);
+      cudaDeviceProp prop;
+      cudaGetDeviceProperties(&prop, device);
+      std::string name = prop.name;
+      std::replace(name.begin(), name.end(), ' ', '_');
+      return name + "_sm" + std::to_string(prop.major * 10 + prop.minor);
+    }
+
+    template <class Launch>
+    int measure(Launch launch, int cap) {
+      cudaStream_t stream = currentStream();
+      cudaEvent_t start, stop;
+      CUDA_CHECK(cudaEventCreate(&start));
+      CUDA_CHECK(cudaEventCreate(&stop));
+
+      int best = 0;
+      float bestTime = 0;
+      for(int threads = 32; threads <= cap; threads *= 2) {
+        launch(threads);
+        cudaEventRecord(start, stream);
+        for(int i = 0; i < 5; ++i)
+          launch(threads);
+        cudaEventRecord(stop, stream);
+        cudaEventSynchronize(stop);
+
+        float time;
+        cudaEventElapsedTime(&time, start, stop);
+        if(!best || time < bestTime) {
+          best = threads;
+          bestTime = time;
+        }
+      }
+
+      cudaEventDestroy(start);
+      cudaEventDestroy(stop);
+      return best;
+    }
+
+  public:
+    static LaunchTuner& instance() {
+      static LaunchTuner tuner;
+      return tuner;
+    }
+
+    /** @brief Enables tuning with winners cached in  path , an empty path disables it */
+    void setCache(const std::string& path) {
+      std::lock_guard<std::mutex> guard(mutex_);
+      if(path == path_)
+        return;
+      path_ = path;
+      best_.clear();
+
+      std::ifstream in(path_);
+      std::string key;
+      int threads;
+      while(in >> key >> threads)
+        best_[key] = threads;
+    }
+
+    /**
+     * @brief Block size for  kernel  on  rows  x  cols , at most  cap . Runs
+     *  launch(threads)  for every candidate if the shape class is new.
+     */
+    template <class Launch>
+    int threads(const std::string& kernel, int rows, int cols,
+                int fallback, int cap, Launch launch) {
+      std::lock_guard<std::mutex> guard(mutex_);
+      if(path_.empty())
+        return fallback;
+
+      std::stringstream key;
+      key << deviceName() << ":" << kernel
+          << ":r" << bucket(rows) << ":c" << bucket(cols);
+
+      auto it = best_.find(key.str());
+      if(it != best_.end())
+        return it->second;
+
+      // timing synchronizes, which is not allowed while recording CUDA graphs
+      cudaStreamCaptureStatus status;
+      cudaStreamIsCapturing(currentStream(), &status);
+      if(status != cudaStreamCaptureStatusNone)
+        return fallback;
+
+      int threads = measure(launch, cap);
+      best_[key.str()] = threads;
+
+      std::ofstream out(path_, std::ios::app);
+      out << key.str() << " " << threads << std::endl;
+      LOG(info, "Tuned {} to {} threads", key.str(), threads);
+
+      return threads;
+    }
+};
+
+}
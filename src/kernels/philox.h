@@ -0,0 +1,68 @@
+#pragma once
+
+// This file is part of the Marian toolkit.
+
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <stdint.h>
+#include <cuda_runtime.h>
+
+namespace marian {
+
+/**
+ * @brief Counter-based random numbers, Philox4x32-10 (Salmon et al. 2011).
+ *
+ * The value for a given (seed, counter) pair is a pure function of both, so a
+ * kernel can draw the number for element i without any generator state and the
+ * backward pass regenerates exactly the same numbers from the same seed.
+ */
+__host__ __device__
+inline uint32_t philox(uint64_t seed, uint32_t counter) {
+  uint32_t c[4] = {counter, 0, 0, 0};
+  uint32_t k[2] = {(uint32_t)seed, (uint32_t)(seed >> 32)};
+
+  for(int round = 0; round < 10; ++round) {
+    uint64_t p0 = (uint64_t)0xD2511F53 * c[0];
+    uint64_t p1 = (uint64_t)0xCD9E8D57 * c[2];
+    uint32_t n0 = (uint32_t)(p1 >> 32) ^ c[1] ^ k[0];
+    uint32_t n2 = (uint32_t)(p0 >> 32) ^ c[3] ^ k[1];
+    c[1] = (uint32_t)p1;
+    c[3] = (uint32_t)p0;
+    c[0] = n0;
+    c[2] = n2;
+    k[0] += 0x9E3779B9;
+    k[1] += 0xBB67AE85;
+  }
+  return c[0];
+}
+
+/** @brief Uniform float in [0, 1) from the upper 24 bits of philox() */
+__host__ __device__
+inline float philoxUniform(uint64_t seed, uint32_t counter) {
+  return (philox(seed, counter) >> 8) * (1.f / 16777216.f);
+}
+
+/** @brief Inverted dropout factor: 1/keep with probability keep, else 0 */
+__host__ __device__
+inline float dropoutScale(uint64_t seed, uint32_t counter, float keep) {
+  return philoxUniform(seed, counter) < keep ? 1.f / keep : 0.f;
+}
+
+}
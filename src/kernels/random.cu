@@ -0,0 +1,105 @@
+#include <map>
+#include <cusolverDn.h>
+
+#include "kernels/random.h"
+#include "kernels/philox.h"
+#include "kernels/cuda_helpers.h"
+
+namespace marian {
+
+#define CUSOLVER_CHECK(expr) do {                                          \
+  cusolverStatus_t rc = (expr);                                            \
+  UTIL_THROW_IF2(rc != CUSOLVER_STATUS_SUCCESS,                            \
+                 "cuSOLVER error " << (int)rc << " in " #expr);            \
+} while(0)
+
+__global__
+void gRandomUniform(float* data, int n, float a, float b, size_t seed) {
+  int index = threadIdx.x + blockIdx.x * blockDim.x;
+  while(index < n) {
+    data[index] = a + (b - a) * philoxUniform(seed, index);
+    index += gridDim.x * blockDim.x;
+  }
+}
+
+__global__
+void gRandomNormal(float* data, int n, float mean, float stddev, size_t seed) {
+  int index = threadIdx.x + blockIdx.x * blockDim.x;
+  while(index < n) {
+    // (0, 1] for the logarithm
+    float u1 = 1.f - philoxUniform(seed, 2 * index);
+    float u2 = philoxUniform(seed, 2 * index + 1);
+    data[index] = mean + stddev * sqrtf(-2.f * __logf(u1)) * __cosf(6.2831853f * u2);
+    index += gridDim.x * blockDim.x;
+  }
+}
+
+static void launchSize(int n, int& blocks, int& threads) {
+  threads = std::max(1, std::min(n, 512));
+  blocks = std::max(1, std::min(65535, n / threads + (n % threads != 0)));
+}
+
+void RandomUniform(Tensor t, float a, float b, size_t seed) {
+  UTIL_THROW_IF2(isCPU(t->getDevice()), "RandomUniform is not implemented on CPU");
+  cudaSetDevice(t->getDevice());
+
+  int blocks, threads;
+  launchSize(t->size(), blocks, threads);
+  gRandomUniform<<<blocks, threads, 0, currentStream()>>>(t->data(), t->size(), a, b, seed);
+}
+
+void RandomNormal(Tensor t, float mean, float stddev, size_t seed) {
+  UTIL_THROW_IF2(isCPU(t->getDevice()), "RandomNormal is not implemented on CPU");
+  cudaSetDevice(t->getDevice());
+
+  int blocks, threads;
+  launchSize(t->size(), blocks, threads);
+  gRandomNormal<<<blocks, threads, 0, currentStream()>>>(t->data(), t->size(),
+                                                         mean, stddev, seed);
+}
+
+void Orthogonalize(Tensor t) {
+  UTIL_THROW_IF2(isCPU(t->getDevice()), "Orthogonalize is not implemented on CPU");
+  cudaSetDevice(t->getDevice());
+
+  Shape shape = t->shape();
+  int rows = shape[0] * shape[2] * shape[3];
+  int cols = shape[1];
+  int n = std::min(rows, cols);
+  int m = std::max(rows, cols);
+  UTIL_THROW_IF2(m % n != 0, "Matrix dimensions must be equal or multiples of each other");
+
+  // one handle per thread and device, bound to the current stream per call
+  thread_local std::map<size_t, cusolverDnHandle_t> handles;
+  auto& handle = handles[t->getDevice()];
+  if(!handle)
+    CUSOLVER_CHECK(cusolverDnCreate(&handle));
+  CUSOLVER_CHECK(cusolverDnSetStream(handle, currentStream()));
+
+  int geqrf = 0, orgqr = 0;
+  CUSOLVER_CHECK(cusolverDnSgeqrf_bufferSize(handle, n, n, t->data(), n, &geqrf));
+
+  float* tau;
+  int* info;
+  CUDA_CHECK(cudaMalloc(&tau, n * sizeof(float)));
+  CUDA_CHECK(cudaMalloc(&info, sizeof(int)));
+  CUSOLVER_CHECK(cusolverDnSorgqr_bufferSize(handle, n, n, n, t->data(), n, tau, &orgqr));
+  int lwork = std::max(geqrf, orgqr);
+  float* work;
+  CUDA_CHECK(cudaMalloc(&work, lwork * sizeof(float)));
+
+  // a row-major block is the transpose of the column-major matrix cuSOLVER
+  // sees, the transpose of an orthogonal matrix is orthogonal as well
+  for(int i = 0; i < (int)t->size(); i += n * n) {
+    float* block = t->data() + i;
+    CUSOLVER_CHECK(cusolverDnSgeqrf(handle, n, n, block, n, tau, work, lwork, info));
+    CUSOLVER_CHECK(cusolverDnSorgqr(handle, n, n, n, block, n, tau, work, lwork, info));
+  }
+
+  CUDA_CHECK(cudaStreamSynchronize(currentStream()));
+  cudaFree(work);
+  cudaFree(info);
+  cudaFree(tau);
+}
+
+}
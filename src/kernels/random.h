@@ -0,0 +1,20 @@
+#pragma once
+
+#include "tensors/tensor.h"
+
+namespace marian {
+
+/** @brief Fills  t  on its device with uniform numbers in [a, b) drawn from  seed  by philox() */
+void RandomUniform(Tensor t, float a, float b, size_t seed);
+
+/** @brief Fills  t  on its device with normal numbers drawn from  seed  by philox() and Box-Muller */
+void RandomNormal(Tensor t, float mean, float stddev, size_t seed);
+
+/**
+ * @brief Replaces every square block of  t , of the smaller of its row and
+ * column counts, by the orthogonal factor of its QR decomposition, computed
+ * on the device with cuSOLVER
+ */
+void Orthogonalize(Tensor t);
+
+}
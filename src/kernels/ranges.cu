@@ -0,0 +1,76 @@
+#include "kernels/ranges.h"
+#include "kernels/cuda_helpers.h"
+
+namespace marian {
+
+__global__
+void gGatherRanges(float* packed, const float* in, uint32_t n,
+                   const uint32_t* starts, const uint32_t* prefix, int count) {
+  uint32_t index = threadIdx.x + blockIdx.x * blockDim.x;
+  while(index < n) {
+    packed[index] = in[rangeElement(index, starts, prefix, count)];
+    index += gridDim.x * blockDim.x;
+  }
+}
+
+__global__
+void gScatterRanges(float* out, const float* packed, uint32_t n, float scale,
+                    const uint32_t* starts, const uint32_t* prefix, int count) {
+  uint32_t index = threadIdx.x + blockIdx.x * blockDim.x;
+  while(index < n) {
+    out[rangeElement(index, starts, prefix, count)] = scale * packed[index];
+    index += gridDim.x * blockDim.x;
+  }
+}
+
+static void launchSize(int n, int& blocks, int& threads) {
+  threads = std::max(1, std::min(n, 512));
+  blocks = std::max(1, std::min(65535, n / threads + (n % threads != 0)));
+}
+
+void DeviceRanges::upload(const Ranges& ranges) {
+  count_ = ranges.starts.size();
+  total_ = 0;
+  std::vector<uint32_t> data(2 * count_ + 1);
+  for(int i = 0; i < count_; ++i) {
+    data[i] = ranges.starts[i];
+    data[count_ + i] = total_;
+    total_ += ranges.lengths[i];
+  }
+  data[2 * count_] = total_;
+
+  if(!buffer_ || buffer_->size() < data.size()) {
+    size_t capacity = std::max(data.size(), buffer_ ? 2 * buffer_->size() : 0);
+    alloc_ = New<TensorAllocator>(device_);
+    alloc_->reserveExact(capacity);
+    alloc_->allocate(buffer_, {1, (int)capacity});
+  }
+  CUDA_CHECK(cudaMemcpyAsync(buffer_->data(), data.data(),
+                             data.size() * sizeof(uint32_t),
+                             cudaMemcpyHostToDevice, currentStream()));
+}
+
+void GatherRanges(float* packed, Tensor in, const DeviceRanges& ranges) {
+  if(ranges.total() == 0)
+    return;
+  int blocks, threads;
+  launchSize(ranges.total(), blocks, threads);
+  gGatherRanges<<<blocks, threads, 0, currentStream()>>>(
+    packed, in->data(), ranges.total(),
+    ranges.starts(), ranges.prefix(), ranges.count());
+}
+
+void ScatterRanges(Tensor out, const float* packed, const DeviceRanges& ranges,
+                   float scale) {
+  CUDA_CHECK(cudaMemsetAsync(out->data(), 0, out->size() * sizeof(float),
+                             currentStream()));
+  if(ranges.total() == 0)
+    return;
+  int blocks, threads;
+  launchSize(ranges.total(), blocks, threads);
+  gScatterRanges<<<blocks, threads, 0, currentStream()>>>(
+    out->data(), packed, ranges.total(), scale,
+    ranges.starts(), ranges.prefix(), ranges.count());
+}
+
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "tensors/tensor.h"
+#include "tensors/tensor_allocator.h"
+
+namespace marian {
+
+/**
+ * @brief Sorted, disjoint ranges of elements of a flat tensor, e.g. the
+ * parameters a batch changes, see ExpressionGraph::updateRanges().
+ */
+struct Ranges {
+  std::vector<uint32_t> starts;
+  std::vector<uint32_t> lengths;
+
+  void clear() {
+    starts.clear();
+    lengths.clear();
+  }
+
+  /** @brief Appends a range starting behind the last one, joins them if adjacent */
+  void add(size_t start, size_t length) {
+    if(length == 0)
+      return;
+    if(!starts.empty() && starts.back() + lengths.back() == start)
+      lengths.back() += length;
+    else {
+      starts.push_back(start);
+      lengths.push_back(length);
+    }
+  }
+
+  size_t total() const {
+    size_t sum = 0;
+    for(auto length : lengths)
+      sum += length;
+    return sum;
+  }
+
+  /**
+   * @brief The parts of the ranges within  [begin, end) , moved to start at 0,
+   * and in  before  the number of elements of the ranges ahead of  begin , i.e.
+   * where the parts start in a buffer packed by GatherRanges()
+   */
+  Ranges slice(size_t begin, size_t end, size_t& before) const {
+    Ranges part;
+    before = 0;
+    for(size_t i = 0; i < starts.size(); ++i) {
+      size_t first = starts[i], last = first + lengths[i];
+      if(last <= begin) {
+        before += lengths[i];
+        continue;
+      }
+      if(first >= end)
+        break;
+      if(first < begin)
+        before += begin - first;
+      first = std::max(first, begin);
+      part.add(first - begin, std::min(last, end) - first);
+    }
+    return part;
+  }
+};
+
+/**
+ * @brief Ranges on the device: their starts and the prefix sums of their
+ * lengths, which map the i-th element of the ranges to its position by binary
+ * search. The buffer grows with the number of ranges and is reused.
+ */
+class DeviceRanges {
+  private:
+    size_t device_;
+    Ptr<TensorAllocator> alloc_;
+    Tensor buffer_;
+    int count_{0};
+    size_t total_{0};
+
+  public:
+    DeviceRanges(size_t device) : device_(device) {}
+
+    /** @brief Copies  ranges  to the device, in order with the current stream */
+    void upload(const Ranges& ranges);
+
+    const uint32_t* starts() const {
+      return (const uint32_t*)buffer_->data();
+    }
+
+    /** @brief count() + 1 prefix sums, the first is 0 */
+    const uint32_t* prefix() const {
+      return starts() + count_;
+    }
+
+    int count() const {
+      return count_;
+    }
+
+    size_t total() const {
+      return total_;
+    }
+};
+
+#ifdef __CUDACC__
+/** @brief Position of the element  i < prefix[count]  of the ranges */
+__device__ inline uint32_t rangeElement(uint32_t i, const uint32_t* starts,
+                                        const uint32_t* prefix, int count) {
+  int lo = 0, hi = count - 1;
+  while(lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if(prefix[mid] <= i)
+      lo = mid;
+    else
+      hi = mid - 1;
+  }
+  return starts[lo] + (i - prefix[lo]);
+}
+#endif
+
+/** @brief Copies the elements of  in  within  ranges  to  packed[0, ranges.total())  */
+void GatherRanges(float* packed, Tensor in, const DeviceRanges& ranges);
+
+/** @brief Zeroes  out  and sets its elements within  ranges  to  scale  times  packed  */
+void ScatterRanges(Tensor out, const float* packed, const DeviceRanges& ranges,
+                   float scale = 1.f);
+
+}
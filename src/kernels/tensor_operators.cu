@@ -19,21 +19,113 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <cfloat>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <tuple>
+#include <cuda_fp16.h>
+
 #include "kernels/tensor_operators.h"
+#include "kernels/thrust_functions.h"
 #include "kernels/cuda_helpers.h"
+#include "kernels/gemm_tuner.h"
+#include "kernels/launch_tuner.h"
+#include "kernels/ranges.h"
 
 #include "3rd_party/reduce_all.h"
 
 namespace marian {
 
+/** @brief Block size of a row-wise kernel, measured if tuning is enabled, see LaunchTuner */
+template <class Launch>
+int tunedThreads(const std::string& kernel, int rows, int cols, Launch launch) {
+  return LaunchTuner::instance().threads(kernel, rows, cols,
+                                         std::min(MAX_THREADS, cols),
+                                         MAX_THREADS, launch);
+}
+
+/**
+ * Row-wise kernels templated on  COLS  are instantiated for the row sizes of
+ * common models, dim-emb 256 and 512 and dim-rnn 512 and 1024, with their
+ * loops fully unrolled. COLS = 0 is the generic kernel for any runtime size.
+ */
+inline bool unrolledCols(int cols) {
+  return cols == 256 || cols == 512 || cols == 1024;
+}
+
+/** @brief Block size of the GRU kernels unrolled for rows of  cols  */
+__host__ __device__ constexpr int unrolledThreads(int cols) {
+  return cols < MAX_THREADS ? cols : MAX_THREADS;
+}
+
+/**
+ * @brief Returns  kernel<256> ,  kernel<512>  or  kernel<1024>  for  cols  of
+ * these sizes and  kernel<0>  otherwise, see unrolledCols().
+ */
+#define UNROLLED_KERNEL(kernel, cols) \
+  ((cols) == 256 ? kernel<256> : (cols) == 512 ? kernel<512> \
+   : (cols) == 1024 ? kernel<1024> : kernel<0>)
+
+
+namespace {
+
+// handles made ahead of time by warmUpDevice(), by device
+std::mutex handlesMutex;
+std::map<size_t, std::vector<cublasHandle_t>> warmHandles;
+
+}
 
 cublasHandle_t create_handle(size_t device) {
   cudaSetDevice(device);
+  {
+    std::lock_guard<std::mutex> lock(handlesMutex);
+    auto& handles = warmHandles[device];
+    if(!handles.empty()) {
+      cublasHandle_t cublasHandle = handles.back();
+      handles.pop_back();
+      return cublasHandle;
+    }
+  }
   cublasHandle_t cublasHandle;
   cublasCreate(&cublasHandle);
   return cublasHandle;
 }
 
+void warmUpDevice(size_t device, size_t handles) {
+  CUDA_CHECK(cudaSetDevice(device));
+  CUDA_CHECK(cudaFree(0));
+
+  std::vector<cublasHandle_t> created(std::max((size_t)1, handles));
+  for(auto& handle : created)
+    cublasCreate(&handle);
+
+  // the first product loads the GEMM kernels of the device
+  float* data;
+  CUDA_CHECK(cudaMalloc(&data, 3 * sizeof(float)));
+  CUDA_CHECK(cudaMemset(data, 0, 3 * sizeof(float)));
+  float alpha = 1, beta = 0;
+  cublasSgemm(created[0], CUBLAS_OP_N, CUBLAS_OP_N, 1, 1, 1,
+              &alpha, data, 1, data + 1, 1, &beta, data + 2, 1);
+  CUDA_CHECK(cudaDeviceSynchronize());
+  CUDA_CHECK(cudaFree(data));
+
+  std::lock_guard<std::mutex> lock(handlesMutex);
+  auto& kept = warmHandles[device];
+  kept.insert(kept.end(), created.begin(), created.end());
+}
+
+std::future<void> warmUpDevices(const std::vector<size_t>& devices, size_t handles) {
+  return std::async(std::launch::async, [devices, handles]() {
+    std::vector<std::thread> threads;
+    for(auto device : devices)
+      if(!isCPU(device))
+        threads.emplace_back(warmUpDevice, device, handles);
+    for(auto& thread : threads)
+      thread.join();
+  });
+}
+
 //static cudnnHandle_t create_handle_dnn() {
 //  cudnnHandle_t cudnnHandle;
 //  cudnnCreate(&cudnnHandle);
@@ -115,7 +207,8 @@ cublasHandle_t create_handle(size_t device) {
 __global__ void gSoftmax(float* out,
                          const Shape outShape,
                          const float* in,
-                         const float* mask) {
+                         const float* mask,
+                         int maskRows) {
   int rows = outShape[0] * outShape[2] * outShape[3];
   int cols = outShape[1];
   for(int bid = 0; bid < rows; bid += gridDim.x) {
@@ -123,7 +216,8 @@ __global__ void gSoftmax(float* out,
     if(j < rows) {
       float* so = out + j * cols;
       const float* sp = in + j * cols;
-      const float* mp = mask ? (mask + j * cols) : 0;
+      // beams repeat the rows of the mask
+      const float* mp = mask ? (mask + (j % maskRows) * cols) : 0;
 
       extern __shared__ float _share[];
 
@@ -185,26 +279,28 @@ __global__ void gSoftmax(float* out,
 }
 
 void Softmax(Tensor out, Tensor in, Tensor mask) {
+  if(isCPU(out->getDevice())) {
+    cpu::Softmax(out, in, mask);
+    return;
+  }
+
   cudaSetDevice(out->getDevice());
 
   size_t m = out->shape()[0] * out->shape()[2] * out->shape()[3];
   size_t k = out->shape()[1];
 
   int blocks = std::min(MAX_BLOCKS, (int) m);
-  int threads = std::min(MAX_THREADS, (int) k);
-  int shared = sizeof(float) * threads * 2;
+  int maskRows = mask ? mask->shape().elements() / k : 1;
 
-  if(mask)
-    gSoftmax<<<blocks, threads, shared>>>(out->data(),
-                                          out->shape(),
-                                          in->data(),
-                                          mask->data());
-  else
-    gSoftmax<<<blocks, threads, shared>>>(out->data(),
+  auto launch = [&](int threads) {
+    int shared = sizeof(float) * threads * 2;
+    gSoftmax<<<blocks, threads, shared, currentStream()>>>(out->data(),
                                           out->shape(),
                                           in->data(),
-                                          0);
-  cudaStreamSynchronize(0);
+                                          mask ? mask->data() : 0,
+                                          maskRows);
+  };
+  launch(tunedThreads("softmax", m, k, launch));
 }
 
 __global__ void gLogSoftmax(float* out,
@@ -276,6 +372,11 @@ __global__ void gLogSoftmax(float* out,
 }
 
 void LogSoftmax(Tensor out, Tensor in) {
+  if(isCPU(out->getDevice())) {
+    cpu::LogSoftmax(out, in);
+    return;
+  }
+
   cudaSetDevice(out->getDevice());
 
   size_t m = out->shape()[0] * out->shape()[2] * out->shape()[3];
@@ -285,7 +386,7 @@ void LogSoftmax(Tensor out, Tensor in) {
   int threads = std::min(MAX_THREADS, (int) k);
   int shared = sizeof(float) * threads * 2;
 
-  gLogSoftmax<<<blocks, threads, shared>>>(out->data(),
+  gLogSoftmax<<<blocks, threads, shared, currentStream()>>>(out->data(),
                                            out->shape(),
                                            in->data());
 
@@ -335,6 +436,8 @@ __global__ void gSoftmaxGrad(float* grad, const float* adj, const float* val,
 }
 
 void SoftmaxGrad(Tensor grad, Tensor adj, Tensor val) {
+  UTIL_THROW_IF2(isCPU(adj->getDevice()), "SoftmaxGrad is not implemented on CPU");
+
   cudaSetDevice(adj->getDevice());
   // grad and val are both m-by-k matrices, passed as input.
   // A weighted average of each row of grad (according to the weights
@@ -346,7 +449,7 @@ void SoftmaxGrad(Tensor grad, Tensor adj, Tensor val) {
   int blocks = std::min(MAX_BLOCKS, m);
   int threads = std::min(MAX_THREADS, k);
   int shared = sizeof(float) * threads * 2;
-  gSoftmaxGrad<<<blocks, threads, shared>>>(grad->data(),
+  gSoftmaxGrad<<<blocks, threads, shared, currentStream()>>>(grad->data(),
                                             adj->data(),
                                             val->data(),
                                             m, k);
@@ -391,6 +494,8 @@ __global__ void gLogSoftmaxGrad(float* grad, const float* adj, const float* val,
 }
 
 void LogSoftmaxGrad(Tensor grad, Tensor adj, Tensor val) {
+  UTIL_THROW_IF2(isCPU(adj->getDevice()), "LogSoftmaxGrad is not implemented on CPU");
+
   cudaSetDevice(adj->getDevice());
 
   // grad and val are both m-by-k matrices, passed as input.
@@ -403,44 +508,86 @@ void LogSoftmaxGrad(Tensor grad, Tensor adj, Tensor val) {
   int blocks = std::min(MAX_BLOCKS, m);
   int threads = std::min(MAX_THREADS, k);
   int shared = sizeof(float) * threads * 2;
-  gLogSoftmaxGrad<<<blocks, threads, shared>>>(grad->data(),
+  gLogSoftmaxGrad<<<blocks, threads, shared, currentStream()>>>(grad->data(),
                                                adj->data(), val->data(),
                                                m, k);
 
 }
 
 ///////////////////////////////////////////////////////
-__global__ void gArgmax(float *out, const float *data, size_t rows, size_t cols) {
-  size_t row = blockIdx.x;
-    size_t startInd = row * cols;
-    float maxScore = -99999;
-    size_t maxInd;
-    for (size_t col = 0; col < cols; ++col) {
-      size_t ind = startInd + col;
-      float score = data[ind];
-      if (score > maxScore) {
-        maxScore = score;
-        maxInd = col;
+__global__ void gArgmax(float* out, const float* data,
+                        int rows, int cols, int exclude) {
+  for(int bid = 0; bid < rows; bid += gridDim.x) {
+    int j = bid + blockIdx.x;
+    if(j < rows) {
+      const float* sp = data + j * cols;
+
+      extern __shared__ float _share[];
+      float* _max = _share;
+      int* _idx = (int*)(_share + blockDim.x);
+
+      float best = -3.40282e+38f;
+      int bestIdx = exclude == 0 ? 1 : 0;
+      for(int id = threadIdx.x; id < cols; id += blockDim.x) {
+        if(id != exclude && sp[id] > best) {
+          best = sp[id];
+          bestIdx = id;
+        }
+      }
+      _max[threadIdx.x] = best;
+      _idx[threadIdx.x] = bestIdx;
+      __syncthreads();
+
+      // ties go to the smaller column
+      for(int len = (blockDim.x >> 1); len > 0; len >>= 1) {
+        if(threadIdx.x < len) {
+          float v = _max[threadIdx.x + len];
+          int i = _idx[threadIdx.x + len];
+          if(v > _max[threadIdx.x] || (v == _max[threadIdx.x] && i < _idx[threadIdx.x])) {
+            _max[threadIdx.x] = v;
+            _idx[threadIdx.x] = i;
+          }
+        }
+        __syncthreads();
       }
+
+      if(threadIdx.x == 0)
+        out[j] = _idx[0];
+      __syncthreads();
     }
-    out[row] = maxInd;
+  }
 }
 
-//void Argmax(Tensor* Out, const Tensor* In) {
-//  size_t m = In->shape()[0];
-//  size_t k = In->shape()[1];
-//
-//  int blocks = m; //std::min(MAX_BLOCKS, (int) m);
-//  int threads = k; //std::min(MAX_THREADS, (int) k);
-//  //int shared = sizeof(float) * threads * 2;
-//  gArgmax<<<blocks, threads>>>(Out->data(), In->data(), m, k);
-//
-//}
+void Argmax(Tensor out, const Tensor in, int exclude) {
+  if(isCPU(out->getDevice())) {
+    cpu::Argmax(out, in, exclude);
+    return;
+  }
+
+  cudaSetDevice(out->getDevice());
+
+  int m = in->shape()[0] * in->shape()[2] * in->shape()[3];
+  int k = in->shape()[1];
+
+  int blocks = std::min(MAX_BLOCKS, m);
+  // a power of two for the tree reduction
+  int threads = 32;
+  while(threads < std::min(MAX_THREADS, k))
+    threads <<= 1;
+  int shared = threads * (sizeof(float) + sizeof(int));
+  gArgmax<<<blocks, threads, shared, currentStream()>>>(out->data(), in->data(),
+                                                        m, k, exclude);
+}
 
 ///////////////////////////////////////////////////////
 
 void Prod(cublasHandle_t handle, Tensor C, const Tensor A, const Tensor B,
              bool transA, bool transB, Float beta) {
+  if(isCPU(C->getDevice())) {
+    cpu::Prod(C, A, B, transA, transB, beta);
+    return;
+  }
+
   cudaSetDevice(C->getDevice());
   Float alpha = 1.0;
 
@@ -464,10 +611,153 @@ void Prod(cublasHandle_t handle, Tensor C, const Tensor A, const Tensor B,
   cublasOperation_t opA = transA ? CUBLAS_OP_T : CUBLAS_OP_N;
   cublasOperation_t opB = transB ? CUBLAS_OP_T : CUBLAS_OP_N;
 
+  if(GemmTuner::instance().sgemm(opB, opA, n, m, k, &alpha, B->data(), ldb,
+                                 A->data(), lda, &beta, C->data(), ldc))
+    return;
+
   cublasSgemm(handle, opB, opA,
               n, m, k, &alpha, B->data(), ldb, A->data(), lda, &beta, C->data(), ldc);
 }
 
+void ProdBatched(cublasHandle_t handle, Tensor C, const Tensor A, const Tensor B,
+                 bool transA, bool transB, Float beta) {
+  if(isCPU(C->getDevice())) {
+    cpu::ProdBatched(C, A, B, transA, transB, beta);
+    return;
+  }
+
+  cudaSetDevice(C->getDevice());
+  Float alpha = 1.0;
+
+  size_t batch = A->shape()[2] * A->shape()[3];
+  UTIL_THROW_IF2(batch != B->shape()[2] * B->shape()[3],
+                 "batched matrix product requires batch dimensions to match");
+
+  size_t m = A->shape()[0];
+  size_t k = A->shape()[1];
+  if(transA)
+    std::swap(m, k);
+
+  size_t n = B->shape()[1];
+  if(transB)
+    n = B->shape()[0];
+
+  size_t lda = A->shape()[1];
+  size_t ldb = B->shape()[1];
+  size_t ldc = n;
+
+  size_t strideA = A->shape()[0] * A->shape()[1];
+  size_t strideB = B->shape()[0] * B->shape()[1];
+  size_t strideC = m * n;
+
+  cublasOperation_t opA = transA ? CUBLAS_OP_T : CUBLAS_OP_N;
+  cublasOperation_t opB = transB ? CUBLAS_OP_T : CUBLAS_OP_N;
+
+#if CUDA_VERSION >= 8000
+  cublasSgemmStridedBatched(handle, opB, opA,
+                            n, m, k, &alpha,
+                            B->data(), ldb, strideB,
+                            A->data(), lda, strideA, &beta,
+                            C->data(), ldc, strideC, batch);
+#else
+  for(size_t i = 0; i < batch; ++i)
+    cublasSgemm(handle, opB, opA,
+                n, m, k, &alpha, B->data() + i * strideB, ldb,
+                A->data() + i * strideA, lda, &beta,
+                C->data() + i * strideC, ldc);
+#endif
+}
+
+#if CUDA_VERSION >= 9000
+__global__ void gToHalf(__half* out, const float* in, int length) {
+  for(int bid = 0; bid < length; bid += blockDim.x * gridDim.x) {
+    int index = bid + blockDim.x * blockIdx.x + threadIdx.x;
+    if(index < length)
+      out[index] = __float2half(in[index]);
+  }
+}
+
+/** @brief Per-thread scratch buffers for fp16 copies of GEMM operands, grown on demand */
+__half* halfScratch(size_t device, int slot, size_t elements) {
+  thread_local std::map<std::pair<size_t, int>, std::pair<__half*, size_t>> scratch;
+  auto& buffer = scratch[std::make_pair(device, slot)];
+  if(buffer.second < elements) {
+    if(buffer.first)
+      CUDA_CHECK(cudaFree(buffer.first));
+    CUDA_CHECK(cudaMalloc(&buffer.first, elements * sizeof(__half)));
+    buffer.second = elements;
+  }
+  return buffer.first;
+}
+
+__half* toHalf(Tensor in, int slot) {
+  __half* out = halfScratch(in->getDevice(), slot, in->size());
+  ToHalf(out, in);
+  return out;
+}
+#endif
+
+void ToHalf(__half* out, const Tensor in) {
+#if CUDA_VERSION >= 9000
+  cudaSetDevice(in->getDevice());
+
+  int length = in->size();
+  int threads = std::min(MAX_THREADS, length);
+  int blocks = std::min(MAX_BLOCKS, length / threads + (length % threads != 0));
+  gToHalf<<<blocks, threads, 0, currentStream()>>>(out, in->data(), length);
+#else
+  UTIL_THROW2("fp16 conversion requires CUDA 9 or newer");
+#endif
+}
+
+void ProdHalf(cublasHandle_t handle, Tensor C, const Tensor A, const Tensor B,
+              bool transA, bool transB, Float beta,
+              const __half* halfA, const __half* halfB) {
+#if CUDA_VERSION >= 9000
+  if(isCPU(C->getDevice())) {
+    cpu::Prod(C, A, B, transA, transB, beta);
+    return;
+  }
+
+  cudaSetDevice(C->getDevice());
+  Float alpha = 1.0;
+
+  size_t m = A->shape()[0] * A->shape()[2] * A->shape()[3];
+  size_t k = A->shape()[1];
+  if(transA)
+    std::swap(m, k);
+
+  size_t l = B->shape()[0];
+  size_t n = B->shape()[1];
+  if(transB)
+    std::swap(l, n);
+
+  size_t lda = A->shape()[1];
+  size_t ldb = B->shape()[1];
+  size_t ldc = B->shape()[1];
+
+  if(transB)
+    ldc = B->shape()[0];
+
+  cublasOperation_t opA = transA ? CUBLAS_OP_T : CUBLAS_OP_N;
+  cublasOperation_t opB = transB ? CUBLAS_OP_T : CUBLAS_OP_N;
+
+  if(!halfA)
+    halfA = toHalf(A, 0);
+  if(!halfB)
+    halfB = toHalf(B, 1);
+
+  cublasGemmEx(handle, opB, opA,
+               n, m, k, &alpha,
+               halfB, CUDA_R_16F, ldb,
+               halfA, CUDA_R_16F, lda, &beta,
+               C->data(), CUDA_R_32F, ldc,
+               CUDA_R_32F, CUBLAS_GEMM_DEFAULT_TENSOR_OP);
+#else
+  Prod(handle, C, A, B, transA, transB, beta);
+#endif
+}
+
 //void CudnnDropoutPrepare(Tensor in, float p,
 //                         cudnnDropoutDescriptor_t* dropDesc,
 //                         void** space, size_t* spaceSize,
@@ -527,7 +817,7 @@ void Prod(cublasHandle_t handle, Tensor C, const Tensor A, const Tensor B,
 //}
 
 __global__ void gCopyRows(float* out, const float* in, size_t cols,
-                          const size_t* sourceRowIdx, size_t rows) {
+                          const float* sourceRowIdx, size_t rows) {
   for(int bid = 0; bid < rows; bid += gridDim.x) {
     int j = bid + blockIdx.x;
     if(j < rows) {
@@ -546,29 +836,70 @@ __global__ void gCopyRows(float* out, const float* in, size_t cols,
   }
 }
 
-void CopyRows(Tensor out, const Tensor in, const std::vector<size_t>& indeces) {
+#if CUDART_VERSION >= 11000
+// largest persisting L2 window of a device, 0 without support. The first
+// query sets the device's persisting L2 carve-out to its maximum.
+static size_t persistingWindow(int device) {
+  static std::mutex mutex;
+  static std::map<int, size_t> windows;
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = windows.find(device);
+  if(it != windows.end())
+    return it->second;
+
+  int carveOut = 0, window = 0;
+  cudaDeviceGetAttribute(&carveOut, cudaDevAttrMaxPersistingL2CacheSize, device);
+  cudaDeviceGetAttribute(&window, cudaDevAttrMaxAccessPolicyWindowSize, device);
+  if(carveOut > 0 && window > 0)
+    CUDA_CHECK(cudaDeviceSetLimit(cudaLimitPersistingL2CacheSize, carveOut));
+  return windows[device] = carveOut > 0 ? std::min(carveOut, window) : 0;
+}
+#endif
+
+// Sets the persisting L2 window of the current stream to the first  bytes  of
+// data , bytes 0 clears it. Kernels record the window they are launched with.
+static void hotWindow(int device, const float* data, size_t bytes) {
+#if CUDART_VERSION >= 11000
+  size_t window = persistingWindow(device);
+  if(window == 0)
+    return;
+  cudaStreamAttrValue attr = {};
+  attr.accessPolicyWindow.base_ptr = (void*)data;
+  attr.accessPolicyWindow.num_bytes = std::min(bytes, window);
+  attr.accessPolicyWindow.hitRatio = 1.f;
+  attr.accessPolicyWindow.hitProp = cudaAccessPropertyPersisting;
+  attr.accessPolicyWindow.missProp = cudaAccessPropertyStreaming;
+  CUDA_CHECK(cudaStreamSetAttribute(currentStream(),
+                                    cudaStreamAttributeAccessPolicyWindow, &attr));
+#endif
+}
+
+void CopyRows(Tensor out, const Tensor in, const Tensor indices, size_t hotRows) {
+  if(isCPU(out->getDevice())) {
+    cpu::CopyRows(out, in, indices);
+    return;
+  }
+
   cudaSetDevice(out->getDevice());
 
   size_t cols = in->shape()[1];
-  size_t rowsToCopy = indeces.size();
+  size_t rowsToCopy = indices->size();
 
   int threads = std::min(MAX_THREADS, (int)cols);
   int blocks = std::min(MAX_BLOCKS, (int)rowsToCopy);
 
-  size_t* d_indeces;
-  CUDA_CHECK(cudaMalloc(&d_indeces, rowsToCopy * sizeof(size_t)));
-  CUDA_CHECK(cudaMemcpy(d_indeces, indeces.data(), rowsToCopy * sizeof(size_t),
-                        cudaMemcpyHostToDevice));
-
-  gCopyRows<<<blocks, threads>>>(out->data(), in->data(), cols,
-                                 d_indeces,
+  hotRows = std::min(hotRows, (size_t)in->shape()[0]);
+  if(hotRows > 0)
+    hotWindow(out->getDevice(), in->data(), hotRows * cols * sizeof(float));
+  gCopyRows<<<blocks, threads, 0, currentStream()>>>(out->data(), in->data(), cols,
+                                 indices->data(),
                                  rowsToCopy);
-
-  CUDA_CHECK(cudaFree(d_indeces));
+  if(hotRows > 0)
+    hotWindow(out->getDevice(), in->data(), 0);
 }
 
 __global__ void gPasteRows(float* out, const float* in, size_t cols,
-                          const size_t* targetRowIdx, size_t rows) {
+                          const float* targetRowIdx, size_t rows) {
   for(int bid = 0; bid < rows; bid += gridDim.x) {
     int j = bid + blockIdx.x;
     if(j < rows) {
@@ -587,41 +918,150 @@ __global__ void gPasteRows(float* out, const float* in, size_t cols,
   }
 }
 
-void PasteRows(Tensor out, const Tensor in, const std::vector<size_t>& indeces) {
+void PasteRows(Tensor out, const Tensor in, const Tensor indices, size_t hotRows) {
+  UTIL_THROW_IF2(isCPU(out->getDevice()), "PasteRows is not implemented on CPU");
+
   cudaSetDevice(out->getDevice());
 
   size_t cols = in->shape()[1];
-  size_t rowsToCopy = indeces.size();
+  size_t rowsToCopy = indices->size();
 
   int threads = std::min(MAX_THREADS, (int)cols);
   int blocks = std::min(MAX_BLOCKS, (int)rowsToCopy);
 
-  // @TODO: turn into tensor
-  size_t* d_indeces;
-  CUDA_CHECK(cudaMalloc(&d_indeces, rowsToCopy * sizeof(size_t)));
-  CUDA_CHECK(cudaMemcpy(d_indeces, indeces.data(), rowsToCopy * sizeof(size_t),
-                        cudaMemcpyHostToDevice));
-
-  gPasteRows<<<blocks, threads>>>(out->data(), in->data(), cols,
-                                  d_indeces,
+  hotRows = std::min(hotRows, (size_t)out->shape()[0]);
+  if(hotRows > 0)
+    hotWindow(out->getDevice(), out->data(), hotRows * cols * sizeof(float));
+  gPasteRows<<<blocks, threads, 0, currentStream()>>>(out->data(), in->data(), cols,
+                                  indices->data(),
                                   rowsToCopy);
-  CUDA_CHECK(cudaFree(d_indeces));
+  if(hotRows > 0)
+    hotWindow(out->getDevice(), out->data(), 0);
 }
 
-void Transpose(cublasHandle_t cublasHandle, Tensor out, const Tensor in) {
+__global__ void gCopyCols(float* out, const float* in, size_t rows,
+                          size_t colsIn, const float* sourceColIdx,
+                          size_t colsOut) {
+  for(int bid = 0; bid < rows; bid += gridDim.x) {
+    int j = bid + blockIdx.x;
+    if(j < rows) {
+      const float* rowIn = in + j * colsIn;
+      float* rowOut = out + j * colsOut;
+
+      for(int tid = 0; tid < colsOut; tid += blockDim.x) {
+        int i = tid + threadIdx.x;
+        if(i < colsOut)
+          rowOut[i] = rowIn[(size_t)sourceColIdx[i]];
+      }
+    }
+  }
+}
+
+void CopyCols(Tensor out, const Tensor in, const Tensor indices) {
+  if(isCPU(out->getDevice())) {
+    cpu::CopyCols(out, in, indices);
+    return;
+  }
+
+  cudaSetDevice(out->getDevice());
+
+  size_t rows = in->shape()[0];
+  size_t colsIn = in->shape()[1];
+  size_t colsOut = indices->size();
+
+  int threads = std::min(MAX_THREADS, (int)colsOut);
+  int blocks = std::min(MAX_BLOCKS, (int)rows);
+
+  gCopyCols<<<blocks, threads, 0, currentStream()>>>(out->data(), in->data(),
+                                                     rows, colsIn,
+                                                     indices->data(), colsOut);
+}
+
+__global__ void gPasteCols(float* out, const float* in, size_t rows,
+                           size_t colsOut, const float* targetColIdx,
+                           size_t colsIn) {
+  for(int bid = 0; bid < rows; bid += gridDim.x) {
+    int j = bid + blockIdx.x;
+    if(j < rows) {
+      const float* rowIn = in + j * colsIn;
+      float* rowOut = out + j * colsOut;
+
+      for(int tid = 0; tid < colsIn; tid += blockDim.x) {
+        int i = tid + threadIdx.x;
+        if(i < colsIn)
+          atomicAdd(rowOut + (size_t)targetColIdx[i], rowIn[i]);
+      }
+    }
+  }
+}
+
+void PasteCols(Tensor out, const Tensor in, const Tensor indices) {
+  UTIL_THROW_IF2(isCPU(out->getDevice()), "PasteCols is not implemented on CPU");
+
   cudaSetDevice(out->getDevice());
-  size_t steps = in->shape()[2] * in->shape()[3];
-  for(int i = 0; i < steps; i++) {
-    size_t m = in->shape()[0];
-    size_t n = in->shape()[1];
-    float alpha = 1.0;
-    float beta  = 0.0;
 
-    size_t offset = i * steps;
+  size_t rows = out->shape()[0];
+  size_t colsOut = out->shape()[1];
+  size_t colsIn = indices->size();
+
+  int threads = std::min(MAX_THREADS, (int)colsIn);
+  int blocks = std::min(MAX_BLOCKS, (int)rows);
+
+  gPasteCols<<<blocks, threads, 0, currentStream()>>>(out->data(), in->data(),
+                                                      rows, colsOut,
+                                                      indices->data(), colsIn);
+}
+
+const int TILE_DIM = 32;
+const int TILE_ROWS = 8;
+
+// Transposes every s0 x s1 slice through a padded shared memory tile, all
+// slices at once along gridDim.z, so both reads and writes are coalesced.
+__global__ void gTransposeSlices(float* out, const float* in,
+                                 int rows, int cols, int slices) {
+  __shared__ float tile[TILE_DIM][TILE_DIM + 1];
+
+  for(int z = blockIdx.z; z < slices; z += gridDim.z) {
+    const float* sliceIn = in + (size_t)z * rows * cols;
+    float* sliceOut = out + (size_t)z * rows * cols;
 
-    cublasSgeam(cublasHandle, CUBLAS_OP_T, CUBLAS_OP_T, m, n, &alpha, in->data() + offset, n,
-                &beta, in->data() + offset, n, out->data() + offset, m);
+    int x = blockIdx.x * TILE_DIM + threadIdx.x;
+    int y = blockIdx.y * TILE_DIM + threadIdx.y;
+    for(int j = 0; j < TILE_DIM; j += TILE_ROWS)
+      if(x < cols && y + j < rows)
+        tile[threadIdx.y + j][threadIdx.x] = sliceIn[(y + j) * cols + x];
+
+    __syncthreads();
+
+    x = blockIdx.y * TILE_DIM + threadIdx.x;
+    y = blockIdx.x * TILE_DIM + threadIdx.y;
+    for(int j = 0; j < TILE_DIM; j += TILE_ROWS)
+      if(x < rows && y + j < cols)
+        sliceOut[(y + j) * rows + x] = tile[threadIdx.x][threadIdx.y + j];
+
+    __syncthreads();
+  }
+}
+
+void Transpose(cublasHandle_t cublasHandle, Tensor out, const Tensor in) {
+  if(isCPU(out->getDevice())) {
+    cpu::Transpose(out, in);
+    return;
   }
+
+  cudaSetDevice(out->getDevice());
+
+  int rows = in->shape()[0];
+  int cols = in->shape()[1];
+  int slices = in->shape()[2] * in->shape()[3];
+
+  dim3 threads(TILE_DIM, TILE_ROWS);
+  dim3 blocks((cols + TILE_DIM - 1) / TILE_DIM,
+              (rows + TILE_DIM - 1) / TILE_DIM,
+              std::min(MAX_BLOCKS, slices));
+
+  gTransposeSlices<<<blocks, threads, 0, currentStream()>>>(
+    out->data(), in->data(), rows, cols, slices);
 }
 
 void Concatenate0(Tensor out, const std::vector<Tensor>& inputs) {
@@ -631,61 +1071,97 @@ void Concatenate0(Tensor out, const std::vector<Tensor>& inputs) {
   for(auto in : inputs) {
     UTIL_THROW_IF2(out->shape()[1] != in->shape()[1],
                    "Second dimension must be equal");
-    cudaMemcpy(out->data() + offset,
-               in->data(),
-               in->size() * sizeof(float),
-               cudaMemcpyDeviceToDevice);
+    cudaMemcpyAsync(out->data() + offset,
+                    in->data(),
+                    in->size() * sizeof(float),
+                    cudaMemcpyDeviceToDevice, currentStream());
     offset += in->size();
   }
 }
 
-__global__ void gInsertCols(float* out, const float* in,
-                            size_t rows, size_t cols,
-                            size_t cols_out, size_t cols_in,
-                            size_t offset_out, size_t offset_in) {
+const int MAX_CONCAT = 16;
+
+// Passed by value as a kernel argument, so describing the inputs costs no
+// device allocation or copy
+struct ConcatTable {
+  float* ptrs[MAX_CONCAT];
+  int offsets[MAX_CONCAT + 1];
+  int count;
+};
+
+// Copies between the columns [offsets[0], offsets[count]) of  big  and the
+// tensors of the table, gathering into  big  or scattering out of it.
+template <bool scatter>
+__global__ void gConcatCols(float* big, ConcatTable table,
+                            size_t rows, size_t colsBig) {
+  int first = table.offsets[0];
+  int last = table.offsets[table.count];
+
   for(int bid = 0; bid < rows; bid += gridDim.x) {
     int j = bid + blockIdx.x;
     if(j < rows) {
-      float* rowOut = out + j * cols_out + offset_out;
-      const float* rowIn = in + j * cols_in + offset_in;
-
-      for(int tid = 0; tid < cols; tid += blockDim.x) {
-        int i = tid + threadIdx.x;
-        if(i < cols)
-          rowOut[i] = rowIn[i];
+      float* rowBig = big + j * colsBig;
+
+      // each thread walks its columns left to right, so k only moves forward
+      int k = 0;
+      for(int tid = 0; tid < last - first; tid += blockDim.x) {
+        int i = first + tid + threadIdx.x;
+        if(i < last) {
+          while(i >= table.offsets[k + 1])
+            ++k;
+          int cols = table.offsets[k + 1] - table.offsets[k];
+          float* small = table.ptrs[k] + j * cols + (i - table.offsets[k]);
+          if(scatter)
+            *small = rowBig[i];
+          else
+            rowBig[i] = *small;
+        }
       }
     }
   }
 }
 
-// this probably does not work for tensors with more than 2
-// dimensions, verify this!
-void Concatenate1(Tensor out, const std::vector<Tensor>& inputs) {
-  cudaSetDevice(out->getDevice());
-
-  size_t offset = 0;
-  int rows = out->shape()[0] * out->shape()[2] * out->shape()[3];
-  int cols_out = out->shape()[1];
-
-  for(auto in : inputs) {
-    UTIL_THROW_IF2(out->shape()[0] != in->shape()[0],
-                   "First dimension must be equal");
-    int cols_in = in->shape()[1];
+// One launch per MAX_CONCAT tensors, i.e. a single launch in practice
+template <bool scatter>
+void ConcatCols(Tensor big, const std::vector<Tensor>& smalls) {
+  cudaSetDevice(big->getDevice());
+
+  int rows = big->shape()[0] * big->shape()[2] * big->shape()[3];
+  int colsBig = big->shape()[1];
+
+  int offset = 0;
+  for(size_t start = 0; start < smalls.size(); start += MAX_CONCAT) {
+    ConcatTable table;
+    table.count = std::min(MAX_CONCAT, (int)(smalls.size() - start));
+    for(int k = 0; k < table.count; ++k) {
+      auto small = smalls[start + k];
+      UTIL_THROW_IF2(small->shape()[0] != big->shape()[0],
+                     "First dimension must be equal");
+      table.ptrs[k] = small->data();
+      table.offsets[k] = offset;
+      offset += small->shape()[1];
+    }
+    table.offsets[table.count] = offset;
 
+    int width = table.offsets[table.count] - table.offsets[0];
     int blocks  = std::min(MAX_BLOCKS, rows);
-    int threads = std::min(MAX_THREADS, cols_in);
+    int threads = std::min(MAX_THREADS, width);
 
-    gInsertCols<<<blocks, threads>>>(
-      out->data(),
-      in->data(),
-      rows, cols_in,
-      cols_out, cols_in,
-      offset, 0);
-    offset += cols_in;
+    gConcatCols<scatter><<<blocks, threads, 0, currentStream()>>>(
+      big->data(), table, rows, colsBig);
   }
 }
 
+void Concatenate1(Tensor out, const std::vector<Tensor>& inputs) {
+  ConcatCols<false>(out, inputs);
+}
+
 void Concatenate(Tensor out, const std::vector<Tensor>& inputs, int ax) {
+  if(isCPU(out->getDevice())) {
+    cpu::Concatenate(out, inputs, ax);
+    return;
+  }
+
   if(ax == 1)
     Concatenate1(out, inputs);
   else
@@ -697,57 +1173,51 @@ void Deconcatenate0(std::vector<Tensor>& outputs, const Tensor in) {
 
   size_t offset = 0;
   for(auto out : outputs) {
-    cudaMemcpy(out->data(),
-               in->data() + offset,
-               out->size() * sizeof(float),
-               cudaMemcpyDeviceToDevice);
+    cudaMemcpyAsync(out->data(),
+                    in->data() + offset,
+                    out->size() * sizeof(float),
+                    cudaMemcpyDeviceToDevice, currentStream());
     offset += out->size();
   }
 }
 
 void Deconcatenate1(std::vector<Tensor>& outputs, const Tensor in) {
-  cudaSetDevice(in->getDevice());
-
-  size_t offset = 0;
-  int rows = in->shape()[0] * in->shape()[2] * in->shape()[3];
-  int cols_in = in->shape()[1];
-  for(auto out : outputs) {
-    UTIL_THROW_IF2(out->shape()[0] != in->shape()[0],
-                   "First dimension must be equal");
-    int cols_out = out->shape()[1];
-
-    int blocks  = std::min(MAX_BLOCKS, rows);
-    int threads = std::min(MAX_THREADS, cols_out);
-
-    gInsertCols<<<blocks, threads>>>(
-      out->data(),
-      in->data(),
-      rows, cols_out,
-      cols_out, cols_in,
-      0, offset);
-    offset += cols_out;
-  }
+  ConcatCols<true>(in, outputs);
 }
 
 void Deconcatenate(std::vector<Tensor>& outputs, const Tensor in, int ax) {
+  UTIL_THROW_IF2(isCPU(in->getDevice()), "Deconcatenate is not implemented on CPU");
+
   if(ax == 1)
     Deconcatenate1(outputs, in);
   else
     Deconcatenate0(outputs, in);
 }
 
+template <int COLS>
 __global__ void gGRUFastForward(float* out,
                                 const float* state,
                                 const float* xW,
                                 const float* sU,
                                 const float* b,
                                 const float* mask,
-                                size_t rows, size_t cols,
+                                size_t rows, size_t active, size_t dimCols,
                                 bool final) {
+  const int cols = COLS ? COLS : dimCols;
+  const int stride = COLS ? unrolledThreads(COLS) : blockDim.x;
 
   for(int bid = 0; bid < rows; bid += gridDim.x) {
     int j = bid + blockIdx.x;
-    if(j < rows) {
+    if(j >= active && j < rows) {
+      // rows without sU, i.e. sentences that ended, keep their state
+#pragma unroll
+      for(int tid = 0; tid < cols; tid += stride) {
+        int i = tid + threadIdx.x;
+        if(i < cols)
+          out[j * cols + i] = state[j * cols + i];
+      }
+    }
+    else if(j < rows) {
       float m = !mask || mask[j];
       float* rowOut = out + j * cols;
       const float* rowState = state + j * cols;
@@ -755,7 +1225,8 @@ __global__ void gGRUFastForward(float* out,
       const float* xWrow = xW + j * cols * 3;
       const float* sUrow = sU + j * cols * 3;
 
-      for(int tid = 0; tid < cols; tid += blockDim.x) {
+#pragma unroll
+      for(int tid = 0; tid < cols; tid += stride) {
         int i = tid + threadIdx.x;
         if(i < cols) {
           float ev1 = expf(-(xWrow[i] + sUrow[i] + b[i]));
@@ -780,25 +1251,33 @@ __global__ void gGRUFastForward(float* out,
   }
 }
 
-void GRUFastForward(Tensor out, std::vector<Tensor> inputs, bool final){
+void GRUFastForward(Tensor out, const std::vector<Tensor>& inputs, bool final){
+  if(isCPU(out->getDevice())) {
+    cpu::GRUFastForward(out, inputs, final);
+    return;
+  }
+
   cudaSetDevice(out->getDevice());
 
   int rows = out->shape()[0] * out->shape()[2] * out->shape()[3];
   int cols = out->shape()[1];
+  int active = inputs[2]->size() / (3 * cols);
 
   int blocks  = std::min(MAX_BLOCKS, rows);
-  int threads = std::min(MAX_THREADS, cols);
+  int threads = unrolledThreads(cols);
 
-  gGRUFastForward<<<blocks, threads>>>(
+  auto kernel = UNROLLED_KERNEL(gGRUFastForward, cols);
+  kernel<<<blocks, threads, 0, currentStream()>>>(
     out->data(), // output
     inputs[0]->data(), // state
     inputs[1]->data(), // xW
     inputs[2]->data(), // sU
     inputs[3]->data(), // b
     inputs.size() > 4 ? inputs[4]->data() : 0, // mask
-    rows, cols, final);
+    rows, active, cols, final);
 }
 
+template <int COLS>
 __global__ void gGRUFastBackward(float* outState,
                                  float* outXW,
                                  float* outSU,
@@ -809,12 +1288,22 @@ __global__ void gGRUFastBackward(float* outState,
                                  const float* b,
                                  const float* mask,
                                  const float* adj,
-                                 size_t rows, size_t cols,
+                                 size_t rows, size_t active, size_t dimCols,
                                  bool final) {
+  const int cols = COLS ? COLS : dimCols;
+  const int stride = COLS ? unrolledThreads(COLS) : blockDim.x;
 
   for(int bid = 0; bid < rows; bid += gridDim.x) {
     int j = bid + blockIdx.x;
-    if(j < rows) {
+    if(j >= active && j < rows) {
+#pragma unroll
+      for(int tid = 0; tid < cols; tid += stride) {
+        int i = tid + threadIdx.x;
+        if(i < cols && outState)
+          outState[j * cols + i] += adj[j * cols + i];
+      }
+    }
+    else if(j < rows) {
       float m = !mask || mask[j];
 
       float* rowOutState = outState + j * cols;
@@ -826,7 +1315,8 @@ __global__ void gGRUFastBackward(float* outState,
       const float* rowSU = sU + j * cols * 3;
       const float* rowAdj = adj + j * cols;
 
-      for(int tid = 0; tid < cols; tid += blockDim.x) {
+#pragma unroll
+      for(int tid = 0; tid < cols; tid += stride) {
         int i = tid + threadIdx.x;
         if(i < cols) {
           int k = i + cols;
@@ -849,7 +1339,7 @@ __global__ void gGRUFastBackward(float* outState,
           float t = (1-z)*(1-h*h);
 
           // df/ds
-          if(outState) rowOutState[i] += m * z * adj - m + 1;
+          if(outState) rowOutState[i] += (m * z + 1 - m) * adj;
 
           // df/d(xW_r) ...
           float dfdxW_r = r * (1-r) * t * adj;
@@ -882,19 +1372,23 @@ __global__ void gGRUFastBackward(float* outState,
   }
 }
 
-void GRUFastBackward(std::vector<Tensor> outputs,
-                     std::vector<Tensor> inputs,
+void GRUFastBackward(const std::vector<Tensor>& outputs,
+                     const std::vector<Tensor>& inputs,
                      Tensor adj, bool final) {
 
+  UTIL_THROW_IF2(isCPU(adj->getDevice()), "GRUFastBackward is not implemented on CPU");
+
   cudaSetDevice(adj->getDevice());
 
   int rows = adj->shape()[0] * adj->shape()[2] * adj->shape()[3];
   int cols = adj->shape()[1];
+  int active = inputs[2]->size() / (3 * cols);
 
   int blocks  = std::min(MAX_BLOCKS, rows);
-  int threads = std::min(MAX_THREADS, cols);
+  int threads = unrolledThreads(cols);
 
-  gGRUFastBackward<<<blocks, threads>>>(
+  auto kernel = UNROLLED_KERNEL(gGRUFastBackward, cols);
+  kernel<<<blocks, threads, 0, currentStream()>>>(
     outputs[0] ? outputs[0]->data() : 0, // state - adj
     outputs[1] ? outputs[1]->data() : 0, // xW - adj
     outputs[2] ? outputs[2]->data() : 0, // sU - adj
@@ -905,31 +1399,557 @@ void GRUFastBackward(std::vector<Tensor> outputs,
     inputs[3]->data(), // b
     inputs.size() > 4 ? inputs[4]->data() : 0, // mask
     adj->data(),
-    rows, cols, final);
+    rows, active, cols, final);
 }
 
-__global__ void gCrossEntropyPick(float* out,
-                                  const Shape outShape,
-                                  const float* in,
-                                  const Shape inShape,
-                                  const float* pick) {
+/** @brief Per-thread, per-stream device scratch buffers, grown on demand */
+template <typename T>
+T* deviceScratch(size_t device, int slot, size_t elements) {
+  typedef std::tuple<size_t, cudaStream_t, int> Key;
+  thread_local std::map<Key, std::pair<T*, size_t>> scratch;
+  auto& buffer = scratch[Key(device, currentStream(), slot)];
+  if(buffer.second < elements) {
+    if(buffer.first)
+      CUDA_CHECK(cudaFree(buffer.first));
+    CUDA_CHECK(cudaMalloc(&buffer.first, elements * sizeof(T)));
+    CUDA_CHECK(cudaMemset(buffer.first, 0, elements * sizeof(T)));
+    buffer.second = elements;
+  }
+  return buffer.first;
+}
 
-  int rows = inShape[0];
-  int cols = inShape[1];
+/**
+ * Per column of a row-major {rows, cols} matrix, scale = max|x| / 127 and
+ * out = round(x / scale). One thread per column, reads are coalesced over
+ * the columns of a row.
+ */
+__global__ void gQuantizeColumns(int8_t* out, float* scales, const float* in,
+                                 int rows, int cols) {
+  for(int bid = 0; bid < cols; bid += blockDim.x * gridDim.x) {
+    int j = bid + blockDim.x * blockIdx.x + threadIdx.x;
+    if(j < cols) {
+      float mx = 0;
+      for(int i = 0; i < rows; ++i)
+        mx = max(mx, fabsf(in[i * cols + j]));
+      float scale = mx > 0 ? mx / 127.f : 1.f;
+      scales[j] = scale;
+      for(int i = 0; i < rows; ++i)
+        out[i * cols + j] = (int8_t)__float2int_rn(in[i * cols + j] / scale);
+    }
+  }
+}
+
+/** Per row, scale = max|x| / 127 and out = round(x / scale). One block per row. */
+__global__ void gQuantizeRows(int8_t* out, float* scales, const float* in,
+                              int rows, int cols) {
+  extern __shared__ float _share[];
   for(int bid = 0; bid < rows; bid += gridDim.x) {
     int j = bid + blockIdx.x;
     if(j < rows) {
-      const float* sp = in + j * cols;
-
-      extern __shared__ float _share[];
-      float* _max = _share + blockDim.x;
+      const float* row = in + j * cols;
 
-      _max[threadIdx.x] = sp[threadIdx.x];
-      for(int tid = 1; tid < cols; tid += blockDim.x) {
-        int id = tid + threadIdx.x;
-        if (id < cols) {
-          if (sp[id] > _max[threadIdx.x]) _max[threadIdx.x] = sp[id];
-        }
+      float mx = 0;
+      for(int i = threadIdx.x; i < cols; i += blockDim.x)
+        mx = max(mx, fabsf(row[i]));
+      _share[threadIdx.x] = mx;
+      __syncthreads();
+      for(int len = blockDim.x >> 1; len > 0; len >>= 1) {
+        if(threadIdx.x < len)
+          _share[threadIdx.x] = max(_share[threadIdx.x], _share[threadIdx.x + len]);
+        __syncthreads();
+      }
+      float scale = _share[0] > 0 ? _share[0] / 127.f : 1.f;
+      __syncthreads();
+
+      if(threadIdx.x == 0)
+        scales[j] = scale;
+      for(int i = threadIdx.x; i < cols; i += blockDim.x)
+        out[j * cols + i] = (int8_t)__float2int_rn(row[i] / scale);
+    }
+  }
+}
+
+/** C = acc * rowScales[i] * colScales[j] + beta * C */
+__global__ void gDequantize(float* C, const int* acc,
+                            const float* rowScales, const float* colScales,
+                            int rows, int cols, float beta) {
+  int length = rows * cols;
+  for(int bid = 0; bid < length; bid += blockDim.x * gridDim.x) {
+    int index = bid + blockDim.x * blockIdx.x + threadIdx.x;
+    if(index < length) {
+      float v = acc[index] * rowScales[index / cols] * colScales[index % cols];
+      C[index] = beta ? v + beta * C[index] : v;
+    }
+  }
+}
+
+void QuantizeColumns(int8_t* out, float* scales, const Tensor in) {
+  int rows = in->shape()[0] * in->shape()[2] * in->shape()[3];
+  int cols = in->shape()[1];
+
+  if(isCPU(in->getDevice())) {
+    cpu::QuantizeColumns(out, scales, in);
+    return;
+  }
+
+  cudaSetDevice(in->getDevice());
+  int threads = std::min(MAX_THREADS, cols);
+  int blocks = std::min(MAX_BLOCKS, cols / threads + (cols % threads != 0));
+  gQuantizeColumns<<<blocks, threads, 0, currentStream()>>>
+    (out, scales, in->data(), rows, cols);
+}
+
+void ProdInt8(cublasHandle_t handle, Tensor C, const Tensor A, const Tensor B,
+              bool transA, bool transB, Float beta,
+              const int8_t* quantB, const float* scalesB) {
+  if(transA || transB || !quantB) {
+    Prod(handle, C, A, B, transA, transB, beta);
+    return;
+  }
+
+  if(isCPU(C->getDevice())) {
+    cpu::ProdInt8(C, A, B, beta, quantB, scalesB);
+    return;
+  }
+
+  size_t device = C->getDevice();
+  cudaSetDevice(device);
+
+  int m = A->shape()[0] * A->shape()[2] * A->shape()[3];
+  int k = A->shape()[1];
+  int n = B->shape()[1];
+
+  int8_t* quantA = deviceScratch<int8_t>(device, 0, (size_t)m * k);
+  float* scalesA = deviceScratch<float>(device, 9, m);
+  int* acc = deviceScratch<int>(device, 0, (size_t)m * n);
+
+  int threads = std::min(MAX_THREADS, k);
+  int blocks = std::min(MAX_BLOCKS, m);
+  gQuantizeRows<<<blocks, threads, threads * sizeof(float), currentStream()>>>
+    (quantA, scalesA, A->data(), m, k);
+
+  // row-major C = A * B is column-major C^T = B^T * A^T
+  int alpha = 1;
+  int zero = 0;
+  cublasStatus_t status
+    = cublasGemmEx(handle, CUBLAS_OP_N, CUBLAS_OP_N,
+                   n, m, k, &alpha,
+                   quantB, CUDA_R_8I, n,
+                   quantA, CUDA_R_8I, k, &zero,
+                   acc, CUDA_R_32I, n,
+#if CUDA_VERSION >= 11000
+                   CUBLAS_COMPUTE_32I,
+#else
+                   CUDA_R_32I,
+#endif
+                   CUBLAS_GEMM_DEFAULT);
+
+  // int8 GEMMs need dimensions divisible by 4 on most devices
+  if(status != CUBLAS_STATUS_SUCCESS) {
+    Prod(handle, C, A, B, transA, transB, beta);
+    return;
+  }
+
+  int length = m * n;
+  threads = std::min(MAX_THREADS, length);
+  blocks = std::min(MAX_BLOCKS, length / threads + (length % threads != 0));
+  gDequantize<<<blocks, threads, 0, currentStream()>>>
+    (C->data(), acc, scalesA, scalesB, m, n, beta);
+}
+
+/**
+ * Barrier across all blocks of a cooperative launch. barrier[0] counts arrivals,
+ * barrier[1] is the generation the waiting blocks spin on.
+ */
+__device__ void gGridSync(unsigned int* barrier) {
+  __syncthreads();
+  if(threadIdx.x == 0) {
+    volatile unsigned int* generation = barrier + 1;
+    unsigned int gen = *generation;
+    __threadfence();
+    if(atomicAdd(barrier, 1) == gridDim.x - 1) {
+      atomicExch(barrier, 0);
+      __threadfence();
+      atomicAdd(barrier + 1, 1);
+    }
+    else {
+      while(*generation == gen);
+    }
+    __threadfence();
+  }
+  __syncthreads();
+}
+
+/**
+ * Recurrent products of one (row, unit) pair, s * U for the reset, update and
+ * candidate columns of unit j. Us is the block's column slice of U in shared
+ * memory or null, then U is read from global memory.
+ */
+__device__ inline void gRecurrent(float& ur, float& uz, float& ux,
+                                  const float* s, const float* U, const float* Us,
+                                  int dim, int j, int jj, int own) {
+  ur = 0; uz = 0; ux = 0;
+  for(int k = 0; k < dim; ++k) {
+    float sk = __ldcg(s + k);
+    if(Us) {
+      const float* u = Us + k * 3 * own;
+      ur += sk * u[jj];
+      uz += sk * u[own + jj];
+      ux += sk * u[2 * own + jj];
+    }
+    else {
+      const float* u = U + k * 3 * dim;
+      ur += sk * u[j];
+      uz += sk * u[dim + j];
+      ux += sk * u[2 * dim + j];
+    }
+  }
+}
+
+/**
+ * Persistent GRU recurrence over all timesteps. Every block owns a contiguous
+ * range of hidden units for all batch rows and stages the matching columns of
+ * U in shared memory if they fit. Timesteps are separated by grid barriers,
+ * states are exchanged through out in global memory.
+ */
+__global__ void gGRUSequenceForward(float* out,
+                                    const float* state,
+                                    const float* xW,
+                                    const float* U,
+                                    const float* b,
+                                    const float* mask,
+                                    int batch, int dim, int steps,
+                                    bool reverse, bool final, bool stage,
+                                    unsigned int* barrier) {
+  extern __shared__ float Ushared[];
+
+  int units = (dim + gridDim.x - 1) / gridDim.x;
+  int first = blockIdx.x * units;
+  int own = max(0, min(dim, first + units) - first);
+
+  const float* Us = stage ? Ushared : nullptr;
+  if(stage) {
+    for(int idx = threadIdx.x; idx < dim * 3 * own; idx += blockDim.x) {
+      int k = idx / (3 * own);
+      int c = idx % (3 * own);
+      Ushared[idx] = U[k * 3 * dim + (c / own) * dim + first + c % own];
+    }
+    __syncthreads();
+  }
+
+  for(int s = 0; s < steps; ++s) {
+    int t = reverse ? steps - 1 - s : s;
+    const float* prev = s == 0 ? state : out + (reverse ? t + 1 : t - 1) * batch * dim;
+    float* cur = out + t * batch * dim;
+
+    for(int p = threadIdx.x; p < batch * own; p += blockDim.x) {
+      int row = p / own;
+      int jj = p % own;
+      int j = first + jj;
+
+      const float* rowState = prev + row * dim;
+      float ur, uz, ux;
+      gRecurrent(ur, uz, ux, rowState, U, Us, dim, j, jj, own);
+
+      const float* x = xW + (t * batch + row) * 3 * dim;
+      float m = !mask || mask[t * batch + row];
+
+      float r = 1.0f / (1.0f + expf(-(x[j] + ur + b[j])));
+      float z = 1.0f / (1.0f + expf(-(x[dim + j] + uz + b[dim + j])));
+
+      int l = 2 * dim + j;
+      float h;
+      if(final)
+        h = tanhf(x[l] + (ux + b[l]) * r);
+      else
+        h = tanhf(x[l] + ux * r + b[l]);
+
+      float sj = __ldcg(rowState + j);
+      float o = (1.0f - z) * h + z * sj;
+      cur[row * dim + j] = m * o + (1 - m) * sj;
+    }
+
+    gGridSync(barrier);
+  }
+}
+
+/**
+ * Backward recurrence, walks the timesteps in the opposite order. Per step the
+ * gate gradients of all owned pairs are written to dsU, after a grid barrier
+ * every block computes the state gradient of its units, carry = direct + dsU * U^T.
+ * Weight and input gradients are left to batched products over all steps.
+ */
+__global__ void gGRUSequenceBackward(float* outState,
+                                     float* outXW,
+                                     float* dsU,
+                                     float* outB,
+                                     float* carry,
+                                     float* direct,
+                                     const float* out,
+                                     const float* state,
+                                     const float* xW,
+                                     const float* U,
+                                     const float* b,
+                                     const float* mask,
+                                     const float* adj,
+                                     int batch, int dim, int steps,
+                                     bool reverse, bool final, bool stage,
+                                     unsigned int* barrier) {
+  extern __shared__ float Ushared[];
+
+  int units = (dim + gridDim.x - 1) / gridDim.x;
+  int first = blockIdx.x * units;
+  int own = max(0, min(dim, first + units) - first);
+
+  // column slice for the recomputed products, row slice for dsU * U^T
+  const float* Us = stage ? Ushared : nullptr;
+  const float* Ur = stage ? Ushared + dim * 3 * own : nullptr;
+  if(stage) {
+    for(int idx = threadIdx.x; idx < dim * 3 * own; idx += blockDim.x) {
+      int k = idx / (3 * own);
+      int c = idx % (3 * own);
+      Ushared[idx] = U[k * 3 * dim + (c / own) * dim + first + c % own];
+      Ushared[dim * 3 * own + idx] = U[(first + idx / (3 * dim)) * 3 * dim + idx % (3 * dim)];
+    }
+    __syncthreads();
+  }
+
+  for(int s = steps - 1; s >= 0; --s) {
+    int t = reverse ? steps - 1 - s : s;
+    const float* prev = s == 0 ? state : out + (reverse ? t + 1 : t - 1) * batch * dim;
+    float* dsUt = dsU + t * batch * 3 * dim;
+
+    for(int p = threadIdx.x; p < batch * own; p += blockDim.x) {
+      int row = p / own;
+      int jj = p % own;
+      int j = first + jj;
+      int k = dim + j;
+      int l = 2 * dim + j;
+
+      const float* rowState = prev + row * dim;
+      float ur, uz, ux;
+      gRecurrent(ur, uz, ux, rowState, U, Us, dim, j, jj, own);
+
+      const float* x = xW + (t * batch + row) * 3 * dim;
+      float m = !mask || mask[t * batch + row];
+
+      float r = 1.0f / (1.0f + expf(-(x[j] + ur + b[j])));
+      float z = 1.0f / (1.0f + expf(-(x[k] + uz + b[k])));
+
+      float h;
+      if(final)
+        h = tanhf(x[l] + (ux + b[l]) * r);
+      else
+        h = tanhf(x[l] + ux * r + b[l]);
+
+      float g = adj[(t * batch + row) * dim + j];
+      if(s < steps - 1)
+        g += carry[row * dim + j];
+
+      float tt = (1 - z) * (1 - h * h);
+
+      float dfdxW_r = m * r * (1 - r) * tt * g * (final ? ux + b[l] : ux);
+      float dfdxW_z = m * (1 - z) * z * (__ldcg(rowState + j) - h) * g;
+      float dfdxW_x = m * tt * g;
+
+      float* rowDsU = dsUt + row * 3 * dim;
+      rowDsU[j] = dfdxW_r;
+      rowDsU[k] = dfdxW_z;
+      rowDsU[l] = dfdxW_x * r;
+
+      if(outXW) {
+        float* rowOutXW = outXW + (t * batch + row) * 3 * dim;
+        rowOutXW[j] += dfdxW_r;
+        rowOutXW[k] += dfdxW_z;
+        rowOutXW[l] += dfdxW_x;
+      }
+      if(outB) {
+        atomicAdd(outB + j, dfdxW_r);
+        atomicAdd(outB + k, dfdxW_z);
+        atomicAdd(outB + l, final ? dfdxW_x * r : dfdxW_x);
+      }
+
+      direct[row * dim + j] = (m * z + 1 - m) * g;
+    }
+
+    gGridSync(barrier);
+
+    for(int p = threadIdx.x; p < batch * own; p += blockDim.x) {
+      int row = p / own;
+      int jj = p % own;
+      int j = first + jj;
+
+      const float* rowDsU = dsUt + row * 3 * dim;
+      const float* u = Ur ? Ur + jj * 3 * dim : U + j * 3 * dim;
+      float sum = direct[row * dim + j];
+      for(int c = 0; c < 3 * dim; ++c)
+        sum += __ldcg(rowDsU + c) * u[c];
+      carry[row * dim + j] = sum;
+
+      if(s == 0 && outState)
+        outState[row * dim + j] += sum;
+    }
+  }
+}
+
+/** @brief Launch configuration of the persistent GRU kernels */
+struct SequenceLaunch {
+  int blocks;
+  int threads;
+  size_t shared;
+};
+
+/**
+ * Picks as many blocks as can be resident at once, at most one per unit.
+ * The U slices of a block are staged in shared memory if they fit without
+ * cutting the number of blocks.  slices  is 1 forward and 2 backward.
+ */
+template <typename Kernel>
+SequenceLaunch sequenceLaunch(Kernel kernel, size_t device, int dim, int slices) {
+  int threads = 256;
+
+  int sms, cooperative;
+  cudaDeviceGetAttribute(&sms, cudaDevAttrMultiProcessorCount, device);
+  cudaDeviceGetAttribute(&cooperative, cudaDevAttrCooperativeLaunch, device);
+  UTIL_THROW_IF2(!cooperative,
+                 "Device " << device << " does not support cooperative launches "
+                 "required by the persistent RNN kernels");
+
+  int perSM;
+  cudaOccupancyMaxActiveBlocksPerMultiprocessor(&perSM, kernel, threads, 0);
+  int blocks = std::min(dim, perSM * sms);
+
+  int units = (dim + blocks - 1) / blocks;
+  size_t shared = (size_t)slices * 3 * dim * units * sizeof(float);
+  if(shared <= 48 * 1024) {
+    int stagedPerSM;
+    cudaOccupancyMaxActiveBlocksPerMultiprocessor(&stagedPerSM, kernel, threads, shared);
+    int needed = (dim + units - 1) / units;
+    if(stagedPerSM * sms >= needed)
+      return {needed, threads, shared};
+  }
+  return {blocks, threads, 0};
+}
+
+void GRUSequenceForward(Tensor out, const std::vector<Tensor>& inputs,
+                        bool reverse, bool final) {
+  if(isCPU(out->getDevice())) {
+    cpu::GRUSequenceForward(out, inputs, reverse, final);
+    return;
+  }
+
+  size_t device = out->getDevice();
+  cudaSetDevice(device);
+
+  int batch = out->shape()[0];
+  int dim = out->shape()[1];
+  int steps = out->shape()[2];
+
+  float* outData = out->data();
+  const float* state = inputs[0]->data();
+  const float* xW = inputs[1]->data();
+  const float* U = inputs[2]->data();
+  const float* b = inputs[3]->data();
+  const float* mask = inputs.size() > 4 ? inputs[4]->data() : nullptr;
+
+  auto launch = sequenceLaunch(gGRUSequenceForward, device, dim, 1);
+  bool stage = launch.shared > 0;
+  unsigned int* barrier = deviceScratch<unsigned int>(device, 0, 2);
+
+  void* args[] = {&outData, &state, &xW, &U, &b, &mask,
+                  &batch, &dim, &steps, &reverse, &final, &stage, &barrier};
+  CUDA_CHECK(cudaLaunchCooperativeKernel((void*)gGRUSequenceForward,
+                                         launch.blocks, launch.threads,
+                                         args, launch.shared, currentStream()));
+}
+
+void GRUSequenceBackward(cublasHandle_t handle,
+                         const std::vector<Tensor>& outputs,
+                         const std::vector<Tensor>& inputs,
+                         Tensor out, Tensor adj,
+                         bool reverse, bool final) {
+  UTIL_THROW_IF2(isCPU(adj->getDevice()), "GRUSequenceBackward is not implemented on CPU");
+
+  size_t device = adj->getDevice();
+  cudaSetDevice(device);
+
+  int batch = adj->shape()[0];
+  int dim = adj->shape()[1];
+  int steps = adj->shape()[2];
+
+  float* outState = outputs[0] ? outputs[0]->data() : nullptr;
+  float* outXW = outputs[1] ? outputs[1]->data() : nullptr;
+  float* outB = outputs[3] ? outputs[3]->data() : nullptr;
+
+  float* dsU = deviceScratch<float>(device, 1, (size_t)batch * 3 * dim * steps);
+  float* carry = deviceScratch<float>(device, 2, (size_t)batch * dim);
+  float* direct = deviceScratch<float>(device, 3, (size_t)batch * dim);
+  unsigned int* barrier = deviceScratch<unsigned int>(device, 0, 2);
+
+  const float* outData = out->data();
+  const float* state = inputs[0]->data();
+  const float* xW = inputs[1]->data();
+  const float* U = inputs[2]->data();
+  const float* b = inputs[3]->data();
+  const float* mask = inputs.size() > 4 ? inputs[4]->data() : nullptr;
+  const float* adjData = adj->data();
+
+  auto launch = sequenceLaunch(gGRUSequenceBackward, device, dim, 2);
+  bool stage = launch.shared > 0;
+
+  void* args[] = {&outState, &outXW, &dsU, &outB, &carry, &direct,
+                  &outData, &state, &xW, &U, &b, &mask, &adjData,
+                  &batch, &dim, &steps, &reverse, &final, &stage, &barrier};
+  CUDA_CHECK(cudaLaunchCooperativeKernel((void*)gGRUSequenceBackward,
+                                         launch.blocks, launch.threads,
+                                         args, launch.shared, currentStream()));
+
+  if(!outputs[2])
+    return;
+
+  // dU += S^T * dsU with S the state entering every step, for all steps at once
+  size_t slice = (size_t)batch * dim;
+  float* prev = deviceScratch<float>(device, 4, slice * steps);
+  if(!reverse) {
+    CUDA_CHECK(cudaMemcpyAsync(prev, state, slice * sizeof(float),
+                               cudaMemcpyDeviceToDevice, currentStream()));
+    CUDA_CHECK(cudaMemcpyAsync(prev + slice, outData, slice * (steps - 1) * sizeof(float),
+                               cudaMemcpyDeviceToDevice, currentStream()));
+  }
+  else {
+    CUDA_CHECK(cudaMemcpyAsync(prev, outData + slice, slice * (steps - 1) * sizeof(float),
+                               cudaMemcpyDeviceToDevice, currentStream()));
+    CUDA_CHECK(cudaMemcpyAsync(prev + slice * (steps - 1), state, slice * sizeof(float),
+                               cudaMemcpyDeviceToDevice, currentStream()));
+  }
+
+  Tensor S(new TensorBase(prev, {batch, dim, steps}, device));
+  Tensor G(new TensorBase(dsU, {batch, 3 * dim, steps}, device));
+  Prod(handle, outputs[2], S, G, true, false, 1.0);
+}
+
+__global__ void gCrossEntropyPick(float* out,
+                                  const Shape outShape,
+                                  const float* in,
+                                  const Shape inShape,
+                                  const float* pick) {
+
+  int rows = inShape[0];
+  int cols = inShape[1];
+  for(int bid = 0; bid < rows; bid += gridDim.x) {
+    int j = bid + blockIdx.x;
+    if(j < rows) {
+      const float* sp = in + j * cols;
+
+      extern __shared__ float _share[];
+      float* _max = _share + blockDim.x;
+
+      _max[threadIdx.x] = sp[threadIdx.x];
+      for(int tid = 1; tid < cols; tid += blockDim.x) {
+        int id = tid + threadIdx.x;
+        if (id < cols) {
+          if (sp[id] > _max[threadIdx.x]) _max[threadIdx.x] = sp[id];
+        }
       }
       __syncthreads();
       int len = blockDim.x;
@@ -978,21 +1998,27 @@ __global__ void gCrossEntropyPick(float* out,
 }
 
 void CrossEntropyPick(Tensor out, Tensor in, Tensor pick) {
+  if(isCPU(out->getDevice())) {
+    cpu::CrossEntropyPick(out, in, pick);
+    return;
+  }
+
   cudaSetDevice(out->getDevice());
 
   size_t m = in->shape()[0];
   size_t k = in->shape()[1];
 
   int blocks = std::min(MAX_BLOCKS, (int) m);
-  int threads = std::min(MAX_THREADS, (int) k);
-  int shared = sizeof(float) * threads * 2;
-
-  gCrossEntropyPick<<<blocks, threads, shared>>>(out->data(),
-                                                 out->shape(),
-                                                 in->data(),
-                                                 in->shape(),
-                                                 pick->data());
 
+  auto launch = [&](int threads) {
+    int shared = sizeof(float) * threads * 2;
+    gCrossEntropyPick<<<blocks, threads, shared, currentStream()>>>(out->data(),
+                                                   out->shape(),
+                                                   in->data(),
+                                                   in->shape(),
+                                                   pick->data());
+  };
+  launch(tunedThreads("cross-entropy-pick", m, k, launch));
 }
 
 __global__ void gCrossEntropyPickBackward(float* out,
@@ -1068,6 +2094,8 @@ __global__ void gCrossEntropyPickBackward(float* out,
 }
 
 void CrossEntropyPickBackward(Tensor out, Tensor adj, Tensor a, Tensor pick) {
+  UTIL_THROW_IF2(isCPU(out->getDevice()), "CrossEntropyPickBackward is not implemented on CPU");
+
   cudaSetDevice(out->getDevice());
 
   size_t m = out->shape()[0];
@@ -1077,14 +2105,258 @@ void CrossEntropyPickBackward(Tensor out, Tensor adj, Tensor a, Tensor pick) {
   int threads = std::min(MAX_THREADS, (int) k);
   int shared = sizeof(float) * threads * 2;
 
-  gCrossEntropyPickBackward<<<blocks, threads, shared>>>(out->data(),
+  gCrossEntropyPickBackward<<<blocks, threads, shared, currentStream()>>>(out->data(),
                                                          out->shape(),
                                                          adj->data(),
                                                          a->data(),
                                                          pick->data());
 }
 
+/** @brief Max or sum of  value  over the threads of a block, returned to all of them */
+__device__ float shardReduce(float* share, float value, bool isMax) {
+  share[threadIdx.x] = value;
+  __syncthreads();
+  int len = blockDim.x;
+  while(len != 1) {
+    int skip = (len + 1) >> 1;
+    if(threadIdx.x < (len >> 1))
+      share[threadIdx.x] = isMax ? fmaxf(share[threadIdx.x], share[threadIdx.x + skip])
+                                 : share[threadIdx.x] + share[threadIdx.x + skip];
+    len = skip;
+    __syncthreads();
+  }
+  float result = share[0];
+  __syncthreads();
+  return result;
+}
+
+// per row of the logits of a shard, folds max and sum of exponentials into
+// the running log-sum-exp stats = (max, sum, picked logit)
+__global__ void gShardLogSumExp(float* stats,
+                                const float* logits,
+                                const float* bias,
+                                const float* pick,
+                                int rows, int cols, int offset, bool first) {
+  extern __shared__ float _share[];
+  for(int bid = 0; bid < rows; bid += gridDim.x) {
+    int j = bid + blockIdx.x;
+    if(j < rows) {
+      const float* sp = logits + j * cols;
+
+      float max = -FLT_MAX;
+      for(int id = threadIdx.x; id < cols; id += blockDim.x)
+        max = fmaxf(max, sp[id] + bias[id]);
+      max = shardReduce(_share, max, true);
+
+      float sum = 0;
+      for(int id = threadIdx.x; id < cols; id += blockDim.x)
+        sum += __expf(sp[id] + bias[id] - max);
+      sum = shardReduce(_share, sum, false);
+
+      if(threadIdx.x == 0) {
+        float* st = stats + 3 * j;
+        if(first) {
+          st[0] = max;
+          st[1] = sum;
+          st[2] = 0;
+        }
+        else {
+          float joint = fmaxf(st[0], max);
+          st[1] = st[1] * __expf(st[0] - joint) + sum * __expf(max - joint);
+          st[0] = joint;
+        }
+        int p = (int)pick[j] - offset;
+        if(p >= 0 && p < cols)
+          st[2] = sp[p] + bias[p];
+      }
+    }
+  }
+}
+
+__global__ void gShardCost(float* out, const float* stats, int rows) {
+  for(int j = threadIdx.x + blockIdx.x * blockDim.x; j < rows; j += gridDim.x * blockDim.x)
+    out[j] = __logf(stats[3 * j + 1]) + stats[3 * j] - stats[3 * j + 2];
+}
+
+// log-sum-exp of every row from the cost and the logit of the picked word
+__global__ void gPickedLogSumExp(float* lse,
+                                 const float* cost,
+                                 const float* in,
+                                 const float* W,
+                                 const float* bias,
+                                 const float* pick,
+                                 int rows, int dim, int vocab, bool transW) {
+  extern __shared__ float _share[];
+  for(int bid = 0; bid < rows; bid += gridDim.x) {
+    int j = bid + blockIdx.x;
+    if(j < rows) {
+      int p = (int)pick[j];
+      float sum = 0;
+      for(int k = threadIdx.x; k < dim; k += blockDim.x)
+        sum += in[j * dim + k] * (transW ? W[p * dim + k] : W[k * vocab + p]);
+      sum = shardReduce(_share, sum, false);
+      if(threadIdx.x == 0)
+        lse[j] = cost[j] + sum + bias[p];
+    }
+  }
+}
+
+// turns the logits of a shard into the gradient of the cost in place
+__global__ void gShardGrad(float* logits,
+                           const float* bias,
+                           const float* lse,
+                           const float* adj,
+                           const float* pick,
+                           int rows, int cols, int offset) {
+  int length = rows * cols;
+  for(int i = threadIdx.x + blockIdx.x * blockDim.x; i < length; i += gridDim.x * blockDim.x) {
+    int j = i / cols;
+    int id = i % cols;
+    float sub = (float)(id == (int)pick[j] - offset);
+    logits[i] = adj[j] * (__expf(logits[i] + bias[id] - lse[j]) - sub);
+  }
+}
+
+__global__ void gAddColumnSums(float* out, const float* in, int rows, int cols) {
+  for(int c = threadIdx.x + blockIdx.x * blockDim.x; c < cols; c += gridDim.x * blockDim.x) {
+    float sum = 0;
+    for(int j = 0; j < rows; ++j)
+      sum += in[j * cols + c];
+    out[c] += sum;
+  }
+}
+
+/**
+ * Logits of the columns [offset, offset + cols) of the output layer, row-major
+ * {rows, cols} in  logits : in * W[:, offset:offset + cols] for the  rows  x
+ * dim  block  in . The slice of W is addressed in place with its row stride.
+ */
+// W is dim x vocab, or vocab x dim with  transW , a slice of the vocabulary
+// is then a range of rows
+static void shardLogits(cublasHandle_t handle, float* logits,
+                        const float* in, int rows, int dim,
+                        Tensor W, int offset, int cols, bool transW) {
+  float alpha = 1.f, beta = 0.f;
+  if(transW)
+    cublasSgemm(handle, CUBLAS_OP_T, CUBLAS_OP_N, cols, rows, dim,
+                &alpha, W->data() + (size_t)offset * dim, dim, in, dim,
+                &beta, logits, cols);
+  else
+    cublasSgemm(handle, CUBLAS_OP_N, CUBLAS_OP_N, cols, rows, dim,
+                &alpha, W->data() + offset, W->shape()[1], in, dim,
+                &beta, logits, cols);
+}
+
+void ShardedCrossEntropy(cublasHandle_t handle, Tensor out, Tensor in,
+                         Tensor W, Tensor b, Tensor pick, int shards, int chunks,
+                         bool transW) {
+  UTIL_THROW_IF2(isCPU(out->getDevice()), "ShardedCrossEntropy is not implemented on CPU");
+
+  size_t device = out->getDevice();
+  cudaSetDevice(device);
+
+  int rows = in->shape()[0];
+  int dim = in->shape()[1];
+  int vocab = W->shape()[transW ? 0 : 1];
+  int width = (vocab + shards - 1) / shards;
+  int height = (rows + chunks - 1) / chunks;
+
+  float* logits = deviceScratch<float>(device, 4, (size_t)height * width);
+  float* stats = deviceScratch<float>(device, 5, (size_t)height * 3);
+
+  // rows are time-major, a chunk of them is a range of target steps
+  for(int first = 0; first < rows; first += height) {
+    int count = std::min(height, rows - first);
+    const float* chunkIn = in->data() + (size_t)first * dim;
+    const float* chunkPick = pick->data() + first;
+
+    int blocks = std::min(MAX_BLOCKS, count);
+    for(int offset = 0; offset < vocab; offset += width) {
+      int cols = std::min(width, vocab - offset);
+      shardLogits(handle, logits, chunkIn, count, dim, W, offset, cols, transW);
+      int threads = std::min(MAX_THREADS, cols);
+      gShardLogSumExp<<<blocks, threads, sizeof(float) * threads, currentStream()>>>(
+        stats, logits, b->data() + offset, chunkPick, count, cols, offset, offset == 0);
+    }
+
+    int threads = std::min(MAX_THREADS, count);
+    gShardCost<<<std::min(MAX_BLOCKS, count / threads + (count % threads != 0)), threads,
+                 0, currentStream()>>>(out->data() + first, stats, count);
+  }
+}
+
+void ShardedCrossEntropyBackward(cublasHandle_t handle,
+                                 Tensor outIn, Tensor outW, Tensor outB,
+                                 Tensor adj, Tensor val,
+                                 Tensor in, Tensor W, Tensor b, Tensor pick,
+                                 int shards, int chunks, bool transW) {
+  UTIL_THROW_IF2(isCPU(adj->getDevice()), "ShardedCrossEntropyBackward is not implemented on CPU");
+
+  size_t device = adj->getDevice();
+  cudaSetDevice(device);
+
+  int rows = in->shape()[0];
+  int dim = in->shape()[1];
+  int vocab = W->shape()[transW ? 0 : 1];
+  int width = (vocab + shards - 1) / shards;
+  int height = (rows + chunks - 1) / chunks;
+
+  float* grads = deviceScratch<float>(device, 4, (size_t)height * width);
+  float* lse = deviceScratch<float>(device, 5, (size_t)height * 3);
+
+  float alpha = 1.f, beta = 1.f;
+  for(int first = 0; first < rows; first += height) {
+    int count = std::min(height, rows - first);
+    const float* chunkIn = in->data() + (size_t)first * dim;
+    const float* chunkPick = pick->data() + first;
+    const float* chunkAdj = adj->data() + first;
+
+    int blocks = std::min(MAX_BLOCKS, count);
+    int threads = std::min(MAX_THREADS, dim);
+    gPickedLogSumExp<<<blocks, threads, sizeof(float) * threads, currentStream()>>>(
+      lse, val->data() + first, chunkIn, W->data(), b->data(), chunkPick, count, dim, vocab,
+      transW);
+
+    for(int offset = 0; offset < vocab; offset += width) {
+      int cols = std::min(width, vocab - offset);
+      shardLogits(handle, grads, chunkIn, count, dim, W, offset, cols, transW);
+
+      int length = count * cols;
+      threads = std::min(MAX_THREADS, length);
+      gShardGrad<<<std::min(MAX_BLOCKS, length / threads + (length % threads != 0)), threads,
+                   0, currentStream()>>>(grads, b->data() + offset, lse, chunkAdj,
+                                         chunkPick, count, cols, offset);
+
+      // d in += G * W_s^T, d W_s += in^T * G, d b_s += column sums of G
+      if(outIn && transW)
+        cublasSgemm(handle, CUBLAS_OP_N, CUBLAS_OP_N, dim, count, cols,
+                    &alpha, W->data() + (size_t)offset * dim, dim, grads, cols,
+                    &beta, outIn->data() + (size_t)first * dim, dim);
+      else if(outIn)
+        cublasSgemm(handle, CUBLAS_OP_T, CUBLAS_OP_N, dim, count, cols,
+                    &alpha, W->data() + offset, vocab, grads, cols,
+                    &beta, outIn->data() + (size_t)first * dim, dim);
+      if(outW && transW)
+        cublasSgemm(handle, CUBLAS_OP_N, CUBLAS_OP_T, dim, cols, count,
+                    &alpha, chunkIn, dim, grads, cols,
+                    &beta, outW->data() + (size_t)offset * dim, dim);
+      else if(outW)
+        cublasSgemm(handle, CUBLAS_OP_N, CUBLAS_OP_T, cols, dim, count,
+                    &alpha, grads, cols, chunkIn, dim,
+                    &beta, outW->data() + offset, vocab);
+      if(outB) {
+        threads = std::min(MAX_THREADS, cols);
+        gAddColumnSums<<<std::min(MAX_BLOCKS, cols / threads + (cols % threads != 0)), threads,
+                         0, currentStream()>>>(outB->data() + offset, grads, count, cols);
+      }
+    }
+  }
+}
+
 float L2Norm(Tensor in) {
+  if(isCPU(in->getDevice()))
+    return cpu::L2Norm(in);
+
   cudaSetDevice(in->getDevice());
 
   float* data;
@@ -1097,6 +2369,365 @@ float L2Norm(Tensor in) {
   return dataCpu;
 }
 
+__global__ void gSquaredPartials(float* partials, const float* in, int length) {
+  extern __shared__ float _share[];
+
+  float sum = 0;
+  for(int index = blockIdx.x * blockDim.x + threadIdx.x; index < length;
+      index += blockDim.x * gridDim.x)
+    sum += in[index] * in[index];
+  _share[threadIdx.x] = sum;
+
+  int len = blockDim.x;
+  while(len != 1) {
+    __syncthreads();
+    int skip = (len + 1) >> 1;
+    if(threadIdx.x < (len >> 1))
+      _share[threadIdx.x] += _share[threadIdx.x + skip];
+    len = (len + 1) >> 1;
+  }
+  __syncthreads();
+  if(threadIdx.x == 0)
+    partials[blockIdx.x] = _share[0];
+}
+
+__global__ void gClipFactor(float* factor, const float* partials, int parts, float c) {
+  if(threadIdx.x == 0) {
+    float sum = 0;
+    for(int i = 0; i < parts; ++i)
+      sum += partials[i];
+    float norm = sqrtf(sum);
+    factor[0] = norm >= c ? c / norm : 1.f;
+  }
+}
+
+void ClipNormFactor(Tensor factor, Tensor in, float c) {
+  UTIL_THROW_IF2(factor->size() < CLIP_PARTS + 1,
+                 "Clipping factor needs " << CLIP_PARTS + 1 << " elements");
+
+  if(isCPU(in->getDevice())) {
+    float norm = cpu::L2Norm(in);
+    factor->data()[0] = norm >= c ? c / norm : 1.f;
+    return;
+  }
+
+  cudaSetDevice(in->getDevice());
+
+  int length = in->size();
+  int threads = MAX_THREADS;
+  int blocks = std::min(CLIP_PARTS, length / threads + (length % threads != 0));
+
+  gSquaredPartials<<<blocks, threads, threads * sizeof(float), currentStream()>>>(
+    factor->data() + 1, in->data(), length);
+  gClipFactor<<<1, 32, 0, currentStream()>>>(factor->data(), factor->data() + 1, blocks, c);
+}
+
+__global__ void gAdamUpdate(float* params, const float* grads,
+                            float* mt, float* vt, int length,
+                            float eta, float beta1, float beta2, float eps,
+                            float denom1, float denom2, const float* scale,
+                            float* avg, float decay,
+                            const uint32_t* starts, const uint32_t* prefix, int count) {
+  float s = scale ? scale[0] : 1.f;
+  for(int bid = 0; bid < length; bid += blockDim.x * gridDim.x) {
+    int i = bid + blockDim.x * blockIdx.x + threadIdx.x;
+    if(i < length) {
+      int index = starts ? rangeElement(i, starts, prefix, count) : i;
+      float g = s * grads[index];
+      float m = beta1 * mt[index] + (1 - beta1) * g;
+      float v = beta2 * vt[index] + (1 - beta2) * (g * g);
+      mt[index] = m;
+      vt[index] = v;
+      float p = params[index] - eta * (m / denom1) / (sqrtf(v / denom2) + eps);
+      params[index] = p;
+      if(avg)
+        avg[index] = decay * avg[index] + (1 - decay) * p;
+    }
+  }
+}
+
+void AdamUpdate(Tensor params, Tensor grads, Tensor mt, Tensor vt,
+                float eta, float beta1, float beta2, float eps,
+                float denom1, float denom2, Tensor scale,
+                Tensor avg, float decay, const DeviceRanges* ranges) {
+  if(isCPU(params->getDevice())) {
+    float s = scale ? scale->data()[0] : 1.f;
+    cpu::Element(_1 = (beta1 * _1) + ((1 - beta1) * s * _2), mt, grads);
+    cpu::Element(_1 = (beta2 * _1) + ((1 - beta2) * (s * _2) * (s * _2)),
+                 vt, grads);
+    cpu::Element(_1 -= eta * (_2 / denom1) / (Sqrt(_3 / denom2) + eps),
+                 params, mt, vt);
+    if(avg)
+      cpu::Element(_1 = decay * _1 + (1 - decay) * _2, avg, params);
+    return;
+  }
+
+  cudaSetDevice(params->getDevice());
+
+  int length = ranges ? ranges->total() : params->size();
+  if(length == 0)
+    return;
+  int threads = std::min(MAX_THREADS, length);
+  int blocks = std::min(MAX_BLOCKS, length / threads + (length % threads != 0));
+
+  gAdamUpdate<<<blocks, threads, 0, currentStream()>>>(params->data(), grads->data(),
+                                   mt->data(), vt->data(), length,
+                                   eta, beta1, beta2, eps, denom1, denom2,
+                                   scale ? scale->data() : nullptr,
+                                   avg ? avg->data() : nullptr, decay,
+                                   ranges ? ranges->starts() : nullptr,
+                                   ranges ? ranges->prefix() : nullptr,
+                                   ranges ? ranges->count() : 0);
+}
+
+// normalized, companded codes of the moments in [-1, 1]
+__device__ inline float fromCode(int8_t q) { return q / 127.f; }
+__device__ inline float fromCode(uint8_t q) { return q / 255.f; }
+__device__ inline float fromCode(__half q) { return __half2float(q); }
+
+__device__ inline void toCode(int8_t* q, float c) {
+  *q = (int8_t)fminf(127.f, fmaxf(-127.f, rintf(127.f * c)));
+}
+// rounded up, v is never underestimated
+__device__ inline void toCode(uint8_t* q, float c) {
+  *q = (uint8_t)fminf(255.f, ceilf(255.f * c));
+}
+__device__ inline void toCode(__half* q, float c) {
+  *q = __float2half(c);
+}
+
+template <typename M, typename V>
+__global__ void gAdamUpdateQuantized(float* params, const float* grads,
+                                     M* mt, V* vt, float* mScale, float* vScale,
+                                     int length, float eta, float beta1, float beta2,
+                                     float eps, float denom1, float denom2,
+                                     const float* scale, float* avg, float decay) {
+  __shared__ float mMax[ADAM_BLOCK];
+  __shared__ float vMax[ADAM_BLOCK];
+
+  float s = scale ? scale[0] : 1.f;
+  int blocks = length / ADAM_BLOCK + (length % ADAM_BLOCK != 0);
+  for(int b = blockIdx.x; b < blocks; b += gridDim.x) {
+    int index = b * ADAM_BLOCK + threadIdx.x;
+    float m = 0, v = 0;
+    if(index < length) {
+      float w = fromCode(mt[index]) * mScale[b];
+      float u = fromCode(vt[index]) * vScale[b];
+      float g = s * grads[index];
+      m = beta1 * copysignf(w * w, w) + (1 - beta1) * g;
+      v = beta2 * (u * u) * (u * u) + (1 - beta2) * (g * g);
+      float p = params[index] - eta * (m / denom1) / (sqrtf(v / denom2) + eps);
+      params[index] = p;
+      if(avg)
+        avg[index] = decay * avg[index] + (1 - decay) * p;
+    }
+
+    // the new scales are the maxima of the block
+    float w = copysignf(sqrtf(fabsf(m)), m);
+    float u = sqrtf(sqrtf(v));
+    mMax[threadIdx.x] = fabsf(w);
+    vMax[threadIdx.x] = u;
+    __syncthreads();
+    for(int half = ADAM_BLOCK / 2; half > 0; half /= 2) {
+      if(threadIdx.x < half) {
+        mMax[threadIdx.x] = fmaxf(mMax[threadIdx.x], mMax[threadIdx.x + half]);
+        vMax[threadIdx.x] = fmaxf(vMax[threadIdx.x], vMax[threadIdx.x + half]);
+      }
+      __syncthreads();
+    }
+    float sm = mMax[0];
+    float sv = vMax[0];
+    if(index < length) {
+      toCode(mt + index, sm > 0 ? w / sm : 0.f);
+      toCode(vt + index, sv > 0 ? u / sv : 0.f);
+    }
+    // all threads have read the old scales and the maxima
+    __syncthreads();
+    if(threadIdx.x == 0) {
+      mScale[b] = sm;
+      vScale[b] = sv;
+    }
+  }
+}
+
+void AdamUpdateQuantized(Tensor params, Tensor grads, void* mt, void* vt,
+                         float* mScale, float* vScale, int bits,
+                         float eta, float beta1, float beta2, float eps,
+                         float denom1, float denom2, Tensor scale,
+                         Tensor avg, float decay) {
+  UTIL_THROW_IF2(isCPU(params->getDevice()),
+                 "Optimizer states in " << bits << " bits require a GPU");
+  cudaSetDevice(params->getDevice());
+
+  int length = params->size();
+  if(length == 0)
+    return;
+  int blocks = std::min(MAX_BLOCKS, length / ADAM_BLOCK + (length % ADAM_BLOCK != 0));
+
+  if(bits == 8)
+    gAdamUpdateQuantized<<<blocks, ADAM_BLOCK, 0, currentStream()>>>(
+      params->data(), grads->data(), (int8_t*)mt, (uint8_t*)vt, mScale, vScale,
+      length, eta, beta1, beta2, eps, denom1, denom2,
+      scale ? scale->data() : nullptr, avg ? avg->data() : nullptr, decay);
+  else
+    gAdamUpdateQuantized<<<blocks, ADAM_BLOCK, 0, currentStream()>>>(
+      params->data(), grads->data(), (__half*)mt, (__half*)vt, mScale, vScale,
+      length, eta, beta1, beta2, eps, denom1, denom2,
+      scale ? scale->data() : nullptr, avg ? avg->data() : nullptr, decay);
+}
+
+__global__ void gAdagradUpdate(float* params, const float* grads,
+                               float* gt, int length,
+                               float eta, float eps, const float* scale,
+                               float* avg, float decay) {
+  float s = scale ? scale[0] : 1.f;
+  for(int bid = 0; bid < length; bid += blockDim.x * gridDim.x) {
+    int index = bid + blockDim.x * blockIdx.x + threadIdx.x;
+    if(index < length) {
+      float g = s * grads[index];
+      float h = gt[index] + g * g;
+      gt[index] = h;
+      float p = params[index] - (eta / (sqrtf(h) + eps)) * g;
+      params[index] = p;
+      if(avg)
+        avg[index] = decay * avg[index] + (1 - decay) * p;
+    }
+  }
+}
+
+void AdagradUpdate(Tensor params, Tensor grads, Tensor gt,
+                   float eta, float eps, Tensor scale,
+                   Tensor avg, float decay) {
+  if(isCPU(params->getDevice())) {
+    float s = scale ? scale->data()[0] : 1.f;
+    cpu::Element(_1 += (s * _2) * (s * _2), gt, grads);
+    cpu::Element(_1 -= (eta / (Sqrt(_2) + eps)) * (s * _3),
+                 params, gt, grads);
+    if(avg)
+      cpu::Element(_1 = decay * _1 + (1 - decay) * _2, avg, params);
+    return;
+  }
+
+  cudaSetDevice(params->getDevice());
+
+  int length = params->size();
+  int threads = std::min(MAX_THREADS, length);
+  int blocks = std::min(MAX_BLOCKS, length / threads + (length % threads != 0));
+
+  gAdagradUpdate<<<blocks, threads, 0, currentStream()>>>(params->data(), grads->data(),
+                                      gt->data(), length, eta, eps,
+                                      scale ? scale->data() : nullptr,
+                                      avg ? avg->data() : nullptr, decay);
+}
+
+/** @brief Per-input pointers and shapes of a fused elementwise kernel, passed by value */
+struct ElementArgs {
+  const float* vals[ElementProgram::MAX_INPUTS];
+  float* grads[ElementProgram::MAX_INPUTS];
+  Shape shapes[ElementProgram::MAX_INPUTS];
+  bool same[ElementProgram::MAX_INPUTS];
+};
+
+static ElementArgs elementArgs(const ElementProgram& program, Shape full,
+                               const std::vector<Tensor>& inputs,
+                               const std::vector<Tensor>& grads) {
+  UTIL_THROW_IF2((int)inputs.size() != program.inputs
+                 || program.inputs > ElementProgram::MAX_INPUTS,
+                 "Wrong number of inputs for fused elementwise program");
+  ElementArgs args;
+  for(int k = 0; k < program.inputs; ++k) {
+    args.vals[k] = inputs[k]->data();
+    args.grads[k] = grads.empty() || !grads[k] ? nullptr : grads[k]->data();
+    args.shapes[k] = inputs[k]->shape();
+    args.same[k] = inputs[k]->shape() == full;
+  }
+  return args;
+}
+
+__global__ void gFusedForward(ElementProgram program, ElementArgs args,
+                              float* out, Shape outShape) {
+  int length = outShape.elements();
+  float r[ElementProgram::MAX_REGISTERS];
+  int dims[4];
+  for(int bid = 0; bid < length; bid += blockDim.x * gridDim.x) {
+    int index = bid + blockDim.x * blockIdx.x + threadIdx.x;
+    if(index < length) {
+      outShape.dims(index, dims);
+      for(int k = 0; k < program.inputs; ++k)
+        r[k] = args.vals[k][args.same[k] ? index : args.shapes[k].bindex(dims)];
+      program.forward(r);
+      out[index] = r[program.inputs + program.ops - 1];
+    }
+  }
+}
+
+void FusedForward(const ElementProgram& program, Tensor out,
+                  const std::vector<Tensor>& inputs) {
+  if(isCPU(out->getDevice())) {
+    cpu::FusedForward(program, out, inputs);
+    return;
+  }
+
+  cudaSetDevice(out->getDevice());
+
+  int length = out->shape().elements();
+  int threads = std::min(MAX_THREADS, length);
+  int blocks = std::min(MAX_BLOCKS, length / threads + (length % threads != 0));
+
+  gFusedForward<<<blocks, threads, 0, currentStream()>>>(program,
+                                     elementArgs(program, out->shape(), inputs, {}),
+                                     out->data(), out->shape());
+}
+
+__global__ void gFusedBackward(ElementProgram program, ElementArgs args,
+                               const float* adj, Shape adjShape) {
+  int length = adjShape.elements();
+  float r[ElementProgram::MAX_REGISTERS];
+  float g[ElementProgram::MAX_REGISTERS];
+  int dims[4];
+  for(int bid = 0; bid < length; bid += blockDim.x * gridDim.x) {
+    int index = bid + blockDim.x * blockIdx.x + threadIdx.x;
+    if(index < length) {
+      adjShape.dims(index, dims);
+      for(int k = 0; k < program.inputs; ++k)
+        r[k] = args.vals[k][args.same[k] ? index : args.shapes[k].bindex(dims)];
+      program.forward(r);
+      program.backward(r, g, adj[index]);
+      for(int k = 0; k < program.inputs; ++k) {
+        if(!args.grads[k])
+          continue;
+        if(args.same[k])
+          args.grads[k][index] += g[k];
+        else
+          atomicAdd(args.grads[k] + args.shapes[k].bindex(dims), g[k]);
+      }
+    }
+  }
+}
+
+void FusedBackward(const ElementProgram& program, Tensor adj,
+                   const std::vector<Tensor>& inputs,
+                   const std::vector<Tensor>& grads) {
+  if(isCPU(adj->getDevice())) {
+    cpu::FusedBackward(program, adj, inputs, grads);
+    return;
+  }
+
+  cudaSetDevice(adj->getDevice());
+
+  int length = adj->shape().elements();
+  int threads = std::min(MAX_THREADS, length);
+  int blocks = std::min(MAX_BLOCKS, length / threads + (length % threads != 0));
+
+  gFusedBackward<<<blocks, threads, 0, currentStream()>>>(program,
+                                      elementArgs(program, adj->shape(), inputs, grads),
+                                      adj->data(), adj->shape());
+}
+
+// block size of gAtt unrolled for a fixed depth, see unrolledCols()
+const int ATT_UNROLLED_THREADS = 128;
+
+template <int COLS>
 __global__ void gAtt(float* out,
                      const float* va,
                      const float* ctx,
@@ -1108,31 +2739,34 @@ __global__ void gAtt(float* out,
                      int t // time of ctx
                      ) {
   int rows = m;
-  int cols = k;
+  const int cols = COLS ? COLS : k;
+  const int threads = COLS ? ATT_UNROLLED_THREADS : blockDim.x;
   for(int bid = 0; bid < m; bid += gridDim.x) {
     int j = bid + blockIdx.x;
     if(j < rows) {
       const float* vaRow = va;
       const float* ctxRow = ctx + (j % (b * t)) * cols;
-      const float* stateRow = state + (j / (b * t) + j % b) * cols;
+      const float* stateRow = state + ((j / (b * t)) * b + j % b) * cols;
       const float* covRow = cov ? cov + (j % (b * t)) * cols : nullptr;
 
       extern __shared__ float _share[];
       float* _sum = _share + blockDim.x;
 
-      _sum[threadIdx.x] = 0.0;
-      for(int tid = 0; tid < cols; tid += blockDim.x) {
+      // the thread's share of the row is summed in a register
+      float sum = 0;
+#pragma unroll
+      for(int tid = 0; tid < cols; tid += threads) {
         int id = tid + threadIdx.x;
         if(id < cols) {
           float z = ctxRow[id] + stateRow[id];
           if(cov)
             z += covRow[id];
-          float ex = tanhf(z) * vaRow[id];
-          _sum[threadIdx.x] += ex;
+          sum += tanhf(z) * vaRow[id];
         }
       }
+      _sum[threadIdx.x] = sum;
       __syncthreads();
-      int len = blockDim.x;
+      int len = threads;
       while(len != 1) {
         __syncthreads();
         int skip = (len + 1) >> 1;
@@ -1151,6 +2785,11 @@ void Att(Tensor out,
          Tensor context,
          Tensor state,
          Tensor coverage) {
+  if(isCPU(out->getDevice())) {
+    cpu::Att(out, va, context, state, coverage);
+    return;
+  }
+
   cudaSetDevice(out->getDevice());
 
   size_t m = out->shape()[0] * out->shape()[2] * out->shape()[3];
@@ -1160,15 +2799,367 @@ void Att(Tensor out,
   size_t t = context->shape()[2];
 
   int blocks = std::min(MAX_BLOCKS, (int) m);
-  int threads = std::min(MAX_THREADS, (int) k);
-  int shared = sizeof(float) * threads * 2;
 
-  gAtt<<<blocks, threads, shared>>>(out->data(),
-                                    va->data(),
-                                    context->data(),
-                                    state->data(),
-                                    coverage ? coverage->data() : nullptr,
-                                    m, k, b, t);
+  if(unrolledCols(k)) {
+    int threads = ATT_UNROLLED_THREADS;
+    int shared = sizeof(float) * threads * 2;
+    auto kernel = UNROLLED_KERNEL(gAtt, k);
+    kernel<<<blocks, threads, shared, currentStream()>>>(out->data(),
+                                        va->data(),
+                                        context->data(),
+                                        state->data(),
+                                        coverage ? coverage->data() : nullptr,
+                                        m, k, b, t);
+    return;
+  }
+
+  auto launch = [&](int threads) {
+    int shared = sizeof(float) * threads * 2;
+    gAtt<0><<<blocks, threads, shared, currentStream()>>>(out->data(),
+                                      va->data(),
+                                      context->data(),
+                                      state->data(),
+                                      coverage ? coverage->data() : nullptr,
+                                      m, k, b, t);
+  };
+  launch(tunedThreads("att", m, k, launch));
+}
+
+#if CUDA_VERSION >= 9000
+#define SHFL_DOWN(v, offset) __shfl_down_sync(0xffffffff, v, offset)
+#define SHFL(v, lane) __shfl_sync(0xffffffff, v, lane)
+#else
+#define SHFL_DOWN(v, offset) __shfl_down(v, offset)
+#define SHFL(v, lane) __shfl(v, lane)
+#endif
+
+const int ATT_WORDS = 32;
+const int ATT_DEPTH = 64;
+const int ATT_THREADS = 256;
+const int ATT_PAIRS = ATT_WORDS * ATT_BEAMS / ATT_THREADS;
+
+__device__ inline float loadFloat(float x) {
+  return x;
+}
+
+#if CUDA_VERSION >= 9000
+__device__ inline float loadFloat(__half x) {
+  return __half2float(x);
+}
+#endif
+
+// Energies of a tile of ATT_WORDS words for all beams of sentence blockIdx.y.
+// Each thread owns up to ATT_PAIRS (word, beam) pairs and accumulates them
+// over tiles of the depth, every context value is loaded once per block.
+// Rows of ctx are ldCtx elements apart, float or fp16.
+template <typename T>
+__global__ void gAttEnergies(float* energies,
+                             const float* va,
+                             const T* ctx,
+                             const float* state,
+                             int batch, int stateBatch,
+                             int depth, int ldCtx, int words, int beams) {
+  __shared__ float sCtx[ATT_WORDS][ATT_DEPTH + 1];
+  __shared__ float sState[ATT_DEPTH][ATT_BEAMS];
+  __shared__ float sVa[ATT_DEPTH];
+
+  int b = blockIdx.y;
+  int sb = stateBatch == 1 ? 0 : b;
+  int w0 = blockIdx.x * ATT_WORDS;
+  int pairs = ATT_WORDS * beams;
+
+  float acc[ATT_PAIRS];
+#pragma unroll
+  for(int i = 0; i < ATT_PAIRS; ++i)
+    acc[i] = 0;
+
+  for(int d0 = 0; d0 < depth; d0 += ATT_DEPTH) {
+    for(int i = threadIdx.x; i < ATT_WORDS * ATT_DEPTH; i += blockDim.x) {
+      int w = i / ATT_DEPTH;
+      int d = i % ATT_DEPTH;
+      sCtx[w][d] = (w0 + w < words && d0 + d < depth)
+        ? loadFloat(ctx[((size_t)(w0 + w) * batch + b) * ldCtx + d0 + d]) : 0.f;
+    }
+    for(int i = threadIdx.x; i < ATT_DEPTH * beams; i += blockDim.x) {
+      int k = i / ATT_DEPTH;
+      int d = i % ATT_DEPTH;
+      sState[d][k] = d0 + d < depth
+        ? state[((size_t)k * stateBatch + sb) * depth + d0 + d] : 0.f;
+    }
+    for(int d = threadIdx.x; d < ATT_DEPTH; d += blockDim.x)
+      sVa[d] = d0 + d < depth ? va[d0 + d] : 0.f;
+    __syncthreads();
+
+#pragma unroll
+    for(int i = 0; i < ATT_PAIRS; ++i) {
+      int p = threadIdx.x + i * blockDim.x;
+      if(p < pairs) {
+        int w = p / beams;
+        int k = p % beams;
+        float sum = 0;
+        for(int d = 0; d < ATT_DEPTH; ++d)
+          sum += sVa[d] * tanhf(sCtx[w][d] + sState[d][k]);
+        acc[i] += sum;
+      }
+    }
+    __syncthreads();
+  }
+
+#pragma unroll
+  for(int i = 0; i < ATT_PAIRS; ++i) {
+    int p = threadIdx.x + i * blockDim.x;
+    if(p < pairs) {
+      int w = w0 + p / beams;
+      int k = p % beams;
+      if(w < words)
+        energies[((size_t)b * beams + k) * words + w] = acc[i];
+    }
+  }
+}
+
+// Masked softmax over the words of every beam of sentence blockIdx.x, then
+// the context of all beams from a single pass over the sentence's context.
+template <typename T>
+__global__ void gAttContext(float* out,
+                            const float* energies,
+                            const T* ctx,
+                            const float* mask,
+                            int batch, int dimContext, int ldCtx,
+                            int words, int beams) {
+  extern __shared__ float sAlign[];
+
+  int b = blockIdx.x;
+  int lane = threadIdx.x % 32;
+  int warp = threadIdx.x / 32;
+  int warps = blockDim.x / 32;
+
+  for(int k = warp; k < beams; k += warps) {
+    const float* e = energies + ((size_t)b * beams + k) * words;
+
+    float max = -INFINITY;
+    for(int w = lane; w < words; w += 32)
+      max = fmaxf(max, e[w]);
+    for(int offset = 16; offset > 0; offset /= 2)
+      max = fmaxf(max, SHFL_DOWN(max, offset));
+    max = SHFL(max, 0);
+
+    float sum = 0;
+    for(int w = lane; w < words; w += 32) {
+      float ex = 0;
+      if(!mask || mask[(size_t)w * batch + b])
+        ex = __expf(e[w] - max);
+      sAlign[w * beams + k] = ex;
+      sum += ex;
+    }
+    for(int offset = 16; offset > 0; offset /= 2)
+      sum += SHFL_DOWN(sum, offset);
+    sum = SHFL(sum, 0);
+
+    for(int w = lane; w < words; w += 32)
+      sAlign[w * beams + k] /= sum;
+  }
+  __syncthreads();
+
+  for(int d = threadIdx.x; d < dimContext; d += blockDim.x) {
+    float acc[ATT_BEAMS];
+#pragma unroll
+    for(int k = 0; k < ATT_BEAMS; ++k)
+      acc[k] = 0;
+
+    for(int w = 0; w < words; ++w) {
+      float c = loadFloat(ctx[((size_t)w * batch + b) * ldCtx + d]);
+#pragma unroll
+      for(int k = 0; k < ATT_BEAMS; ++k)
+        if(k < beams)
+          acc[k] += sAlign[w * beams + k] * c;
+    }
+
+#pragma unroll
+    for(int k = 0; k < ATT_BEAMS; ++k)
+      if(k < beams)
+        out[((size_t)k * batch + b) * dimContext + d] = acc[k];
+  }
+}
+
+void AttFused(Tensor out, Tensor va, Tensor mappedContext, Tensor mappedState,
+              Tensor context, Tensor mask, bool half) {
+  UTIL_THROW_IF2(isCPU(out->getDevice()), "AttFused is not implemented on CPU");
+#if CUDA_VERSION < 9000
+  UTIL_THROW_IF2(half, "fp16 attention contexts require CUDA 9 or newer");
+#endif
+
+  int batch = mappedContext->shape()[0];
+  int depth = mappedState->shape()[1];
+  int words = mappedContext->shape()[2];
+  int beams = mappedState->shape()[3];
+  int dimContext = out->shape()[1];
+  // packed rows hold two fp16 values per float
+  int ldMapped = half ? 2 * mappedContext->shape()[1] : depth;
+  int ldContext = half ? 2 * context->shape()[1] : dimContext;
+
+  UTIL_THROW_IF2(beams > ATT_BEAMS || words * beams > ATT_MAX_ALIGNMENTS,
+                 "AttFused supports at most " << ATT_BEAMS << " beams and "
+                 << ATT_MAX_ALIGNMENTS << " alignments per sentence");
+
+  cudaSetDevice(out->getDevice());
+
+  float* energies = deviceScratch<float>(out->getDevice(), 8,
+                                         (size_t)batch * beams * words);
+
+  dim3 tiles((words + ATT_WORDS - 1) / ATT_WORDS, batch);
+  int threads = std::min(MAX_THREADS, std::max(32 * beams, dimContext));
+  threads = (threads + 31) / 32 * 32;
+  int shared = words * beams * sizeof(float);
+
+  if(!half) {
+    gAttEnergies<<<tiles, ATT_THREADS, 0, currentStream()>>>(
+      energies, va->data(), mappedContext->data(), mappedState->data(),
+      batch, mappedState->shape()[0], depth, ldMapped, words, beams);
+    gAttContext<<<batch, threads, shared, currentStream()>>>(
+      out->data(), energies, context->data(), mask ? mask->data() : nullptr,
+      batch, dimContext, ldContext, words, beams);
+  }
+#if CUDA_VERSION >= 9000
+  else {
+    gAttEnergies<<<tiles, ATT_THREADS, 0, currentStream()>>>(
+      energies, va->data(), (const __half*)mappedContext->data(), mappedState->data(),
+      batch, mappedState->shape()[0], depth, ldMapped, words, beams);
+    gAttContext<<<batch, threads, shared, currentStream()>>>(
+      out->data(), energies, (const __half*)context->data(), mask ? mask->data() : nullptr,
+      batch, dimContext, ldContext, words, beams);
+  }
+#endif
+}
+
+// One block per sentence: its length from the mask, then the rows of its
+// window, copied or with add accumulated back into the input rows
+template <bool add>
+__global__ void gLocalWindow(float* out, float* in, const float* mask,
+                             int batch, int cols, int words, int window, int center) {
+  __shared__ int sLength;
+
+  for(int bid = 0; bid < batch; bid += gridDim.x) {
+    int b = bid + blockIdx.x;
+    if(b >= batch)
+      return;
+
+    if(threadIdx.x == 0)
+      sLength = mask ? 0 : words;
+    __syncthreads();
+    if(mask) {
+      int length = 0;
+      for(int w = threadIdx.x; w < words; w += blockDim.x)
+        length += mask[(size_t)w * batch + b] != 0;
+      atomicAdd(&sLength, length);
+    }
+    __syncthreads();
+    int first = max(0, min(center - window / 2, sLength - window));
+
+    for(int i = threadIdx.x; i < window * cols; i += blockDim.x) {
+      int k = i / cols;
+      int c = i % cols;
+      int w = first + k;
+      float* windowed = out + ((size_t)k * batch + b) * cols + c;
+      if(add) {
+        if(w < words)
+          in[((size_t)w * batch + b) * cols + c] += *windowed;
+      }
+      else {
+        *windowed = w < words ? in[((size_t)w * batch + b) * cols + c] : 0.f;
+      }
+    }
+    __syncthreads();
+  }
+}
+
+void LocalWindow(Tensor out, const Tensor in, const Tensor mask, int center) {
+  if(isCPU(out->getDevice())) {
+    cpu::LocalWindow(out, in, mask, center);
+    return;
+  }
+
+  cudaSetDevice(out->getDevice());
+
+  int batch = in->shape()[0];
+  int cols = in->shape()[1];
+  int window = out->shape()[2];
+
+  int blocks = std::min(MAX_BLOCKS, batch);
+  int threads = std::min(MAX_THREADS, std::max(32, window * cols));
+  gLocalWindow<false><<<blocks, threads, 0, currentStream()>>>(
+    out->data(), in->data(), mask ? mask->data() : nullptr,
+    batch, cols, in->shape()[2], window, center);
+}
+
+void LocalWindowGrad(Tensor grad, const Tensor adj, const Tensor mask, int center) {
+  UTIL_THROW_IF2(isCPU(grad->getDevice()), "LocalWindowGrad is not implemented on CPU");
+
+  cudaSetDevice(grad->getDevice());
+
+  int batch = grad->shape()[0];
+  int cols = grad->shape()[1];
+  int window = adj->shape()[2];
+
+  int blocks = std::min(MAX_BLOCKS, batch);
+  int threads = std::min(MAX_THREADS, std::max(32, window * cols));
+  gLocalWindow<true><<<blocks, threads, 0, currentStream()>>>(
+    adj->data(), grad->data(), mask ? mask->data() : nullptr,
+    batch, cols, grad->shape()[2], window, center);
+}
+
+#if CUDA_VERSION >= 9000
+__global__ void gPackHalf(__half* out, const float* in, int rows, int cols, int ldOut) {
+  for(int bid = 0; bid < rows * ldOut; bid += blockDim.x * gridDim.x) {
+    int index = bid + blockDim.x * blockIdx.x + threadIdx.x;
+    if(index < rows * ldOut) {
+      int i = index / ldOut;
+      int j = index % ldOut;
+      out[index] = __float2half(j < cols ? in[(size_t)i * cols + j] : 0.f);
+    }
+  }
+}
+
+__global__ void gUnpackHalf(float* out, const __half* in, int rows, int cols, int ldIn) {
+  for(int bid = 0; bid < rows * cols; bid += blockDim.x * gridDim.x) {
+    int index = bid + blockDim.x * blockIdx.x + threadIdx.x;
+    if(index < rows * cols)
+      out[index] = __half2float(in[(size_t)(index / cols) * ldIn + index % cols]);
+  }
+}
+#endif
+
+void PackHalf(Tensor out, const Tensor in) {
+#if CUDA_VERSION >= 9000
+  UTIL_THROW_IF2(isCPU(out->getDevice()), "PackHalf is not implemented on CPU");
+  cudaSetDevice(out->getDevice());
+  int cols = in->shape()[1];
+  int rows = in->size() / cols;
+  int ldOut = 2 * out->shape()[1];
+  int length = rows * ldOut;
+  int threads = std::min(MAX_THREADS, length);
+  int blocks = std::min(MAX_BLOCKS, length / threads + (length % threads != 0));
+  gPackHalf<<<blocks, threads, 0, currentStream()>>>((__half*)out->data(), in->data(),
+                                                     rows, cols, ldOut);
+#else
+  UTIL_THROW2("fp16 conversion requires CUDA 9 or newer");
+#endif
+}
+
+void UnpackHalf(Tensor out, const Tensor in) {
+#if CUDA_VERSION >= 9000
+  UTIL_THROW_IF2(isCPU(out->getDevice()), "UnpackHalf is not implemented on CPU");
+  cudaSetDevice(out->getDevice());
+  int cols = out->shape()[1];
+  int rows = out->size() / cols;
+  int ldIn = 2 * in->shape()[1];
+  int length = rows * cols;
+  int threads = std::min(MAX_THREADS, length);
+  int blocks = std::min(MAX_BLOCKS, length / threads + (length % threads != 0));
+  gUnpackHalf<<<blocks, threads, 0, currentStream()>>>(out->data(), (const __half*)in->data(),
+                                                       rows, cols, ldIn);
+#else
+  UTIL_THROW2("fp16 conversion requires CUDA 9 or newer");
+#endif
 }
 
 __global__ void gAttBack(float* gVa,
@@ -1222,6 +3213,8 @@ __global__ void gAttBack(float* gVa,
 void AttBack(Tensor gVa, Tensor gContext, Tensor gState, Tensor gCoverage,
              Tensor va, Tensor context, Tensor state, Tensor coverage,
              Tensor adj) {
+  UTIL_THROW_IF2(isCPU(adj->getDevice()), "AttBack is not implemented on CPU");
+
   cudaSetDevice(adj->getDevice());
 
   size_t m = context->shape()[0] * context->shape()[2] * context->shape()[3];
@@ -1232,7 +3225,7 @@ void AttBack(Tensor gVa, Tensor gContext, Tensor gState, Tensor gCoverage,
   int blocks = std::min(MAX_BLOCKS, (int) n);
   int threads = std::min(MAX_THREADS, (int) k);
 
-  gAttBack<<<blocks, threads>>>(gVa->data(),
+  gAttBack<<<blocks, threads, 0, currentStream()>>>(gVa->data(),
                                 gContext->data(),
                                 gState->data(),
                                 gCoverage ? gCoverage->data() : nullptr,
@@ -1246,6 +3239,213 @@ void AttBack(Tensor gVa, Tensor gContext, Tensor gState, Tensor gCoverage,
                                 m, k, n);
 }
 
+// rows of up to this many columns are normalized by a single warp
+const int LN_WARP_COLS = 1024;
+// warps per block of the warp-level layer normalization kernels
+const int LN_WARPS = 4;
+
+/** Mean and variance of a row, one pass of Welford updates per lane merged across the warp */
+__device__ inline void gWarpWelford(const float* row, int cols, float& mean, float& var) {
+  int lane = threadIdx.x & 31;
+
+  float n = 0, m = 0, m2 = 0;
+  for(int i = lane; i < cols; i += 32) {
+    float v = row[i];
+    n += 1;
+    float d = v - m;
+    m += d / n;
+    m2 += d * (v - m);
+  }
+
+  for(int offset = 16; offset > 0; offset >>= 1) {
+    float on = SHFL_DOWN(n, offset);
+    float om = SHFL_DOWN(m, offset);
+    float om2 = SHFL_DOWN(m2, offset);
+    float total = n + on;
+    if(on > 0) {
+      float d = om - m;
+      float w = on / total;
+      m += d * w;
+      m2 += om2 + d * d * n * w;
+      n = total;
+    }
+  }
+
+  mean = SHFL(m, 0);
+  var = SHFL(m2, 0) / cols;
+}
+
+/** Sum across a warp, broadcast to all lanes */
+__device__ inline float gWarpSum(float v) {
+  for(int offset = 16; offset > 0; offset >>= 1)
+    v += SHFL_DOWN(v, offset);
+  return SHFL(v, 0);
+}
+
+/**
+ * One warp per row. Unrolled for  COLS , see unrolledCols(), every lane keeps
+ * its COLS / 32 values of the row in registers and reads the row only once.
+ */
+template <int COLS>
+__global__ void gLNormalizationWarp(float* out, const float* in, const float* gamma, const float* beta,
+                                    int rows, int cols, float eps) {
+  int warps = gridDim.x * blockDim.x / 32;
+  int lane = threadIdx.x & 31;
+
+  for(int j = (blockIdx.x * blockDim.x + threadIdx.x) / 32; j < rows; j += warps) {
+    const float* sp = in + j * COLS;
+    float* so = out + j * COLS;
+
+    const int n = COLS / 32;
+    float v[n];
+    float sum = 0;
+#pragma unroll
+    for(int i = 0; i < n; ++i) {
+      v[i] = sp[lane + 32 * i];
+      sum += v[i];
+    }
+    float mean = gWarpSum(sum) / COLS;
+
+    float sqSum = 0;
+#pragma unroll
+    for(int i = 0; i < n; ++i) {
+      v[i] -= mean;
+      sqSum += v[i] * v[i];
+    }
+    float rstd = rsqrtf(gWarpSum(sqSum) / COLS + eps);
+
+#pragma unroll
+    for(int i = 0; i < n; ++i) {
+      int id = lane + 32 * i;
+      float t = gamma[id] * (v[i] * rstd);
+      if(beta)
+        t += beta[id];
+      so[id] = t;
+    }
+  }
+}
+
+/** The generic kernel, for rows of any size up to LN_WARP_COLS */
+template <>
+__global__ void gLNormalizationWarp<0>(float* out, const float* in, const float* gamma, const float* beta,
+                                       int rows, int cols, float eps) {
+  int warps = gridDim.x * blockDim.x / 32;
+  int lane = threadIdx.x & 31;
+
+  for(int j = (blockIdx.x * blockDim.x + threadIdx.x) / 32; j < rows; j += warps) {
+    const float* sp = in + j * cols;
+    float* so = out + j * cols;
+
+    float mean, var;
+    gWarpWelford(sp, cols, mean, var);
+    float rstd = rsqrtf(var + eps);
+
+    for(int i = lane; i < cols; i += 32) {
+      float t = gamma[i] * ((sp[i] - mean) * rstd);
+      if(beta)
+        t += beta[i];
+      so[i] = t;
+    }
+  }
+}
+
+/**
+ * Gradient of x per row, one warp per row. Mean and reciprocal deviation of
+ * every row are kept in stats for the gradients of gamma and beta.
+ */
+__global__ void gLayerNormalizationGradWarp(float* gradX, float* stats,
+                                            const float* adj, const float* x, const float* gamma,
+                                            int rows, int cols, float eps) {
+  int warps = gridDim.x * blockDim.x / 32;
+  int lane = threadIdx.x & 31;
+
+  for(int j = (blockIdx.x * blockDim.x + threadIdx.x) / 32; j < rows; j += warps) {
+    const float* xRow = x + j * cols;
+    const float* adjRow = adj + j * cols;
+
+    float mean, var;
+    gWarpWelford(xRow, cols, mean, var);
+    float rstd = rsqrtf(var + eps);
+
+    float sumG = 0, sumGX = 0;
+    for(int i = lane; i < cols; i += 32) {
+      float g = adjRow[i] * gamma[i];
+      sumG += g;
+      sumGX += g * (xRow[i] - mean) * rstd;
+    }
+    sumG = gWarpSum(sumG) / cols;
+    sumGX = gWarpSum(sumGX) / cols;
+
+    if(gradX) {
+      float* gradXRow = gradX + j * cols;
+      for(int i = lane; i < cols; i += 32) {
+        float xHat = (xRow[i] - mean) * rstd;
+        gradXRow[i] += rstd * (adjRow[i] * gamma[i] - sumG - xHat * sumGX);
+      }
+    }
+
+    if(lane == 0) {
+      stats[2 * j] = mean;
+      stats[2 * j + 1] = rstd;
+    }
+  }
+}
+
+/**
+ * First stage of the gamma and beta gradients, a tile of 32 columns times a
+ * share of the rows per block. Partial sums go to partial[blockIdx.y].
+ */
+__global__ void gLayerNormalizationParamGrad(float* partialGamma, float* partialBeta,
+                                             const float* adj, const float* x, const float* stats,
+                                             int rows, int cols) {
+  __shared__ float sGamma[8][33];
+  __shared__ float sBeta[8][33];
+
+  int col = blockIdx.x * 32 + threadIdx.x;
+
+  float dGamma = 0, dBeta = 0;
+  if(col < cols) {
+    for(int j = blockIdx.y * blockDim.y + threadIdx.y; j < rows; j += gridDim.y * blockDim.y) {
+      float a = adj[j * cols + col];
+      dGamma += a * (x[j * cols + col] - stats[2 * j]) * stats[2 * j + 1];
+      dBeta += a;
+    }
+  }
+  sGamma[threadIdx.y][threadIdx.x] = dGamma;
+  sBeta[threadIdx.y][threadIdx.x] = dBeta;
+  __syncthreads();
+
+  if(threadIdx.y == 0 && col < cols) {
+    for(int k = 1; k < blockDim.y; ++k) {
+      dGamma += sGamma[k][threadIdx.x];
+      dBeta += sBeta[k][threadIdx.x];
+    }
+    partialGamma[blockIdx.y * cols + col] = dGamma;
+    if(partialBeta)
+      partialBeta[blockIdx.y * cols + col] = dBeta;
+  }
+}
+
+/** Second stage, adds the partial sums of all row shares to the gradients */
+__global__ void gLayerNormalizationParamGradSum(float* gradGamma, float* gradBeta,
+                                                const float* partialGamma, const float* partialBeta,
+                                                int parts, int cols) {
+  for(int bid = 0; bid < cols; bid += blockDim.x * gridDim.x) {
+    int col = bid + blockDim.x * blockIdx.x + threadIdx.x;
+    if(col < cols) {
+      float dGamma = 0, dBeta = 0;
+      for(int k = 0; k < parts; ++k) {
+        dGamma += partialGamma[k * cols + col];
+        if(partialBeta)
+          dBeta += partialBeta[k * cols + col];
+      }
+      gradGamma[col] += dGamma;
+      if(gradBeta)
+        gradBeta[col] += dBeta;
+    }
+  }
+}
+
 __global__ void gLNormalization(float* out, const float* in, const float* alpha, const float* beta,
                                 int rows, int cols, float eps=1e-9) {
   extern __shared__ float _share[];
@@ -1315,20 +3515,39 @@ __global__ void gLNormalization(float* out, const float* in, const float* alpha,
 }
 
 void LayerNormalization(Tensor out, Tensor in, Tensor gamma, Tensor beta, float eps) {
+  if(isCPU(out->getDevice())) {
+    cpu::LayerNormalization(out, in, gamma, beta, eps);
+    return;
+  }
+
   cudaSetDevice(out->getDevice());
 
   int rows = in->shape()[0] * in->shape()[2] * in->shape()[3];
   int cols = in->shape()[1];
 
+  if(cols <= LN_WARP_COLS) {
+    int threads = 32 * LN_WARPS;
+    int blocks = std::min(MAX_BLOCKS, rows / LN_WARPS + (rows % LN_WARPS != 0));
+    auto kernel = UNROLLED_KERNEL(gLNormalizationWarp, cols);
+    kernel<<<blocks, threads, 0, currentStream()>>>(out->data(),
+                                                  in->data(),
+                                                  gamma->data(),
+                                                  beta ? beta->data() : nullptr,
+                                                  rows, cols, eps);
+    return;
+  }
+
   int blocks = std::min(MAX_BLOCKS, (int)rows);
-  int threads = std::min(MAX_THREADS, (int)cols);
-  int shared = 2 * threads * sizeof(float);
 
-  gLNormalization<<<blocks, threads, shared>>>(out->data(),
-                                               in->data(),
-                                               gamma->data(),
-                                               beta ? beta->data() : nullptr,
-                                               rows, cols, eps);
+  auto launch = [&](int threads) {
+    int shared = 2 * threads * sizeof(float);
+    gLNormalization<<<blocks, threads, shared, currentStream()>>>(out->data(),
+                                                 in->data(),
+                                                 gamma->data(),
+                                                 beta ? beta->data() : nullptr,
+                                                 rows, cols, eps);
+  };
+  launch(tunedThreads("layer-norm", rows, cols, launch));
 }
 
 __global__ void gLayerNormalizationGrad(float* gradX, float* gradGamma, float* gradBeta,
@@ -1358,8 +3577,8 @@ __global__ void gLayerNormalizationGrad(float* gradX, float* gradGamma, float* g
         int id = tid + threadIdx.x;
         if (id < cols) {
           sum_x[threadIdx.x] += xRow[id];
-          sum_adj_x[threadIdx.x] += adjRow[id] * (yRow[id] - ((beta) ? beta[id] : 0)) / gamma[id];
-          sum_adj[threadIdx.x] += adjRow[id];
+          sum_adj_x[threadIdx.x] += adjRow[id] * (yRow[id] - ((beta) ? beta[id] : 0));
+          sum_adj[threadIdx.x] += adjRow[id] * gamma[id];
         }
       }
       __syncthreads();
@@ -1405,12 +3624,12 @@ __global__ void gLayerNormalizationGrad(float* gradX, float* gradGamma, float* g
         if (id < cols) {
           float grad_x = 0.0f;
           float x_hat = (yRow[id] - ((beta) ? beta[id] : 0) )  / gamma[id];
-          grad_x += cols * adjRow[id];
+          grad_x += cols * adjRow[id] * gamma[id];
           grad_x -= sum_adj[0];
           grad_x -= sum_adj_x[0] * x_hat;
           grad_x /= (cols * sigma);
 
-          gradXRow[id] += gamma[id] * grad_x;
+          gradXRow[id] += grad_x;
           atomicAdd(gradGamma + id, adjRow[id] * x_hat);
           if (beta) {
             atomicAdd(gradBeta + id, adjRow[id]);
@@ -1423,17 +3642,244 @@ __global__ void gLayerNormalizationGrad(float* gradX, float* gradGamma, float* g
 
 void LayerNormalizationGrad(Tensor gradX, Tensor gradGamma, Tensor gradBeta,
                             Tensor adj, Tensor y, Tensor x, Tensor gamma, Tensor beta) {
+  UTIL_THROW_IF2(isCPU(adj->getDevice()), "LayerNormalizationGrad is not implemented on CPU");
+
   cudaSetDevice(adj->getDevice());
   int rows = y->shape()[0] * y->shape()[2] * y->shape()[3];
   int cols = y->shape()[1];
 
+  if(cols <= LN_WARP_COLS) {
+    size_t device = adj->getDevice();
+    const float eps = 1e-9;
+
+    float* stats = deviceScratch<float>(device, 5, 2 * rows);
+
+    int threads = 32 * LN_WARPS;
+    int blocks = std::min(MAX_BLOCKS, rows / LN_WARPS + (rows % LN_WARPS != 0));
+    gLayerNormalizationGradWarp<<<blocks, threads, 0, currentStream()>>>
+      (gradX ? gradX->data() : nullptr, stats,
+       adj->data(), x->data(), gamma->data(), rows, cols, eps);
+
+    int tiles = cols / 32 + (cols % 32 != 0);
+    int parts = std::min(64, rows / 8 + (rows % 8 != 0));
+    float* partialGamma = deviceScratch<float>(device, 6, parts * cols);
+    float* partialBeta = gradBeta ? deviceScratch<float>(device, 7, parts * cols) : nullptr;
+
+    gLayerNormalizationParamGrad<<<dim3(tiles, parts), dim3(32, 8), 0, currentStream()>>>
+      (partialGamma, partialBeta, adj->data(), x->data(), stats, rows, cols);
+
+    int sumThreads = std::min(MAX_THREADS, cols);
+    int sumBlocks = std::min(MAX_BLOCKS, cols / sumThreads + (cols % sumThreads != 0));
+    gLayerNormalizationParamGradSum<<<sumBlocks, sumThreads, 0, currentStream()>>>
+      (gradGamma->data(), gradBeta ? gradBeta->data() : nullptr,
+       partialGamma, partialBeta, parts, cols);
+    return;
+  }
+
   int threads = std::min(MAX_THREADS, cols);
   int blocks = std::min(MAX_BLOCKS, rows);
   int shared = sizeof(float) * threads * 4;
 
-  gLayerNormalizationGrad<<<blocks, threads, shared>>>
+  gLayerNormalizationGrad<<<blocks, threads, shared, currentStream()>>>
     (gradX->data(), gradGamma->data(), (gradBeta) ? gradBeta->data() : nullptr,
      adj->data(), y->data(), x->data(), gamma->data(),(beta) ?  beta->data() : nullptr, rows, cols);
 }
 
+/**
+ * Sizes of  full  in memory order, dims 3, 2, 0, 1, split into the dims
+ * before, within and after the reduced ones, those where  part  is 1. False
+ * if they are not contiguous in memory or nothing is reduced.
+ */
+struct ReduceLayout {
+  int outer{1};
+  int mid{1};
+  int inner{1};
+};
+
+bool reduceLayout(const Shape& full, const Shape& part, ReduceLayout& layout) {
+  const int order[4] = {3, 2, 0, 1};
+  // 0 before the reduced dims, 1 within, 2 after them
+  int stage = 0;
+  for(int k = 0; k < 4; ++k) {
+    int d = order[k];
+    if(full[d] == 1)
+      continue;
+    if(part[d] == 1) {
+      if(stage == 2)
+        return false;
+      stage = 1;
+      layout.mid *= full[d];
+    }
+    else if(part[d] != full[d]) {
+      return false;
+    }
+    else if(stage == 0) {
+      layout.outer *= full[d];
+    }
+    else {
+      stage = 2;
+      layout.inner *= full[d];
+    }
+  }
+  return layout.mid > 1;
+}
+
+__device__ inline float warpSum(float v) {
+  for(int offset = 16; offset > 0; offset >>= 1)
+    v += SHFL_DOWN(v, offset);
+  return v;
+}
+
+// sum over a block of a multiple of 32 threads, valid in thread 0
+__device__ inline float blockSum(float v, float* partial) {
+  int lane = threadIdx.x % 32;
+  int warp = threadIdx.x / 32;
+  v = warpSum(v);
+  // partial may still be read from the previous call
+  __syncthreads();
+  if(lane == 0)
+    partial[warp] = v;
+  __syncthreads();
+  if(warp == 0) {
+    v = threadIdx.x < blockDim.x / 32 ? partial[lane] : 0.f;
+    v = warpSum(v);
+  }
+  return v;
+}
+
+// a warp per row of  cols  contiguous values
+__global__ void gReduceRows(float* out, const float* in,
+                            int rows, int cols, float scale) {
+  int warps = blockDim.x / 32;
+  int lane = threadIdx.x % 32;
+  for(int row = blockIdx.x * warps + threadIdx.x / 32; row < rows;
+      row += gridDim.x * warps) {
+    const float* sp = in + (size_t)row * cols;
+    float sum = 0;
+    for(int i = lane; i < cols; i += 32)
+      sum += sp[i];
+    sum = warpSum(sum);
+    if(lane == 0)
+      out[row] = sum * scale;
+  }
+}
+
+// a block per row, for few long rows
+__global__ void gReduceRowsBlock(float* out, const float* in,
+                                 int rows, int cols, float scale) {
+  __shared__ float partial[32];
+  for(int row = blockIdx.x; row < rows; row += gridDim.x) {
+    const float* sp = in + (size_t)row * cols;
+    float sum = 0;
+    for(int i = threadIdx.x; i < cols; i += blockDim.x)
+      sum += sp[i];
+    sum = blockSum(sum, partial);
+    if(threadIdx.x == 0)
+      out[row] = sum * scale;
+  }
+}
+
+// out[o, i] = scale * sum over m of in[o, m, i]. threadIdx.x runs over 32
+// consecutive i, so reads are coalesced, threadIdx.y splits the m
+__global__ void gReduceMiddle(float* out, const float* in,
+                              int outer, int mid, int inner, float scale) {
+  __shared__ float partial[8][33];
+  for(int o = blockIdx.y; o < outer; o += gridDim.y) {
+    for(int tile = blockIdx.x; tile * 32 < inner; tile += gridDim.x) {
+      int i = tile * 32 + threadIdx.x;
+      float sum = 0;
+      if(i < inner)
+        for(int m = threadIdx.y; m < mid; m += blockDim.y)
+          sum += in[((size_t)o * mid + m) * inner + i];
+      partial[threadIdx.y][threadIdx.x] = sum;
+      __syncthreads();
+      if(threadIdx.y == 0 && i < inner) {
+        for(int y = 1; y < blockDim.y; ++y)
+          sum += partial[y][threadIdx.x];
+        out[(size_t)o * inner + i] = sum * scale;
+      }
+      __syncthreads();
+    }
+  }
+}
+
+// out[blockIdx.x] = scale * the sum of a grid-stride share of  in
+__global__ void gReduceAll(float* out, const float* in, size_t n, float scale) {
+  __shared__ float partial[32];
+  float sum = 0;
+  for(size_t i = blockIdx.x * blockDim.x + threadIdx.x; i < n;
+      i += (size_t)blockDim.x * gridDim.x)
+    sum += in[i];
+  sum = blockSum(sum, partial);
+  if(threadIdx.x == 0)
+    out[blockIdx.x] = sum * scale;
+}
+
+__global__ void gAddBroadcast(float* out, const float* in,
+                              int outer, int mid, int inner, float scale) {
+  size_t slice = (size_t)mid * inner;
+  size_t n = outer * slice;
+  for(size_t idx = blockIdx.x * blockDim.x + threadIdx.x; idx < n;
+      idx += (size_t)blockDim.x * gridDim.x)
+    out[idx] += scale * in[(idx / slice) * inner + idx % inner];
+}
+
+void ReduceSum(Tensor out, Tensor in, float scale) {
+  ReduceLayout layout;
+  if(isCPU(out->getDevice()) || !reduceLayout(in->shape(), out->shape(), layout)) {
+    Reduce(_1, out, in, scale);
+    return;
+  }
+
+  cudaSetDevice(out->getDevice());
+  const int threads = 256;
+
+  if(layout.outer == 1 && layout.inner == 1) {
+    size_t n = layout.mid;
+    int blocks = std::min((size_t)threads, n / threads + (n % threads != 0));
+    if(blocks == 1) {
+      gReduceAll<<<1, threads, 0, currentStream()>>>(out->data(), in->data(), n, scale);
+      return;
+    }
+    float* partials = deviceScratch<float>(out->getDevice(), 10, blocks);
+    gReduceAll<<<blocks, threads, 0, currentStream()>>>(partials, in->data(), n, 1.f);
+    gReduceAll<<<1, threads, 0, currentStream()>>>(out->data(), partials, blocks, scale);
+  }
+  else if(layout.inner == 1) {
+    int rows = layout.outer;
+    int cols = layout.mid;
+    if(rows >= 1024 || cols <= 1024) {
+      int warps = threads / 32;
+      int blocks = std::min(MAX_BLOCKS, rows / warps + (rows % warps != 0));
+      gReduceRows<<<blocks, threads, 0, currentStream()>>>(out->data(), in->data(),
+                                                          rows, cols, scale);
+    }
+    else {
+      gReduceRowsBlock<<<std::min(MAX_BLOCKS, rows), threads, 0, currentStream()>>>
+        (out->data(), in->data(), rows, cols, scale);
+    }
+  }
+  else {
+    int tiles = layout.inner / 32 + (layout.inner % 32 != 0);
+    dim3 blocks(std::min(MAX_BLOCKS, tiles), std::min(MAX_BLOCKS, layout.outer));
+    gReduceMiddle<<<blocks, dim3(32, 8), 0, currentStream()>>>
+      (out->data(), in->data(), layout.outer, layout.mid, layout.inner, scale);
+  }
+}
+
+void AddBroadcast(Tensor out, Tensor in, float scale) {
+  ReduceLayout layout;
+  if(isCPU(out->getDevice()) || !reduceLayout(out->shape(), in->shape(), layout)) {
+    Add(_1, out, in, scale);
+    return;
+  }
+
+  cudaSetDevice(out->getDevice());
+  size_t n = out->shape().elements();
+  int threads = std::min((size_t)MAX_THREADS, n);
+  int blocks = std::min((size_t)MAX_BLOCKS, n / threads + (n % threads != 0));
+  gAddBroadcast<<<blocks, threads, 0, currentStream()>>>
+    (out->data(), in->data(), layout.outer, layout.mid, layout.inner, scale);
+}
+
 }  // namespace marian
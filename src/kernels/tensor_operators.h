@@ -1,12 +1,18 @@
 #pragma once
 
+#include <future>
+#include <vector>
 #include <cublas_v2.h>
+#include <cuda_fp16.h>
 #include <thrust/functional.h>
 #include <thrust/host_vector.h>
 #include <thrust/device_vector.h>
 #include <thrust/pair.h>
 
 #include "tensors/tensor.h"
+#include "kernels/tensor_operators_cpu.h"
+#include "kernels/element_program.h"
+#include "kernels/cuda_helpers.h"
 
 namespace marian {
 
@@ -15,9 +21,25 @@ using namespace thrust::placeholders;
 #define MAX_BLOCKS 65535
 
 class TensorGPU;
+class DeviceRanges;
 
+/** @brief A cuBLAS handle on  device , one made by warmUpDevice() if there is one left */
 cublasHandle_t create_handle(size_t);
 
+/**
+ * @brief Creates the CUDA context of  device , loads the cuBLAS kernels with
+ * a tiny product and keeps  handles  cuBLAS handles for later create_handle()
+ * calls, so that none of this happens at the first batch
+ */
+void warmUpDevice(size_t device, size_t handles);
+
+/**
+ * @brief Runs warmUpDevice() for all GPUs of  devices  in parallel, one thread
+ * each, e.g. while a model loads. Wait for the result before the first graph
+ * is created; CPU devices are skipped.
+ */
+std::future<void> warmUpDevices(const std::vector<size_t>& devices, size_t handles);
+
 template <class Functor>
 __global__ void gAdd(Functor functor,
                      float* out,
@@ -133,6 +155,11 @@ template <class Functor>
 void Add(Functor functor,
          Tensor out, Tensor in, float scale = 1.0) {
 
+  if(isCPU(out->getDevice())) {
+    cpu::Add(functor, out, in, scale);
+    return;
+  }
+
   cudaSetDevice(out->getDevice());
 
   auto full = out->shape();
@@ -149,7 +176,7 @@ void Add(Functor functor,
     int threads = std::min(MAX_THREADS, (int) k);
     int shared = sizeof(float) * threads * 2;
 
-    gAdd1<<<blocks, threads, shared>>>(functor,
+    gAdd1<<<blocks, threads, shared, currentStream()>>>(functor,
                                        out->data(), out->shape(),
                                        in->data(), in->shape(),
                                        full, scale);
@@ -159,7 +186,7 @@ void Add(Functor functor,
     int threads = std::min(MAX_THREADS, length);
     int blocks  = std::min(MAX_BLOCKS, length / threads  + (length % threads != 0));
 
-    gAdd<<<blocks, threads>>>(functor,
+    gAdd<<<blocks, threads, 0, currentStream()>>>(functor,
                               out->data(), out->shape(),
                               in->data(), in->shape(),
                               full, scale);
@@ -298,6 +325,11 @@ template <class Functor>
 void Add(Functor functor,
          Tensor out, Tensor in1, Tensor in2, float scale = 1.0) {
 
+  if(isCPU(out->getDevice())) {
+    cpu::Add(functor, out, in1, in2, scale);
+    return;
+  }
+
   cudaSetDevice(out->getDevice());
 
   auto full = out->shape();
@@ -317,7 +349,7 @@ void Add(Functor functor,
     int threads = std::min(MAX_THREADS, (int) k);
     int shared = sizeof(float) * threads * 2;
 
-    gAdd1<<<blocks, threads, shared>>>(functor,
+    gAdd1<<<blocks, threads, shared, currentStream()>>>(functor,
                                        out->data(), out->shape(),
                                        in1->data(), in1->shape(),
                                        in2->data(), in2->shape(),
@@ -327,7 +359,7 @@ void Add(Functor functor,
     int threads = std::min(MAX_THREADS, length);
     int blocks  = std::min(MAX_BLOCKS, length / threads  + (length % threads != 0));
 
-    gAdd<<<blocks, threads>>>(functor,
+    gAdd<<<blocks, threads, 0, currentStream()>>>(functor,
                               out->data(), out->shape(),
                               in1->data(), in1->shape(),
                               in2->data(), in2->shape(),
@@ -406,6 +438,11 @@ __global__ void gAdd(Functor functor,
 template <class Functor>
 void Add(Functor functor,
          Tensor out, Tensor in1, Tensor in2, Tensor in3) {
+  if(isCPU(out->getDevice())) {
+    cpu::Add(functor, out, in1, in2, in3);
+    return;
+  }
+
   cudaSetDevice(out->getDevice());
 
   auto full = out->shape();
@@ -421,7 +458,7 @@ void Add(Functor functor,
   int threads = std::min(MAX_THREADS, length);
   int blocks  = std::min(MAX_BLOCKS, length / threads  + (length % threads != 0));
 
-  gAdd<<<blocks, threads>>>(functor,
+  gAdd<<<blocks, threads, 0, currentStream()>>>(functor,
                             out->data(), out->shape(),
                             in1->data(), in1->shape(),
                             in2->data(), in2->shape(),
@@ -439,7 +476,104 @@ void Reduce(Functor functor,
 }
 
 
+/**
+ * @brief Calls an elementwise functor with the output value and  N  input values.
+ */
+template <int N> struct ElementCall;
 
+template <> struct ElementCall<0> {
+  template <class Functor>
+  __device__ static float apply(Functor functor, float o, float, float, float) {
+    return functor(o);
+  }
+};
+
+template <> struct ElementCall<1> {
+  template <class Functor>
+  __device__ static float apply(Functor functor, float o, float a, float, float) {
+    return functor(o, a);
+  }
+};
+
+template <> struct ElementCall<2> {
+  template <class Functor>
+  __device__ static float apply(Functor functor, float o, float a, float b, float) {
+    return functor(o, a, b);
+  }
+};
+
+template <> struct ElementCall<3> {
+  template <class Functor>
+  __device__ static float apply(Functor functor, float o, float a, float b, float c) {
+    return functor(o, a, b, c);
+  }
+};
+
+/**
+ * @brief Elementwise kernel for  N  inputs of the output's shape: no index
+ * arithmetic, grid-stride loops over  vectors  float4 elements and then over
+ * the remaining scalars. Unused inputs are nullptr and never read.
+ */
+template <int N, class Functor>
+__global__ void gElementContiguous(Functor functor,
+                                   float* out,
+                                   const float* in1,
+                                   const float* in2,
+                                   const float* in3,
+                                   int length,
+                                   int vectors) {
+  int start = blockDim.x * blockIdx.x + threadIdx.x;
+  int stride = blockDim.x * gridDim.x;
+
+  float4* out4 = (float4*)out;
+  const float4* in14 = (const float4*)in1;
+  const float4* in24 = (const float4*)in2;
+  const float4* in34 = (const float4*)in3;
+  for(int i = start; i < vectors; i += stride) {
+    float4 o = out4[i];
+    float4 a = N > 0 ? in14[i] : o;
+    float4 b = N > 1 ? in24[i] : o;
+    float4 c = N > 2 ? in34[i] : o;
+    o.x = ElementCall<N>::apply(functor, o.x, a.x, b.x, c.x);
+    o.y = ElementCall<N>::apply(functor, o.y, a.y, b.y, c.y);
+    o.z = ElementCall<N>::apply(functor, o.z, a.z, b.z, c.z);
+    o.w = ElementCall<N>::apply(functor, o.w, a.w, b.w, c.w);
+    out4[i] = o;
+  }
+
+  for(int i = 4 * vectors + start; i < length; i += stride) {
+    float o = out[i];
+    out[i] = ElementCall<N>::apply(functor, o,
+                                   N > 0 ? in1[i] : o,
+                                   N > 1 ? in2[i] : o,
+                                   N > 2 ? in3[i] : o);
+  }
+}
+
+/**
+ * @brief Launches gElementContiguous, with float4 accesses if all pointers are
+ * 16-byte aligned. Called by Element() when no operand is broadcast.
+ */
+template <int N, class Functor>
+void ElementContiguous(Functor functor,
+                       float* out,
+                       const float* in1,
+                       const float* in2,
+                       const float* in3,
+                       int length) {
+  if(length == 0)
+    return;
+
+  size_t address = (size_t)out | (size_t)in1 | (size_t)in2 | (size_t)in3;
+  int vectors = address % sizeof(float4) == 0 ? length / 4 : 0;
+  int work = vectors + (length - 4 * vectors);
+
+  int threads = std::min(MAX_THREADS, work);
+  int blocks  = std::min(MAX_BLOCKS, work / threads + (work % threads != 0));
+
+  gElementContiguous<N><<<blocks, threads, 0, currentStream()>>>(
+    functor, out, in1, in2, in3, length, vectors);
+}
 
 template <class Functor>
 __global__ void gElement(Functor functor,
@@ -466,17 +600,26 @@ __global__ void gElement(Functor functor,
 template <class Functor, class T1, class T2>
 void Element(Functor functor,
              T1 out, T2 in) {
+  if(isCPU(out->getDevice())) {
+    cpu::Element(functor, out, in);
+    return;
+  }
+
   cudaSetDevice(out->getDevice());
 
   int length = out->shape().elements();
+  if(out->shape() == in->shape()) {
+    ElementContiguous<1>(functor, out->data(), in->data(), nullptr, nullptr, length);
+    return;
+  }
 
   int threads = std::min(MAX_THREADS, length);
   int blocks  = std::min(MAX_BLOCKS, length / threads  + (length % threads != 0));
 
-  gElement<<<blocks, threads>>>(functor,
+  gElement<<<blocks, threads, 0, currentStream()>>>(functor,
                                 out->data(), out->shape(),
                                 in->data(), in->shape(),
-                                out->shape() != in->shape());
+                                true);
 
 }
 
@@ -509,18 +652,27 @@ __global__ void gElement(Functor functor,
 template <class Functor, class T1, class T2, class T3>
 void Element(Functor functor,
              T1 out, T2 in1, T3 in2) {
+  if(isCPU(out->getDevice())) {
+    cpu::Element(functor, out, in1, in2);
+    return;
+  }
+
   cudaSetDevice(out->getDevice());
 
   int length = out->shape().elements();
+  if(out->shape() == in1->shape() && out->shape() == in2->shape()) {
+    ElementContiguous<2>(functor, out->data(), in1->data(), in2->data(), nullptr, length);
+    return;
+  }
 
   int threads = std::min(MAX_THREADS, length);
   int blocks  = std::min(MAX_BLOCKS, length / threads  + (length % threads != 0));
 
-  gElement<<<blocks, threads>>>(functor,
+  gElement<<<blocks, threads, 0, currentStream()>>>(functor,
                                 out->data(), out->shape(),
                                 in1->data(), in1->shape(),
                                 in2->data(), in2->shape(),
-                                out->shape() != in1->shape() || out->shape() != in2->shape());
+                                true);
 
 
 }
@@ -558,47 +710,44 @@ __global__ void gElement(Functor functor,
 template <class Functor, class T1, class T2, class T3, class T4>
 void Element(Functor functor,
              T1 out, T2 in1, T3 in2, T4 in3) {
+  if(isCPU(out->getDevice())) {
+    cpu::Element(functor, out, in1, in2, in3);
+    return;
+  }
+
   cudaSetDevice(out->getDevice());
 
   int length = out->shape().elements();
+  if(out->shape() == in1->shape() && out->shape() == in2->shape()
+     && out->shape() == in3->shape()) {
+    ElementContiguous<3>(functor, out->data(), in1->data(), in2->data(), in3->data(), length);
+    return;
+  }
 
   int threads = std::min(MAX_THREADS, length);
   int blocks  = std::min(MAX_BLOCKS, length / threads  + (length % threads != 0));
 
-  gElement<<<blocks, threads>>>(functor,
+  gElement<<<blocks, threads, 0, currentStream()>>>(functor,
                                 out->data(), out->shape(),
                                 in1->data(), in1->shape(),
                                 in2->data(), in2->shape(),
                                 in3->data(), in3->shape(),
-                                out->shape() != in1->shape()
-                                || out->shape() != in2->shape()
-                                || out->shape() != in3->shape());
+                                true);
 
 
 }
 
-template <class Functor>
-__global__ void gElement(Functor functor,
-                         float* out,
-                         int length) {
-  for(int bid = 0; bid < length; bid += blockDim.x * gridDim.x) {
-    int index = bid + blockDim.x * blockIdx.x + threadIdx.x;
-    if (index < length) {
-      out[index] = functor(out[index]);
-    }
-  }
-}
-
 template <class Functor, class T1>
 void Element(Functor functor, T1 out) {
+  if(isCPU(out->getDevice())) {
+    cpu::Element(functor, out);
+    return;
+  }
+
   cudaSetDevice(out->getDevice());
 
   int length = out->shape().elements();
-
-  int threads = std::min(MAX_THREADS, length);
-  int blocks  = std::min(MAX_BLOCKS, length / threads  + (length % threads != 0));
-
-  gElement<<<blocks, threads>>>(functor, out->data(), length);
+  ElementContiguous<0>(functor, out->data(), nullptr, nullptr, nullptr, length);
 
 }
 
@@ -626,6 +775,11 @@ __global__ void gPick(Functor functor,
 
 template <class Functor, class T1, class T2>
 void Pick(Functor functor, T1 out, const T2 picks) {
+  if(isCPU(out->getDevice())) {
+    cpu::Pick(functor, out, picks);
+    return;
+  }
+
   cudaSetDevice(out->getDevice());
 
   int length = out->shape().elements();
@@ -633,7 +787,7 @@ void Pick(Functor functor, T1 out, const T2 picks) {
   int threads = std::min(MAX_THREADS, length);
   int blocks  = std::min(MAX_BLOCKS, length / threads  + (length % threads != 0));
 
-  gPick<<<blocks, threads>>>(functor, out->data(), out->shape(),
+  gPick<<<blocks, threads, 0, currentStream()>>>(functor, out->data(), out->shape(),
                              picks->data());
 
 }
@@ -663,6 +817,11 @@ __global__ void gPick(Functor functor,
 
 template <class Functor, class T1, class T2, class T3>
 void Pick(Functor functor, T1 out, const T2 in, const T3 picks) {
+  if(isCPU(out->getDevice())) {
+    cpu::Pick(functor, out, in, picks);
+    return;
+  }
+
   cudaSetDevice(out->getDevice());
 
   int length = out->shape().elements();
@@ -670,7 +829,7 @@ void Pick(Functor functor, T1 out, const T2 in, const T3 picks) {
   int threads = std::min(MAX_THREADS, length);
   int blocks  = std::min(MAX_BLOCKS, length / threads  + (length % threads != 0));
 
-  gPick<<<blocks, threads>>>(functor, out->data(), out->shape(),
+  gPick<<<blocks, threads, 0, currentStream()>>>(functor, out->data(), out->shape(),
                              in->data(), in->shape(),
                              picks->data());
 
@@ -703,6 +862,11 @@ __global__ void gPickReduce(Functor functor,
 
 template <class Functor, class T1, class T2, class T3>
 void PickReduce(Functor functor, T1 out, const T2 in, const T3 picks) {
+  if(isCPU(out->getDevice())) {
+    cpu::PickReduce(functor, out, in, picks);
+    return;
+  }
+
   cudaSetDevice(out->getDevice());
 
   int length = in->shape().elements();
@@ -711,7 +875,7 @@ void PickReduce(Functor functor, T1 out, const T2 in, const T3 picks) {
   int blocks  = std::min(MAX_BLOCKS, length / threads  + (length % threads != 0));
 
   out->set(0);
-  gPickReduce<<<blocks, threads>>>(functor, out->data(), out->shape(),
+  gPickReduce<<<blocks, threads, 0, currentStream()>>>(functor, out->data(), out->shape(),
                              in->data(), in->shape(),
                              picks->data());
 
@@ -745,6 +909,11 @@ __global__ void gPick(Functor functor,
 
 template <class Functor, class T1, class T2, class T3, class T4>
 void Pick(Functor functor, T1 out, const T2 in1, const T3 in2, const T4 picks) {
+  if(isCPU(out->getDevice())) {
+    cpu::Pick(functor, out, in1, in2, picks);
+    return;
+  }
+
   cudaSetDevice(out->getDevice());
 
   int length = out->shape().elements();
@@ -752,7 +921,7 @@ void Pick(Functor functor, T1 out, const T2 in1, const T3 in2, const T4 picks) {
   int threads = std::min(MAX_THREADS, length);
   int blocks  = std::min(MAX_BLOCKS, length / threads  + (length % threads != 0));
 
-  gPick<<<blocks, threads>>>(functor, out->data(), out->shape(),
+  gPick<<<blocks, threads, 0, currentStream()>>>(functor, out->data(), out->shape(),
                              in1->data(),
                              in1->shape(),
                              in2->data(),
@@ -763,6 +932,21 @@ void Pick(Functor functor, T1 out, const T2 in1, const T3 in2, const T4 picks) {
 
 float L2Norm(Tensor in);
 
+/**
+ * @brief out = scale * the sum of  in  over the axes where  out  has size 1,
+ * e.g. Sum and Mean. Reductions over contiguous axes use dedicated kernels:
+ * over the columns of rows a warp or a block per row, over outer axes
+ * coalesced reads across the kept inner elements, and over all elements a
+ * two-stage tree. Other layouts and the CPU use Reduce().
+ */
+void ReduceSum(Tensor out, Tensor in, float scale = 1.f);
+
+/**
+ * @brief out += scale * in, broadcast over the axes where  in  has size 1,
+ * the gradient of ReduceSum() in one pass over  out
+ */
+void AddBroadcast(Tensor out, Tensor in, float scale = 1.f);
+
 void Softmax(Tensor out, Tensor in, Tensor mask = nullptr);
 void LogSoftmax(Tensor out, Tensor in);
 
@@ -778,17 +962,99 @@ void CudnnLogSoftmaxGrad(Tensor grad, Tensor adj, Tensor val);
 void CrossEntropyPick(Tensor out, Tensor in, Tensor pick);
 void CrossEntropyPickBackward(Tensor out, Tensor adj, Tensor a, Tensor pick);
 
-void Argmax(Tensor Out, const Tensor In);
+/**
+ * @brief Per row of  in , the cross-entropy of the output layer  in * W + b
+ * against  pick , without holding all logits: they are computed for  shards
+ * slices of the vocabulary in turn and combined by a running log-sum-exp.
+ * The rows are processed in  chunks  blocks, which bounds the logits held at
+ * once to a block of rows times a slice of the vocabulary. With  transW  the
+ * weights are stored vocabulary by input, e.g. tied target embeddings.
+ */
+void ShardedCrossEntropy(cublasHandle_t handle, Tensor out, Tensor in,
+                         Tensor W, Tensor b, Tensor pick, int shards,
+                         int chunks = 1, bool transW = false);
+
+/**
+ * @brief Adds the gradients of ShardedCrossEntropy() with cost  val  for  adj
+ * to those of  in ,  W  and  b , any of which may be null. The logits are
+ * recomputed block by block and slice by slice.
+ */
+void ShardedCrossEntropyBackward(cublasHandle_t handle,
+                                 Tensor outIn, Tensor outW, Tensor outB,
+                                 Tensor adj, Tensor val,
+                                 Tensor in, Tensor W, Tensor b, Tensor pick,
+                                 int shards, int chunks = 1, bool transW = false);
+
+/**
+ * @brief Column of the largest value of every row of  in  as a float, the
+ * column  exclude  is never chosen. Pass exclude = -1 to consider all.
+ */
+void Argmax(Tensor out, const Tensor in, int exclude = -1);
 
 void Prod(cublasHandle_t handle, Tensor C, const Tensor A, const Tensor B,
              bool transA, bool transB, Float beta = 0);
 
+/**
+ * @brief Batched matrix product over dimensions 2 and 3. Every (d2, d3) slice
+ * of A, B and C is a contiguous matrix in dimensions 0 and 1, all products
+ * run in a single strided-batched GEMM.
+ */
+void ProdBatched(cublasHandle_t handle, Tensor C, const Tensor A, const Tensor B,
+                 bool transA, bool transB, Float beta = 0);
+
+/**
+ * @brief Same as Prod, but A and B are rounded to fp16 and multiplied with
+ * fp32 accumulation, on tensor cores where available. C stays fp32.
+ *
+ * halfA and halfB may point to fp16 copies of A and B that already exist,
+ * e.g. cached parameters, only null operands are converted.
+ */
+void ProdHalf(cublasHandle_t handle, Tensor C, const Tensor A, const Tensor B,
+              bool transA, bool transB, Float beta = 0,
+              const __half* halfA = nullptr, const __half* halfB = nullptr);
+
+/** @brief Rounds  in  to fp16 into  out , which holds in->size() halves */
+void ToHalf(__half* out, const Tensor in);
+
+/**
+ * @brief Int8 copy of the matrix  in  with one scale per column, in is
+ * approximately out * scales[column]. out holds in->size() values, scales
+ * one per column. Memory of both lies on the device of  in .
+ */
+void QuantizeColumns(int8_t* out, float* scales, const Tensor in);
+
+/**
+ * @brief Same as Prod with B given as int8 with per-column scales, see
+ * QuantizeColumns. Rows of A are quantized per product with one scale each,
+ * products accumulate in int32 and are scaled back to fp32. Transposed
+ * operands and shapes the int8 GEMM does not support fall back to Prod.
+ */
+void ProdInt8(cublasHandle_t handle, Tensor C, const Tensor A, const Tensor B,
+              bool transA, bool transB, Float beta,
+              const int8_t* quantB, const float* scalesB);
+
 void CopyRowsByIndex(Tensor out, const Tensor in,
                      thrust::pair<size_t, size_t>* ipair, size_t length);
 
-void CopyRows(Tensor out, const Tensor in, const std::vector<size_t>& indeces);
+/**
+ * @brief Gathers the rows of  in  listed in the device tensor  indices , one
+ * index per float. The first  hotRows  rows of  in , the most frequent words
+ * of an embedding with a frequency-ordered vocabulary, are kept persisting in
+ * L2 during the gather on devices which support access policy windows.
+ */
+void CopyRows(Tensor out, const Tensor in, const Tensor indices, size_t hotRows = 0);
+
+/**
+ * @brief Adds the rows of  in  to the rows of  out  listed in  indices , the
+ * first  hotRows  rows of  out  persisting in L2 as in CopyRows()
+ */
+void PasteRows(Tensor out, const Tensor in, const Tensor indices, size_t hotRows = 0);
+
+/** @brief Gathers the columns of the 2D  in  listed in  indices , one index per float */
+void CopyCols(Tensor out, const Tensor in, const Tensor indices);
 
-void PasteRows(Tensor out, const Tensor in, const std::vector<size_t>& indeces);
+/** @brief Adds the columns of  in  to the columns of  out  listed in  indices  */
+void PasteCols(Tensor out, const Tensor in, const Tensor indices);
 
 //void CudnnDropoutPrepare(Tensor in, float p,
 //                         cudnnDropoutDescriptor_t* dropDesc,
@@ -812,13 +1078,79 @@ void Concatenate(Tensor out, const std::vector<Tensor>& inputs, int ax);
 
 void Deconcatenate(std::vector<Tensor>& outputs, const Tensor in, int ax);
 
-void GRUFastForward(Tensor out, std::vector<Tensor> inputs, bool final = false);
+/**
+ * @brief One GRU step from inputs state, xW, sU, b and optionally the mask. If
+ * sU has fewer rows than the state, the remaining rows are sentences that
+ * ended before this step and only keep their state, see RNN::applySteps().
+ */
+void GRUFastForward(Tensor out, const std::vector<Tensor>& inputs, bool final = false);
 
-void GRUFastBackward(std::vector<Tensor> outputs,
-                     std::vector<Tensor> inputs,
+void GRUFastBackward(const std::vector<Tensor>& outputs,
+                     const std::vector<Tensor>& inputs,
                      Tensor adj, bool final = false);
 
+/**
+ * @brief GRU recurrence over all timesteps in a single persistent kernel.
+ *
+ * inputs are the initial state {batch, dim}, xW {batch, 3 * dim, steps}, U, b
+ * and optionally the mask {batch, 1, steps}. out receives the states of all
+ * steps {batch, dim, steps}, with reverse the recurrence runs from the last step.
+ */
+void GRUSequenceForward(Tensor out, const std::vector<Tensor>& inputs,
+                        bool reverse = false, bool final = false);
+
+/**
+ * @brief Backward pass of GRUSequenceForward, outputs are the gradients of the
+ * inputs in the same order, null for those not required. The gradient of U is
+ * one matrix product over all steps.
+ */
+void GRUSequenceBackward(cublasHandle_t handle,
+                         const std::vector<Tensor>& outputs,
+                         const std::vector<Tensor>& inputs,
+                         Tensor out, Tensor adj,
+                         bool reverse = false, bool final = false);
+
 void Att(Tensor out, Tensor va, Tensor context, Tensor state, Tensor coverage);
+
+/** @brief Limits of AttFused(): beams per sentence and words times beams per sentence */
+const int ATT_BEAMS = 32;
+const int ATT_MAX_ALIGNMENTS = 12 * 1024;
+
+/**
+ * @brief Forward-only attention over all beams of every sentence: energies
+ * of va^T tanh(mappedContext + mappedState), softmax over the source words
+ * masked by mask ({batch, 1, words}, may be null) and the weighted sum of
+ * context into out ({batch, dimContext, 1, beams}).
+ *
+ * Tiles of mappedContext and context pass through shared memory once per
+ * sentence and are used for all of its beams. With  half , mappedContext and
+ * context are packed by PackHalf() and converted while they are read.
+ */
+void AttFused(Tensor out, Tensor va, Tensor mappedContext, Tensor mappedState,
+              Tensor context, Tensor mask, bool half = false);
+
+/**
+ * @brief The  window  words (the third dimension of  out ) of every sentence
+ * of  in  ({batch, cols, words}) around word  center , for local attention.
+ * The window of sentence b starts at center - window / 2, moved into its
+ * words as counted by  mask  ({batch, 1, words}, all words if null). Words
+ * past the end of  in  are zeros. Only the window is read.
+ */
+void LocalWindow(Tensor out, const Tensor in, const Tensor mask, int center);
+
+/** @brief Adds  adj , the gradient of LocalWindow(), into the windows of  grad  */
+void LocalWindowGrad(Tensor grad, const Tensor adj, const Tensor mask, int center);
+
+/**
+ * @brief Packs the rows of  in  as fp16, two values per float of  out , whose
+ * second dimension is half that of  in  rounded up, rows of odd length are
+ * zero-padded.
+ * The packed rows can be gathered like any tensor, e.g. by select_batch.
+ */
+void PackHalf(Tensor out, const Tensor in);
+
+/** @brief Inverse of PackHalf(), the second dimension of  out  gives the row length */
+void UnpackHalf(Tensor out, const Tensor in);
 void AttBack(Tensor gva, Tensor gContext, Tensor gState, Tensor gCoverage,
              Tensor va, Tensor context, Tensor state, Tensor coverage,
              Tensor adj);
@@ -827,4 +1159,76 @@ void LayerNormalization(Tensor out, Tensor in, Tensor gamma, Tensor beta, float
 void LayerNormalizationGrad(Tensor gradX, Tensor gradGamma, Tensor gradBeta,
                             Tensor adj, Tensor y, Tensor x, Tensor gamma, Tensor beta);
 
+/** @brief Blocks of the first pass of ClipNormFactor() */
+const int CLIP_PARTS = 64;
+
+/**
+ * @brief Writes min(1, c / ||in||) to factor[0] without reading anything back
+ * to the host. The first pass leaves one partial sum of squares per block in
+ * factor[1..CLIP_PARTS], the second pass combines them, so factor needs
+ * CLIP_PARTS + 1 elements.
+ */
+void ClipNormFactor(Tensor factor, Tensor in, float c);
+
+/**
+ * @brief Fused Adam step, reads and writes every element of the moments mt and vt
+ * exactly once. mt and vt may live in mapped pinned host memory. Gradients are
+ * multiplied on the fly by the first element of scale, e.g. the factor of
+ * ClipNormFactor(), and left unchanged. No scaling if scale is null.
+ * With  ranges  only their elements are updated, the others keep their
+ * moments, i.e. a lazy update of the parameters a batch used. The CPU always
+ * updates all elements.
+ */
+void AdamUpdate(Tensor params, Tensor grads, Tensor mt, Tensor vt,
+                float eta, float beta1, float beta2, float eps,
+                float denom1, float denom2, Tensor scale = nullptr,
+                Tensor avg = nullptr, float decay = 0,
+                const DeviceRanges* ranges = nullptr);
+
+/** @brief Elements per scale of the moments of AdamUpdateQuantized() */
+const int ADAM_BLOCK = 256;
+
+/**
+ * @brief AdamUpdate() with the moments stored in  bits  8 or 16 per element,
+ * decoded and encoded again within the same pass. Every block of ADAM_BLOCK
+ * elements has one scale per moment,  mScale  and  vScale , the largest
+ * magnitude of the block. The codes are companded, sqrt(|m|) and v^(1/4) over
+ * their block's maximum, so small moments keep precision next to large ones.
+ * With 8 bits m is rounded to the nearest and v up to the next code, v never
+ * decodes to zero while m does not. The parameter step itself uses the exact
+ * new moments. Always updates all elements, GPU only.
+ */
+void AdamUpdateQuantized(Tensor params, Tensor grads, void* mt, void* vt,
+                         float* mScale, float* vScale, int bits,
+                         float eta, float beta1, float beta2, float eps,
+                         float denom1, float denom2, Tensor scale = nullptr,
+                         Tensor avg = nullptr, float decay = 0);
+
+/**
+ * @brief Fused Adagrad step, accumulates the squared scaled gradients into gt
+ * and updates params in one pass.
+ *
+ * For both, a non-null  avg  receives the exponential moving average of the
+ * updated parameters in the same pass, avg = decay * avg + (1 - decay) * params.
+ */
+void AdagradUpdate(Tensor params, Tensor grads, Tensor gt,
+                   float eta, float eps, Tensor scale = nullptr,
+                   Tensor avg = nullptr, float decay = 0);
+
+/**
+ * @brief Evaluates a fused elementwise program into out, the inputs broadcast
+ * to the shape of out.
+ */
+void FusedForward(const ElementProgram& program, Tensor out,
+                  const std::vector<Tensor>& inputs);
+
+/**
+ * @brief Adds the gradients of a fused elementwise program to grads, one per
+ * input, null for inputs without gradient. Gradients of broadcast inputs are
+ * accumulated atomically.
+ */
+void FusedBackward(const ElementProgram& program, Tensor adj,
+                   const std::vector<Tensor>& inputs,
+                   const std::vector<Tensor>& grads);
+
 }
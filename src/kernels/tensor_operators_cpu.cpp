@@ -0,0 +1,604 @@
+// This file is part of the Marian toolkit.
+
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <memory>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#ifdef BLAS_FOUND
+#include <cblas.h>
+#endif
+
+#include "kernels/tensor_operators_cpu.h"
+#include "common/thread_pool.h"
+
+namespace marian {
+namespace cpu {
+
+namespace {
+
+std::atomic<size_t> threads_{1};
+
+/**
+ * Calls  body(begin, end)  on ranges of [0, n) of at least  grain  items, one
+ * per thread, the calling thread takes the first range
+ */
+void parallel(size_t n, size_t grain, const std::function<void(size_t, size_t)>& body) {
+  size_t parts = std::min((size_t)threads_, n / std::max(grain, (size_t)1));
+  if(parts <= 1) {
+    body(0, n);
+    return;
+  }
+
+  thread_local std::unique_ptr<ThreadPool> helpers;
+  if(!helpers || helpers->size() + 1 < threads_)
+    helpers.reset(new ThreadPool(threads_ - 1));
+
+  size_t chunk = (n + parts - 1) / parts;
+  std::vector<std::future<void>> done;
+  for(size_t part = 1; part < parts && part * chunk < n; ++part) {
+    size_t begin = part * chunk;
+    size_t end = std::min(n, begin + chunk);
+    done.push_back(helpers->enqueueAt(part - 1, [&body, begin, end]() { body(begin, end); }));
+  }
+  body(0, std::min(n, chunk));
+  for(auto& d : done)
+    d.get();
+}
+
+/** @brief C = A * B + beta * C of row-major matrices with leading dimensions */
+void gemm(bool transA, bool transB,
+          size_t m, size_t n, size_t k,
+          const float* a, size_t lda,
+          const float* b, size_t ldb,
+          float beta, float* c, size_t ldc) {
+#ifdef BLAS_FOUND
+  cblas_sgemm(CblasRowMajor,
+              transA ? CblasTrans : CblasNoTrans,
+              transB ? CblasTrans : CblasNoTrans,
+              m, n, k, 1.f, a, lda, b, ldb, beta, c, ldc);
+#else
+  // reference fallback, i-k-j order keeps the inner loop contiguous in B and C
+  for(size_t i = 0; i < m; ++i) {
+    float* crow = c + i * ldc;
+    for(size_t j = 0; j < n; ++j)
+      crow[j] = beta ? crow[j] * beta : 0.f;
+    for(size_t p = 0; p < k; ++p) {
+      float aip = transA ? a[p * lda + i] : a[i * lda + p];
+      if(!transB) {
+        const float* brow = b + p * ldb;
+        for(size_t j = 0; j < n; ++j)
+          crow[j] += aip * brow[j];
+      }
+      else {
+        for(size_t j = 0; j < n; ++j)
+          crow[j] += aip * b[j * ldb + p];
+      }
+    }
+  }
+#endif
+}
+
+#ifdef __AVX2__
+inline float hsum(__m256 v) {
+  __m128 lo = _mm256_castps256_ps128(v);
+  __m128 hi = _mm256_extractf128_ps(v, 1);
+  lo = _mm_add_ps(lo, hi);
+  lo = _mm_hadd_ps(lo, lo);
+  lo = _mm_hadd_ps(lo, lo);
+  return _mm_cvtss_f32(lo);
+}
+
+inline float hmax(__m256 v) {
+  __m128 lo = _mm256_castps256_ps128(v);
+  __m128 hi = _mm256_extractf128_ps(v, 1);
+  lo = _mm_max_ps(lo, hi);
+  lo = _mm_max_ps(lo, _mm_movehl_ps(lo, lo));
+  lo = _mm_max_ss(lo, _mm_shuffle_ps(lo, lo, 1));
+  return _mm_cvtss_f32(lo);
+}
+#endif
+
+inline float rowMax(const float* x, int n) {
+  int i = 0;
+  float m = x[0];
+#ifdef __AVX2__
+  if(n >= 8) {
+    __m256 acc = _mm256_loadu_ps(x);
+    for(i = 8; i + 8 <= n; i += 8)
+      acc = _mm256_max_ps(acc, _mm256_loadu_ps(x + i));
+    m = hmax(acc);
+  }
+#endif
+  for(; i < n; ++i)
+    m = std::max(m, x[i]);
+  return m;
+}
+
+inline float rowSum(const float* x, int n) {
+  int i = 0;
+  float s = 0;
+#ifdef __AVX2__
+  __m256 acc = _mm256_setzero_ps();
+  for(; i + 8 <= n; i += 8)
+    acc = _mm256_add_ps(acc, _mm256_loadu_ps(x + i));
+  s = hsum(acc);
+#endif
+  for(; i < n; ++i)
+    s += x[i];
+  return s;
+}
+
+}
+
+void setThreads(size_t threads) {
+  threads_ = std::max((size_t)1, threads);
+}
+
+size_t threads() {
+  return threads_;
+}
+
+float L2Norm(Tensor in) {
+  const float* x = in->data();
+  double sum = 0;
+  for(size_t i = 0; i < in->size(); ++i)
+    sum += x[i] * x[i];
+  return std::sqrt(sum);
+}
+
+void Softmax(Tensor out, Tensor in, Tensor mask) {
+  int rows = out->shape()[0] * out->shape()[2] * out->shape()[3];
+  int cols = out->shape()[1];
+  int maskRows = mask ? mask->shape().elements() / cols : 1;
+
+  parallel(rows, std::max(1, 4096 / cols), [&](size_t begin, size_t end) {
+    for(int j = begin; j < (int)end; ++j) {
+      float* so = out->data() + j * cols;
+      const float* sp = in->data() + j * cols;
+      const float* mp = mask ? mask->data() + (j % maskRows) * cols : nullptr;
+
+      float max = rowMax(sp, cols);
+      for(int i = 0; i < cols; ++i)
+        so[i] = (!mp || mp[i]) ? std::exp(sp[i] - max) : 0.f;
+
+      float sum = rowSum(so, cols);
+      for(int i = 0; i < cols; ++i)
+        so[i] /= sum;
+    }
+  });
+}
+
+void Argmax(Tensor out, const Tensor in, int exclude) {
+  int rows = in->shape()[0] * in->shape()[2] * in->shape()[3];
+  int cols = in->shape()[1];
+
+  for(int j = 0; j < rows; ++j) {
+    const float* sp = in->data() + j * cols;
+    int best = exclude == 0 ? 1 : 0;
+    for(int i = 0; i < cols; ++i)
+      if(i != exclude && sp[i] > sp[best])
+        best = i;
+    out->data()[j] = best;
+  }
+}
+
+void LogSoftmax(Tensor out, Tensor in) {
+  int rows = out->shape()[0] * out->shape()[2] * out->shape()[3];
+  int cols = out->shape()[1];
+
+  parallel(rows, std::max(1, 4096 / cols), [&](size_t begin, size_t end) {
+    for(int j = begin; j < (int)end; ++j) {
+      float* so = out->data() + j * cols;
+      const float* sp = in->data() + j * cols;
+
+      float max = rowMax(sp, cols);
+      float sum = 0;
+      for(int i = 0; i < cols; ++i) {
+        so[i] = sp[i] - max;
+        sum += std::exp(so[i]);
+      }
+
+      float logSum = std::log(sum);
+      for(int i = 0; i < cols; ++i)
+        so[i] -= logSum;
+    }
+  });
+}
+
+void CrossEntropyPick(Tensor out, Tensor in, Tensor pick) {
+  int rows = in->shape()[0];
+  int cols = in->shape()[1];
+
+  for(int j = 0; j < rows; ++j) {
+    const float* sp = in->data() + j * cols;
+    float max = rowMax(sp, cols);
+    float sum = 0;
+    for(int i = 0; i < cols; ++i)
+      sum += std::exp(sp[i] - max);
+    out->data()[j] = std::log(sum) - sp[(int)pick->data()[j]] + max;
+  }
+}
+
+void Prod(Tensor C, const Tensor A, const Tensor B,
+          bool transA, bool transB, float beta) {
+  size_t m = A->shape()[0] * A->shape()[2] * A->shape()[3];
+  size_t k = A->shape()[1];
+  if(transA)
+    std::swap(m, k);
+
+  size_t l = B->shape()[0];
+  size_t n = B->shape()[1];
+  if(transB)
+    std::swap(l, n);
+
+  size_t lda = A->shape()[1];
+  size_t ldb = B->shape()[1];
+  size_t ldc = n;
+
+  const float* a = A->data();
+  const float* b = B->data();
+  float* c = C->data();
+
+  // decoding has few rows and many columns, e.g. the output layer, so the
+  // longer side is split; the blocks of C are disjoint
+  if(n >= m) {
+    parallel(n, 256, [&](size_t begin, size_t end) {
+      gemm(transA, transB, m, end - begin, k, a, lda,
+           transB ? b + begin * ldb : b + begin, ldb, beta, c + begin, ldc);
+    });
+  }
+  else {
+    parallel(m, 16, [&](size_t begin, size_t end) {
+      gemm(transA, transB, end - begin, n, k,
+           transA ? a + begin : a + begin * lda, lda, b, ldb,
+           beta, c + begin * ldc, ldc);
+    });
+  }
+}
+
+void ProdBatched(Tensor C, const Tensor A, const Tensor B,
+                 bool transA, bool transB, float beta) {
+  size_t batch = A->shape()[2] * A->shape()[3];
+  UTIL_THROW_IF2(batch != B->shape()[2] * B->shape()[3],
+                 "batched matrix product requires batch dimensions to match");
+
+  Shape shapeA = {A->shape()[0], A->shape()[1]};
+  Shape shapeB = {B->shape()[0], B->shape()[1]};
+  Shape shapeC = {C->shape()[0], C->shape()[1]};
+  for(size_t i = 0; i < batch; ++i) {
+    Tensor a(new TensorBase(A->data() + i * shapeA.elements(), shapeA, A->getDevice()));
+    Tensor b(new TensorBase(B->data() + i * shapeB.elements(), shapeB, B->getDevice()));
+    Tensor c(new TensorBase(C->data() + i * shapeC.elements(), shapeC, C->getDevice()));
+    Prod(c, a, b, transA, transB, beta);
+  }
+}
+
+void QuantizeColumns(int8_t* out, float* scales, const Tensor in) {
+  size_t rows = in->shape()[0] * in->shape()[2] * in->shape()[3];
+  size_t cols = in->shape()[1];
+  const float* x = in->data();
+
+  std::vector<float> mx(cols, 0.f);
+  for(size_t i = 0; i < rows; ++i)
+    for(size_t j = 0; j < cols; ++j)
+      mx[j] = std::max(mx[j], std::fabs(x[i * cols + j]));
+
+  for(size_t j = 0; j < cols; ++j)
+    scales[j] = mx[j] > 0 ? mx[j] / 127.f : 1.f;
+
+  for(size_t i = 0; i < rows; ++i)
+    for(size_t j = 0; j < cols; ++j)
+      out[i * cols + j] = (int8_t)std::lrint(x[i * cols + j] / scales[j]);
+}
+
+void ProdInt8(Tensor C, const Tensor A, const Tensor B, float beta,
+              const int8_t* quantB, const float* scalesB) {
+  size_t m = A->shape()[0] * A->shape()[2] * A->shape()[3];
+  size_t k = A->shape()[1];
+  size_t n = B->shape()[1];
+
+  std::vector<int8_t> quantA(k);
+  std::vector<int32_t> acc(n);
+  float* c = C->data();
+
+  for(size_t i = 0; i < m; ++i) {
+    const float* arow = A->data() + i * k;
+
+    float mx = 0;
+    for(size_t p = 0; p < k; ++p)
+      mx = std::max(mx, std::fabs(arow[p]));
+    float scaleA = mx > 0 ? mx / 127.f : 1.f;
+    for(size_t p = 0; p < k; ++p)
+      quantA[p] = (int8_t)std::lrint(arow[p] / scaleA);
+
+    // i-k-j order, the integer inner loop vectorizes over the columns of B
+    std::fill(acc.begin(), acc.end(), 0);
+    for(size_t p = 0; p < k; ++p) {
+      int32_t aip = quantA[p];
+      const int8_t* brow = quantB + p * n;
+      size_t j = 0;
+#ifdef __AVX2__
+      // 16 columns per step, int8 * int8 fits int16, sums are kept in int32
+      __m256i a16 = _mm256_set1_epi16((int16_t)aip);
+      for(; j + 16 <= n; j += 16) {
+        __m128i b8 = _mm_loadu_si128((const __m128i*)(brow + j));
+        __m256i prod = _mm256_mullo_epi16(_mm256_cvtepi8_epi16(b8), a16);
+        __m256i lo = _mm256_cvtepi16_epi32(_mm256_castsi256_si128(prod));
+        __m256i hi = _mm256_cvtepi16_epi32(_mm256_extracti128_si256(prod, 1));
+        __m256i* out = (__m256i*)(acc.data() + j);
+        _mm256_storeu_si256(out, _mm256_add_epi32(_mm256_loadu_si256(out), lo));
+        _mm256_storeu_si256(out + 1, _mm256_add_epi32(_mm256_loadu_si256(out + 1), hi));
+      }
+#endif
+      for(; j < n; ++j)
+        acc[j] += aip * brow[j];
+    }
+
+    float* crow = c + i * n;
+    for(size_t j = 0; j < n; ++j) {
+      float v = acc[j] * scaleA * scalesB[j];
+      crow[j] = beta ? v + beta * crow[j] : v;
+    }
+  }
+}
+
+void CopyRows(Tensor out, const Tensor in, const Tensor indices) {
+  size_t cols = in->shape()[1];
+  const float* idx = indices->data();
+  for(size_t j = 0; j < indices->size(); ++j)
+    std::memcpy(out->data() + j * cols,
+                in->data() + (size_t)idx[j] * cols,
+                cols * sizeof(float));
+}
+
+void CopyCols(Tensor out, const Tensor in, const Tensor indices) {
+  size_t rows = in->shape()[0];
+  size_t cols = in->shape()[1];
+  size_t colsOut = indices->size();
+  const float* idx = indices->data();
+  for(size_t i = 0; i < rows; ++i)
+    for(size_t j = 0; j < colsOut; ++j)
+      out->data()[i * colsOut + j] = in->data()[i * cols + (size_t)idx[j]];
+}
+
+void Transpose(Tensor out, const Tensor in) {
+  size_t m = in->shape()[0];
+  size_t n = in->shape()[1];
+  size_t steps = in->shape()[2] * in->shape()[3];
+  for(size_t s = 0; s < steps; ++s) {
+    const float* a = in->data() + s * m * n;
+    float* b = out->data() + s * m * n;
+    for(size_t i = 0; i < m; ++i)
+      for(size_t j = 0; j < n; ++j)
+        b[j * m + i] = a[i * n + j];
+  }
+}
+
+void Concatenate(Tensor out, const std::vector<Tensor>& inputs, int ax) {
+  if(ax == 1) {
+    size_t rows = out->shape()[0] * out->shape()[2] * out->shape()[3];
+    size_t colsOut = out->shape()[1];
+    size_t offset = 0;
+    for(auto in : inputs) {
+      UTIL_THROW_IF2(out->shape()[0] != in->shape()[0],
+                     "First dimension must be equal");
+      size_t colsIn = in->shape()[1];
+      for(size_t j = 0; j < rows; ++j)
+        std::memcpy(out->data() + j * colsOut + offset,
+                    in->data() + j * colsIn,
+                    colsIn * sizeof(float));
+      offset += colsIn;
+    }
+  }
+  else {
+    size_t offset = 0;
+    for(auto in : inputs) {
+      UTIL_THROW_IF2(out->shape()[1] != in->shape()[1],
+                     "Second dimension must be equal");
+      std::memcpy(out->data() + offset, in->data(), in->size() * sizeof(float));
+      offset += in->size();
+    }
+  }
+}
+
+void GRUFastForward(Tensor out, const std::vector<Tensor>& inputs, bool final) {
+  int rows = out->shape()[0] * out->shape()[2] * out->shape()[3];
+  int cols = out->shape()[1];
+
+  const float* state = inputs[0]->data();
+  const float* xW = inputs[1]->data();
+  const float* sU = inputs[2]->data();
+  const float* b = inputs[3]->data();
+  const float* mask = inputs.size() > 4 ? inputs[4]->data() : nullptr;
+  int active = inputs[2]->size() / (3 * cols);
+
+  for(int j = 0; j < rows; ++j) {
+    float* rowOut = out->data() + j * cols;
+    const float* rowState = state + j * cols;
+    if(j >= active) {
+      std::copy(rowState, rowState + cols, rowOut);
+      continue;
+    }
+
+    float m = !mask || mask[j];
+    const float* xWrow = xW + j * cols * 3;
+    const float* sUrow = sU + j * cols * 3;
+
+    for(int i = 0; i < cols; ++i) {
+      float r = 1.0f / (1.0f + std::exp(-(xWrow[i] + sUrow[i] + b[i])));
+
+      int k = i + cols;
+      float z = 1.0f / (1.0f + std::exp(-(xWrow[k] + sUrow[k] + b[k])));
+
+      int l = i + 2 * cols;
+      float h;
+      if(final)
+        h = std::tanh(xWrow[l] + (sUrow[l] + b[l]) * r);
+      else
+        h = std::tanh(xWrow[l] + sUrow[l] * r + b[l]);
+
+      float o = (1.0f - z) * h + z * rowState[i];
+      rowOut[i] = m * o + (1 - m) * rowState[i];
+    }
+  }
+}
+
+void GRUSequenceForward(Tensor out, const std::vector<Tensor>& inputs, bool reverse, bool final) {
+  int batch = out->shape()[0];
+  int dim = out->shape()[1];
+  int steps = out->shape()[2];
+  size_t device = out->getDevice();
+
+  Shape stateShape = {batch, dim};
+  Shape gatesShape = {batch, 3 * dim};
+  Shape maskShape = {batch, 1};
+
+  std::vector<float> sU(gatesShape.elements());
+  Tensor gates(new TensorBase(sU.data(), gatesShape, device));
+
+  Tensor prev = inputs[0];
+  for(int s = 0; s < steps; ++s) {
+    int t = reverse ? steps - 1 - s : s;
+    Tensor cur(new TensorBase(out->data() + t * stateShape.elements(), stateShape, device));
+    Tensor xW(new TensorBase(inputs[1]->data() + t * gatesShape.elements(), gatesShape, device));
+
+    Prod(gates, prev, inputs[2], false, false, 0);
+
+    std::vector<Tensor> stepInputs = {prev, xW, gates, inputs[3]};
+    if(inputs.size() > 4)
+      stepInputs.emplace_back(new TensorBase(inputs[4]->data() + t * batch, maskShape, device));
+    GRUFastForward(cur, stepInputs, final);
+
+    prev = cur;
+  }
+}
+
+void Att(Tensor out, Tensor va, Tensor context, Tensor state, Tensor coverage) {
+  int m = out->shape()[0] * out->shape()[2] * out->shape()[3];
+  int b = context->shape()[0];
+  int k = context->shape()[1];
+  int t = context->shape()[2];
+
+  for(int j = 0; j < m; ++j) {
+    const float* ctxRow = context->data() + (j % (b * t)) * k;
+    const float* stateRow = state->data() + (j / (b * t) + j % b) * k;
+    const float* covRow = coverage ? coverage->data() + (j % (b * t)) * k : nullptr;
+
+    float sum = 0;
+    for(int i = 0; i < k; ++i) {
+      float z = ctxRow[i] + stateRow[i];
+      if(covRow)
+        z += covRow[i];
+      sum += std::tanh(z) * va->data()[i];
+    }
+    out->data()[j] = sum;
+  }
+}
+
+void LocalWindow(Tensor out, const Tensor in, const Tensor mask, int center) {
+  int batch = in->shape()[0];
+  int cols = in->shape()[1];
+  int words = in->shape()[2];
+  int window = out->shape()[2];
+
+  for(int b = 0; b < batch; ++b) {
+    int length = words;
+    if(mask) {
+      length = 0;
+      for(int w = 0; w < words; ++w)
+        length += mask->data()[w * batch + b] != 0;
+    }
+    int first = std::max(0, std::min(center - window / 2, length - window));
+
+    for(int k = 0; k < window; ++k) {
+      float* row = out->data() + ((size_t)k * batch + b) * cols;
+      int w = first + k;
+      for(int c = 0; c < cols; ++c)
+        row[c] = w < words ? in->data()[((size_t)w * batch + b) * cols + c] : 0.f;
+    }
+  }
+}
+
+void LayerNormalization(Tensor out, Tensor in, Tensor gamma, Tensor beta, float eps) {
+  int rows = in->shape()[0] * in->shape()[2] * in->shape()[3];
+  int cols = in->shape()[1];
+
+  for(int j = 0; j < rows; ++j) {
+    float* so = out->data() + j * cols;
+    const float* sp = in->data() + j * cols;
+
+    float mean = rowSum(sp, cols) / cols;
+    float sqSum = 0;
+    for(int i = 0; i < cols; ++i)
+      sqSum += (sp[i] - mean) * (sp[i] - mean);
+    float sigma = std::sqrt(eps + sqSum / cols);
+
+    for(int i = 0; i < cols; ++i) {
+      float t = gamma->data()[i] * ((sp[i] - mean) / sigma);
+      if(beta)
+        t += beta->data()[i];
+      so[i] = t;
+    }
+  }
+}
+
+void FusedForward(const ElementProgram& program, Tensor out,
+                  const std::vector<Tensor>& inputs) {
+  float r[ElementProgram::MAX_REGISTERS];
+  int dims[4];
+  int length = out->shape().elements();
+  for(int i = 0; i < length; ++i) {
+    out->shape().dims(i, dims);
+    for(int k = 0; k < program.inputs; ++k)
+      r[k] = inputs[k]->data()[inputs[k]->shape().bindex(dims)];
+    program.forward(r);
+    out->data()[i] = r[program.inputs + program.ops - 1];
+  }
+}
+
+void FusedBackward(const ElementProgram& program, Tensor adj,
+                   const std::vector<Tensor>& inputs,
+                   const std::vector<Tensor>& grads) {
+  float r[ElementProgram::MAX_REGISTERS];
+  float g[ElementProgram::MAX_REGISTERS];
+  int dims[4];
+  int length = adj->shape().elements();
+  for(int i = 0; i < length; ++i) {
+    adj->shape().dims(i, dims);
+    for(int k = 0; k < program.inputs; ++k)
+      r[k] = inputs[k]->data()[inputs[k]->shape().bindex(dims)];
+    program.forward(r);
+    program.backward(r, g, adj->data()[i]);
+    for(int k = 0; k < program.inputs; ++k)
+      if(grads[k])
+        grads[k]->data()[grads[k]->shape().bindex(dims)] += g[k];
+  }
+}
+
+}
+}
@@ -0,0 +1,277 @@
+#pragma once
+
+// This file is part of the Marian toolkit.
+
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <vector>
+#include <algorithm>
+
+#include "tensors/tensor.h"
+#include "kernels/element_program.h"
+
+namespace marian {
+
+/**
+ * CPU implementations of the tensor operators in kernels/tensor_operators.h.
+ *
+ * The generic wrappers in tensor_operators.h dispatch here for tensors placed
+ * on CPU_DEVICE. Element functors are the same thrust placeholder expressions
+ * as on the GPU, their operators are host-callable. Tensors of identical shape
+ * take a contiguous loop the compiler can vectorize, broadcasting goes through
+ * Shape::bindex like the kernels. Only operators needed for inference have
+ * CPU versions, the gradient operators throw. The top-k of beam search
+ * (NthElement) has none either, CPU graphs only decode greedily with a
+ * single model.
+ *
+ * Prod and the softmax operators split their work across setThreads()
+ * threads, helpers of the calling thread which it creates on first use and
+ * which inherit its CPU affinity, so every decoder thread has its own.
+ */
+namespace cpu {
+
+/** @brief Threads of every matrix product and softmax, 1 by default */
+void setThreads(size_t threads);
+
+size_t threads();
+
+template <class Functor>
+void Element(Functor functor, Tensor out) {
+  float* o = out->data();
+  int length = out->shape().elements();
+  for(int i = 0; i < length; ++i)
+    o[i] = functor(o[i]);
+}
+
+template <class Functor>
+void Element(Functor functor, Tensor out, Tensor in) {
+  float* o = out->data();
+  const float* a = in->data();
+  int length = out->shape().elements();
+
+  if(out->shape() == in->shape()) {
+    for(int i = 0; i < length; ++i)
+      o[i] = functor(o[i], a[i]);
+  }
+  else {
+    int dims[4];
+    for(int i = 0; i < length; ++i) {
+      out->shape().dims(i, dims);
+      o[i] = functor(o[i], a[in->shape().bindex(dims)]);
+    }
+  }
+}
+
+template <class Functor>
+void Element(Functor functor, Tensor out, Tensor in1, Tensor in2) {
+  float* o = out->data();
+  const float* a = in1->data();
+  const float* b = in2->data();
+  int length = out->shape().elements();
+
+  if(out->shape() == in1->shape() && out->shape() == in2->shape()) {
+    for(int i = 0; i < length; ++i)
+      o[i] = functor(o[i], a[i], b[i]);
+  }
+  else {
+    int dims[4];
+    for(int i = 0; i < length; ++i) {
+      out->shape().dims(i, dims);
+      o[i] = functor(o[i],
+                     a[in1->shape().bindex(dims)],
+                     b[in2->shape().bindex(dims)]);
+    }
+  }
+}
+
+template <class Functor>
+void Element(Functor functor, Tensor out, Tensor in1, Tensor in2, Tensor in3) {
+  float* o = out->data();
+  const float* a = in1->data();
+  const float* b = in2->data();
+  const float* c = in3->data();
+  int length = out->shape().elements();
+
+  if(out->shape() == in1->shape() && out->shape() == in2->shape()
+     && out->shape() == in3->shape()) {
+    for(int i = 0; i < length; ++i)
+      o[i] = functor(o[i], a[i], b[i], c[i]);
+  }
+  else {
+    int dims[4];
+    for(int i = 0; i < length; ++i) {
+      out->shape().dims(i, dims);
+      o[i] = functor(o[i],
+                     a[in1->shape().bindex(dims)],
+                     b[in2->shape().bindex(dims)],
+                     c[in3->shape().bindex(dims)]);
+    }
+  }
+}
+
+inline Shape fullShape(Tensor out, const std::vector<Tensor>& ins) {
+  auto full = out->shape();
+  for(auto in : ins)
+    for(int i = 0; i < in->shape().size(); ++i)
+      full.set(i, std::max(full[i], in->shape()[i]));
+  return full;
+}
+
+// out += scale * sum over broadcast dimensions of functor(ins...)
+template <class Functor>
+void Add(Functor functor, Tensor out, Tensor in, float scale = 1.0) {
+  auto full = fullShape(out, {in});
+  float* o = out->data();
+  const float* a = in->data();
+  int dims[4];
+  for(int i = 0; i < full.elements(); ++i) {
+    full.dims(i, dims);
+    o[out->shape().bindex(dims)] += functor(a[in->shape().bindex(dims)]) * scale;
+  }
+}
+
+template <class Functor>
+void Add(Functor functor, Tensor out, Tensor in1, Tensor in2, float scale = 1.0) {
+  auto full = fullShape(out, {in1, in2});
+  float* o = out->data();
+  const float* a = in1->data();
+  const float* b = in2->data();
+  int dims[4];
+  for(int i = 0; i < full.elements(); ++i) {
+    full.dims(i, dims);
+    o[out->shape().bindex(dims)] += functor(a[in1->shape().bindex(dims)],
+                                            b[in2->shape().bindex(dims)]) * scale;
+  }
+}
+
+template <class Functor>
+void Add(Functor functor, Tensor out, Tensor in1, Tensor in2, Tensor in3) {
+  auto full = fullShape(out, {in1, in2, in3});
+  float* o = out->data();
+  const float* a = in1->data();
+  const float* b = in2->data();
+  const float* c = in3->data();
+  int dims[4];
+  for(int i = 0; i < full.elements(); ++i) {
+    full.dims(i, dims);
+    o[out->shape().bindex(dims)] += functor(a[in1->shape().bindex(dims)],
+                                            b[in2->shape().bindex(dims)],
+                                            c[in3->shape().bindex(dims)]);
+  }
+}
+
+template <class Functor>
+void Pick(Functor functor, Tensor out, Tensor picks) {
+  float* o = out->data();
+  const float* p = picks->data();
+  int dims[4];
+  for(int i = 0; i < out->shape().elements(); ++i) {
+    out->shape().dims(i, dims);
+    o[i] = functor(o[i], (float)(dims[1] == (int)p[dims[0]]));
+  }
+}
+
+template <class Functor>
+void Pick(Functor functor, Tensor out, Tensor in, Tensor picks) {
+  float* o = out->data();
+  const float* a = in->data();
+  const float* p = picks->data();
+  int dims[4];
+  for(int i = 0; i < out->shape().elements(); ++i) {
+    out->shape().dims(i, dims);
+    o[i] = functor(o[i], a[in->shape().bindex(dims)],
+                   (float)(dims[1] == (int)p[dims[0]]));
+  }
+}
+
+template <class Functor>
+void PickReduce(Functor functor, Tensor out, Tensor in, Tensor picks) {
+  float* o = out->data();
+  const float* a = in->data();
+  const float* p = picks->data();
+  std::fill(o, o + out->size(), 0.f);
+  int dims[4];
+  for(int i = 0; i < in->shape().elements(); ++i) {
+    in->shape().dims(i, dims);
+    o[out->shape().bindex(dims)] += functor(a[i], (float)(dims[1] == (int)p[dims[0]]));
+  }
+}
+
+template <class Functor>
+void Pick(Functor functor, Tensor out, Tensor in1, Tensor in2, Tensor picks) {
+  float* o = out->data();
+  const float* a = in1->data();
+  const float* b = in2->data();
+  const float* p = picks->data();
+  int dims[4];
+  for(int i = 0; i < out->shape().elements(); ++i) {
+    out->shape().dims(i, dims);
+    o[i] = functor(o[i], a[in1->shape().bindex(dims)], b[in2->shape().bindex(dims)],
+                   (float)(dims[1] == (int)p[dims[0]]));
+  }
+}
+
+float L2Norm(Tensor in);
+
+void Softmax(Tensor out, Tensor in, Tensor mask);
+void LogSoftmax(Tensor out, Tensor in);
+void Argmax(Tensor out, const Tensor in, int exclude);
+
+void CrossEntropyPick(Tensor out, Tensor in, Tensor pick);
+
+void Prod(Tensor C, const Tensor A, const Tensor B,
+          bool transA, bool transB, float beta);
+
+void ProdBatched(Tensor C, const Tensor A, const Tensor B,
+                 bool transA, bool transB, float beta);
+
+void QuantizeColumns(int8_t* out, float* scales, const Tensor in);
+
+void ProdInt8(Tensor C, const Tensor A, const Tensor B, float beta,
+              const int8_t* quantB, const float* scalesB);
+
+void CopyRows(Tensor out, const Tensor in, const Tensor indices);
+
+void CopyCols(Tensor out, const Tensor in, const Tensor indices);
+
+void Transpose(Tensor out, const Tensor in);
+
+void Concatenate(Tensor out, const std::vector<Tensor>& inputs, int ax);
+
+void GRUFastForward(Tensor out, const std::vector<Tensor>& inputs, bool final);
+
+void GRUSequenceForward(Tensor out, const std::vector<Tensor>& inputs, bool reverse, bool final);
+
+void Att(Tensor out, Tensor va, Tensor context, Tensor state, Tensor coverage);
+
+void LocalWindow(Tensor out, const Tensor in, const Tensor mask, int center);
+
+void LayerNormalization(Tensor out, Tensor in, Tensor gamma, Tensor beta, float eps);
+
+void FusedForward(const ElementProgram& program, Tensor out,
+                  const std::vector<Tensor>& inputs);
+
+void FusedBackward(const ElementProgram& program, Tensor adj,
+                   const std::vector<Tensor>& inputs,
+                   const std::vector<Tensor>& grads);
+
+}
+
+}
@@ -88,6 +88,175 @@ Expr attOps(Expr va, Expr context, Expr state, Expr coverage=nullptr) {
                  {dimWords, dimBatch, 1, dimBeam});
 }
 
+/**
+ * The  window  words of every sentence around word  center , see
+ * LocalWindow(). Children are the input and optionally the source mask,
+ * which places the windows of sentences shorter than the batch.
+ */
+struct LocalWindowNodeOp : public NaryNodeOp {
+  int center_;
+
+  LocalWindowNodeOp(const std::vector<Expr>& nodes, int center, int window)
+    : NaryNodeOp(nodes, keywords::shape=newShape(nodes[0], window)),
+      center_(center) {}
+
+  Shape newShape(Expr a, int window) {
+    Shape shape = a->shape();
+    UTIL_THROW_IF2(shape[3] != 1, "Local windows of beams are not supported");
+    shape.set(2, window);
+    return shape;
+  }
+
+  NodeOps forwardOps() {
+    return {
+      NodeOp(LocalWindow(val_,
+                         children_[0]->val(),
+                         children_.size() == 2 ? children_[1]->val() : nullptr,
+                         center_))
+    };
+  }
+
+  NodeOps backwardOps() {
+    return {
+      NodeOp(LocalWindowGrad(children_[0]->grad(),
+                             adj_,
+                             children_.size() == 2 ? children_[1]->val() : nullptr,
+                             center_))
+    };
+  }
+
+  const std::string type() {
+    return "local-window";
+  }
+
+  const std::string color() {
+    return "orange";
+  }
+
+  virtual size_t hash() {
+    if(!hash_) {
+      hash_ = NaryNodeOp::hash();
+      boost::hash_combine(hash_, center_);
+      boost::hash_combine(hash_, shape()[2]);
+    }
+    return hash_;
+  }
+};
+
+Expr localWindow(Expr a, Expr mask, int center, int window) {
+  std::vector<Expr> nodes{a};
+  if(mask)
+    nodes.push_back(mask);
+  return Expression<LocalWindowNodeOp>(nodes, center, window);
+}
+
+/**
+ * Rows in fp16, two values per float, see PackHalf(). Forward only, for
+ * tensors that are kept during decoding.
+ */
+struct PackHalfNodeOp : public UnaryNodeOp {
+  PackHalfNodeOp(Expr a)
+    : UnaryNodeOp(a, keywords::shape=newShape(a)) {}
+
+  Shape newShape(Expr a) {
+    Shape shape = a->shape();
+    shape.set(1, (shape[1] + 1) / 2);
+    return shape;
+  }
+
+  NodeOps forwardOps() {
+    return { NodeOp(PackHalf(val_, children_[0]->val())) };
+  }
+
+  NodeOps backwardOps() {
+    UTIL_THROW2("fp16 packing has no backward pass");
+    return {};
+  }
+
+  const std::string type() {
+    return "pack-half";
+  }
+};
+
+/** @brief Rows of  cols  floats from a PackHalfNodeOp */
+struct UnpackHalfNodeOp : public UnaryNodeOp {
+  UnpackHalfNodeOp(Expr a, int cols)
+    : UnaryNodeOp(a, keywords::shape=newShape(a, cols)) {}
+
+  Shape newShape(Expr a, int cols) {
+    Shape shape = a->shape();
+    shape.set(1, cols);
+    return shape;
+  }
+
+  NodeOps forwardOps() {
+    return { NodeOp(UnpackHalf(val_, children_[0]->val())) };
+  }
+
+  NodeOps backwardOps() {
+    UTIL_THROW2("fp16 unpacking has no backward pass");
+    return {};
+  }
+
+  const std::string type() {
+    return "unpack-half";
+  }
+};
+
+/**
+ * Energies, masked softmax and context of all beams in one node, see
+ * AttFused(). Children are va, mappedContext, mappedState, context and
+ * optionally the source mask. With  half , mappedContext and context are
+ * packed fp16 and  dimContext  is the width of the unpacked context. Forward
+ * only, used by GlobalAttention in inference mode.
+ */
+struct FusedAttentionNodeOp : public NaryNodeOp {
+  bool half_;
+
+  FusedAttentionNodeOp(const std::vector<Expr>& nodes,
+                       bool half = false,
+                       int dimContext = 0)
+    : NaryNodeOp(nodes, keywords::shape=newShape(nodes, half, dimContext)),
+      half_(half) {}
+
+  Shape newShape(const std::vector<Expr>& nodes, bool half, int dimContext) {
+    return {nodes[1]->shape()[0], half ? dimContext : nodes[3]->shape()[1],
+            1, nodes[2]->shape()[3]};
+  }
+
+  NodeOps forwardOps() {
+    return {
+      NodeOp(AttFused(val_,
+                      children_[0]->val(),
+                      children_[1]->val(),
+                      children_[2]->val(),
+                      children_[3]->val(),
+                      children_.size() == 5 ? children_[4]->val() : nullptr,
+                      half_))
+    };
+  }
+
+  NodeOps backwardOps() {
+    UTIL_THROW2("Fused attention has no backward pass");
+    return {};
+  }
+
+  const std::string type() {
+    return "Att-fused";
+  }
+
+  const std::string color() {
+    return "yellow";
+  }
+};
+
+/**
+ * Additive attention over the source words. With keywords::window > 0 it is
+ * local attention (Luong et al., 2015, local-m): target step t attends only
+ * to the  window  words around source word t of every sentence, so each step
+ * costs the window instead of the source length. Sources not longer than
+ * the window are attended globally, which is the same.
+ */
 class GlobalAttention {
   private:
     Expr Wa_, ba_, Ua_, va_;
@@ -95,20 +264,45 @@ class GlobalAttention {
     Expr gammaContext_, betaContext_;
     Expr gammaState_, betaState_;
 
+    std::string prefix_;
     Ptr<EncoderState> encState_;
     Expr softmaxMask_;
     Expr mappedContext_;
     std::vector<Expr> contexts_;
     std::vector<Expr> alignments_;
     bool layerNorm_;
+    int window_;
 
     float dropout_;
     Expr contextDropped_;
-    Expr dropMaskContext_;
-    Expr dropMaskState_;
+    size_t dropSeedState_;
 
     Expr cov_;
 
+    // decoding with fp16 context, see ExpressionGraph::setHalfContext(): only
+    // the packed context and projection are kept, the fp32 ones are dropped
+    bool half_{false};
+    Expr halfContext_;
+    Expr halfMapped_;
+    int dimContext_;
+
+    Expr project() {
+      if(layerNorm_)
+        return layer_norm(dot(contextDropped_, Ua_), gammaContext_, ba_);
+      return affine(contextDropped_, Ua_, ba_);
+    }
+
+    static Expr softmaxMask(Expr mask) {
+      if(!mask)
+        return nullptr;
+      Shape shape = { mask->shape()[2], mask->shape()[0] };
+      return transpose(reshape(mask, shape));
+    }
+
+    void setSoftmaxMask() {
+      softmaxMask_ = softmaxMask(encState_->mask);
+    }
+
   public:
 
     template <typename ...Args>
@@ -116,12 +310,15 @@ class GlobalAttention {
               Ptr<EncoderState> encState,
               int dimDecState,
               Args ...args)
-     : encState_(encState),
+     : prefix_(prefix),
+       encState_(encState),
        contextDropped_(encState->context),
        layerNorm_(Get(keywords::normalize, false, args...)),
+       window_(Get(keywords::window, 0, args...)),
        cov_(Get(keywords::coverage, nullptr, args...)) {
 
       int dimEncState = encState_->context->shape()[1];
+      dimContext_ = dimEncState;
 
       auto graph = encState_->context->graph();
 
@@ -136,55 +333,142 @@ class GlobalAttention {
 
       dropout_ = Get(keywords::dropout_prob, 0.0f, args...);
       if(dropout_> 0.0f) {
-        dropMaskContext_ = graph->dropout(dropout_, {1, dimEncState});
-        dropMaskState_ = graph->dropout(dropout_, {1, dimDecState});
+        contextDropped_ = dropout(contextDropped_, dropout_, {1, dimEncState},
+                                  graph->dropoutSeed());
+        dropSeedState_ = graph->dropoutSeed();
       }
 
-      if(dropMaskContext_)
-        contextDropped_ = dropout(contextDropped_, keywords::mask=dropMaskContext_);
-
       if(layerNorm_) {
         gammaContext_ = graph->param(prefix + "_att_gamma1", {1, dimEncState},
                                      keywords::init=inits::from_value(1.0));
         gammaState_ = graph->param(prefix + "_att_gamma2", {1, dimEncState},
                                    keywords::init=inits::from_value(1.0));
+      }
+
+      half_ = graph->getInference() && graph->getHalfContext()
+              && !isCPU(graph->getDevice()) && dropout_ == 0.0f;
+      if(half_) {
+        // packed once per encoder state and shared like the projections
+        auto& context = encState_->projections["context_fp16"];
+        if(!context)
+          context = Expression<PackHalfNodeOp>(encState_->context);
+        halfContext_ = context;
+        auto& mapped = encState_->projections[prefix_ + "_fp16"];
+        if(!mapped)
+          mapped = Expression<PackHalfNodeOp>(project());
+        halfMapped_ = mapped;
+        contextDropped_ = nullptr;
+        setSoftmaxMask();
+        return;
+      }
 
-        mappedContext_ = layer_norm(dot(contextDropped_, Ua_), gammaContext_, ba_);
+      // a dropped out context is projected anew by every attention object
+      auto cached = encState_->projections.find(prefix_);
+      if(dropout_ == 0.0f && cached != encState_->projections.end()) {
+        mappedContext_ = cached->second;
       }
       else {
-        mappedContext_ = affine(contextDropped_, Ua_, ba_);
+        mappedContext_ = project();
+        if(dropout_ == 0.0f)
+          encState_->projections[prefix_] = mappedContext_;
       }
 
-      auto softmaxMask = encState_->mask;
-      if(softmaxMask) {
-        Shape shape = { softmaxMask->shape()[2],
-                        softmaxMask->shape()[0] };
-        softmaxMask_ = transpose(reshape(softmaxMask, shape));
+      setSoftmaxMask();
+    }
+
+    /**
+     * @brief Keeps the given sentences of the encoder state, in this order.
+     * Used by the decoder to drop finished sentences, the projected context
+     * is gathered instead of recomputed.
+     */
+    void select(const std::vector<size_t>& batchIndices) {
+      auto mask = encState_->mask ? select_batch(encState_->mask, batchIndices) : nullptr;
+      if(half_) {
+        encState_ = New<EncoderState>(EncoderState{nullptr, mask});
+        halfContext_ = select_batch(halfContext_, batchIndices);
+        halfMapped_ = select_batch(halfMapped_, batchIndices);
+        encState_->projections["context_fp16"] = halfContext_;
+        encState_->projections[prefix_ + "_fp16"] = halfMapped_;
+        setSoftmaxMask();
+        return;
       }
+
+      encState_ = New<EncoderState>(EncoderState{
+        select_batch(encState_->context, batchIndices), mask});
+
+      contextDropped_ = select_batch(contextDropped_, batchIndices);
+      mappedContext_ = select_batch(mappedContext_, batchIndices);
+      if(dropout_ == 0.0f)
+        encState_->projections[prefix_] = mappedContext_;
+      setSoftmaxMask();
     }
 
     Expr apply(Expr state) {
       using namespace keywords;
 
-      int dimBatch = contextDropped_->shape()[0];
-      int srcWords = contextDropped_->shape()[2];
+      Expr sizes = half_ ? halfMapped_ : contextDropped_;
+      int dimBatch = sizes->shape()[0];
+      int srcWords = sizes->shape()[2];
       int dimBeam  = state->shape()[3];
 
-      if(dropMaskState_)
-        state = dropout(state, keywords::mask=dropMaskState_);
+      if(dropout_ > 0.0f)
+        state = dropout(state, dropout_, {1, state->shape()[1]}, dropSeedState_);
 
       auto mappedState = dot(state, Wa_);
       if(layerNorm_)
         mappedState = layer_norm(mappedState, gammaState_);
 
-      auto attReduce = attOps(va_, mappedContext_, mappedState);
+      Expr mappedContext = half_ ? halfMapped_ : mappedContext_;
+      Expr context = half_ ? halfContext_ : encState_->context;
+      Expr mask = encState_->mask;
+      Expr attMask = softmaxMask_;
+
+      // local attention, the window of this step is all that is read below
+      if(window_ > 0 && srcWords > window_) {
+        int center = contexts_.size();
+        mappedContext = localWindow(mappedContext, encState_->mask, center, window_);
+        context = localWindow(context, encState_->mask, center, window_);
+        if(mask)
+          mask = localWindow(mask, encState_->mask, center, window_);
+        attMask = softmaxMask(mask);
+        srcWords = window_;
+      }
+
+      // decoding: read the encoder context once per sentence for all beams
+      auto graph = state->graph();
+      if(graph->getInference() && !isCPU(graph->getDevice())
+         && dimBeam <= ATT_BEAMS && srcWords * dimBeam <= ATT_MAX_ALIGNMENTS) {
+        std::vector<Expr> nodes{va_, mappedContext, mappedState, context};
+        if(mask)
+          nodes.push_back(mask);
+        auto alignedSource = Expression<FusedAttentionNodeOp>(nodes, half_, dimContext_);
+        contexts_.push_back(alignedSource);
+        return alignedSource;
+      }
+
+      // too many beams or words for the fused kernel, fp16 is unpacked per step
+      if(half_) {
+        mappedContext = Expression<UnpackHalfNodeOp>(mappedContext, mappedState->shape()[1]);
+        context = Expression<UnpackHalfNodeOp>(context, dimContext_);
+      }
+
+      auto attReduce = attOps(va_, mappedContext, mappedState);
 
       // @TODO: horrible ->
-      auto e = reshape(transpose(softmax(transpose(attReduce), softmaxMask_)),
+      auto e = reshape(transpose(softmax(transpose(attReduce), attMask)),
                        {dimBatch, 1, srcWords, dimBeam});
       // <- horrible
 
-      auto alignedSource = weighted_average(encState_->context, e, axis=2);
+      Expr alignedSource;
+      if(dimBatch == 1) {
+        // single sentence, e.g. in beam search: the context of all beam entries
+        // is one matrix product, the softmax weights already sum to one
+        alignedSource = dot(reshape(e, {1, srcWords, 1, dimBeam}),
+                            reshape(context, {srcWords, dimContext_}));
+      }
+      else {
+        alignedSource = weighted_average(context, e, axis=2);
+      }
 
       contexts_.push_back(alignedSource);
       alignments_.push_back(e);
@@ -196,7 +480,7 @@ class GlobalAttention {
     }
 
     int outputDim() {
-      return encState_->context->shape()[1];
+      return dimContext_;
     }
 };
 
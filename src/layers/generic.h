@@ -1,5 +1,9 @@
 #pragma once
 
+#include <cmath>
+#include <random>
+#include <unordered_map>
+
 #include "common/definitions.h"
 #include "graph/expression_graph.h"
 #include "graph/expression_operators.h"
@@ -163,18 +167,112 @@ namespace marian {
 
       template <typename ...Args>
       Expr operator()(Expr in, Expr picks, Args ...args) {
+        return total(cross_entropy(in, picks), args...);
+      }
+
+      /**
+       * @brief The cost of the output layer  in * W + b  without holding its
+       * logits, see sharded_cross_entropy()
+       */
+      template <typename ...Args>
+      Expr operator()(Expr in, Expr W, Expr b, Expr picks, int shards, int chunks, Args ...args) {
+        return total(sharded_cross_entropy(in, W, b, picks, shards, chunks), args...);
+      }
+
+      /**
+       * @brief The cost of the cross-entropies  ce  of single words, shaped
+       * like the mask, e.g. computed elsewhere for some positions only
+       */
+      template <typename ...Args>
+      Expr words(Expr ce, Args ...args) {
+        return total(ce, args...);
+      }
+
+    protected:
+      template <typename ...Args>
+      Expr total(Expr ce, Args ...args) {
         auto mask = Get(keywords::mask, nullptr, args...);
 
-        auto ce = cross_entropy(in, picks);
-        
         if(mask)
           ce = ce * mask;
 
-        auto cost = mean(sum(ce, keywords::axis=2),
-                         keywords::axis=0);
+        // kept for scoring sentences and words, see Scorer
+        auto sentences = sum(ce, keywords::axis=2);
+        name(ce, name_ + "_words");
+        name(sentences, name_ + "_sentences");
+
+        auto cost = mean(sentences, keywords::axis=0);
         name(cost, name_);
         return cost;
       }
 
   };
+
+  /**
+   * @brief Sampled softmax cost of the output layer  in * W + b  for training
+   * with large vocabularies (Jean et al., 2015). The softmax runs over the
+   * target words  picks  of the batch plus  samples  negatives shared by all
+   * rows, drawn from a log-uniform proposal over word ids, which are sorted by
+   * frequency. The logit of each candidate is corrected by the log of its
+   * probability to be among the candidates, 1 for the targets. The samples
+   * are drawn with a fresh seed of the graph.
+   */
+  class SampledCrossEntropyCost : public CrossEntropyCost {
+    public:
+      SampledCrossEntropyCost(const std::string name)
+       : CrossEntropyCost(name) {}
+
+      /**
+       * With transposed=true the weights  W  are stored vocabulary by input,
+       * e.g. tied target embeddings, and rows of them are sampled
+       */
+      template <typename ...Args>
+      Expr operator()(Expr in, Expr W, Expr b,
+                      const std::vector<size_t>& picks,
+                      size_t samples,
+                      Args ...args) {
+        using namespace keywords;
+        auto graph = in->graph();
+        bool transW = Get(keywords::transposed, false, args...);
+        int dimVoc = W->shape()[transW ? 0 : 1];
+
+        std::unordered_map<size_t, size_t> position;
+        std::vector<size_t> words;
+        std::vector<float> corrections;
+        auto candidate = [&](size_t word, float correction) {
+          if(position.emplace(word, words.size()).second) {
+            words.push_back(word);
+            corrections.push_back(correction);
+          }
+        };
+        for(auto word : picks)
+          candidate(word, 0.f);
+
+        std::mt19937 rng(graph->dropoutSeed());
+        std::uniform_real_distribution<double> uniform(0, 1);
+        double range = std::log(dimVoc + 1.0);
+        for(size_t i = 0; i < samples; ++i) {
+          size_t word = std::min((size_t)dimVoc - 1,
+                                 (size_t)std::exp(uniform(rng) * range) - 1);
+          // probability to be drawn at least once in  samples  draws
+          double p = (std::log(word + 2.0) - std::log(word + 1.0)) / range;
+          double q = -std::expm1(samples * std::log1p(-p));
+          candidate(word, -std::log(q));
+        }
+
+        int dimCand = words.size();
+        auto Wc = transW ? rows(W, words) : cols(W, words);
+        auto bc = cols(b, words)
+                  + graph->constant(shape={1, dimCand},
+                                    init=inits::from_vector(corrections));
+
+        std::vector<float> columns;
+        for(auto word : picks)
+          columns.push_back(position[word]);
+        auto pickIdx = graph->constant(shape={(int)columns.size(), 1},
+                                       init=inits::from_vector(columns));
+
+        return total(cross_entropy(affine(in, Wc, bc, false, transW), pickIdx), args...);
+      }
+  };
 }
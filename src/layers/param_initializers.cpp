@@ -1,10 +1,14 @@
 
 #include <random>
 #include <algorithm>
+#include <atomic>
 #include <iterator>
 #include <stdint.h>
 
 #include "param_initializers.h"
+#include "tensors/tensor_allocator.h"
+#include "kernels/cuda_helpers.h"
+#include "kernels/random.h"
 #include "svd/svd.h"
 
 namespace marian {
@@ -49,21 +53,46 @@ std::function<void(Tensor)> diag(float val) {
   };
 }
 
+/**
+ * Seed of the next tensor initialized on a device, derived from the seed of
+ * the run and the tensors initialized before, so every tensor draws its own
+ * numbers, which are generated where the tensor lives.
+ */
+static size_t deviceSeed() {
+  static std::atomic<size_t> tensors{0};
+  size_t seed = Config::seed;
+  return seed * 0x9E3779B97F4A7C15ULL + tensors++;
+}
+
+static void uniformIn(Tensor t, float a, float b) {
+  if(isCPU(t->getDevice()))
+    distribution<std::uniform_real_distribution<float>>(t, a, b);
+  else
+    RandomUniform(t, a, b, deviceSeed());
+}
+
+static void normalIn(Tensor t, float mean, float stddev) {
+  if(isCPU(t->getDevice()))
+    distribution<std::normal_distribution<float>>(t, mean, stddev);
+  else
+    RandomNormal(t, mean, stddev, deviceSeed());
+}
+
 std::function<void(Tensor)> normal(float scale, bool orto) {
   return [scale](Tensor t) {
-    distribution<std::normal_distribution<float>>(t, 0, scale);
+    normalIn(t, 0, scale);
   };
 }
 
 std::function<void(Tensor)> uniform(float scale) {
   return [scale](Tensor t) {
-    distribution<std::uniform_real_distribution<float>>(t, -scale, scale);
+    uniformIn(t, -scale, scale);
   };
 }
 
 void glorot_uniform(Tensor t) {
   float scale = sqrtf( 6.0f / (t->shape()[0] + t->shape()[1]) );
-  distribution<std::uniform_real_distribution<float>>(t, -scale, scale);
+  uniformIn(t, -scale, scale);
 }
 
 void xorshift(Tensor t) {
@@ -75,7 +104,7 @@ void xorshift(Tensor t) {
 
 void glorot_normal(Tensor t) {
   float scale = sqrtf( 2.0f / (t->shape()[0] + t->shape()[1]) );
-  distribution<std::normal_distribution<float>>(t, 0, scale);
+  normalIn(t, 0, scale);
 }
 
 void svd(std::vector<float>& vec, Shape shape) {
@@ -98,6 +127,12 @@ void svd(std::vector<float>& vec, Shape shape) {
 }
 
 void ortho(Tensor t) {
+  if(!isCPU(t->getDevice())) {
+    RandomNormal(t, 0, 1, deviceSeed());
+    Orthogonalize(t);
+    return;
+  }
+
   std::vector<float> vec(t->size());
   distribution<std::normal_distribution<float>>(vec, 0, 1);
   svd(vec, t->shape());
@@ -105,8 +140,18 @@ void ortho(Tensor t) {
 }
 
 std::function<void(Tensor)> from_vector(const std::vector<float>& v) {
+  // batch inputs and indices of every step, read by the node's own kernels
+  // queued behind the upload on the same stream
   return [v](Tensor t) {
-    t->set(v);
+    t->setAsync(v);
+  };
+}
+
+std::function<void(Tensor)> from_device(const float* data) {
+  return [data](Tensor t) {
+    cudaSetDevice(t->getDevice());
+    CUDA_CHECK(cudaMemcpyAsync(t->data(), data, t->size() * sizeof(float),
+                               cudaMemcpyDefault, currentStream()));
   };
 }
 
@@ -124,6 +169,29 @@ std::function<void(Tensor)> from_numpy(const cnpy::NpyArray& np) {
   };
 }
 
+std::function<void(Tensor)> padded(std::function<void(Tensor)> init, int cols, float fill) {
+  return [init, cols, fill](Tensor t) {
+    int rows = t->shape()[0];
+    int width = t->shape()[1];
+
+    std::vector<float> real(rows * cols, 0.f);
+    if(init) {
+      auto alloc = New<TensorAllocator>(t->getDevice());
+      alloc->reserveExact(rows * cols);
+      Tensor unpadded;
+      alloc->allocate(unpadded, {rows, cols});
+      init(unpadded);
+      unpadded >> real;
+    }
+
+    std::vector<float> v(rows * width, fill);
+    for(int i = 0; i < rows; ++i)
+      std::copy(real.begin() + i * cols, real.begin() + (i + 1) * cols,
+                v.begin() + i * width);
+    t->set(v);
+  };
+}
+
 }
 
 } // namespace marian
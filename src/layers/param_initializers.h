@@ -55,8 +55,17 @@ void glorot_normal(Tensor t);
 
 std::function<void(Tensor)> from_vector(const std::vector<float>& v);
 
+/** @brief Copies t->size() floats from device memory, ordered on the current stream */
+std::function<void(Tensor)> from_device(const float* data);
+
 std::function<void(Tensor)> from_numpy(const cnpy::NpyArray& np);
 
+/**
+ * @brief Runs  init  on the first  cols  columns of a wider tensor and sets
+ * the remaining columns to  fill , see ExpressionGraph::padColumns()
+ */
+std::function<void(Tensor)> padded(std::function<void(Tensor)> init, int cols, float fill);
+
 }
 
 } // namespace marian
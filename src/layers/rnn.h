@@ -54,6 +54,25 @@ class Tanh {
 
 /***************************************************************/
 
+/**
+ * Runs a cell over all timesteps of xW at once if it has a fused implementation,
+ * returns the states of all steps or nullptr otherwise. See the GRU overload.
+ */
+template <class Cell>
+Expr applySequence(Ptr<Cell> cell, Expr xW, Expr state, Expr mask, bool reverse) {
+  return nullptr;
+}
+
+/**
+ * One step of a cell where only the first  active  rows of the batch hold
+ * sentences that have not ended. Cells that cannot skip the others compute
+ * all rows, see the GRU overload.
+ */
+template <class Cell>
+Expr applyStep(Ptr<Cell> cell, Expr xW, Expr state, Expr mask, size_t active) {
+  return mask ? cell->apply2(xW, state, mask) : cell->apply2(xW, state);
+}
+
 template <class Cell>
 class RNN : public Layer {
   public:
@@ -81,21 +100,37 @@ class RNN : public Layer {
       return cell_;
     }
 
+    /**
+     * Projects the whole input {dimBatch, dimInput, dimWords} with one product
+     * in apply1, every step then reads a view of it, see step(). Only the
+     * recurrent part runs per timestep.
+     */
     std::vector<Expr> apply(const Expr input, const Expr initialState,
                             const Expr mask = nullptr, bool reverse = false) {
-      auto xW = cell_->apply1(input);
+      return applySteps(cell_->apply1(input), initialState, mask, reverse);
+    }
+
+    /**
+     * With  active , for every timestep the number of leading rows that hold
+     * unfinished sentences as from SubBatch::activeRows(), the recurrence of
+     * a step only runs over those rows and the others carry their state.
+     */
+    std::vector<Expr> applySteps(const Expr xW, const Expr initialState,
+                                 const Expr mask = nullptr, bool reverse = false,
+                                 const std::vector<size_t>& active = {}) {
       std::vector<Expr> outputs;
       auto state = initialState;
-      for(size_t i = 0; i < input->shape()[2]; ++i) {
+      size_t dimBatch = xW->shape()[0];
+      for(size_t i = 0; i < xW->shape()[2]; ++i) {
         int j = i;
         if(reverse)
-          j = input->shape()[2] - i - 1;
+          j = xW->shape()[2] - i - 1;
 
-        if(mask)
-          state = cell_->apply2(step(xW, j), state, step(mask, j));
-        else
-          state = cell_->apply2(step(xW, j), state);
+        size_t rows = j < active.size() ? std::max(active[j], (size_t)1) : dimBatch;
+        state = applyStep(cell_, step(xW, j), state,
+                          mask ? step(mask, j) : nullptr, rows);
         outputs.push_back(state);
+        state->graph()->checkpoint(state, checkpoints::step);
       }
       return outputs;
     }
@@ -118,25 +153,34 @@ class RNN : public Layer {
       int dimInput = input->shape()[1];
 
       Expr mask = Get(keywords::mask, nullptr, args...);
+      auto active = Get(keywords::active_rows, std::vector<size_t>(), args...);
+
+      UTIL_THROW_IF2(direction_ == dir::bidirect,
+                     "Use BiRNN for bidirectional RNNs");
+      bool reverse = direction_ == dir::backward;
 
-      if(direction_ == dir::backward) {
-        auto states = apply(input, state, mask, true);
-        std::reverse(states.begin(), states.end());
+      Expr output;
+      auto xW = cell_->apply1(input);
+      if(auto all = applySequence(cell_, xW, state, mask, reverse)) {
+        // states of all steps in their natural order, the last one computed
+        // is the first step when running backwards
         if(outputLast_)
-          return states.back();
+          output = step(all, reverse ? 0 : all->shape()[2] - 1);
         else
-          return concatenate(states, keywords::axis=2);
-      }
-      else if(direction_ == dir::bidirect) {
-        UTIL_THROW2("Use BiRNN for bidirectional RNNs");
+          output = all;
       }
-      else { // assuming dir::forward
-        auto states = apply(input, state, mask, false);
+      else {
+        auto states = applySteps(xW, state, mask, reverse, active);
+        if(reverse)
+          std::reverse(states.begin(), states.end());
         if(outputLast_)
-          return states.back();
+          output = states.back();
         else
-          return concatenate(states, keywords::axis=2);
+          output = concatenate(states, keywords::axis=2);
       }
+
+      graph->checkpoint(output, checkpoints::layer);
+      return output;
     }
 };
 
@@ -174,9 +218,81 @@ class MLRNN : public Layer {
       }
     }
 
+    /**
+     * Wavefront order pays off if the graph runs independent nodes on several
+     * streams and the layers are built from single steps anyway
+     */
+    bool wavefront(Expr input) {
+      auto graph = input->graph();
+      return layers_ > 1 && graph->getStreams() > 1 && !graph->getPersistentRnn()
+             && graph->getCheckpointing() == checkpoints::none
+             && !rnns_[0]->outputLast_;
+    }
+
+    /**
+     * Builds all layers one timestep at a time, layer i at step t only reads
+     * layer i - 1 at step t instead of its whole output. The steps of a
+     * diagonal t + i then share a tape group, which a multi-stream graph runs
+     * concurrently, so the stack is O(T + L) steps deep instead of O(T * L).
+     * Layers above the first project their input per step.
+     */
+    template <typename ...Args>
+    std::tuple<Expr, std::vector<Expr>>
+    applyWavefront(Expr input, std::vector<Expr> states, Args ...args) {
+      Expr mask = Get(keywords::mask, nullptr, args...);
+      auto active = Get(keywords::active_rows, std::vector<size_t>(), args...);
+      bool reverse = rnns_[0]->direction_ == dir::backward;
+
+      size_t dimBatch = input->shape()[0];
+      size_t dimWords = input->shape()[2];
+      auto xW0 = rnns_[0]->getCell()->apply1(input);
+
+      std::vector<std::vector<Expr>> layerStates(layers_);
+      std::vector<Expr> outputs;
+      for(size_t k = 0; k < dimWords; ++k) {
+        size_t t = reverse ? dimWords - k - 1 : k;
+        size_t rows = t < active.size() ? std::max(active[t], (size_t)1) : dimBatch;
+        Expr stepMask = mask ? step(mask, t) : nullptr;
+
+        Expr below = step(input, t);
+        for(int i = 0; i < layers_; ++i) {
+          auto cell = rnns_[i]->getCell();
+          auto xW = i == 0 ? step(xW0, t) : cell->apply1(below);
+          auto prev = layerStates[i].empty() ? states[i] : layerStates[i].back();
+          auto state = applyStep(cell, xW, prev, stepMask, rows);
+          layerStates[i].push_back(state);
+
+          if(skip_ && (skipFirst_ || i > 0))
+            below = state + below;
+          else
+            below = state;
+        }
+        outputs.push_back(below);
+      }
+
+      if(reverse)
+        std::reverse(outputs.begin(), outputs.end());
+      std::vector<Expr> outStates;
+      for(auto& steps : layerStates) {
+        if(reverse)
+          std::reverse(steps.begin(), steps.end());
+        outStates.push_back(concatenate(steps, keywords::axis=2));
+      }
+      return std::make_tuple(concatenate(outputs, keywords::axis=2), outStates);
+    }
+
     template <typename ...Args>
     std::tuple<Expr, std::vector<Expr>>
     operator()(Expr input, Args ...args) {
+      if(wavefront(input)) {
+        auto graph = input->graph();
+        int dimBatch = input->shape()[0];
+        std::vector<Expr> states;
+        for(int i = 0; i < layers_; ++i)
+          states.push_back(graph->zeros(keywords::shape={dimBatch, dimState_}));
+        return applyWavefront(input, states, args...);
+      }
+
       Expr output;
       std::vector<Expr> outStates;
       for(int i = 0; i < layers_; ++i) {
@@ -198,6 +314,9 @@ class MLRNN : public Layer {
     operator()(Expr input,
                std::vector<Expr> states,
                Args ...args) {
+      if(wavefront(input))
+        return applyWavefront(input, states, args...);
+
       Expr output;
       std::vector<Expr> outStates;
       for(int i = 0; i < layers_; ++i) {
@@ -279,28 +398,14 @@ struct GRUFastNodeOp : public NaryNodeOp {
       final_(final) {}
 
   NodeOps forwardOps() {
-    std::vector<Tensor> inputs;
-    for(auto child : children_)
-      inputs.push_back(child->val());
-
     return {
-      NodeOp(GRUFastForward(val_, inputs, final_))
+      NodeOp(GRUFastForward(val_, childValues(), final_))
     };
   }
 
   NodeOps backwardOps() {
-    std::vector<Tensor> inputs;
-    std::vector<Tensor> outputs;
-    for(auto child : children_) {
-      inputs.push_back(child->val());
-      if(child->trainable())
-        outputs.push_back(child->grad());
-      else
-        outputs.push_back(nullptr);
-    }
-
     return {
-      NodeOp(GRUFastBackward(outputs, inputs, adj_, final_))
+      NodeOp(GRUFastBackward(childGrads(), childValues(), adj_, final_))
     };
   }
 
@@ -323,6 +428,62 @@ Expr gruOps(const std::vector<Expr>& nodes, bool final = false) {
   return Expression<GRUFastNodeOp>(nodes, final);
 }
 
+/**
+ * All timesteps of a GRU layer, the recurrence runs in one persistent kernel.
+ * Children are the initial state, xW of all steps, U, b and optionally the mask.
+ */
+struct GRUSequenceNodeOp : public NaryNodeOp {
+  bool reverse_;
+  bool final_;
+
+  template <typename ...Args>
+  GRUSequenceNodeOp(const std::vector<Expr>& nodes, bool reverse, bool final, Args ...args)
+    : NaryNodeOp(nodes,
+                 keywords::shape=newShape(nodes),
+                 args...),
+      reverse_(reverse),
+      final_(final) {}
+
+  Shape newShape(const std::vector<Expr>& nodes) {
+    Shape xW = nodes[1]->shape();
+    return {xW[0], xW[1] / 3, xW[2]};
+  }
+
+  NodeOps forwardOps() {
+    return {
+      NodeOp(GRUSequenceForward(val_, childValues(), reverse_, final_))
+    };
+  }
+
+  NodeOps backwardOps() {
+    return {
+      NodeOp(GRUSequenceBackward(getCublasHandle(), childGrads(), childValues(),
+                                 val_, adj_, reverse_, final_))
+    };
+  }
+
+  // do not check if node is trainable
+  virtual void runBackward(const NodeOps& ops) {
+    for(auto&& op : ops)
+      op();
+  }
+
+  virtual size_t hash() {
+    size_t seed = NaryNodeOp::hash();
+    boost::hash_combine(seed, reverse_);
+    boost::hash_combine(seed, final_);
+    return seed;
+  }
+
+  const std::string type() {
+    return "GRU-sequence";
+  }
+
+  const std::string color() {
+    return "yellow";
+  }
+};
+
 /***************************************************************/
 
 class GRU {
@@ -337,8 +498,12 @@ class GRU {
     bool layerNorm_;
     float dropout_;
 
-    Expr dropMaskX_;
-    Expr dropMaskS_;
+    // masks are regenerated from these seeds inside the dropout kernels,
+    // the same seed at every time step gives variational dropout
+    size_t dropSeedX_;
+    size_t dropSeedS_;
+    int dimInput_;
+    int dimState_;
 
   public:
 
@@ -347,32 +512,47 @@ class GRU {
         const std::string prefix,
         int dimInput,
         int dimState,
-        Args ...args) : prefix_(prefix) {
-
-      auto U = graph->param(prefix + "_U", {dimState, 2 * dimState},
-                               keywords::init=inits::glorot_uniform);
-      auto W = graph->param(prefix + "_W", {dimInput, 2 * dimState},
-                               keywords::init=inits::glorot_uniform);
-      auto b = graph->param(prefix + "_b", {1, 2 * dimState},
-                               keywords::init=inits::zeros);
-      auto Ux = graph->param(prefix + "_Ux", {dimState, dimState},
-                                keywords::init=inits::glorot_uniform);
-      auto Wx = graph->param(prefix + "_Wx", {dimInput, dimState},
-                                keywords::init=inits::glorot_uniform);
-      auto bx = graph->param(prefix + "_bx", {1, dimState},
-                                keywords::init=inits::zeros);
-
-      U_ = concatenate({U, Ux}, keywords::axis=1);
-      W_ = concatenate({W, Wx}, keywords::axis=1);
-      b_ = concatenate({b, bx}, keywords::axis=1);
+        Args ...args)
+    : prefix_(prefix), dimInput_(dimInput), dimState_(dimState) {
+
+      // a model converted by marian-freeze holds the concatenations as
+      // parameters, which are then neither rebuilt nor kept twice
+      U_ = graph->get(prefix + "_Ucat");
+      W_ = graph->get(prefix + "_Wcat");
+      b_ = graph->get(prefix + "_bcat");
+
+      if(U_ && W_ && b_) {
+        UTIL_THROW_IF2(U_->shape()[0] != dimState || U_->shape()[1] != 3 * dimState
+                       || W_->shape()[0] != dimInput || W_->shape()[1] != 3 * dimState
+                       || b_->shape()[1] != 3 * dimState,
+                       "Frozen parameters of " << prefix << " do not match the model");
+      }
+      else {
+        auto U = graph->param(prefix + "_U", {dimState, 2 * dimState},
+                                 keywords::init=inits::glorot_uniform);
+        auto W = graph->param(prefix + "_W", {dimInput, 2 * dimState},
+                                 keywords::init=inits::glorot_uniform);
+        auto b = graph->param(prefix + "_b", {1, 2 * dimState},
+                                 keywords::init=inits::zeros);
+        auto Ux = graph->param(prefix + "_Ux", {dimState, dimState},
+                                  keywords::init=inits::glorot_uniform);
+        auto Wx = graph->param(prefix + "_Wx", {dimInput, dimState},
+                                  keywords::init=inits::glorot_uniform);
+        auto bx = graph->param(prefix + "_bx", {1, dimState},
+                                  keywords::init=inits::zeros);
+
+        U_ = concatenate({U, Ux}, keywords::axis=1);
+        W_ = concatenate({W, Wx}, keywords::axis=1);
+        b_ = concatenate({b, bx}, keywords::axis=1);
+      }
 
       final_ = Get(keywords::final, false, args...);
       layerNorm_ = Get(keywords::normalize, false, args...);
 
       dropout_ = Get(keywords::dropout_prob, 0.0f, args...);
       if(dropout_> 0.0f) {
-        dropMaskX_ = graph->dropout(dropout_, {1, dimInput});
-        dropMaskS_ = graph->dropout(dropout_, {1, dimState});
+        dropSeedX_ = graph->dropoutSeed();
+        dropSeedS_ = graph->dropoutSeed();
       }
 
       if(layerNorm_) {
@@ -389,8 +569,8 @@ class GRU {
     }
 
     Expr apply1(Expr input) {
-      if(dropMaskX_)
-        input = dropout(input, keywords::mask=dropMaskX_);
+      if(dropout_ > 0.0f)
+        input = dropout(input, dropout_, {1, dimInput_}, dropSeedX_);
 
       auto xW = dot(input, W_);
 
@@ -399,12 +579,18 @@ class GRU {
       return xW;
     }
 
+    /**
+     * With  active  below the batch size the recurrent product only covers the
+     * first  active  rows of the state, the others keep their state.
+     */
     Expr apply2(Expr xW, Expr state,
-                Expr mask = nullptr) {
+                Expr mask = nullptr, size_t active = 0) {
 
       auto stateDropped = state;
-      if(dropMaskS_)
-        stateDropped = dropout(state, keywords::mask=dropMaskS_);
+      if(active > 0 && active < state->shape()[0])
+        stateDropped = step(state, 0, active);
+      if(dropout_ > 0.0f)
+        stateDropped = dropout(stateDropped, dropout_, {1, dimState_}, dropSeedS_);
 
       auto sU = dot(stateDropped, U_);
 
@@ -417,8 +603,33 @@ class GRU {
 
       return output;
     }
+
+    /**
+     * States of all steps of xW from one GRUSequenceNodeOp, nullptr if the
+     * graph does not use persistent RNNs or the recurrence is not a plain
+     * product, i.e. with layer normalization or dropout of the state.
+     */
+    Expr applySequence(Expr xW, Expr state, Expr mask, bool reverse) {
+      auto graph = xW->graph();
+      if(!graph->getPersistentRnn() || layerNorm_ || dropout_ > 0.0f)
+        return nullptr;
+
+      return mask ?
+        Expression<GRUSequenceNodeOp>(std::vector<Expr>({state, xW, U_, b_, mask}),
+                                      reverse, final_) :
+        Expression<GRUSequenceNodeOp>(std::vector<Expr>({state, xW, U_, b_}),
+                                      reverse, final_);
+    }
 };
 
+inline Expr applySequence(Ptr<GRU> cell, Expr xW, Expr state, Expr mask, bool reverse) {
+  return cell->applySequence(xW, state, mask, reverse);
+}
+
+inline Expr applyStep(Ptr<GRU> cell, Expr xW, Expr state, Expr mask, size_t active) {
+  return cell->apply2(xW, state, mask, active);
+}
+
 
 /***************************************************************/
 
@@ -29,10 +29,12 @@ class EncoderDL4MT : public EncoderBase {
       float dropoutRnn = inference_ ? 0 : options_->get<float>("dropout-rnn");
       float dropoutSrc = inference_ ? 0 : options_->get<float>("dropout-src");
 
-      auto xEmb = Embedding("Wemb", dimSrcVoc, dimSrcEmb)(graph);
+      auto xEmb = Embedding(sourceEmbeddings(options_, "Wemb"), dimSrcVoc, dimSrcEmb)(graph);
 
       Expr x, xMask;
       std::tie(x, xMask) = prepareSource(xEmb, batch, batchIdx);
+      // the recurrences skip the padding at the end of shorter sentences
+      auto active = (*batch)[batchIdx].activeRows();
 
       if(dropoutSrc) {
         int srcWords = x->shape()[2];
@@ -44,14 +46,14 @@ class EncoderDL4MT : public EncoderBase {
                           dimSrcEmb, dimEncState,
                           normalize=layerNorm,
                           dropout_prob=dropoutRnn)
-                         (x);
+                         (x, active_rows=active);
 
       auto xBw = RNN<GRU>(graph, prefix_ + "_r",
                           dimSrcEmb, dimEncState,
                           normalize=layerNorm,
                           direction=dir::backward,
                           dropout_prob=dropoutRnn)
-                         (x, mask=xMask);
+                         (x, mask=xMask, active_rows=active);
 
       auto xContext = concatenate({xFw, xBw}, axis=1);
       return New<EncoderState>(EncoderState{xContext, xMask});
@@ -78,6 +80,7 @@ class DecoderDL4MT : public DecoderBase {
       int dimTrgEmb = options_->get<int>("dim-emb");
       int dimDecState = options_->get<int>("dim-rnn");
       bool layerNorm = options_->get<bool>("layer-normalization");
+      int attWindow = options_->get<size_t>("att-window");
       bool skipDepth = options_->get<bool>("skip");
       size_t decoderLayers = options_->get<size_t>("layers-dec");
 
@@ -97,7 +100,8 @@ class DecoderDL4MT : public DecoderBase {
                                           encState,
                                           dimDecState,
                                           dropout_prob=dropoutRnn,
-                                          normalize=layerNorm);
+                                          normalize=layerNorm,
+                                          window=attWindow);
       RNN<CGRU> rnnL1(graph, "decoder",
                       dimTrgEmb, dimDecState,
                       attention_,
@@ -120,12 +124,15 @@ class DecoderDL4MT : public DecoderBase {
                             normalize=layerNorm)
                         (embeddings, outputLn, alignedContext);
 
-      auto logitsL2 = Dense("ff_logit_l2", dimTrgVoc)
-                        (logitsL1);
+      auto logitsL2 = outputLayer(logitsL1, dimTrgVoc);
 
       return std::make_tuple(logitsL2, statesOut);
     }
 
+    void selectSentences(const std::vector<size_t>& batchIndices) {
+      attention_->select(batchIndices);
+    }
+
 };
 
 class DL4MT : public Seq2Seq<EncoderDL4MT, DecoderDL4MT> {
@@ -139,8 +146,9 @@ class DL4MT : public Seq2Seq<EncoderDL4MT, DecoderDL4MT> {
       using namespace keywords;
 
       LOG(info, "Loading model from {}", name);
+      padOutput(graph);
 
-      auto numpy = cnpy::npz_load(name);
+      auto numpy = cnpy::npz_load(io::fetch(name));
 
       std::vector<std::string> parameters = {
         // Source word embeddings
@@ -193,6 +201,14 @@ class DL4MT : public Seq2Seq<EncoderDL4MT, DecoderDL4MT> {
         for(auto& p : parametersNorm)
           parameters.push_back(p);
 
+      // tied embeddings replace the output weights and the target embeddings
+      auto tied = [&](const std::string& name) {
+        return (name == "ff_logit_W" && tiedOutput(options_))
+               || (name == "Wemb_dec" && targetEmbeddings(options_) == "Wemb");
+      };
+      parameters.erase(std::remove_if(parameters.begin(), parameters.end(), tied),
+                       parameters.end());
+
       std::map<std::string, std::string> nameMap = {
         {"decoder_U", "decoder_cell1_U"},
         {"decoder_W", "decoder_cell1_W"},
@@ -248,34 +264,31 @@ class DL4MT : public Seq2Seq<EncoderDL4MT, DecoderDL4MT> {
     
       save(graph, name);
       
-      if(saveTranslatorConfig) {
-        YAML::Node amun;
-        auto vocabs = options_->get<std::vector<std::string>>("vocabs");
-        amun["source-vocab"] = vocabs[0];
-        amun["target-vocab"] = vocabs[1];
-        amun["devices"] = options_->get<std::vector<int>>("devices");
-        amun["normalize"] = true;
-        amun["beam-size"] = 12;
-        amun["relative-paths"] = false;
-        
-        amun["scorers"]["F0"]["path"] = name;
-        amun["scorers"]["F0"]["type"] = "Nematus";      
-        amun["weights"]["F0"] = 1.0f;
-        
-        OutputFileStream out(name + ".amun.yml");
-        (std::ostream&)out << amun;
-      }
+      if(saveTranslatorConfig)
+        this->saveTranslatorConfig(name);
     }
-    
-    void save(Ptr<ExpressionGraph> graph,
-              const std::string& name) {
 
-      LOG(info, "Saving model to {}", name);
-
-      unsigned shape[2];
-      std::string mode = "w";
+    void saveTranslatorConfig(const std::string& name) {
+      YAML::Node amun;
+      auto vocabs = options_->get<std::vector<std::string>>("vocabs");
+      amun["source-vocab"] = vocabs[0];
+      amun["target-vocab"] = vocabs[1];
+      amun["devices"] = options_->get<std::vector<int>>("devices");
+      amun["normalize"] = true;
+      amun["beam-size"] = 12;
+      amun["relative-paths"] = false;
+      
+      amun["scorers"]["F0"]["path"] = name;
+      amun["scorers"]["F0"]["type"] = "Nematus";      
+      amun["weights"]["F0"] = 1.0f;
+      
+      OutputFileStream out(name + ".amun.yml");
+      (std::ostream&)out << amun;
+    }
 
-      std::map<std::string, std::string> nameMap = {
+    /** @brief Nematus names of the parameters */
+    std::string savedName(const std::string& name) {
+      static const std::map<std::string, std::string> nameMap = {
         {"decoder_cell1_U", "decoder_U"},
         {"decoder_cell1_W", "decoder_W"},
         {"decoder_cell1_b", "decoder_b"},
@@ -301,34 +314,34 @@ class DL4MT : public Seq2Seq<EncoderDL4MT, DecoderDL4MT> {
         {"ff_logit_l2_b", "ff_logit_b"}
       };
 
-      cudaSetDevice(graph->getDevice());
+      auto it = nameMap.find(name);
+      return it == nameMap.end() ? name : it->second;
+    }
 
-      for(auto p : graph->params().getMap()) {
-        std::vector<float> v;
-        p.second->val() >> v;
+    void saveExtras(NpzWriter& npz) {
+      unsigned shape[1] = {1};
+      float ctt = 0;
+      npz.add("decoder_c_tt", &ctt, shape, 1);
+    }
+    
+    void save(Ptr<ExpressionGraph> graph,
+              const std::string& name) {
 
-        unsigned dim;
-        if(p.second->shape()[0] == 1) {
-          shape[0] = p.second->shape()[1];
-          dim = 1;
-        }
-        else {
-          shape[0] = p.second->shape()[0];
-          shape[1] = p.second->shape()[1];
-          dim = 2;
-        }
+      LOG(info, "Saving model to {}", name);
+
+      unsigned shape[2];
+      NpzWriter npz(name);
 
-        std::string pName = p.first;
-        if(nameMap.count(pName))
-          pName = nameMap[pName];
+      cudaSetDevice(graph->getDevice());
 
-        cnpy::npz_save(name, pName, v.data(), shape, dim, mode);
-        mode = "a";
+      for(auto p : graph->params().getMap()) {
+        unsigned dim;
+        auto v = graph->savedValues(p.first, p.second, shape, dim);
+        npz.add(savedName(p.first), v.data(), shape, dim);
       }
 
-      float ctt = 0;
-      shape[0] = 1;
-      cnpy::npz_save(name, "decoder_c_tt", &ctt, shape, 1, mode);
+      saveExtras(npz);
+      npz.close();
     }
 };
 
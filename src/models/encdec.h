@@ -1,5 +1,8 @@
 #pragma once
 
+#include <algorithm>
+#include <map>
+
 #include "data/corpus.h"
 #include "training/config.h"
 #include "graph/expression_graph.h"
@@ -7,12 +10,41 @@
 #include "layers/param_initializers.h"
 #include "layers/generic.h"
 #include "common/logging.h"
+#include "common/npz_writer.h"
 
 namespace marian {
 
+/**
+ * @brief Name of the source embeddings  name , "Wemb" for all encoders and
+ * the decoder with --tied-embeddings-all
+ */
+inline std::string sourceEmbeddings(Ptr<Config> options, const std::string& name) {
+  if(options->has("tied-embeddings-all") && options->get<bool>("tied-embeddings-all"))
+    return "Wemb";
+  return name;
+}
+
+/** @brief Name of the target embeddings, see sourceEmbeddings() */
+inline std::string targetEmbeddings(Ptr<Config> options) {
+  return sourceEmbeddings(options, "Wemb_dec");
+}
+
+/**
+ * @brief Whether the output layer uses the target embeddings transposed
+ * instead of weights of its own, with --tied-embeddings or --tied-embeddings-all
+ */
+inline bool tiedOutput(Ptr<Config> options) {
+  auto flag = [&](const std::string& key) { return options->has(key) && options->get<bool>(key); };
+  return flag("tied-embeddings") || flag("tied-embeddings-all");
+}
+
 struct EncoderState {
   Expr context;
   Expr mask;
+
+  // context projections of the attention layers reading this state, by
+  // parameter prefix, computed once and reused by every step and beam
+  std::map<std::string, Expr> projections;
 };
 
 class EncoderBase {
@@ -24,28 +56,28 @@ class EncoderBase {
     virtual std::tuple<Expr, Expr>
     prepareSource(Expr emb, Ptr<data::CorpusBatch> batch, size_t index) {
       using namespace keywords;
-      std::vector<size_t> indeces;
-      std::vector<float> mask;
-
-      for(auto& word : (*batch)[index]) {
-        for(auto i: word.first)
-          indeces.push_back(i);
-        for(auto m: word.second)
-          mask.push_back(m);
-      }
+      auto& sub = (*batch)[index];
 
-      int dimBatch = batch->size();
+      int dimBatch = sub.batchSize();
       int dimEmb = emb->shape()[1];
-      int dimWords = (int)(*batch)[index].size();
+      int dimWords = sub.batchWidth();
 
-      auto graph = emb->graph();
-      auto x = reshape(rows(emb, indeces), {dimBatch, dimEmb, dimWords});
-      auto xMask = graph->constant(shape={dimBatch, 1, dimWords},
-                                   init=inits::from_vector(mask));
-      return std::make_tuple(x, xMask);
+      auto x = reshape(rows(emb, sub.indices()), {dimBatch, dimEmb, dimWords});
+      return std::make_tuple(x, sourceMask(emb->graph(), batch, index));
     }
 
   public:
+    /** @brief Mask of input stream  index  of  batch  as the encoders return it */
+    static Expr sourceMask(Ptr<ExpressionGraph> graph,
+                           Ptr<data::CorpusBatch> batch, size_t index) {
+      using namespace keywords;
+      auto& sub = (*batch)[index];
+      int dimBatch = sub.batchSize();
+      int dimWords = sub.batchWidth();
+      return graph->constant(shape={dimBatch, 1, dimWords},
+                             init=inits::from_vector(sub.mask()));
+    }
+
     template <class ...Args>
     EncoderBase(Ptr<Config> options, Args ...args)
      : options_(options),
@@ -55,6 +87,18 @@ class EncoderBase {
 
     virtual Ptr<EncoderState>
     build(Ptr<ExpressionGraph>, Ptr<data::CorpusBatch>, size_t = 0) = 0;
+
+    /**
+     * @brief The sentences  batchIndices  of  state , in this order and
+     * possibly repeated, e.g. to share the state of one source among several
+     * targets. Projections are left to the attention layers reading the result.
+     */
+    virtual Ptr<EncoderState>
+    select(Ptr<EncoderState> state, const std::vector<size_t>& batchIndices) {
+      return New<EncoderState>(EncoderState{
+        select_batch(state->context, batchIndices),
+        select_batch(state->mask, batchIndices)});
+    }
 };
 
 class DecoderBase {
@@ -62,30 +106,111 @@ class DecoderBase {
     Ptr<Config> options_;
     bool inference_{false};
 
-    virtual std::tuple<Expr, Expr, Expr>
-    prepareTarget(Expr emb, Ptr<data::CorpusBatch> batch, size_t index) {
+    std::vector<size_t> shortlist_;
+    Expr shortW_, shortB_;
+
+    // --output-shards, slices of the vocabulary, and --output-chunks, blocks
+    // of target steps, cost() computes the output layer in, 1 and 1 for
+    // logits from step(), and --output-samples, negatives of a sampled
+    // softmax in cost(), 0 for the full softmax
+    size_t outputShards_{1};
+    size_t outputChunks_{1};
+    size_t outputSamples_{0};
+
+    // the output weights are the target embeddings, used transposed
+    bool tied_{false};
+
+    // in training, the flat time-major rows of the real, unpadded target
+    // positions and for every position its row among them, 0 for padding,
+    // set by groundTruth(). Empty if the batch has no padding.
+    std::vector<size_t> realRows_;
+    std::vector<size_t> realIndex_;
+
+    /**
+     * @brief The rows of the decoder output  in  for the real target
+     * positions only, so the output layer skips the padding
+     */
+    Expr compact(Expr in) {
+      auto shape = in->shape();
+      size_t positions = shape[0] * shape[2] * shape[3];
+      if(realRows_.empty() || positions != realIndex_.size())
+        return in;
+      return rows(reshape(in, {(int)positions, shape[1]}), realRows_);
+    }
+
+    /**
+     * @brief Weights of the output layer for inputs of size  dimIn ,
+     * "ff_logit_l2_W" or with tied embeddings the target embeddings, which
+     * are vocabulary by input and used transposed
+     */
+    Expr outputWeights(Ptr<ExpressionGraph> graph, int dimIn, int dimTrgVoc) {
+      using namespace keywords;
+      if(!tied_)
+        return graph->param("ff_logit_l2_W", {dimIn, dimTrgVoc},
+                            init=inits::glorot_uniform);
+
+      auto W = Embedding(targetEmbeddings(options_), dimTrgVoc,
+                         options_->get<int>("dim-emb"))(graph);
+      UTIL_THROW_IF2(W->shape()[1] != dimIn,
+                     "Tied embeddings need an output layer input of size --dim-emb, not "
+                     << dimIn);
+      return W;
+    }
+
+    /**
+     * @brief Output layer "ff_logit_l2", restricted to the columns of the
+     * shortlist if one is set. The reduced weights are gathered once and
+     * kept for all decoding steps. With --output-shards, --output-chunks or
+     * --output-samples the layer is left to cost() and its input is returned.
+     * In training the logits are rows of the real target positions.
+     */
+    Expr outputLayer(Expr in, int dimTrgVoc) {
       using namespace keywords;
 
-      std::vector<size_t> indeces;
-      std::vector<float> mask;
-      std::vector<float> findeces;
+      if(fusedOutput() && shortlist_.empty())
+        return in;
 
-      for(int j = 0; j < (*batch)[index].size(); ++j) {
-        auto& trgWordBatch = (*batch)[index][j];
+      if(shortlist_.empty() && !tied_)
+        return Dense("ff_logit_l2", dimTrgVoc)(compact(in));
 
-        for(auto i : trgWordBatch.first) {
-          findeces.push_back((float)i);
-          if(j < (*batch)[index].size() - 1)
-            indeces.push_back(i);
-        }
+      auto graph = in->graph();
+      if(shortlist_.empty()) {
+        auto W = outputWeights(graph, in->shape()[1], dimTrgVoc);
+        auto b = graph->param("ff_logit_l2_b", {1, dimTrgVoc},
+                              init=inits::zeros);
+        return affine(compact(in), W, b, false, true);
+      }
 
-        for(auto m : trgWordBatch.second)
-            mask.push_back(m);
+      if(!shortW_) {
+        auto W = outputWeights(graph, in->shape()[1], dimTrgVoc);
+        auto b = graph->param("ff_logit_l2_b", {1, dimTrgVoc},
+                              init=inits::zeros);
+
+        shortW_ = tied_ ? rows(W, shortlist_) : cols(W, shortlist_);
+        shortB_ = cols(b, shortlist_);
       }
+      return affine(compact(in), shortW_, shortB_, false, tied_);
+    }
 
-      int dimBatch = batch->size();
+    /** @brief Whether cost() rather than step() computes the output layer */
+    bool fusedOutput() {
+      return outputShards_ > 1 || outputChunks_ > 1 || outputSamples_ > 0;
+    }
+
+    virtual std::tuple<Expr, Expr, Expr>
+    prepareTarget(Expr emb, Ptr<data::CorpusBatch> batch, size_t index) {
+      using namespace keywords;
+      auto& sub = (*batch)[index];
+
+      int dimBatch = sub.batchSize();
       int dimEmb = emb->shape()[1];
-      int dimWords = (int)(*batch)[index].size();
+      int dimWords = sub.batchWidth();
+
+      // time-major, so the inputs (all but the last step) are a prefix
+      std::vector<size_t> indeces(sub.indices().begin(),
+                                  sub.indices().end() - dimBatch);
+      std::vector<float> findeces(sub.indices().begin(), sub.indices().end());
+      auto& mask = sub.mask();
 
       auto graph = emb->graph();
 
@@ -104,7 +229,65 @@ class DecoderBase {
     template <class ...Args>
     DecoderBase(Ptr<Config> options, Args ...args)
      : options_(options),
-       inference_(Get(keywords::inference, false, args...)) {}
+       inference_(Get(keywords::inference, false, args...)) {
+      if(!inference_ && options_->has("output-shards"))
+        outputShards_ = std::max((size_t)1, options_->get<size_t>("output-shards"));
+      if(!inference_ && options_->has("output-chunks"))
+        outputChunks_ = std::max((size_t)1, options_->get<size_t>("output-chunks"));
+      if(!inference_ && options_->has("output-samples"))
+        outputSamples_ = options_->get<size_t>("output-samples");
+      UTIL_THROW_IF2((outputShards_ > 1 || outputChunks_ > 1) && outputSamples_ > 0,
+                     "--output-shards and --output-chunks exclude --output-samples");
+
+      tied_ = tiedOutput(options_);
+      if(targetEmbeddings(options_) == "Wemb") {
+        auto dims = options_->get<std::vector<int>>("dim-vocabs");
+        UTIL_THROW_IF2(std::count(dims.begin(), dims.end(), dims.front()) != (int)dims.size(),
+                       "--tied-embeddings-all needs equal --dim-vocabs, i.e. a shared vocabulary");
+      }
+    }
+
+    /**
+     * @brief Cross-entropy cost of the output of step() against the ground
+     * truth of  batch , sampled with --output-samples. Costs computed for the
+     * real target positions only are pasted back to the padded layout.
+     */
+    Expr cost(Expr out, Expr trgIdx, Expr trgMask, Ptr<data::CorpusBatch> batch) {
+      using namespace keywords;
+
+      auto picks = realRows_.empty() ? trgIdx : rows(trgIdx, realRows_);
+      Expr ce;
+      if(!fusedOutput() || !shortlist_.empty()) {
+        ce = cross_entropy(out, picks);
+      }
+      else if(outputSamples_ == 0) {
+        auto graph = out->graph();
+        int dimTrgVoc = options_->get<std::vector<int>>("dim-vocabs").back();
+        auto W = outputWeights(graph, out->shape()[1], dimTrgVoc);
+        auto b = graph->param("ff_logit_l2_b", {1, dimTrgVoc},
+                              init=inits::zeros);
+        ce = sharded_cross_entropy(compact(out), W, b, picks,
+                                   (int)outputShards_, (int)outputChunks_, tied_);
+      }
+
+      // padding picks the cost of row 0, masked below
+      if(ce) {
+        if(!realRows_.empty())
+          ce = reshape(rows(ce, realIndex_), trgMask->shape());
+        return CrossEntropyCost("cost").words(ce, mask=trgMask);
+      }
+
+      auto graph = out->graph();
+      int dimTrgVoc = options_->get<std::vector<int>>("dim-vocabs").back();
+      auto W = outputWeights(graph, out->shape()[1], dimTrgVoc);
+      auto b = graph->param("ff_logit_l2_b", {1, dimTrgVoc},
+                            init=inits::zeros);
+      auto& words = (*batch)[batch->sets() - 1].indices();
+      return SampledCrossEntropyCost("cost")(out, W, b,
+                                             std::vector<size_t>(words.begin(), words.end()),
+                                             outputSamples_, transposed=tied_,
+                                             mask=trgMask);
+    }
 
     virtual std::tuple<Expr, Expr, Expr>
     groundTruth(Ptr<ExpressionGraph> graph,
@@ -115,10 +298,28 @@ class DecoderBase {
       int dimTrgVoc = options_->get<std::vector<int>>("dim-vocabs").back();
       int dimTrgEmb = options_->get<int>("dim-emb");
 
-      auto yEmb = Embedding("Wemb_dec", dimTrgVoc, dimTrgEmb)(graph);
+      auto yEmb = Embedding(targetEmbeddings(options_), dimTrgVoc, dimTrgEmb)(graph);
       Expr y, yMask, yIdx;
       size_t sets = batch->sets();
       std::tie(y, yMask, yIdx) = prepareTarget(yEmb, batch, sets - 1);
+
+      realRows_.clear();
+      realIndex_.clear();
+      if(!inference_) {
+        auto& mask = (*batch)[sets - 1].mask();
+        std::vector<size_t> index(mask.size(), 0);
+        for(size_t i = 0; i < mask.size(); ++i) {
+          if(mask[i] != 0) {
+            index[i] = realRows_.size();
+            realRows_.push_back(i);
+          }
+        }
+        if(realRows_.size() < mask.size() && !realRows_.empty())
+          realIndex_.swap(index);
+        else
+          realRows_.clear();
+      }
+
       auto yEmpty = graph->zeros(shape={dimBatch, dimTrgEmb});
       auto yShifted = concatenate({yEmpty, y}, axis=2);
 
@@ -144,8 +345,30 @@ class DecoderBase {
     virtual std::tuple<Expr, std::vector<Expr>>
     step(Expr embeddings, std::vector<Expr> states,
          Ptr<EncoderState> encState, bool single=false) = 0;
+
+    /**
+     * @brief Keeps the given sentences of the encoder state seen by the
+     * decoder, in this order, e.g. to drop finished sentences in beam search.
+     * Only valid after the first step.
+     */
+    virtual void selectSentences(const std::vector<size_t>& batchIndices) = 0;
+
+    /**
+     * @brief Computes the output layer only for the given sorted target ids,
+     * column i of the logits then belongs to word shortlist[i]. Empty for the
+     * full vocabulary.
+     */
+    void setShortlist(const std::vector<size_t>& shortlist) {
+      shortlist_ = shortlist;
+      shortW_ = nullptr;
+      shortB_ = nullptr;
+    }
 };
 
+// bias of padded output columns, see Seq2Seq::padOutput(), low enough for
+// their probabilities to be 0 and representable in fp16
+const float PAD_LOGIT = -1e4f;
+
 class Seq2SeqBase {
   public:
     virtual void load(Ptr<ExpressionGraph>,
@@ -157,9 +380,26 @@ class Seq2SeqBase {
     virtual void save(Ptr<ExpressionGraph>,
                       const std::string&, bool) = 0;
 
+    /** @brief Name under which parameter  name  is saved */
+    virtual std::string savedName(const std::string& name) {
+      return name;
+    }
+
+    /** @brief Adds entries other than the parameters to a model being written */
+    virtual void saveExtras(NpzWriter& npz) {}
+
+    /** @brief Writes the configuration a translator needs for the model  name  */
+    virtual void saveTranslatorConfig(const std::string& name) {}
+
+    virtual void restart(Ptr<ExpressionGraph>) = 0;
+
     virtual std::tuple<Expr, std::vector<Expr>>
     step(Expr, std::vector<Expr>, Ptr<EncoderState>, bool=false) = 0;
 
+    virtual void selectSentences(const std::vector<size_t>&) = 0;
+
+    virtual void setShortlist(const std::vector<size_t>&) = 0;
+
     virtual Expr build(Ptr<ExpressionGraph> graph,
                        Ptr<data::CorpusBatch> batch) = 0;
 };
@@ -182,8 +422,23 @@ class Seq2Seq : public Seq2SeqBase {
        inference_(Get(keywords::inference, false, args...))
     {}
 
+    /**
+     * --pad-dims: the output layer gets a multiple of that many columns for
+     * aligned GEMMs. Padded columns have zero weights and PAD_LOGIT biases, so
+     * their probabilities and gradients are 0 and search never picks them.
+     * Not done for tied embeddings, whose rows are the vocabulary.
+     */
+    void padOutput(Ptr<ExpressionGraph> graph) {
+      size_t multiple = options_->has("pad-dims") ? options_->get<size_t>("pad-dims") : 0;
+      if(multiple < 2 || tiedOutput(options_))
+        return;
+      graph->padColumns("ff_logit_l2_W", multiple, 0.f);
+      graph->padColumns("ff_logit_l2_b", multiple, PAD_LOGIT);
+    }
+
      virtual void load(Ptr<ExpressionGraph> graph,
                        const std::string& name) {
+      padOutput(graph);
       graph->load(name);
     }
 
@@ -199,13 +454,23 @@ class Seq2Seq : public Seq2SeqBase {
       graph->save(name);
     }
 
+    /**
+     * @brief Clears  graph  and starts a new encoder and decoder, e.g. to
+     * decode from an encoder state and decoder states kept from an earlier
+     * graph, which the caller then adds as constants
+     */
+    virtual void restart(Ptr<ExpressionGraph> graph) {
+      graph->clear();
+      padOutput(graph);
+      encoder_ = New<Encoder>(options_, keywords::inference=inference_);
+      decoder_ = New<Decoder>(options_, keywords::inference=inference_);
+    }
+
     virtual std::tuple<std::vector<Expr>, Ptr<EncoderState>>
     buildEncoder(Ptr<ExpressionGraph> graph,
                  Ptr<data::CorpusBatch> batch) {
       using namespace keywords;
-      graph->clear();
-      encoder_ = New<Encoder>(options_, keywords::inference=inference_);
-      decoder_ = New<Decoder>(options_, keywords::inference=inference_);
+      restart(graph);
 
       auto encState = encoder_->build(graph, batch);
       auto startState = decoder_->buildStartState(encState);
@@ -224,6 +489,14 @@ class Seq2Seq : public Seq2SeqBase {
       return decoder_->step(embeddings, states, encState, single);
     }
 
+    virtual void selectSentences(const std::vector<size_t>& batchIndices) {
+      decoder_->selectSentences(batchIndices);
+    }
+
+    virtual void setShortlist(const std::vector<size_t>& shortlist) {
+      decoder_->setShortlist(shortlist);
+    }
+
     virtual Expr build(Ptr<ExpressionGraph> graph,
                        Ptr<data::CorpusBatch> batch) {
       using namespace keywords;
@@ -241,10 +514,84 @@ class Seq2Seq : public Seq2SeqBase {
                                                       startStates,
                                                       encState);
 
-      auto cost = CrossEntropyCost("cost")(trgLogits, trgIdx,
-                                           mask=trgMask);
+      return decoder_->cost(trgLogits, trgIdx, trgMask, batch);
+    }
+
+    /**
+     * @brief The cost of build() for targets that share sources: the encoder
+     * runs once on the distinct sources in  sources , whose targets are not
+     * read, and its state is repeated for the sentences of  batch , sentence b
+     * reading source  sourceRows[b] . The source streams of  batch  are not
+     * read either.
+     */
+    virtual Expr buildShared(Ptr<ExpressionGraph> graph,
+                             Ptr<data::CorpusBatch> batch,
+                             Ptr<data::CorpusBatch> sources,
+                             const std::vector<size_t>& sourceRows) {
+      using namespace keywords;
+      restart(graph);
+
+      auto shared = encoder_->build(graph, sources);
+      auto encState = encoder_->select(shared, sourceRows);
+      auto startState = select_batch(decoder_->buildStartState(shared), sourceRows);
+      std::vector<Expr> startStates(options_->get<size_t>("layers-dec"), startState);
+
+      Expr trgEmbeddings, trgMask, trgIdx;
+      std::tie(trgEmbeddings, trgMask, trgIdx) = decoder_->groundTruth(graph, batch);
+
+      Expr trgLogits;
+      std::vector<Expr> trgStates;
+      std::tie(trgLogits, trgStates) = decoder_->step(trgEmbeddings,
+                                                      startStates,
+                                                      encState);
+
+      return decoder_->cost(trgLogits, trgIdx, trgMask, batch);
+    }
+
+    /**
+     * @brief The first pipeline stage of build(): the encoder alone, its top
+     * node is the context
+     */
+    virtual Expr buildContext(Ptr<ExpressionGraph> graph,
+                              Ptr<data::CorpusBatch> batch) {
+      graph->clear();
+      encoder_ = New<Encoder>(options_, keywords::inference=inference_);
+      return encoder_->build(graph, batch)->context;
+    }
+
+    /**
+     * @brief The second pipeline stage of build(): decoder and cost for the
+     * encoder's  context  computed on another graph. The context enters as a
+     * constant named "pipeline_context" whose gradient backward() keeps.
+     */
+    virtual Expr buildFromContext(Ptr<ExpressionGraph> graph,
+                                  Ptr<data::CorpusBatch> batch,
+                                  Tensor context) {
+      using namespace keywords;
+      graph->clear();
+      padOutput(graph);
+      decoder_ = New<Decoder>(options_, keywords::inference=inference_);
+
+      auto ctx = graph->constant(shape=context->shape(),
+                                 init=[context](Tensor t) { t->copyFrom(context); });
+      ctx->setTrainable(true);
+      marian::name(ctx, "pipeline_context");
+
+      auto encState = New<EncoderState>(
+        EncoderState{ctx, EncoderBase::sourceMask(graph, batch, 0)});
+      auto startState = decoder_->buildStartState(encState);
+      std::vector<Expr> startStates(options_->get<size_t>("layers-dec"), startState);
+
+      Expr trgEmbeddings, trgMask, trgIdx;
+      std::tie(trgEmbeddings, trgMask, trgIdx) = decoder_->groundTruth(graph, batch);
+
+      Expr trgLogits;
+      std::vector<Expr> trgStates;
+      std::tie(trgLogits, trgStates) = decoder_->step(trgEmbeddings,
+                                                      startStates,
+                                                      encState);
 
-      return cost;
+      return decoder_->cost(trgLogits, trgIdx, trgMask, batch);
     }
 
 };
@@ -30,10 +30,13 @@ class EncoderGNMT : public EncoderBase {
       float dropoutRnn = inference_ ? 0 : options_->get<float>("dropout-rnn");
       float dropoutSrc = inference_ ? 0 : options_->get<float>("dropout-src");
 
-      auto xEmb = Embedding(prefix_ + "_Wemb", dimSrcVoc, dimSrcEmb)(graph);
+      auto xEmb = Embedding(sourceEmbeddings(options_, prefix_ + "_Wemb"),
+                            dimSrcVoc, dimSrcEmb)(graph);
 
       Expr x, xMask;
       std::tie(x, xMask) = prepareSource(xEmb, batch, batchIdx);
+      // the recurrences skip the padding at the end of shorter sentences
+      auto active = (*batch)[batchIdx].activeRows();
 
       if(dropoutSrc) {
         int dimBatch = x->shape()[0];
@@ -46,14 +49,14 @@ class EncoderGNMT : public EncoderBase {
                           dimSrcEmb, dimEncState,
                           normalize=layerNorm,
                           dropout_prob=dropoutRnn)
-                         (x);
+                         (x, active_rows=active);
 
       auto xBw = RNN<GRU>(graph, prefix_ + "_bi_r",
                           dimSrcEmb, dimEncState,
                           normalize=layerNorm,
                           direction=dir::backward,
                           dropout_prob=dropoutRnn)
-                         (x, mask=xMask);
+                         (x, mask=xMask, active_rows=active);
 
       if(encoderLayers > 1) {
         auto xBi = concatenate({xFw, xBw}, axis=1);
@@ -66,7 +69,7 @@ class EncoderGNMT : public EncoderBase {
                        normalize=layerNorm,
                        skip=skipDepth,
                        dropout_prob=dropoutRnn)
-                      (xBi);
+                      (xBi, active_rows=active);
         return New<EncoderState>(EncoderState{xContext, xMask});
       }
       else {
@@ -97,6 +100,7 @@ class DecoderGNMT : public DecoderBase {
       int dimTrgEmb = options_->get<int>("dim-emb");
       int dimDecState = options_->get<int>("dim-rnn");
       bool layerNorm = options_->get<bool>("layer-normalization");
+      int attWindow = options_->get<size_t>("att-window");
       bool skipDepth = options_->get<bool>("skip");
       size_t decoderLayers = options_->get<size_t>("layers-dec");
 
@@ -117,7 +121,8 @@ class DecoderGNMT : public DecoderBase {
                                           encState,
                                           dimDecState,
                                           dropout_prob=dropoutRnn,
-                                          normalize=layerNorm);
+                                          normalize=layerNorm,
+                                          window=attWindow);
       RNN<CGRU> rnnL1(graph, "decoder",
                       dimTrgEmb, dimDecState,
                       attention_,
@@ -161,12 +166,15 @@ class DecoderGNMT : public DecoderBase {
                             normalize=layerNorm)
                         (embeddings, outputLn, alignedContext);
 
-      auto logitsL2 = Dense("ff_logit_l2", dimTrgVoc)
-                        (logitsL1);
+      auto logitsL2 = outputLayer(logitsL1, dimTrgVoc);
 
       return std::make_tuple(logitsL2, statesOut);
     }
 
+    void selectSentences(const std::vector<size_t>& batchIndices) {
+      attention_->select(batchIndices);
+    }
+
 };
 
 typedef Seq2Seq<EncoderGNMT, DecoderGNMT> GNMT;
@@ -32,11 +32,20 @@ class MultiEncoder : public EncoderBase {
           Ptr<data::CorpusBatch> batch,
           size_t batchIdx = 0) {
 
+      // independent subgraphs, with --streams > 1 nodes of both encoders at
+      // the same depth run concurrently
       auto encState1 = encoder1_->build(graph, batch, 0);
       auto encState2 = encoder2_->build(graph, batch, 1);
 
       return New<MultiEncoderState>(encState1, encState2);
     }
+
+    Ptr<EncoderState>
+    select(Ptr<EncoderState> state, const std::vector<size_t>& batchIndices) {
+      auto multiEncState = std::static_pointer_cast<MultiEncoderState>(state);
+      return New<MultiEncoderState>(encoder1_->select(multiEncState->enc1, batchIndices),
+                                    encoder2_->select(multiEncState->enc2, batchIndices));
+    }
 };
 
 template <class Cell1, class Attention1, class Attention2, class Cell2>
@@ -87,6 +96,7 @@ class MultiAttentionCell {
     Expr apply2(Expr xW, Expr state, Expr mask = nullptr) {
       auto hidden = cell1_->apply2(xW, state, mask);
 
+      // both attentions only depend on  hidden  and overlap with --streams > 1
       auto alignedSourceContext1 = att1_->apply(hidden);
       auto alignedSourceContext2 = att2_->apply(hidden);
 
@@ -165,6 +175,7 @@ class MultiDecoderGNMT : public DecoderBase {
       int dimTrgEmb = options_->get<int>("dim-emb");
       int dimDecState = options_->get<int>("dim-rnn");
       bool layerNorm = options_->get<bool>("layer-normalization");
+      int attWindow = options_->get<size_t>("att-window");
       bool skipDepth = options_->get<bool>("skip");
       size_t decoderLayers = options_->get<size_t>("layers-dec");
 
@@ -185,12 +196,14 @@ class MultiDecoderGNMT : public DecoderBase {
         attention1_ = New<GlobalAttention>("decoder_att1",
                                            multiEncState->enc1,
                                            dimDecState,
-                                           normalize=layerNorm);
+                                           normalize=layerNorm,
+                                           window=attWindow);
       if(!attention2_)
         attention2_ = New<GlobalAttention>("decoder_att2",
                                            multiEncState->enc2,
                                            dimDecState,
-                                           normalize=layerNorm);
+                                           normalize=layerNorm,
+                                           window=attWindow);
 
       RNN<MultiCGRU> rnnL1(graph, "decoder",
                            dimTrgEmb, dimDecState,
@@ -236,12 +249,16 @@ class MultiDecoderGNMT : public DecoderBase {
                             normalize=layerNorm)
                         (embeddings, outputLn, alignedContext);
 
-      auto logitsL2 = Dense("ff_logit_l2", dimTrgVoc)
-                        (logitsL1);
+      auto logitsL2 = outputLayer(logitsL1, dimTrgVoc);
 
       return std::make_tuple(logitsL2, statesOut);
     }
 
+    void selectSentences(const std::vector<size_t>& batchIndices) {
+      attention1_->select(batchIndices);
+      attention2_->select(batchIndices);
+    }
+
 };
 
 typedef MultiEncoder<EncoderGNMT, EncoderGNMT> MultiEncoderGNMT;
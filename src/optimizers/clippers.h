@@ -4,6 +4,7 @@
 #include <memory>
 
 #include "kernels/tensor_operators.h"
+#include "tensors/tensor_allocator.h"
 
 namespace marian {
 
@@ -14,6 +15,16 @@ namespace marian {
 class ClipperBase {
   public:
     virtual void clip(Tensor) = 0;
+
+    /**
+     * @brief Returns a {1, 1} tensor on the device of  t  holding the factor
+     * the optimizer applies to the gradients while updating. Clippers that
+     * cannot be expressed as a single factor clip in place and return null.
+     */
+    virtual Tensor scale(Tensor t) {
+      clip(t);
+      return nullptr;
+    }
 };
 
 typedef std::shared_ptr<ClipperBase> ClipperPtr;
@@ -34,14 +45,32 @@ class Norm : public ClipperBase {
   public:
     Norm(float c=1.0) : c_(c) {}
 
+    /** @brief Changes the maximal norm, e.g. for gradients that are still loss-scaled */
+    void setThreshold(float c) {
+      c_ = c;
+    }
+
     void clip(Tensor t) {
-      float l2Norm = L2Norm(t);
-      if(l2Norm >= c_)
-        Element(_1 = (c_ / l2Norm) * _1, t);
+      Element(_1 = _1 * _2, t, scale(t));
+    }
+
+    // the factor stays on the device, nothing is read back to the host
+    Tensor scale(Tensor t) {
+      if(!alloc_ || buffer_->getDevice() != t->getDevice()) {
+        alloc_ = New<TensorAllocator>(t->getDevice());
+        alloc_->reserveExact(CLIP_PARTS + 1);
+        alloc_->allocate(buffer_, {1, CLIP_PARTS + 1});
+        factor_ = buffer_->subtensor(0, 1);
+      }
+      ClipNormFactor(buffer_, t, c_);
+      return factor_;
     }
 
   private:
     float c_;
+    Ptr<TensorAllocator> alloc_;
+    Tensor buffer_;
+    Tensor factor_;
 };
 
 
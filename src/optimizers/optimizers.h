@@ -3,9 +3,11 @@
 #include <map>
 #include <memory>
 
+#include "kernels/ranges.h"
 #include "kernels/tensor_operators.h"
 #include "training/config.h"
 #include "optimizers/clippers.h"
+#include "optimizers/pruner.h"
 
 namespace marian {
 
@@ -27,13 +29,51 @@ class OptimizerBase {
     void update(Ptr<ExpressionGraph> graph) {
       Tensor p = graph->params().vals();
       Tensor g = graph->params().grads();
-      update(p, g);
+      if(sparseRows_) {
+        Ranges touched;
+        graph->updateRanges(touched);
+        if(!ranges_)
+          ranges_ = New<DeviceRanges>(p->getDevice());
+        ranges_->upload(touched);
+        Tensor scale = clipper_ ? clipper_->scale(g) : nullptr;
+        updateImpl(p, g, scale, ranges_.get());
+      }
+      else {
+        update(p, g);
+      }
+      if(pruner_)
+        pruner_->apply(graph);
+      graph->invalidateHalfParams();
     }
 
     void update(Tensor params, Tensor grads) {
-      if(clipper_)
-        clipper_->clip(grads);
-      updateImpl(params, grads);
+      // clipping by norm is folded into the update kernels as a factor on
+      // the device, the gradients themselves are not rescaled
+      Tensor scale = clipper_ ? clipper_->scale(grads) : nullptr;
+      updateImpl(params, grads, scale, nullptr);
+    }
+
+    /**
+     * @brief Updates with a factor computed elsewhere, e.g. the clipping factor
+     * of the whole gradient when params and grads are a shard of it. The own
+     * clipper is not used. With  ranges  the gradient is zero elsewhere.
+     */
+    void update(Tensor params, Tensor grads, Tensor scale,
+                const DeviceRanges* ranges = nullptr) {
+      updateImpl(params, grads, scale, ranges);
+    }
+
+    /** @brief As above with the learning rate times  rate  for this update only */
+    void update(Tensor params, Tensor grads, Tensor scale,
+                const DeviceRanges* ranges, float rate) {
+      float eta = eta_;
+      eta_ *= rate;
+      updateImpl(params, grads, scale, ranges);
+      eta_ = eta;
+    }
+
+    Ptr<ClipperBase> getClipper() {
+      return clipper_;
     }
 
     void updateSchedule() {
@@ -41,12 +81,67 @@ class OptimizerBase {
       //LOG(info, "Changing learning rate to {}", eta_);
     }
 
+    /**
+     * @brief Keeps an exponential moving average of the updated parameters,
+     * avg = decay * avg + (1 - decay) * params, 0 disables it.
+     */
+    void setSmoothing(float decay) {
+      decay_ = decay;
+    }
+
+    /** @brief The moving average, null without smoothing or before the first update */
+    Tensor smoothed() {
+      return avg_;
+    }
+
+    /**
+     * @brief update(graph) only updates the parameters the graph used, and of
+     * embeddings only the rows it looked up, see ExpressionGraph::updateRanges()
+     */
+    void setSparseRows(bool sparse) {
+      sparseRows_ = sparse;
+    }
+
+    /** @brief Prunes the parameters after every update(graph), see Pruner */
+    void setPruner(Ptr<Pruner> pruner) {
+      pruner_ = pruner;
+    }
+
   protected:
 
-    virtual void updateImpl(Tensor params, Tensor grads) = 0;
+    /**
+     * Optimizers whose step is a no-op for a zero gradient may ignore  ranges ,
+     * those with moments update them only within the ranges.
+     */
+    virtual void updateImpl(Tensor params, Tensor grads, Tensor scale,
+                            const DeviceRanges* ranges) = 0;
+
+    /** @brief The average to update along with  params , started at their current values */
+    Tensor average(Tensor params) {
+      if(decay_ <= 0)
+        return nullptr;
+      if(!avg_) {
+        avgAlloc_ = New<TensorAllocator>(params->getDevice());
+        avgAlloc_->reserveExact(params->size());
+        avgAlloc_->allocate(avg_, {1, (int)params->size()});
+        if(!isCPU(params->getDevice()))
+          cudaStreamSynchronize(currentStream());
+        avg_->copyFrom(params);
+      }
+      return avg_;
+    }
 
     Ptr<ClipperBase> clipper_;
     float eta_;
+
+    float decay_{0};
+    Ptr<TensorAllocator> avgAlloc_;
+    Tensor avg_;
+
+    bool sparseRows_{false};
+    Ptr<DeviceRanges> ranges_;
+
+    Ptr<Pruner> pruner_;
 };
 
 class Sgd : public OptimizerBase {
@@ -56,8 +151,14 @@ class Sgd : public OptimizerBase {
     : OptimizerBase(eta, args...) {}
 
   private:
-    void updateImpl(Tensor params, Tensor grads) {
-      Element(_1 -= eta_ * _2, params, grads);
+    void updateImpl(Tensor params, Tensor grads, Tensor scale,
+                    const DeviceRanges* ranges) {
+      if(scale)
+        Element(_1 -= eta_ * _2 * _3, params, grads, scale);
+      else
+        Element(_1 -= eta_ * _2, params, grads);
+      if(Tensor avg = average(params))
+        Element(_1 = decay_ * _1 + (1 - decay_) * _2, avg, params);
     }
 };
 
@@ -71,7 +172,8 @@ class Adagrad : public OptimizerBase {
     {}
 
   private:
-    void updateImpl(Tensor params, Tensor grads) {
+    void updateImpl(Tensor params, Tensor grads, Tensor scale,
+                    const DeviceRanges* ranges) {
       if(!alloc_)
         alloc_ = New<TensorAllocator>(params->getDevice());
 
@@ -82,11 +184,7 @@ class Adagrad : public OptimizerBase {
         gt_->set(0);
       }
 
-      Element(_1 += (_2 * _2),
-              gt_, grads);
-
-      Element(_1 -= (eta_ / (Sqrt(_2) + eps_)) * _3,
-              params, gt_, grads);
+      AdagradUpdate(params, grads, gt_, eta_, eps_, scale, average(params), decay_);
     }
 
     float eps_;
@@ -97,6 +195,14 @@ class Adagrad : public OptimizerBase {
 
 // @TODO: Add serialization for historic gradients and parameters
 // https://arxiv.org/pdf/1412.6980v8.pdf
+//
+// With offload=true the moments live in mapped pinned host memory. The fused
+// update kernel streams them over PCIe while it runs, no device memory is
+// used for them and no separate copies are issued.
+//
+// With states="fp16" or "int8" the moments are stored blockwise in 16 or 8
+// bits, see AdamUpdateQuantized(), a half or a quarter of their fp32 memory.
+// These updates ignore ranges, all moments decay with every update.
 class Adam : public OptimizerBase {
   public:
     template <typename ...Args>
@@ -105,46 +211,139 @@ class Adam : public OptimizerBase {
       beta1_(Get(keywords::beta1, 0.9, args...)),
       beta2_(Get(keywords::beta2, 0.999, args...)),
       eps_(Get(keywords::eps, 1e-8, args...)),
+      offload_(Get(keywords::offload, false, args...)),
+      bits_(stateBits(Get(keywords::states, std::string("fp32"), args...))),
       t_(0)
     {}
 
-    void updateImpl(Tensor params, Tensor grads) {
+    ~Adam() {
+      if(host_)
+        cudaFreeHost(host_);
+      if(quantized_)
+        cudaFree(quantized_);
+    }
 
-      if(!mtAlloc_)
-        mtAlloc_ = New<TensorAllocator>(params->getDevice());
-      if(!vtAlloc_)
-        vtAlloc_ = New<TensorAllocator>(params->getDevice());
+    /** @brief Bits per moment of --optimizer-states  states  */
+    static int stateBits(const std::string& states) {
+      if(states == "fp32")
+        return 32;
+      if(states == "fp16")
+        return 16;
+      if(states == "int8")
+        return 8;
+      UTIL_THROW2("Unknown optimizer states: " << states);
+    }
 
-      if(!mt_) {
-        int totalSize = params->size();
-        mtAlloc_->reserveExact(totalSize);
-        mtAlloc_->allocate(mt_, {1, totalSize});
-        mt_->set(0);
+    void updateImpl(Tensor params, Tensor grads, Tensor scale,
+                    const DeviceRanges* ranges) {
+      if(bits_ < 32) {
+        if(!mScale_)
+          allocateQuantized(params);
+        t_++;
+        AdamUpdateQuantized(params, grads, mCodes_, vCodes_, mScale_, vScale_, bits_,
+                            eta_, beta1_, beta2_, eps_,
+                            1 - std::pow(beta1_, t_), 1 - std::pow(beta2_, t_),
+                            scale, average(params), decay_);
+        return;
+      }
 
-        vtAlloc_->reserveExact(totalSize);
-        vtAlloc_->allocate(vt_, {1, totalSize});
-        vt_->set(0);
+      if(!mt_) {
+        if(offload_ && !isCPU(params->getDevice()))
+          allocateHost(params);
+        else
+          allocateDevice(params);
       }
 
       t_++;
       float denom1 = 1 - std::pow(beta1_, t_);
       float denom2 = 1 - std::pow(beta2_, t_);
 
-      Element(_1 = (beta1_ * _1) + ((1 - beta1_) * _2),
-              mt_, grads);
-      Element(_1 = (beta2_ * _1) + ((1 - beta2_) * (_2 * _2)),
-              vt_, grads);
-
-      Element(_1 -= eta_ * (_2 / denom1) / (Sqrt(_3 / denom2) + eps_),
-              params, mt_, vt_);
+      AdamUpdate(params, grads, mt_, vt_,
+                 eta_, beta1_, beta2_, eps_, denom1, denom2, scale,
+                 average(params), decay_, ranges);
     }
 
   private:
     float beta1_;
     float beta2_;
     float eps_;
+    bool offload_;
+    int bits_;
     size_t t_;
 
+    float* host_{nullptr};
+
+    // quantized moments: the scales of both, then the codes of mt and of vt
+    void* quantized_{nullptr};
+    float* mScale_{nullptr};
+    float* vScale_{nullptr};
+    void* mCodes_{nullptr};
+    void* vCodes_{nullptr};
+
+    void allocateQuantized(Tensor params) {
+      UTIL_THROW_IF2(isCPU(params->getDevice()),
+                     "Optimizer states in " << bits_ << " bits require a GPU");
+      size_t n = params->size();
+      size_t blocks = n / ADAM_BLOCK + (n % ADAM_BLOCK != 0);
+      size_t bytes = 2 * blocks * sizeof(float) + 2 * n * (bits_ / 8);
+
+      cudaSetDevice(params->getDevice());
+      char* base;
+      if(offload_) {
+        UTIL_THROW_IF2(cudaHostAlloc((void**)&host_, bytes,
+                                     cudaHostAllocMapped | cudaHostAllocPortable) != cudaSuccess,
+                       "Could not allocate " << bytes << " bytes of pinned host memory for Adam");
+        std::fill((char*)host_, (char*)host_ + bytes, 0);
+        cudaHostGetDevicePointer((void**)&base, host_, 0);
+      }
+      else {
+        CUDA_CHECK(cudaMalloc(&quantized_, bytes));
+        CUDA_CHECK(cudaMemset(quantized_, 0, bytes));
+        base = (char*)quantized_;
+      }
+      mScale_ = (float*)base;
+      vScale_ = mScale_ + blocks;
+      mCodes_ = base + 2 * blocks * sizeof(float);
+      vCodes_ = (char*)mCodes_ + n * (bits_ / 8);
+
+      LOG(memory, "Adam moments in {} bits, {} MB of {} memory (device {})",
+          bits_, bytes / (1024 * 1024), offload_ ? "pinned host" : "device",
+          params->getDevice());
+    }
+
+    void allocateDevice(Tensor params) {
+      int totalSize = params->size();
+
+      mtAlloc_ = New<TensorAllocator>(params->getDevice());
+      mtAlloc_->reserveExact(totalSize);
+      mtAlloc_->allocate(mt_, {1, totalSize});
+      mt_->set(0);
+
+      vtAlloc_ = New<TensorAllocator>(params->getDevice());
+      vtAlloc_->reserveExact(totalSize);
+      vtAlloc_->allocate(vt_, {1, totalSize});
+      vt_->set(0);
+    }
+
+    void allocateHost(Tensor params) {
+      int totalSize = params->size();
+      size_t bytes = 2 * totalSize * sizeof(float);
+
+      cudaSetDevice(params->getDevice());
+      UTIL_THROW_IF2(cudaHostAlloc((void**)&host_, bytes,
+                                   cudaHostAllocMapped | cudaHostAllocPortable) != cudaSuccess,
+                     "Could not allocate " << bytes << " bytes of pinned host memory for Adam");
+      std::fill(host_, host_ + 2 * totalSize, 0.f);
+
+      float* mapped;
+      cudaHostGetDevicePointer((void**)&mapped, host_, 0);
+      mt_.reset(new TensorBase(mapped, {1, totalSize}, params->getDevice()));
+      vt_.reset(new TensorBase(mapped + totalSize, {1, totalSize}, params->getDevice()));
+
+      LOG(memory, "Adam moments offloaded to {} MB of pinned host memory (device {})",
+          bytes / (1024 * 1024), params->getDevice());
+    }
+
     Ptr<TensorAllocator> mtAlloc_;
     Tensor mt_;
     Ptr<TensorAllocator> vtAlloc_;
@@ -156,6 +355,17 @@ Ptr<OptimizerBase> Optimizer(Args&& ...args) {
   return Ptr<OptimizerBase>(new Algorithm(args...));
 }
 
+/** @brief Floats of optimizer state kept on the device per parameter */
+inline float optimizerStates(Ptr<Config> options) {
+  std::string opt = options->get<std::string>("optimizer");
+  if(opt == "adagrad")
+    return 1;
+  if(opt == "adam")
+    return options->get<bool>("optimizer-offload")
+           ? 0 : 2 * Adam::stateBits(options->get<std::string>("optimizer-states")) / 32.f;
+  return 0;
+}
+
 Ptr<OptimizerBase> Optimizer(Ptr<Config> options) {
 
   Ptr<ClipperBase> clipper = nullptr;
@@ -164,21 +374,36 @@ Ptr<OptimizerBase> Optimizer(Ptr<Config> options) {
     clipper = Clipper<Norm>(clipNorm);
 
   float lrate = options->get<double>("learn-rate");
+  bool offload = options->get<bool>("optimizer-offload");
+  std::string states = options->get<std::string>("optimizer-states");
 
   std::string opt = options->get<std::string>("optimizer");
 
+  Ptr<OptimizerBase> optimizer;
   if(opt == "sgd") {
-    return Optimizer<Sgd>(lrate, keywords::clip=clipper);
+    optimizer = Optimizer<Sgd>(lrate, keywords::clip=clipper);
   }
   else if(opt == "adagrad") {
-    return Optimizer<Adagrad>(lrate, keywords::clip=clipper);
+    optimizer = Optimizer<Adagrad>(lrate, keywords::clip=clipper);
   }
   else if(opt == "adam") {
-    return Optimizer<Adam>(lrate, keywords::clip=clipper);
+    optimizer = Optimizer<Adam>(lrate, keywords::clip=clipper,
+                                keywords::offload=offload,
+                                keywords::states=states);
   }
   else {
     UTIL_THROW2("Unknown optimizer: " << opt);
   }
+  UTIL_THROW_IF2(opt != "adam" && states != "fp32",
+                 "--optimizer-states " << states << " requires --optimizer adam");
+
+  float sparsity = options->get<float>("prune-sparsity");
+  if(sparsity > 0)
+    optimizer->setPruner(New<Pruner>(sparsity,
+                                     options->get<size_t>("prune-start"),
+                                     options->get<size_t>("prune-end"),
+                                     options->get<size_t>("prune-freq")));
+  return optimizer;
 }
 
 }
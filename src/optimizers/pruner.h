@@ -0,0 +1,121 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "common/logging.h"
+#include "graph/expression_graph.h"
+#include "kernels/tensor_operators.h"
+#include "tensors/tensor_allocator.h"
+
+namespace marian {
+
+/**
+ * @brief Gradual magnitude pruning of the weight matrices of products.
+ *
+ * Every  freq  updates between  start  and  end  the smallest weights of each
+ * matrix by magnitude are zeroed until its fraction of zeros reaches the
+ * cubic schedule s(t) = sparsity * (1 - (1 - (t - start) / (end - start))^3).
+ * The pruned weights are kept in a mask that is applied after every update,
+ * so they stay zero whatever the optimizer's moments propose. Embeddings,
+ * vectors like biases and layer normalization gains are not pruned.
+ */
+class Pruner {
+  private:
+    float sparsity_;
+    size_t start_;
+    size_t end_;
+    size_t freq_;
+
+    size_t updates_{0};
+    float current_{0};
+
+    Ptr<TensorAllocator> alloc_;
+    Tensor mask_;
+
+    float target(size_t t) {
+      if(t >= end_ || end_ <= start_)
+        return sparsity_;
+      float progress = float(t - start_) / (end_ - start_);
+      return sparsity_ * (1.f - std::pow(1.f - progress, 3.f));
+    }
+
+    void prune(Ptr<ExpressionGraph> graph, float sparsity) {
+      Tensor vals = graph->params().vals();
+      if(!mask_ || mask_->size() != vals->size()) {
+        alloc_ = New<TensorAllocator>(vals->getDevice());
+        alloc_->reserveExact(vals->size());
+        alloc_->allocate(mask_, {1, (int)vals->size()});
+      }
+
+      std::vector<float> values;
+      vals->get(values);
+      std::vector<float> mask(values.size(), 1.f);
+      std::vector<float> magnitudes;
+
+      size_t pruned = 0, total = 0;
+      for(auto& p : graph->params().getMap()) {
+        if(!prunable(p.first, p.second->shape()))
+          continue;
+        size_t offset = p.second->val()->data() - vals->data();
+        size_t size = p.second->val()->size();
+        size_t k = sparsity * size;
+        total += size;
+        if(k == 0)
+          continue;
+
+        magnitudes.resize(size);
+        for(size_t i = 0; i < size; ++i)
+          magnitudes[i] = std::abs(values[offset + i]);
+        std::nth_element(magnitudes.begin(), magnitudes.begin() + k - 1,
+                         magnitudes.end());
+        float threshold = magnitudes[k - 1];
+
+        // ties at the threshold are pruned up to k weights, zeros first
+        size_t left = k;
+        for(size_t i = 0; i < size && left > 0; ++i)
+          if(std::abs(values[offset + i]) < threshold) {
+            mask[offset + i] = 0.f;
+            left--;
+          }
+        for(size_t i = 0; i < size && left > 0; ++i)
+          if(mask[offset + i] != 0.f && std::abs(values[offset + i]) == threshold) {
+            mask[offset + i] = 0.f;
+            left--;
+          }
+        pruned += k - left;
+      }
+
+      mask_->set(mask);
+      current_ = sparsity;
+      LOG(info, "Pruned {} of {} weights of matrices ({:.1f}%)",
+          pruned, total, total ? 100.f * pruned / total : 0.f);
+    }
+
+  public:
+    Pruner(float sparsity, size_t start, size_t end, size_t freq)
+      : sparsity_(sparsity), start_(start), end_(end),
+        freq_(std::max(freq, (size_t)1)) {}
+
+    /** @brief Weight matrices of products except embeddings */
+    static bool prunable(const std::string& name, const Shape& shape) {
+      return shape[0] > 1 && shape[1] > 1
+             && name.find("Wemb") == std::string::npos;
+    }
+
+    /** @brief Call after every update, prunes on the schedule and keeps pruned weights zero */
+    void apply(Ptr<ExpressionGraph> graph) {
+      updates_++;
+      if(updates_ >= start_ && (updates_ - start_) % freq_ == 0) {
+        float sparsity = target(updates_);
+        if(sparsity > current_)
+          prune(graph, sparsity);
+      }
+      if(mask_)
+        Element(_1 *= _2, graph->params().vals(), mask_);
+    }
+};
+
+}
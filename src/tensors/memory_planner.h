@@ -0,0 +1,128 @@
+#pragma once
+
+// This file is part of the Marian toolkit.
+
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <vector>
+#include <algorithm>
+
+namespace marian {
+
+/**
+ * @brief Assigns fixed offsets in a single arena to buffers with known lifetimes.
+ *
+ * Every buffer is described by its size in floats and by the first and last
+ * step (both inclusive) during which it is in use. Buffers whose lifetimes do
+ * not overlap may share memory. Offsets are assigned greedily, largest buffer
+ * first, into the lowest gap not used by any overlapping, already placed buffer.
+ */
+class MemoryPlanner {
+  private:
+    struct Block {
+      size_t size;
+      size_t first;
+      size_t last;
+      size_t offset;
+    };
+
+    std::vector<Block> blocks_;
+    size_t total_{0};
+
+    static bool overlap(const Block& a, const Block& b) {
+      return a.first <= b.last && b.first <= a.last;
+    }
+
+  public:
+    /** @brief Registers a buffer and returns the index under which its offset can be queried */
+    size_t add(size_t size, size_t first, size_t last) {
+      blocks_.push_back({size, first, last, 0});
+      return blocks_.size() - 1;
+    }
+
+    /** @brief Computes all offsets, returns the required arena size in floats */
+    size_t plan() {
+      std::vector<size_t> order(blocks_.size());
+      for(size_t i = 0; i < order.size(); ++i)
+        order[i] = i;
+
+      std::stable_sort(order.begin(), order.end(),
+                       [this](size_t a, size_t b) {
+                         return blocks_[a].size > blocks_[b].size;
+                       });
+
+      total_ = 0;
+      std::vector<size_t> placed;
+      std::vector<const Block*> live;
+      for(auto i : order) {
+        Block& block = blocks_[i];
+
+        live.clear();
+        for(auto j : placed)
+          if(overlap(block, blocks_[j]))
+            live.push_back(&blocks_[j]);
+
+        std::sort(live.begin(), live.end(),
+                  [](const Block* a, const Block* b) {
+                    return a->offset < b->offset;
+                  });
+
+        size_t offset = 0;
+        for(auto other : live) {
+          if(other->offset >= offset + block.size)
+            break;
+          offset = std::max(offset, other->offset + other->size);
+        }
+
+        block.offset = offset;
+        total_ = std::max(total_, offset + block.size);
+        placed.push_back(i);
+      }
+      return total_;
+    }
+
+    size_t offset(size_t i) const {
+      return blocks_[i].offset;
+    }
+
+    size_t size() const {
+      return blocks_.size();
+    }
+
+    /** @brief Arena size of the last plan in floats */
+    size_t total() const {
+      return total_;
+    }
+
+    /** @brief Sum of all buffer sizes, i.e. the arena size without any reuse */
+    size_t unshared() const {
+      size_t sum = 0;
+      for(auto& b : blocks_)
+        sum += b.size;
+      return sum;
+    }
+
+    void clear() {
+      blocks_.clear();
+      total_ = 0;
+    }
+};
+
+}
@@ -0,0 +1,109 @@
+// This file is part of the Marian toolkit.
+
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <map>
+#include <cstring>
+#include <memory>
+
+#include "common/numa.h"
+#include "tensors/pinned_pool.h"
+#include "kernels/cuda_helpers.h"
+
+namespace marian {
+
+PinnedPool& PinnedPool::get(size_t device) {
+  static std::mutex mutex;
+  static std::map<size_t, std::unique_ptr<PinnedPool>> pools;
+
+  std::lock_guard<std::mutex> guard(mutex);
+  auto& pool = pools[device];
+  if(!pool)
+    pool.reset(new PinnedPool(device));
+  return *pool;
+}
+
+PinnedPool::~PinnedPool() {
+  for(auto buffer : buffers_) {
+    cudaEventSynchronize(buffer->event);
+    cudaEventDestroy(buffer->event);
+    cudaFreeHost(buffer->data);
+    delete buffer;
+  }
+}
+
+PinnedBuffer* PinnedPool::acquire(size_t elements) {
+  std::lock_guard<std::mutex> guard(mutex_);
+
+  PinnedBuffer* best = nullptr;
+  for(auto buffer : buffers_) {
+    if(!buffer->inUse && buffer->size >= elements
+       && (!best || buffer->size < best->size)
+       && cudaEventQuery(buffer->event) == cudaSuccess)
+      best = buffer;
+  }
+
+  if(!best) {
+    size_t size = 1024;
+    while(size < elements)
+      size *= 2;
+
+    CUDA_CHECK(cudaSetDevice(device_));
+    best = new PinnedBuffer();
+    // pinning touches the pages, which places them on the node of the device
+    numa::DeviceScope local(device_);
+    CUDA_CHECK(cudaHostAlloc((void**)&best->data, size * sizeof(float),
+                             cudaHostAllocPortable));
+    CUDA_CHECK(cudaEventCreateWithFlags(&best->event, cudaEventDisableTiming));
+    best->size = size;
+    buffers_.push_back(best);
+
+    bytes_ += size * sizeof(float);
+    LOG(memory, "Pinned staging pool grown to {} MB (device {})",
+        bytes_ / (1024 * 1024), device_);
+  }
+
+  best->inUse = true;
+  return best;
+}
+
+void PinnedPool::release(PinnedBuffer* buffer) {
+  std::lock_guard<std::mutex> guard(mutex_);
+  buffer->inUse = false;
+}
+
+bool Transfer::ready() {
+  return !buffer_ || cudaEventQuery(buffer_->event) == cudaSuccess;
+}
+
+void Transfer::wait() {
+  if(!buffer_)
+    return;
+
+  CUDA_CHECK(cudaEventSynchronize(buffer_->event));
+  if(dst_)
+    std::memcpy(dst_, buffer_->data, elements_ * sizeof(float));
+
+  PinnedPool::get(device_).release(buffer_);
+  buffer_ = nullptr;
+  dst_ = nullptr;
+}
+
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+// This file is part of the Marian toolkit.
+
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+
+#include <mutex>
+#include <vector>
+#include <cuda_runtime.h>
+
+#include "common/definitions.h"
+
+namespace marian {
+
+/**
+ * @brief Page-locked host buffer used for staging host<->device copies.
+ *
+ * A buffer may be handed out again once it is not in use and the copy
+ * recorded in its event has completed.
+ */
+struct PinnedBuffer {
+  float* data{nullptr};
+  size_t size{0};
+  cudaEvent_t event;
+  bool inUse{false};
+};
+
+/**
+ * @brief Pool of pinned staging buffers, one pool per device.
+ *
+ * Replaces registering and unregistering every std::vector that is copied to
+ * or from a device. Buffers grow in powers of two and are never returned to
+ * the system before the program exits.
+ */
+class PinnedPool {
+  private:
+    size_t device_;
+    std::mutex mutex_;
+    std::vector<PinnedBuffer*> buffers_;
+    size_t bytes_{0};
+
+    PinnedPool(size_t device) : device_(device) {}
+
+  public:
+    ~PinnedPool();
+
+    static PinnedPool& get(size_t device);
+
+    PinnedBuffer* acquire(size_t elements);
+
+    void release(PinnedBuffer* buffer);
+
+    size_t bytes() {
+      return bytes_;
+    }
+};
+
+/**
+ * @brief A pending host<->device copy through a pinned staging buffer.
+ *
+ * Device-to-host transfers deliver their data into the destination vector
+ * in wait(); destroying an unfinished device-to-host transfer waits for it.
+ * Host-to-device transfers may be dropped at any time, the staging buffer
+ * is not reused before the copy has finished.
+ */
+class Transfer {
+  private:
+    size_t device_;
+    PinnedBuffer* buffer_;
+    float* dst_;
+    size_t elements_;
+
+  public:
+    Transfer(size_t device, PinnedBuffer* buffer,
+             float* dst = nullptr, size_t elements = 0)
+    : device_(device), buffer_(buffer), dst_(dst), elements_(elements) {}
+
+    ~Transfer() {
+      if(dst_)
+        wait();
+      else if(buffer_)
+        PinnedPool::get(device_).release(buffer_);
+    }
+
+    Transfer(const Transfer&) = delete;
+
+    /** @brief True if the copy has completed, does not block */
+    bool ready();
+
+    /** @brief Blocks until the copy has completed and its data is delivered */
+    void wait();
+};
+
+}
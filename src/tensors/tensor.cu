@@ -25,6 +25,7 @@
 #include <thrust/device_vector.h>
 
 #include "tensors/tensor.h"
+#include "tensors/pinned_pool.h"
 #include "kernels/tensor_operators.h"
 #include "kernels/cuda_helpers.h"
 
@@ -40,59 +41,113 @@ __global__ void gFill(float* d_in, int size, float val) {
 }
 
 float TensorBase::get(size_t i) {
-   cudaSetDevice(device_);
-   float temp;
-   CUDA_CHECK(cudaMemcpy(&temp, data_ + i, sizeof(float),
-              cudaMemcpyDeviceToHost));
-   cudaStreamSynchronize(0);
-   return temp;
- }
+  if(isCPU(device_))
+    return data_[i];
 
-void TensorBase::set(size_t i, float value) {
-  cudaSetDevice(device_);
-  CUDA_CHECK(cudaMemcpy(data_ + i, &value, sizeof(float),
-             cudaMemcpyHostToDevice));
-  cudaStreamSynchronize(0);
+  float temp;
+  auto buffer = PinnedPool::get(device_).acquire(1);
+  Transfer transfer(device_, buffer, &temp, 1);
+
+  CUDA_CHECK(cudaSetDevice(device_));
+  CUDA_CHECK(cudaMemcpyAsync(buffer->data, data_ + i, sizeof(float),
+                             cudaMemcpyDeviceToHost, currentStream()));
+  CUDA_CHECK(cudaEventRecord(buffer->event, currentStream()));
+  transfer.wait();
+  return temp;
 }
 
-void TensorBase::get(std::vector<float> &v) {
+void TensorBase::set(size_t i, float value) {
+  if(isCPU(device_)) {
+    data_[i] = value;
+    return;
+  }
+
+  auto buffer = PinnedPool::get(device_).acquire(1);
+  Transfer transfer(device_, buffer);
+  buffer->data[0] = value;
+
   CUDA_CHECK(cudaSetDevice(device_));
+  CUDA_CHECK(cudaMemcpyAsync(data_ + i, buffer->data, sizeof(float),
+                             cudaMemcpyHostToDevice, currentStream()));
+  CUDA_CHECK(cudaEventRecord(buffer->event, currentStream()));
+  transfer.wait();
+}
+
+Ptr<Transfer> TensorBase::getAsync(std::vector<float> &v) {
   v.resize(size());
-  CUDA_CHECK(cudaHostRegister(v.data(), v.size() * sizeof(float),
-                              cudaHostRegisterPortable));
-  CUDA_CHECK(cudaMemcpy(v.data(), data_, size() * sizeof(float),
-             cudaMemcpyDeviceToHost));
-  CUDA_CHECK(cudaHostUnregister(v.data()));
-  cudaStreamSynchronize(0);
+  if(isCPU(device_)) {
+    std::copy(data_, data_ + size(), v.begin());
+    return New<Transfer>(device_, nullptr);
+  }
+
+  auto buffer = PinnedPool::get(device_).acquire(size());
+  auto transfer = New<Transfer>(device_, buffer, v.data(), v.size());
+
+  CUDA_CHECK(cudaSetDevice(device_));
+  CUDA_CHECK(cudaMemcpyAsync(buffer->data, data_, size() * sizeof(float),
+                             cudaMemcpyDeviceToHost, currentStream()));
+  CUDA_CHECK(cudaEventRecord(buffer->event, currentStream()));
+  return transfer;
+}
+
+Ptr<Transfer> TensorBase::setAsync(const std::vector<float> &v) {
+  if(isCPU(device_)) {
+    std::copy(v.begin(), v.end(), data_);
+    return New<Transfer>(device_, nullptr);
+  }
+
+  auto buffer = PinnedPool::get(device_).acquire(v.size());
+  auto transfer = New<Transfer>(device_, buffer);
+  std::copy(v.begin(), v.end(), buffer->data);
+
+  CUDA_CHECK(cudaSetDevice(device_));
+  CUDA_CHECK(cudaMemcpyAsync(data_, buffer->data, v.size() * sizeof(float),
+                             cudaMemcpyHostToDevice, currentStream()));
+  CUDA_CHECK(cudaEventRecord(buffer->event, currentStream()));
+  return transfer;
+}
+
+void TensorBase::get(std::vector<float> &v) {
+  getAsync(v)->wait();
 }
 
 void TensorBase::set(float value) {
+  if(isCPU(device_)) {
+    std::fill(data_, data_ + size(), value);
+    return;
+  }
+
   cudaSetDevice(device_);
+  if(value == 0.f) {
+    CUDA_CHECK(cudaMemsetAsync(data_, 0, size() * sizeof(float), currentStream()));
+    return;
+  }
+
   int threads = std::min(512, (int)size());
   int blocks = (size() / threads) + (size() % threads != 0);
-  gFill<<<blocks, threads>>>(data_, size(), value);
-  cudaStreamSynchronize(0);
+  gFill<<<blocks, threads, 0, currentStream()>>>(data_, size(), value);
 }
 
 void TensorBase::set(const std::vector<float> &v) {
-  CUDA_CHECK(cudaSetDevice(device_));
-  CUDA_CHECK(cudaHostRegister(const_cast<float*>(v.data()), v.size() * sizeof(float),
-                              cudaHostRegisterPortable));
-  CUDA_CHECK(cudaMemcpy(data_, v.data(), v.size() * sizeof(float),
-             cudaMemcpyHostToDevice));
-  CUDA_CHECK(cudaHostUnregister(const_cast<float*>(v.data())));
-  cudaStreamSynchronize(0);
+  setAsync(v)->wait();
 }
 
 void TensorBase::copyFrom(Tensor in) {
-    cudaSetDevice(device_);
+    if(isCPU(device_) && isCPU(in->getDevice())) {
+      std::copy(in->data(), in->data() + in->size(), data_);
+      return;
+    }
+
+    // mixed host/device copies rely on unified addressing
+    cudaSetDevice(isCPU(device_) ? in->getDevice() : device_);
     CUDA_CHECK(cudaMemcpy(data_ , in->data() , in->size() * sizeof(float),
                           cudaMemcpyDefault));
     cudaStreamSynchronize(0);
 }
 
 std::string TensorBase::debug() {
-  cudaSetDevice(device_);
+  if(!isCPU(device_))
+    cudaSetDevice(device_);
   std::stringstream strm;
   assert(shape_.size());
   strm << "shape=" << shape_[0];
@@ -185,9 +240,131 @@ std::string TensorBase::debug() {
 
 DeviceGPU::~DeviceGPU() {
   cudaSetDevice(device_);
+  cudaDeviceSynchronize();
+#if CUDA_VERSION >= 10020
+  if(virtual_) {
+    CUdeviceptr base = (CUdeviceptr)data_;
+    size_t offset = 0;
+    for(auto&& chunk : chunks_) {
+      CU_CHECK(cuMemUnmap(base + offset, chunk.second));
+      CU_CHECK(cuMemRelease(chunk.first));
+      offset += chunk.second;
+    }
+    CU_CHECK(cuMemAddressFree(base, range_));
+    return;
+  }
+#endif
   if(data_)
     CUDA_CHECK(cudaFree(data_));
-  cudaDeviceSynchronize();
+}
+
+bool DeviceGPU::reserveVirtual(size_t size) {
+#if CUDA_VERSION >= 10020
+  if(!virtual_) {
+    // a buffer that started out as a plain allocation stays one
+    if(data_)
+      return false;
+
+    CUdevice dev;
+    int supported = 0;
+    CUDA_CHECK(cudaFree(0));
+    CU_CHECK(cuDeviceGet(&dev, device_));
+    CU_CHECK(cuDeviceGetAttribute(&supported,
+             CU_DEVICE_ATTRIBUTE_VIRTUAL_ADDRESS_MANAGEMENT_SUPPORTED, dev));
+    if(!supported)
+      return false;
+  }
+
+  CUmemAllocationProp prop = {};
+  prop.type = CU_MEM_ALLOCATION_TYPE_PINNED;
+  prop.location.type = CU_MEM_LOCATION_TYPE_DEVICE;
+  prop.location.id = device_;
+
+  if(!virtual_) {
+    CU_CHECK(cuMemGetAllocationGranularity(&granularity_, &prop,
+                                           CU_MEM_ALLOC_GRANULARITY_RECOMMENDED));
+    size_t free, total;
+    CUDA_CHECK(cudaMemGetInfo(&free, &total));
+    range_ = (total + granularity_ - 1) / granularity_ * granularity_;
+
+    CUdeviceptr base;
+    if(cuMemAddressReserve(&base, range_, 0, 0, 0) != CUDA_SUCCESS)
+      return false;
+    data_ = (float*)base;
+    virtual_ = true;
+  }
+
+  size_t bytes = size * sizeof(float);
+  bytes = (bytes + granularity_ - 1) / granularity_ * granularity_;
+  UTIL_THROW_IF(bytes > range_, OutOfMemoryException,
+                 "Requested " << bytes << " bytes exceed the reserved address range of "
+                 << range_ << " bytes on device " << device_);
+
+  if(bytes > mapped_) {
+    size_t chunk = bytes - mapped_;
+    CUdeviceptr at = (CUdeviceptr)data_ + mapped_;
+
+    CUmemGenericAllocationHandle handle;
+    CUresult res = cuMemCreate(&handle, chunk, &prop, 0);
+    UTIL_THROW_IF(res != CUDA_SUCCESS, OutOfMemoryException,
+                  "Could not map " << chunk << " more bytes of workspace on device " << device_);
+    CU_CHECK(cuMemMap(at, chunk, 0, handle, 0));
+
+    CUmemAccessDesc access = {};
+    access.location = prop.location;
+    access.flags = CU_MEM_ACCESS_FLAGS_PROT_READWRITE;
+    CU_CHECK(cuMemSetAccess(at, chunk, &access, 1));
+
+    chunks_.emplace_back(handle, chunk);
+    mapped_ = bytes;
+  }
+
+  size_ = mapped_ / sizeof(float);
+  return true;
+#else
+  return false;
+#endif
+}
+
+void DeviceGPU::reserveManaged(size_t size) {
+  if(!data_) {
+    int supported = 0;
+    CUDA_CHECK(cudaDeviceGetAttribute(&supported, cudaDevAttrConcurrentManagedAccess, device_));
+    UTIL_THROW_IF2(!supported, "Managed memory larger than the device needs concurrent "
+                   "managed access, device " << device_ << " does not support it");
+  }
+
+  float* data;
+  if(cudaMallocManaged(&data, size * sizeof(float)) != cudaSuccess) {
+    cudaGetLastError();
+    UTIL_THROW(OutOfMemoryException,
+               "Could not allocate " << size * sizeof(float)
+               << " bytes of managed memory for device " << device_);
+  }
+  CUDA_CHECK(cudaMemAdvise(data, size * sizeof(float), cudaMemAdviseSetAccessedBy, device_));
+  if(data_) {
+    CUDA_CHECK(cudaMemcpy(data, data_, size_ * sizeof(float), cudaMemcpyDefault));
+    CUDA_CHECK(cudaFree(data_));
+  }
+  data_ = data;
+  size_ = size;
+}
+
+void DeviceGPU::advise(float* data, size_t size, bool resident) {
+  if(!managed_ || size == 0)
+    return;
+  cudaSetDevice(device_);
+  CUDA_CHECK(cudaMemAdvise(data, size * sizeof(float), cudaMemAdviseSetPreferredLocation,
+                           resident ? (int)device_ : cudaCpuDeviceId));
+  if(resident)
+    prefetch(data, size);
+}
+
+void DeviceGPU::prefetch(const float* data, size_t size) {
+  if(!managed_ || size == 0)
+    return;
+  cudaSetDevice(device_);
+  CUDA_CHECK(cudaMemPrefetchAsync(data, size * sizeof(float), device_, currentStream()));
 }
 
 void DeviceGPU::reserve(size_t size) {
@@ -195,19 +372,41 @@ void DeviceGPU::reserve(size_t size) {
 
    UTIL_THROW_IF2(size < size_, "New size must be larger than old size");
 
+   if(managed_) {
+     reserveManaged(size);
+     return;
+   }
+
+   if(reserveVirtual(size))
+     return;
+
    if(data_) {
      // Allocate memory by going through host memory
      float *temp = new float[size_];
      CUDA_CHECK(cudaMemcpy(temp, data_, size_* sizeof(float),
                 cudaMemcpyDeviceToHost));
      CUDA_CHECK(cudaFree(data_));
-     CUDA_CHECK(cudaMalloc(&data_, size * sizeof(float)));
+     bool grown = cudaMalloc(&data_, size * sizeof(float)) == cudaSuccess;
+     if(!grown) {
+       // restore the old buffer, its size was available a moment ago
+       cudaGetLastError();
+       CUDA_CHECK(cudaMalloc(&data_, size_ * sizeof(float)));
+     }
      CUDA_CHECK(cudaMemcpy(data_, temp, size_* sizeof(float),
                 cudaMemcpyHostToDevice));
      delete[] temp;
+     UTIL_THROW_IF(!grown, OutOfMemoryException,
+                   "Could not grow buffer to " << size * sizeof(float)
+                   << " bytes on device " << device_);
    }
    else {
-      CUDA_CHECK(cudaMalloc(&data_, size * sizeof(float)));
+      if(cudaMalloc(&data_, size * sizeof(float)) != cudaSuccess) {
+        cudaGetLastError();
+        data_ = 0;
+        UTIL_THROW(OutOfMemoryException,
+                   "Could not allocate " << size * sizeof(float)
+                   << " bytes on device " << device_);
+      }
    }
 
    size_ = size;
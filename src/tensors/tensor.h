@@ -25,6 +25,7 @@
 #include <iostream>
 #include <sstream>
 #include <iomanip>
+#include <vector>
 
 #include "3rd_party/exception.h"
 #include "common/definitions.h"
@@ -32,6 +33,8 @@
 
 namespace marian {
 
+class Transfer;
+
 class TensorBase : public std::enable_shared_from_this<TensorBase> {
   private:
     float* data_;
@@ -77,34 +80,103 @@ class TensorBase : public std::enable_shared_from_this<TensorBase> {
 
     float get(size_t i);
 
+    /** @brief Writes  value  at  i , the tensor holds it when the call returns */
     void set(size_t i, float value);
 
     void get(std::vector<float> &v);
 
     void set(float value);
 
+    /** @brief Copies  v  into the tensor, which holds it when the call returns */
     void set(const std::vector<float> &v);
 
+    /** @brief Starts copying the tensor into  v  through a pinned staging buffer */
+    Ptr<Transfer> getAsync(std::vector<float> &v);
+
+    /**
+     * @brief Starts copying  v  into the tensor on currentStream(),  v  may be
+     * modified or freed right after the call. Only work queued behind it on
+     * the same stream sees the data, other streams and threads have to wait
+     * for the transfer.
+     */
+    Ptr<Transfer> setAsync(const std::vector<float> &v);
+
     void copyFrom(Tensor);
 
     std::string debug();
 };
 
-class DeviceGPU {
+/** @brief Device id under which tensors live in host memory */
+const size_t CPU_DEVICE = (size_t)-1;
+
+inline bool isCPU(size_t device) {
+  return device == CPU_DEVICE;
+}
+
+/** @brief Thrown when a device buffer cannot grow, the buffer keeps its previous contents */
+class OutOfMemoryException : public util::Exception {
+  public:
+    OutOfMemoryException() throw() {}
+    ~OutOfMemoryException() throw() {}
+};
+
+class DeviceBase {
+  public:
+    virtual ~DeviceBase() {}
+
+    virtual void reserve(size_t size) = 0;
+
+    virtual float* data() = 0;
+
+    virtual size_t capacity() = 0;
+
+    virtual size_t getDevice() = 0;
+
+    /** @brief Hints where  size  floats at  data  should live, see DeviceGPU */
+    virtual void advise(float* data, size_t size, bool resident) {}
+
+    /** @brief Moves  size  floats at  data  to the device ahead of their use */
+    virtual void prefetch(const float* data, size_t size) {}
+};
+
+/**
+ * @brief Device memory backing a TensorAllocator.
+ *
+ * Where the driver supports virtual memory management, the first reserve()
+ * sets aside an address range as large as the device memory and later calls
+ * only map more physical memory behind it: the buffer grows in place, data()
+ * never changes and nothing is copied. Otherwise growing allocates a new
+ * buffer and copies the old contents through host memory.
+ *
+ * A managed buffer is CUDA managed memory instead, which may exceed the
+ * device memory: pages migrate to the device when they are used or
+ * prefetched and are evicted to the host when the device is full.
+ */
+class DeviceGPU : public DeviceBase {
   private:
     float* data_;
     size_t size_;
     size_t device_;
 
+    // virtual address range and the physical chunks (handle, bytes) mapped into it
+    bool virtual_{false};
+    size_t range_{0};
+    size_t mapped_{0};
+    size_t granularity_{0};
+    std::vector<std::pair<unsigned long long, size_t>> chunks_;
+
+    bool managed_{false};
+
+    bool reserveVirtual(size_t size);
+    void reserveManaged(size_t size);
+
   public:
-    DeviceGPU(size_t device)
-    : data_(0), size_(0), device_(device) {
+    DeviceGPU(size_t device, bool managed = false)
+    : data_(0), size_(0), device_(device), managed_(managed) {
    }
 
     ~DeviceGPU();
 
-    typedef TensorBase tensor_type;
-
     void reserve(size_t size);
 
     float* data() {
@@ -118,6 +190,16 @@ class DeviceGPU {
     size_t getDevice() {
       return device_;
     }
+
+    /**
+     * @brief In a managed buffer, keeps  size  floats at  data  on the device
+     * if  resident , otherwise lets them live on the host, read in place by
+     * the device unless prefetched. Nothing for device memory.
+     */
+    void advise(float* data, size_t size, bool resident);
+
+    /** @brief Migrates pages of a managed buffer on the current stream, nothing otherwise */
+    void prefetch(const float* data, size_t size);
 };
 
 typedef std::shared_ptr<TensorBase> Tensor;
@@ -23,74 +23,201 @@
 
 #include <set>
 #include <deque>
+#include <vector>
+#include <unordered_map>
+#include <unordered_set>
+#include <algorithm>
 
 #include "common/definitions.h"
 #include "tensors/tensor.h"
+#include "tensors/tensor_cpu.h"
 
 namespace marian {
 
+/**
+ * @brief Strategies for managing free space inside a TensorAllocator
+ *
+ * bestfit:   exact sizes from a set of gaps, neighbouring gaps are merged on free.
+ *            Keeps tensors contiguous, required for parameters.
+ * sizeclass: sizes are rounded up to a size class, freed blocks are cached in
+ *            per-class free lists and handed out again in O(1). Cached blocks are
+ *            only returned to the gaps if the buffer would otherwise have to grow.
+ */
+enum struct allocation { bestfit, sizeclass };
+
 class TensorAllocator {
   private:
     const size_t CHUNK  = 512;
     const size_t MBYTE  = 1024 * 1024;
     const size_t FLOATS = CHUNK * MBYTE / sizeof(float);
 
-    DeviceGPU device_;
+    UPtr<DeviceBase> device_;
+    allocation strategy_{allocation::bestfit};
 
     typedef std::pair<size_t, float*> Gap;
     std::set<Gap> gaps_;
     Gap lastGap_;
 
-    std::deque<Tensor> allocated_;
+    std::unordered_set<Tensor> allocated_;
+
+    // cached free blocks per size class
+    std::unordered_map<size_t, std::vector<float*>> bins_;
+    size_t cached_{0};
+
+    // front of the buffer reserved for tensors with planned offsets
+    size_t planned_{0};
+    std::deque<Tensor> plannedTensors_;
+
+    size_t allocations_{0};
+    size_t hits_{0};
+    size_t flushes_{0};
+    size_t growths_{0};
+
+    // floats in use by live tensors and the planned region, and their maximum
+    size_t used_{0};
+    size_t peak_{0};
+
+    // end of the furthest block ever handed out, in floats from the start
+    size_t extent_{0};
+
+    // maximum capacity in floats, 0 for none, see setLimit()
+    size_t limit_{0};
+
+    /** @brief Capacity to grow to for  elements  floats, at most the limit */
+    size_t bounded(size_t elements, size_t needed) {
+      if(!limit_)
+        return elements;
+      UTIL_THROW_IF(needed > limit_, OutOfMemoryException,
+                    "Work space of " << needed * sizeof(float) / MBYTE
+                    << " MB exceeds the limit of " << limit_ * sizeof(float) / MBYTE << " MB");
+      return std::min(elements, limit_);
+    }
+
+    void use(size_t elements) {
+      used_ += elements;
+      peak_ = std::max(peak_, used_);
+    }
 
     void reset(Tensor t, float* start) {
       t->reset(start);
     }
 
+    /** @brief Number of floats a tensor of  elements  floats occupies in the buffer */
+    size_t footprint(size_t elements) {
+      if(strategy_ == allocation::bestfit)
+        return elements;
+
+      // multiples of 64 floats for small tensors, four classes per power of two above
+      const size_t small = 4096;
+      if(elements <= small)
+        return std::max((size_t)64, (elements + 63) / 64 * 64);
+
+      size_t step = 1;
+      while((step << 3) <= elements)
+        step <<= 1;
+      return (elements + step - 1) / step * step;
+    }
+
     void resetAllocated(float* oldStart) {
+      for(auto&& t : plannedTensors_)
+        reset(t, device_->data() + (t->data() - oldStart));
+
+      // cached blocks are dropped, their space becomes part of the gaps
+      bins_.clear();
+      cached_ = 0;
+
+      std::vector<Tensor> sorted(allocated_.begin(), allocated_.end());
+      std::sort(sorted.begin(), sorted.end(),
+                [](const Tensor& a, const Tensor& b) {
+                  return a->data() < b->data();
+                });
+
       gaps_.clear();
-      size_t prev = 0;
-      for(auto&& t : allocated_) {
+      size_t prev = planned_;
+      for(auto&& t : sorted) {
         size_t dist = t->data() - oldStart;
-        reset(t, device_.data() + dist);
+        reset(t, device_->data() + dist);
         if(dist > prev)
-          gaps_.emplace(dist - prev, device_.data() + prev);
-        prev = dist + t->size();
-      }
-
-      if(allocated_.empty()) {
-        lastGap_ = { device_.capacity(), device_.data() };
-      }
-      else {
-        size_t used = allocated_.back()->data() - device_.data() + allocated_.back()->size();
-        size_t gap = device_.capacity() - used;
-        float* addr = allocated_.back()->data() + allocated_.back()->size();
-        lastGap_ = { gap, addr };
+          gaps_.emplace(dist - prev, device_->data() + prev);
+        prev = dist + footprint(t->size());
       }
 
+      lastGap_ = { device_->capacity() - prev, device_->data() + prev };
       gaps_.insert(lastGap_);
     }
 
-    auto getGap(Shape shape) -> decltype(gaps_.begin()) {
+    /** @brief Updates bookkeeping after the device buffer has grown */
+    void grown(float* oldStart, size_t oldCapacity) {
+      // grown in place: tensors and cached blocks stay valid, only the new tail is free
+      if(oldStart && oldStart == device_->data()) {
+        if(device_->capacity() > oldCapacity)
+          insertGap({ device_->capacity() - oldCapacity, oldStart + oldCapacity });
+        return;
+      }
+      resetAllocated(oldStart);
+    }
+
+    auto getGap(size_t elements) -> decltype(gaps_.begin()) {
       auto it = std::lower_bound(gaps_.begin(), gaps_.end(),
-                                 std::make_pair((size_t)shape.elements(), (float*)0));
+                                 std::make_pair(elements, (float*)0));
       return it;
     }
 
-    auto checkSpace(Shape shape) -> decltype(gaps_.begin()) {
-      auto gapIt = getGap(shape);
+    auto checkSpace(size_t elements) -> decltype(gaps_.begin()) {
+      auto gapIt = getGap(elements);
+      if(gapIt == gaps_.end() && cached_ > 0) {
+        flush();
+        gapIt = getGap(elements);
+      }
       if(gapIt == gaps_.end()) {
-        size_t incr = device_.capacity() - lastGap_.first + shape.elements();
-        reserve(device_.capacity() + incr);
+        size_t incr = device_->capacity() - lastGap_.first + elements;
+        reserve(device_->capacity() + incr);
         gapIt = gaps_.find(lastGap_);
       }
       return gapIt;
     }
 
+    void insertGap(Gap gap) {
+      auto it2 = gaps_.begin();
+      std::vector<decltype(it2)> adjacent;
+      while(it2 != gaps_.end()) {
+        if(it2->second + it2->first  == gap.second) {
+          gap = { gap.first + it2->first, it2->second };
+          adjacent.push_back(it2);
+        }
+        if(gap.second + gap.first == it2->second) {
+          gap = { gap.first + it2->first, gap.second };
+          adjacent.push_back(it2);
+        }
+        it2++;
+      }
+      for(auto&& a : adjacent)
+        gaps_.erase(a);
+      if(gap.second + gap.first == device_->data() + device_->capacity())
+        lastGap_ = gap;
+      gaps_.insert(gap);
+    }
+
+    /** @brief Returns all cached blocks to the gaps, merging neighbours */
+    void flush() {
+      flushes_++;
+      for(auto&& bin : bins_)
+        for(auto ptr : bin.second)
+          insertGap({ bin.first, ptr });
+      bins_.clear();
+      cached_ = 0;
+      LOG(memory, "Flushed cached blocks (device {}): {}",
+          device_->getDevice(), statistics());
+    }
+
   public:
-    TensorAllocator(size_t device)
-     : device_(device) {
-      lastGap_ = { device_.capacity(), device_.data() };
+    /** @brief With  managed , the buffer is CUDA managed memory, see DeviceGPU */
+    TensorAllocator(size_t device, allocation strategy = allocation::bestfit,
+                    bool managed = false)
+     : device_(isCPU(device) ? (DeviceBase*)new DeviceCPU()
+                             : (DeviceBase*)new DeviceGPU(device, managed)),
+       strategy_(strategy) {
+      lastGap_ = { device_->capacity(), device_->data() };
       gaps_.insert(lastGap_);
     }
 
@@ -100,92 +227,247 @@ class TensorAllocator {
 
     void reserve(size_t elements = 0) {
       float mult = elements / FLOATS + 1;
+      size_t capacity = bounded(mult * FLOATS, elements);
       LOG(memory, "Extending reserved space to {} MB (device {})",
-	  mult * CHUNK, device_.getDevice());
+	  capacity * sizeof(float) / MBYTE, device_->getDevice());
 
-      size_t old = device_.capacity();
-      float* oldStart = device_.data();
-      device_.reserve(mult * FLOATS);
-      resetAllocated(oldStart);
+      growths_++;
+      float* oldStart = device_->data();
+      size_t oldCapacity = device_->capacity();
+      device_->reserve(capacity);
+      grown(oldStart, oldCapacity);
+    }
+
+    /** @brief Placement hint for  t  in a managed buffer, see DeviceGPU::advise() */
+    void advise(Tensor t, bool resident) {
+      device_->advise(t->data(), t->size(), resident);
+    }
+
+    /** @brief Migrates  size  floats at  data  of a managed buffer to the device */
+    void prefetch(const float* data, size_t size) {
+      device_->prefetch(data, size);
+    }
+
+    /**
+     * @brief Lets the buffer grow to at most  elements  floats, 0 for no limit.
+     * Allocations beyond it throw OutOfMemoryException as if the device were full.
+     */
+    void setLimit(size_t elements) {
+      limit_ = elements;
     }
 
     void reserveExact(size_t elements = 0) {
+      // a preallocation beyond the limit is cut to it
+      if(limit_)
+        elements = std::min(elements, limit_);
       size_t mbytes = (elements * sizeof(float)) / MBYTE;
       LOG(memory, "Reserving space for {} floats ({} MB, device {})",
-	  elements, mbytes, device_.getDevice());
+	  elements, mbytes, device_->getDevice());
 
-      size_t old = device_.capacity();
-      float* oldStart = device_.data();
-      device_.reserve(elements);
-      resetAllocated(oldStart);
+      growths_++;
+      float* oldStart = device_->data();
+      size_t oldCapacity = device_->capacity();
+      device_->reserve(elements);
+      grown(oldStart, oldCapacity);
     }
 
     void clear() {
       gaps_.clear();
-      lastGap_ = { device_.capacity(), device_.data() };
+      lastGap_ = { device_->capacity(), device_->data() };
       gaps_.insert(lastGap_);
       allocated_.clear();
+      bins_.clear();
+      cached_ = 0;
+      planned_ = 0;
+      plannedTensors_.clear();
+      used_ = 0;
+    }
+
+    /**
+     * @brief Sets aside the first  elements  floats for tensors with planned offsets.
+     *
+     * Only possible while no tensors are allocated, the remainder of the buffer
+     * keeps being managed as free gaps.
+     */
+    void reservePlanned(size_t elements) {
+      UTIL_THROW_IF2(!allocated_.empty() || !plannedTensors_.empty(),
+                     "Planned space can only be reserved in an empty allocator");
+
+      if(device_->capacity() < elements)
+        reserve(elements);
+
+      bins_.clear();
+      cached_ = 0;
+      planned_ = elements;
+      extent_ = std::max(extent_, planned_);
+      used_ = 0;
+      use(planned_);
+      gaps_.clear();
+      lastGap_ = { device_->capacity() - planned_, device_->data() + planned_ };
+      gaps_.insert(lastGap_);
+    }
+
+    size_t planned() {
+      return planned_;
+    }
+
+    bool empty() {
+      return allocated_.empty() && plannedTensors_.empty();
+    }
+
+    void allocateAt(Tensor &t, Shape shape, size_t offset) {
+      UTIL_THROW_IF2(offset + shape.elements() > planned_,
+                     "Planned tensor exceeds planned space");
+      if(!t || t->shape() != shape) {
+        t.reset(new TensorBase(device_->data() + offset, shape, device_->getDevice()));
+        plannedTensors_.push_back(t);
+      }
     }
 
     void allocate(Tensor &t, Shape shape) {
       if(!t || t->shape() != shape) {
-        auto it = checkSpace(shape);
+        allocations_++;
+        size_t elements = footprint(shape.elements());
+
+        if(strategy_ == allocation::sizeclass) {
+          auto bin = bins_.find(elements);
+          if(bin != bins_.end() && !bin->second.empty()) {
+            hits_++;
+            float* start = bin->second.back();
+            bin->second.pop_back();
+            cached_ -= elements;
+            t.reset(new TensorBase(start, shape, device_->getDevice()));
+            allocated_.insert(t);
+            use(elements);
+            return;
+          }
+        }
+
+        auto it = checkSpace(elements);
         float* start = it->second;
-        t.reset(new TensorBase(start, shape, device_.getDevice()));
-        allocated_.push_back(t);
-        if(it->first > t->size())
-          gaps_.emplace(it->first - t->size(), it->second + t->size());
+        t.reset(new TensorBase(start, shape, device_->getDevice()));
+        allocated_.insert(t);
+        use(elements);
+        extent_ = std::max(extent_, (size_t)(start - device_->data()) + elements);
+
+        Gap gap = *it;
         gaps_.erase(it);
+        if(gap.first > elements) {
+          Gap rest = { gap.first - elements, gap.second + elements };
+          gaps_.insert(rest);
+          if(gap == lastGap_)
+            lastGap_ = rest;
+        }
+        else if(gap == lastGap_) {
+          lastGap_ = { 0, gap.second + gap.first };
+        }
       }
     }
 
     void free(Tensor& t) {
-      auto it = allocated_.rbegin();
-      while(it != allocated_.rend()) {
-        if(*it == t) {
-          Gap gap = { t->size(), t->data() };
-          allocated_.erase(std::next(it).base());
-
-          auto it2 = gaps_.begin();
-          std::vector<decltype(it2)> adjacent;
-          while(it2 != gaps_.end()) {
-            if(it2->second + it2->first  == gap.second) {
-              gap = { gap.first + it2->first, it2->second };
-              adjacent.push_back(it2);
-            }
-            if(gap.second + gap.first == it2->second) {
-              gap = { gap.first + it2->first, gap.second };
-              adjacent.push_back(it2);
-            }
-            it2++;
-          }
-          for(auto&& a : adjacent)
-            gaps_.erase(a);
-          gaps_.insert(gap);
-          break;
+      if(t->data() < device_->data() + planned_) {
+        auto it = std::find(plannedTensors_.begin(), plannedTensors_.end(), t);
+        if(it != plannedTensors_.end())
+          plannedTensors_.erase(it);
+        t.reset();
+        return;
+      }
+
+      auto it = allocated_.find(t);
+      if(it != allocated_.end()) {
+        allocated_.erase(it);
+        size_t elements = footprint(t->size());
+        used_ -= elements;
+        if(strategy_ == allocation::sizeclass) {
+          bins_[elements].push_back(t->data());
+          cached_ += elements;
+        }
+        else {
+          insertGap({ elements, t->data() });
         }
-        it++;
       }
       t.reset();
     }
 
     Tensor asTensor() {
-      float* start = device_.data();
-      return Tensor(new TensorBase(start, {1, (int)size()}, device_.getDevice()));
+      float* start = device_->data();
+      return Tensor(new TensorBase(start, {1, (int)size()}, device_->getDevice()));
     }
 
     size_t capacity() {
-      return device_.capacity();
+      return device_->capacity();
+    }
+
+    /** @brief Start of the underlying buffer, changes if growing has to move it */
+    float* memory() {
+      return device_->data();
     }
 
     size_t size() {
-      float* start = device_.data();
-      float* end = start;
-      if(!allocated_.empty())
-        end = allocated_.back()->data() + allocated_.back()->size();
+      float* start = device_->data();
+      float* end = start + planned_;
+      for(auto&& t : allocated_)
+        end = std::max(end, t->data() + footprint(t->size()));
 
       return end - start;
     }
+
+    /** @brief Largest contiguous free gap in floats, not counting cached blocks */
+    size_t largestGap() {
+      return gaps_.empty() ? 0 : gaps_.rbegin()->first;
+    }
+
+    /** @brief Floats currently held by live tensors, including the planned region */
+    size_t used() {
+      return used_;
+    }
+
+    /** @brief High-water mark of used() since construction or the last resetPeak() */
+    size_t peak() {
+      return peak_;
+    }
+
+    void resetPeak() {
+      peak_ = used_;
+    }
+
+    /**
+     * @brief Floats of the buffer up to the end of the furthest tensor placed
+     * since construction, the capacity the same work needs without growing
+     */
+    size_t extent() {
+      return extent_;
+    }
+
+    /** @brief Number of times the underlying buffer was grown */
+    size_t growths() {
+      return growths_;
+    }
+
+    size_t device() {
+      return device_->getDevice();
+    }
+
+    std::string statistics() {
+      size_t free = 0;
+      for(auto&& gap : gaps_)
+        free += gap.first;
+      float fragmentation = free > 0 ? 1.f - largestGap() / (float)free : 0.f;
+
+      std::stringstream ss;
+      ss << used_ * sizeof(float) / MBYTE << " MB used, "
+         << peak_ * sizeof(float) / MBYTE << " MB peak, "
+         << device_->capacity() * sizeof(float) / MBYTE << " MB reserved, "
+         << largestGap() * sizeof(float) / MBYTE << " MB largest gap, "
+         << allocations_ << " allocations, "
+         << hits_ << " cache hits, "
+         << flushes_ << " flushes, "
+         << growths_ << " growths, "
+         << cached_ * sizeof(float) / MBYTE << " MB cached, "
+         << std::fixed << std::setprecision(2)
+         << fragmentation << " fragmentation";
+      return ss.str();
+    }
 };
 
 }
@@ -21,43 +21,26 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 
+#include <cstdlib>
 #include <cstring>
 
 #include "tensors/tensor.h"
 
 namespace marian {
 
-class TensorCPU : public TensorBase {
-  public:
-    TensorCPU(float* data, Shape shape)
-    : TensorBase(data, shape) {}
-
-    float get(size_t i) {
-      return data_[i];
-    }
-
-    void set(size_t i, float value) {
-      data_[i] = value;
-    }
-
-    void get(std::vector<float> &v) {
-      v.resize(size());
-      std::copy(data_, data_ + size(), v.begin());
-    }
-
-    void set(float value) {
-      std::fill(data_, data_ + size(), value);
-    }
-
-    void set(const std::vector<float> &v) {
-      std::copy(v.begin(), v.end(), data_);
-    }
-};
-
-class DeviceCPU {
+/**
+ * @brief Host memory backing for tensors on CPU_DEVICE.
+ *
+ * Memory is 64-byte aligned so rows handed to vectorized kernels start on a
+ * cache line. Tensors themselves are plain TensorBase objects, their
+ * accessors dispatch on the device id.
+ */
+class DeviceCPU : public DeviceBase {
   private:
     float* data_;
-    size_t size_
+    size_t size_;
+
+    static const size_t ALIGNMENT = 64;
 
   public:
     DeviceCPU()
@@ -65,21 +48,21 @@ class DeviceCPU {
 
     ~DeviceCPU() {
       if(data_)
-        delete[] data_;
+        std::free(data_);
     }
 
-    typedef TensorCPU tensor_type;
-
     void reserve(size_t size) {
       UTIL_THROW_IF2(size < size_, "New size must be larger than old size");
-      float* temp = new float[size];
+      void* temp = nullptr;
+      UTIL_THROW_IF2(posix_memalign(&temp, ALIGNMENT, size * sizeof(float)),
+                     "Could not allocate " << size << " floats on CPU");
 
       if(data_) {
-        std::memcpy(temp, data_, size_* sizeof(float));
-        delete[] data_;
+        std::memcpy(temp, data_, size_ * sizeof(float));
+        std::free(data_);
       }
 
-      data_ = temp;
+      data_ = (float*)temp;
       size_ = size;
     }
 
@@ -90,6 +73,10 @@ class DeviceCPU {
     size_t capacity() {
       return size_;
     }
+
+    size_t getDevice() {
+      return CPU_DEVICE;
+    }
 };
 
 }
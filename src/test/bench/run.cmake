@@ -0,0 +1,34 @@
+# Runs marian_bench_train with the configuration of every model type of TYPES
+# and compares the results to BASELINE with marian_bench_check, or records
+# them as the new baseline with UPDATE. Fails if any type regressed. Run by
+# the bench_regression and bench_baseline targets:
+#
+#   cmake -DBENCH_TRAIN=... -DBENCH_CHECK=... -DBASELINE=... -DTYPES="dl4mt;gnmt"
+#         -DCONFIG_DIR=... -DOUTPUT_DIR=... [-DUPDATE=ON] -P run.cmake
+
+set(failed "")
+foreach(type ${TYPES})
+  set(results ${OUTPUT_DIR}/bench_${type}.json)
+  message(STATUS "Benchmarking ${type}")
+  execute_process(COMMAND ${BENCH_TRAIN} -c ${CONFIG_DIR}/${type}.yml
+                  OUTPUT_FILE ${results}
+                  RESULT_VARIABLE status)
+  if(NOT status EQUAL 0)
+    list(APPEND failed ${type})
+  else()
+    if(UPDATE)
+      execute_process(COMMAND ${BENCH_CHECK} ${BASELINE} ${results} --update
+                      RESULT_VARIABLE status)
+    else()
+      execute_process(COMMAND ${BENCH_CHECK} ${BASELINE} ${results}
+                      RESULT_VARIABLE status)
+    endif()
+    if(NOT status EQUAL 0)
+      list(APPEND failed ${type})
+    endif()
+  endif()
+endforeach()
+
+if(failed)
+  message(FATAL_ERROR "Performance regression or failed benchmark: ${failed}")
+endif()
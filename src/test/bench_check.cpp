@@ -0,0 +1,130 @@
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+
+#include "3rd_party/yaml-cpp/yaml.h"
+
+// Compares the JSON output of marian_bench_train against a baseline, see main()
+
+typedef std::map<std::string, double> Metrics;
+
+/** Metrics where lower is better, all others are throughputs */
+bool lowerIsBetter(const std::string& metric) {
+  auto endsWith = [&](const std::string& suffix) {
+    return metric.size() >= suffix.size()
+           && metric.compare(metric.size() - suffix.size(), suffix.size(), suffix) == 0;
+  };
+  return metric.find("_ms_") != std::string::npos || endsWith("_mb");
+}
+
+/**
+ * The metrics of a run: those of the last training result, with all devices,
+ * the scaling efficiency and those of the decoding pass prefixed with
+ * "decoding_". JSON is read as YAML.
+ */
+Metrics metrics(const YAML::Node& run) {
+  Metrics found;
+  auto add = [&](const YAML::Node& node, const std::string& prefix) {
+    for(auto it = node.begin(); it != node.end(); ++it)
+      if(it->second.IsScalar())
+        found[prefix + it->first.as<std::string>()] = it->second.as<double>();
+  };
+
+  auto results = run["results"];
+  if(results && results.size() > 0)
+    add(results[results.size() - 1], "");
+  if(run["scaling_efficiency"])
+    found["scaling_efficiency"] = run["scaling_efficiency"].as<double>();
+  if(run["decoding"])
+    add(run["decoding"], "decoding_");
+
+  // counts and sizes of the run, not results
+  for(auto key : {"devices", "steps", "seconds", "decoding_beam_size",
+                  "decoding_sentences", "decoding_seconds"})
+    found.erase(key);
+  return found;
+}
+
+/**
+ * Usage:
+ *
+ *     marian_bench_check baseline.yml results.json [--update]
+ *
+ * Every metric the baseline lists under the model type of the results, e.g.
+ *
+ *     tolerance: 0.05
+ *     gnmt:
+ *       tolerance: 0.1
+ *       words_per_second: 4150
+ *       decoding_sentences_per_second: 38.5
+ *
+ * must not be worse than its baseline value by more than the type's relative
+ * tolerance, or the top-level one. Throughputs may not fall below, step times
+ * (_ms_) and memory (_mb) not rise above. Returns 1 on a regression, the
+ * results are printed either way. With --update the metrics of the results
+ * replace the baseline of their type instead, for a new reference machine.
+ */
+int main(int argc, char** argv) {
+  if(argc < 3) {
+    std::cerr << "Usage: " << argv[0] << " baseline.yml results.json [--update]" << std::endl;
+    return 2;
+  }
+  std::string baselineFile = argv[1];
+  bool update = argc > 3 && std::string(argv[3]) == "--update";
+
+  YAML::Node run = YAML::LoadFile(argv[2]);
+  std::string type = run["type"].as<std::string>();
+  if(run["sync"] && run["sync"].as<bool>())
+    type += "-sync";
+  Metrics current = metrics(run);
+
+  YAML::Node baseline;
+  std::ifstream exists(baselineFile);
+  if(exists)
+    baseline = YAML::LoadFile(baselineFile);
+
+  if(update) {
+    YAML::Node entry = baseline[type] ? baseline[type] : YAML::Node();
+    for(auto& m : current)
+      entry[m.first] = m.second;
+    baseline[type] = entry;
+    std::ofstream out(baselineFile);
+    out << baseline << std::endl;
+    std::cout << "Updated the baseline of " << type << " in " << baselineFile << std::endl;
+    return 0;
+  }
+
+  if(!baseline[type]) {
+    std::cerr << "No baseline for " << type << " in " << baselineFile
+              << ", record one with --update" << std::endl;
+    return 1;
+  }
+
+  double tolerance = baseline["tolerance"] ? baseline["tolerance"].as<double>() : 0.05;
+  if(baseline[type]["tolerance"])
+    tolerance = baseline[type]["tolerance"].as<double>();
+
+  bool regressed = false;
+  for(auto it = baseline[type].begin(); it != baseline[type].end(); ++it) {
+    std::string metric = it->first.as<std::string>();
+    if(metric == "tolerance")
+      continue;
+    double expected = it->second.as<double>();
+    if(!current.count(metric)) {
+      std::cout << type << " " << metric << ": missing from the results" << std::endl;
+      regressed = true;
+      continue;
+    }
+
+    double value = current[metric];
+    double change = expected != 0 ? (value - expected) / std::fabs(expected) : 0;
+    bool worse = lowerIsBetter(metric) ? change > tolerance : change < -tolerance;
+    regressed |= worse;
+    std::cout << type << " " << metric << ": " << value << " (baseline " << expected << ", "
+              << (change >= 0 ? "+" : "") << 100 * change << "%)"
+              << (worse ? " REGRESSION" : "") << std::endl;
+  }
+  return regressed ? 1 : 0;
+}
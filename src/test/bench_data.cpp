@@ -0,0 +1,175 @@
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sys/resource.h>
+
+#include "common/logging.h"
+#include "data/batch_generator.h"
+#include "data/corpus.h"
+#include "training/config.h"
+
+namespace marian {
+
+struct DataResult {
+  int miniBatch{0};
+  int maxiBatch{0};
+  size_t miniBatchWords{0};
+  bool shuffle{false};
+
+  double prepareSeconds{0};
+  double seconds{0};
+  size_t sentences{0};
+  size_t tokens{0};
+  size_t batches{0};
+  std::vector<float> padding;
+  size_t peakRss{0};
+
+  std::string json() const {
+    auto rate = [&](size_t n) { return seconds > 0 ? n / seconds : 0; };
+    double efficiency = 0;
+    for(auto e : padding)
+      efficiency += e / padding.size();
+
+    std::stringstream ss;
+    ss << "{\"mini_batch\": " << miniBatch
+       << ", \"maxi_batch\": " << maxiBatch
+       << ", \"mini_batch_words\": " << miniBatchWords
+       << ", \"shuffle\": " << (shuffle ? "true" : "false")
+       << ", \"prepare_seconds\": " << prepareSeconds
+       << ", \"seconds\": " << seconds
+       << ", \"sentences_per_second\": " << rate(sentences)
+       << ", \"tokens_per_second\": " << rate(tokens)
+       << ", \"batches_per_second\": " << rate(batches)
+       << ", \"padding_ratio\": " << (padding.empty() ? 0 : 1 - efficiency)
+       << ", \"peak_rss_mb\": " << peakRss / 1024 << "}";
+    return ss.str();
+  }
+};
+
+/**
+ * @brief Resets the peak resident set size of the process where the kernel
+ * supports it, so that peakRss() covers only what follows
+ */
+bool resetPeakRss() {
+  std::ofstream out("/proc/self/clear_refs");
+  return (bool)(out << "5" << std::flush);
+}
+
+/** @brief Peak resident set size in KB, since the last resetPeakRss() if it succeeded */
+size_t peakRss() {
+  std::ifstream in("/proc/self/status");
+  std::string line;
+  while(std::getline(in, line))
+    if(line.compare(0, 6, "VmHWM:") == 0)
+      return std::stoul(line.substr(6));
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+DataResult benchmark(Ptr<data::Corpus> corpus,
+                     Ptr<Config> options,
+                     int miniBatch,
+                     int maxiBatch,
+                     size_t miniBatchWords,
+                     bool shuffle) {
+  options->get()["mini-batch"] = miniBatch;
+  options->get()["maxi-batch"] = maxiBatch;
+  options->get()["mini-batch-words"] = miniBatchWords;
+  options->refresh();
+
+  DataResult result;
+  result.miniBatch = miniBatch;
+  result.maxiBatch = maxiBatch;
+  result.miniBatchWords = miniBatchWords;
+  result.shuffle = shuffle;
+  size_t limit = options->get<size_t>("bench-data-batches");
+
+  resetPeakRss();
+  typedef std::chrono::steady_clock clock;
+  data::BatchGenerator<data::Corpus> batchGenerator(corpus, options);
+
+  // the first shuffle of a text corpus also indexes its lines
+  auto start = clock::now();
+  batchGenerator.prepare(shuffle);
+  auto prepared = clock::now();
+  result.prepareSeconds = std::chrono::duration<double>(prepared - start).count();
+
+  while(batchGenerator && (limit == 0 || result.batches < limit)) {
+    auto batch = batchGenerator.next();
+    result.batches++;
+    result.sentences += batch->size();
+    for(size_t i = 0; i < batch->sets(); ++i)
+      result.tokens += std::count_if((*batch)[i].mask().begin(), (*batch)[i].mask().end(),
+                                     [](float m) { return m != 0; });
+  }
+  result.seconds = std::chrono::duration<double>(clock::now() - prepared).count();
+  result.padding = batchGenerator.paddingEfficiency();
+  result.peakRss = peakRss();
+
+  LOG(info, "mini-batch {} maxi-batch {} mini-batch-words {}{}: {:.0f} sentences/s, "
+      "{:.0f} tokens/s, {:.0f} batches/s",
+      miniBatch, maxiBatch, miniBatchWords, shuffle ? " shuffled" : "",
+      result.sentences / std::max(result.seconds, 1e-9),
+      result.tokens / std::max(result.seconds, 1e-9),
+      result.batches / std::max(result.seconds, 1e-9));
+  return result;
+}
+
+}
+
+/**
+ * Throughput of the data pipeline alone, Corpus and BatchGenerator reading
+ * --train-sets without a device or a model. Takes the options of
+ * marian_train, e.g.
+ *
+ *     marian_bench_data -c config.yml --bench-mini-batches 64 128 \
+ *       --bench-batch-words 0 4000 --bench-data-batches 2000
+ *
+ * Every combination of --bench-mini-batches, --bench-maxi-batches and
+ * --bench-batch-words (each defaulting to the configured --mini-batch,
+ * --maxi-batch and --mini-batch-words) is run with and without shuffling,
+ * for one epoch or --bench-data-batches batches. The input format is that of
+ * --train-sets, text, gzipped text or a corpus of marian-binarize, run the
+ * benchmark once per format to compare them. The results are written as
+ * JSON to stdout.
+ */
+int main(int argc, char** argv) {
+  using namespace marian;
+  using namespace data;
+
+  auto options = New<Config>(argc, argv, false);
+
+  auto list = [&](const std::string& key, int value) {
+    if(options->has(key))
+      return options->get<std::vector<int>>(key);
+    return std::vector<int>{value};
+  };
+  auto miniBatches = list("bench-mini-batches", options->get<int>("mini-batch"));
+  auto maxiBatches = list("bench-maxi-batches", options->get<int>("maxi-batch"));
+  auto batchWords = list("bench-batch-words", (int)options->get<size_t>("mini-batch-words"));
+
+  auto corpus = New<Corpus>(options);
+
+  std::vector<DataResult> results;
+  for(bool shuffle : {false, true})
+    for(auto miniBatch : miniBatches)
+      for(auto maxiBatch : maxiBatches)
+        for(auto words : batchWords)
+          results.push_back(benchmark(corpus, options, miniBatch, maxiBatch,
+                                      (size_t)std::max(0, words), shuffle));
+
+  auto paths = options->get<std::vector<std::string>>("train-sets");
+  std::cout << "{\"train_sets\": [";
+  for(size_t i = 0; i < paths.size(); ++i)
+    std::cout << (i ? ", " : "") << "\"" << paths[i] << "\"";
+  std::cout << "], \"results\": [";
+  for(size_t i = 0; i < results.size(); ++i)
+    std::cout << (i ? ", " : "") << results[i].json();
+  std::cout << "]}" << std::endl;
+  return 0;
+}
@@ -0,0 +1,362 @@
+#include <algorithm>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "tensors/tensor_allocator.h"
+#include "tensors/tensor.h"
+#include "kernels/tensor_operators.h"
+#include "kernels/thrust_functions.h"
+#include "kernels/cuda_helpers.h"
+#include "common/logging.h"
+
+using namespace marian;
+
+namespace {
+
+/** @brief Peak memory bandwidth in GB/s and single precision GFLOP/s of a device */
+struct Peak {
+  std::string name;
+  double gbs;
+  double gflops;
+};
+
+Peak devicePeak(int device) {
+  cudaDeviceProp prop;
+  CUDA_CHECK(cudaGetDeviceProperties(&prop, device));
+
+  // FP32 cores per multiprocessor by architecture
+  int cores = 64;
+  switch(prop.major) {
+    case 2: cores = prop.minor == 0 ? 32 : 48; break;
+    case 3: cores = 192; break;
+    case 5: cores = 128; break;
+    case 6: cores = prop.minor == 0 ? 64 : 128; break;
+    default: cores = 64;
+  }
+
+  Peak peak;
+  peak.name = prop.name;
+  // double data rate, clocks in kHz
+  peak.gbs = 2.0 * prop.memoryClockRate * 1e3 * (prop.memoryBusWidth / 8) / 1e9;
+  peak.gflops = 2.0 * prop.clockRate * 1e3 * prop.multiProcessorCount * cores / 1e9;
+  return peak;
+}
+
+/**
+ * @brief Times kernels on one device and collects the results as JSON.
+ *
+ * Every case gets a fresh allocator with random inputs, runs its kernel a few
+ * times untimed, e.g. for tunedThreads(), then  repetitions  times between two
+ * events on the current stream. Bandwidth and throughput follow from the bytes
+ * a kernel has to move at least and the floating point operations it performs.
+ */
+class KernelBench {
+  private:
+    int device_;
+    size_t repetitions_;
+    Peak peak_;
+    cublasHandle_t handle_;
+    std::mt19937 engine_{1234};
+    std::vector<std::string> results_;
+
+    Ptr<TensorAllocator> alloc_;
+
+    Tensor random(Shape shape, float lo = -1.f, float hi = 1.f) {
+      Tensor t;
+      alloc_->allocate(t, shape);
+      std::uniform_real_distribution<float> dist(lo, hi);
+      std::vector<float> values(t->size());
+      for(auto& v : values)
+        v = dist(engine_);
+      t->set(values);
+      return t;
+    }
+
+    /** @brief Integral values in [0, range) as floats, for indices and picks */
+    Tensor indices(size_t size, size_t range) {
+      Tensor t;
+      alloc_->allocate(t, {(int)size, 1});
+      std::uniform_int_distribution<size_t> dist(0, range - 1);
+      std::vector<float> values(size);
+      for(auto& v : values)
+        v = dist(engine_);
+      t->set(values);
+      return t;
+    }
+
+    void run(const std::string& kernel,
+             const std::string& shape,
+             double bytes,
+             double flops,
+             std::function<void()> launch) {
+      for(int i = 0; i < 3; ++i)
+        launch();
+
+      cudaEvent_t start, stop;
+      CUDA_CHECK(cudaEventCreate(&start));
+      CUDA_CHECK(cudaEventCreate(&stop));
+      CUDA_CHECK(cudaEventRecord(start, currentStream()));
+      for(size_t i = 0; i < repetitions_; ++i)
+        launch();
+      CUDA_CHECK(cudaEventRecord(stop, currentStream()));
+      CUDA_CHECK(cudaEventSynchronize(stop));
+      float total;
+      CUDA_CHECK(cudaEventElapsedTime(&total, start, stop));
+      cudaEventDestroy(start);
+      cudaEventDestroy(stop);
+
+      double ms = total / repetitions_;
+      double gbs = bytes / (ms * 1e6);
+      double gflops = flops / (ms * 1e6);
+
+      std::stringstream json;
+      json << "{\"kernel\": \"" << kernel << "\", \"shape\": \"" << shape << "\""
+           << ", \"ms\": " << ms
+           << ", \"gbs\": " << gbs
+           << ", \"gflops\": " << gflops
+           << ", \"bandwidth\": " << gbs / peak_.gbs
+           << ", \"compute\": " << gflops / peak_.gflops << "}";
+      results_.push_back(json.str());
+      std::cerr << kernel << " " << shape << ": " << ms << " ms, "
+                << gbs << " GB/s, " << gflops << " GFLOP/s" << std::endl;
+    }
+
+    template <class... Dims>
+    static std::string dims(Dims... d) {
+      std::stringstream ss;
+      std::vector<size_t> values = {(size_t)d...};
+      for(size_t i = 0; i < values.size(); ++i)
+        ss << (i ? "x" : "") << values[i];
+      return ss.str();
+    }
+
+  public:
+    KernelBench(int device, size_t repetitions)
+     : device_(device),
+       repetitions_(repetitions),
+       peak_(devicePeak(device)),
+       handle_(create_handle(device)) {
+      cudaSetDevice(device_);
+    }
+
+    /** @brief Starts a case, the tensors of the previous one are freed */
+    void begin() {
+      alloc_ = New<TensorAllocator>(device_);
+    }
+
+    void softmax(size_t rows, size_t cols) {
+      begin();
+      auto in = random({(int)rows, (int)cols});
+      auto out = random({(int)rows, (int)cols});
+      double n = rows * cols;
+      run("Softmax", dims(rows, cols), 8 * n, 5 * n,
+          [=]() { Softmax(out, in); });
+      run("LogSoftmax", dims(rows, cols), 8 * n, 5 * n,
+          [=]() { LogSoftmax(out, in); });
+    }
+
+    void crossEntropyPick(size_t rows, size_t cols) {
+      begin();
+      auto in = random({(int)rows, (int)cols});
+      auto picks = indices(rows, cols);
+      Tensor out;
+      alloc_->allocate(out, {(int)rows, 1});
+      double n = rows * cols;
+      run("CrossEntropyPick", dims(rows, cols), 4 * n + 8 * rows, 4 * n,
+          [=]() { CrossEntropyPick(out, in, picks); });
+    }
+
+    void gru(size_t batch, size_t dim) {
+      begin();
+      auto state = random({(int)batch, (int)dim});
+      auto xW = random({(int)batch, 3 * (int)dim});
+      auto sU = random({(int)batch, 3 * (int)dim});
+      auto b = random({1, 3 * (int)dim});
+      auto out = random({(int)batch, (int)dim});
+      auto adj = random({(int)batch, (int)dim});
+      auto gState = random({(int)batch, (int)dim});
+      auto gxW = random({(int)batch, 3 * (int)dim});
+      auto gsU = random({(int)batch, 3 * (int)dim});
+      auto gb = random({1, 3 * (int)dim});
+      std::vector<Tensor> inputs = {state, xW, sU, b};
+      std::vector<Tensor> outputs = {gState, gxW, gsU, gb};
+
+      double n = batch * dim;
+      run("GRUFastForward", dims(batch, dim), 4 * 8 * n, 15 * n,
+          [=]() { GRUFastForward(out, inputs); });
+      run("GRUFastBackward", dims(batch, dim), 4 * 15 * n, 30 * n,
+          [=]() { GRUFastBackward(outputs, inputs, adj); });
+    }
+
+    void attention(size_t batch, size_t dim, size_t words) {
+      begin();
+      auto va = random({(int)dim, 1});
+      auto context = random({(int)batch, (int)dim, (int)words});
+      auto state = random({(int)batch, (int)dim, 1});
+      Tensor out;
+      alloc_->allocate(out, {(int)batch, 1, (int)words});
+      auto adj = random({(int)batch, 1, (int)words});
+      auto gva = random({(int)dim, 1});
+      auto gContext = random({(int)batch, (int)dim, (int)words});
+      auto gState = random({(int)batch, (int)dim, 1});
+
+      double n = batch * dim * words;
+      run("Att", dims(batch, dim, words), 4 * n, 4 * n,
+          [=]() { Att(out, va, context, state, nullptr); });
+      run("AttBack", dims(batch, dim, words), 4 * 2 * n, 8 * n,
+          [=]() {
+            AttBack(gva, gContext, gState, nullptr,
+                    va, context, state, nullptr, adj);
+          });
+    }
+
+    void layerNorm(size_t rows, size_t cols) {
+      begin();
+      auto in = random({(int)rows, (int)cols});
+      auto out = random({(int)rows, (int)cols});
+      auto gamma = random({1, (int)cols});
+      auto beta = random({1, (int)cols});
+      double n = rows * cols;
+      run("LayerNormalization", dims(rows, cols), 8 * n, 8 * n,
+          [=]() { LayerNormalization(out, in, gamma, beta); });
+    }
+
+    void copyRows(size_t vocab, size_t rows, size_t cols) {
+      begin();
+      auto in = random({(int)vocab, (int)cols});
+      auto idx = indices(rows, vocab);
+      Tensor out;
+      alloc_->allocate(out, {(int)rows, (int)cols});
+      run("CopyRows", dims(vocab, rows, cols), 8.0 * rows * cols, 0,
+          [=]() { CopyRows(out, in, idx); });
+    }
+
+    void concatenate(size_t rows, size_t cols, size_t parts) {
+      begin();
+      std::vector<Tensor> inputs;
+      for(size_t i = 0; i < parts; ++i)
+        inputs.push_back(random({(int)rows, (int)cols}));
+      Tensor out;
+      alloc_->allocate(out, {(int)rows, (int)(cols * parts)});
+      run("Concatenate", dims(rows, cols, parts), 8.0 * rows * cols * parts, 0,
+          [=]() { Concatenate(out, inputs, 1); });
+    }
+
+    void prod(size_t m, size_t k, size_t n) {
+      begin();
+      auto A = random({(int)m, (int)k});
+      auto B = random({(int)k, (int)n});
+      Tensor C;
+      alloc_->allocate(C, {(int)m, (int)n});
+      auto handle = handle_;
+      run("Prod", dims(m, k, n), 4.0 * (m * k + k * n + m * n), 2.0 * m * k * n,
+          [=]() { Prod(handle, C, A, B, false, false); });
+    }
+
+    void element(size_t rows, size_t cols) {
+      begin();
+      auto a = random({(int)rows, (int)cols});
+      auto b = random({(int)rows, (int)cols});
+      auto out = random({(int)rows, (int)cols});
+      double n = rows * cols;
+      run("Element", dims(rows, cols), 12 * n, 2 * n,
+          [=]() { Element(_1 = Tanh(_2 + _3), out, a, b); });
+    }
+
+    /** @brief Sum over axis  ax  of a {rows, cols, words} tensor, -1 for all, and its gradient */
+    void reduce(size_t rows, size_t cols, size_t words, int ax) {
+      begin();
+      Shape full{(int)rows, (int)cols, (int)words};
+      Shape part = full;
+      for(int i = 0; i < 4; ++i)
+        if(ax == -1 || ax == i)
+          part.set(i, 1);
+      auto in = random(full);
+      auto out = random(part);
+      auto grad = random(full);
+      double n = rows * cols * words;
+      std::string shape = dims(rows, cols, words) + "/" + std::to_string(ax);
+      run("ReduceSum", shape, 4 * (n + part.elements()), n,
+          [=]() { ReduceSum(out, in); });
+      run("Reduce", shape, 4 * (n + part.elements()), n,
+          [=]() { Reduce(_1, out, in); });
+      run("AddBroadcast", shape, 4 * (2 * n + part.elements()), n,
+          [=]() { AddBroadcast(grad, out); });
+    }
+
+    /** @brief Device, its peaks and all results so far */
+    void print(std::ostream& out) {
+      out << "{\"device\": \"" << peak_.name << "\""
+          << ", \"peak_gbs\": " << peak_.gbs
+          << ", \"peak_gflops\": " << peak_.gflops
+          << ", \"repetitions\": " << repetitions_
+          << ", \"results\": [" << std::endl;
+      for(size_t i = 0; i < results_.size(); ++i)
+        out << "  " << results_[i] << (i + 1 < results_.size() ? "," : "") << std::endl;
+      out << "]}" << std::endl;
+    }
+};
+
+}
+
+/**
+ * Micro-benchmarks of the kernels in tensor_operators.cu over shapes of
+ * typical models: batches of 1 to 128 sentences, states of 512 to 1024,
+ * vocabularies of 30k to 85k and source lengths up to 100 words.
+ *
+ *     marian_bench_kernels [device] [repetitions] > results.json
+ *
+ * The results are written as JSON to stdout, a summary to stderr. Bandwidth
+ * and compute are fractions of the device peak.
+ */
+int main(int argc, char** argv) {
+  int device = argc > 1 ? std::atoi(argv[1]) : 0;
+  size_t repetitions = argc > 2 ? std::atoi(argv[2]) : 100;
+
+  Logger memory{stderrLogger("memory", "[%Y-%m-%d %T] [memory] %v")};
+  KernelBench bench(device, std::max((size_t)1, repetitions));
+
+  for(size_t rows : {64, 640, 6400})
+    for(size_t vocab : {30000, 85000}) {
+      bench.softmax(rows, vocab);
+      bench.crossEntropyPick(rows, vocab);
+    }
+
+  for(size_t batch : {1, 12, 64, 128})
+    for(size_t dim : {512, 1024})
+      bench.gru(batch, dim);
+
+  for(size_t batch : {12, 64})
+    for(size_t words : {20, 50, 100})
+      bench.attention(batch, 1024, words);
+
+  for(size_t rows : {64, 1280, 6400})
+    for(size_t cols : {512, 1024})
+      bench.layerNorm(rows, cols);
+
+  for(size_t rows : {64, 1280, 6400})
+    bench.copyRows(85000, rows, 512);
+
+  for(size_t rows : {64, 1280, 6400})
+    bench.concatenate(rows, 1024, 2);
+
+  for(size_t m : {64, 1280})
+    for(size_t n : {1024, 3072, 30000})
+      bench.prod(m, 1024, n);
+
+  for(size_t rows : {64, 1280, 6400})
+    bench.element(rows, 1024);
+
+  // sums of attention scores and costs over words, states and batches
+  for(int ax : {-1, 0, 1, 2})
+    for(size_t batch : {12, 64})
+      bench.reduce(batch, 1024, 50, ax);
+
+  bench.print(std::cout);
+  return 0;
+}
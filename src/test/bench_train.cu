@@ -0,0 +1,309 @@
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <numeric>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "marian.h"
+#include "kernels/cuda_helpers.h"
+#include "models/dl4mt.h"
+#include "models/gnmt.h"
+#include "models/multi_gnmt.h"
+#include "translator/translator.h"
+
+namespace marian {
+
+struct BenchResult {
+  size_t devices;
+  size_t steps;
+  double seconds;
+  size_t words;
+  std::vector<double> stepMs;
+  size_t memory;
+
+  double wordsPerSecond() const {
+    return seconds > 0 ? words / seconds : 0;
+  }
+
+  double percentile(double p) const {
+    if(stepMs.empty())
+      return 0;
+    std::vector<double> sorted = stepMs;
+    std::sort(sorted.begin(), sorted.end());
+    size_t i = std::min(sorted.size() - 1, (size_t)(p * sorted.size()));
+    return sorted[i];
+  }
+
+  std::string json() const {
+    std::stringstream ss;
+    ss << "{\"devices\": " << devices
+       << ", \"steps\": " << steps
+       << ", \"seconds\": " << seconds
+       << ", \"words_per_second\": " << wordsPerSecond()
+       << ", \"step_ms_p50\": " << percentile(0.5)
+       << ", \"step_ms_p90\": " << percentile(0.9)
+       << ", \"step_ms_p99\": " << percentile(0.99)
+       << ", \"memory_mb\": " << memory / (1024 * 1024) << "}";
+    return ss.str();
+  }
+};
+
+struct DecodeResult {
+  size_t beamSize;
+  size_t sentences;
+  size_t tokens;
+  double seconds;
+
+  std::string json() const {
+    std::stringstream ss;
+    ss << "{\"beam_size\": " << beamSize
+       << ", \"sentences\": " << sentences
+       << ", \"seconds\": " << seconds
+       << ", \"sentences_per_second\": " << (seconds > 0 ? sentences / seconds : 0)
+       << ", \"tokens_per_second\": " << (seconds > 0 ? tokens / seconds : 0) << "}";
+    return ss.str();
+  }
+};
+
+/**
+ * @brief Synthetic batches of --mini-batch sentences, or --mini-batch-words
+ * words, whose lengths follow a normal distribution given by --bench-length
+ * clipped to [1, max-length]. All sentences of a batch and all input streams
+ * share one length, as after sorting by length within a maxi-batch. The seed
+ * is fixed, so every run sees the same batches.
+ */
+class SyntheticBatches {
+  private:
+    Ptr<Config> options_;
+    std::mt19937 engine_{1234};
+    std::normal_distribution<float> length_;
+    size_t streams_;
+    size_t maxLength_;
+
+  public:
+    SyntheticBatches(Ptr<Config> options)
+     : options_(options),
+       streams_(options->get<std::vector<int>>("dim-vocabs").size()),
+       maxLength_(options->get<size_t>("max-length")) {
+      std::vector<float> length = {maxLength_ / 2.f, maxLength_ / 4.f};
+      if(options->has("bench-length"))
+        length = options->get<std::vector<float>>("bench-length");
+      length_ = std::normal_distribution<float>(length[0],
+                                                length.size() > 1 ? length[1] : 0.f);
+    }
+
+    Ptr<data::CorpusBatch> next() {
+      float sampled = std::round(length_(engine_));
+      size_t length = std::max(1.f, std::min((float)maxLength_, sampled));
+      auto& opt = options_->snapshot();
+      size_t sentences = opt.miniBatchWords > 0
+                         ? std::max((size_t)1, opt.miniBatchWords / length)
+                         : opt.miniBatch;
+      return syntheticBatch(sentences, std::vector<size_t>(streams_, length));
+    }
+};
+
+/**
+ * @brief Runs --bench-steps steps of  Group , one batch per graph each, after
+ * a tenth as many untimed ones. The clock stops once the graph group has
+ * finished all updates and is destroyed.
+ */
+template <class Group>
+BenchResult benchmark(Ptr<Config> options) {
+  auto devices = options->get<std::vector<size_t>>("devices");
+  size_t graphs = devices.size()
+                  * std::max((size_t)1, options->get<size_t>("graphs-per-device"));
+  size_t steps = std::max((size_t)1, options->get<size_t>("bench-steps"));
+  size_t warmup = std::max((size_t)1, steps / 10);
+
+  // no checkpoints, the model is never written
+  options->get()["save-freq"] = (warmup + steps) * graphs + 1;
+  options->refresh();
+
+  SyntheticBatches batches(options);
+  auto group = New<Group>(options);
+  group->setReporter(New<Reporter>(options));
+
+  BenchResult result;
+  result.devices = devices.size();
+  result.steps = steps;
+  result.words = 0;
+
+  typedef std::chrono::steady_clock clock;
+  auto start = clock::now();
+  for(size_t step = 0; step < warmup + steps; ++step) {
+    if(step == warmup)
+      start = clock::now();
+    auto begin = clock::now();
+    for(size_t i = 0; i < graphs; ++i) {
+      auto batch = batches.next();
+      if(step >= warmup)
+        result.words += batch->words();
+      group->update(batch);
+    }
+    if(step >= warmup)
+      result.stepMs.push_back(
+        std::chrono::duration<double, std::milli>(clock::now() - begin).count());
+  }
+
+  // allocators only grow, what is in use now is the peak
+  result.memory = 0;
+  for(auto device : devices) {
+    size_t free, total;
+    cudaSetDevice(device);
+    CUDA_CHECK(cudaMemGetInfo(&free, &total));
+    result.memory = std::max(result.memory, total - free);
+  }
+
+  group.reset();
+  result.seconds = std::chrono::duration<double>(clock::now() - start).count();
+
+  LOG(info, "{} devices: {:.0f} words/s, step {:.1f} / {:.1f} / {:.1f} ms (p50 / p90 / p99), {} MB",
+      result.devices, result.wordsPerSecond(), result.percentile(0.5),
+      result.percentile(0.9), result.percentile(0.99), result.memory / (1024 * 1024));
+  return result;
+}
+
+/**
+ * @brief Beam search with --bench-beam-size over a tenth of --bench-steps
+ * synthetic batches, after one untimed batch, on the first device. The model
+ * is randomly initialized and rarely chooses EOS, so most sentences run to the
+ * length limit of --max-length-factor, which keeps the work of every run the
+ * same.
+ */
+template <class Builder>
+DecodeResult benchmarkDecoding(Ptr<Config> options) {
+  // search options of marian_translate, not declared for training
+  auto& yaml = options->get();
+  yaml["beam-size"] = options->get<size_t>("bench-beam-size");
+  if(!options->has("max-length-factor"))
+    yaml["max-length-factor"] = 3.f;
+  if(!options->has("beam-threshold"))
+    yaml["beam-threshold"] = 0.f;
+  if(!options->has("beam-max-per-parent"))
+    yaml["beam-max-per-parent"] = (size_t)0;
+  options->refresh();
+
+  size_t device = options->get<std::vector<size_t>>("devices")[0];
+  cudaSetDevice(device);
+
+  SyntheticBatches batches(options);
+  auto graph = New<ExpressionGraph>();
+  graph->setDevice(device);
+  graph->setInference(true);
+  New<Builder>(options, keywords::inference=true)->build(graph, batches.next());
+  graph->initParams();
+
+  auto translate = [&](Ptr<data::CorpusBatch> batch) {
+    std::vector<size_t> ids(batch->size());
+    std::iota(ids.begin(), ids.end(), 0);
+    batch->setSentenceIds(ids);
+    BeamSearch<Builder> search(options, {graph}, {1.f}, nullptr);
+    return search.translate(batch);
+  };
+
+  translate(batches.next());
+
+  DecodeResult result;
+  result.beamSize = options->get<size_t>("beam-size");
+  result.sentences = 0;
+  result.tokens = 0;
+
+  size_t steps = std::max((size_t)1, options->get<size_t>("bench-steps") / 10);
+  auto start = std::chrono::steady_clock::now();
+  for(size_t step = 0; step < steps; ++step) {
+    for(auto& translation : translate(batches.next())) {
+      result.sentences++;
+      result.tokens += translation.second.size();
+    }
+  }
+  CUDA_CHECK(cudaStreamSynchronize(graph->getStream()));
+  result.seconds = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count();
+
+  LOG(info, "Decoding with beam {}: {:.1f} sentences/s, {:.0f} tokens/s",
+      result.beamSize, result.sentences / result.seconds, result.tokens / result.seconds);
+  return result;
+}
+
+template <class Builder>
+BenchResult benchmarkType(Ptr<Config> options) {
+  if(options->get<bool>("sync-sgd"))
+    return benchmark<SyncGraphGroup<Builder>>(options);
+  return benchmark<AsyncGraphGroup<Builder>>(options);
+}
+
+BenchResult benchmarkModel(Ptr<Config> options) {
+  auto type = options->get<std::string>("type");
+  if(type == "gnmt")
+    return benchmarkType<GNMT>(options);
+  else if(type == "multi-gnmt")
+    return benchmarkType<MultiGNMT>(options);
+  else
+    return benchmarkType<DL4MT>(options);
+}
+
+DecodeResult benchmarkModelDecoding(Ptr<Config> options) {
+  auto type = options->get<std::string>("type");
+  if(type == "gnmt")
+    return benchmarkDecoding<GNMT>(options);
+  else if(type == "multi-gnmt")
+    return benchmarkDecoding<MultiGNMT>(options);
+  else
+    return benchmarkDecoding<DL4MT>(options);
+}
+
+}
+
+/**
+ * Training throughput on synthetic batches, no corpus is read and no model
+ * written. Takes the options of marian_train, e.g.
+ *
+ *     marian_bench_train -c config.yml --bench-steps 200 --bench-length 30 10
+ *
+ * With several --devices the first device is benchmarked alone first and the
+ * scaling efficiency is the throughput of all devices over that of one times
+ * their number. Unless --bench-beam-size is 0, decoding with the untrained
+ * model is timed last. The results are written as JSON to stdout, compare
+ * them to a baseline with marian_bench_check.
+ */
+int main(int argc, char** argv) {
+  using namespace marian;
+
+  auto options = New<Config>(argc, argv, false);
+  UTIL_THROW_IF2(options->get<bool>("pipeline"),
+                 "marian_bench_train supports asynchronous and synchronous SGD only");
+  auto devices = options->get<std::vector<size_t>>("devices");
+
+  std::vector<BenchResult> results;
+  if(devices.size() > 1) {
+    options->get()["devices"] = std::vector<size_t>{devices[0]};
+    results.push_back(benchmarkModel(options));
+    options->get()["devices"] = devices;
+  }
+  results.push_back(benchmarkModel(options));
+
+  std::vector<DecodeResult> decoding;
+  if(options->get<size_t>("bench-beam-size") > 0)
+    decoding.push_back(benchmarkModelDecoding(options));
+
+  std::cout << "{\"type\": \"" << options->get<std::string>("type") << "\""
+            << ", \"sync\": " << (options->get<bool>("sync-sgd") ? "true" : "false")
+            << ", \"results\": [";
+  for(size_t i = 0; i < results.size(); ++i)
+    std::cout << (i ? ", " : "") << results[i].json();
+  std::cout << "]";
+  if(results.size() > 1) {
+    double scaling = results[1].wordsPerSecond()
+                     / (devices.size() * results[0].wordsPerSecond());
+    std::cout << ", \"scaling_efficiency\": " << scaling;
+    LOG(info, "Scaling efficiency on {} devices: {:.1f}%", devices.size(), 100 * scaling);
+  }
+  if(!decoding.empty())
+    std::cout << ", \"decoding\": " << decoding[0].json();
+  std::cout << "}" << std::endl;
+  return 0;
+}
@@ -0,0 +1,189 @@
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <future>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <boost/timer/timer.hpp>
+
+#include "marian.h"
+#include "training/config.h"
+#include "data/corpus.h"
+#include "common/bounded_queue.h"
+#include "common/file_stream.h"
+#include "translator/scorer.h"
+#include "translator/output_collector.h"
+
+namespace marian {
+
+typedef std::pair<size_t, data::SentenceTuple> Tuple;
+
+/** Reads and tokenizes the aligned files of --inputs, one vocabulary each */
+void readTuples(Ptr<Config> options, std::vector<Ptr<Vocab>> vocabs,
+                BoundedQueue<Tuple>& tuples) {
+  auto inputs = options->get<std::vector<std::string>>("inputs");
+  std::vector<UPtr<InputFileStream>> files;
+  for(auto& input : inputs)
+    files.emplace_back(new InputFileStream(input));
+
+  std::string line;
+  for(size_t lineNo = 0; ; ++lineNo) {
+    data::SentenceTuple tuple;
+    for(size_t i = 0; i < files.size(); ++i) {
+      if(!std::getline((std::istream&)*files[i], line)) {
+        tuples.close();
+        return;
+      }
+      tuple.push_back((*vocabs[i])(line));
+    }
+    tuples.push({lineNo, tuple});
+  }
+}
+
+bool sameSource(const data::SentenceTuple& a, const data::SentenceTuple& b) {
+  return std::equal(a.begin(), a.end() - 1, b.begin());
+}
+
+/**
+ * Collects up to --maxi-batch times --mini-batch sentence pairs, sorts them
+ * by length and hands mini-batches to the scorers, as for translation. With
+ * --share-sources pairs are sorted by source first, so that the candidates
+ * of a source end up next to each other, and the encoder runs once per
+ * distinct source of a mini-batch.
+ */
+void makeBatches(Ptr<Config> options, BoundedQueue<Tuple>& tuples,
+                 ScorerPool& scorers,
+                 BoundedQueue<std::future<std::vector<SentenceScore>>>& results) {
+  size_t miniBatch = std::max(1, options->get<int>("mini-batch"));
+  size_t maxiBatch = miniBatch * std::max(1, options->get<int>("maxi-batch"));
+  bool share = options->get<bool>("share-sources");
+
+  Tuple tuple;
+  while(tuples.pop(tuple)) {
+    std::vector<Tuple> pool(1, tuple);
+    while(pool.size() < maxiBatch && tuples.tryPop(tuple))
+      pool.push_back(tuple);
+
+    if(share) {
+      // longest sources first, equal sources by target length
+      std::stable_sort(pool.begin(), pool.end(),
+                       [](const Tuple& a, const Tuple& b) {
+                         auto& x = a.second;
+                         auto& y = b.second;
+                         if(x.front().size() != y.front().size())
+                           return x.front().size() > y.front().size();
+                         if(!sameSource(x, y))
+                           return std::lexicographical_compare(x.begin(), x.end() - 1,
+                                                               y.begin(), y.end() - 1);
+                         return x.back().size() > y.back().size();
+                       });
+    }
+    else {
+      std::stable_sort(pool.begin(), pool.end(),
+                       [](const Tuple& a, const Tuple& b) {
+                         return a.second.back().size() > b.second.back().size();
+                       });
+    }
+
+    for(size_t start = 0; start < pool.size(); start += miniBatch) {
+      std::vector<data::SentenceTuple> samples;
+      std::vector<size_t> ids;
+      for(size_t i = start; i < std::min(start + miniBatch, pool.size()); ++i) {
+        samples.push_back(pool[i].second);
+        ids.push_back(pool[i].first);
+      }
+
+      auto batch = data::Corpus::toBatch(samples);
+      batch->setSentenceIds(ids);
+
+      std::vector<data::SentenceTuple> sources;
+      std::vector<size_t> sourceRows;
+      if(share) {
+        for(auto& sample : samples) {
+          if(sources.empty() || !sameSource(sources.back(), sample))
+            sources.push_back(sample);
+          sourceRows.push_back(sources.size() - 1);
+        }
+      }
+      if(sources.size() < sourceRows.size())
+        results.push(scorers.score(batch, data::Corpus::toBatch(sources), sourceRows));
+      else
+        results.push(scorers.score(batch));
+    }
+  }
+  results.close();
+}
+
+/**
+ * Writes the score of every sentence pair in input order, with --word-scores
+ * followed by " ||| " and the scores of the target words including </s>
+ */
+void writeScores(BoundedQueue<std::future<std::vector<SentenceScore>>>& results) {
+  OutputCollector collector;
+  std::future<std::vector<SentenceScore>> result;
+  while(results.pop(result)) {
+    for(auto& score : result.get()) {
+      std::stringstream ss;
+      ss << std::setprecision(6) << score.score;
+      if(!score.words.empty()) {
+        ss << " |||";
+        for(auto w : score.words)
+          ss << " " << w;
+      }
+      collector.write(score.lineNo, ss.str());
+    }
+    if(results.size() == 0)
+      collector.sync();
+  }
+  collector.flush();
+}
+
+}
+
+/**
+ * Scores the aligned sentence pairs of --inputs with the model of --model,
+ * e.g. for data filtering, writing the log-probability of the target given
+ * the source per line. All options of marian_translate apply where they make
+ * sense, batches of --mini-batch pairs are sorted by target length within
+ * --maxi-batch and scored on all --devices. There is no search, so large
+ * batches are much faster than decoding. For n-best lists and other inputs
+ * with many targets per source, --share-sources encodes every distinct source
+ * of a batch once.
+ *
+ *     marian_score -m model.npz -v src.yml trg.yml -i corpus.src corpus.trg --mini-batch 256
+ *     marian_score -m model.npz -v src.yml trg.yml -i nbest.src nbest.trg --share-sources
+ */
+int main(int argc, char** argv) {
+  using namespace marian;
+
+  auto options = New<Config>(argc, argv, true, true);
+
+  auto paths = options->get<std::vector<std::string>>("vocabs");
+  UTIL_THROW_IF2(!options->has("inputs")
+                 || options->get<std::vector<std::string>>("inputs").size() != paths.size(),
+                 "marian_score needs one file of --inputs per vocabulary, the target last");
+  std::vector<Ptr<Vocab>> vocabs;
+  for(auto& path : paths) {
+    vocabs.push_back(New<Vocab>());
+    vocabs.back()->load(path);
+  }
+
+  ScorerPool scorers(options);
+  boost::timer::cpu_timer timer;
+
+  size_t buffer = 2 * std::max(1, options->get<int>("mini-batch"))
+                    * std::max(1, options->get<int>("maxi-batch"));
+  BoundedQueue<Tuple> tuples(buffer);
+  BoundedQueue<std::future<std::vector<SentenceScore>>> results(2 * scorers.size());
+
+  std::thread reader(readTuples, options, vocabs, std::ref(tuples));
+  std::thread writer(writeScores, std::ref(results));
+  makeBatches(options, tuples, scorers, results);
+
+  reader.join();
+  writer.join();
+
+  std::cerr << timer.format(5, "%ws") << std::endl;
+  return 0;
+}
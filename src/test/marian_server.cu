@@ -0,0 +1,662 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <boost/asio.hpp>
+#include <boost/filesystem.hpp>
+
+#include "marian.h"
+#include "training/config.h"
+#include "data/corpus.h"
+#include "translator/translator.h"
+#include "translator/translation_cache.h"
+#include "translator/prefix_cache.h"
+
+namespace marian {
+
+/**
+ * @brief Collects sentences of all connections into batches for a single
+ * translator.
+ *
+ * A batch is started by the oldest waiting sentence and translated as soon as
+ * it holds --mini-batch sentences or --max-tokens source tokens, or after
+ * --max-wait milliseconds, whatever comes first. With --cache-size, sentences
+ * translated before are answered from the cache and never queued.
+ *
+ * A request with a session and a target prefix is translated on its own as
+ * a continuation of the prefix, see BeamSearch::translatePrefix(), with the
+ * states of the session's earlier requests kept in a PrefixCache.
+ *
+ * Requests are queued by class, interactive ones from --port and bulk ones
+ * from --bulk-port. Waiting interactive requests are always batched first,
+ * bulk batches are collected for up to --bulk-max-wait milliseconds and at
+ * most --bulk-mini-batch sentences, so an interactive request waits for at
+ * most one bulk batch in flight. With an --slo or --bulk-slo, a class whose
+ * oldest queued request has waited longer than that is overloaded: new
+ * requests are shed to a cheaper search with --shed-beam-size and the
+ * --shed-shortlist, and rejected with an empty line once the wait exceeds
+ * twice the budget. Shed translations are not cached.
+ *
+ * swap() replaces the translator between two batches: the batch in flight
+ * finishes on the old one, which is freed with it, every later batch runs on
+ * the new one and the cache is emptied.
+ */
+class BatchingQueue {
+  private:
+    struct Request {
+      Words source;
+      // empty unless the request continues a target prefix
+      std::string session;
+      Words prefix;
+      std::promise<std::string> result;
+      std::chrono::steady_clock::time_point arrival;
+      size_t cls{0};
+      // translated with the cheaper search of an overloaded class
+      bool shed{false};
+      // called with the stable prefix while the request is translated
+      std::function<void(const std::string&)> partial;
+      // result is set, a failing batch only fails the others
+      bool answered{false};
+    };
+
+    // the most recent of a sample, for quantiles
+    struct Window {
+      std::vector<double> values;
+      size_t next{0};
+
+      void add(double value) {
+        if(values.size() < 1024)
+          values.push_back(value);
+        else
+          values[next++ % values.size()] = value;
+      }
+
+      double quantile(double q) const {
+        if(values.empty())
+          return 0;
+        auto sorted = values;
+        size_t k = std::min(sorted.size() - 1, (size_t)(q * sorted.size()));
+        std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+        return sorted[k];
+      }
+    };
+
+    struct Queue {
+      std::string name;
+      size_t maxSentences;
+      std::chrono::milliseconds maxWait;
+      // budget of the queue wait, 0 for no admission control
+      std::chrono::milliseconds slo;
+
+      std::deque<Ptr<Request>> requests;
+      size_t tokens{0};
+
+      size_t admitted{0};
+      size_t shed{0};
+      size_t rejected{0};
+      // seconds
+      Window waits;
+      Window latencies;
+    };
+
+    // guards the translator, its generation and cache updates
+    std::mutex translatorMutex_;
+    Ptr<TranslatorBase> translator_;
+    size_t generation_{0};
+    Ptr<TranslationCache> cache_;
+    Ptr<PrefixCache> prefixCache_;
+    Ptr<Vocab> srcVocab_;
+    Ptr<Vocab> trgVocab_;
+
+    size_t maxSentences_;
+    size_t maxTokens_;
+
+    SearchOptions shedSearch_;
+    Ptr<data::Shortlist> shedShortlist_;
+
+    // guards the queues and their statistics
+    std::mutex mutex_;
+    std::condition_variable cv_;
+    // interactive first
+    std::vector<Queue> queues_;
+
+    std::vector<Ptr<Request>> nextBatch() {
+      std::unique_lock<std::mutex> lock(mutex_);
+      auto& interactive = queues_[INTERACTIVE].requests;
+      cv_.wait(lock, [&]() { return !interactive.empty() || !queues_[BULK].requests.empty(); });
+
+      size_t cls = interactive.empty() ? BULK : INTERACTIVE;
+      {
+        // an interactive prefix request does not wait for others, a bulk
+        // batch stops waiting for interactive requests
+        auto& q = queues_[cls];
+        auto deadline = q.requests.front()->arrival + q.maxWait;
+        if(q.requests.front()->session.empty())
+          cv_.wait_until(lock, deadline, [&]() {
+            return q.requests.size() >= q.maxSentences || q.tokens >= maxTokens_
+                   || (cls == BULK && !interactive.empty());
+          });
+        if(!interactive.empty())
+          cls = INTERACTIVE;
+      }
+
+      auto& q = queues_[cls];
+      auto now = std::chrono::steady_clock::now();
+      std::vector<Ptr<Request>> batch;
+      size_t tokens = 0;
+      while(!q.requests.empty() && batch.size() < q.maxSentences) {
+        auto& next = q.requests.front();
+        size_t length = next->source.size();
+        if(!batch.empty() && tokens + length > maxTokens_)
+          break;
+        // prefix requests are translated alone, shed ones with their kind
+        bool alone = !next->session.empty();
+        if(!batch.empty() && (alone || !batch.front()->session.empty()
+                              || next->shed != batch.front()->shed))
+          break;
+        tokens += length;
+        q.tokens -= length;
+        q.waits.add(std::chrono::duration<double>(now - next->arrival).count());
+        batch.push_back(next);
+        q.requests.pop_front();
+      }
+      return batch;
+    }
+
+    void finish(Ptr<Request> request, const std::string& translation) {
+      request->result.set_value(translation);
+      request->answered = true;
+      std::chrono::duration<double> latency = std::chrono::steady_clock::now() - request->arrival;
+      std::lock_guard<std::mutex> lock(mutex_);
+      queues_[request->cls].latencies.add(latency.count());
+    }
+
+    void translate(const std::vector<Ptr<Request>>& requests) {
+      std::vector<data::SentenceTuple> samples;
+      std::vector<size_t> ids;
+      for(auto& request : requests) {
+        samples.push_back({request->source});
+        ids.push_back(ids.size());
+      }
+
+      auto batch = data::Corpus::toBatch(samples);
+      batch->setSentenceIds(ids);
+
+      Ptr<TranslatorBase> translator;
+      size_t generation;
+      {
+        std::lock_guard<std::mutex> lock(translatorMutex_);
+        translator = translator_;
+        generation = generation_;
+      }
+
+      if(!requests[0]->session.empty()) {
+        translatePrefix(requests[0], batch, translator, generation);
+        return;
+      }
+
+      // set for every batch, the callback only lives as long as its requests
+      bool streamed = false;
+      for(auto& request : requests)
+        streamed |= (bool)request->partial;
+      if(streamed)
+        translator->setStream([&](size_t id, const Words& stable) {
+          if(requests[id]->partial)
+            requests[id]->partial(toString(stable));
+        });
+      else
+        translator->setStream(nullptr);
+
+      bool shed = requests[0]->shed;
+      auto translations = shed ? translator->translate(batch, shedSearch_, shedShortlist_)
+                               : translator->translate(batch);
+      {
+        // translations of a model swapped out meanwhile are not cached
+        std::lock_guard<std::mutex> lock(translatorMutex_);
+        if(cache_ && !shed && generation == generation_)
+          for(auto& translation : translations)
+            cache_->put(requests[translation.first]->source, translation.second);
+      }
+      for(auto& translation : translations)
+        finish(requests[translation.first], toString(translation.second));
+    }
+
+    void translatePrefix(Ptr<Request> request,
+                         Ptr<data::CorpusBatch> batch,
+                         Ptr<TranslatorBase> translator,
+                         size_t generation) {
+      Ptr<PrefixState> state = prefixCache_ ? prefixCache_->get(request->session)
+                                            : New<PrefixState>();
+      auto words = translator->translatePrefix(batch, request->prefix, state);
+      {
+        // states of a model swapped out meanwhile are not kept
+        std::lock_guard<std::mutex> lock(translatorMutex_);
+        if(prefixCache_ && generation == generation_)
+          prefixCache_->put(request->session, state);
+      }
+      finish(request, toString(words));
+    }
+
+    std::string toString(const Words& words) {
+      std::stringstream ss;
+      for(auto w : words)
+        if(w != 0)
+          ss << (*trgVocab_)[w] << " ";
+      return ss.str();
+    }
+
+  public:
+    enum { INTERACTIVE = 0, BULK = 1 };
+
+    BatchingQueue(Ptr<Config> options,
+                  Ptr<TranslatorBase> translator,
+                  Ptr<TranslationCache> cache = nullptr)
+     : translator_(translator),
+       cache_(cache),
+       srcVocab_(New<Vocab>()),
+       trgVocab_(New<Vocab>()),
+       maxSentences_(std::max(1, options->get<int>("mini-batch"))),
+       maxTokens_(options->get<size_t>("max-tokens")),
+       shedSearch_(SearchOptions::from(options)),
+       shedShortlist_(loadShortlist(options, "shed-shortlist")) {
+      typedef std::chrono::milliseconds ms;
+      size_t bulkSentences = options->get<size_t>("bulk-mini-batch");
+      queues_.resize(2);
+      queues_[INTERACTIVE].name = "interactive";
+      queues_[INTERACTIVE].maxSentences = maxSentences_;
+      queues_[INTERACTIVE].maxWait = ms(options->get<size_t>("max-wait"));
+      queues_[INTERACTIVE].slo = ms(options->get<size_t>("slo"));
+      queues_[BULK].name = "bulk";
+      queues_[BULK].maxSentences = bulkSentences > 0 ? bulkSentences : maxSentences_;
+      queues_[BULK].maxWait = ms(options->get<size_t>("bulk-max-wait"));
+      queues_[BULK].slo = ms(options->get<size_t>("bulk-slo"));
+      shedSearch_.beamSize = std::max((size_t)1, options->get<size_t>("shed-beam-size"));
+
+      size_t prefixBytes = options->get<size_t>("prefix-cache-size") * 1024 * 1024;
+      if(prefixBytes > 0)
+        prefixCache_ = New<PrefixCache>(prefixBytes);
+      auto vocabs = options->get<std::vector<std::string>>("vocabs");
+      srcVocab_->load(vocabs.front());
+      trgVocab_->load(vocabs.back());
+    }
+
+    /**
+     * @brief Translates a full batch of dummy sentences with  translator , so
+     * its workspace grows and its parameters are converted before it serves
+     */
+    void warmUp(Ptr<TranslatorBase> translator) {
+      size_t length = std::max((size_t)1, std::min((size_t)50, maxTokens_ / maxSentences_));
+      Words source(length, UNK_ID);
+      source.push_back(EOS_ID);
+
+      std::vector<data::SentenceTuple> samples(maxSentences_, {source});
+      std::vector<size_t> ids;
+      for(size_t i = 0; i < samples.size(); ++i)
+        ids.push_back(i);
+      auto batch = data::Corpus::toBatch(samples);
+      batch->setSentenceIds(ids);
+      translator->translate(batch);
+    }
+
+    /** @brief Translates all batches after the current one with  translator  */
+    void swap(Ptr<TranslatorBase> translator) {
+      std::lock_guard<std::mutex> lock(translatorMutex_);
+      translator_ = translator;
+      generation_++;
+      if(cache_)
+        cache_->clear();
+      if(prefixCache_)
+        prefixCache_->clear();
+    }
+
+    /**
+     * @brief Queues a tokenized sentence of class  cls , the future holds its
+     * translation. A line "session ||| source ||| prefix" asks for the
+     * translation of source that starts with the tokenized target prefix, in
+     * the session of an interactive client. Unless it continues a prefix,
+     *  partial  is called with the growing stable prefix of the translation
+     * from the translating thread, see BeamSearch::setStream().
+     */
+    std::future<std::string> push(const std::string& line,
+                                  size_t cls = INTERACTIVE,
+                                  std::function<void(const std::string&)> partial = nullptr) {
+      auto request = New<Request>();
+      request->partial = partial;
+      size_t first = line.find("|||");
+      size_t second = first == std::string::npos ? first : line.find("|||", first + 3);
+      if(second != std::string::npos) {
+        request->session = line.substr(0, first);
+        request->session.erase(request->session.find_last_not_of(" \t") + 1);
+        request->session.erase(0, request->session.find_first_not_of(" \t"));
+        request->source = (*srcVocab_)(line.substr(first + 3, second - first - 3));
+        request->prefix = (*trgVocab_)(line.substr(second + 3), false);
+      }
+      else {
+        request->source = (*srcVocab_)(line);
+      }
+      request->arrival = std::chrono::steady_clock::now();
+      request->cls = cls;
+      auto result = request->result.get_future();
+
+      Words target;
+      if(request->session.empty() && cache_ && cache_->get(request->source, target)) {
+        request->result.set_value(toString(target));
+        return result;
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto& q = queues_[cls];
+        if(q.slo.count() > 0 && !q.requests.empty()) {
+          auto waited = request->arrival - q.requests.front()->arrival;
+          if(waited > 2 * q.slo) {
+            q.rejected++;
+            request->result.set_exception(std::make_exception_ptr(
+              std::runtime_error("Rejected, the " + q.name + " queue is over its SLO")));
+            return result;
+          }
+          // prefix requests keep the full search, they are single sentences
+          if(waited > q.slo && request->session.empty()) {
+            request->shed = true;
+            q.shed++;
+          }
+        }
+        q.admitted++;
+        q.tokens += request->source.size();
+        q.requests.push_back(request);
+      }
+      cv_.notify_one();
+      return result;
+    }
+
+    /**
+     * @brief The queue depths, request counts and the median and 99th
+     * percentile of queue waits and latencies of the recent requests of
+     * every class, in the Prometheus text format
+     */
+    void writeMetrics(std::ostream& out) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for(auto& q : queues_) {
+        std::string cls = "{class=\"" + q.name + "\"";
+        out << "marian_queue_depth" << cls << "} " << q.requests.size() << "\n";
+        out << "marian_queue_tokens" << cls << "} " << q.tokens << "\n";
+        out << "marian_requests_total" << cls << ",outcome=\"admitted\"} " << q.admitted << "\n";
+        out << "marian_requests_total" << cls << ",outcome=\"shed\"} " << q.shed << "\n";
+        out << "marian_requests_total" << cls << ",outcome=\"rejected\"} " << q.rejected << "\n";
+        for(double quantile : {0.5, 0.99}) {
+          out << "marian_queue_wait_seconds" << cls << ",quantile=\"" << quantile << "\"} "
+              << q.waits.quantile(quantile) << "\n";
+          out << "marian_latency_seconds" << cls << ",quantile=\"" << quantile << "\"} "
+              << q.latencies.quantile(quantile) << "\n";
+        }
+      }
+    }
+
+    /** @brief Translates batches forever, to be run by a single thread */
+    void run() {
+      for(size_t batches = 1; ; ++batches) {
+        auto requests = nextBatch();
+        try {
+          translate(requests);
+        }
+        catch(...) {
+          for(auto& request : requests)
+            if(!request->answered)
+              request->result.set_exception(std::current_exception());
+        }
+
+        if(cache_ && batches % 1000 == 0)
+          LOG(info, "Cache: {} hits, {} misses, {} entries, {} bytes",
+              cache_->hits(), cache_->misses(), cache_->size(), cache_->bytes());
+        if(prefixCache_ && batches % 1000 == 0)
+          LOG(info, "Prefix cache: {} hits, {} misses, {} sessions, {} bytes",
+              prefixCache_->hits(), prefixCache_->misses(), prefixCache_->size(),
+              prefixCache_->bytes());
+      }
+    }
+};
+
+/** @brief Modification times of the model files, 0 for a missing file */
+std::vector<std::time_t> modelTimes(const std::vector<std::string>& models) {
+  std::vector<std::time_t> times;
+  for(auto& model : models) {
+    boost::system::error_code error;
+    auto time = boost::filesystem::last_write_time(model, error);
+    times.push_back(error ? 0 : time);
+  }
+  return times;
+}
+
+/**
+ * Every --reload-interval seconds checks whether a model file changed, then
+ * loads the new model into a second translator next to the serving one,
+ * warms it up and swaps it in, see BatchingQueue::swap(). Clients see neither
+ * a pause nor a slow first batch, the device needs memory for both models
+ * while the new one loads. Models should be replaced by renaming a complete
+ * file, as checkpoints are written; a model that fails to load is retried
+ * at the next check and the old one keeps serving. Models converted with
+ * marian-binarize load fastest.
+ */
+void reloadModels(Ptr<Config> options,
+                  size_t device,
+                  Ptr<data::Shortlist> shortlist,
+                  Ptr<BatchingQueue> queue) {
+  std::chrono::seconds interval(options->get<size_t>("reload-interval"));
+  std::vector<std::string> models;
+  if(options->has("models"))
+    models = options->get<std::vector<std::string>>("models");
+  else
+    models.push_back(options->get<std::string>("model"));
+
+  auto loaded = modelTimes(models);
+  while(true) {
+    std::this_thread::sleep_for(interval);
+    auto times = modelTimes(models);
+    if(times == loaded || std::find(times.begin(), times.end(), 0) != times.end())
+      continue;
+
+    try {
+      LOG(info, "Model changed, reloading");
+      auto start = std::chrono::steady_clock::now();
+      auto translator = createTranslator(options, device, shortlist);
+      queue->warmUp(translator);
+      queue->swap(translator);
+      loaded = times;
+      std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+      LOG(info, "Serving the reloaded model, loaded and warmed up in {:.2f}s",
+          seconds.count());
+    }
+    catch(std::exception& e) {
+      LOG(info, "Reloading the model failed, keeping the old one: {}", e.what());
+    }
+  }
+}
+
+/**
+ * Serves one client, one tokenized sentence per line in each direction, see
+ * BatchingQueue::push() for requests that continue a target prefix.
+ * Lines are queued as they arrive and answered in order, so a client may send
+ * many sentences before reading and profit from batching. A rejected request
+ * is answered with an empty line.
+ *
+ * With  partial  (--stream-partial), the sentence being answered is preceded
+ * by lines "PARTIAL ||| words" whenever the words all hypotheses of the beam
+ * agree on have grown, so clients of long sentences see output early. Only
+ * the latest stable prefix of a sentence is sent, earlier ones are dropped.
+ */
+void serve(Ptr<boost::asio::ip::tcp::iostream> stream,
+           Ptr<BatchingQueue> queue,
+           size_t cls,
+           bool partial) {
+  struct Pending {
+    std::future<std::string> result;
+    // latest stable prefix not sent yet
+    std::string prefix;
+    bool fresh{false};
+  };
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<Ptr<Pending>> results;
+  bool closed = false;
+
+  std::thread writer([&]() {
+    while(true) {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [&]() { return closed || !results.empty(); });
+      if(results.empty())
+        return;
+      auto pending = results.front();
+      results.pop_front();
+      lock.unlock();
+
+      auto sendPrefix = [&]() {
+        std::string prefix;
+        {
+          std::lock_guard<std::mutex> guard(mutex);
+          if(!pending->fresh)
+            return;
+          prefix.swap(pending->prefix);
+          pending->fresh = false;
+        }
+        *stream << "PARTIAL ||| " << prefix << std::endl;
+      };
+      if(partial)
+        while(pending->result.wait_for(std::chrono::milliseconds(5))
+              != std::future_status::ready)
+          sendPrefix();
+
+      std::string line;
+      try {
+        line = pending->result.get();
+      }
+      catch(std::exception& e) {
+        std::cerr << "Translation failed: " << e.what() << std::endl;
+      }
+      *stream << line << std::endl;
+    }
+  });
+
+  std::string line;
+  while(std::getline(*stream, line)) {
+    auto pending = New<Pending>();
+    std::function<void(const std::string&)> onPrefix;
+    if(partial)
+      onPrefix = [&mutex, pending](const std::string& prefix) {
+        std::lock_guard<std::mutex> guard(mutex);
+        pending->prefix = prefix;
+        pending->fresh = true;
+      };
+    pending->result = queue->push(line, cls, onPrefix);
+    std::lock_guard<std::mutex> lock(mutex);
+    results.push_back(pending);
+    cv.notify_one();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+  }
+  cv.notify_one();
+  writer.join();
+}
+
+/**
+ * @brief Accepts the clients of  port  forever, their requests are of class
+ *  cls , see serve() for  partial
+ */
+void acceptClients(boost::asio::io_service& service,
+                   size_t port,
+                   Ptr<BatchingQueue> queue,
+                   size_t cls,
+                   bool partial) {
+  using boost::asio::ip::tcp;
+  tcp::acceptor acceptor(service, tcp::endpoint(tcp::v4(), port));
+  LOG(info, "Translation server listening on port {} for {} requests", port,
+      cls == BatchingQueue::BULK ? "bulk" : "interactive");
+
+  while(true) {
+    auto stream = New<tcp::iostream>();
+    acceptor.accept(*stream->rdbuf());
+    std::thread(serve, stream, queue, cls, partial).detach();
+  }
+}
+
+/**
+ * Rewrites  path  with BatchingQueue::writeMetrics() every few seconds, by
+ * renaming so readers such as a node exporter never see a partial file
+ */
+void exportMetrics(const std::string& path, Ptr<BatchingQueue> queue) {
+  while(true) {
+    std::this_thread::sleep_for(std::chrono::seconds(5));
+    std::string part = path + ".part";
+    {
+      std::ofstream out(part);
+      queue->writeMetrics(out);
+    }
+    boost::system::error_code error;
+    boost::filesystem::rename(part, path, error);
+    if(error)
+      LOG(info, "Cannot write metrics to {}: {}", path, error.message());
+  }
+}
+
+}
+
+int main(int argc, char** argv) {
+  using namespace marian;
+
+  auto options = New<Config>(argc, argv, true, true);
+
+  // a single decoder thread, on the CPU its products use --cpu-intra-threads
+  size_t device = options->get<std::vector<int>>("devices")[0];
+  if(options->get<size_t>("cpu-threads") > 0) {
+    device = CPU_DEVICE;
+    cpu::setThreads(options->get<size_t>("cpu-intra-threads"));
+  }
+  // the device comes up while the shortlist and the cache load
+  auto start = std::chrono::steady_clock::now();
+  auto warm = warmUpDevices({device}, 1);
+  auto shortlist = loadShortlist(options);
+  Ptr<TranslationCache> cache;
+  if(options->get<size_t>("cache-size") > 0)
+    cache = New<TranslationCache>(options->get<size_t>("cache-size") * 1024 * 1024,
+                                  options->has("cache-file")
+                                    ? options->get<std::string>("cache-file")
+                                    : "");
+  warm.wait();
+  auto translator = createTranslator(options, device, shortlist);
+  auto queue = New<BatchingQueue>(options, translator, cache);
+
+  // the ports open once the first batch would not be slow, clients and
+  // health checks take a connection as readiness
+  queue->warmUp(translator);
+  std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+  LOG(info, "Loaded and warmed up in {:.2f}s", seconds.count());
+  std::thread worker([queue]() { queue->run(); });
+  if(options->get<size_t>("reload-interval") > 0)
+    std::thread(reloadModels, options, device, shortlist, queue).detach();
+
+  if(options->has("metrics-file"))
+    std::thread(exportMetrics, options->get<std::string>("metrics-file"), queue).detach();
+
+  boost::asio::io_service service;
+  size_t bulkPort = options->get<size_t>("bulk-port");
+  bool partial = options->get<bool>("stream-partial");
+  if(bulkPort > 0)
+    std::thread([&service, bulkPort, queue, partial]() {
+      acceptClients(service, bulkPort, queue, BatchingQueue::BULK, partial);
+    }).detach();
+  acceptClients(service, options->get<size_t>("port"), queue,
+                BatchingQueue::INTERACTIVE, partial);
+
+  worker.join();
+  return 0;
+}
@@ -1,261 +1,465 @@
+#include <iostream>
 #include <algorithm>
 #include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <future>
 #include <iomanip>
+#include <map>
+#include <set>
 #include <string>
-#include <cstdio>
+#include <sstream>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <boost/filesystem.hpp>
 #include <boost/timer/timer.hpp>
-#include <boost/chrono.hpp>
 
 #include "marian.h"
 #include "training/config.h"
-#include "optimizers/optimizers.h"
-#include "optimizers/clippers.h"
-#include "data/batch_generator.h"
 #include "data/corpus.h"
-#include "models/multi_gnmt.h"
-#include "models/gnmt.h"
-#include "models/dl4mt.h"
-
-#include "translator/nth_element.h"
-#include "common/history.h"
-
+#include "common/bounded_queue.h"
+#include "common/file_stream.h"
+#include "translator/translator.h"
+#include "translator/output_collector.h"
 
 namespace marian {
 
-template <class Builder>
-class BeamSearch {
-  private:
-    Ptr<Config> options_;
-    Ptr<Builder> builder_;
-    size_t beamSize_;
-    cudaStream_t stream_{0};
+typedef std::pair<size_t, Words> Line;
+
+/**
+ * Reads and tokenizes the input line by line, from --inputs or from stdin
+ * without inputs or with "-", so translation can run inside a pipe. Lines
+ * for which  skip  returns true are counted but not passed on.
+ */
+void readLines(Ptr<Config> options, Ptr<Vocab> source, BoundedQueue<Line>& lines,
+               std::function<bool(size_t)> skip) {
+  std::vector<std::string> inputs;
+  if(options->has("inputs"))
+    inputs = options->get<std::vector<std::string>>("inputs");
+
+  Ptr<InputFileStream> in;
+  if(inputs.empty() || inputs[0] == "-")
+    in = New<InputFileStream>(std::cin);
+  else
+    in = New<InputFileStream>(inputs[0]);
+
+  std::string line;
+  for(size_t lineNo = 0; std::getline((std::istream&)*in, line); ++lineNo) {
+    if(skip && skip(lineNo))
+      continue;
+    Words words = (*source)(line);
+    if(words.empty())
+      words.push_back(0);
+    lines.push({lineNo, words});
+  }
+  lines.close();
+}
 
-  public:
-    BeamSearch(Ptr<Config> options)
-     : options_(options),
-       builder_(New<Builder>(options)),
-       beamSize_(12)
-    {}
-
-    Beam toHyps(const std::vector<uint> keys,
-                const std::vector<float> costs,
-                size_t vocabSize,
-                const Beam& beam) {
-      Beam newBeam;
-      for(int i = 0; i < keys.size(); ++i) {
-        int embIdx = keys[i] % vocabSize;
-        int hypIdx = keys[i] / vocabSize;
-        float cost = costs[i];
-
-        newBeam.push_back(
-          New<Hypothesis>(beam[hypIdx], embIdx, hypIdx, cost));
+/**
+ * Collects up to --maxi-batch times --mini-batch lines, without waiting for
+ * more than are available once the first has arrived, sorts them by length
+ * and hands mini-batches to the translators. Futures are queued in input
+ * order of the batches for the writer.
+ */
+void makeBatches(Ptr<Config> options, BoundedQueue<Line>& lines,
+                 TranslatorPool& translators,
+                 BoundedQueue<std::future<std::vector<Translation>>>& results) {
+  size_t miniBatch = std::max(1, options->get<int>("mini-batch"));
+  size_t maxiBatch = miniBatch * std::max(1, options->get<int>("maxi-batch"));
+
+  Line line;
+  while(lines.pop(line)) {
+    std::vector<Line> pool(1, line);
+    while(pool.size() < maxiBatch && lines.tryPop(line))
+      pool.push_back(line);
+
+    std::stable_sort(pool.begin(), pool.end(),
+                     [](const Line& a, const Line& b) {
+                       return a.second.size() > b.second.size();
+                     });
+
+    for(size_t start = 0; start < pool.size(); start += miniBatch) {
+      std::vector<data::SentenceTuple> samples;
+      std::vector<size_t> ids;
+      for(size_t i = start; i < std::min(start + miniBatch, pool.size()); ++i) {
+        samples.push_back({pool[i].second});
+        ids.push_back(pool[i].first);
       }
-      return newBeam;
-    }
 
-    Beam pruneBeam(const Beam& beam) {
-      Beam newBeam;
-      for(auto hyp : beam) {
-        if(hyp->GetWord() > 0) {
-          newBeam.push_back(hyp);
-        }
-      }
-      return newBeam;
+      auto batch = data::Corpus::toBatch(samples);
+      batch->setSentenceIds(ids);
+      results.push(translators.translate(batch));
     }
+  }
+  results.close();
+}
 
-    std::tuple<std::vector<Expr>, Expr>
-    step(std::vector<Expr> hyps,
-         Ptr<EncoderState> encState,
-         const std::vector<size_t> hypIdx = {},
-         const std::vector<size_t> embIdx = {}) {
-      using namespace keywords;
-      auto graph = hyps[0]->graph();
-
-      // @TODO: not hard-coded!
-      int dimTrgEmb_ = 512;
-      int dimTrgVoc_ = 50000;
-
-      std::vector<Expr> selectedHyps;
-      Expr selectedEmbs;
-      if(embIdx.empty()) {
-        selectedHyps = hyps;
-        selectedEmbs = graph->constant(shape={1, dimTrgEmb_},
-                                       init=inits::zeros);
-      }
-      else {
-        // @TODO : solve this better than reshaping!
-        for(auto h : hyps)
-          selectedHyps.push_back(
-            reshape(rows(h, hypIdx), {1, h->shape()[1], 1, (int)hypIdx.size()}));
-
-        auto yEmb = Embedding("Wemb_dec", dimTrgVoc_, dimTrgEmb_)(graph);
-        selectedEmbs = reshape(rows(yEmb, embIdx),
-                               {1, yEmb->shape()[1], 1, (int)embIdx.size()});
-      }
+/** @brief Time of  f()  in milliseconds */
+template <class F>
+double milliseconds(F f) {
+  auto start = std::chrono::steady_clock::now();
+  f();
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now()
+                                                   - start).count();
+}
 
-      Expr logits;
-      std::vector<Expr> newHyps;
-      std::tie(logits, newHyps) = builder_->step(selectedEmbs,
-                                                 selectedHyps,
-                                                 encState,
-                                                 true);
-      return std::make_tuple(newHyps, logsoftmax(logits));
-    }
+double percentile(std::vector<double> values, double p) {
+  if(values.empty())
+    return 0;
+  std::sort(values.begin(), values.end());
+  return values[std::min(values.size() - 1, (size_t)(p * values.size()))];
+}
 
-    std::tuple<std::vector<Expr>, Expr>
-    step(std::vector<Expr> hyps,
-         Ptr<EncoderState> encState,
-         const Beam& beam) {
+/**
+ * With --benchmark, translates all input lines, sorted by length, once for
+ * every combination of --bench-beam-sizes, --bench-batch-sizes and
+ * --bench-length-factors on a single translator of the first device. The
+ * first batch is translated once untimed. A timed pass measures sentences/s
+ * and output tokens/s and the latency of every sentence, the time of its
+ * batch; a second pass with a SearchProfile breaks the time down, apart
+ * because profiling waits for the device. The results are written as JSON.
+ */
+void benchmark(Ptr<Config> options, Ptr<Vocab> source) {
+  BoundedQueue<Line> queue(1024);
+  std::thread reader(readLines, options, source, std::ref(queue), nullptr);
+  std::vector<Line> lines;
+  Line line;
+  while(queue.pop(line))
+    lines.push_back(line);
+  reader.join();
+  UTIL_THROW_IF2(lines.empty(), "No input to benchmark");
+
+  std::stable_sort(lines.begin(), lines.end(),
+                   [](const Line& a, const Line& b) {
+                     return a.second.size() > b.second.size();
+                   });
+
+  auto list = [&](const std::string& key, const std::string& fallback) {
+    return options->has(key) ? options->get<std::vector<float>>(key)
+                             : std::vector<float>{options->get<float>(fallback)};
+  };
+  auto beamSizes = list("bench-beam-sizes", "beam-size");
+  auto batchSizes = list("bench-batch-sizes", "mini-batch");
+  auto lengthFactors = list("bench-length-factors", "max-length-factor");
+
+  auto devices = options->get<std::vector<int>>("devices");
+  auto translator = createTranslator(options, devices[0], loadShortlist(options));
+
+  std::cout << "{\"sentences\": " << lines.size() << ", \"results\": [" << std::endl;
+  bool firstResult = true;
+  for(size_t beamSize : beamSizes)
+    for(size_t batchSize : batchSizes)
+      for(float lengthFactor : lengthFactors) {
+        options->get()["beam-size"] = beamSize;
+        options->get()["max-length-factor"] = lengthFactor;
+        batchSize = std::max((size_t)1, batchSize);
+
+        std::vector<Ptr<data::CorpusBatch>> batches;
+        for(size_t start = 0; start < lines.size(); start += batchSize) {
+          std::vector<data::SentenceTuple> samples;
+          std::vector<size_t> ids;
+          for(size_t i = start; i < std::min(start + batchSize, lines.size()); ++i) {
+            samples.push_back({lines[i].second});
+            ids.push_back(lines[i].first);
+          }
+          auto batch = data::Corpus::toBatch(samples);
+          batch->setSentenceIds(ids);
+          batches.push_back(batch);
+        }
 
-      std::vector<size_t> hypIndeces;
-      std::vector<size_t> embIndeces;
-      std::vector<float> beamCosts;
+        translator->translate(batches[0]);
+
+        std::vector<double> latencies;
+        size_t tokens = 0;
+        double total = 0;
+        for(auto batch : batches) {
+          std::vector<Translation> translations;
+          double ms = milliseconds([&]() { translations = translator->translate(batch); });
+          total += ms;
+          for(auto& translation : translations) {
+            latencies.push_back(ms);
+            tokens += translation.second.size();
+          }
+        }
 
-      for(auto hyp : beam) {
-        hypIndeces.push_back(hyp->GetPrevStateIndex());
-        embIndeces.push_back(hyp->GetWord());
-        beamCosts.push_back(hyp->GetCost());
+        auto profile = New<SearchProfile>();
+        translator->setProfile(profile);
+        for(auto batch : batches)
+          translator->translate(batch);
+        translator->setProfile(nullptr);
+
+        double seconds = total / 1000;
+        double profiled = std::max(profile->total(), 1e-9);
+        LOG(info, "Beam {}, batch {}, length factor {}: {:.1f} sentences/s, {:.0f} tokens/s, "
+            "latency {:.1f} / {:.1f} / {:.1f} ms (p50 / p95 / p99), encoder {:.0f}%, "
+            "decoder {:.0f}%, top-k {:.0f}%, host {:.0f}%",
+            beamSize, batchSize, lengthFactor, lines.size() / seconds, tokens / seconds,
+            percentile(latencies, 0.5), percentile(latencies, 0.95), percentile(latencies, 0.99),
+            100 * profile->encoder / profiled, 100 * profile->decoder / profiled,
+            100 * profile->topk / profiled, 100 * profile->host / profiled);
+
+        std::cout << (firstResult ? "  " : ", ")
+                  << "{\"beam_size\": " << beamSize
+                  << ", \"batch_size\": " << batchSize
+                  << ", \"length_factor\": " << lengthFactor
+                  << ", \"sentences_per_second\": " << lines.size() / seconds
+                  << ", \"tokens_per_second\": " << tokens / seconds
+                  << ", \"latency_ms_p50\": " << percentile(latencies, 0.5)
+                  << ", \"latency_ms_p95\": " << percentile(latencies, 0.95)
+                  << ", \"latency_ms_p99\": " << percentile(latencies, 0.99)
+                  << ", \"encoder_seconds\": " << profile->encoder
+                  << ", \"decoder_seconds\": " << profile->decoder
+                  << ", \"topk_seconds\": " << profile->topk
+                  << ", \"host_seconds\": " << profile->host
+                  << ", \"steps\": " << profile->steps << "}" << std::endl;
+        firstResult = false;
       }
+  std::cout << "]}" << std::endl;
+}
 
-      auto graph = hyps[0]->graph();
-      auto costs = graph->constant(keywords::shape={1, 1, 1, (int)beamCosts.size()},
-                                   keywords::init=inits::from_vector(beamCosts));
-
-      std::vector<Expr> newHyps;
-      Expr probs;
-      std::tie(newHyps, probs) = step(hyps,
-                                      encState,
-                                      hypIndeces,
-                                      embIndeces);
-      probs = probs + costs;
-      return std::make_tuple(newHyps, probs);
-    }
-
-    Ptr<History> search(Ptr<ExpressionGraph> graph,
-                        Ptr<data::CorpusBatch> batch) {
-
-      std::vector<Expr> startStates;
-      Ptr<EncoderState> encState;
-      std::tie(startStates, encState)
-        = builder_->buildEncoder(graph, batch);
-
-      size_t pos = 0;
-      auto history = New<History>(0);
-      Beam beam(1, New<Hypothesis>());
-      bool first = true;
-      bool final = false;
-      std::vector<size_t> beamSizes(1, beamSize_);
-      auto nth = New<NthElement>(beamSize_, batch->size(), stream_);
-
-      history->Add(beam);
-
-      std::vector<Expr> hyps;
-      Expr probs;
-      do {
-
-        if(first) {
-          std::tie(hyps, probs) = step(startStates, encState);
-          pos = graph->forward();
-        }
-        else {
-          std::tie(hyps, probs) = step(hyps, encState, beam);
-          beamSizes[0] = beam.size();
-          pos = graph->forward(pos);
-        }
-
-        size_t dimTrgVoc = probs->shape()[1];
+typedef std::vector<std::pair<size_t, std::string>> OutputLines;
 
-        std::vector<unsigned> outKeys;
-        std::vector<float> outCosts;
+/** @brief Output line of a translation, its words separated by spaces */
+std::string formatLine(Ptr<Vocab> target, const Words& words) {
+  std::string line;
+  for(auto w : words) {
+    if(w != 0) {
+      line += (*target)[w];
+      line += ' ';
+    }
+  }
+  return line;
+}
 
-        for(int i = 0; i < probs->shape()[3]; i++) {
-          probs->val()->set(i * dimTrgVoc + 1, std::numeric_limits<float>::lowest());
-        }
+/**
+ * Detokenizes the translations of every batch on a pool of --output-threads
+ * threads as soon as the batch is decoded, the translators never wait for
+ * it. The formatted batches are queued in the order of the batches for the
+ * writer.
+ */
+void formatLines(Ptr<Config> options, Ptr<Vocab> target,
+                 BoundedQueue<std::future<std::vector<Translation>>>& results,
+                 BoundedQueue<std::future<OutputLines>>& formatted) {
+  size_t threads = std::max((size_t)1, options->get<size_t>("output-threads"));
+  ThreadPool pool(threads, 2 * threads);
+  std::future<std::vector<Translation>> result;
+  while(results.pop(result)) {
+    auto format = [target](std::shared_future<std::vector<Translation>> result) {
+      OutputLines lines;
+      for(auto& translation : result.get())
+        lines.emplace_back(translation.first, formatLine(target, translation.second));
+      return lines;
+    };
+    formatted.push(pool.enqueue(format, result.share()));
+  }
+  formatted.close();
+}
 
-        nth->getNBestList(beamSizes, probs->val(),
-                          outCosts, outKeys, first);
-        first = false;
+/**
+ * Writes the formatted translations in input order from a single thread.
+ * The output is flushed whenever no further batch is ready, not per line.
+ */
+void writeLines(BoundedQueue<std::future<OutputLines>>& formatted) {
+  OutputCollector collector;
+  std::future<OutputLines> lines;
+  while(formatted.pop(lines)) {
+    for(auto& line : lines.get())
+      collector.write(line.first, line.second);
+    if(formatted.size() == 0)
+      collector.sync();
+  }
+  collector.flush();
+}
 
-        beam = toHyps(outKeys, outCosts, dimTrgVoc, beam);
-        final = history->size() >= 3 * batch->words();
-        history->Add(beam, final);
-        beam = pruneBeam(beam);
+/**
+ * @brief Output and progress of a resumable bulk translation in --job-dir.
+ *
+ * The input is cut into chunks of --job-chunk lines. Chunk k is written to
+ * DIR/chunk.k once all its lines are translated, through a synced temporary
+ * file, and then appended as "k first-line lines" to DIR/progress. A job
+ * started again on the same input skips the chunks listed there, chunks that
+ * were in flight when it stopped are translated again.
+ */
+class BulkJob {
+  private:
+    std::string dir_;
+    size_t chunk_;
+    // finished before this run, read by the reader thread
+    std::set<size_t> resumed_;
+
+    struct Pending {
+      std::vector<std::string> lines;
+      size_t filled{0};
+    };
+    std::map<size_t, Pending> pending_;
+
+    size_t written_{0};
+    std::chrono::steady_clock::time_point start_;
+
+    std::string path(size_t chunk) const {
+      std::stringstream ss;
+      ss << dir_ << "/chunk." << std::setw(8) << std::setfill('0') << chunk;
+      return ss.str();
+    }
 
-      } while(!beam.empty() && !final);
+    static void sync(const std::string& file) {
+      int fd = ::open(file.c_str(), O_RDONLY);
+      UTIL_THROW_IF2(fd < 0 || ::fsync(fd) != 0, "Could not sync " << file);
+      ::close(fd);
+    }
 
-      return history;
+    void finish(size_t chunk) {
+      auto& pending = pending_[chunk];
+      std::string file = path(chunk);
+      std::string tmp = file + ".tmp";
+      {
+        std::ofstream out(tmp);
+        for(size_t i = 0; i < pending.filled; ++i)
+          out << pending.lines[i] << "\n";
+        UTIL_THROW_IF2(!out.flush(), "Could not write " << tmp);
+      }
+      sync(tmp);
+      UTIL_THROW_IF2(std::rename(tmp.c_str(), file.c_str()) != 0,
+                     "Could not rename " << tmp << " to " << file);
+
+      std::string progress = dir_ + "/progress";
+      {
+        std::ofstream out(progress, std::ios::app);
+        out << chunk << " " << chunk * chunk_ << " " << pending.filled << "\n";
+        UTIL_THROW_IF2(!out.flush(), "Could not write " << progress);
+      }
+      sync(progress);
+
+      written_ += pending.filled;
+      double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()
+                                                     - start_).count();
+      LOG(info, "Finished chunk {} of {} lines, {:.1f} sentences/s since start",
+          chunk, pending.filled, written_ / std::max(seconds, 1e-9));
+      pending_.erase(chunk);
     }
-};
 
-class TranslatorBase {
   public:
-    virtual Ptr<History> translate(Ptr<data::CorpusBatch>) = 0;
-};
-
-template <class Model>
-class Translator : public TranslatorBase {
-  private:
-    Ptr<Config> options_;
-    Ptr<ExpressionGraph> graph_;
-
+    BulkJob(const std::string& dir, size_t chunk)
+     : dir_(dir), chunk_(std::max((size_t)1, chunk)),
+       start_(std::chrono::steady_clock::now()) {
+      boost::filesystem::create_directories(dir_);
+      std::ifstream in(dir_ + "/progress");
+      size_t done, first, lines;
+      while(in >> done >> first >> lines) {
+        UTIL_THROW_IF2(first != done * chunk_,
+                       "Job in " << dir_ << " was started with another --job-chunk");
+        resumed_.insert(done);
+      }
+      if(!resumed_.empty())
+        LOG(info, "Resuming job in {}, {} chunks are done", dir_, resumed_.size());
+    }
 
-  public:
-    Translator(Ptr<Config> options)
-    : options_(options),
-    graph_(New<ExpressionGraph>()) {
-      auto devices = options_->get<std::vector<int>>("devices");
-      graph_->setDevice(devices[0]);
+    /** @brief Whether input line  lineNo  belongs to a chunk finished before this run */
+    bool done(size_t lineNo) const {
+      return resumed_.count(lineNo / chunk_) > 0;
     }
 
-    Ptr<History> translate(Ptr<data::CorpusBatch> batch) {
-      auto search = New<BeamSearch<Model>>(options_);
-      return search->search(graph_, batch);
+    /** @brief Output line  line  of input line  lineNo , finishes the chunk once it is full */
+    void write(size_t lineNo, const std::string& line) {
+      size_t chunk = lineNo / chunk_;
+      auto& pending = pending_[chunk];
+      if(pending.lines.empty())
+        pending.lines.resize(chunk_);
+      pending.lines[lineNo % chunk_] = line;
+      if(++pending.filled == chunk_)
+        finish(chunk);
     }
 
+    /** @brief Finishes the last, shorter chunk at the end of the input */
+    void close() {
+      while(!pending_.empty())
+        finish(pending_.begin()->first);
+    }
 };
 
+/**
+ * With --job-dir, translates the input into chunked output files, see
+ * BulkJob, with the pipeline of a normal run: length-sorted maxi-batches on
+ * all translators of --devices, with --beam-size, e.g. 1 for greedy search,
+ * and --shortlist as configured. The job can be stopped at any time and
+ * resumes with the first unfinished chunk.
+ */
+void bulk(Ptr<Config> options, Ptr<Vocab> source, Ptr<Vocab> target) {
+  auto job = New<BulkJob>(options->get<std::string>("job-dir"),
+                          options->get<size_t>("job-chunk"));
+  TranslatorPool translators(options);
+
+  size_t lineBuffer = 2 * std::max(1, options->get<int>("mini-batch"))
+                        * std::max(1, options->get<int>("maxi-batch"));
+  BoundedQueue<Line> lines(lineBuffer);
+  BoundedQueue<std::future<std::vector<Translation>>> results(2 * translators.size());
+  BoundedQueue<std::future<OutputLines>> formatted(2 * translators.size());
+
+  std::thread reader(readLines, options, source, std::ref(lines),
+                     [job](size_t lineNo) { return job->done(lineNo); });
+  std::thread formatter(formatLines, options, target, std::ref(results), std::ref(formatted));
+  std::thread writer([&]() {
+    std::future<OutputLines> batch;
+    while(formatted.pop(batch))
+      for(auto& line : batch.get())
+        job->write(line.first, line.second);
+    job->close();
+  });
+  makeBatches(options, lines, translators, results);
+
+  reader.join();
+  formatter.join();
+  writer.join();
+}
+
 }
 
 int main(int argc, char** argv) {
   using namespace marian;
-  using namespace data;
 
   auto options = New<Config>(argc, argv, true, true);
 
-  Ptr<TranslatorBase> translator;
-  auto type = options->get<std::string>("type");
-  if(type == "gnmt")
-    translator = New<Translator<GNMT>>(options);
-  else if(type == "multi-gnmt")
-    translator = New<Translator<MultiGNMT>>(options);
-  else
-    translator = New<Translator<DL4MT>>(options);
+  auto vocabs = options->get<std::vector<std::string>>("vocabs");
+  auto source = New<Vocab>();
+  source->load(vocabs.front());
 
-  auto corpus = DataSet<Corpus>(options, true);
-  BatchGenerator<Corpus> bg(corpus, options);
+  if(options->get<bool>("benchmark")) {
+    benchmark(options, source);
+    return 0;
+  }
 
   auto target = New<Vocab>();
-  auto vocabs = options->get<std::vector<std::string>>("vocabs");
   target->load(vocabs.back());
 
+  if(options->has("job-dir")) {
+    bulk(options, source, target);
+    return 0;
+  }
+
+  TranslatorPool translators(options);
+
   boost::timer::cpu_timer timer;
-  bg.prepare(false);
-  while(bg) {
-    auto batch = bg.next();
-    auto history = translator->translate(batch);
-
-    //********************************
-    auto results = history->NBest(1);
-    std::stringstream ss;
-    for(auto r : results) {
-      for(auto w : r.first)
-        if(w != 0)
-          ss << (*target)[w] << " ";
-    }
-    std::cout << ss.str() << std::endl;
-    //********************************
 
-  }
+  // reader -> batcher -> translators -> formatters -> writer, the bounded
+  // queues keep the text stages just far enough ahead that the devices never
+  // wait on them
+  size_t lineBuffer = 2 * std::max(1, options->get<int>("mini-batch"))
+                        * std::max(1, options->get<int>("maxi-batch"));
+  BoundedQueue<Line> lines(lineBuffer);
+  BoundedQueue<std::future<std::vector<Translation>>> results(2 * translators.size());
+  BoundedQueue<std::future<OutputLines>> formatted(2 * translators.size());
+
+  std::thread reader(readLines, options, source, std::ref(lines), nullptr);
+  std::thread formatter(formatLines, options, target, std::ref(results), std::ref(formatted));
+  std::thread writer(writeLines, std::ref(formatted));
+  makeBatches(options, lines, translators, results);
+
+  reader.join();
+  formatter.join();
+  writer.join();
+
   std::cerr << timer.format(5, "%ws") << std::endl;
 
   return 0;
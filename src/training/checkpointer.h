@@ -0,0 +1,249 @@
+#pragma once
+
+#include <cstdio>
+#include <fcntl.h>
+#include <functional>
+#include <future>
+#include <string>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "common/thread_pool.h"
+#include "common/definitions.h"
+#include "common/logging.h"
+#include "common/npz_writer.h"
+#include "graph/expression_graph.h"
+#include "kernels/cuda_helpers.h"
+#include "tensors/pinned_pool.h"
+
+namespace marian {
+
+/**
+ * @brief Writes model checkpoints on a background thread.
+ *
+ * save() only blocks for one device-to-host copy of all parameters into a
+ * pinned snapshot per checkpoint, e.g. the parameters and their moving average,
+ * or for a previous checkpoint that is still being written.
+ * The writer thread then serializes the snapshot into  file.tmp , syncs it to
+ * disk and renames it to  file , so an interrupted write never replaces a
+ * complete checkpoint. Errors of the writer are rethrown by the next save()
+ * or wait().
+ */
+class Checkpointer {
+  public:
+    /**
+     * @brief One set of parameters to save: every file of  files  gets them,
+     * with the translator config of the builder if its flag is set.  copy(host)
+     * fills the snapshot in the layout of graph->params().vals() and returns
+     * once the data has arrived; by default it is copied from the graph.
+     * Frozen parameters, which follow vals(), are always copied from the graph.
+     */
+    struct Checkpoint {
+      std::vector<std::pair<std::string, bool>> files;
+      std::function<void(float*)> copy;
+    };
+
+  private:
+    struct Entry {
+      std::string name;
+      unsigned shape[2];
+      unsigned dim;
+      size_t offset;
+      // floats per row in memory, more than saved for padded columns
+      unsigned stride;
+    };
+
+    size_t device_{0};
+    std::vector<PinnedBuffer*> snapshots_;
+
+    ThreadPool writer_{1};
+    std::future<void> pending_;
+
+    /** @brief Names, shapes and offsets of the parameters of  graph , shifted by  shift  */
+    template <class Builder>
+    std::vector<Entry> layout(Ptr<ExpressionGraph> graph, Ptr<Builder> builder,
+                              size_t shift = 0) {
+      std::vector<Entry> entries;
+      const float* base = graph->params().vals()->data();
+      for(auto p : graph->params().getMap()) {
+        Entry entry;
+        entry.name = builder->savedName(p.first);
+        int cols = graph->realColumns(p.first, p.second->shape()[1]);
+        entry.stride = p.second->shape()[1];
+        if(p.second->shape()[0] == 1) {
+          entry.shape[0] = cols;
+          entry.dim = 1;
+        }
+        else {
+          entry.shape[0] = p.second->shape()[0];
+          entry.shape[1] = cols;
+          entry.dim = 2;
+        }
+        entry.offset = shift + (p.second->val()->data() - base);
+        entries.push_back(entry);
+      }
+      return entries;
+    }
+
+    static void commit(const std::string& tmp, const std::string& file) {
+      int fd = ::open(tmp.c_str(), O_RDONLY);
+      UTIL_THROW_IF2(fd < 0 || ::fsync(fd) != 0, "Could not sync checkpoint " << tmp);
+      ::close(fd);
+      UTIL_THROW_IF2(std::rename(tmp.c_str(), file.c_str()) != 0,
+                     "Could not rename checkpoint " << tmp << " to " << file);
+    }
+
+    void release() {
+      for(auto snapshot : snapshots_)
+        PinnedPool::get(device_).release(snapshot);
+      snapshots_.clear();
+    }
+
+    /** @brief Copies the floats of  graph  from  offset  on into  host + offset  */
+    static void copyParams(Ptr<ExpressionGraph> graph, float* host, size_t offset = 0) {
+      Tensor all = graph->params().allVals();
+      if(offset >= all->size())
+        return;
+      Tensor vals = all->subtensor(offset, all->size() - offset);
+      host += offset;
+      int current;
+      cudaGetDevice(&current);
+      cudaSetDevice(graph->getDevice());
+      CUDA_CHECK(cudaMemcpyAsync(host, vals->data(), vals->size() * sizeof(float),
+                                 cudaMemcpyDeviceToHost, currentStream()));
+      CUDA_CHECK(cudaStreamSynchronize(currentStream()));
+      cudaSetDevice(current);
+    }
+
+    /** @brief Fills snapshots of  size  floats for  checkpoints , then writes them in order */
+    template <class Builder>
+    void write(const std::vector<Entry>& entries,
+               size_t size,
+               size_t device,
+               Ptr<Builder> builder,
+               const std::vector<Checkpoint>& checkpoints) {
+      if(snapshots_.size() != checkpoints.size()
+         || (!snapshots_.empty() && snapshots_[0]->size < size)) {
+        release();
+        device_ = device;
+        for(size_t i = 0; i < checkpoints.size(); ++i)
+          snapshots_.push_back(PinnedPool::get(device_).acquire(size));
+      }
+
+      std::vector<const float*> data;
+      for(size_t i = 0; i < checkpoints.size(); ++i) {
+        float* host = snapshots_[i]->data;
+        checkpoints[i].copy(host);
+        data.push_back(host);
+      }
+
+      pending_ = writer_.enqueue([=]() {
+        for(size_t i = 0; i < checkpoints.size(); ++i) {
+          for(auto& file : checkpoints[i].files) {
+            LOG(info, "Saving model to {}", file.first);
+            std::string tmp = file.first + ".tmp";
+            NpzWriter npz(tmp);
+            for(auto& entry : entries) {
+              const float* values = data[i] + entry.offset;
+              // padded columns are stripped row by row
+              std::vector<float> compact;
+              if(entry.dim == 2 && entry.stride != entry.shape[1]) {
+                for(unsigned r = 0; r < entry.shape[0]; ++r)
+                  compact.insert(compact.end(), values + r * entry.stride,
+                                 values + r * entry.stride + entry.shape[1]);
+                values = compact.data();
+              }
+              npz.add(entry.name, values, entry.shape, entry.dim);
+            }
+            builder->saveExtras(npz);
+            npz.close();
+            commit(tmp, file.first);
+            if(file.second)
+              builder->saveTranslatorConfig(file.first);
+          }
+        }
+      });
+    }
+
+  public:
+    ~Checkpointer() {
+      try {
+        wait();
+      }
+      catch(std::exception& e) {
+        LOG(info, "Writing the last checkpoint failed: {}", e.what());
+      }
+      release();
+    }
+
+    /** @brief Blocks until the last checkpoint is on disk */
+    void wait() {
+      if(pending_.valid())
+        pending_.get();
+    }
+
+    /** @brief Snapshots every checkpoint of  checkpoints , then writes them in order */
+    template <class Builder>
+    void save(Ptr<ExpressionGraph> graph,
+              Ptr<Builder> builder,
+              const std::vector<Checkpoint>& checkpoints) {
+      // the snapshots are still read by the previous write
+      wait();
+
+      std::vector<Checkpoint> copies = checkpoints;
+      size_t trained = graph->params().vals()->size();
+      for(auto& checkpoint : copies) {
+        if(!checkpoint.copy) {
+          checkpoint.copy = [graph](float* host) { copyParams(graph, host); };
+        }
+        else if(graph->params().freezing()) {
+          auto copy = checkpoint.copy;
+          checkpoint.copy = [graph, copy, trained](float* host) {
+            copy(host);
+            copyParams(graph, host, trained);
+          };
+        }
+      }
+      write(layout(graph, builder), graph->params().allVals()->size(),
+            graph->getDevice(), builder, copies);
+    }
+
+    /**
+     * @brief Snapshots the parameters of all  graphs  into one model written to
+     *  files , e.g. of pipeline stages that each hold a part of the model
+     */
+    template <class Builder>
+    void save(const std::vector<Ptr<ExpressionGraph>>& graphs,
+              Ptr<Builder> builder,
+              const std::vector<std::pair<std::string, bool>>& files) {
+      wait();
+
+      std::vector<Entry> entries;
+      std::vector<size_t> shifts;
+      size_t size = 0;
+      for(auto graph : graphs) {
+        auto part = layout(graph, builder, size);
+        entries.insert(entries.end(), part.begin(), part.end());
+        shifts.push_back(size);
+        size += graph->params().allVals()->size();
+      }
+      auto copy = [graphs, shifts](float* host) {
+        for(size_t i = 0; i < graphs.size(); ++i)
+          copyParams(graphs[i], host + shifts[i]);
+      };
+      write(entries, size, graphs[0]->getDevice(), builder,
+            std::vector<Checkpoint>{{files, copy}});
+    }
+
+    /** @brief Snapshots the parameters of  graph  and writes them to  files  */
+    template <class Builder>
+    void save(Ptr<ExpressionGraph> graph,
+              Ptr<Builder> builder,
+              const std::vector<std::pair<std::string, bool>>& files,
+              std::function<void(float*)> copy = nullptr) {
+      save(graph, builder, std::vector<Checkpoint>{{files, copy}});
+    }
+};
+
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+#include <boost/asio.hpp>
+
+#include "common/definitions.h"
+#include "common/logging.h"
+#include "training/config.h"
+
+namespace marian {
+
+/**
+ * @brief Processes of a training job spread over --cluster-nodes machines.
+ *
+ * Node 0 listens on the port of --cluster-master, all others connect to it
+ * there. The connections only bootstrap the job, e.g. by broadcasting the
+ * NCCL id, and let the nodes agree on small decisions. Gradients never pass
+ * through them.
+ */
+class Cluster {
+  private:
+    size_t nodes_;
+    size_t rank_;
+    // node 0 holds one connection per node 1..n-1, the other nodes one to node 0
+    std::vector<Ptr<boost::asio::ip::tcp::iostream>> peers_;
+
+    void send(boost::asio::ip::tcp::iostream& peer, const std::string& blob) {
+      uint64_t size = blob.size();
+      peer.write((const char*)&size, sizeof(size));
+      peer.write(blob.data(), blob.size());
+      peer.flush();
+      UTIL_THROW_IF2(!peer, "Lost connection to a cluster node");
+    }
+
+    std::string receive(boost::asio::ip::tcp::iostream& peer) {
+      uint64_t size = 0;
+      peer.read((char*)&size, sizeof(size));
+      std::string blob(size, 0);
+      peer.read(&blob[0], size);
+      UTIL_THROW_IF2(!peer, "Lost connection to a cluster node");
+      return blob;
+    }
+
+    void connect(const std::string& master) {
+      using boost::asio::ip::tcp;
+      size_t colon = master.rfind(':');
+      UTIL_THROW_IF2(colon == std::string::npos,
+                     "--cluster-master must be host:port, not " << master);
+      std::string host = master.substr(0, colon);
+      std::string port = master.substr(colon + 1);
+
+      if(rank_ == 0) {
+        boost::asio::io_service service;
+        tcp::acceptor acceptor(service, tcp::endpoint(tcp::v4(), std::stoi(port)));
+        LOG(info, "Waiting for {} cluster nodes on port {}", nodes_ - 1, port);
+
+        std::vector<Ptr<tcp::iostream>> peers(nodes_ - 1);
+        for(size_t i = 1; i < nodes_; ++i) {
+          auto peer = New<tcp::iostream>();
+          acceptor.accept(*peer->rdbuf());
+          size_t rank = std::stoul(receive(*peer));
+          UTIL_THROW_IF2(rank == 0 || rank >= nodes_ || peers[rank - 1],
+                         "Invalid or duplicate cluster rank " << rank);
+          peers[rank - 1] = peer;
+        }
+        peers_ = peers;
+      }
+      else {
+        // node 0 may still be starting up
+        auto peer = New<tcp::iostream>();
+        for(size_t attempt = 0; ; ++attempt) {
+          peer->clear();
+          peer->connect(host, port);
+          if(*peer)
+            break;
+          UTIL_THROW_IF2(attempt == 600, "Could not connect to cluster node " << master);
+          std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        send(*peer, std::to_string(rank_));
+        peers_.push_back(peer);
+      }
+      LOG(info, "Node {} of {} connected", rank_, nodes_);
+    }
+
+  public:
+    Cluster(Ptr<Config> options)
+     : nodes_(std::max((size_t)1, options->get<size_t>("cluster-nodes"))),
+       rank_(options->get<size_t>("cluster-rank")) {
+      UTIL_THROW_IF2(rank_ >= nodes_,
+                     "--cluster-rank " << rank_ << " with " << nodes_ << " nodes");
+      if(nodes_ > 1)
+        connect(options->get<std::string>("cluster-master"));
+    }
+
+    size_t nodes() {
+      return nodes_;
+    }
+
+    size_t rank() {
+      return rank_;
+    }
+
+    /** @brief Returns  blob  of node 0 on all nodes */
+    std::string broadcast(const std::string& blob) {
+      if(nodes_ == 1)
+        return blob;
+      if(rank_ == 0) {
+        for(auto& peer : peers_)
+          send(*peer, blob);
+        return blob;
+      }
+      return receive(*peers_[0]);
+    }
+
+    /** @brief True on all nodes if  value  is true on all nodes */
+    bool all(bool value) {
+      if(nodes_ == 1)
+        return value;
+      if(rank_ == 0) {
+        for(auto& peer : peers_)
+          value = receive(*peer) == "1" && value;
+        return broadcast(value ? "1" : "0") == "1";
+      }
+      send(*peers_[0], value ? "1" : "0");
+      return receive(*peers_[0]) == "1";
+    }
+};
+
+}
@@ -5,6 +5,9 @@
 #include "training/config.h"
 #include "common/file_stream.h"
 #include "common/logging.h"
+#include "common/numa.h"
+#include "common/read_ahead.h"
+#include "data/binary_corpus.h"
 
 #define SET_OPTION(key, type) \
 do { if(!vm_[key].defaulted() || !config_[key]) { \
@@ -39,9 +42,28 @@ YAML::Node& Config::get() {
   return config_;
 }
 
+void Config::refresh() {
+  auto option = [this](const std::string& key, size_t fallback) {
+    return has(key) ? get<size_t>(key) : fallback;
+  };
+
+  snapshot_.miniBatch = get<int>("mini-batch");
+  snapshot_.maxiBatch = get<int>("maxi-batch");
+  snapshot_.miniBatchWords = option("mini-batch-words", 0);
+
+  snapshot_.dispFreq = option("disp-freq", 1);
+  snapshot_.saveFreq = option("save-freq", 0);
+  snapshot_.validFreq = option("valid-freq", 0);
+  snapshot_.validAsync = has("valid-async") && get<bool>("valid-async");
+
+  snapshot_.afterEpochs = option("after-epochs", 0);
+  snapshot_.afterBatches = option("after-batches", 0);
+  snapshot_.earlyStopping = option("early-stopping", 0);
+}
+
 void ProcessPaths(YAML::Node& node, const boost::filesystem::path& configPath, bool isPath) {
   using namespace boost::filesystem;
-  std::set<std::string> paths = {"model", "trainsets", "vocabs"};
+  std::set<std::string> paths = {"model", "models", "trainsets", "vocabs"};
 
   if(isPath) {
     if(node.Type() == YAML::NodeType::Scalar) {
@@ -85,17 +107,31 @@ void Config::validate(bool translate) const {
       UTIL_THROW_IF2(!has("train-sets")
                      || get<std::vector<std::string>>("train-sets").empty(),
                      "No train sets given in config file or on command line");
+      auto trainSets = get<std::vector<std::string>>("train-sets");
+      size_t streams = trainSets.size();
+      // a binary corpus holds all streams in one file
+      if(streams == 1 && data::BinaryCorpus::isBinary(trainSets[0])) {
+        UTIL_THROW_IF2(!has("vocabs"),
+                       "A binary training corpus requires --vocabs");
+        streams = get<std::vector<std::string>>("vocabs").size();
+      }
       if(has("vocabs")) {
-        UTIL_THROW_IF2(get<std::vector<std::string>>("vocabs").size() !=
-          get<std::vector<std::string>>("train-sets").size(),
+        UTIL_THROW_IF2(get<std::vector<std::string>>("vocabs").size() != streams,
           "There should be as many vocabularies as training sets");
       }
       if(has("valid-sets")) {
-        UTIL_THROW_IF2(get<std::vector<std::string>>("valid-sets").size() !=
-          get<std::vector<std::string>>("train-sets").size(),
+        UTIL_THROW_IF2(get<std::vector<std::string>>("valid-sets").size() != streams,
           "There should be as many validation sets as training sets");
       }
     }
+    else if(has("cpu-threads") && get<size_t>("cpu-threads") > 0) {
+      // NthElement has no host implementation, CPU graphs decode greedily
+      UTIL_THROW_IF2(get<size_t>("beam-size") > 1,
+                     "--cpu-threads requires --beam-size 1");
+      UTIL_THROW_IF2(has("models")
+                     && get<std::vector<std::string>>("models").size() > 1,
+                     "--cpu-threads does not support ensembles of --models");
+    }
 }
 
 void Config::OutputRec(const YAML::Node node, YAML::Emitter& out) const {
@@ -138,10 +174,26 @@ void Config::addOptionsCommon(po::options_description& desc) {
      "Configuration file")
     ("workspace,w", po::value<size_t>()->default_value(2048),
       "Preallocate  arg  MB of work space")
+    ("allocator", po::value<std::string>()->default_value("sizeclass"),
+      "Work space allocation strategy (possible values: sizeclass, bestfit)")
+    ("workspace-limit", po::value<size_t>()->default_value(0),
+      "Never grow the work space beyond  arg  MB, training splits batches that do not "
+      "fit as on a full device (0 = no limit)")
     ("log", po::value<std::string>(),
      "Log training process information to file given by  arg")
+    ("log-queue", po::value<size_t>()->default_value(8192),
+     "Messages queued per log channel, written by a thread of the channel; info, memory and "
+     "data messages are dropped while the queue is full (power of 2, 0 = write synchronously)")
     ("seed", po::value<size_t>()->default_value(1234),
      "Seed for all random number generators")
+    ("data-threads", po::value<size_t>()->default_value(1),
+     "Tokenize and map text input to vocabulary ids and count words for new vocabularies with  arg  threads")
+    ("numa", po::value<bool>()->zero_tokens()->default_value(false),
+     "Bind the worker threads of every device, its pinned staging buffers and the data "
+     "reading threads to the CPUs of the NUMA node the device is attached to")
+    ("read-ahead", po::value<size_t>()->default_value(32),
+     "Read input files  arg  MB ahead in concurrent requests, for network filesystems "
+     "and http://, https:// or s3:// URLs")
     ("relative-paths", po::value<bool>()->zero_tokens()->default_value(false),
      "All paths are relative to the config file location")
     ("dump-config", po::value<bool>()->zero_tokens()->default_value(false),
@@ -164,6 +216,9 @@ void Config::addOptionsModel(po::options_description& desc, bool translate=false
       ->default_value(std::vector<int>({50000, 50000}), "50000 50000"),
       "Maximum items in vocabulary ordered by rank")
     ("dim-emb", po::value<int>()->default_value(512), "Size of embedding vector")
+    ("pad-dims", po::value<size_t>()->default_value(8),
+      "Store the output layer with a multiple of  arg  vocabulary columns for tensor core "
+      "GEMMs, the padding is masked and not saved (0 or 1 = off)")
     ("dim-rnn", po::value<int>()->default_value(1024), "Size of rnn hidden state")
     ("layers-enc", po::value<int>()->default_value(1), "Number of encoder layers")
     ("layers-dec", po::value<int>()->default_value(1), "Number of decoder layers")
@@ -171,6 +226,15 @@ void Config::addOptionsModel(po::options_description& desc, bool translate=false
      "Use skip connections")
     ("layer-normalization", po::value<bool>()->zero_tokens()->default_value(false),
      "Enable layer normalization")
+    ("att-window", po::value<size_t>()->default_value(0),
+     "Local attention: target word t attends to the  arg  source words around word t "
+     "instead of all of them, for long inputs (0 = global attention)")
+    ("tied-embeddings", po::value<bool>()->zero_tokens()->default_value(false),
+     "Use the target embeddings transposed as output layer weights, needs output layer "
+     "inputs of size --dim-emb")
+    ("tied-embeddings-all", po::value<bool>()->zero_tokens()->default_value(false),
+     "Share one embedding matrix between all encoders, the decoder and the output layer, "
+     "needs a shared vocabulary")
   ;
 
   if(!translate) {
@@ -194,12 +258,14 @@ void Config::addOptionsTraining(po::options_description& desc) {
     ("no-reload", po::value<bool>()->zero_tokens()->default_value(false),
       "Do not load existing model specified in --model arg")
     ("train-sets,t", po::value<std::vector<std::string>>()->multitoken(),
-      "Paths to training corpora: source target")
+      "Paths to training corpora: source target, or a single binary corpus created by marian-binarize")
     ("vocabs,v", po::value<std::vector<std::string>>()->multitoken(),
       "Paths to vocabulary files have to correspond to --trainsets. "
       "If this parameter is not supplied we look for vocabulary files "
       "source.{yml,json} and target.{yml,json}. "
       "If these files do not exists they are created.")
+    ("vocab-sample", po::value<size_t>()->default_value(0),
+      "Create missing vocabularies from the first  arg  lines of each training corpus only (0 = all lines)")
     ("max-length", po::value<size_t>()->default_value(50),
       "Maximum length of a sentence in a training sentence pair")
     ("after-epochs,e", po::value<size_t>()->default_value(0),
@@ -208,6 +274,9 @@ void Config::addOptionsTraining(po::options_description& desc) {
       "Finish after this many batch updates, 0 is infinity")
     ("disp-freq", po::value<size_t>()->default_value(1000),
       "Display information every  arg  updates")
+    ("data-stats", po::value<std::string>(),
+      "Append the data pipeline counters logged every --disp-freq updates to file  arg  "
+      "as tab-separated values")
     ("save-freq", po::value<size_t>()->default_value(10000),
       "Save model file every  arg  updates")
     ("no-shuffle", po::value<bool>()->zero_tokens()->default_value(false),
@@ -220,12 +289,191 @@ void Config::addOptionsTraining(po::options_description& desc) {
       "Size of mini-batch used during update")
     ("maxi-batch", po::value<int>()->default_value(100),
       "Number of batches to preload for length-based sorting")
+    ("mini-batch-words", po::value<size_t>()->default_value(0),
+      "Fill mini-batches up to  arg  source and target words including padding "
+      "instead of --mini-batch sentences (0 = off)")
+    ("shuffle-block", po::value<size_t>()->default_value(0),
+      "Shuffle blocks of  arg  consecutive sentences, then the sentences within each block, "
+      "for locality on very large corpora (0 = shuffle sentences freely)")
+    ("length-index", po::value<bool>()->zero_tokens()->default_value(false),
+      "Cache line offsets and lengths of uncompressed training files in <first file>.index "
+      "and read only sentences within --max-length")
+    ("sync-sgd", po::value<bool>()->zero_tokens()->default_value(false),
+      "Use synchronous SGD: all devices update together with the averaged gradient")
+    ("pipeline", po::value<bool>()->zero_tokens()->default_value(false),
+      "Pipeline model parallelism on two --devices: the encoder on the first, decoder and "
+      "output layer on the second (gnmt and dl4mt)")
+    ("pipeline-micro-batches", po::value<size_t>()->default_value(4),
+      "Split every batch into  arg  parts with --pipeline, so that both devices are busy")
+    ("cluster-nodes", po::value<size_t>()->default_value(1),
+      "Train with --sync-sgd on  arg  nodes, each started with the same options and its "
+      "own --cluster-rank. Every node reads its own part of the training data")
+    ("cluster-rank", po::value<size_t>()->default_value(0),
+      "Rank of this node with --cluster-nodes, node 0 saves the model")
+    ("cluster-master", po::value<std::string>()->default_value("localhost:6000"),
+      "host:port of node 0 with --cluster-nodes")
+    ("data-shards", po::value<size_t>()->default_value(1),
+      "Read the training data with  arg  independent readers over disjoint parts of the "
+      "shuffled corpus, each with its own batching and prefetching. "
+      "Requires a binary or an uncompressed text corpus")
+    ("prefetch", po::value<size_t>()->default_value(0),
+      "Read, sort and convert batches in a background thread, keeping up to  arg  of them ready "
+      "(0 = read on the training thread)")
+    ("stream-epochs", po::value<bool>()->zero_tokens()->default_value(false),
+      "Shuffle the corpus for the next epoch in the background during the current one and, "
+      "with --prefetch, batch its start ahead, so training does not stall between epochs. "
+      "Requires a single data shard")
+    ("data-processes", po::value<size_t>()->default_value(0),
+      "Read, sort and convert the training batches in  arg  separate processes over disjoint "
+      "parts of the shuffled corpus, which hand them over in shared memory "
+      "(0 = in the training process). Requires a binary or an uncompressed text corpus "
+      "and a single data shard")
+    ("data-ring-mb", po::value<size_t>()->default_value(256),
+      "Size of the shared memory for batches of --data-processes in MB")
     ("optimizer,o", po::value<std::string>()->default_value("adam"),
       "Optimization algorithm (possible values: sgd, adagrad, adam")
     ("learn-rate,l", po::value<double>()->default_value(0.0001),
       "Learning rate")
+    ("optimizer-offload", po::value<bool>()->zero_tokens()->default_value(false),
+      "Keep optimizer moments (Adam) in pinned host memory instead of on the device")
+    ("optimizer-states", po::value<std::string>()->default_value("fp32"),
+      "Storage of the optimizer moments (Adam): fp32, fp16 or int8, the latter two "
+      "blockwise scaled")
+    ("exponential-smoothing", po::value<double>()->default_value(0),
+      "Asynchronous training: keep a moving average of the parameters with decay  arg , "
+      "e.g. 0.9999, validate it and save it as model.smoothed.npz (0 = off)")
+    ("optimizer-delay", po::value<size_t>()->default_value(1),
+      "Accumulate gradients over  arg  batches per worker before each update, "
+      "for larger effective batches and less communication")
+    ("fetch-staleness", po::value<size_t>()->default_value(0),
+      "Asynchronous training: fetch a parameter shard before a batch only once it received "
+      "more than  arg  updates since the worker last fetched it")
+    ("staleness-scaling", po::value<bool>()->zero_tokens()->default_value(false),
+      "Asynchronous training: scale down the learning rate of gradients computed on "
+      "parameters that missed more shard updates than one per other worker plus "
+      "--fetch-staleness, by the expected over the actual number")
+    ("hogwild", po::value<bool>()->zero_tokens()->default_value(false),
+      "Asynchronous training: workers update and fetch the parameter shards themselves, "
+      "concurrently on their own streams, instead of queuing on the shard's thread; "
+      "requires dense fp32 gradients")
+    ("island-size", po::value<size_t>()->default_value(1),
+      "Asynchronous training: groups of  arg  consecutive devices, e.g. those sharing NVLink, "
+      "train synchronously and sum their gradients into the first, which fetches and "
+      "pushes them as a single asynchronous worker")
+    ("comm-fp16", po::value<bool>()->zero_tokens()->default_value(false),
+      "Send parameters and gradients between devices in fp16, gradients with error feedback "
+      "of the rounding; asynchronous training sends dropped and sparse gradients in fp32")
     ("clip-norm", po::value<double>()->default_value(1.f),
       "Clip gradient norm to  arg  (0 to disable)")
+    ("freeze", po::value<std::vector<std::string>>()->multitoken(),
+      "Keep the parameters matching the name patterns  arg , e.g. encoder_*, fixed; "
+      "they get no gradients, optimizer state or shard traffic")
+    ("managed-params", po::value<std::vector<std::string>>()->multitoken(),
+      "Keep the parameters matching the name patterns  arg , e.g. Wemb*, and their gradients "
+      "in host memory managed by CUDA, moving the rows of each batch's words to the device, "
+      "for embeddings larger than the device; combine with --optimizer-offload")
+    ("grad-buckets", po::value<size_t>()->default_value(0),
+      "Asynchronous training: send gradients to the parameter shards in buckets of  arg  MB "
+      "as soon as backward has finished them (0 = after backward)")
+    ("grad-dropping-rate", po::value<double>()->default_value(0),
+      "Asynchronous training: keep back the fraction  arg  of smallest gradient entries "
+      "in a residual and send the others as sparse updates, e.g. 0.99 (0 = dense)")
+    ("sparse-embeddings", po::value<bool>()->zero_tokens()->default_value(false),
+      "Asynchronous training: send and update only the parameters a batch used, of embeddings "
+      "only the rows of its words, Adam moments of the other rows are not decayed")
+    ("prune-sparsity", po::value<float>()->default_value(0),
+      "Zero the fraction  arg  of smallest weights of every matrix except embeddings by "
+      "gradual magnitude pruning, pruned weights stay zero (0 = off)")
+    ("prune-start", po::value<size_t>()->default_value(0),
+      "Update at which pruning starts")
+    ("prune-end", po::value<size_t>()->default_value(10000),
+      "Update at which the pruned fraction reaches --prune-sparsity")
+    ("prune-freq", po::value<size_t>()->default_value(100),
+      "Prune every  arg  updates between --prune-start and --prune-end")
+    ("device-share", po::value<float>()->default_value(1.f),
+     "Limit the forward passes of training to this fraction of the wall time, e.g. for "
+     "one of several trainings sharing a device through marian-multi (1 = no limit)")
+    ("memory-plan", po::value<bool>()->zero_tokens()->default_value(false),
+      "Plan workspace offsets from tensor lifetimes before each batch to reuse memory")
+    ("output-shards", po::value<size_t>()->default_value(1),
+      "Compute output layer and cross-entropy in  arg  slices of the target vocabulary "
+      "without holding all logits, for large vocabularies (1 = off)")
+    ("output-chunks", po::value<size_t>()->default_value(1),
+      "Compute output layer and cross-entropy in  arg  blocks of target positions, "
+      "forward and backward, without holding all logits, for long targets (1 = off)")
+    ("output-samples", po::value<size_t>()->default_value(0),
+      "Train with a sampled softmax over the target words of each batch and  arg  shared "
+      "negatives from a log-uniform proposal, validation and decoding use the full softmax "
+      "(0 = off)")
+    ("gradient-checkpointing", po::value<std::string>()->default_value("none"),
+      "Recompute activations inside RNN layers during backward instead of keeping them "
+      "(possible values: none, layer, step)")
+    ("fp16", po::value<bool>()->zero_tokens()->default_value(false),
+      "Run matrix products in fp16 with fp32 accumulation and dynamic loss scaling")
+    ("loss-scale", po::value<double>()->default_value(32768),
+      "Initial loss scale for --fp16, adjusted automatically on overflow")
+    ("fuse-elementwise", po::value<bool>()->zero_tokens()->default_value(false),
+      "Merge chains of elementwise operations into single kernels")
+    ("dry-run", po::value<std::vector<size_t>>()->multitoken(),
+      "Log the estimated device memory for a batch of  arg  sentences, optionally followed "
+      "by one length per input stream (default: max-length), and exit without training")
+    ("bench-steps", po::value<size_t>()->default_value(100),
+      "Number of timed steps of marian_bench_train")
+    ("bench-length", po::value<std::vector<float>>()->multitoken(),
+      "Mean and standard deviation of the synthetic sentence lengths of "
+      "marian_bench_train (default: half and a quarter of max-length)")
+    ("bench-beam-size", po::value<size_t>()->default_value(12),
+      "Beam size of the decoding pass of marian_bench_train, on the randomly initialized "
+      "model (0 = no decoding pass)")
+    ("bench-mini-batches", po::value<std::vector<int>>()->multitoken(),
+      "Values of --mini-batch timed by marian_bench_data (default: --mini-batch)")
+    ("bench-maxi-batches", po::value<std::vector<int>>()->multitoken(),
+      "Values of --maxi-batch timed by marian_bench_data (default: --maxi-batch)")
+    ("bench-batch-words", po::value<std::vector<int>>()->multitoken(),
+      "Values of --mini-batch-words timed by marian_bench_data (default: --mini-batch-words)")
+    ("bench-data-batches", po::value<size_t>()->default_value(0),
+      "Batches per configuration of marian_bench_data (0 = one epoch)")
+    ("mini-batch-fit", po::value<bool>()->zero_tokens()->default_value(false),
+      "Set --mini-batch to the largest number of sentences of --max-length that fits "
+      "into the free memory of the first device, estimated before training")
+    ("adjoint-arena", po::value<bool>()->zero_tokens()->default_value(false),
+      "Keep all gradients of a batch in one buffer cleared at once, uses more memory. "
+      "Has no effect together with memory planning")
+    ("persistent-rnn", po::value<bool>()->zero_tokens()->default_value(false),
+      "Run the recurrence of GRU encoder layers over all timesteps in a single kernel. "
+      "Not used with layer normalization or dropout of the state")
+    ("embedding-hot-rows", po::value<size_t>()->default_value(0),
+      "Keep the embeddings of the  arg  most frequent words, the first ids of a "
+      "frequency-ordered vocabulary, persisting in L2 during lookups (0 = off, needs CUDA 11)")
+    ("autotune", po::value<std::string>()->default_value(""),
+      "Benchmark block sizes of softmax, layer normalization, attention and cross-entropy "
+      "kernels on first use per shape class and cache the winners in file  arg ")
+    ("gemm-autotune", po::value<bool>()->zero_tokens()->default_value(false),
+      "Benchmark the cuBLASLt algorithms of every matrix product shape on first use "
+      "and keep the fastest (needs CUDA 10.1)")
+    ("gemm-autotune-cache", po::value<std::string>()->default_value(""),
+      "With --gemm-autotune, cache the winners per GPU model in file  arg ")
+    ("graphs-per-device", po::value<size_t>()->default_value(1),
+      "Asynchronous training: build graphs for  arg  batches per device concurrently, "
+      "the host prepares the next batch while the device runs the current one. "
+      "Each graph has its own workspace")
+    ("streams", po::value<size_t>()->default_value(1),
+      "Run independent nodes of the forward pass concurrently on up to  arg  CUDA streams per device")
+    ("cuda-graphs", po::value<bool>()->zero_tokens()->default_value(false),
+      "Record forward and backward kernels into CUDA graphs per batch shape and replay them, "
+      "implies --memory-plan")
+    ("memory-trace", po::value<std::string>()->default_value(""),
+      "Write a per-node allocation timeline to  arg  (suffixed with the device id for several devices)")
+    ("profile", po::value<size_t>()->default_value(0),
+      "Time every node over the first  arg  batches and log the most expensive node types")
+    ("profile-trace", po::value<std::string>()->default_value(""),
+      "Write the timings of --profile as Chrome trace to  arg  (suffixed with the device id for several devices)")
+    ("metrics-file", po::value<std::string>()->default_value(""),
+      "Rewrite  arg  every --disp-freq batches with the throughput, step times and memory "
+      "of every worker and device in the Prometheus text format, e.g. for a node exporter")
+    ("trace", po::value<std::string>()->default_value(""),
+      "Write the phases of the training loop, e.g. batch fetch, forward, pushGradients, "
+      "shard updates and lock waits, per thread as Chrome trace to  arg ")
   ;
   desc.add(training);
 }
@@ -237,19 +485,37 @@ void Config::addOptionsValid(po::options_description& desc) {
       "Paths to validation corpora: source target")
     ("valid-freq", po::value<size_t>()->default_value(10000),
       "Validate model every  arg  updates")
+    ("valid-mini-batch", po::value<int>()->default_value(128),
+      "Size of validation mini-batches, sorted by length and kept in memory")
     ("valid-metrics", po::value<std::vector<std::string>>()
       ->multitoken()
       ->default_value(std::vector<std::string>({"cross-entropy"}),
                       "cross-entropy"),
-      "Metric to use during validation: cross-entropy, perplexity, valid-script. "
+      "Metric to use during validation: cross-entropy, perplexity, valid-script, bleu. "
       "Multiple metrics can be specified")
     ("valid-script-path", po::value<std::string>(),
      "Path to external validation script")
+    ("valid-beam-size", po::value<size_t>()->default_value(4),
+     "Beam size of --valid-metrics bleu, which translates the validation set in process")
+    ("valid-max-length-factor", po::value<float>()->default_value(1.5),
+     "Maximum length of --valid-metrics bleu translations as a multiple of the longest "
+     "source sentence of their batch")
+    ("valid-shortlist", po::value<std::vector<std::string>>()->multitoken(),
+     "Shortlist of --valid-metrics bleu: lexical table, see --shortlist of marian_translate, "
+     "optionally followed by the numbers of best translations per source word and of "
+     "frequent target words (default: 100 1000)")
     ("early-stopping", po::value<size_t>()->default_value(10),
      "Stop if the first validation metric does not improve for  arg  consecutive "
      "validation steps")
     ("valid-log", po::value<std::string>(),
      "Log validation scores to file given by  arg")
+    ("valid-async", po::value<bool>()->zero_tokens()->default_value(false),
+     "Validate a copy of the parameters on a separate low-priority graph while training continues")
+    ("valid-device", po::value<int>()->default_value(-1),
+     "Device for --valid-async validation (-1 = device of the validated graph)")
+    ("valid-share", po::value<float>()->default_value(1.f),
+     "Limit --valid-async validation to this fraction of the wall time, pausing between "
+     "its passes, to bound its cost to training on a shared device (1 = no limit)")
   ;
   desc.add(valid);
 }
@@ -258,7 +524,7 @@ void Config::addOptionsTranslate(po::options_description& desc) {
   po::options_description translate("Translator options");
   translate.add_options()
     ("inputs,i", po::value<std::vector<std::string>>()->multitoken(),
-      "Paths to input files")
+      "Paths to input files, stdin if omitted or \"-\"")
     ("vocabs,v", po::value<std::vector<std::string>>()->multitoken(),
       "Paths to vocabulary files have to correspond to --inputs.")
     ("max-length", po::value<size_t>()->default_value(1000),
@@ -267,10 +533,121 @@ void Config::addOptionsTranslate(po::options_description& desc) {
       ->multitoken()
       ->default_value(std::vector<int>({0}), "0"),
       "GPUs to use for translating.")
-    ("mini-batch", po::value<int>()->default_value(1),
-      "Size of mini-batch used during update")
-    ("maxi-batch", po::value<int>()->default_value(1),
-      "Number of batches to preload for length-based sorting")
+    ("graphs-per-device", po::value<size_t>()->default_value(1),
+      "Number of translators per device, each with its own graph and stream")
+    ("cpu-threads", po::value<size_t>()->default_value(0),
+      "Translate on the CPU instead of --devices with  arg  decoder threads, each with "
+      "its own graph sharing the parameters of the first (0 = translate on GPUs). "
+      "Requires --beam-size 1 and a single --model")
+    ("cpu-intra-threads", po::value<size_t>()->default_value(1),
+      "Threads per CPU decoder thread within matrix products and softmax, for the "
+      "latency of single requests. A threaded BLAS should be limited to one thread")
+    ("cpu-affinity", po::value<bool>()->zero_tokens()->default_value(false),
+      "Bind CPU decoder thread  i  and its intra-op threads to the cores from "
+      "i * cpu-intra-threads on")
+    ("output-threads", po::value<size_t>()->default_value(2),
+      "Number of threads turning translated batches into output lines")
+    ("word-scores", po::value<bool>()->zero_tokens()->default_value(false),
+      "marian_score: also print the log-probability of every target word")
+    ("share-sources", po::value<bool>()->zero_tokens()->default_value(false),
+      "marian_score: batch the pairs of equal sources together and encode each source "
+      "once per batch, e.g. for the candidates of n-best lists")
+    ("streams", po::value<size_t>()->default_value(1),
+      "Run independent nodes of each decoding step concurrently on up to  arg  CUDA streams, "
+      "e.g. the encoders and attentions of multi-source models")
+    ("models", po::value<std::vector<std::string>>()->multitoken(),
+      "Paths to the models of an ensemble sharing one beam, replaces --model")
+    ("weights", po::value<std::vector<float>>()->multitoken(),
+      "Weights of the ensemble models' log-probabilities (default: 1 each)")
+    ("mini-batch", po::value<int>()->default_value(16),
+      "Number of sentences translated together, each with its own beam")
+    ("maxi-batch", po::value<int>()->default_value(100),
+      "Number of batches to preload for length-based sorting, output keeps the input order")
+    ("beam-size,b", po::value<size_t>()->default_value(12),
+      "Beam size used during search, 1 selects greedy decoding")
+    ("int8", po::value<bool>()->zero_tokens()->default_value(false),
+      "Quantize the weights of matrix products to int8 with per-column scales")
+    ("block-sparse", po::value<float>()->default_value(0),
+      "Run products with pruned weights whose fraction of nonzero 16x16 blocks is at most  arg  "
+      "as block-sparse GEMMs, see --prune-sparsity (0 = off)")
+    ("half-context", po::value<bool>()->zero_tokens()->default_value(false),
+      "Keep the encoder context and its attention projections in fp16 during decoding, "
+      "halving the memory and bandwidth of attention (GPU, needs CUDA 9)")
+    ("gemm-autotune", po::value<bool>()->zero_tokens()->default_value(false),
+      "Benchmark the cuBLASLt algorithms of every matrix product shape on first use "
+      "and keep the fastest, e.g. for beam x vocabulary products (needs CUDA 10.1)")
+    ("gemm-autotune-cache", po::value<std::string>()->default_value(""),
+      "With --gemm-autotune, cache the winners per GPU model in file  arg ")
+    ("max-length-factor", po::value<float>()->default_value(3),
+      "Maximum length of a translation as a multiple of the longest source sentence of its batch")
+    ("beam-threshold", po::value<float>()->default_value(0),
+      "Drop hypotheses whose cost is more than this below the best one of their sentence (0 = off)")
+    ("beam-max-per-parent", po::value<size_t>()->default_value(0),
+      "Maximum number of hypotheses extending the same hypothesis (0 = off)")
+    ("replay-steps", po::value<bool>()->zero_tokens()->default_value(false),
+      "Keep the nodes of a decoder step and run them again for later steps of the same "
+      "beam width instead of building the step anew, until a sentence of the batch finishes")
+    ("shortlist", po::value<std::string>(),
+      "Lexical table with lines \"source target probability\", restricts the output "
+      "layer to the candidate translations of each batch")
+    ("shortlist-best", po::value<size_t>()->default_value(100),
+      "Number of most probable translations per source word in the shortlist")
+    ("shortlist-frequent", po::value<size_t>()->default_value(1000),
+      "Number of most frequent target words always in the shortlist")
+    ("port,p", po::value<size_t>()->default_value(8080),
+      "Port of the translation server")
+    ("max-wait", po::value<size_t>()->default_value(10),
+      "Milliseconds the translation server waits for a batch to fill")
+    ("max-tokens", po::value<size_t>()->default_value(4096),
+      "Maximum number of source tokens per batch of the translation server")
+    ("bulk-port", po::value<size_t>()->default_value(0),
+      "Port of the translation server for bulk requests, batched after all waiting "
+      "interactive requests of --port (0 = none)")
+    ("bulk-max-wait", po::value<size_t>()->default_value(200),
+      "Milliseconds the translation server waits for a batch of bulk requests to fill")
+    ("bulk-mini-batch", po::value<size_t>()->default_value(0),
+      "Maximum number of sentences per batch of bulk requests (0 = mini-batch)")
+    ("slo", po::value<size_t>()->default_value(0),
+      "Milliseconds interactive requests may wait in the queue, later ones are "
+      "translated with --shed-beam-size and rejected beyond twice the wait (0 = no limit)")
+    ("bulk-slo", po::value<size_t>()->default_value(0),
+      "As --slo for bulk requests")
+    ("shed-beam-size", po::value<size_t>()->default_value(1),
+      "Beam size of requests shed by an overloaded translation server")
+    ("shed-shortlist", po::value<std::string>(),
+      "Shortlist of requests shed by an overloaded translation server (default: shortlist)")
+    ("stream-partial", po::value<bool>()->zero_tokens()->default_value(false),
+      "Send the translation server's clients the prefix of a translation all beam "
+      "hypotheses agree on as it grows, in lines \"PARTIAL ||| words\"")
+    ("metrics-file", po::value<std::string>(),
+      "File the translation server rewrites every 5s with queue depths, request counts, "
+      "queue waits and latencies in the Prometheus text format")
+    ("cache-size", po::value<size_t>()->default_value(0),
+      "Megabytes of translations cached by the translation server (0 = no cache)")
+    ("cache-file", po::value<std::string>(),
+      "File the translation cache is warmed from and written to")
+    ("prefix-cache-size", po::value<size_t>()->default_value(256),
+      "Megabytes of encoder and decoder states the translation server keeps per session "
+      "for requests continuing a target prefix (0 = recompute every request)")
+    ("reload-interval", po::value<size_t>()->default_value(0),
+      "Seconds between checks of the translation server for a changed model, "
+      "which is then loaded in the background and swapped in (0 = never)")
+    ("benchmark", po::value<bool>()->zero_tokens()->default_value(false),
+      "Time the translation of the input for every combination of the bench-* lists "
+      "instead of writing translations, results are written as JSON")
+    ("bench-beam-sizes", po::value<std::vector<size_t>>()->multitoken(),
+      "Beam sizes of --benchmark (default: beam-size)")
+    ("bench-batch-sizes", po::value<std::vector<int>>()->multitoken(),
+      "Batch sizes in sentences of --benchmark (default: mini-batch)")
+    ("bench-length-factors", po::value<std::vector<float>>()->multitoken(),
+      "Maximum output lengths of --benchmark as multiples of the source length "
+      "(default: max-length-factor)")
+    ("job-dir", po::value<std::string>(),
+      "Translate the input as a resumable bulk job, writing the translations of every "
+      "--job-chunk lines to a file of its own in directory  arg  with the finished chunks "
+      "listed in  arg/progress , a restarted job skips them")
+    ("job-chunk", po::value<size_t>()->default_value(100000),
+      "Input lines per output file of --job-dir")
   ;
   desc.add(translate);
 }
@@ -329,11 +706,15 @@ void Config::addOptions(int argc, char** argv,
   SET_OPTION("type", std::string);
   SET_OPTION("dim-vocabs", std::vector<int>);
   SET_OPTION("dim-emb", int);
+  SET_OPTION("pad-dims", size_t);
   SET_OPTION("dim-rnn", int);
   SET_OPTION("layers-enc", int);
   SET_OPTION("layers-dec", int);
   SET_OPTION("skip", bool);
   SET_OPTION("layer-normalization", bool);
+  SET_OPTION("att-window", size_t);
+  SET_OPTION("tied-embeddings", bool);
+  SET_OPTION("tied-embeddings-all", bool);
   if(!translate) {
     SET_OPTION("dropout-rnn", float);
     SET_OPTION("dropout-src", float);
@@ -344,6 +725,21 @@ void Config::addOptions(int argc, char** argv,
   /** training **/
   if(!translate) {
     SET_OPTION("overwrite", bool);
+    SET_OPTION("vocab-sample", size_t);
+    SET_OPTION("mini-batch-words", size_t);
+    SET_OPTION("shuffle-block", size_t);
+    SET_OPTION("length-index", bool);
+    SET_OPTION("sync-sgd", bool);
+    SET_OPTION("pipeline", bool);
+    SET_OPTION("pipeline-micro-batches", size_t);
+    SET_OPTION("cluster-nodes", size_t);
+    SET_OPTION("cluster-rank", size_t);
+    SET_OPTION("cluster-master", std::string);
+    SET_OPTION("data-shards", size_t);
+    SET_OPTION("prefetch", size_t);
+    SET_OPTION("stream-epochs", bool);
+    SET_OPTION("data-processes", size_t);
+    SET_OPTION("data-ring-mb", size_t);
     SET_OPTION("no-reload", bool);
     if (!vm_["train-sets"].empty()) {
       config_["train-sets"] = vm_["train-sets"].as<std::vector<std::string>>();
@@ -351,12 +747,63 @@ void Config::addOptions(int argc, char** argv,
     SET_OPTION("after-epochs", size_t);
     SET_OPTION("after-batches", size_t);
     SET_OPTION("disp-freq", size_t);
+    SET_OPTION_NONDEFAULT("data-stats", std::string);
     SET_OPTION("save-freq", size_t);
     SET_OPTION("no-shuffle", bool);
 
     SET_OPTION("optimizer", std::string);
     SET_OPTION("learn-rate", double);
+    SET_OPTION("optimizer-offload", bool);
+    SET_OPTION("optimizer-states", std::string);
+    SET_OPTION("exponential-smoothing", double);
+    SET_OPTION("optimizer-delay", size_t);
+    SET_OPTION("fetch-staleness", size_t);
+    SET_OPTION("staleness-scaling", bool);
+    SET_OPTION("hogwild", bool);
+    SET_OPTION("island-size", size_t);
+    SET_OPTION("comm-fp16", bool);
     SET_OPTION("clip-norm", double);
+    SET_OPTION_NONDEFAULT("freeze", std::vector<std::string>);
+    SET_OPTION_NONDEFAULT("managed-params", std::vector<std::string>);
+    SET_OPTION("grad-buckets", size_t);
+    SET_OPTION("grad-dropping-rate", double);
+    SET_OPTION("sparse-embeddings", bool);
+    SET_OPTION("prune-sparsity", float);
+    SET_OPTION("prune-start", size_t);
+    SET_OPTION("prune-end", size_t);
+    SET_OPTION("prune-freq", size_t);
+    SET_OPTION("device-share", float);
+    SET_OPTION("memory-plan", bool);
+    SET_OPTION("output-shards", size_t);
+    SET_OPTION("output-chunks", size_t);
+    SET_OPTION("output-samples", size_t);
+    SET_OPTION("gradient-checkpointing", std::string);
+    SET_OPTION("fp16", bool);
+    SET_OPTION("loss-scale", double);
+    SET_OPTION("fuse-elementwise", bool);
+    SET_OPTION("adjoint-arena", bool);
+    SET_OPTION("persistent-rnn", bool);
+    SET_OPTION("embedding-hot-rows", size_t);
+    SET_OPTION("autotune", std::string);
+    SET_OPTION("gemm-autotune", bool);
+    SET_OPTION("gemm-autotune-cache", std::string);
+    SET_OPTION_NONDEFAULT("dry-run", std::vector<size_t>);
+    SET_OPTION("bench-steps", size_t);
+    SET_OPTION_NONDEFAULT("bench-length", std::vector<float>);
+    SET_OPTION("bench-beam-size", size_t);
+    SET_OPTION_NONDEFAULT("bench-mini-batches", std::vector<int>);
+    SET_OPTION_NONDEFAULT("bench-maxi-batches", std::vector<int>);
+    SET_OPTION_NONDEFAULT("bench-batch-words", std::vector<int>);
+    SET_OPTION("bench-data-batches", size_t);
+    SET_OPTION("mini-batch-fit", bool);
+    SET_OPTION("graphs-per-device", size_t);
+    SET_OPTION("streams", size_t);
+    SET_OPTION("cuda-graphs", bool);
+    SET_OPTION("memory-trace", std::string);
+    SET_OPTION("profile", size_t);
+    SET_OPTION("profile-trace", std::string);
+    SET_OPTION("trace", std::string);
+    SET_OPTION("metrics-file", std::string);
   }
   /** training **/
   else {
@@ -372,13 +819,70 @@ void Config::addOptions(int argc, char** argv,
     }
     SET_OPTION_NONDEFAULT("valid-sets", std::vector<std::string>);
     SET_OPTION("valid-freq", size_t);
+    SET_OPTION("valid-mini-batch", int);
     SET_OPTION("valid-metrics", std::vector<std::string>);
     SET_OPTION_NONDEFAULT("valid-script-path", std::string);
+    SET_OPTION("valid-beam-size", size_t);
+    SET_OPTION("valid-max-length-factor", float);
+    SET_OPTION_NONDEFAULT("valid-shortlist", std::vector<std::string>);
     SET_OPTION("early-stopping", size_t);
     SET_OPTION_NONDEFAULT("valid-log", std::string);
+    SET_OPTION("valid-async", bool);
+    SET_OPTION("valid-device", int);
+    SET_OPTION("valid-share", float);
   }
   /** valid **/
 
+  /** translate **/
+  if(translate) {
+    SET_OPTION("graphs-per-device", size_t);
+    SET_OPTION("cpu-threads", size_t);
+    SET_OPTION("cpu-intra-threads", size_t);
+    SET_OPTION("cpu-affinity", bool);
+    SET_OPTION("output-threads", size_t);
+    SET_OPTION("word-scores", bool);
+    SET_OPTION("share-sources", bool);
+    SET_OPTION("streams", size_t);
+    SET_OPTION("beam-size", size_t);
+    SET_OPTION("max-length-factor", float);
+    SET_OPTION("beam-threshold", float);
+    SET_OPTION("int8", bool);
+    SET_OPTION("block-sparse", float);
+    SET_OPTION("half-context", bool);
+    SET_OPTION("gemm-autotune", bool);
+    SET_OPTION("gemm-autotune-cache", std::string);
+    SET_OPTION("beam-max-per-parent", size_t);
+    SET_OPTION("replay-steps", bool);
+    SET_OPTION_NONDEFAULT("models", std::vector<std::string>);
+    SET_OPTION_NONDEFAULT("weights", std::vector<float>);
+    SET_OPTION_NONDEFAULT("shortlist", std::string);
+    SET_OPTION("shortlist-best", size_t);
+    SET_OPTION("shortlist-frequent", size_t);
+    SET_OPTION("port", size_t);
+    SET_OPTION("max-wait", size_t);
+    SET_OPTION("max-tokens", size_t);
+    SET_OPTION("bulk-port", size_t);
+    SET_OPTION("bulk-max-wait", size_t);
+    SET_OPTION("bulk-mini-batch", size_t);
+    SET_OPTION("slo", size_t);
+    SET_OPTION("bulk-slo", size_t);
+    SET_OPTION("shed-beam-size", size_t);
+    SET_OPTION_NONDEFAULT("shed-shortlist", std::string);
+    SET_OPTION("stream-partial", bool);
+    SET_OPTION_NONDEFAULT("metrics-file", std::string);
+    SET_OPTION("cache-size", size_t);
+    SET_OPTION_NONDEFAULT("cache-file", std::string);
+    SET_OPTION("prefix-cache-size", size_t);
+    SET_OPTION("reload-interval", size_t);
+    SET_OPTION("benchmark", bool);
+    SET_OPTION_NONDEFAULT("bench-beam-sizes", std::vector<size_t>);
+    SET_OPTION_NONDEFAULT("bench-batch-sizes", std::vector<int>);
+    SET_OPTION_NONDEFAULT("bench-length-factors", std::vector<float>);
+    SET_OPTION_NONDEFAULT("job-dir", std::string);
+    SET_OPTION("job-chunk", size_t);
+  }
+  /** translate **/
+
   if(doValidate) {
     try {
       validate(translate);
@@ -393,8 +897,14 @@ void Config::addOptions(int argc, char** argv,
   }
   
   SET_OPTION("workspace", size_t);
+  SET_OPTION("allocator", std::string);
+  SET_OPTION("workspace-limit", size_t);
   SET_OPTION_NONDEFAULT("log", std::string);
+  SET_OPTION("log-queue", size_t);
   SET_OPTION("seed", size_t);
+  SET_OPTION("data-threads", size_t);
+  SET_OPTION("numa", bool);
+  SET_OPTION("read-ahead", size_t);
   SET_OPTION("relative-paths", bool);
   SET_OPTION("devices", std::vector<int>);
   SET_OPTION("mini-batch", int);
@@ -410,6 +920,9 @@ void Config::addOptions(int argc, char** argv,
     exit(0);
   }
   seed = vm_["seed"].as<size_t>();
+  numa::enable(get<bool>("numa"));
+  io::setReadAhead(get<size_t>("read-ahead"));
+  refresh();
 }
 
 void Config::log() {
@@ -8,6 +8,26 @@
 
 namespace marian {
 
+/**
+ * @brief Options read for every batch, converted from the YAML config once
+ * instead of on each access, see Config::snapshot(). Options that do not
+ * exist in the current mode keep their defaults.
+ */
+struct OptionSnapshot {
+  int miniBatch{0};
+  int maxiBatch{0};
+  size_t miniBatchWords{0};
+
+  size_t dispFreq{1};
+  size_t saveFreq{0};
+  size_t validFreq{0};
+  bool validAsync{false};
+
+  size_t afterEpochs{0};
+  size_t afterBatches{0};
+  size_t earlyStopping{0};
+};
+
 class Config {
   public:
 
@@ -29,8 +49,17 @@ class Config {
     }
 
     const YAML::Node& get() const;
+
+    /** @brief The YAML config to change, call refresh() afterwards */
     YAML::Node& get();
 
+    const OptionSnapshot& snapshot() const {
+      return snapshot_;
+    }
+
+    /** @brief Converts the options of snapshot() again, after changes of the YAML config */
+    void refresh();
+
     YAML::Node operator[](const std::string& key) const {
       return get(key);
     }
@@ -68,6 +97,7 @@ class Config {
     boost::program_options::options_description cmdline_options_;
     std::string inputPath;
     YAML::Node config_;
+    OptionSnapshot snapshot_;
 };
 
 }
@@ -0,0 +1,73 @@
+#pragma once
+
+#include "common/definitions.h"
+#include "graph/chainable.h"
+#include "tensors/tensor_allocator.h"
+#include "kernels/tensor_operators.h"
+#include "kernels/thrust_functions.h"
+
+namespace marian {
+
+/**
+ * @brief Sums the costs of consecutive batches on the device.
+ *
+ * add() only enqueues a kernel behind the forward pass, so the host does not
+ * wait for the cost of every batch. read() copies the sum back, the single
+ * synchronization, and is meant to be called once per report. Not thread-safe:
+ * every worker owns the accumulator of its graph.
+ */
+class CostAccumulator {
+  private:
+    Ptr<TensorAllocator> allocator_;
+    Tensor memory_;
+    Tensor sum_;
+    Tensor batch_;
+    size_t batches_{0};
+
+  public:
+    CostAccumulator(size_t device)
+     : allocator_(New<TensorAllocator>(device)) {
+      allocator_->reserveExact(2);
+      allocator_->allocate(memory_, {1, 2});
+      memory_->set(0);
+      sum_ = memory_->subtensor(0, 1);
+      batch_ = memory_->subtensor(1, 1);
+    }
+
+    /** @brief Adds the value of the scalar node  cost  */
+    void add(Expr cost) {
+      Element(_1 += _2, sum_, cost->val());
+      batches_++;
+    }
+
+    /** @brief Adds  weight  times the cost of a part of a batch, see commit() */
+    void add(Expr cost, float weight) {
+      Element(_1 += weight * _2, batch_, cost->val());
+    }
+
+    /** @brief Counts the parts added since the last commit() or discard() as one batch */
+    void commit() {
+      Element(_1 += _2, sum_, batch_);
+      batch_->set(0);
+      batches_++;
+    }
+
+    void discard() {
+      batch_->set(0);
+    }
+
+    /** @brief Batches added since the last read() */
+    size_t batches() {
+      return batches_;
+    }
+
+    /** @brief Returns the sum since the last read() and resets it */
+    float read() {
+      float sum = sum_->get(0);
+      sum_->set(0);
+      batches_ = 0;
+      return sum;
+    }
+};
+
+}
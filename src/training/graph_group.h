@@ -1,17 +1,344 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <sstream>
 #include <thread>
 #include <future>
 #include <boost/filesystem.hpp>
 
 #include "common/definitions.h"
-#include "3rd_party/threadpool.h"
+#include "common/numa.h"
+#include "common/trace.h"
+#include "common/thread_pool.h"
+#include "data/pipeline_stats.h"
+#include "kernels/gradient_dropping.h"
+#include "kernels/half_comm.h"
+#include "kernels/ranges.h"
 #include "optimizers/optimizers.h"
+#include "training/checkpointer.h"
+#include "training/cluster.h"
 #include "training/training.h"
 #include "training/validator.h"
+#include "training/loss_scaler.h"
+#include "training/cost_accumulator.h"
 
 namespace marian {
 
+inline allocation allocationStrategy(Ptr<Config> options) {
+  auto name = options->get<std::string>("allocator");
+  UTIL_THROW_IF2(name != "sizeclass" && name != "bestfit",
+                 "Unknown allocation strategy: " << name);
+  return name == "bestfit" ? allocation::bestfit : allocation::sizeclass;
+}
+
+/**
+ * @brief Throttles the forward passes of  graph  to --device-share of the wall
+ * time on a low-priority stream, for trainings that share a device
+ */
+inline void shareDevice(ExpressionGraphPtr graph, Ptr<Config> options) {
+  float share = options->get<float>("device-share");
+  if(share < 1.f)
+    graph->setPriority(priority::low, share);
+}
+
+inline checkpoints checkpointGranularity(Ptr<Config> options) {
+  auto name = options->get<std::string>("gradient-checkpointing");
+  UTIL_THROW_IF2(name != "none" && name != "layer" && name != "step",
+                 "Unknown checkpointing granularity: " << name);
+  if(name == "step")
+    return checkpoints::step;
+  return name == "layer" ? checkpoints::layer : checkpoints::none;
+}
+
+/**
+ * @brief Factor of gradients sent in fp16, see --comm-fp16. Without loss
+ * scaling their small magnitudes would lose precision or underflow in fp16.
+ */
+inline float commScale(Ptr<Config> options) {
+  return options->get<bool>("fp16") ? 1.f : 1024.f;
+}
+
+/** @brief Batches after which each of  workers  reads back its summed cost, so that reports see all shares */
+inline size_t reportInterval(Ptr<Config> options, size_t workers) {
+  return std::max((size_t)1, options->snapshot().dispFreq / std::max((size_t)1, workers));
+}
+
+/**
+ * @brief Output file given by  option  for graph  copy  on  device , suffixed with
+ * the device id (and copy) when training with several graphs
+ */
+inline std::string deviceFile(Ptr<Config> options, const std::string& option,
+                              size_t device, size_t copy = 0) {
+  auto file = options->get<std::string>(option);
+  if(file.empty()
+     || (options->get<std::vector<size_t>>("devices").size() == 1 && copy == 0
+         && options->get<size_t>("graphs-per-device") == 1))
+    return file;
+  file += "." + std::to_string(device);
+  if(copy > 0)
+    file += "-" + std::to_string(copy);
+  return file;
+}
+
+/**
+ * @brief Peak workspace in MB per device of --devices over all  graphs  on it,
+ * saved with the model for reserveWorkspace()
+ */
+inline std::vector<size_t> workspacePeaks(Ptr<Config> options,
+                                          const std::vector<Ptr<ExpressionGraph>>& graphs) {
+  auto devices = options->get<std::vector<size_t>>("devices");
+  std::vector<size_t> peaks(devices.size(), 0);
+  for(auto graph : graphs) {
+    size_t i = std::find(devices.begin(), devices.end(), graph->getDevice()) - devices.begin();
+    if(i < peaks.size())
+      peaks[i] = std::max(peaks[i], graph->workspacePeakMB());
+  }
+  return peaks;
+}
+
+/**
+ * @brief Forward and backward pass over  batch  that survives running out of device memory.
+ *
+ * On an OutOfMemoryException the batch is split into twice as many parts and
+ * processed part by part. Parameter gradients are accumulated over the parts,
+ * the loss of each weighted by its share of the sentences, so the caller applies
+ * a single update as for the whole batch. prepare(graph) is called after the
+ * graph of the first part has been built, e.g. to fetch parameters. Gives up
+ * once the batch cannot be split any further.
+ *
+ * With  accumulate  the gradients of the whole batch are added to those already
+ * in the graph, see --optimizer-delay. A backward pass that runs out of memory
+ * half-way may then leave partial gradients behind, but out of memory errors
+ * almost always happen during the forward pass.
+ */
+template <class Builder, class Prepare>
+void resilientStep(Ptr<ExpressionGraph> graph,
+                   Ptr<Builder> builder,
+                   Ptr<data::CorpusBatch> batch,
+                   Ptr<CostAccumulator> costs,
+                   float lossScale,
+                   Prepare prepare,
+                   bool accumulate = false) {
+  size_t parts = 1;
+  while(true) {
+    try {
+      std::vector<Ptr<data::CorpusBatch>> split = { batch };
+      if(parts > 1)
+        split = batch->split(parts);
+
+      for(size_t k = 0; k < split.size(); ++k) {
+        float share = split[k]->size() / (float)batch->size();
+        {
+          TraceRange range("build");
+          builder->build(graph, split[k]);
+        }
+        if(k == 0)
+          prepare(graph);
+        {
+          TraceRange range("forward");
+          graph->forward();
+        }
+        costs->add(graph->topNode(), share);
+        graph->setLossScale(lossScale * share);
+        {
+          TraceRange range("backward");
+          graph->backward(accumulate || k > 0);
+        }
+      }
+      costs->commit();
+      return;
+    }
+    catch(OutOfMemoryException& e) {
+      costs->discard();
+      UTIL_THROW_IF2(parts >= batch->size(),
+                     "Out of device memory for a single sentence: " << e.what());
+      parts *= 2;
+      LOG(info, "Out of device memory for a batch of {} sentences, retrying in {} parts",
+          batch->size(), std::min(parts, batch->size()));
+    }
+  }
+}
+
+/**
+ * @brief Initializes the parameters of all  graphs  before the first batch.
+ *
+ *  build(graph)  builds the model on  graphs[0] , whose parameters are then
+ * allocated and initialized, from a loaded model or by their initializers.
+ * The other graphs take over its parameter layout and receive its values by a
+ * device-to-device copy, all devices in parallel, so neither the model file
+ * nor the random initialization is processed more than once and no graph runs
+ * a forward pass only to create its parameters.
+ */
+template <class Build>
+void initReplicas(const std::vector<Ptr<ExpressionGraph>>& graphs, Build build) {
+  build(graphs[0]);
+  graphs[0]->initParams();
+
+  std::vector<std::future<void>> copies;
+  for(size_t i = 1; i < graphs.size(); ++i) {
+    auto graph = graphs[i];
+    copies.push_back(std::async(std::launch::async, [graph, &graphs]() {
+      cudaSetDevice(graph->getDevice());
+      graph->copyParamLayout(graphs[0]);
+      graph->initParams();
+      graph->params().allVals()->copyFrom(graphs[0]->params().allVals());
+      graph->invalidateHalfParams();
+    }));
+  }
+  // rethrows the first error of a replica
+  for(auto& copy : copies)
+    copy.get();
+}
+
+/** @brief A batch of  dimBatch  sentences of the given lengths per input stream, all words 0 and unmasked */
+inline Ptr<data::CorpusBatch> syntheticBatch(size_t dimBatch,
+                                             const std::vector<size_t>& lengths) {
+  std::vector<data::SubBatch> batches;
+  for(auto length : lengths) {
+    batches.emplace_back(dimBatch, length);
+    std::fill(batches.back().mask().begin(), batches.back().mask().end(), 1.f);
+  }
+  return New<data::CorpusBatch>(batches, dimBatch * lengths.front());
+}
+
+/**
+ * @brief Estimates device memory for training on a synthetic batch of  dimBatch
+ * sentences with the given lengths per input stream, see ExpressionGraph::estimate().
+ *
+ * The training graph is built on a CPU graph, which only computes shapes, so no
+ * device memory is allocated and no kernel is launched.  graph  and  builder  can
+ * be reused between calls.
+ */
+template <class Builder>
+MemoryEstimate estimateMemory(Ptr<Config> options,
+                              Ptr<ExpressionGraph> graph,
+                              Ptr<Builder> builder,
+                              size_t dimBatch,
+                              const std::vector<size_t>& lengths) {
+  builder->build(graph, syntheticBatch(dimBatch, lengths));
+  auto estimate = graph->estimate();
+
+  // asynchronous training shards the optimizer over all devices, with
+  // --sync-sgd every replica updates itself with the full state
+  size_t devices = options->get<bool>("sync-sgd")
+                   ? 1 : options->get<std::vector<size_t>>("devices").size();
+  estimate.optimizer = optimizerStates(options) * estimate.params / devices;
+  return estimate;
+}
+
+/** @brief Host graph for estimateMemory() configured like the training graphs */
+inline Ptr<ExpressionGraph> estimationGraph(Ptr<Config> options) {
+  auto graph = New<ExpressionGraph>();
+  graph->setDevice(CPU_DEVICE);
+  graph->setFusion(options->get<bool>("fuse-elementwise"));
+  graph->setCheckpointing(checkpointGranularity(options));
+  return graph;
+}
+
+/** @brief Lengths of the longest batches, --max-length for every input stream */
+inline std::vector<size_t> maxLengths(Ptr<Config> options) {
+  size_t streams = options->get<std::vector<std::string>>("train-sets").size();
+  return std::vector<size_t>(streams, options->get<size_t>("max-length"));
+}
+
+/**
+ * @brief Logs the estimated device memory for the batch given by --dry-run: the
+ * number of sentences followed by one length per input stream, missing lengths
+ * default to --max-length.
+ */
+template <class Builder>
+MemoryEstimate DryRun(Ptr<Config> options) {
+  auto dims = options->get<std::vector<size_t>>("dry-run");
+  size_t dimBatch = dims.empty() ? options->get<int>("mini-batch") : dims[0];
+  auto lengths = maxLengths(options);
+  for(size_t i = 1; i < dims.size() && i <= lengths.size(); ++i)
+    lengths[i - 1] = dims[i];
+
+  auto estimate = estimateMemory(options, estimationGraph(options),
+                                 New<Builder>(options), dimBatch, lengths);
+
+  std::string lengthList;
+  for(auto length : lengths)
+    lengthList += (lengthList.empty() ? "" : " ") + std::to_string(length);
+
+  auto mb = [](size_t bytes) { return bytes / (1024 * 1024); };
+  LOG(info, "Dry run for {} sentences of lengths {}", dimBatch, lengthList);
+  LOG(info, "Parameters {} MB, gradients {} MB, optimizer {} MB, workspace {} MB ({} MB without reuse)",
+      mb(estimate.params), mb(estimate.gradients), mb(estimate.optimizer),
+      mb(estimate.workspace), mb(estimate.unshared));
+  return estimate;
+}
+
+/**
+ * @brief Device memory training needs per device. Asynchronously every graph
+ * holds parameters, gradients and a workspace, the device additionally holds
+ * its shards of the parameters, gradients and optimizer state. With --sync-sgd
+ * the single replica of a device holds all of them in full, with --comm-fp16
+ * also the residual of its gradient and its fp16 copy.
+ */
+inline size_t deviceBytes(Ptr<Config> options, const MemoryEstimate& estimate) {
+  size_t devices = options->get<std::vector<size_t>>("devices").size();
+  size_t copies = std::max((size_t)1, options->get<size_t>("graphs-per-device"));
+  size_t workspace = std::max(estimate.workspace,
+                              options->get<size_t>("workspace") * 1024 * 1024);
+  if(options->get<bool>("sync-sgd")) {
+    size_t half = options->get<bool>("comm-fp16") ? estimate.gradients * 3 / 2 : 0;
+    return estimate.params + estimate.gradients + workspace
+           + estimate.optimizer + half;
+  }
+  return copies * (estimate.params + estimate.gradients + workspace)
+         + (estimate.params + estimate.gradients) / devices + estimate.optimizer;
+}
+
+/**
+ * @brief Sets --mini-batch in the effective config to the largest number of
+ * sentences of --max-length whose estimated memory fits into the free memory
+ * of the first device, keeping a margin for cuBLAS and fragmentation.
+ */
+template <class Builder>
+size_t FitMiniBatch(Ptr<Config> options) {
+  const float margin = 0.9f;
+  const size_t limit = 1 << 16;
+
+  size_t device = options->get<std::vector<size_t>>("devices")[0];
+  size_t free = 0, total = 0;
+  CUDA_CHECK(cudaSetDevice(device));
+  CUDA_CHECK(cudaMemGetInfo(&free, &total));
+  size_t budget = margin * free;
+
+  auto graph = estimationGraph(options);
+  auto builder = New<Builder>(options);
+  auto lengths = maxLengths(options);
+  auto fits = [&](size_t dimBatch) {
+    return deviceBytes(options, estimateMemory(options, graph, builder,
+                                               dimBatch, lengths)) <= budget;
+  };
+
+  UTIL_THROW_IF2(!fits(1), "Not even a single sentence of length "
+                 << lengths[0] << " fits into the " << free / (1024 * 1024)
+                 << " MB free on device " << device);
+
+  // largest fitting power of two, then bisect up to the next one
+  size_t lo = 1;
+  while(lo < limit && fits(2 * lo))
+    lo *= 2;
+  size_t hi = std::min(2 * lo, limit + 1);
+  while(hi - lo > 1) {
+    size_t mid = (lo + hi) / 2;
+    if(fits(mid))
+      lo = mid;
+    else
+      hi = mid;
+  }
+
+  LOG(info, "Fitted mini-batch of {} sentences of length {} into {} MB free on device {}",
+      lo, lengths[0], free / (1024 * 1024), device);
+  options->get()["mini-batch"] = (int)lo;
+  options->refresh();
+  return lo;
+}
+
 class GraphGroup {
   protected:
     Ptr<Config> options_;
@@ -26,6 +353,14 @@ class GraphGroup {
 
     virtual void update(Ptr<data::CorpusBatch>) = 0;
 
+    /**
+     * @brief Whether to feed another batch of this epoch given that this
+     * process  has  one. Processes training together must all agree.
+     */
+    virtual bool feed(bool has) {
+      return has;
+    }
+
     virtual void setReporter(Ptr<Reporter> reporter) {
       reporter_ = reporter;
     }
@@ -46,7 +381,17 @@ class AsyncGraphGroup : public GraphGroup {
     std::vector<Ptr<ExpressionGraph>> graphs_;
 
     std::mutex sync_;
-    std::vector<std::mutex> shardSync_;
+    // batches handed to the workers, ids of the batches in the trace
+    size_t fed_{0};
+    // per graph, logged by the reporter
+    std::vector<Ptr<WorkerStats>> workerStats_;
+
+    // --island-size, consecutive devices that train synchronously as a single
+    // asynchronous worker, batches collected for the next island, and per
+    // island a thread for each graph but the first
+    size_t island_{1};
+    std::vector<Ptr<data::CorpusBatch>> pending_;
+    std::vector<UPtr<ThreadPool>> islandPools_;
 
     std::vector<Tensor> params_;
     std::vector<Ptr<TensorAllocator> > paramsAlloc_;
@@ -54,56 +399,641 @@ class AsyncGraphGroup : public GraphGroup {
     std::vector<Tensor> grads_;
     std::vector<Ptr<TensorAllocator>> gradsAlloc_;
 
+    // --comm-fp16, per shard its parameters in fp16, converted once per
+    // version, followed by room for a shard of received gradients
+    std::vector<UPtr<HalfBuffer>> shardHalf_;
+    std::vector<size_t> halfVersions_;
+
     std::vector<Ptr<OptimizerBase>> shardOpt_;
 
+    // per shard copy of the clipping factor of the whole gradient
+    std::vector<Tensor> scales_;
+    std::vector<Ptr<TensorAllocator>> scalesAlloc_;
+
     int shardSize_;
 
+    // stalled validations seen so far, for learning rate schedules
+    size_t lastStalled_{0};
+
+    // one long-lived thread per shard runs all copies from and updates of
+    // that shard in submission order, which also serializes access to it
+    std::vector<UPtr<ThreadPool>> shardPools_;
+    // stream of each shard thread for its peer copies and update kernels
+    std::vector<cudaStream_t> shardStreams_;
+
+    // updates applied to each shard, and --fetch-staleness, the number of
+    // them a worker may miss before it fetches the shard again
+    std::vector<UPtr<std::atomic<size_t>>> versions_;
+    size_t staleness_{0};
+    // --staleness-scaling
+    bool staleScaling_{false};
+    // --hogwild, workers copy from and update the shards themselves, only the
+    // launch of an update takes the lock of its shard's optimizer
+    bool hogwild_{false};
+    std::vector<UPtr<std::mutex>> launchLocks_;
+
+    // per shard: copies and updates run, microseconds they spent queued behind
+    // each other and running, logged and reset every --disp-freq batches
+    struct ShardStats {
+      std::atomic<uint64_t> tasks{0};
+      std::atomic<uint64_t> waitMicros{0};
+      std::atomic<uint64_t> busyMicros{0};
+      // updates with a learning rate scaled down by --staleness-scaling
+      std::atomic<uint64_t> damped{0};
+      // --hogwild: updates in flight, and updates started while another one
+      // was, which would have queued behind it on the shard's thread
+      std::atomic<uint64_t> running{0};
+      std::atomic<uint64_t> overlapped{0};
+    };
+    std::vector<UPtr<ShardStats>> shardStats_;
+
+    /** @brief Queues  f  on the thread of shard  idx  and counts its wait and run time */
+    template <class F>
+    std::future<void> enqueueShard(int idx, F f) {
+      auto queued = std::chrono::steady_clock::now();
+      return shardPools_[idx]->enqueue([this, idx, queued, f]() {
+        ShardStats& stats = *shardStats_[idx];
+        stats.tasks++;
+        stats.waitMicros += std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - queued).count();
+        data::StageTimer busy(stats.busyMicros);
+        f();
+      });
+    }
+
+    void logShardStats() {
+      std::stringstream line;
+      for(size_t idx = 0; idx < shardStats_.size(); ++idx) {
+        ShardStats& stats = *shardStats_[idx];
+        line << (idx ? " | " : "") << stats.tasks.exchange(0) << " tasks "
+             << stats.waitMicros.exchange(0) / 1000 << " ms queued "
+             << stats.busyMicros.exchange(0) / 1000 << " ms busy";
+        if(staleScaling_)
+          line << " " << stats.damped.exchange(0) << " damped";
+        if(hogwild_)
+          line << " " << stats.overlapped.exchange(0) << " overlapped";
+      }
+      LOG(info, "Shards: {}", line.str());
+    }
+
+    // --grad-dropping-rate, fraction of the gradient entries kept back
+    float dropRate_{0};
+    std::vector<Tensor> sparseIndices_;
+    std::vector<Tensor> sparseValues_;
+    std::vector<Ptr<TensorAllocator>> sparseAlloc_;
+
+    // --sparse-embeddings, per shard the ranges of the last push and a buffer
+    // that receives their gradients packed
+    bool sparseRows_{false};
+    std::vector<UPtr<DeviceRanges>> shardRanges_;
+    std::vector<Tensor> received_;
+    std::vector<Ptr<TensorAllocator>> receivedAlloc_;
+
+    // --optimizer-delay, batches each worker accumulates before pushing
+    size_t delay_{1};
+
+    // --comm-fp16: parameters and gradients travel between workers and
+    // shards in fp16, see shardHalf_
+    bool commHalf_{false};
+
+    /** Error feedback residual of a worker and its fp16 gradients, see --comm-fp16 */
+    struct HalfSender {
+      Ptr<TensorAllocator> alloc;
+      Tensor residual;
+      HalfBuffer send;
+
+      HalfSender(size_t device, size_t size) : send(device, size) {
+        alloc = New<TensorAllocator>(device);
+        alloc->reserveExact(size);
+        alloc->allocate(residual, {1, (int)size});
+        residual->set(0);
+      }
+    };
+
+    // --exponential-smoothing, decay of the moving average of the parameters
+    // kept by every shard's optimizer, backup_ holds the trained parameters
+    // of a single graph while it validates the average
+    float smoothing_{0};
+    Tensor backup_;
+    Ptr<TensorAllocator> backupAlloc_;
+
+    /** Residual of a worker and its buffers for the entries sent per batch */
+    struct GradientDropper {
+      Ptr<TensorAllocator> alloc;
+      Tensor residual;
+      Tensor sample;
+      Tensor indices;
+      Tensor values;
+
+      GradientDropper(size_t device, size_t size, float rate) {
+        // a sample of 0.1% of the entries estimates the threshold well, the
+        // selection may exceed its share up to twice before it is raised
+        size_t sample = std::min(size, std::max((size_t)4096, size / 1000));
+        size_t capacity = std::min(size, (size_t)(2 * (1 - rate) * size) + 1);
+        alloc = New<TensorAllocator>(device);
+        alloc->reserveExact(size + sample + 2 * capacity);
+        alloc->allocate(residual, {1, (int)size});
+        alloc->allocate(sample, {1, (int)sample});
+        alloc->allocate(indices, {1, (int)capacity});
+        alloc->allocate(values, {1, (int)capacity});
+        residual->set(0);
+      }
+    };
+
+    /** Buffers of a worker for the gradients of the ranges it sends per batch */
+    struct RangeSender {
+      Ranges touched;
+      DeviceRanges ranges;
+      Ptr<TensorAllocator> alloc;
+      Tensor packed;
+
+      RangeSender(size_t device, size_t size) : ranges(device) {
+        alloc = New<TensorAllocator>(device);
+        alloc->reserveExact(size);
+        alloc->allocate(packed, {1, (int)size});
+      }
+    };
+
+    /**
+     * --hogwild: a worker's own stream per shard device and the gradients and
+     * clipping factor it updates the shard with, a shard's worth on every device.
+     */
+    struct HogwildWorker {
+      std::vector<cudaStream_t> streams;
+      std::vector<Ptr<TensorAllocator>> allocs;
+      std::vector<Tensor> grads;
+      std::vector<Tensor> scales;
+
+      HogwildWorker(const std::vector<size_t>& devices, const std::vector<Tensor>& shards) {
+        for(size_t idx = 0; idx < devices.size(); ++idx) {
+          cudaSetDevice(devices[idx]);
+          streams.push_back(createStream(priority::normal));
+
+          int size = shards[idx]->size();
+          Tensor grad, scale;
+          auto alloc = New<TensorAllocator>(devices[idx]);
+          alloc->reserveExact(size + 1);
+          alloc->allocate(grad, {1, size});
+          alloc->allocate(scale, {1, 1});
+          allocs.push_back(alloc);
+          grads.push_back(grad);
+          scales.push_back(scale);
+        }
+      }
+
+      ~HogwildWorker() {
+        for(auto stream : streams)
+          cudaStreamDestroy(stream);
+      }
+    };
+
+    /** @brief The --hogwild buffers of the calling worker, created on first use */
+    HogwildWorker& hogwildWorker() {
+      thread_local UPtr<HogwildWorker> worker;
+      if(!worker)
+        worker.reset(new HogwildWorker(devices_, grads_));
+      return *worker;
+    }
+
+    /** @brief Device and stream for the work of shard  idx , on its thread */
+    void onShard(int idx) {
+      cudaSetDevice(devices_[idx]);
+      currentStream() = shardStreams_[idx];
+    }
+
+    /**
+     * Enables direct access between all pairs of devices that support it.
+     * cudaMemcpyPeerAsync stages copies between the other pairs through host
+     * memory by itself.
+     */
+    void enablePeerAccess() {
+      size_t pairs = 0, peers = 0;
+      for(auto i : devices_) {
+        for(auto j : devices_) {
+          if(i == j)
+            continue;
+          pairs++;
+          int can = 0;
+          CUDA_CHECK(cudaDeviceCanAccessPeer(&can, i, j));
+          if(!can)
+            continue;
+          cudaSetDevice(i);
+          cudaError_t err = cudaDeviceEnablePeerAccess(j, 0);
+          if(err == cudaErrorPeerAccessAlreadyEnabled)
+            cudaGetLastError();
+          else
+            CUDA_CHECK(err);
+          peers++;
+        }
+      }
+      if(pairs > 0)
+        LOG(info, "Peer access between {} of {} device pairs", peers, pairs);
+    }
+
+    // declared before pool_ so that it outlives the workers
+    Checkpointer checkpointer_;
     ThreadPool pool_;
 
-    void fetchParams(Tensor oldParams) {
-      if(graphs_.size() < 2)
+    /**
+     * Copies the shards into the parameters of  graph  that received more than
+     * --fetch-staleness updates since the versions in  seen , which are advanced
+     * accordingly. An empty  seen  fetches every shard. The check runs on the
+     * shard threads, so a later push of the worker still waits for it.
+     *
+     * With --comm-fp16 the shards send their parameters in fp16 into the
+     * graph's halfParamsBuffer() and the worker expands them. Shards not
+     * fetched are unchanged in both, so the buffer stays the fp16 copy of the
+     * parameters and fp16 compute uses it as it is.
+     */
+    void fetchParams(Ptr<ExpressionGraph> graph, std::vector<size_t>& seen) {
+      if(graphs_.size() < 2) {
+        graph->invalidateHalfParams();
+        return;
+      }
+      TraceRange range("fetchParams");
+      if(hogwild_) {
+        fetchHogwild(graph, seen);
+        return;
+      }
+
+      Tensor oldParams = graph->params().vals();
+      __half* received = commHalf_ ? graph->halfParamsBuffer() : nullptr;
+      bool all = seen.empty();
+      seen.resize(devices_.size(), 0);
+      std::vector<char> got(devices_.size(), 0);
+
+      std::vector<std::future<void>> fetched;
+      int pos = 0;
+      for(int idx = 0; idx < devices_.size(); idx++) {
+        fetched.push_back(enqueueShard(idx, [=, &seen, &got]() {
+          size_t version = *versions_[idx];
+          if(!all && version - seen[idx] <= staleness_)
+            return;
+          seen[idx] = version;
+          got[idx] = 1;
+          onShard(idx);
+          size_t size = params_[idx]->size();
+          if(received) {
+            if(halfVersions_[idx] != version) {
+              CompressHalf(shardHalf_[idx]->data, params_[idx]->data(), nullptr, size, 1.f);
+              halfVersions_[idx] = version;
+            }
+            CUDA_CHECK(cudaMemcpyPeerAsync(received + pos, oldParams->getDevice(),
+                                           shardHalf_[idx]->data, devices_[idx],
+                                           size * sizeof(__half), currentStream()));
+          }
+          else {
+            CUDA_CHECK(cudaMemcpyPeerAsync(oldParams->data() + pos, oldParams->getDevice(),
+                                           params_[idx]->data(), devices_[idx],
+                                           size * sizeof(float), currentStream()));
+          }
+          CUDA_CHECK(cudaStreamSynchronize(currentStream()));
+        }));
+        pos += shardSize_;
+      }
+      for(auto& f : fetched)
+        f.get();
+
+      if(!received) {
+        graph->invalidateHalfParams();
         return;
+      }
+      cudaSetDevice(oldParams->getDevice());
+      pos = 0;
+      for(int idx = 0; idx < devices_.size(); idx++) {
+        if(got[idx])
+          ExpandHalf(oldParams->data() + pos, received + pos, params_[idx]->size(), 1.f);
+        pos += shardSize_;
+      }
+      CUDA_CHECK(cudaStreamSynchronize(currentStream()));
+      graph->setHalfParamsReceived();
+    }
 
-      // @TODO read guard on parameters
+    /**
+     * --hogwild: fetchParams() on the worker's own streams, the shards are read
+     * as they are, possibly while other workers update them.
+     */
+    void fetchHogwild(Ptr<ExpressionGraph> graph, std::vector<size_t>& seen) {
+      HogwildWorker& worker = hogwildWorker();
+      Tensor oldParams = graph->params().vals();
+      bool all = seen.empty();
+      seen.resize(devices_.size(), 0);
+
+      auto start = std::chrono::steady_clock::now();
+      std::vector<char> got(devices_.size(), 0);
       int pos = 0;
+      for(int idx = 0; idx < devices_.size(); idx++) {
+        size_t version = *versions_[idx];
+        if(all || version - seen[idx] > staleness_) {
+          seen[idx] = version;
+          got[idx] = 1;
+          CUDA_CHECK(cudaMemcpyPeerAsync(oldParams->data() + pos, oldParams->getDevice(),
+                                         params_[idx]->data(), devices_[idx],
+                                         params_[idx]->size() * sizeof(float),
+                                         worker.streams[idx]));
+        }
+        pos += shardSize_;
+      }
+      for(int idx = 0; idx < devices_.size(); idx++) {
+        if(!got[idx])
+          continue;
+        CUDA_CHECK(cudaStreamSynchronize(worker.streams[idx]));
+        shardStats_[idx]->tasks++;
+        shardStats_[idx]->busyMicros += microsSince(start);
+      }
+      graph->invalidateHalfParams();
+    }
 
-      std::vector<std::thread> threads;
-      for (int idx = 0; idx < devices_.size(); idx++) {
-        threads.emplace_back( std::thread( [=](int idx, int pos) {
-          //individual mutex per-shard
-          std::lock_guard<std::mutex> guard( shardSync_[idx] );
-          oldParams->subtensor(pos , params_[idx]->size())->copyFrom(params_[idx]);
-        }, idx, pos) );
+    /**
+     * --hogwild: updates every shard with its slice of  newGrads  from the
+     * worker's thread and streams, concurrently with other workers doing the
+     * same. The slices are copied and unscaled in the worker's buffers on the
+     * shard devices, only the launch of the update kernel takes the shard's
+     * lock, which keeps the optimizer's step count and schedule consistent.
+     * Returns once the updates are done, so  newGrads  may be reused.
+     */
+    void pushHogwild(Tensor newGrads,
+                     Tensor factor,
+                     cudaEvent_t ready,
+                     float unscale,
+                     const std::vector<size_t>& seen) {
+      HogwildWorker& worker = hogwildWorker();
+      cudaStream_t workerStream = currentStream();
+      auto start = std::chrono::steady_clock::now();
 
+      int pos = 0;
+      for(int idx = 0; idx < devices_.size(); idx++) {
+        ShardStats& stats = *shardStats_[idx];
+        if(stats.running++ > 0)
+          stats.overlapped++;
+
+        cudaSetDevice(devices_[idx]);
+        currentStream() = worker.streams[idx];
+        Tensor grads = worker.grads[idx];
+        CUDA_CHECK(cudaMemcpyPeerAsync(grads->data(), devices_[idx],
+                                       newGrads->data() + pos, newGrads->getDevice(),
+                                       grads->size() * sizeof(float), currentStream()));
+        if(unscale != 1.f)
+          Element(_1 *= unscale, grads);
+        Tensor scale;
+        if(factor) {
+          scale = worker.scales[idx];
+          cudaStreamWaitEvent(currentStream(), ready, 0);
+          cudaMemcpyPeerAsync(scale->data(), devices_[idx],
+                              factor->data(), factor->getDevice(),
+                              sizeof(float), currentStream());
+        }
+
+        float rate = staleRate(idx, seen[idx]);
+        std::unique_lock<std::mutex> lock(*launchLocks_[idx], std::defer_lock);
+        {
+          WorkerTimer timer(stats.waitMicros);
+          lock.lock();
+        }
+        shardOpt_[idx]->update(params_[idx], grads, scale, nullptr, rate);
+        lock.unlock();
         pos += shardSize_;
       }
-      for (auto &&t : threads) {
-        t.join();
+
+      for(int idx = 0; idx < devices_.size(); idx++) {
+        ShardStats& stats = *shardStats_[idx];
+        CUDA_CHECK(cudaStreamSynchronize(worker.streams[idx]));
+        (*versions_[idx])++;
+        stats.running--;
+        stats.tasks++;
+        stats.busyMicros += microsSince(start);
       }
+
+      cudaSetDevice(newGrads->getDevice());
+      currentStream() = workerStream;
     }
 
-    void pushGradients(Tensor newGrads) {
+    /**
+     * Queues copies of the floats  [offset, offset + size)  of  newGrads  into
+     * the gradient shards they overlap, once  ready  has passed. Called from
+     * backward() for every finished bucket, see setGradientBuckets().
+     */
+    void pushBucket(Tensor newGrads, size_t offset, size_t size, cudaEvent_t ready,
+                    std::vector<std::future<void>>& pushed) {
+      size_t pos = 0;
+      for(int idx = 0; idx < devices_.size(); idx++) {
+        size_t first = std::max(offset, pos);
+        size_t last = std::min(offset + size, pos + grads_[idx]->size());
+        if(first < last) {
+          const float* src = newGrads->data() + first;
+          size_t device = newGrads->getDevice();
+          pushed.push_back(enqueueShard(idx, [=]() {
+            onShard(idx);
+            cudaStreamWaitEvent(currentStream(), ready, 0);
+            cudaMemcpyPeerAsync(grads_[idx]->data() + (first - pos), devices_[idx],
+                                src, device, (last - first) * sizeof(float),
+                                currentStream());
+          }));
+        }
+        pos += shardSize_;
+      }
+    }
+
+    /**
+     * Queues the update of every shard with its slice of  newGrads  and returns
+     * without waiting, the slices are only copied unless  bucketed , i.e. all
+     * were pushed by pushBucket() already. The gradients must stay untouched
+     * until the returned futures are ready, which is implied by a later
+     * fetchParams() of the same worker as the shards work in order. The shards
+     * multiply their gradients by  unscale , the inverse loss scale.
+     *
+     * Clipping by norm must see the whole gradient, not a shard of it. The
+     * factor is computed on the worker's device and only copied device to
+     * device into every shard, where the update kernels read it.  seen  are
+     * the shard versions the gradients were computed on, see fetchParams().
+     *
+     * With  half  the worker converts the gradients to fp16 with error
+     * feedback, see --comm-fp16, the shards expand and unscale their slices.
+     */
+    void pushGradients(Tensor newGrads,
+                       Tensor factor,
+                       cudaEvent_t ready,
+                       float unscale,
+                       bool bucketed,
+                       const std::vector<size_t>& seen,
+                       Ptr<HalfSender> half,
+                       std::vector<std::future<void>>& pushed) {
       if(graphs_.size() < 2) {
+        if(unscale != 1.f)
+          Element(_1 *= unscale, newGrads);
         opt_->update(graphs_[0]);
+        return;
+      }
+
+      const __half* send = nullptr;
+      if(half) {
+        CompressHalf(half->send.data, newGrads->data(), half->residual->data(),
+                     newGrads->size(), commScale(options_));
+        // the shards copy from their own streams
+        CUDA_CHECK(cudaStreamSynchronize(currentStream()));
+        send = half->send.data;
+        unscale /= commScale(options_);
+      }
+
+      int pos = 0;
+      for(int idx = 0; idx < devices_.size(); idx++) {
+        size_t fetched = seen[idx];
+        pushed.push_back(enqueueShard(idx, [=]() {
+          onShard(idx);
+          size_t size = grads_[idx]->size();
+          if(send) {
+            __half* receive = shardHalf_[idx]->data + shardSize_;
+            CUDA_CHECK(cudaMemcpyPeerAsync(receive, devices_[idx],
+                                           send + pos, newGrads->getDevice(),
+                                           size * sizeof(__half), currentStream()));
+            ExpandHalf(grads_[idx]->data(), receive, size, unscale);
+          }
+          else {
+            if(!bucketed)
+              CUDA_CHECK(cudaMemcpyPeerAsync(grads_[idx]->data(), devices_[idx],
+                                             newGrads->data() + pos, newGrads->getDevice(),
+                                             size * sizeof(float),
+                                             currentStream()));
+            if(unscale != 1.f)
+              Element(_1 *= unscale, grads_[idx]);
+          }
+          updateShard(idx, factor, ready, fetched);
+        }));
+        pos += shardSize_;
+      }
+    }
+
+    /**
+     * --staleness-scaling: the learning rate factor of a gradient computed on
+     * version  fetched  of shard  idx . Between a worker's fetch and its push
+     * every other worker, or island, pushes once, plus up to --fetch-staleness updates the
+     * worker chose to skip. Gradients that missed more, typically those of
+     * slower devices, are scaled by the expected over the actual staleness.
+     * Gradients of workers that keep up keep the tuned learning rate.
+     */
+    float staleRate(int idx, size_t fetched) {
+      if(!staleScaling_)
+        return 1.f;
+      size_t stale = *versions_[idx] - fetched;
+      size_t expected = std::max((size_t)1, graphs_.size() / island_ - 1 + staleness_);
+      if(stale <= expected)
+        return 1.f;
+      shardStats_[idx]->damped++;
+      return (float)expected / stale;
+    }
+
+    /**
+     * @brief Updates shard  idx  with grads_[idx], on the shard's thread, only
+     * within  ranges  if given. Gradients computed on version  fetched  of the
+     * shard may update with a lower learning rate, see staleRate().
+     */
+    void updateShard(int idx, Tensor factor, cudaEvent_t ready, size_t fetched,
+                     const DeviceRanges* ranges = nullptr) {
+      Tracer::context(devices_[idx]);
+      TraceRange range("shard update");
+      float rate = staleRate(idx, fetched);
+      if(factor) {
+        cudaStreamWaitEvent(currentStream(), ready, 0);
+        cudaMemcpyPeerAsync(scales_[idx]->data(), devices_[idx],
+                            factor->data(), factor->getDevice(),
+                            sizeof(float), currentStream());
+        shardOpt_[idx]->update(params_[idx], grads_[idx], scales_[idx], ranges, rate);
       }
       else {
-        // add instead of copy?
-        std::vector<std::thread> threads;
-        int pos = 0;
-        for (int idx = 0; idx < devices_.size(); idx++) {
-          threads.emplace_back( std::thread([=](int idx, int pos) {
-            //individual mutex per-shard
-            std::lock_guard<std::mutex> guard( shardSync_[idx] );
-            grads_[idx]->copyFrom( newGrads->subtensor(pos , grads_[idx]->size() ) );
-            shardOpt_[idx]->update(params_[idx], grads_[idx]);
+        shardOpt_[idx]->update(params_[idx], grads_[idx], nullptr, ranges, rate);
+      }
+      cudaStreamSynchronize(currentStream());
+      (*versions_[idx])++;
+    }
 
-            cudaStreamSynchronize(0);
-          } , idx, pos) );
+    /**
+     * Gradient dropping: adds the unscaled  newGrads  to the worker's residual
+     * and sends only its largest entries by magnitude, all but the fraction
+     * --grad-dropping-rate of them, as index/value pairs. The rest stays in
+     * the residual for later batches. Shards update with the sparse gradient.
+     */
+    void pushSparse(Tensor newGrads,
+                    Ptr<GradientDropper> dropper,
+                    Tensor factor,
+                    cudaEvent_t ready,
+                    float unscale,
+                    const std::vector<size_t>& seen,
+                    std::vector<std::future<void>>& pushed) {
+      Element(_1 += _2 * unscale, dropper->residual, newGrads);
+      float threshold = DropThreshold(dropper->residual, dropper->sample, dropRate_);
+      uint32_t* indices = (uint32_t*)dropper->indices->data();
+      float* values = dropper->values->data();
+      size_t n = DropGradients(dropper->residual, threshold, indices, values,
+                               dropper->indices->size());
+
+      std::vector<uint32_t> bounds;
+      for(int idx = 0; idx < devices_.size(); idx++)
+        bounds.push_back(idx * shardSize_);
+      bounds.push_back(newGrads->size());
+      auto positions = SplitSorted(indices, n, bounds);
+
+      size_t device = newGrads->getDevice();
+      for(int idx = 0; idx < devices_.size(); idx++) {
+        size_t first = positions[idx];
+        size_t count = positions[idx + 1] - first;
+        size_t fetched = seen[idx];
+        pushed.push_back(enqueueShard(idx, [=]() {
+          onShard(idx);
+          uint32_t* shardIndices = (uint32_t*)sparseIndices_[idx]->data();
+          float* shardValues = sparseValues_[idx]->data();
+          if(count > 0) {
+            CUDA_CHECK(cudaMemcpyPeerAsync(shardIndices, devices_[idx],
+                                           indices + first, device,
+                                           count * sizeof(uint32_t), currentStream()));
+            CUDA_CHECK(cudaMemcpyPeerAsync(shardValues, devices_[idx],
+                                           values + first, device,
+                                           count * sizeof(float), currentStream()));
+          }
+          ScatterGradients(grads_[idx], shardIndices, shardValues, count, idx * shardSize_);
+          updateShard(idx, factor, ready, fetched);
+        }));
+      }
+    }
 
-          pos += shardSize_;
-        }
-        for(auto&& t : threads)
-          t.join();
+    /**
+     * --sparse-embeddings: sends only the entries of  newGrads  the batch can
+     * have changed, every parameter it used but of embeddings only the rows of
+     * its words. They are packed on the worker's device, so every shard gets
+     * its part with a single copy, scatters it into its zeroed gradient and
+     * updates just those entries.
+     */
+    void pushRanges(Tensor newGrads,
+                    Ptr<RangeSender> sender,
+                    Tensor factor,
+                    cudaEvent_t ready,
+                    float unscale,
+                    const std::vector<size_t>& seen,
+                    std::vector<std::future<void>>& pushed) {
+      const Ranges& touched = sender->touched;
+      sender->ranges.upload(touched);
+      GatherRanges(sender->packed->data(), newGrads, sender->ranges);
+      // the shards copy the packed gradients on their own streams
+      CUDA_CHECK(cudaStreamSynchronize(currentStream()));
+
+      const float* packed = sender->packed->data();
+      size_t device = newGrads->getDevice();
+      for(int idx = 0; idx < devices_.size(); idx++) {
+        size_t before;
+        Ranges part = touched.slice(idx * shardSize_,
+                                    idx * shardSize_ + grads_[idx]->size(), before);
+        size_t fetched = seen[idx];
+        pushed.push_back(enqueueShard(idx, [=]() {
+          onShard(idx);
+          DeviceRanges& ranges = *shardRanges_[idx];
+          ranges.upload(part);
+          if(ranges.total() > 0)
+            CUDA_CHECK(cudaMemcpyPeerAsync(received_[idx]->data(), devices_[idx],
+                                           packed + before, device,
+                                           ranges.total() * sizeof(float),
+                                           currentStream()));
+          ScatterRanges(grads_[idx], received_[idx]->data(), ranges, unscale);
+          updateShard(idx, factor, ready, fetched, &ranges);
+        }));
       }
     }
 
@@ -111,14 +1041,14 @@ class AsyncGraphGroup : public GraphGroup {
       static bool first = true;
       if(first && graphs_.size() > 1) {
         // initialize the parameters
-        for(size_t i = 0; i < graphs_.size(); ++i) {
-          builders_[i]->build(graphs_[i], batch);
-          graphs_[i]->forward();
-        }
+        initReplicas(graphs_, [&](Ptr<ExpressionGraph> graph) {
+          builders_[0]->build(graph, batch);
+        });
 
         if(params_.size() == 0) {
           int totalSize = graphs_[0]->params().vals()->size();
-          shardSize_ = ceil(totalSize / devices_.size());
+          // rounded up, the last shard is the smaller one and none is missed
+          shardSize_ = (totalSize + devices_.size() - 1) / devices_.size();
 
           int pos = 0;
           //parameter sharding
@@ -135,6 +1065,12 @@ class AsyncGraphGroup : public GraphGroup {
             params_.push_back(param_);
             pos += __size__;
 
+            // parameters out and gradients in, each a shard's worth
+            if(commHalf_) {
+              shardHalf_.emplace_back(new HalfBuffer(device, 2 * shardSize_));
+              halfVersions_.push_back((size_t)-1);
+            }
+
           }
         }
         if(grads_.size() == 0) {
@@ -151,50 +1087,294 @@ class AsyncGraphGroup : public GraphGroup {
             gradsAlloc_.push_back(allocator_);
             grads_.push_back(grad_);
 
+            Tensor scale_;
+            Ptr<TensorAllocator> scaleAllocator_ = New<TensorAllocator>(device);
+            scaleAllocator_->reserveExact(1);
+            scaleAllocator_->allocate(scale_, {1, 1});
+            scalesAlloc_.push_back(scaleAllocator_);
+            scales_.push_back(scale_);
+
+            // receive buffers for sparse gradients, a shard's worth at most
+            if(dropRate_ > 0) {
+              Ptr<TensorAllocator> sparseAllocator = New<TensorAllocator>(device);
+              sparseAllocator->reserveExact(2 * __size__);
+              Tensor indices, values;
+              sparseAllocator->allocate(indices, {1, __size__});
+              sparseAllocator->allocate(values, {1, __size__});
+              sparseAlloc_.push_back(sparseAllocator);
+              sparseIndices_.push_back(indices);
+              sparseValues_.push_back(values);
+            }
+            if(sparseRows_) {
+              Ptr<TensorAllocator> receivedAllocator = New<TensorAllocator>(device);
+              receivedAllocator->reserveExact(__size__);
+              Tensor received;
+              receivedAllocator->allocate(received, {1, __size__});
+              receivedAlloc_.push_back(receivedAllocator);
+              received_.push_back(received);
+            }
           }
         }
 
         first = false;
       }
 
-      auto task = [this](Ptr<data::CorpusBatch> batch) {
+      // with --island-size the worker is the first graph of an island, the
+      // others run their batches on the island's threads, take over the
+      // parameters the worker fetched and add their gradients to its own,
+      // which it pushes as those of a single worker
+      auto task = [this](std::vector<Ptr<data::CorpusBatch>> batches, size_t id) {
         static size_t i = 0;
         thread_local Ptr<ExpressionGraph> graph;
         thread_local Ptr<Builder> builder;
+        thread_local Ptr<LossScaler> scaler;
+        thread_local Ptr<CostAccumulator> costs;
+        thread_local Ptr<Norm> clipper;
+        thread_local cudaEvent_t clipped;
+        thread_local std::vector<std::future<void>> pushed;
+        thread_local Ptr<GradientDropper> dropper;
+        thread_local Ptr<RangeSender> sender;
+        thread_local Ptr<HalfSender> halfSender;
+        thread_local std::vector<size_t> seen;
+        thread_local Ptr<WorkerStats> stats;
         thread_local size_t t = 0;
+        // the other graphs of the island, their costs, stats and rounds since the last push
+        thread_local std::vector<size_t> members;
+        thread_local std::vector<Ptr<CostAccumulator>> memberCosts;
+        thread_local std::vector<size_t> memberRounds;
+        thread_local ThreadPool* helpers = nullptr;
+        thread_local Ptr<TensorAllocator> stageAlloc;
+        thread_local Tensor stage;
 
         if(!graph) {
           std::lock_guard<std::mutex> lock(sync_);
-          graph = graphs_[i];
-          builder = builders_[i++];
+          size_t first = i * island_;
+          if(island_ > 1)
+            helpers = islandPools_[i].get();
+          i++;
+          graph = graphs_[first];
+          stats = workerStats_[first];
+          builder = builders_[first];
+          numa::bindThread(graph->getDevice());
+          for(size_t j = first + 1; j < first + island_; ++j) {
+            members.push_back(j);
+            memberCosts.push_back(New<CostAccumulator>(graphs_[j]->getDevice()));
+            memberRounds.push_back(0);
+          }
+          costs = New<CostAccumulator>(graph->getDevice());
+          if(options_->get<bool>("fp16"))
+            scaler = New<LossScaler>(options_->get<double>("loss-scale"));
+          float clipNorm = options_->get<double>("clip-norm");
+          if(clipNorm > 0 && graphs_.size() > 1) {
+            clipper = New<Norm>(clipNorm);
+            cudaSetDevice(graph->getDevice());
+            cudaEventCreateWithFlags(&clipped, cudaEventDisableTiming);
+          }
+          // with --grad-buckets gradient shards are sent during backward(),
+          // dropped, accumulated and sparse gradients are only known after it
+          size_t bucketMB = options_->get<size_t>("grad-buckets");
+          if(bucketMB > 0 && graphs_.size() > 1 && dropRate_ == 0 && delay_ == 1
+             && !sparseRows_ && island_ == 1 && !commHalf_ && !hogwild_) {
+            ExpressionGraph* g = graph.get();
+            graph->setGradientBuckets(bucketMB * 1024 * 1024 / sizeof(float),
+                                      [this, g](size_t offset, size_t size, cudaEvent_t ready) {
+                                        pushBucket(g->params().grads(), offset, size, ready, pushed);
+                                      });
+          }
         }
 
-        builder->build(graph, batch);
-        fetchParams(graph->params().vals());
+        Tracer::context(graph->getDevice(), id);
+        auto batch = batches[0];
+
+        // with --optimizer-delay parameters are fetched before the first batch
+        // of each window and gradients pushed after the last, in between they
+        // are accumulated on top of the previous batches'
+        bool accumulate = t % delay_ != 0;
+        float lossScale = scaler ? scaler->scale() : 1.f;
+
+        // thread-local state is copied, the island's threads have their own
+        std::promise<void> fetched;
+        std::shared_future<void> ready = fetched.get_future().share();
+        std::vector<std::future<void>> memberSteps;
+        for(size_t j = 1; j < batches.size(); ++j) {
+          size_t m = members[j - 1];
+          auto leader = graph;
+          auto memberCost = memberCosts[j - 1];
+          auto memberBatch = batches[j];
+          memberRounds[j - 1]++;
+          memberSteps.push_back(helpers->enqueue([=]() {
+            auto member = graphs_[m];
+            auto memberStats = workerStats_[m];
+            cudaSetDevice(member->getDevice());
+            Tracer::context(member->getDevice(), id);
+            uint64_t waitMicros = 0;
+            auto start = std::chrono::steady_clock::now();
+            resilientStep(member, builders_[m], memberBatch, memberCost, lossScale,
+                          [&](Ptr<ExpressionGraph> member) {
+                            if(accumulate)
+                              return;
+                            auto wait = std::chrono::steady_clock::now();
+                            ready.get();
+                            member->params().vals()->copyFrom(leader->params().vals());
+                            member->invalidateHalfParams();
+                            waitMicros += microsSince(wait);
+                          },
+                          accumulate);
+            cudaStreamSynchronize(member->getStream());
+            memberStats->computeMicros += microsSince(start) - waitMicros;
+            memberStats->commMicros += waitMicros;
+            memberStats->batches++;
+            memberStats->words += memberBatch->words();
+          }));
+        }
 
-        graph->forward();
-        float cost = graph->topNode()->scalar();
-        graph->backward();
+        uint64_t fetchMicros = 0;
+        bool signalled = false;
+        auto start = std::chrono::steady_clock::now();
+        resilientStep(graph, builder, batch, costs, lossScale,
+                      [&](Ptr<ExpressionGraph> graph) {
+                        if(accumulate)
+                          return;
+                        auto fetch = std::chrono::steady_clock::now();
+                        fetchParams(graph, seen);
+                        if(!signalled)
+                          fetched.set_value();
+                        signalled = true;
+                        // done after the fetch, rethrows errors of the shards
+                        for(auto& p : pushed)
+                          p.get();
+                        pushed.clear();
+                        fetchMicros += microsSince(fetch);
+                      },
+                      accumulate);
+        stats->computeMicros += microsSince(start) - fetchMicros;
+        stats->commMicros += fetchMicros;
+        stats->batches++;
+        stats->words += batch->words();
+        for(auto& step : memberSteps)
+          step.get();
+
+        bool push = (t + 1) % delay_ == 0;
+
+        // gradients are copied to the shards from other threads' streams
+        if(push) {
+          cudaStreamSynchronize(graph->getStream());
+          cudaStreamSynchronize(0);
+        }
 
-        cudaStreamSynchronize(0);
-        pushGradients(graph->params().grads());
+        // the island's gradients are summed into the worker's, over the
+        // peer links between its devices
+        size_t rounds = delay_;
+        if(push && !members.empty()) {
+          TraceRange range("island reduce");
+          WorkerTimer timer(stats->commMicros);
+          Tensor grads = graph->params().grads();
+          if(!stage) {
+            stageAlloc = New<TensorAllocator>(graph->getDevice());
+            stageAlloc->reserveExact(grads->size());
+            stageAlloc->allocate(stage, {1, (int)grads->size()});
+          }
+          for(size_t j = 0; j < members.size(); ++j) {
+            if(memberRounds[j] == 0)
+              continue;
+            stage->copyFrom(graphs_[members[j]]->params().grads());
+            Element(_1 += _2, grads, stage);
+            rounds += memberRounds[j];
+            memberRounds[j] = 0;
+          }
+          cudaStreamSynchronize(currentStream());
+        }
+
+        // the worker's gradients may already be read by bucket copies, so they
+        // stay loss-scaled here and the fp32 shards unscale their part, which
+        // also averages them over the accumulated batches
+        float unscale = 1.f / (lossScale * rounds);
+        if(push && (!scaler || scaler->check(graph->params().grads()))) {
+          TraceRange range("pushGradients");
+          WorkerTimer timer(stats->commMicros);
+          Tensor factor;
+          if(clipper) {
+            clipper->setThreshold(options_->get<double>("clip-norm") * lossScale * delay_);
+            factor = clipper->scale(graph->params().grads());
+            cudaEventRecord(clipped, currentStream());
+          }
+          if(dropRate_ > 0 && graphs_.size() > 1) {
+            if(!dropper)
+              dropper = New<GradientDropper>(graph->getDevice(),
+                                             graph->params().grads()->size(),
+                                             dropRate_);
+            pushSparse(graph->params().grads(), dropper, factor, clipped,
+                       unscale, seen, pushed);
+          }
+          else if(sparseRows_ && graphs_.size() > 1) {
+            if(!sender)
+              sender = New<RangeSender>(graph->getDevice(),
+                                        graph->params().grads()->size());
+            graph->updateRanges(sender->touched);
+            pushRanges(graph->params().grads(), sender, factor, clipped,
+                       unscale, seen, pushed);
+          }
+          else if(hogwild_ && graphs_.size() > 1) {
+            pushHogwild(graph->params().grads(), factor, clipped, unscale, seen);
+          }
+          else {
+            if(commHalf_ && !halfSender)
+              halfSender = New<HalfSender>(graph->getDevice(),
+                                           graph->params().grads()->size());
+            pushGradients(graph->params().grads(), factor, clipped, unscale,
+                          graph->bucketsComplete(), seen, halfSender, pushed);
+          }
+        }
 
         if(reporter_) {
-          std::lock_guard<std::mutex> guard(sync_);
-          reporter_->update(cost, batch);
-          if(reporter_->batches % options_->get<size_t>("save-freq") == 0)
-            this->save();
-          size_t prevStalled = reporter_->stalled();
-          reporter_->validate(graph);
-          if(prevStalled < reporter_->stalled())
+          std::unique_lock<std::mutex> guard(sync_, std::defer_lock);
+          {
+            TraceRange range("wait sync_");
+            WorkerTimer timer(stats->lockMicros);
+            guard.lock();
+          }
+          // every graph reports its share of a display interval
+          for(size_t j = 0; j < batches.size(); ++j) {
+            auto graphCosts = j == 0 ? costs : memberCosts[j - 1];
+            size_t n = graphCosts->batches();
+            if(n >= reportInterval(options_, graphs_.size()))
+              reporter_->addCost(graphCosts->read(), n);
+            reporter_->update(batches[j]);
+            if(reporter_->batches % options_->snapshot().saveFreq == 0)
+              this->save();
+            if(graphs_.size() > 1
+               && reporter_->batches % options_->snapshot().dispFreq == 0)
+              logShardStats();
+          }
+          // validators see the moving average, workers continue with the
+          // trained parameters
+          if(smoothing_ > 0 && reporter_->validating()) {
+            useSmoothed(graph);
+            reporter_->validate(graph);
+            useTrained(graph, seen);
+          }
+          else {
+            reporter_->validate(graph);
+          }
+          // asynchronous validation results may arrive any number of batches later
+          size_t stalled = reporter_->stalled();
+          if(stalled > lastStalled_)
             for(auto opt : shardOpt_)
               opt->updateSchedule();
+          lastStalled_ = stalled;
         }
 
         t++;
       };
 
-      pool_.enqueue(task, batch);
+      // a null batch hands an incomplete island its remaining batches
+      if(batch)
+        pending_.push_back(batch);
+      if(pending_.empty() || (batch && pending_.size() < island_))
+        return;
+      pool_.enqueue(task, pending_, fed_);
+      fed_ += pending_.size();
+      pending_.clear();
     }
 
   public:
@@ -203,50 +1383,246 @@ class AsyncGraphGroup : public GraphGroup {
     AsyncGraphGroup(Ptr<Config> options)
      : GraphGroup(options),
        devices_{options_->get<std::vector<size_t>>("devices")},
-       pool_{devices_.size(), devices_.size()},
-       shardSync_{devices_.size()} {
-
+       island_(std::max((size_t)1, options_->get<size_t>("island-size"))),
+       staleness_(options_->get<size_t>("fetch-staleness")),
+       staleScaling_(options_->get<bool>("staleness-scaling")),
+       hogwild_(options_->get<bool>("hogwild")),
+       dropRate_(options_->get<double>("grad-dropping-rate")),
+       delay_(std::max((size_t)1, options_->get<size_t>("optimizer-delay"))),
+       commHalf_(options_->get<bool>("comm-fp16")),
+       smoothing_(options_->get<double>("exponential-smoothing")),
+       pool_{workerCount(options_), workerCount(options_)} {
+      UTIL_THROW_IF2(dropRate_ < 0 || dropRate_ >= 1,
+                     "--grad-dropping-rate must lie in [0, 1)");
+      UTIL_THROW_IF2(hogwild_ && (dropRate_ > 0 || commHalf_),
+                     "--hogwild sends dense fp32 gradients, it excludes "
+                     "--grad-dropping-rate and --comm-fp16");
+      // the parameter shards are updated without their names
+      UTIL_THROW_IF2(graphCount(options_) > 1
+                     && options_->get<float>("prune-sparsity") > 0,
+                     "--prune-sparsity requires a single graph or synchronous training");
+
+      // several graphs per device: a worker builds its graph on the host while
+      // the kernels of another worker's graph keep the same device busy
+      size_t copies = std::max((size_t)1, options_->get<size_t>("graphs-per-device"));
+      UTIL_THROW_IF2(devices_.size() % island_ != 0,
+                     "--island-size " << island_ << " does not divide the "
+                     << devices_.size() << " devices");
+      UTIL_THROW_IF2(island_ > 1 && copies > 1,
+                     "--island-size requires --graphs-per-device 1");
+      if(island_ > 1)
+        for(size_t island = 0; island < devices_.size() / island_; ++island)
+          islandPools_.emplace_back(new ThreadPool(island_ - 1));
       for(auto device : devices_) {
-        auto graph = New<ExpressionGraph>();
-        graph->setDevice(device);
-        graph->reserveWorkspaceMB(options_->get<size_t>("workspace"));
-        graphs_.push_back(graph);
+        for(size_t copy = 0; copy < copies; ++copy) {
+          auto graph = New<ExpressionGraph>();
+          graph->setDevice(device, allocationStrategy(options_));
+          reserveWorkspace(graph, options_);
+          shareDevice(graph, options_);
+          graph->setMemoryPlanning(options_->get<bool>("memory-plan")
+                                   || options_->get<bool>("cuda-graphs"));
+          graph->setCudaGraphs(options_->get<bool>("cuda-graphs"));
+          graph->setStreams(options_->get<size_t>("streams"));
+          graph->setFusion(options_->get<bool>("fuse-elementwise"));
+          graph->setAdjointArena(options_->get<bool>("adjoint-arena"));
+          graph->setPersistentRnn(options_->get<bool>("persistent-rnn"));
+          graph->setHotRows(options_->get<size_t>("embedding-hot-rows"));
+          graph->setAutotune(options_->get<std::string>("autotune"));
+          if(options_->has("freeze"))
+            graph->setFrozen(options_->get<std::vector<std::string>>("freeze"));
+          if(options_->has("managed-params"))
+            graph->setManaged(options_->get<std::vector<std::string>>("managed-params"));
+          graph->setGemmAutotune(options_->get<bool>("gemm-autotune"),
+                                 options_->get<std::string>("gemm-autotune-cache"));
+          graph->setCheckpointing(checkpointGranularity(options_));
+          graph->setMemoryTrace(deviceFile(options_, "memory-trace", device, copy));
+          graph->setProfiling(options_->get<size_t>("profile"),
+                              deviceFile(options_, "profile-trace", device, copy));
+          graph->setHalfPrecision(options_->get<bool>("fp16"));
+          graphs_.push_back(graph);
+          builders_.push_back(New<Builder>(options_));
+          workerStats_.push_back(New<WorkerStats>(device));
+        }
         shardOpt_.push_back(Optimizer(options_));
-        builders_.push_back(New<Builder>(options_));
+        shardOpt_.back()->setSmoothing(smoothing_);
+        shardPools_.emplace_back(new ThreadPool(1));
+        shardPools_.back()->enqueue([device]() { numa::bindThread(device); });
+        shardStats_.emplace_back(new ShardStats());
+        launchLocks_.emplace_back(new std::mutex());
+        versions_.emplace_back(new std::atomic<size_t>(0));
+        shardRanges_.emplace_back(new DeviceRanges(device));
+
+        cudaSetDevice(device);
+        shardStreams_.push_back(createStream(priority::normal));
+      }
+      enablePeerAccess();
+      opt_->setSmoothing(smoothing_);
+
+      // the ranges of a batch do not cover accumulated, dropped or reduced gradients
+      if(options_->get<bool>("sparse-embeddings")) {
+        sparseRows_ = delay_ == 1 && dropRate_ == 0 && island_ == 1 && !hogwild_;
+        if(!sparseRows_)
+          LOG(info, "--sparse-embeddings is ignored with --optimizer-delay, "
+                    "--grad-dropping-rate, --island-size or --hogwild");
       }
+      opt_->setSparseRows(sparseRows_);
+    }
+
+    static size_t graphCount(Ptr<Config> options) {
+      return options->get<std::vector<size_t>>("devices").size()
+             * std::max((size_t)1, options->get<size_t>("graphs-per-device"));
+    }
+
+    /** @brief Asynchronous workers, one per graph or per island of --island-size graphs */
+    static size_t workerCount(Ptr<Config> options) {
+      return graphCount(options) / std::max((size_t)1, options->get<size_t>("island-size"));
+    }
+
+    ~AsyncGraphGroup() {
+      // the batches of an incomplete island
+      if(!pending_.empty())
+        execute(nullptr);
     }
 
     void update(Ptr<data::CorpusBatch> batch) {
       execute(batch);
     }
 
+    void setReporter(Ptr<Reporter> reporter) {
+      GraphGroup::setReporter(reporter);
+      for(auto& stats : workerStats_)
+        reporter->addWorkerStats(stats);
+    }
+
+    /** @brief Number of updates applied to each parameter shard so far */
+    std::vector<size_t> shardVersions() {
+      std::vector<size_t> versions;
+      for(auto& version : versions_)
+        versions.push_back(*version);
+      return versions;
+    }
+
     void load() {
       if(!options_->get<bool>("no-reload")) {
         std::string init = options_->get<std::string>("model");
         if(boost::filesystem::exists(init)) {
-          size_t i = 0;
           reporter_->load(init);
-          for(auto graph : graphs_)
-            builders_[i++]->load(graph, init);
+          // the other graphs copy the parameters of the first, see initReplicas()
+          builders_[0]->load(graphs_[0], init);
         }
       }
     }
 
-    void save() {
-      if(options_->get<bool>("overwrite")) {
-        std::string name = options_->get<std::string>("model");
-        builders_[0]->save(graphs_[0], name, true);
-        reporter_->save(name);
+    /** @brief Shard  idx  of the moving average, the parameters before the first update */
+    Tensor smoothedShard(int idx) {
+      Tensor avg = shardOpt_[idx]->smoothed();
+      return avg ? avg : params_[idx];
+    }
+
+    /** @brief Copies the parameter shards, or their moving averages, into  host  */
+    void copyShards(float* host, bool smoothed = false) {
+      std::vector<std::future<void>> copied;
+      int pos = 0;
+      for(int idx = 0; idx < devices_.size(); idx++) {
+        copied.push_back(enqueueShard(idx, [=]() {
+          onShard(idx);
+          Tensor src = smoothed ? smoothedShard(idx) : params_[idx];
+          CUDA_CHECK(cudaMemcpyAsync(host + pos, src->data(),
+                                     src->size() * sizeof(float),
+                                     cudaMemcpyDeviceToHost, currentStream()));
+          CUDA_CHECK(cudaStreamSynchronize(currentStream()));
+        }));
+        pos += shardSize_;
       }
-      else {
-        std::string name = options_->get<std::string>("model");
+      for(auto& c : copied)
+        c.get();
+    }
+
+    void save() {
+      TraceRange range("save");
+      std::string name = options_->get<std::string>("model");
+      std::vector<std::pair<std::string, bool>> files;
+      if(!options_->get<bool>("overwrite")) {
         std::string nameOverwrite = name;
         nameOverwrite.replace(name.size() - 4, 4,
           ".iter" + std::to_string(reporter_->batches) + ".npz");
-        builders_[0]->save(graphs_[0], nameOverwrite);
+        files.push_back({nameOverwrite, false});
+      }
+      files.push_back({name, true});
+
+      // the shards hold the current parameters, graphs_[0] only its last fetch
+      bool sharded = graphs_.size() > 1 && !params_.empty();
+      std::vector<Checkpointer::Checkpoint> checkpoints;
+      if(sharded)
+        checkpoints.push_back({files, [this](float* host) { copyShards(host); }});
+      else
+        checkpoints.push_back({files, nullptr});
+
+      if(smoothing_ > 0) {
+        std::string nameSmoothed = name;
+        nameSmoothed.replace(name.size() - 4, 4, ".smoothed.npz");
+        if(sharded)
+          checkpoints.push_back({{{nameSmoothed, false}},
+                                 [this](float* host) { copyShards(host, true); }});
+        else if(opt_->smoothed())
+          checkpoints.push_back({{{nameSmoothed, false}}, [this](float* host) {
+            Tensor avg = opt_->smoothed();
+            cudaSetDevice(avg->getDevice());
+            CUDA_CHECK(cudaMemcpy(host, avg->data(), avg->size() * sizeof(float),
+                                  cudaMemcpyDeviceToHost));
+          }});
+      }
 
-        builders_[0]->save(graphs_[0], name, true);
-        reporter_->save(name);
+      checkpointer_.save(graphs_[0], builders_[0], checkpoints);
+      reporter_->workspacePeaks = workspacePeaks(options_, graphs_);
+      reporter_->save(name);
+    }
+
+    /** @brief Replaces the parameters of the worker's  graph  by their moving average */
+    void useSmoothed(Ptr<ExpressionGraph> graph) {
+      Tensor vals = graph->params().vals();
+      if(graphs_.size() < 2) {
+        if(!opt_->smoothed())
+          return;
+        if(!backup_) {
+          backupAlloc_ = New<TensorAllocator>(graph->getDevice());
+          backupAlloc_->reserveExact(vals->size());
+          backupAlloc_->allocate(backup_, {1, (int)vals->size()});
+        }
+        backup_->copyFrom(vals);
+        vals->copyFrom(opt_->smoothed());
+      }
+      else {
+        std::vector<std::future<void>> copied;
+        int pos = 0;
+        for(int idx = 0; idx < devices_.size(); idx++) {
+          copied.push_back(enqueueShard(idx, [=]() {
+            onShard(idx);
+            Tensor src = smoothedShard(idx);
+            CUDA_CHECK(cudaMemcpyPeerAsync(vals->data() + pos, vals->getDevice(),
+                                           src->data(), devices_[idx],
+                                           src->size() * sizeof(float),
+                                           currentStream()));
+            CUDA_CHECK(cudaStreamSynchronize(currentStream()));
+          }));
+          pos += shardSize_;
+        }
+        for(auto& c : copied)
+          c.get();
+      }
+      graph->invalidateHalfParams();
+    }
+
+    /** @brief Undoes useSmoothed(),  seen  are the shard versions of the worker */
+    void useTrained(Ptr<ExpressionGraph> graph, std::vector<size_t>& seen) {
+      if(graphs_.size() < 2) {
+        if(opt_->smoothed())
+          graph->params().vals()->copyFrom(backup_);
+        graph->invalidateHalfParams();
+      }
+      else {
+        seen.clear();
+        fetchParams(graph, seen);
       }
     }
 };
@@ -257,92 +1633,429 @@ class SyncGraphGroup : public GraphGroup {
   private:
     Ptr<Builder> builder_;
     std::vector<Ptr<data::CorpusBatch>> batches_;
+    Ptr<LossScaler> scaler_;
+    std::vector<Ptr<CostAccumulator>> costs_;
+    // per graph, logged by the reporter
+    std::vector<Ptr<WorkerStats>> workerStats_;
 
     bool first_{true};
+    // batches handed to the workers, ids of the batches in the trace
+    size_t fed_{0};
 
-    void accumulateGradients(Ptr<ExpressionGraph> master,
-                             std::vector<Ptr<ExpressionGraph>> graphs) {
-      if(graphs_.size() < 2) {
+    // --optimizer-delay, rounds of batches accumulated before each update,
+    // and the rounds accumulated so far
+    size_t delay_{1};
+    size_t delayed_{0};
+
+    // every graph updates its own replica with the same reduced gradient
+    std::vector<Ptr<OptimizerBase>> optimizers_;
+
+    // other processes training the same model, see --cluster-nodes
+    Ptr<Cluster> cluster_;
+
+    Checkpointer checkpointer_;
+
+    // one long-lived thread per device runs all work on its graph, in
+    // submission order, a step waits for the tasks of all of them
+    std::vector<UPtr<ThreadPool>> workers_;
+    std::mutex sync_;
+
+    // optimizer updates queued behind the last all-reduce, the next round's
+    // forward() waits for them on the device, updated_ is recorded after them
+    std::vector<std::future<void>> updates_;
+    std::vector<cudaEvent_t> updated_;
+
+    // per device, recorded on the graph's stream after its backward pass and
+    // on the stream of the main thread after the all-reduce, which orders the
+    // collective between them and the scaling on the worker streams
+    std::vector<cudaEvent_t> backward_;
+    std::vector<cudaEvent_t> reduced_;
+
+    // --comm-fp16, per device the error feedback residual of its gradient,
+    // the gradient in fp16 and without NCCL a shard received from a peer
+    bool commHalf_{false};
+    std::vector<Tensor> residuals_;
+    std::vector<Ptr<TensorAllocator>> residualsAlloc_;
+    std::vector<UPtr<HalfBuffer>> halfGrads_;
+    std::vector<UPtr<HalfBuffer>> halfTemps_;
+
+#ifdef NCCL_FOUND
+    std::vector<ncclComm_t> comms_;
+
+    /** Communicators of the local devices among the devices of all nodes */
+    void initComms() {
+      size_t local = graphs_.size();
+      size_t world = local * cluster_->nodes();
+
+      ncclUniqueId id;
+      if(cluster_->rank() == 0)
+        NCCL_CHECK(ncclGetUniqueId(&id));
+      std::string blob = cluster_->broadcast(std::string((const char*)&id, sizeof(id)));
+      UTIL_THROW_IF2(blob.size() != sizeof(id), "Received an invalid NCCL id");
+      std::copy(blob.begin(), blob.end(), (char*)&id);
+
+      // every node has to train on the same number of devices
+      comms_.resize(local);
+      NCCL_CHECK(ncclGroupStart());
+      for(size_t i = 0; i < local; ++i) {
+        cudaSetDevice(graphs_[i]->getDevice());
+        NCCL_CHECK(ncclCommInitRank(&comms_[i], world, id, cluster_->rank() * local + i));
+      }
+      NCCL_CHECK(ncclGroupEnd());
+    }
+#else
+    // graph i sums shard i of all gradients, received in temps_[i]
+    size_t shardSize_{0};
+    std::vector<Tensor> temps_;
+    std::vector<Ptr<TensorAllocator>> tempsAlloc_;
+#endif
+
+    /** @brief Queues  f(i)  on the thread of every device  i  without waiting */
+    template <class F>
+    std::vector<std::future<void>> enqueueEachDevice(F f) {
+      std::vector<std::future<void>> done;
+      for(size_t i = 0; i < graphs_.size(); ++i)
+        done.push_back(workers_[i]->enqueue([this, f, i]() {
+          cudaSetDevice(graphs_[i]->getDevice());
+          f(i);
+        }));
+      return done;
+    }
+
+    /** @brief Runs  f(i)  for every device  i  and waits until it has finished on the device */
+    template <class F>
+    void forEachDevice(F f) {
+      auto done = enqueueEachDevice([f](size_t i) {
+        f(i);
+        cudaStreamSynchronize(currentStream());
+      });
+      for(auto& d : done)
+        d.get();
+    }
+
+    /** @brief Blocks until the queued optimizer updates have run on the devices */
+    void waitUpdates() {
+      for(auto& u : updates_)
+        u.get();
+      updates_.clear();
+      for(size_t i = 0; i < updated_.size(); ++i) {
+        cudaSetDevice(graphs_[i]->getDevice());
+        cudaEventSynchronize(updated_[i]);
+      }
+    }
+
+    /**
+     * Replaces the gradients of all graphs by their sum times  factor . With
+     * NCCL this is a ring all-reduce, otherwise a reduce-scatter followed by
+     * an all-gather through peer copies, where every device reduces and
+     * sends one shard. Either way each device moves 2(n-1)/n of the gradient
+     * in parallel and all replicas end up with identical gradients. Across
+     * --cluster-nodes only the NCCL version is available. With --comm-fp16
+     * see allReduceHalf().
+     */
+    void allReduceGradients(float factor) {
+      if(graphs_.size() < 2 && cluster_->nodes() < 2) {
+        if(factor != 1.f)
+          Element(_1 *= factor, graphs_[0]->params().grads());
         return;
       }
+      if(commHalf_) {
+        allReduceHalf(factor);
+        return;
+      }
+
+#ifdef NCCL_FOUND
+      if(comms_.empty())
+        initComms();
+
+      // the collective reads the gradients once the backward passes on the
+      // graphs' streams have written them
+      for(size_t i = 0; i < graphs_.size(); ++i) {
+        cudaSetDevice(graphs_[i]->getDevice());
+        CUDA_CHECK(cudaStreamWaitEvent(currentStream(), backward_[i], 0));
+      }
+
+      NCCL_CHECK(ncclGroupStart());
+      for(size_t i = 0; i < graphs_.size(); ++i) {
+        Tensor grads = graphs_[i]->params().grads();
+        cudaSetDevice(graphs_[i]->getDevice());
+        NCCL_CHECK(ncclAllReduce(grads->data(), grads->data(), grads->size(),
+                                 ncclFloat, ncclSum, comms_[i], currentStream()));
+      }
+      NCCL_CHECK(ncclGroupEnd());
+      for(size_t i = 0; i < graphs_.size(); ++i) {
+        cudaSetDevice(graphs_[i]->getDevice());
+        CUDA_CHECK(cudaEventRecord(reduced_[i], currentStream()));
+      }
+
+      // the workers scale on their own streams, behind the all-reduce
+      forEachDevice([this, factor](size_t i) {
+        CUDA_CHECK(cudaStreamWaitEvent(currentStream(), reduced_[i], 0));
+        Element(_1 *= factor, graphs_[i]->params().grads());
+      });
+#else
+      size_t n = graphs_.size();
+      size_t totalSize = graphs_[0]->params().grads()->size();
+      if(temps_.empty()) {
+        shardSize_ = (totalSize + n - 1) / n;
+        for(auto graph : graphs_) {
+          tempsAlloc_.push_back(New<TensorAllocator>(graph->getDevice()));
+          tempsAlloc_.back()->reserveExact(shardSize_);
+          temps_.emplace_back();
+          tempsAlloc_.back()->allocate(temps_.back(), {1, (int)shardSize_});
+        }
+      }
 
-      Tensor grads = master->params().grads();
-      Tensor tempGrads;
-      master->tensor(tempGrads, grads->shape());
+      auto shard = [this, totalSize](Tensor t, size_t i) {
+        size_t pos = std::min(i * shardSize_, totalSize);
+        return t->subtensor(pos, std::min(shardSize_, totalSize - pos));
+      };
+
+      // reduce-scatter: shard i of every gradient is only written by device i
+      forEachDevice([&](size_t i) {
+        Tensor sum = shard(graphs_[i]->params().grads(), i);
+        if(sum->size() == 0)
+          return;
+        Tensor temp = temps_[i]->subtensor(0, sum->size());
+        for(size_t j = 0; j < n; ++j) {
+          if(j != i) {
+            temp->copyFrom(shard(graphs_[j]->params().grads(), i));
+            Element(_1 += _2, sum, temp);
+          }
+        }
+        Element(_1 *= factor, sum);
+      });
+
+      // all-gather: device i fetches the reduced shards of all others
+      forEachDevice([&](size_t i) {
+        for(size_t j = 0; j < n; ++j) {
+          Tensor part = shard(graphs_[i]->params().grads(), j);
+          if(j != i && part->size() > 0)
+            part->copyFrom(shard(graphs_[j]->params().grads(), j));
+        }
+      });
+#endif
+    }
 
-      for(auto graph : graphs) {
-        if(graph != master) {
-          Tensor remoteGrads = graph->params().grads();
-          tempGrads->copyFrom(remoteGrads);
-          Element(_1 += _2, grads, tempGrads);
+    /**
+     * allReduceGradients() in fp16: every device converts its gradient with
+     * error feedback, divided by the number of devices so that the sums stay
+     * in range. With NCCL the ring sums in fp16. Without NCCL device i sums
+     * shard i of all of them in fp32 and sends the sum in fp16, rounded once
+     * for all devices, itself included, so the replicas stay identical.
+     */
+    void allReduceHalf(float factor) {
+      size_t n = graphs_.size();
+      size_t world = n * cluster_->nodes();
+      size_t totalSize = graphs_[0]->params().grads()->size();
+      size_t shardSize = (totalSize + n - 1) / n;
+      float sendScale = commScale(options_) / world;
+      float scale = factor / sendScale;
+
+      if(halfGrads_.empty()) {
+        for(auto graph : graphs_) {
+          residualsAlloc_.push_back(New<TensorAllocator>(graph->getDevice()));
+          residualsAlloc_.back()->reserveExact(totalSize);
+          residuals_.emplace_back();
+          residualsAlloc_.back()->allocate(residuals_.back(), {1, (int)totalSize});
+          residuals_.back()->set(0);
+          halfGrads_.emplace_back(new HalfBuffer(graph->getDevice(), totalSize));
+#ifndef NCCL_FOUND
+          halfTemps_.emplace_back(new HalfBuffer(graph->getDevice(), shardSize));
+#endif
         }
       }
 
-      float denom = graphs_.size();
-      Element(_1 /= denom, grads);
+      forEachDevice([&](size_t i) {
+        Tensor grads = graphs_[i]->params().grads();
+        CompressHalf(halfGrads_[i]->data, grads->data(), residuals_[i]->data(),
+                     totalSize, sendScale);
+      });
+
+#ifdef NCCL_FOUND
+      if(comms_.empty())
+        initComms();
+
+      NCCL_CHECK(ncclGroupStart());
+      for(size_t i = 0; i < n; ++i) {
+        cudaSetDevice(graphs_[i]->getDevice());
+        NCCL_CHECK(ncclAllReduce(halfGrads_[i]->data, halfGrads_[i]->data, totalSize,
+                                 ncclHalf, ncclSum, comms_[i], currentStream()));
+      }
+      NCCL_CHECK(ncclGroupEnd());
+      for(size_t i = 0; i < n; ++i) {
+        cudaSetDevice(graphs_[i]->getDevice());
+        CUDA_CHECK(cudaEventRecord(reduced_[i], currentStream()));
+      }
+
+      forEachDevice([&](size_t i) {
+        CUDA_CHECK(cudaStreamWaitEvent(currentStream(), reduced_[i], 0));
+        ExpandHalf(graphs_[i]->params().grads()->data(), halfGrads_[i]->data,
+                   totalSize, scale);
+      });
+#else
+      auto range = [&](size_t i, size_t& pos, size_t& size) {
+        pos = std::min(i * shardSize, totalSize);
+        size = std::min(shardSize, totalSize - pos);
+      };
+      // a peer's fp16 shard, copied into the own receive buffer
+      auto receive = [&](size_t i, size_t j, size_t pos, size_t size) -> const __half* {
+        if(j == i)
+          return halfGrads_[i]->data + pos;
+        CUDA_CHECK(cudaMemcpyPeerAsync(halfTemps_[i]->data, graphs_[i]->getDevice(),
+                                       halfGrads_[j]->data + pos, graphs_[j]->getDevice(),
+                                       size * sizeof(__half), currentStream()));
+        return halfTemps_[i]->data;
+      };
+
+      // reduce-scatter, shard i of the fp16 gradients is only written by device i
+      forEachDevice([&](size_t i) {
+        size_t pos, size;
+        range(i, pos, size);
+        if(size == 0)
+          return;
+        float* sum = graphs_[i]->params().grads()->data() + pos;
+        for(size_t j = 0; j < n; ++j)
+          ExpandHalf(sum, receive(i, j, pos, size), size, 1.f, j > 0);
+        CompressHalf(halfGrads_[i]->data + pos, sum, nullptr, size, 1.f);
+        ExpandHalf(sum, halfGrads_[i]->data + pos, size, scale);
+      });
+
+      // all-gather
+      forEachDevice([&](size_t i) {
+        for(size_t j = 0; j < n; ++j) {
+          size_t pos, size;
+          range(j, pos, size);
+          if(j != i && size > 0)
+            ExpandHalf(graphs_[i]->params().grads()->data() + pos,
+                       receive(i, j, pos, size), size, scale);
+        }
+      });
+#endif
     }
 
-    void distributeParameters(Ptr<ExpressionGraph> master,
-                              std::vector<Ptr<ExpressionGraph>> graphs) {
-      if(graphs_.size() < 2)
+    /**
+     * Runs one batch per graph and accumulates their gradients, every --optimizer-delay
+     * rounds, or with  flush  once anything is accumulated, all-reduces them
+     * and updates all replicas.
+     */
+    void execute(bool flush = false) {
+      if(batches_.empty() && !(flush && delayed_ > 0))
+        return;
+      if(!batches_.empty())
+        accumulate();
+      if(delayed_ == 0 || (delayed_ < delay_ && !flush))
         return;
 
-      Tensor params = master->params().vals();
-      for(auto graph : graphs) {
-        if(graph != master) {
-          graph->params().vals()->copyFrom(params);
-        }
+      // sum, average over the graphs and rounds and undo the loss scale in one pass
+      float factor = 1.f / (graphs_.size() * cluster_->nodes() * delayed_
+                            * (scaler_ ? scaler_->scale() : 1.f));
+      {
+        TraceRange range("allReduce");
+        auto start = std::chrono::steady_clock::now();
+        allReduceGradients(factor);
+        // a collective, every worker waits for all of it
+        uint64_t micros = microsSince(start);
+        for(auto& stats : workerStats_)
+          stats->commMicros += micros;
       }
+      // each worker queues its update and goes on with the next round, whose
+      // forward() waits for the update on the device while the host builds
+      // the graph and the main thread collects the next batches
+      if(!scaler_ || scaler_->check(graphs_[0]->params().grads()))
+        updates_ = enqueueEachDevice([this](size_t i) {
+          TraceRange range("update");
+          optimizers_[i]->update(graphs_[i]);
+          CUDA_CHECK(cudaEventRecord(updated_[i], currentStream()));
+        });
+      delayed_ = 0;
     }
 
-    void execute() {
+    void accumulate() {
+      // the sentences of all batches are redistributed by their padded size,
+      // so that no device waits for one that got the longest sentences
+      if(batches_.size() > 1)
+        batches_ = data::CorpusBatch::merge(batches_)->splitBalanced(batches_.size());
+
       if(first_) {
-        for(auto graph : graphs_) {
+        initReplicas(graphs_, [&](Ptr<ExpressionGraph> graph) {
           builder_->build(graph, batches_[0]);
-          graph->forward();
-        }
-        distributeParameters(graphs_[0], graphs_);
+        });
         first_ = false;
       }
 
-      auto task = [this](int i,
-                         Ptr<data::CorpusBatch> batch) {
-        thread_local int j = -1;
-        if(j == -1)
-          j = i;
-        auto localGraph = this->graphs_[j];
-
-        builder_->build(localGraph, batch);
-        localGraph->forward();
-        float cost = localGraph->topNode()->scalar();
-        localGraph->backward();
+      // gradients are averaged over the graphs, weighting each loss by its
+      // batch's share of the sentences keeps that an average over sentences
+      // when batches differ in size, e.g. with --mini-batch-words
+      size_t sentences = 0;
+      for(auto& batch : batches_)
+        sentences += batch->size();
+
+      auto task = [this, sentences](size_t i, Ptr<data::CorpusBatch> batch, size_t id) {
+        auto localGraph = this->graphs_[i];
+        auto costs = this->costs_[i];
+        auto stats = this->workerStats_[i];
+        Tracer::context(localGraph->getDevice(), id);
+
+        float weight = batches_.size() * batch->size() / (float)sentences;
+        {
+          WorkerTimer timer(stats->computeMicros);
+          resilientStep(localGraph, builder_, batch, costs,
+                        (scaler_ ? scaler_->scale() : 1.f) * weight,
+                        [](Ptr<ExpressionGraph>) {},
+                        delayed_ > 0);
+          // backward passes finish on the graph's own stream, the all-reduce
+          // waits for backward_ and the costs are read on the host
+          CUDA_CHECK(cudaEventRecord(backward_[i], localGraph->getStream()));
+          cudaStreamSynchronize(localGraph->getStream());
+        }
+        stats->batches++;
+        stats->words += batch->words();
 
         if(reporter_) {
-          reporter_->update(cost, batch);
-          if(reporter_->batches % options_->get<size_t>("save-freq") == 0)
+          std::unique_lock<std::mutex> guard(sync_, std::defer_lock);
+          {
+            TraceRange range("wait sync_");
+            WorkerTimer timer(stats->lockMicros);
+            guard.lock();
+          }
+          size_t n = costs->batches();
+          if(n >= reportInterval(options_, graphs_.size()))
+            reporter_->addCost(costs->read(), n);
+          reporter_->update(batch);
+          if(reporter_->batches % options_->snapshot().saveFreq == 0)
             this->save();
         }
       };
 
-      {
-        size_t workers = graphs_.size();
-        ThreadPool pool(workers, workers);
-
-        for(int i = 0; i < batches_.size(); ++i)
-          pool.enqueue(task, i % (int)workers, batches_[i]);
+      // graph i runs its batches behind its last update on its own worker,
+      // the futures also rethrow errors of the updates
+      std::vector<std::future<void>> done;
+      for(size_t i = 0; i < batches_.size(); ++i) {
+        size_t device = i % graphs_.size();
+        auto batch = batches_[i];
+        size_t id = fed_++;
+        done.push_back(workers_[device]->enqueue([this, task, device, batch, id]() {
+          cudaSetDevice(graphs_[device]->getDevice());
+          task(device, batch, id);
+        }));
       }
-      accumulateGradients(graphs_[0], graphs_);
-      opt_->update(graphs_[0]);
-      distributeParameters(graphs_[0], graphs_);
+      for(auto& d : done)
+        d.get();
+      // ran before the batches on every worker, a save() may have waited for them
+      for(auto& u : updates_)
+        u.get();
+      updates_.clear();
 
       batches_.clear();
+      delayed_++;
     }
 
     void load() {
       if(options_->has("init")) {
         std::string init = options_->get<std::string>("init");
-        for(auto graph : graphs_)
-        builder_->load(graph, init);
+        // the other graphs copy the parameters of the first, see initReplicas()
+        builder_->load(graphs_[0], init);
       }
     }
 
@@ -351,22 +2064,77 @@ class SyncGraphGroup : public GraphGroup {
 
     SyncGraphGroup(Ptr<Config> options)
      : GraphGroup(options),
-       builder_{New<Builder>(options_)} {
+       builder_{New<Builder>(options_)},
+       delay_{std::max((size_t)1, options_->get<size_t>("optimizer-delay"))},
+       cluster_{New<Cluster>(options_)},
+       commHalf_{options_->get<bool>("comm-fp16")} {
+#ifndef NCCL_FOUND
+      UTIL_THROW_IF2(cluster_->nodes() > 1, "Training on several nodes requires NCCL");
+#endif
+
+      if(options_->get<bool>("fp16"))
+        scaler_ = New<LossScaler>(options_->get<double>("loss-scale"));
 
       auto devices = options_->get<std::vector<size_t>>("devices");
       size_t workers = devices.size();
 
       for(auto device : devices) {
         graphs_.emplace_back(New<ExpressionGraph>());
-        graphs_.back()->setDevice(device);
-        graphs_.back()->reserveWorkspaceMB(options_->get<size_t>("workspace"));
+        graphs_.back()->setDevice(device, allocationStrategy(options_));
+        reserveWorkspace(graphs_.back(), options_);
+        shareDevice(graphs_.back(), options_);
+        graphs_.back()->setMemoryPlanning(options_->get<bool>("memory-plan")
+                                          || options_->get<bool>("cuda-graphs"));
+        graphs_.back()->setCudaGraphs(options_->get<bool>("cuda-graphs"));
+        graphs_.back()->setStreams(options_->get<size_t>("streams"));
+        graphs_.back()->setFusion(options_->get<bool>("fuse-elementwise"));
+        graphs_.back()->setAdjointArena(options_->get<bool>("adjoint-arena"));
+        graphs_.back()->setPersistentRnn(options_->get<bool>("persistent-rnn"));
+        graphs_.back()->setHotRows(options_->get<size_t>("embedding-hot-rows"));
+        graphs_.back()->setAutotune(options_->get<std::string>("autotune"));
+        if(options_->has("freeze"))
+          graphs_.back()->setFrozen(options_->get<std::vector<std::string>>("freeze"));
+        if(options_->has("managed-params"))
+          graphs_.back()->setManaged(options_->get<std::vector<std::string>>("managed-params"));
+        graphs_.back()->setGemmAutotune(options_->get<bool>("gemm-autotune"),
+                                        options_->get<std::string>("gemm-autotune-cache"));
+        graphs_.back()->setCheckpointing(checkpointGranularity(options_));
+        graphs_.back()->setMemoryTrace(deviceFile(options_, "memory-trace", device));
+        graphs_.back()->setProfiling(options_->get<size_t>("profile"),
+                                     deviceFile(options_, "profile-trace", device));
+        graphs_.back()->setHalfPrecision(options_->get<bool>("fp16"));
+        costs_.push_back(New<CostAccumulator>(device));
+        workerStats_.push_back(New<WorkerStats>(device));
+        optimizers_.push_back(optimizers_.empty() ? opt_ : Optimizer(options_));
+        workers_.emplace_back(new ThreadPool(1));
+        workers_.back()->enqueue([device]() { numa::bindThread(device); });
+
+        cudaEvent_t updated, backward, reduced;
+        cudaSetDevice(device);
+        CUDA_CHECK(cudaEventCreateWithFlags(&updated, cudaEventDisableTiming));
+        CUDA_CHECK(cudaEventCreateWithFlags(&backward, cudaEventDisableTiming));
+        CUDA_CHECK(cudaEventCreateWithFlags(&reduced, cudaEventDisableTiming));
+        updated_.push_back(updated);
+        backward_.push_back(backward);
+        reduced_.push_back(reduced);
       }
 
       load();
     }
 
     ~SyncGraphGroup() {
-      execute();
+      execute(true);
+      waitUpdates();
+      for(auto event : updated_)
+        cudaEventDestroy(event);
+      for(auto event : backward_)
+        cudaEventDestroy(event);
+      for(auto event : reduced_)
+        cudaEventDestroy(event);
+#ifdef NCCL_FOUND
+      for(auto comm : comms_)
+        ncclCommDestroy(comm);
+#endif
     }
 
     void update(Ptr<data::CorpusBatch> batch) {
@@ -375,18 +2143,330 @@ class SyncGraphGroup : public GraphGroup {
         execute();
     }
 
+    void setReporter(Ptr<Reporter> reporter) {
+      GraphGroup::setReporter(reporter);
+      for(auto& stats : workerStats_)
+        reporter->addWorkerStats(stats);
+    }
+
+    /**
+     * The epoch ends on all nodes as soon as one has no batch left, so that
+     * every node takes part in every all-reduce. The rest is dropped.
+     */
+    bool feed(bool has) {
+      return cluster_->all(has);
+    }
+
     void save() {
+      TraceRange range("save");
+      // all nodes hold the same parameters
+      if(cluster_->rank() != 0)
+        return;
+      // called between rounds, the last update of graph 0 may still be running
+      if(!updates_.empty())
+        updates_[0].wait();
+      cudaSetDevice(graphs_[0]->getDevice());
+      cudaEventSynchronize(updated_[0]);
       if(options_->get<bool>("overwrite")) {
         std::string name = options_->get<std::string>("model") + ".npz";
-        builder_->save(graphs_[0], name);
+        checkpointer_.save(graphs_[0], builder_, {{name, false}});
       }
       else {
         std::string name = options_->get<std::string>("model")
           + "." + std::to_string(reporter_->batches) + ".npz";
-        builder_->save(graphs_[0], name);
+        checkpointer_.save(graphs_[0], builder_, {{name, false}});
+      }
+      }
+      reporter_->workspacePeaks = workspacePeaks(options_, graphs_);
+      reporter_->save(options_->get<std::string>("model"));
+    }
+
+};
+
+/**
+ * @brief Pipeline model parallelism, see --pipeline: the encoder is trained on
+ * the first of --devices, decoder and output layer on the second.
+ *
+ * Each batch is split into --pipeline-micro-batches parts. While the decoder
+ * runs forward and backward pass of part k on the context copied from the
+ * encoder's device, the encoder runs the forward pass of part k+1. The gradient
+ * of the context goes back the same way and seeds the encoder's backward pass
+ * of part k, which first recomputes the forward pass of the part with the same
+ * dropout masks, as the graph has already moved on to the next part. Each
+ * device accumulates the gradients of its parameters over the parts and
+ * updates them with its own optimizer, so gradients are clipped per stage.
+ */
+template <class Builder>
+class PipelineGraphGroup : public GraphGroup {
+  private:
+    Ptr<Builder> builder_;
+    Ptr<CostAccumulator> costs_;
+    size_t micro_{1};
+
+    // graphs_[0] is the encoder stage and graphs_[1] the decoder stage, each
+    // with its own optimizer and worker thread
+    std::vector<Ptr<OptimizerBase>> optimizers_;
+    std::vector<UPtr<ThreadPool>> workers_;
+    bool built_[2]{false, false};
+
+    // the part whose forward pass the encoder graph holds, and the dropout
+    // seeds handed out before the forward passes of the last two parts
+    size_t encoded_{0};
+    size_t seeds_[2];
+
+    /**
+     * A tensor sent to the other stage, grown on demand. ready is recorded
+     * on the sender's device once the copy is queued.
+     */
+    struct Staging {
+      Ptr<TensorAllocator> alloc;
+      Tensor buffer;
+      Tensor tensor;
+      cudaEvent_t ready;
+    };
+
+    // the last two contexts on the decoder's device and their gradients on
+    // the encoder's device
+    Staging contexts_[2];
+    Staging gradients_[2];
+
+    Checkpointer checkpointer_;
+
+    /** @brief Peer copies  in  into  staging  on  device  and records its event */
+    void send(Staging& staging, size_t device, Tensor in) {
+      if(!staging.buffer || staging.buffer->size() < in->size()) {
+        staging.alloc = New<TensorAllocator>(device);
+        staging.alloc->reserveExact(in->size());
+        staging.alloc->allocate(staging.buffer, {1, (int)in->size()});
+      }
+      staging.tensor = Tensor(new TensorBase(staging.buffer->data(), in->shape(), device));
+      CUDA_CHECK(cudaMemcpyPeerAsync(staging.tensor->data(), device,
+                                     in->data(), in->getDevice(),
+                                     in->size() * sizeof(float), currentStream()));
+      CUDA_CHECK(cudaEventRecord(staging.ready, currentStream()));
+    }
+
+    /** @brief Drops the parameters of the other stage on the first build of stage  i  */
+    void prune(size_t i) {
+      if(!built_[i]) {
+        graphs_[i]->pruneParams();
+        built_[i] = true;
+      }
+    }
+
+    /** @brief Builds the encoder stage for  part , the  k -th part of the batch */
+    Expr encode(Ptr<data::CorpusBatch> part, size_t k) {
+      auto graph = graphs_[0];
+      auto context = builder_->buildContext(graph, part);
+      prune(0);
+      graph->forward();
+      encoded_ = k;
+      return context;
+    }
+
+    void forwardEncoder(Ptr<data::CorpusBatch> part, size_t k) {
+      seeds_[k % 2] = graphs_[0]->dropoutSeeds();
+      auto context = encode(part, k);
+      send(contexts_[k % 2], graphs_[1]->getDevice(), context->val());
+    }
+
+    void backwardEncoder(Ptr<data::CorpusBatch> part, size_t k) {
+      auto graph = graphs_[0];
+      if(encoded_ != k) {
+        size_t seeds = graph->dropoutSeeds();
+        graph->setDropoutSeeds(seeds_[k % 2]);
+        encode(part, k);
+        graph->setDropoutSeeds(seeds);
+      }
+      Staging& gradient = gradients_[k % 2];
+      CUDA_CHECK(cudaEventSynchronize(gradient.ready));
+      graph->backward(k > 0, [&gradient](Tensor adj) {
+        CUDA_CHECK(cudaMemcpyAsync(adj->data(), gradient.tensor->data(),
+                                   adj->size() * sizeof(float),
+                                   cudaMemcpyDeviceToDevice, currentStream()));
+      });
+    }
+
+    void decodePart(Ptr<data::CorpusBatch> part, size_t k, float share) {
+      auto graph = graphs_[1];
+      Staging& context = contexts_[k % 2];
+      CUDA_CHECK(cudaEventSynchronize(context.ready));
+      builder_->buildFromContext(graph, part, context.tensor);
+      prune(1);
+      graph->forward();
+      costs_->add(graph->topNode(), share);
+      graph->setLossScale(share);
+      graph->backward(k > 0);
+      send(gradients_[k % 2], graphs_[0]->getDevice(),
+           graph->get("pipeline_context")->grad());
+    }
+
+    /** @brief Fails the promises from  next  on, so that the other stage stops waiting */
+    static void abandon(std::vector<std::promise<void>>& promises, size_t next) {
+      for(size_t k = next; k < promises.size(); ++k)
+        promises[k].set_exception(std::current_exception());
+    }
+
+    void execute(Ptr<data::CorpusBatch> batch) {
+      auto parts = batch->split(micro_);
+      size_t n = parts.size();
+
+      // contexts sent to the decoder and gradients returned to the encoder
+      std::vector<std::promise<void>> sent(n), returned(n);
+      std::vector<std::future<void>> received, gradients;
+      for(size_t k = 0; k < n; ++k) {
+        received.push_back(sent[k].get_future());
+        gradients.push_back(returned[k].get_future());
+      }
+
+      auto encoding = workers_[0]->enqueue([&]() {
+        cudaSetDevice(graphs_[0]->getDevice());
+        size_t next = 0;
+        try {
+          for(size_t k = 0; k < n; ++k) {
+            forwardEncoder(parts[k], k);
+            sent[k].set_value();
+            next++;
+            if(k > 0) {
+              gradients[k - 1].get();
+              backwardEncoder(parts[k - 1], k - 1);
+            }
+          }
+          gradients[n - 1].get();
+          backwardEncoder(parts[n - 1], n - 1);
+          optimizers_[0]->update(graphs_[0]);
+          cudaStreamSynchronize(currentStream());
+        }
+        catch(...) {
+          abandon(sent, next);
+          throw;
+        }
+      });
+
+      auto decoding = workers_[1]->enqueue([&]() {
+        cudaSetDevice(graphs_[1]->getDevice());
+        size_t next = 0;
+        try {
+          for(size_t k = 0; k < n; ++k) {
+            received[k].get();
+            decodePart(parts[k], k, parts[k]->size() / (float)batch->size());
+            returned[k].set_value();
+            next++;
+          }
+          optimizers_[1]->update(graphs_[1]);
+          cudaStreamSynchronize(currentStream());
+        }
+        catch(...) {
+          abandon(returned, next);
+          throw;
+        }
+      });
+
+      // both stages refer to the promises, wait for both before rethrowing
+      encoding.wait();
+      decoding.wait();
+      encoding.get();
+      decoding.get();
+
+      cudaSetDevice(graphs_[1]->getDevice());
+      costs_->commit();
+      if(reporter_) {
+        size_t batches = costs_->batches();
+        if(batches >= reportInterval(options_, 1))
+          reporter_->addCost(costs_->read(), batches);
+        reporter_->update(batch);
+        if(reporter_->batches % options_->snapshot().saveFreq == 0)
+          save();
+      }
+    }
+
+  public:
+    typedef Builder builder_type;
+
+    PipelineGraphGroup(Ptr<Config> options)
+     : GraphGroup(options),
+       builder_{New<Builder>(options_)},
+       micro_{std::max((size_t)1, options_->get<size_t>("pipeline-micro-batches"))} {
+      auto devices = options_->get<std::vector<size_t>>("devices");
+      UTIL_THROW_IF2(devices.size() != 2,
+                     "--pipeline trains on exactly two devices, the encoder on the first");
+      UTIL_THROW_IF2(options_->get<bool>("fp16"), "--pipeline does not support --fp16");
+      UTIL_THROW_IF2(options_->get<size_t>("optimizer-delay") > 1,
+                     "--pipeline does not support --optimizer-delay, use --pipeline-micro-batches");
+
+      for(size_t i = 0; i < devices.size(); ++i) {
+        size_t device = devices[i];
+        graphs_.emplace_back(New<ExpressionGraph>());
+        graphs_.back()->setDevice(device, allocationStrategy(options_));
+        reserveWorkspace(graphs_.back(), options_);
+        shareDevice(graphs_.back(), options_);
+        graphs_.back()->setStreams(options_->get<size_t>("streams"));
+        graphs_.back()->setFusion(options_->get<bool>("fuse-elementwise"));
+        graphs_.back()->setAdjointArena(options_->get<bool>("adjoint-arena"));
+        graphs_.back()->setAutotune(options_->get<std::string>("autotune"));
+        if(options_->has("freeze"))
+          graphs_.back()->setFrozen(options_->get<std::vector<std::string>>("freeze"));
+        if(options_->has("managed-params"))
+          graphs_.back()->setManaged(options_->get<std::vector<std::string>>("managed-params"));
+        graphs_.back()->setGemmAutotune(options_->get<bool>("gemm-autotune"),
+                                        options_->get<std::string>("gemm-autotune-cache"));
+        graphs_.back()->setCheckpointing(checkpointGranularity(options_));
+        graphs_.back()->setMemoryTrace(deviceFile(options_, "memory-trace", device));
+        graphs_.back()->setProfiling(options_->get<size_t>("profile"),
+                                     deviceFile(options_, "profile-trace", device));
+        optimizers_.push_back(optimizers_.empty() ? opt_ : Optimizer(options_));
+        workers_.emplace_back(new ThreadPool(1));
+        workers_.back()->enqueue([device]() { numa::bindThread(device); });
+
+        // contexts are recorded on the encoder's device, gradients on the decoder's
+        cudaSetDevice(device);
+        for(auto& staging : (i == 0 ? contexts_ : gradients_))
+          CUDA_CHECK(cudaEventCreateWithFlags(&staging.ready, cudaEventDisableTiming));
+
+        int peer = devices[1 - i], can = 0;
+        CUDA_CHECK(cudaDeviceCanAccessPeer(&can, device, peer));
+        if(can) {
+          cudaError_t err = cudaDeviceEnablePeerAccess(peer, 0);
+          if(err == cudaErrorPeerAccessAlreadyEnabled)
+            cudaGetLastError();
+          else
+            CUDA_CHECK(err);
+        }
       }
+      costs_ = New<CostAccumulator>(devices[1]);
+
+      load();
+    }
+
+    ~PipelineGraphGroup() {
+      for(auto& staging : contexts_)
+        cudaEventDestroy(staging.ready);
+      for(auto& staging : gradients_)
+        cudaEventDestroy(staging.ready);
+    }
+
+    void update(Ptr<data::CorpusBatch> batch) {
+      execute(batch);
     }
 
+    void load() {
+      // every stage loads the whole model and drops the other stage's part
+      if(options_->has("init")) {
+        std::string init = options_->get<std::string>("init");
+        for(auto graph : graphs_)
+          builder_->load(graph, init);
+      }
+    }
+
+    void save() {
+      TraceRange range("save");
+      std::string name = options_->get<std::string>("model");
+      if(!options_->get<bool>("overwrite"))
+        name += "." + std::to_string(reporter_->batches);
+      checkpointer_.save(graphs_, builder_, {{name + ".npz", false}});
+      reporter_->workspacePeaks = workspacePeaks(options_, graphs_);
+      reporter_->save(options_->get<std::string>("model"));
+    }
 };
 
 }
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cmath>
+
+#include "common/logging.h"
+#include "kernels/tensor_operators.h"
+
+namespace marian {
+
+/**
+ * @brief Dynamic loss scaling for training with fp16 matrix products.
+ *
+ * The loss adjoint is seeded with scale() so that small gradients survive
+ * the rounding of adjoints to fp16. After backward, unscale() divides the
+ * gradients by the scale. If they overflowed, the scale is halved and the
+ * update has to be skipped; after  window  good updates it is doubled again.
+ */
+class LossScaler {
+  private:
+    float scale_;
+    size_t window_;
+    size_t good_{0};
+
+  public:
+    LossScaler(float scale = 32768.f, size_t window = 2000)
+    : scale_(scale), window_(window) {}
+
+    float scale() {
+      return scale_;
+    }
+
+    /** @brief Unscales  grads  in place, returns false if the update must be skipped */
+    bool unscale(Tensor grads) {
+      float inv = 1.f / scale_;
+      if(!check(grads))
+        return false;
+      Element(_1 *= inv, grads);
+      return true;
+    }
+
+    /**
+     * @brief Adapts the scale to  grads  that were already divided by scale()
+     * elsewhere, returns false if the update must be skipped
+     */
+    bool check(Tensor grads) {
+      float norm = L2Norm(grads);
+      if(!std::isfinite(norm)) {
+        scale_ = std::max(1.f, scale_ / 2.f);
+        good_ = 0;
+        LOG(info, "Gradient overflow, skipping update and lowering loss scale to {}", scale_);
+        return false;
+      }
+
+      if(++good_ == window_) {
+        scale_ *= 2.f;
+        good_ = 0;
+      }
+      return true;
+    }
+};
+
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "marian.h"
+#include "models/dl4mt.h"
+#include "models/gnmt.h"
+#include "models/multi_gnmt.h"
+
+namespace marian {
+
+/**
+ * @brief Trains the model of --type with the graph group selected by
+ * --pipeline and --sync-sgd, asynchronous SGD by default
+ */
+inline void TrainModel(Ptr<Config> options) {
+  auto type = options->get<std::string>("type");
+
+  if(options->get<bool>("pipeline")) {
+    UTIL_THROW_IF2(type == "multi-gnmt", "--pipeline supports a single encoder only");
+    if(type == "gnmt")
+      Train<PipelineGraphGroup<GNMT>>(options);
+    else
+      Train<PipelineGraphGroup<DL4MT>>(options);
+    return;
+  }
+
+  if(options->get<bool>("sync-sgd")) {
+    if(type == "gnmt")
+      Train<SyncGraphGroup<GNMT>>(options);
+    else if(type == "multi-gnmt")
+      Train<SyncGraphGroup<MultiGNMT>>(options);
+    else
+      Train<SyncGraphGroup<DL4MT>>(options);
+    return;
+  }
+
+  // the parameter shards of asynchronous SGD live in one process
+  UTIL_THROW_IF2(options->get<size_t>("cluster-nodes") > 1,
+                 "--cluster-nodes requires --sync-sgd");
+  if(type == "gnmt")
+    Train<AsyncGraphGroup<GNMT>>(options);
+  else if(type == "multi-gnmt")
+    Train<AsyncGraphGroup<MultiGNMT>>(options);
+  else
+    Train<AsyncGraphGroup<DL4MT>>(options);
+}
+
+}
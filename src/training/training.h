@@ -1,9 +1,22 @@
 #pragma once
 
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+#include "common/trace.h"
 #include "data/batch_generator.h"
 #include "data/corpus.h"
+#include "kernels/cuda_helpers.h"
+#include "layers/param_initializers.h"
+#include "tensors/tensor_allocator.h"
 #include "training/config.h"
 #include "training/validator.h"
+#include "training/worker_stats.h"
 
 namespace marian {
 
@@ -15,32 +28,224 @@ class Reporter {
     std::vector<Ptr<Validator>> validators_;
 
     float costSum{0};
+    size_t costBatches{0};
 
     size_t epochs{1};
     size_t samples{0};
     size_t wordsDisp{0};
     size_t batches{0};
 
+    // MB per device of --devices, saved as workspace-peak, see reserveWorkspace()
+    std::vector<size_t> workspacePeaks;
+
     boost::timer::cpu_timer timer;
 
+  private:
+    std::vector<Ptr<data::PipelineStats>> dataStats_;
+    UPtr<std::ofstream> dataStatsFile_;
+    std::vector<Ptr<WorkerStats>> workerStats_;
+
+    /**
+     * Logs words/s and the average step split into compute, communication,
+     * lock wait and idle time of every worker, words/s and memory in use of
+     * every device, and resets the worker counters. With --metrics-file the
+     * same figures are written as Prometheus text, replacing the file.
+     */
+    void logWorkerStats(double seconds) {
+      struct Device {
+        double words{0};
+        size_t used{0};
+      };
+      std::map<int, Device> devices;
+
+      std::stringstream metrics;
+      metrics << "marian_updates_total " << batches << "\n"
+              << "marian_epoch " << epochs << "\n";
+
+      std::stringstream line;
+      for(size_t i = 0; i < workerStats_.size(); ++i) {
+        auto& stats = *workerStats_[i];
+        uint64_t n = stats.batches.exchange(0);
+        double words = stats.words.exchange(0) / std::max(seconds, 1e-6);
+        double compute = stats.computeMicros.exchange(0) / 1000.0;
+        double comm = stats.commMicros.exchange(0) / 1000.0;
+        double lock = stats.lockMicros.exchange(0) / 1000.0;
+        double idle = std::max(0.0, 1000 * seconds - compute - comm - lock);
+        double div = std::max((uint64_t)1, n);
+        devices[stats.device].words += words;
+
+        line << (i ? " | " : "") << i << " (device " << stats.device << "): "
+             << (size_t)words << " words/s, step ";
+        line.precision(1);
+        line << std::fixed << (1000 * seconds / div) << " ms = compute " << compute / div
+             << " + comm " << comm / div << " + lock " << lock / div
+             << " + idle " << idle / div;
+        line.unsetf(std::ios::floatfield);
+
+        std::string labels = "{worker=\"" + std::to_string(i) + "\",device=\""
+                             + std::to_string(stats.device) + "\"}";
+        metrics << "marian_worker_words_per_second" << labels << " " << words << "\n"
+                << "marian_worker_batches" << labels << " " << n << "\n"
+                << "marian_worker_compute_ms" << labels << " " << compute / div << "\n"
+                << "marian_worker_comm_ms" << labels << " " << comm / div << "\n"
+                << "marian_worker_lock_ms" << labels << " " << lock / div << "\n"
+                << "marian_worker_idle_ms" << labels << " " << idle / div << "\n";
+      }
+      LOG(info, "Workers: {}", line.str());
+
+      int current;
+      cudaGetDevice(&current);
+      std::stringstream deviceLine;
+      for(auto& d : devices) {
+        size_t free, total;
+        cudaSetDevice(d.first);
+        CUDA_CHECK(cudaMemGetInfo(&free, &total));
+        d.second.used = total - free;
+        deviceLine << (deviceLine.tellp() > 0 ? " | " : "") << d.first << ": "
+                   << (size_t)d.second.words << " words/s, "
+                   << d.second.used / (1024 * 1024) << " MB used";
+
+        std::string labels = "{device=\"" + std::to_string(d.first) + "\"}";
+        metrics << "marian_device_words_per_second" << labels << " " << d.second.words << "\n"
+                << "marian_device_memory_used_bytes" << labels << " " << d.second.used << "\n";
+      }
+      cudaSetDevice(current);
+      LOG(info, "Devices: {}", deviceLine.str());
+
+      if(options_->has("metrics-file") && !options_->get<std::string>("metrics-file").empty()) {
+        std::string file = options_->get<std::string>("metrics-file");
+        std::string tmp = file + ".tmp";
+        {
+          std::ofstream out(tmp);
+          UTIL_THROW_IF2(!out, "Could not open " << tmp);
+          out << metrics.str();
+        }
+        UTIL_THROW_IF2(std::rename(tmp.c_str(), file.c_str()) != 0,
+                       "Could not rename " << tmp << " to " << file);
+      }
+    }
+
+    /**
+     * Logs the data pipeline counters summed over all batch generators and
+     * resets them.  seconds  is the wall time since the last call. Stage rates
+     * are per busy second of the stage, summed over threads for parsing.
+     */
+    void logDataStats(double seconds) {
+      uint64_t counts[11] = {0};
+      for(auto& stats : dataStats_) {
+        std::atomic<uint64_t>* fields[11] = {
+          &stats->read.items, &stats->read.micros,
+          &stats->parse.items, &stats->parse.micros,
+          &stats->batch.items, &stats->batch.micros,
+          &stats->waitMicros, &stats->nexts, &stats->queued,
+          &stats->words, &stats->paddedWords };
+        for(size_t i = 0; i < 11; ++i)
+          counts[i] += fields[i]->exchange(0);
+      }
+
+      auto rate = [](uint64_t items, uint64_t micros) {
+        return micros ? items * 1e6 / micros : 0.0;
+      };
+      // every generator can wait for the whole interval
+      double wait = seconds > 0
+        ? counts[6] / (seconds * 1e6 * dataStats_.size()) : 0.0;
+      double queued = counts[7] ? counts[8] / (double)counts[7] : 0.0;
+      double padding = counts[10] ? 1.0 - counts[9] / (double)counts[10] : 0.0;
+
+      LOG(data, "Up. {} : wait {:.1f}% : read {:.0f} lines/s : parse {:.0f} sentences/s : "
+          "batch {:.0f} batches/s : ready {:.1f} batches : padding {:.1f}%",
+          batches, 100 * wait, rate(counts[0], counts[1]), rate(counts[2], counts[3]),
+          rate(counts[4], counts[5]), queued, 100 * padding);
+
+      if(options_->has("data-stats")) {
+        if(!dataStatsFile_) {
+          dataStatsFile_.reset(new std::ofstream(options_->get<std::string>("data-stats"),
+                                                 std::ios::app));
+          UTIL_THROW_IF2(!*dataStatsFile_, "Could not open "
+                         << options_->get<std::string>("data-stats"));
+        }
+        *dataStatsFile_ << batches << "\t" << seconds << "\t" << wait
+                        << "\t" << rate(counts[0], counts[1])
+                        << "\t" << rate(counts[2], counts[3])
+                        << "\t" << rate(counts[4], counts[5])
+                        << "\t" << queued << "\t" << padding << std::endl;
+      }
+    }
+
+    // with --valid-async parameters are copied into snapshot_ and validated
+    // on validGraph_ by validThread_ while training continues
+    Ptr<ExpressionGraph> validGraph_;
+    Ptr<TensorAllocator> snapshotAlloc_;
+    std::map<std::string, Tensor> snapshot_;
+    std::thread validThread_;
+
+    void runValidators(Ptr<ExpressionGraph> graph, size_t batches) {
+      for(auto validator : validators_) {
+        if(validator) {
+          float value = validator->validate(graph);
+          if(validator->stalled() > 0)
+            LOG(valid, "{} : {} : {} : stalled {} times", batches,
+              validator->type(), value, validator->stalled());
+          else
+            LOG(valid, "{} : {} : {} : new best", batches,
+              validator->type(), value);
+        }
+      }
+    }
+
+    void snapshot(Ptr<ExpressionGraph> graph) {
+      if(!validGraph_) {
+        int device = options_->get<int>("valid-device");
+        validGraph_ = New<ExpressionGraph>();
+        validGraph_->setDevice(device < 0 ? graph->getDevice() : device);
+        validGraph_->reserveWorkspaceMB(options_->get<size_t>("workspace"));
+        validGraph_->setPriority(priority::low, options_->get<float>("valid-share"));
+
+        snapshotAlloc_ = New<TensorAllocator>(validGraph_->getDevice());
+        snapshotAlloc_->reserveExact(graph->params().totalSize());
+        for(auto& p : graph->params().getMap())
+          snapshotAlloc_->allocate(snapshot_[p.first], p.second->shape());
+      }
+
+      for(auto& p : graph->params().getMap())
+        snapshot_[p.first]->copyFrom(p.second->val());
+    }
+
+    void loadSnapshot() {
+      using namespace keywords;
+      for(auto& s : snapshot_) {
+        auto p = validGraph_->params().get(s.first);
+        if(p && p->val())
+          p->val()->copyFrom(s.second);
+        else if(!p)
+          validGraph_->param(s.first, s.second->shape(),
+                             init=inits::from_device(s.second->data()));
+      }
+    }
+
   public:
     Reporter(Ptr<Config> options) : options_(options) {}
 
+    ~Reporter() {
+      if(validThread_.joinable())
+        validThread_.join();
+    }
+
     bool keepGoing() {
+      auto& opt = options_->snapshot();
+
       // stop if it reached the maximum number of epochs
-      if(options_->get<size_t>("after-epochs") > 0
-         && epochs > options_->get<size_t>("after-epochs"))
+      if(opt.afterEpochs > 0 && epochs > opt.afterEpochs)
         return false;
 
       // stop if it reached the maximum number of batch updates
-      if(options_->get<size_t>("after-batches") > 0
-         && batches >= options_->get<size_t>("after-batches"))
+      if(opt.afterBatches > 0 && batches >= opt.afterBatches)
         return false;
 
       // stop if the first validator did not improve for a given number of checks
-      if(options_->get<size_t>("early-stopping") > 0
+      if(opt.earlyStopping > 0
          && !validators_.empty()
-         && validators_[0]->stalled() >= options_->get<size_t>("early-stopping"))
+         && validators_[0]->stalled() >= opt.earlyStopping)
         return false;
 
       return true;
@@ -56,6 +261,8 @@ class Reporter {
     }
 
     void finished() {
+      if(validThread_.joinable())
+        validThread_.join();
       LOG(info, "Training finshed");
     }
 
@@ -63,21 +270,37 @@ class Reporter {
       validators_.push_back(validator);
     }
 
+    /**
+     * @brief Runs the validators every --valid-freq batches. With --valid-async
+     * only the parameters of  graph  are copied here, validation then runs on
+     * a separate graph and thread, and its results reach stalled() and
+     * keepGoing() when it finishes. A new round waits for the previous one.
+     */
     void validate(Ptr<ExpressionGraph> graph) {
-      if(batches % options_->get<size_t>("valid-freq") == 0) {
-        for(auto validator : validators_) {
-          if(validator) {
-            size_t stalledPrev = validator->stalled();
-            float value = validator->validate(graph);
-            if(validator->stalled() > 0)
-              LOG(valid, "{} : {} : {} : stalled {} times", batches,
-                validator->type(), value, validator->stalled());
-            else
-              LOG(valid, "{} : {} : {} : new best", batches,
-                validator->type(), value);
-          }
-        }
+      if(!validating())
+        return;
+      TraceRange range("validate");
+
+      if(!options_->snapshot().validAsync) {
+        runValidators(graph, batches);
+        return;
       }
+
+      if(validThread_.joinable())
+        validThread_.join();
+      snapshot(graph);
+
+      size_t now = batches;
+      validThread_ = std::thread([this, now]() {
+        cudaSetDevice(validGraph_->getDevice());
+        loadSnapshot();
+        runValidators(validGraph_, now);
+      });
+    }
+
+    /** @brief True if validate() runs the validators after this batch */
+    bool validating() {
+      return batches % options_->snapshot().validFreq == 0 && !validators_.empty();
     }
 
     size_t stalled() {
@@ -87,18 +310,39 @@ class Reporter {
       return 0;
     }
 
-    void update(float cost, Ptr<data::CorpusBatch> batch) {
-      costSum += cost;
+    /** @brief Adds the summed cost of  n  batches, read back from a CostAccumulator */
+    void addCost(float sum, size_t n) {
+      costSum += sum;
+      costBatches += n;
+    }
+
+    /** @brief Counters of a batch generator to be logged with every display */
+    void addDataStats(Ptr<data::PipelineStats> stats) {
+      dataStats_.push_back(stats);
+    }
+
+    /** @brief Counters of a worker to be logged with every display, see WorkerStats */
+    void addWorkerStats(Ptr<WorkerStats> stats) {
+      workerStats_.push_back(stats);
+    }
+
+    void update(Ptr<data::CorpusBatch> batch) {
       samples += batch->size();
       wordsDisp += batch->words();
       batches++;
 
-      if(batches % options_->get<size_t>("disp-freq") == 0) {
+      if(batches % options_->snapshot().dispFreq == 0) {
+        float seconds = std::stof(timer.format(5, "%w"));
         LOG(info, "Ep. {} : Up. {} : Sen. {} : Cost {:.2f} : Time {} : {:.2f} words/s",
-            epochs, batches, samples, costSum / options_->get<size_t>("disp-freq"),
-            timer.format(2, "%ws"), wordsDisp / std::stof(timer.format(5, "%w")));
+            epochs, batches, samples, costBatches ? costSum / costBatches : 0.f,
+            timer.format(2, "%ws"), wordsDisp / seconds);
+        if(!dataStats_.empty())
+          logDataStats(seconds);
+        if(!workerStats_.empty())
+          logWorkerStats(seconds);
         timer.start();
         costSum = 0;
+        costBatches = 0;
         wordsDisp = 0;
       }
     }
@@ -116,6 +360,8 @@ class Reporter {
       YAML::Node config = options_->get();
       config["progress"]["epochs"] = epochs;
       config["progress"]["batches"] = batches;
+      if(!workspacePeaks.empty())
+        config["workspace-peak"] = workspacePeaks;
 
       std::string nameYaml = name + ".yml";
       std::ofstream fout(nameYaml);
@@ -123,36 +369,135 @@ class Reporter {
     }
 };
 
+template <class Builder>
+MemoryEstimate DryRun(Ptr<Config> options);
+
+template <class Builder>
+size_t FitMiniBatch(Ptr<Config> options);
+
 template <class Model>
 void Train(Ptr<Config> options) {
   using namespace data;
   using namespace keywords;
 
+  if(options->get<bool>("mini-batch-fit"))
+    FitMiniBatch<typename Model::builder_type>(options);
+
+  if(options->has("dry-run")) {
+    DryRun<typename Model::builder_type>(options);
+    return;
+  }
+
+  if(!options->get<std::string>("trace").empty())
+    Tracer::get().enable(options->get<std::string>("trace"));
+
+  // with --data-shards each shard has its own batch generator and feeder
+  size_t shards = std::max((size_t)1, options->get<size_t>("data-shards"));
+  // with --cluster-nodes every node reads its own shard of the corpus
+  size_t nodes = std::max((size_t)1, options->get<size_t>("cluster-nodes"));
+  UTIL_THROW_IF2(nodes > 1 && shards > 1,
+                 "--data-shards cannot be combined with --cluster-nodes");
+
+  // with --data-processes the readers are forked before the corpus and the
+  // model start their threads. Every reader shuffles its own copy of the
+  // corpus with the same random state and reads its shard of that order
+  size_t processes = options->get<size_t>("data-processes");
+  Ptr<BatchRing> ring;
+  if(processes > 0) {
+    UTIL_THROW_IF2(shards > 1, "--data-processes cannot be combined with --data-shards");
+    size_t rank = nodes > 1 ? options->get<size_t>("cluster-rank") : 0;
+    ring = New<BatchRing>(std::max((size_t)1, options->get<size_t>("data-ring-mb")) << 20);
+    ring->spawn(processes, [&](size_t process) {
+      auto corpus = New<Corpus>(options);
+      corpus->setShard(rank * processes + process, nodes * processes);
+      BatchGenerator<Corpus> batchGenerator(corpus, options);
+      while(true) {
+        batchGenerator.prepare(!options->get<bool>("no-shuffle"));
+        while(batchGenerator)
+          if(!ring->push(*batchGenerator.next()))
+            return;
+        if(!ring->pushEnd())
+          return;
+      }
+    });
+  }
+
+  // device contexts and handles come up while the corpus and vocabularies
+  // load, after the readers are forked
+  auto warm = warmUpDevices(options->get<std::vector<size_t>>("devices"),
+                            options->get<size_t>("graphs-per-device"));
+
   auto trainCorpus = New<Corpus>(options);
-  auto batchGenerator = New<BatchGenerator<Corpus>>(trainCorpus, options);
   auto reporter = New<Reporter>(options);
 
+  std::vector<Ptr<BatchGenerator<Corpus>>> batchGenerators;
+  if(shards > 1)
+    trainCorpus->setShard(0, shards);
+  else if(nodes > 1)
+    trainCorpus->setShard(options->get<size_t>("cluster-rank"), nodes);
+  batchGenerators.push_back(New<BatchGenerator<Corpus>>(trainCorpus, options));
+  for(size_t shard = 1; shard < shards; ++shard)
+    batchGenerators.push_back(New<BatchGenerator<Corpus>>(New<Corpus>(*trainCorpus, shard),
+                                                         options));
+  if(ring)
+    batchGenerators[0]->setRing(ring);
+
+  for(auto batchGenerator : batchGenerators)
+    reporter->addDataStats(batchGenerator->stats());
+
   if((options->has("valid-sets") || options->has("valid-script-path"))
      && options->get<size_t>("valid-freq") > 0) {
     for(auto validator : Validators<typename Model::builder_type>(trainCorpus->getVocabs(), options))
       reporter->addValidator(validator);
   }
 
+  warm.wait();
   auto model = New<Model>(options);
   model->setReporter(reporter);
   model->load();
 
+  std::mutex updateMutex;
   while(reporter->keepGoing()) {
-    batchGenerator->prepare(!options->get<bool>("no-shuffle"));
-    while(*batchGenerator && reporter->keepGoing()) {
-      auto batch = batchGenerator->next();
-      model->update(batch);
+    // the first generator's corpus shuffles the order of all shards
+    for(auto batchGenerator : batchGenerators)
+      batchGenerator->prepare(!options->get<bool>("no-shuffle"));
+
+    if(batchGenerators.size() == 1) {
+      auto batchGenerator = batchGenerators[0];
+      while(model->feed(*batchGenerator && reporter->keepGoing())) {
+        Ptr<CorpusBatch> batch;
+        {
+          TraceRange range("batch fetch");
+          batch = batchGenerator->next();
+        }
+        model->update(batch);
+      }
     }
+    else {
+      std::vector<std::thread> feeders;
+      for(auto batchGenerator : batchGenerators) {
+        feeders.emplace_back([&, batchGenerator]() {
+          while(*batchGenerator && reporter->keepGoing()) {
+            Ptr<CorpusBatch> batch;
+            {
+              TraceRange range("batch fetch");
+              batch = batchGenerator->next();
+            }
+            std::lock_guard<std::mutex> lock(updateMutex);
+            model->update(batch);
+          }
+        });
+      }
+      for(auto& feeder : feeders)
+        feeder.join();
+    }
+
     if(reporter->keepGoing())
       reporter->increaseEpoch();
   }
   reporter->finished();
   model->save();
+  Tracer::get().write();
 }
 
 }
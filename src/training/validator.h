@@ -1,13 +1,18 @@
 #pragma once
 
+#include <algorithm>
+#include <cmath>
 #include <limits>
+#include <map>
 #include <cstdio>
 #include <cstdlib>
 
 #include "training/config.h"
 #include "graph/expression_graph.h"
 #include "data/corpus.h"
-#include "data/batch_generator.h"
+#include "common/logging.h"
+#include "data/shortlist.h"
+#include "translator/beam_search.h"
 
 namespace marian {
 
@@ -18,6 +23,51 @@ namespace marian {
       float lastBest_;
       size_t stalled_{0};
 
+      std::vector<Ptr<data::CorpusBatch>> batches_;
+
+      /**
+       * @brief The validation set, read and batched on first use and kept in
+       * memory. Batches are sorted by length and hold --valid-mini-batch
+       * sentences, more than in training as there is no backward pass.
+       */
+      const std::vector<Ptr<data::CorpusBatch>>& validBatches() {
+        using namespace data;
+        if(!batches_.empty())
+          return batches_;
+
+        auto validPaths = options_->get<std::vector<std::string>>("valid-sets");
+        auto corpus = New<Corpus>(validPaths, vocabs_, options_);
+
+        std::vector<SentenceTuple> samples;
+        std::vector<size_t> ids;
+        for(auto it = corpus->begin(); it != corpus->end(); ++it) {
+          ids.push_back(samples.size());
+          samples.push_back(*it);
+        }
+        std::stable_sort(ids.begin(), ids.end(),
+                         [&samples](size_t a, size_t b) {
+                           for(size_t i = 0; i < samples[a].size(); ++i)
+                             if(samples[a][i].size() != samples[b][i].size())
+                               return samples[a][i].size() < samples[b][i].size();
+                           return false;
+                         });
+
+        size_t dimBatch = std::max(1, options_->get<int>("valid-mini-batch"));
+        for(size_t first = 0; first < ids.size(); first += dimBatch) {
+          std::vector<SentenceTuple> batchVector;
+          std::vector<size_t> batchIds(ids.begin() + first,
+                                       ids.begin() + std::min(first + dimBatch, ids.size()));
+          for(auto id : batchIds)
+            batchVector.push_back(samples[id]);
+          auto batch = Corpus::toBatch(batchVector);
+          batch->setSentenceIds(batchIds);
+          batches_.push_back(batch);
+        }
+
+        LOG(valid, "Cached {} validation sentences in {} batches", samples.size(), batches_.size());
+        return batches_;
+      }
+
     public:
       Validator(std::vector<Ptr<Vocab>> vocabs,
                 Ptr<Config> options)
@@ -45,14 +95,12 @@ namespace marian {
       }
 
       virtual float validate(Ptr<ExpressionGraph> graph) {
-        using namespace data;
-        auto validPaths = options_->get<std::vector<std::string>>("valid-sets");
-        auto corpus = New<Corpus>(validPaths, vocabs_, options_);
-        Ptr<BatchGenerator<Corpus>> batchGenerator
-          = New<BatchGenerator<Corpus>>(corpus, options_);
-        batchGenerator->prepare(false);
+        auto& batches = validBatches();
 
-        float val = validateBG(graph, batchGenerator);
+        bool inference = graph->getInference();
+        graph->setInference(true);
+        float val = validateBatches(graph, batches);
+        graph->setInference(inference);
         if((lowerIsBetter() && lastBest_ > val) ||
            (!lowerIsBetter() && lastBest_ < val)) {
             stalled_ = 0;
@@ -64,8 +112,8 @@ namespace marian {
         return val;
       };
 
-      virtual float validateBG(Ptr<ExpressionGraph>,
-                               Ptr<data::BatchGenerator<data::Corpus>>) = 0;
+      virtual float validateBatches(Ptr<ExpressionGraph>,
+                                    const std::vector<Ptr<data::CorpusBatch>>&) = 0;
 
   };
 
@@ -82,13 +130,12 @@ namespace marian {
         initLastBest();
       }
 
-      virtual float validateBG(Ptr<ExpressionGraph> graph,
-                               Ptr<data::BatchGenerator<data::Corpus>> batchGenerator) {
+      virtual float validateBatches(Ptr<ExpressionGraph> graph,
+                                    const std::vector<Ptr<data::CorpusBatch>>& batches) {
         float cost = 0;
         size_t samples = 0;
 
-        while(*batchGenerator) {
-          auto batch = batchGenerator->next();
+        for(auto batch : batches) {
           builder_->build(graph, batch);
           graph->forward();
 
@@ -115,13 +162,12 @@ namespace marian {
         initLastBest();
       }
 
-      virtual float validateBG(Ptr<ExpressionGraph> graph,
-                               Ptr<data::BatchGenerator<data::Corpus>> batchGenerator) {
+      virtual float validateBatches(Ptr<ExpressionGraph> graph,
+                                    const std::vector<Ptr<data::CorpusBatch>>& batches) {
         float cost = 0;
         size_t words = 0;
 
-        while(*batchGenerator) {
-          auto batch = batchGenerator->next();
+        for(auto batch : batches) {
           builder_->build(graph, batch);
           graph->forward();
 
@@ -192,14 +238,139 @@ namespace marian {
       };
 
 
-      virtual float validateBG(Ptr<ExpressionGraph> graph,
-                               Ptr<data::BatchGenerator<data::Corpus>> batchGenerator) {
+      virtual float validateBatches(Ptr<ExpressionGraph>,
+                                    const std::vector<Ptr<data::CorpusBatch>>&) {
         return 0;
       }
 
       std::string type() { return "valid-script"; }
   };
 
+  /**
+   * @brief Corpus BLEU with n-grams up to 4 and the brevity penalty, on word
+   * ids. Matches are clipped by the counts of the reference, EOS is dropped.
+   */
+  class BleuScore {
+    private:
+      std::vector<size_t> matches_ = std::vector<size_t>(4, 0);
+      std::vector<size_t> totals_ = std::vector<size_t>(4, 0);
+      size_t hypLength_{0};
+      size_t refLength_{0};
+
+      static Words strip(const Words& words) {
+        Words stripped;
+        for(auto w : words)
+          if(w != EOS_ID)
+            stripped.push_back(w);
+        return stripped;
+      }
+
+    public:
+      void add(const Words& translation, const Words& reference) {
+        Words hyp = strip(translation);
+        Words ref = strip(reference);
+        hypLength_ += hyp.size();
+        refLength_ += ref.size();
+
+        for(size_t n = 1; n <= 4; ++n) {
+          std::map<Words, size_t> counts;
+          for(size_t i = 0; i + n <= ref.size(); ++i)
+            counts[Words(ref.begin() + i, ref.begin() + i + n)]++;
+          for(size_t i = 0; i + n <= hyp.size(); ++i) {
+            auto it = counts.find(Words(hyp.begin() + i, hyp.begin() + i + n));
+            if(it != counts.end() && it->second > 0) {
+              it->second--;
+              matches_[n - 1]++;
+            }
+            totals_[n - 1]++;
+          }
+        }
+      }
+
+      /** @brief BLEU in percent, 0 if some order has no matches */
+      float score() const {
+        float logPrecision = 0;
+        for(size_t n = 0; n < 4; ++n) {
+          if(matches_[n] == 0)
+            return 0;
+          logPrecision += std::log(matches_[n] / (float)totals_[n]) / 4;
+        }
+        float brevity = hypLength_ < refLength_
+                        ? std::exp(1 - refLength_ / (float)hypLength_) : 1.f;
+        return 100 * brevity * std::exp(logPrecision);
+      }
+  };
+
+  /**
+   * @brief BLEU of the validation set translated in process, instead of a
+   * model saved for --valid-script-path. Batched beam search of
+   * --valid-beam-size runs on a graph of its own on the device of the
+   * validated graph, which reads the training parameters, see
+   * ExpressionGraph::shareParams(), and is released after each validation.
+   * With --valid-shortlist the output layer is restricted to the candidates
+   * of each batch. References are the target side of the validation set as
+   * word ids, the score is not detokenized.
+   */
+  template <class Builder>
+  class TranslationValidator : public Validator {
+    private:
+      SearchOptions search_;
+      Ptr<data::Shortlist> shortlist_;
+
+    public:
+      TranslationValidator(std::vector<Ptr<Vocab>> vocabs,
+                           Ptr<Config> options)
+       : Validator(vocabs, options),
+         search_{options->get<size_t>("valid-beam-size"), 0.f, 0,
+                 options->get<float>("valid-max-length-factor")} {
+        if(options->has("valid-shortlist")) {
+          auto shortlist = options->get<std::vector<std::string>>("valid-shortlist");
+          shortlist_ = New<data::Shortlist>(shortlist[0], vocabs.front(), vocabs.back(),
+                                            shortlist.size() > 1 ? std::stoul(shortlist[1]) : 100,
+                                            shortlist.size() > 2 ? std::stoul(shortlist[2]) : 1000);
+        }
+        initLastBest();
+      }
+
+      virtual bool lowerIsBetter() {
+        return false;
+      }
+
+      virtual float validateBatches(Ptr<ExpressionGraph> graph,
+                                    const std::vector<Ptr<data::CorpusBatch>>& batches) {
+        // the parameters are read on another stream
+        CUDA_CHECK(cudaStreamSynchronize(graph->getStream()));
+        auto decoder = New<ExpressionGraph>();
+        decoder->setPriority(graph->getPriority(), graph->getShare());
+        decoder->setDevice(graph->getDevice());
+        decoder->setInference(true);
+        decoder->shareParams(graph);
+
+        BleuScore bleu;
+        for(auto batch : batches) {
+          auto& target = (*batch)[batch->sets() - 1];
+          std::map<size_t, size_t> rows;
+          auto& ids = batch->getSentenceIds();
+          for(size_t b = 0; b < ids.size(); ++b)
+            rows[ids[b]] = b;
+
+          BeamSearch<Builder> search(options_, search_, {decoder}, {1.f},
+                                     nullptr, shortlist_);
+          for(auto& translation : search.translate(batch)) {
+            size_t b = rows[translation.first];
+            Words reference;
+            for(size_t k = 0; k < target.batchWidth(); ++k)
+              if(target.mask()[k * target.batchSize() + b] > 0)
+                reference.push_back(target.indices()[k * target.batchSize() + b]);
+            bleu.add(translation.second, reference);
+          }
+        }
+        return bleu.score();
+      }
+
+      std::string type() { return "bleu"; }
+  };
+
   template <class Builder>
   std::vector<Ptr<Validator>> Validators(std::vector<Ptr<Vocab>> vocabs,
                                          Ptr<Config> options) {
@@ -220,6 +391,10 @@ namespace marian {
         auto validator = New<ScriptValidator<Builder>>(vocabs, options);
         validators.push_back(validator);
       }
+      if(metric == "bleu") {
+        auto validator = New<TranslationValidator<Builder>>(vocabs, options);
+        validators.push_back(validator);
+      }
     }
 
     return validators;
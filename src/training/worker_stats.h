@@ -0,0 +1,41 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+#include "data/pipeline_stats.h"
+
+namespace marian {
+
+/**
+ * @brief Counters of one training worker, i.e. one graph, filled by the graph
+ * group and read and reset by the Reporter every --disp-freq batches.
+ *
+ * Compute is time in forward and backward passes including graph building,
+ * communication is time spent fetching parameters, pushing gradients or in
+ * all-reduces, lock is time waiting for the graph group's lock. The rest of
+ * an interval the worker was idle, e.g. waiting for batches.
+ */
+struct WorkerStats {
+  int device;
+
+  std::atomic<uint64_t> batches{0};
+  std::atomic<uint64_t> words{0};
+
+  std::atomic<uint64_t> computeMicros{0};
+  std::atomic<uint64_t> commMicros{0};
+  std::atomic<uint64_t> lockMicros{0};
+
+  WorkerStats(int device) : device(device) {}
+};
+
+typedef data::StageTimer WorkerTimer;
+
+/** @brief Microseconds since  start  */
+inline uint64_t microsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+    std::chrono::steady_clock::now() - start).count();
+}
+
+}
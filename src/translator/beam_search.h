@@ -0,0 +1,836 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <future>
+#include <string>
+#include <typeinfo>
+
+#include "graph/expression_graph.h"
+#include "graph/expression_operators.h"
+#include "layers/param_initializers.h"
+#include "layers/generic.h"
+#include "models/encdec.h"
+#include "data/shortlist.h"
+
+#include "translator/nth_element.h"
+#include "translator/prefix_cache.h"
+#include "common/history.h"
+#include "common/thread_pool.h"
+
+namespace marian {
+
+// line number of a sentence and its best translation
+typedef std::pair<size_t, Words> Translation;
+
+// line number of a sentence and the stable prefix of its translation so far
+typedef std::function<void(size_t, const Words&)> StreamCallback;
+
+/**
+ * @brief Seconds spent in the parts of decoding, summed over batches.
+ *
+ * The encoder includes the first decoder step, which runs in the same forward
+ * pass. Decoder steps and the top-k selection are device time, the device is
+ * waited for after each, host covers building the graphs of the steps and the
+ * beam and history bookkeeping. Profiling adds synchronizations and slows
+ * decoding down a little.
+ */
+struct SearchProfile {
+  double encoder{0};
+  double decoder{0};
+  double topk{0};
+  double host{0};
+  size_t steps{0};
+
+  double total() const {
+    return encoder + decoder + topk + host;
+  }
+};
+
+/**
+ * @brief Parameters of BeamSearch, by default those of marian_translate:
+ * --beam-size, --beam-threshold, --beam-max-per-parent, --max-length-factor
+ */
+struct SearchOptions {
+  size_t beamSize;
+  float threshold;
+  size_t maxPerParent;
+  float lengthFactor;
+  // --replay-steps
+  bool replaySteps;
+
+  static SearchOptions from(Ptr<Config> options) {
+    return {options->get<size_t>("beam-size"),
+            options->get<float>("beam-threshold"),
+            options->get<size_t>("beam-max-per-parent"),
+            options->get<float>("max-length-factor"),
+            options->get<bool>("replay-steps")};
+  }
+};
+
+/**
+ * @brief Beam search over one model or over an ensemble of models sharing a
+ * single beam. Every model has its own builder and graph, possibly on
+ * different devices, its steps run concurrently on a thread pool.
+ */
+template <class Builder>
+class BeamSearch {
+  private:
+    Ptr<Config> options_;
+    size_t beamSize_;
+    float threshold_;
+    size_t maxPerParent_;
+
+    std::vector<Ptr<Builder>> builders_;
+    std::vector<Ptr<ExpressionGraph>> graphs_;
+    std::vector<float> weights_;
+    Ptr<ThreadPool> pool_;
+
+    // per model the decoder states, encoder state and scores of the last step
+    std::vector<std::vector<Expr>> hyps_;
+    std::vector<Ptr<EncoderState>> encStates_;
+    std::vector<Expr> scores_;
+    std::vector<size_t> pos_;
+    // embeddings fed to the first step, zeros if null
+    std::vector<Expr> firstEmbs_;
+
+    /**
+     * A decoder step of dimBeam hypotheses per sentence kept in the graph for
+     * replay, nodes  begin  to  end . It reads the previous states from the
+     * constants  states  and the rows and words selected by NthElement from
+     * hypIdx  and  embIdx , all overwritten before every replay.
+     */
+    struct StepPlan {
+      size_t dimBeam;
+      size_t begin;
+      size_t end;
+      Expr hypIdx;
+      Expr embIdx;
+      std::vector<Expr> states;
+      std::vector<Expr> hyps;
+      Expr scores;
+    };
+
+    // per model, valid until the graph or the encoder states change
+    bool replaySteps_;
+    std::vector<std::vector<StepPlan>> plans_;
+    const size_t MAX_STEP_PLANS = 4;
+
+    // weighted sum of the log-probabilities on the first model's device
+    Ptr<TensorAllocator> sumAlloc_;
+    std::vector<cudaEvent_t> events_;
+
+    Ptr<data::Shortlist> shortlist_;
+    // target ids of the output columns of the current batch, empty without shortlist
+    std::vector<size_t> words_;
+
+    float lengthFactor_;
+
+    Ptr<SearchProfile> profile_;
+    std::chrono::steady_clock::time_point lap_;
+
+    StreamCallback stream_;
+
+    /** @brief With a profile, adds the time since the last lap to  seconds , after the device */
+    void lap(double SearchProfile::* seconds) {
+      if(!profile_)
+        return;
+      for(auto graph : graphs_)
+        CUDA_CHECK(cudaStreamSynchronize(graph->getStream()));
+      auto now = std::chrono::steady_clock::now();
+      (*profile_).*seconds += std::chrono::duration<double>(now - lap_).count();
+      lap_ = now;
+    }
+
+    bool ensemble() const {
+      return graphs_.size() > 1;
+    }
+
+    /** Runs f(m) for every model, concurrently on the pool for ensembles */
+    template <class F>
+    void forEachModel(F f) {
+      if(!ensemble()) {
+        f(0);
+        return;
+      }
+
+      std::vector<std::future<void>> done;
+      for(size_t m = 0; m < graphs_.size(); ++m)
+        done.push_back(pool_->enqueueAt(m, [this, &f](size_t m) {
+          cudaSetDevice(graphs_[m]->getDevice());
+          f(m);
+        }, m));
+      for(auto& d : done)
+        d.get();
+    }
+
+    /**
+     * Weighted sum of the log-probabilities of all models, computed on the
+     * stream of the first model. Other streams are waited for through events
+     * and scores of other devices are copied peer to peer, the host never
+     * blocks.
+     */
+    Tensor combine() {
+      size_t device = graphs_[0]->getDevice();
+      Shape shape = scores_[0]->shape();
+      cudaSetDevice(device);
+
+      bool peers = false;
+      for(auto graph : graphs_)
+        peers |= graph->getDevice() != device;
+
+      sumAlloc_->clear();
+      Tensor sum, stage;
+      sumAlloc_->reserveExact((peers ? 2 : 1) * shape.elements());
+      sumAlloc_->allocate(sum, shape);
+      if(peers)
+        sumAlloc_->allocate(stage, shape);
+
+      cudaStream_t previous = currentStream();
+      currentStream() = graphs_[0]->getStream();
+
+      Element(_1 = weights_[0] * _2, sum, scores_[0]->val());
+      for(size_t m = 1; m < graphs_.size(); ++m) {
+        Tensor scores = scores_[m]->val();
+        CUDA_CHECK(cudaEventRecord(events_[m], graphs_[m]->getStream()));
+        CUDA_CHECK(cudaStreamWaitEvent(currentStream(), events_[m], 0));
+        if(graphs_[m]->getDevice() != device) {
+          CUDA_CHECK(cudaMemcpyPeerAsync(stage->data(), device,
+                                         scores->data(), graphs_[m]->getDevice(),
+                                         shape.elements() * sizeof(float),
+                                         currentStream()));
+          scores = stage;
+        }
+        Element(_1 += weights_[m] * _2, sum, scores);
+      }
+
+      currentStream() = previous;
+      return sum;
+    }
+
+  public:
+    BeamSearch(Ptr<Config> options,
+               const std::vector<Ptr<ExpressionGraph>>& graphs,
+               const std::vector<float>& weights,
+               Ptr<ThreadPool> pool,
+               Ptr<data::Shortlist> shortlist = nullptr)
+     : BeamSearch(options, SearchOptions::from(options), graphs, weights,
+                  pool, shortlist) {}
+
+    /** @brief Searches with  search  instead of the options of marian_translate */
+    BeamSearch(Ptr<Config> options,
+               const SearchOptions& search,
+               const std::vector<Ptr<ExpressionGraph>>& graphs,
+               const std::vector<float>& weights,
+               Ptr<ThreadPool> pool,
+               Ptr<data::Shortlist> shortlist = nullptr)
+     : options_(options),
+       beamSize_(search.beamSize),
+       threshold_(search.threshold),
+       maxPerParent_(search.maxPerParent),
+       graphs_(graphs),
+       weights_(weights),
+       pool_(pool),
+       hyps_(graphs.size()),
+       encStates_(graphs.size()),
+       scores_(graphs.size()),
+       pos_(graphs.size(), 0),
+       firstEmbs_(graphs.size()),
+       // the window of local attention moves with every step
+       replaySteps_(search.replaySteps && options->get<size_t>("att-window") == 0),
+       plans_(graphs.size()),
+       shortlist_(shortlist),
+       lengthFactor_(search.lengthFactor)
+    {
+      for(size_t m = 0; m < graphs_.size(); ++m)
+        builders_.push_back(New<Builder>(options));
+
+      if(ensemble()) {
+        sumAlloc_ = New<TensorAllocator>(graphs_[0]->getDevice());
+        events_.resize(graphs_.size());
+        for(size_t m = 0; m < graphs_.size(); ++m) {
+          cudaSetDevice(graphs_[m]->getDevice());
+          CUDA_CHECK(cudaEventCreateWithFlags(&events_[m], cudaEventDisableTiming));
+        }
+      }
+    }
+
+    /** @brief Accumulates the time of every translate() in  profile  */
+    void setProfile(Ptr<SearchProfile> profile) {
+      profile_ = profile;
+    }
+
+    /**
+     * @brief Calls  stream  whenever the stable prefix of a translation grows
+     * during translate(), see History::Stable(). Greedy decoding streams every
+     * word, prefix translations do not stream.
+     */
+    void setStream(StreamCallback stream) {
+      stream_ = stream;
+    }
+
+    ~BeamSearch() {
+      for(size_t m = 0; m < events_.size(); ++m) {
+        cudaSetDevice(graphs_[m]->getDevice());
+        cudaEventDestroy(events_[m]);
+      }
+    }
+
+    /**
+     * Keys index the rows of all sentences, hypothesis h of sentence b is
+     * row h * dimBatch + b, see step(). With a shortlist, columns are mapped
+     * back to target ids.
+     */
+    Beams toHyps(const std::vector<uint> keys,
+                 const std::vector<float> costs,
+                 size_t vocabSize,
+                 const Beams& beams) {
+      size_t dimBatch = beams.size();
+      Beams newBeams(dimBatch);
+      for(auto& beam : newBeams)
+        beam.reserve(beamSize_);
+      for(int i = 0; i < keys.size(); ++i) {
+        int embIdx = keys[i] % vocabSize;
+        if(!words_.empty())
+          embIdx = words_[embIdx];
+        int hypIdx = keys[i] / vocabSize;
+        int batchIdx = hypIdx % dimBatch;
+        int beamHypIdx = hypIdx / dimBatch;
+        float cost = costs[i];
+
+        auto& prev = beams[batchIdx][beamHypIdx];
+        size_t index = newBeams[batchIdx].size();
+        newBeams[batchIdx].emplace_back(embIdx, hypIdx, prev.GetIndex(), index, cost);
+      }
+      return newBeams;
+    }
+
+    /**
+     * Keeps the live hypotheses of a beam sorted best first, the same rules
+     * are applied to the beams on the device by NthElement. Hypotheses ending
+     * in EOS are dropped, so are those more than --beam-threshold below the
+     * best one and those with --beam-max-per-parent better siblings. The
+     * beam is emptied once its best hypothesis normalized by the maximum
+     * length, a bound for all its continuations since costs only decrease,
+     * cannot beat the best finished one.
+     */
+    Beam pruneBeam(const Beam& beam, float bestFinished, size_t maxLength) {
+      Beam newBeam;
+      for(auto& hyp : beam) {
+        if(hyp.GetWord() == 0)
+          continue;
+        if(threshold_ > 0 && hyp.GetCost() < beam[0].GetCost() - threshold_)
+          continue;
+        if(maxPerParent_ > 0) {
+          size_t siblings = 0;
+          for(auto& kept : newBeam)
+            if(kept.GetPrevStateIndex() == hyp.GetPrevStateIndex())
+              ++siblings;
+          if(siblings >= maxPerParent_)
+            continue;
+        }
+        newBeam.push_back(hyp);
+      }
+
+      if(!newBeam.empty() && newBeam[0].GetCost() / (float)maxLength <= bestFinished)
+        newBeam.clear();
+      return newBeam;
+    }
+
+    /**
+     * One decoder step of model m. The first step starts from the encoder
+     * states, later ones gather states and embeddings by the rows and words
+     * which the top-k selection of the previous step left on the device,
+     * hypothesis h of sentence b in row h * dimBatch + b. Ensemble members
+     * produce log-probabilities to be combined, a single model leaves the
+     * normalization to the fused scoring in NthElement.
+     *
+     * With --replay-steps, a step whose states have the rows of dimBeam
+     * hypotheses per sentence, as left by a step of the same width, is kept
+     * as a StepPlan and replayed for later such steps, which then build no
+     * nodes. Only the states and selections are copied into the plan.
+     */
+    void step(size_t m,
+              size_t dimBatch,
+              size_t dimBeam = 0,
+              Ptr<NthElement> nth = nullptr) {
+      using namespace keywords;
+      auto graph = graphs_[m];
+
+      int dimTrgEmb = options_->get<int>("dim-emb");
+      int dimTrgVoc = options_->get<std::vector<int>>("dim-vocabs").back();
+
+      // states of the previous step, read by the first pass of a new plan
+      auto previous = hyps_[m];
+      StepPlan plan;
+      bool record = false;
+
+      std::vector<Expr> selectedHyps;
+      Expr selectedEmbs;
+      if(!nth) {
+        selectedHyps = hyps_[m];
+        selectedEmbs = firstEmbs_[m]
+                       ? firstEmbs_[m]
+                       : graph->constant(shape={(int)dimBatch, dimTrgEmb},
+                                         init=inits::zeros);
+      }
+      else {
+        int dimRows = dimBatch * dimBeam;
+        bool steady = replaySteps_;
+        for(auto h : hyps_[m])
+          steady &= h->shape().elements() == dimRows * h->shape()[1];
+
+        if(steady) {
+          for(auto& kept : plans_[m]) {
+            if(kept.dimBeam != dimBeam)
+              continue;
+            std::vector<std::pair<Expr, const float*>> inputs
+              = {{kept.hypIdx, nth->hypIndices()}, {kept.embIdx, nth->embIndices()}};
+            for(size_t i = 0; i < kept.states.size(); ++i)
+              inputs.emplace_back(kept.states[i], hyps_[m][i]->val()->data());
+            graph->replay(kept.begin, kept.end, inputs);
+            hyps_[m] = kept.hyps;
+            scores_[m] = kept.scores;
+            return;
+          }
+        }
+
+        record = steady && plans_[m].size() < MAX_STEP_PLANS;
+        std::vector<Expr> states = hyps_[m];
+        if(record) {
+          plan.dimBeam = dimBeam;
+          plan.begin = graph->size();
+          for(auto& h : states)
+            h = graph->constant(shape=h->shape(),
+                                init=inits::from_device(h->val()->data()));
+          plan.states = states;
+        }
+
+        auto hypIdx = graph->constant(shape={dimRows, 1},
+                                      init=inits::from_device(nth->hypIndices()));
+        auto embIdx = graph->constant(shape={dimRows, 1},
+                                      init=inits::from_device(nth->embIndices()));
+        plan.hypIdx = hypIdx;
+        plan.embIdx = embIdx;
+
+        // @TODO : solve this better than reshaping!
+        for(auto h : states)
+          selectedHyps.push_back(
+            reshape(rows(h, hypIdx), {(int)dimBatch, h->shape()[1], 1, (int)dimBeam}));
+
+        auto yEmb = Embedding(targetEmbeddings(options_), dimTrgVoc, dimTrgEmb)(graph);
+        selectedEmbs = reshape(rows(yEmb, embIdx),
+                               {(int)dimBatch, yEmb->shape()[1], 1, (int)dimBeam});
+      }
+
+      Expr logits;
+      std::tie(logits, hyps_[m]) = builders_[m]->step(selectedEmbs,
+                                                      selectedHyps,
+                                                      encStates_[m],
+                                                      true);
+      scores_[m] = ensemble() ? logsoftmax(logits) : logits;
+
+      if(record) {
+        plan.end = graph->size();
+        plan.hyps = hyps_[m];
+        plan.scores = scores_[m];
+        graph->keep(plan.begin, plan.end);
+        plans_[m].push_back(plan);
+      }
+      pos_[m] = pos_[m] > 0 ? graph->forward(pos_[m]) : graph->forward();
+    }
+
+    /**
+     * @brief Drops the step plans of all models, their nodes are freed by
+     * later steps. Called when the encoder states change.
+     */
+    void dropPlans() {
+      for(size_t m = 0; m < plans_.size(); ++m) {
+        for(auto& plan : plans_[m])
+          graphs_[m]->keep(plan.begin, plan.end, false);
+        plans_[m].clear();
+      }
+    }
+
+    /** @brief Values of  e  on the host */
+    static std::vector<float> download(Expr e) {
+      std::vector<float> values;
+      e->val()->get(values);
+      return values;
+    }
+
+    /**
+     * Decoder step of model m for a single sentence that feeds back the
+     * known target word  prev  and keeps the new states in  cached , the
+     * first step of a sentence feeds zeros. The logits are not used.
+     */
+    void forcedStep(size_t m, const Word* prev, PrefixState::Model& cached) {
+      using namespace keywords;
+      auto graph = graphs_[m];
+      int dimTrgEmb = options_->get<int>("dim-emb");
+      int dimTrgVoc = options_->get<std::vector<int>>("dim-vocabs").back();
+
+      Expr embs;
+      if(prev)
+        embs = rows(Embedding(targetEmbeddings(options_), dimTrgVoc, dimTrgEmb)(graph),
+                    std::vector<size_t>({(size_t)*prev}));
+      else
+        embs = graph->constant(shape={1, dimTrgEmb}, init=inits::zeros);
+
+      Expr logits;
+      std::tie(logits, hyps_[m]) = builders_[m]->step(embs, hyps_[m], encStates_[m], true);
+      pos_[m] = pos_[m] > 0 ? graph->forward(pos_[m]) : graph->forward();
+
+      cached.states.emplace_back();
+      for(auto h : hyps_[m])
+        cached.states.back().push_back(download(h));
+    }
+
+    /**
+     * Restricts the output layer to the shortlist of the batch, if any, and
+     * returns the column of UNK which the shortlist always contains.
+     */
+    int setShortlist(Ptr<data::CorpusBatch> batch) {
+      if(!shortlist_)
+        return UNK_ID;
+      words_ = shortlist_->generate(batch);
+      for(auto builder : builders_)
+        builder->setShortlist(words_);
+      return std::lower_bound(words_.begin(), words_.end(), UNK_ID) - words_.begin();
+    }
+
+    std::vector<Translation> translate(Ptr<data::CorpusBatch> batch) {
+      if(beamSize_ == 1 && !ensemble())
+        return greedy(batch);
+
+      std::vector<Translation> translations;
+      auto histories = search(batch, stream_);
+      for(auto history : histories) {
+        auto results = history->NBest(1);
+        translations.emplace_back(history->GetLineNum(),
+                                  results.empty() ? Words() : results[0].first);
+      }
+      return translations;
+    }
+
+    /**
+     * Greedy decoding for beam size 1. The argmax over the logits selects the
+     * next embeddings on the device, scores are never normalized and no
+     * hypotheses are kept. Only the chosen word ids are read back, to collect
+     * the output and to stop once every sentence has produced EOS. Finished
+     * sentences are decoded along until then. Ensembles use search().
+     */
+    std::vector<Translation> greedy(Ptr<data::CorpusBatch> batch) {
+      using namespace keywords;
+
+      auto graph = graphs_[0];
+      auto builder = builders_[0];
+      lap_ = std::chrono::steady_clock::now();
+
+      std::vector<Expr> hyps;
+      Ptr<EncoderState> encState;
+      std::tie(hyps, encState) = builder->buildEncoder(graph, batch);
+      int unk = setShortlist(batch);
+
+      int dimTrgEmb = options_->get<int>("dim-emb");
+      int dimTrgVoc = options_->get<std::vector<int>>("dim-vocabs").back();
+
+      size_t dimBatch = batch->size();
+      auto& ids = batch->getSentenceIds();
+
+      std::vector<Translation> translations;
+      for(size_t b = 0; b < dimBatch; ++b)
+        translations.emplace_back(ids.empty() ? b : ids[b], Words());
+
+      auto yEmb = Embedding(targetEmbeddings(options_), dimTrgVoc, dimTrgEmb)(graph);
+      Expr embs = graph->constant(shape={(int)dimBatch, dimTrgEmb},
+                                  init=inits::zeros);
+
+      // columns to target ids on the device
+      Expr columnWords;
+      if(!words_.empty()) {
+        std::vector<float> words(words_.begin(), words_.end());
+        columnWords = graph->constant(shape={(int)words.size(), 1},
+                                      init=inits::from_vector(words));
+      }
+
+      size_t maxLength = lengthFactor_ * (*batch)[0].batchWidth();
+      std::vector<bool> done(dimBatch, false);
+      size_t left = dimBatch;
+      std::vector<float> best(dimBatch);
+      size_t pos = 0;
+
+      for(size_t steps = 0; steps < maxLength && left > 0; ++steps) {
+        Expr logits;
+        std::tie(logits, hyps) = builder->step(embs, hyps, encState, true);
+
+        auto words = argmax(logits, unk);
+        if(columnWords)
+          words = rows(columnWords, words);
+
+        pos = steps == 0 ? graph->forward() : graph->forward(pos);
+        lap(steps == 0 ? &SearchProfile::encoder : &SearchProfile::decoder);
+        words->val()->get(best);
+        if(profile_)
+          profile_->steps++;
+
+        for(size_t b = 0; b < dimBatch; ++b) {
+          if(done[b])
+            continue;
+          Word word = best[b];
+          if(word == EOS_ID) {
+            done[b] = true;
+            left--;
+          }
+          else {
+            translations[b].second.push_back(word);
+            if(stream_)
+              stream_(translations[b].first, translations[b].second);
+          }
+        }
+
+        embs = rows(yEmb, words);
+        lap(&SearchProfile::host);
+      }
+
+      return translations;
+    }
+
+    /**
+     * Translates all sentences of the batch at once, every sentence keeps
+     * its own beam and history. Finished sentences are dropped from the
+     * beams and the encoder state, so later steps only pay for the
+     * sentences still being translated. The decoder states are compacted
+     * by the row selection of the next step.
+     */
+    std::vector<Ptr<History>> search(Ptr<data::CorpusBatch> batch,
+                                     StreamCallback stream = nullptr) {
+      lap_ = std::chrono::steady_clock::now();
+
+      forEachModel([&](size_t m) {
+        std::tie(hyps_[m], encStates_[m])
+          = builders_[m]->buildEncoder(graphs_[m], batch);
+        pos_[m] = 0;
+        firstEmbs_[m] = nullptr;
+      });
+      int unk = setShortlist(batch);
+
+      return decode(batch, unk, lengthFactor_ * (*batch)[0].batchWidth(), stream);
+    }
+
+    /**
+     * @brief Translates the single sentence of  batch  as a continuation of
+     * the target words  prefix  and returns the prefix followed by the best
+     * continuation.
+     *
+     * With a  state  of earlier requests for the same source sentence, the
+     * encoder is not run again and the decoder resumes from the states of
+     * the longest prefix the requests share, so only the new prefix words
+     * are fed back before the search. The state is updated for the next
+     * request. Only for models with a single source.
+     */
+    Words translatePrefix(Ptr<data::CorpusBatch> batch,
+                          const Words& prefix,
+                          Ptr<PrefixState> state) {
+      using namespace keywords;
+      UTIL_THROW_IF2(batch->size() != 1 || batch->sets() != 1,
+                     "Prefix translation needs a single sentence of a single source");
+      lap_ = std::chrono::steady_clock::now();
+
+      auto& indices = (*batch)[0].indices();
+      Words source(indices.begin(), indices.end());
+      if(state->source != source || state->models.size() != graphs_.size()) {
+        state->source = source;
+        state->prefix.clear();
+        state->models.assign(graphs_.size(), PrefixState::Model());
+      }
+
+      // the states after the  shared  words both prefixes start with
+      size_t shared = 0;
+      while(shared < prefix.size() && shared < state->prefix.size()
+            && prefix[shared] == state->prefix[shared])
+        ++shared;
+      for(auto& cached : state->models)
+        shared = std::min(shared, cached.states.empty() ? 0 : cached.states.size() - 1);
+
+      forEachModel([&](size_t m) {
+        auto graph = graphs_[m];
+        auto& cached = state->models[m];
+        pos_[m] = 0;
+        firstEmbs_[m] = nullptr;
+
+        if(cached.states.empty()) {
+          std::tie(hyps_[m], encStates_[m]) = builders_[m]->buildEncoder(graph, batch);
+          pos_[m] = graph->forward();
+          UTIL_THROW_IF2(typeid(*encStates_[m]) != typeid(EncoderState),
+                         "Prefix translation needs a model with a single source");
+          cached.contextShape = encStates_[m]->context->shape();
+          cached.context = download(encStates_[m]->context);
+          cached.stateShapes.clear();
+          cached.states.emplace_back();
+          for(auto h : hyps_[m]) {
+            cached.stateShapes.push_back(h->shape());
+            cached.states.back().push_back(download(h));
+          }
+        }
+        else {
+          builders_[m]->restart(graph);
+          auto context = graph->constant(shape=cached.contextShape,
+                                         init=inits::from_vector(cached.context));
+          encStates_[m] = New<EncoderState>(
+            EncoderState{context, EncoderBase::sourceMask(graph, batch, 0)});
+          hyps_[m].clear();
+          for(size_t i = 0; i < cached.stateShapes.size(); ++i)
+            hyps_[m].push_back(graph->constant(shape=cached.stateShapes[i],
+                                               init=inits::from_vector(cached.states[shared][i])));
+          cached.states.resize(shared + 1);
+        }
+      });
+      int unk = setShortlist(batch);
+      lap(&SearchProfile::encoder);
+
+      forEachModel([&](size_t m) {
+        for(size_t i = shared; i < prefix.size(); ++i)
+          forcedStep(m, i > 0 ? &prefix[i - 1] : nullptr, state->models[m]);
+
+        if(!prefix.empty()) {
+          int dimTrgEmb = options_->get<int>("dim-emb");
+          int dimTrgVoc = options_->get<std::vector<int>>("dim-vocabs").back();
+          auto yEmb = Embedding(targetEmbeddings(options_), dimTrgVoc, dimTrgEmb)(graphs_[m]);
+          firstEmbs_[m] = rows(yEmb, std::vector<size_t>({(size_t)prefix.back()}));
+        }
+      });
+      state->prefix = prefix;
+      if(profile_)
+        profile_->steps += prefix.size() - shared;
+      lap(&SearchProfile::decoder);
+
+      size_t maxLength = lengthFactor_ * (*batch)[0].batchWidth();
+      maxLength = std::max((size_t)1, maxLength - std::min(maxLength, prefix.size()));
+      auto histories = decode(batch, unk, maxLength);
+
+      Words words = prefix;
+      auto results = histories[0]->NBest(1);
+      if(!results.empty())
+        words.insert(words.end(), results[0].first.begin(), results[0].first.end());
+      return words;
+    }
+
+    /**
+     * Beam search from the current decoder states and encoder states of all
+     * models for at most  maxLength  steps, see search(). With  stream , the
+     * stable prefix of every live sentence is checked after each step.
+     */
+    std::vector<Ptr<History>> decode(Ptr<data::CorpusBatch> batch,
+                                     int unk, size_t maxLength,
+                                     StreamCallback stream = nullptr) {
+      size_t dimBatch = batch->size();
+      auto& ids = batch->getSentenceIds();
+
+      std::vector<Ptr<History>> histories;
+      Beams beams(dimBatch, Beam(1, Hypothesis()));
+      for(size_t b = 0; b < dimBatch; ++b) {
+        histories.push_back(New<History>(ids.empty() ? b : ids[b]));
+        histories.back()->Add(beams[b]);
+      }
+
+      size_t steps = 0;
+
+      // sentence in the batch of every beam
+      std::vector<size_t> active(dimBatch);
+      for(size_t b = 0; b < dimBatch; ++b)
+        active[b] = b;
+
+      // plans of an earlier batch refer to nodes of a cleared graph
+      dropPlans();
+
+      bool first = true;
+      bool final = false;
+      std::vector<size_t> beamSizes(dimBatch, beamSize_);
+      auto nth = New<NthElement>(beamSize_, dimBatch,
+                                 graphs_[0]->getDevice(),
+                                 graphs_[0]->getStream());
+
+      nth->setWords(words_);
+      nth->setPruning(threshold_, maxPerParent_, maxLength);
+
+      // length of the stable prefix streamed per sentence
+      std::vector<size_t> streamed(dimBatch, 0);
+
+      std::vector<size_t> keep;
+      do {
+        if(first) {
+          forEachModel([&](size_t m) { step(m, dimBatch); });
+        }
+        else {
+          size_t dimBeam = 0;
+          beamSizes.resize(beams.size());
+          for(size_t b = 0; b < beams.size(); ++b) {
+            beamSizes[b] = beams[b].size();
+            dimBeam = std::max(dimBeam, beams[b].size());
+          }
+          forEachModel([&](size_t m) { step(m, beams.size(), dimBeam, nth); });
+        }
+        lap(first ? &SearchProfile::encoder : &SearchProfile::decoder);
+        if(profile_)
+          profile_->steps++;
+
+        size_t dimTrgVoc = scores_[0]->shape()[1];
+
+        std::vector<unsigned> outKeys;
+        std::vector<float> outCosts;
+
+        // hypothesis costs and masking of UNK are fused into the top-k
+        // selection, for a single model also the log-softmax
+        Tensor scores = ensemble() ? combine() : scores_[0]->val();
+        nth->getNBestList(beamSizes, scores, unk,
+                          outCosts, outKeys, first, ensemble());
+        lap(&SearchProfile::topk);
+        first = false;
+
+        beams = toHyps(outKeys, outCosts, dimTrgVoc, beams);
+        final = ++steps >= maxLength;
+
+        keep.clear();
+        for(size_t b = 0; b < beams.size(); ++b) {
+          histories[active[b]]->Add(beams[b], final);
+          beams[b] = pruneBeam(beams[b], histories[active[b]]->BestFinished(),
+                               maxLength);
+          if(!beams[b].empty())
+            keep.push_back(b);
+        }
+
+        if(stream && !final) {
+          for(auto b : keep) {
+            auto& history = histories[active[b]];
+            auto stable = history->Stable(beams[b]);
+            if(stable.size() > streamed[active[b]]) {
+              streamed[active[b]] = stable.size();
+              stream(history->GetLineNum(), stable);
+            }
+          }
+        }
+
+        if(!final && !keep.empty() && keep.size() < beams.size()) {
+          Beams keptBeams;
+          std::vector<size_t> keptActive;
+          for(auto b : keep) {
+            keptBeams.push_back(beams[b]);
+            keptActive.push_back(active[b]);
+          }
+          beams = keptBeams;
+          active = keptActive;
+          for(auto builder : builders_)
+            builder->selectSentences(keep);
+          dropPlans();
+        }
+        lap(&SearchProfile::host);
+
+      } while(!keep.empty() && !final);
+
+      return histories;
+    }
+};
+
+}
@@ -1,6 +1,8 @@
 #include <iostream>
 
 #include "translator/nth_element.h"
+#include "data/types.h"
+#include "exception.h"
 
 namespace marian {
 
@@ -11,242 +13,324 @@ void HandleError(cudaError_t err, const char *file, int line ) {
   }
 }
 
-#define UNROLL_MAXARG_LOOP( n, max ) \
-  if (tid < (n) && tid + (n) < ( max ) ) { \
-    if (sdata[tid + ( n ) ] > sdata[tid]) { \
-      sdata[tid] = sdata[tid + ( n ) ]; \
-      indices[tid] = indices[tid + ( n ) ]; \
-    } \
-  }
-
 #define HANDLE_ERROR( err ) (HandleError( err, __FILE__, __LINE__ ))
 
-__global__ void gMaxElement(float* d_out, int* d_ind, float* d_in, int numBatches, int* batchFirstElementIdxs) {
-  extern __shared__ float sdata[];
-  __shared__ int indices[512];
-
-  int tid = threadIdx.x;
-
-  for (int batchIdx = 0; batchIdx < numBatches; ++batchIdx) {
-    int begin = batchFirstElementIdxs[batchIdx];
-    int end = batchFirstElementIdxs[batchIdx + 1];
-
-    int i = begin + blockIdx.x * (blockDim.x * 2) + tid;
-
-    sdata[tid] = -3.40282e+38f;
-
-    if (i < end) {
-      sdata[tid] = d_in[i];
-      indices[tid] = i;
-    }
-
-    if (i + blockDim.x < end) {
-      float a = d_in[i];
-      float b = d_in[i + blockDim.x];
-      if (a > b) {
-        sdata[tid] = a;
-        indices[tid] = i;
-      } else {
-        sdata[tid] = b;
-        indices[tid] = i + blockDim.x;
-      }
-    }
-
-    while (i + 2 * gridDim.x * blockDim.x < end) {
-      i += 2 * gridDim.x * blockDim.x;
-
-      float a = d_in[i];
-      if (a > sdata[tid]) {
-        sdata[tid] = a;
-        indices[tid] = i;
-      }
-
-      if (i + blockDim.x < end) {
-        float b = d_in[i + blockDim.x];
-        if (b > sdata[tid]) {
-          sdata[tid] = b;
-          indices[tid] = i + blockDim.x;
-        }
-      }
-    }
+// Largest beam the top-k kernels keep per thread
+const int MAX_BEAM = 32;
+
+// Threads per top-k block, must be a power of two
+const int TOPK_THREADS = 256;
+
+/**
+ * Inserts (v, i) into a descending list of length k if v beats its last entry.
+ * Ties keep the entry seen first.
+ */
+__device__ inline void insertTopK(float* vals, int* idxs, int k, float v, int i) {
+  if(!(v > vals[k - 1]))
+    return;
+  int j = k - 1;
+  while(j > 0 && vals[j - 1] < v) {
+    vals[j] = vals[j - 1];
+    idxs[j] = idxs[j - 1];
+    --j;
+  }
+  vals[j] = v;
+  idxs[j] = i;
+}
 
+/**
+ * Merges the per-thread sorted lists of a block into the block's k best. Every
+ * round reduces the heads of all lists and advances the winning one.
+ */
+__device__ void mergeTopK(const float* vals, const int* idxs, int k,
+                          float* outVals, int* outIdxs,
+                          float* sval, int* sthread) {
+  const int tid = threadIdx.x;
+  int head = 0;
+  for(int r = 0; r < k; ++r) {
+    sval[tid] = head < k ? vals[head] : -3.40282e+38f;
+    sthread[tid] = tid;
     __syncthreads();
 
-    for (int s = (blockDim.x >> 1); s > 32; s >>= 1) {
-      if (tid < s && tid + s < end) {
-        if (sdata[tid + s] > sdata[tid]) {
-          sdata[tid] = sdata[tid + s];
-          indices[tid] = indices[tid + s];
-        }
+    for(int s = (blockDim.x >> 1); s > 0; s >>= 1) {
+      if(tid < s && sval[tid + s] > sval[tid]) {
+        sval[tid] = sval[tid + s];
+        sthread[tid] = sthread[tid + s];
       }
       __syncthreads();
     }
 
-    UNROLL_MAXARG_LOOP(32, end);
-    UNROLL_MAXARG_LOOP(16, end);
-    UNROLL_MAXARG_LOOP(8, end);
-    UNROLL_MAXARG_LOOP(4, end);
-    UNROLL_MAXARG_LOOP(2, end);
-    UNROLL_MAXARG_LOOP(1, end);
-
-    if (tid == 0) {
-      d_out[blockIdx.x + batchIdx * gridDim.x] = sdata[0];
-      d_ind[blockIdx.x + batchIdx * gridDim.x] = indices[0];
+    if(tid == sthread[0]) {
+      if(head < k) {
+        outVals[r] = vals[head];
+        outIdxs[r] = idxs[head];
+        ++head;
+      }
+      else {
+        outVals[r] = -3.40282e+38f;
+        outIdxs[r] = -1;
+      }
     }
     __syncthreads();
   }
 }
 
-__global__ void gMaxElementUpdate(float* binCosts, int* binIdxs, float* probs, int *batchFirstElements, float* outCosts, int* outIdxs, int *cummulatedBeamSizes, int NUM_BLOCKS) {
-  extern __shared__ float sdata[];
-  __shared__ int indices[512];
-  __shared__ float bestBinCost;
-  __shared__ int bestBinCostIdx;
+/**
+ * Per row of logits, shifts = max + log(sum(exp(x - max))) - cost, so that
+ * x - shift is the log-softmax plus the hypothesis cost. One block per row.
+ */
+__global__ void gRowShifts(float* shifts, const float* logits,
+                           const float* costs, int cols) {
+  __shared__ float sdata[TOPK_THREADS];
 
   const int tid = threadIdx.x;
-  const int batchIdx = blockIdx.x;
-  const int N = batchFirstElements[batchIdx + 1] - batchFirstElements[batchIdx];
-  int num_bins = int(N / (2 * 512)) + int(N % (2 * 512) != 0);
-  if (num_bins > 500) {
-    num_bins = 500;
+  const float* row = logits + blockIdx.x * cols;
+
+  float mx = -3.40282e+38f;
+  for(int i = tid; i < cols; i += blockDim.x)
+    mx = max(mx, row[i]);
+  sdata[tid] = mx;
+  __syncthreads();
+  for(int s = (blockDim.x >> 1); s > 0; s >>= 1) {
+    if(tid < s)
+      sdata[tid] = max(sdata[tid], sdata[tid + s]);
+    __syncthreads();
+  }
+  mx = sdata[0];
+  __syncthreads();
+
+  float sum = 0;
+  for(int i = tid; i < cols; i += blockDim.x)
+    sum += __expf(row[i] - mx);
+  sdata[tid] = sum;
+  __syncthreads();
+  for(int s = (blockDim.x >> 1); s > 0; s >>= 1) {
+    if(tid < s)
+      sdata[tid] += sdata[tid + s];
+    __syncthreads();
   }
 
-  for (int pos = cummulatedBeamSizes[batchIdx]; pos < cummulatedBeamSizes[batchIdx + 1]; ++pos) {
-    int i = tid;
+  if(tid == 0)
+    shifts[blockIdx.x] = mx + __logf(sdata[0]) - costs[blockIdx.x];
+}
 
-    sdata[tid] = -3.40282e+38f;
+/** shifts = -cost for scores which already are log-probabilities */
+__global__ void gCostShifts(float* shifts, const float* costs, int rows) {
+  int i = blockIdx.x * blockDim.x + threadIdx.x;
+  if(i < rows)
+    shifts[i] = -costs[i];
+}
 
-    if (i < num_bins) {
-      sdata[tid] = binCosts[batchIdx * NUM_BLOCKS + i];
-      indices[tid] = i;
+/**
+ * Flags the results of one sentence which stay in its beam and returns their
+ * number. Results ending in EOS finish and update  finished , the best
+ * normalized cost of the sentence. Live results are dropped when their cost
+ * is more than  threshold  below the best result, or when  maxPerParent
+ * better ones extend the same hypothesis. A sentence stops when even its
+ * best live hypothesis normalized by maxLength, a bound for all of its
+ * continuations, cannot beat  finished . BeamSearch::pruneBeam applies the
+ * same rules on the host.
+ */
+__device__ int gLiveHyps(bool* live, float& finished,
+                         const int* keys, const float* vals,
+                         const int* words, int first, int last, int cols,
+                         float threshold, int maxPerParent,
+                         float step, float maxLength) {
+  int n = 0;
+  int best = -1;
+  for(int i = first; i < last; ++i) {
+    int j = i - first;
+    live[j] = false;
+
+    int col = keys[i] % cols;
+    if((words ? words[col] : col) == EOS_ID) {
+      finished = max(finished, vals[i] / step);
+      continue;
     }
-
-    if (i + blockDim.x < num_bins) {
-      float a = binCosts[batchIdx * NUM_BLOCKS + i];
-      float b = binCosts[batchIdx * NUM_BLOCKS + i + blockDim.x];
-      if (a > b) {
-        sdata[tid] = a;
-        indices[tid] = i;
-      } else {
-        sdata[tid] = b;
-        indices[tid] = i + blockDim.x;
-      }
+    if(threshold > 0 && vals[i] < vals[first] - threshold)
+      continue;
+    if(maxPerParent > 0) {
+      int parent = keys[i] / cols;
+      int siblings = 0;
+      for(int m = 0; m < j; ++m)
+        if(live[m] && keys[first + m] / cols == parent)
+          ++siblings;
+      if(siblings >= maxPerParent)
+        continue;
     }
 
-    while (i + 2 * blockDim.x < num_bins) {
-      i += 2 * blockDim.x;
-
-      float a = binCosts[batchIdx * NUM_BLOCKS + i];
-      if (a > sdata[tid]) {
-        sdata[tid] = a;
-        indices[tid] = i;
-      }
-
-      if (i + blockDim.x < num_bins) {
-        float b = binCosts[batchIdx * NUM_BLOCKS + i + blockDim.x];
-        if (b > sdata[tid]) {
-          sdata[tid] = b;
-          indices[tid] = i + blockDim.x;
-        }
-      }
-    }
+    live[j] = true;
+    if(best < 0)
+      best = i;
+    ++n;
+  }
 
-    __syncthreads();
+  if(n > 0 && vals[best] / maxLength <= finished)
+    n = 0;
+  return n;
+}
 
-    for (int s = (blockDim.x >> 1); s > 32; s >>= 1) {
-      if (tid < s && tid + s < num_bins) {
-        if (sdata[tid + s] > sdata[tid]) {
-          sdata[tid] = sdata[tid + s];
-          indices[tid] = indices[tid + s];
-        }
+/**
+ * Beam bookkeeping for the next step, a single block. Sentence b keeps its
+ * live results (see gLiveHyps) in order, sentences keeping none are dropped.
+ * Hypothesis j of the c-th kept sentence becomes row j * kept + c with the
+ * state row and the word it extends and its cost, rows past the beam of a
+ * sentence repeat its first state with word 0 and cost 0. The beam sizes of
+ * the kept sentences replace cumBeamSizes and batchFirstElements and the
+ * best finished costs are compacted alike, so the next top-k needs no upload
+ * from the host.
+ */
+__global__ void gNextBeams(float* hypIdxs, float* embIdxs, float* costs,
+                           int* batchFirstElements, int* cumBeamSizes,
+                           float* finished,
+                           const int* keys, const float* vals,
+                           const int* words, int batch, int cols,
+                           float threshold, int maxPerParent,
+                           float step, float maxLength) {
+  extern __shared__ int sbeams[];
+  int* cum = sbeams;
+  int* kept = cum + batch + 1;
+  int* pos = kept + batch;
+  float* done = (float*)(pos + batch);
+  __shared__ int numKept;
+  __shared__ int dimBeam;
+
+  for(int b = threadIdx.x; b <= batch; b += blockDim.x)
+    cum[b] = cumBeamSizes[b];
+  __syncthreads();
+
+  bool live[MAX_BEAM];
+  for(int b = threadIdx.x; b < batch; b += blockDim.x) {
+    done[b] = finished[b];
+    kept[b] = gLiveHyps(live, done[b], keys, vals, words, cum[b], cum[b + 1],
+                        cols, threshold, maxPerParent, step, maxLength);
+  }
+  __syncthreads();
+
+  if(threadIdx.x == 0) {
+    int c = 0;
+    int beam = 0;
+    cumBeamSizes[0] = 0;
+    batchFirstElements[0] = 0;
+    for(int b = 0; b < batch; ++b) {
+      pos[b] = -1;
+      if(kept[b] > 0) {
+        pos[b] = c++;
+        cumBeamSizes[c] = cumBeamSizes[c - 1] + kept[b];
+        batchFirstElements[c] = batchFirstElements[c - 1] + kept[b] * cols;
+        beam = max(beam, kept[b]);
       }
-      __syncthreads();
-    }
-
-    UNROLL_MAXARG_LOOP(32, num_bins);
-    UNROLL_MAXARG_LOOP(16, num_bins);
-    UNROLL_MAXARG_LOOP(8, num_bins);
-    UNROLL_MAXARG_LOOP(4, num_bins);
-    UNROLL_MAXARG_LOOP(2, num_bins);
-    UNROLL_MAXARG_LOOP(1, num_bins);
-
-    if (tid == 0) {
-      bestBinCost = sdata[0];
-      bestBinCostIdx = batchIdx * NUM_BLOCKS + indices[0];
-
-      probs[binIdxs[bestBinCostIdx]] = -3.40282e+38f;
-
-      outIdxs[pos] = binIdxs[bestBinCostIdx];
-      outCosts[pos] = bestBinCost;
     }
-
-    __syncthreads();
-
-    i = batchFirstElements[batchIdx] + (bestBinCostIdx - batchIdx * NUM_BLOCKS) * (blockDim.x * 2) + tid;
-    const int dist = num_bins * 2 * blockDim.x;
-
-    sdata[tid] = -3.40282e+38f;
-
-    if (i < batchFirstElements[batchIdx + 1]) {
-      sdata[tid] = probs[i];
-      indices[tid] = i;
+    numKept = c;
+    dimBeam = beam;
+  }
+  __syncthreads();
+
+  for(int b = threadIdx.x; b < batch; b += blockDim.x) {
+    if(pos[b] < 0)
+      continue;
+
+    float unused = done[b];
+    gLiveHyps(live, unused, keys, vals, words, cum[b], cum[b + 1],
+              cols, threshold, maxPerParent, step, maxLength);
+    finished[pos[b]] = done[b];
+
+    int j = 0;
+    int first = 0;
+    for(int i = cum[b]; i < cum[b + 1]; ++i) {
+      if(!live[i - cum[b]])
+        continue;
+      int col = keys[i] % cols;
+      if(j == 0)
+        first = keys[i] / cols;
+      int row = j * numKept + pos[b];
+      hypIdxs[row] = keys[i] / cols;
+      embIdxs[row] = words ? words[col] : col;
+      costs[row] = vals[i];
+      ++j;
     }
-
-    if (i + blockDim.x < batchFirstElements[batchIdx + 1]) {
-      float a = probs[i];
-      float b = probs[i+blockDim.x];
-      if (a > b) {
-        sdata[tid] = a;
-        indices[tid] = i;
-      } else {
-        sdata[tid] = b;
-        indices[tid] = i + blockDim.x;
-      }
+    for(; j < dimBeam; ++j) {
+      int row = j * numKept + pos[b];
+      hypIdxs[row] = first;
+      embIdxs[row] = 0;
+      costs[row] = 0;
     }
+  }
+}
 
-    while (i + dist < batchFirstElements[batchIdx + 1]) {
-      i += dist;
-
-      float a = probs[i];
-      if (a > sdata[tid]) {
-        sdata[tid] = a;
-        indices[tid] = i;
-      }
+/**
+ * First pass, grid (bins, sentences). Every block scans a strided share of its
+ * sentence's scores once and writes its k best to binCosts/binIdxs. With
+ * shifts every score is rescored on the fly as probs[i] - shifts[row] and
+ * column unk is excluded. With interleaved rows, hypothesis h of sentence b
+ * is row h * sentences + b and batchFirstElements only delimit the number of
+ * scores per sentence.
+ */
+__global__ void gTopKBins(float* binCosts, int* binIdxs, const float* probs,
+                          const int* batchFirstElements, const int* cumBeamSizes,
+                          int numBins, const float* shifts, int cols, int unk,
+                          bool interleaved) {
+  __shared__ float sval[TOPK_THREADS];
+  __shared__ int sthread[TOPK_THREADS];
+
+  const int batchIdx = blockIdx.y;
+  const int bin = blockIdx.x;
+  const int k = cumBeamSizes[batchIdx + 1] - cumBeamSizes[batchIdx];
+  if(k == 0)
+    return;
+
+  float vals[MAX_BEAM];
+  int idxs[MAX_BEAM];
+  for(int j = 0; j < k; ++j) {
+    vals[j] = -3.40282e+38f;
+    idxs[j] = -1;
+  }
 
-      if (i + blockDim.x < batchFirstElements[batchIdx + 1]) {
-        float b = probs[i + blockDim.x];
-        if (b > sdata[tid]) {
-          sdata[tid] = b;
-          indices[tid] = i + blockDim.x;
-        }
-      }
-    }
+  const int first = batchFirstElements[batchIdx];
+  const int end = batchFirstElements[batchIdx + 1];
+  for(int j = first + bin * blockDim.x + threadIdx.x;
+      j < end; j += blockDim.x * numBins) {
+    int i = j;
+    if(interleaved)
+      i = ((j - first) / cols * gridDim.y + batchIdx) * cols + (j - first) % cols;
+    float score = probs[i];
+    if(shifts)
+      score = (i % cols == unk) ? -3.40282e+38f : score - shifts[i / cols];
+    insertTopK(vals, idxs, k, score, i);
+  }
 
-    __syncthreads();
+  int offset = (batchIdx * numBins + bin) * MAX_BEAM;
+  mergeTopK(vals, idxs, k, binCosts + offset, binIdxs + offset, sval, sthread);
+}
 
-    for (int s = (blockDim.x >> 1); s > 32; s >>= 1) {
-      if (tid < s && tid + s < batchFirstElements[batchIdx + 1]) {
-        if (sdata[tid + s] > sdata[tid]) {
-          sdata[tid] = sdata[tid + s];
-          indices[tid] = indices[tid + s];
-        }
-      }
-      __syncthreads();
-    }
+/**
+ * Second pass, one block per sentence, merges the k best of all bins.
+ */
+__global__ void gTopKMerge(const float* binCosts, const int* binIdxs,
+                           float* outCosts, int* outIdxs,
+                           const int* cumBeamSizes, int numBins) {
+  __shared__ float sval[TOPK_THREADS];
+  __shared__ int sthread[TOPK_THREADS];
 
-    UNROLL_MAXARG_LOOP(32, batchFirstElements[batchIdx + 1]);
-    UNROLL_MAXARG_LOOP(16, batchFirstElements[batchIdx + 1]);
-    UNROLL_MAXARG_LOOP(8, batchFirstElements[batchIdx + 1]);
-    UNROLL_MAXARG_LOOP(4, batchFirstElements[batchIdx + 1]);
-    UNROLL_MAXARG_LOOP(2, batchFirstElements[batchIdx + 1]);
-    UNROLL_MAXARG_LOOP(1, batchFirstElements[batchIdx + 1]);
+  const int batchIdx = blockIdx.x;
+  const int first = cumBeamSizes[batchIdx];
+  const int k = cumBeamSizes[batchIdx + 1] - first;
+  if(k == 0)
+    return;
+
+  float vals[MAX_BEAM];
+  int idxs[MAX_BEAM];
+  for(int j = 0; j < k; ++j) {
+    vals[j] = -3.40282e+38f;
+    idxs[j] = -1;
+  }
 
-    if (tid == 0) {
-      binCosts[bestBinCostIdx] = sdata[0];
-      binIdxs[bestBinCostIdx] = indices[0];
-    }
-    __syncthreads();
+  for(int c = threadIdx.x; c < numBins * k; c += blockDim.x) {
+    int offset = (batchIdx * numBins + c / k) * MAX_BEAM + c % k;
+    insertTopK(vals, idxs, k, binCosts[offset], binIdxs[offset]);
   }
+
+  mergeTopK(vals, idxs, k, outCosts + first, outIdxs + first, sval, sthread);
 }
 
 __global__ void gGetValueByKey(float* d_in, float* d_out, int* indeces, int n)
@@ -258,15 +342,18 @@ __global__ void gGetValueByKey(float* d_in, float* d_out, int* indeces, int n)
   }
 }
 
-NthElement::NthElement(size_t maxBeamSize, size_t maxBatchSize, cudaStream_t stream)
-    : stream_(stream) ,
-      NUM_BLOCKS(std::min(500, int(maxBeamSize * 85000 / (2 * BLOCK_SIZE)) + int(maxBeamSize * 85000 % (2 * BLOCK_SIZE) != 0)))
+NthElement::NthElement(size_t maxBeamSize, size_t maxBatchSize,
+                       size_t device, cudaStream_t stream)
+    : NUM_BLOCKS(std::min(64, int(maxBeamSize * 85000 / (16 * TOPK_THREADS)) + 1)),
+      stream_(stream)
 {
-  //std::cerr << "NthElement::NthElement" << std::endl;
+  UTIL_THROW_IF2(isCPU(device), "NthElement is not implemented on CPU");
+  UTIL_THROW_IF2(maxBeamSize > MAX_BEAM,
+                 "Beam size " << maxBeamSize << " exceeds the maximum of " << MAX_BEAM);
 
-  HANDLE_ERROR( cudaMalloc((void**)&d_ind, maxBatchSize * NUM_BLOCKS * sizeof(int)) );
+  HANDLE_ERROR( cudaMalloc((void**)&d_ind, maxBatchSize * NUM_BLOCKS * MAX_BEAM * sizeof(int)) );
 
-  HANDLE_ERROR( cudaMalloc((void**)&d_out, maxBatchSize * NUM_BLOCKS * sizeof(float)) );
+  HANDLE_ERROR( cudaMalloc((void**)&d_out, maxBatchSize * NUM_BLOCKS * MAX_BEAM * sizeof(float)) );
 
   HANDLE_ERROR( cudaMalloc((void**)&d_res_idx, maxBatchSize * maxBeamSize * sizeof(int)) );
   HANDLE_ERROR( cudaMalloc((void**)&d_res, maxBatchSize * maxBeamSize * sizeof(float)) );
@@ -276,9 +363,14 @@ NthElement::NthElement(size_t maxBeamSize, size_t maxBatchSize, cudaStream_t str
   HANDLE_ERROR( cudaHostAlloc((void**) &h_res_idx, maxBeamSize * maxBatchSize * sizeof(int),
                               cudaHostAllocDefault) );
 
-  HANDLE_ERROR( cudaMalloc((void**)&d_breakdown, maxBeamSize * sizeof(float)) );
+  HANDLE_ERROR( cudaMalloc((void**)&d_breakdown, maxBatchSize * maxBeamSize * sizeof(float)) );
+  HANDLE_ERROR( cudaMalloc((void**)&d_costs, maxBatchSize * maxBeamSize * sizeof(float)) );
+  HANDLE_ERROR( cudaMalloc((void**)&d_shifts, maxBatchSize * maxBeamSize * sizeof(float)) );
   HANDLE_ERROR( cudaMalloc((void**)&d_batchPosition, (maxBatchSize + 1) * sizeof(int)) );
   HANDLE_ERROR( cudaMalloc((void**)&d_cumBeamSizes, (maxBatchSize + 1) * sizeof(int)) );
+  HANDLE_ERROR( cudaMalloc((void**)&d_hypIdxs, maxBatchSize * maxBeamSize * sizeof(float)) );
+  HANDLE_ERROR( cudaMalloc((void**)&d_embIdxs, maxBatchSize * maxBeamSize * sizeof(float)) );
+  HANDLE_ERROR( cudaMalloc((void**)&d_finished, maxBatchSize * sizeof(float)) );
 }
 
 NthElement::~NthElement()
@@ -290,25 +382,61 @@ NthElement::~NthElement()
   HANDLE_ERROR(cudaFreeHost(h_res));
   HANDLE_ERROR(cudaFreeHost(h_res_idx));
   HANDLE_ERROR(cudaFree(d_breakdown));
+  HANDLE_ERROR(cudaFree(d_costs));
+  HANDLE_ERROR(cudaFree(d_shifts));
   HANDLE_ERROR(cudaFree(d_batchPosition));
   HANDLE_ERROR(cudaFree(d_cumBeamSizes));
+  HANDLE_ERROR(cudaFree(d_hypIdxs));
+  HANDLE_ERROR(cudaFree(d_embIdxs));
+  HANDLE_ERROR(cudaFree(d_finished));
+  if(d_words)
+    HANDLE_ERROR(cudaFree(d_words));
+}
+
+void NthElement::setPruning(float threshold, size_t maxPerParent, size_t maxLength) {
+  threshold_ = threshold;
+  maxPerParent_ = maxPerParent;
+  maxLength_ = maxLength;
+}
+
+void NthElement::setWords(const std::vector<size_t>& words) {
+  if(d_words) {
+    HANDLE_ERROR(cudaFree(d_words));
+    d_words = nullptr;
+  }
+  if(words.empty())
+    return;
+
+  std::vector<int> ids(words.begin(), words.end());
+  HANDLE_ERROR( cudaMalloc((void**)&d_words, ids.size() * sizeof(int)) );
+  HANDLE_ERROR( cudaMemcpyAsync(d_words, ids.data(), ids.size() * sizeof(int),
+                                cudaMemcpyHostToDevice, stream_) );
+  HANDLE_ERROR( cudaStreamSynchronize(stream_) );
 }
 
 void NthElement::getNBestList(float* probs, const std::vector<int>& batchFirstElementIdxs,
-                              const std::vector<int>& cummulatedBeamSizes)
+                              const std::vector<int>& cummulatedBeamSizes,
+                              const float* shifts, int cols, int unk,
+                              bool interleaved)
 {
   HANDLE_ERROR( cudaMemcpyAsync(d_batchPosition, batchFirstElementIdxs.data(), batchFirstElementIdxs.size() * sizeof(int),
                                 cudaMemcpyHostToDevice, stream_) );
   HANDLE_ERROR( cudaMemcpyAsync(d_cumBeamSizes, cummulatedBeamSizes.data(), cummulatedBeamSizes.size() * sizeof(int),
                                 cudaMemcpyHostToDevice, stream_) );
 
-  const int numBatches = batchFirstElementIdxs.size() - 1;
+  topK(probs, batchFirstElementIdxs.size() - 1, shifts, cols, unk, interleaved);
+}
 
-  gMaxElement<<<NUM_BLOCKS, BLOCK_SIZE, BLOCK_SIZE * sizeof(float), stream_>>>
-    (d_out, d_ind, probs, numBatches, d_batchPosition);
+void NthElement::topK(float* probs, int numBatches, const float* shifts,
+                      int cols, int unk, bool interleaved) {
+  // a single read of the scores, the results stay in d_res and d_res_idx
+  // until GetPairs copies them for the beam bookkeeping
+  gTopKBins<<<dim3(NUM_BLOCKS, numBatches), TOPK_THREADS, 0, stream_>>>
+    (d_out, d_ind, probs, d_batchPosition, d_cumBeamSizes, NUM_BLOCKS,
+     shifts, cols, unk, interleaved);
 
-  gMaxElementUpdate<<<numBatches, BLOCK_SIZE, BLOCK_SIZE * sizeof(float), stream_>>>
-    (d_out, d_ind, probs, d_batchPosition, d_res, d_res_idx, d_cumBeamSizes, NUM_BLOCKS);
+  gTopKMerge<<<numBatches, TOPK_THREADS, 0, stream_>>>
+    (d_out, d_ind, d_res, d_res_idx, d_cumBeamSizes, NUM_BLOCKS);
 }
 
 void NthElement::getNBestList(const std::vector<size_t>& beamSizes, Tensor Probs,
@@ -329,6 +457,62 @@ void NthElement::getNBestList(const std::vector<size_t>& beamSizes, Tensor Probs
 
 }
 
+void NthElement::getNBestList(const std::vector<size_t>& beamSizes, Tensor logits,
+                              int unk,
+                              std::vector<float>& outCosts, std::vector<unsigned>& outKeys,
+                              const bool isFirst, const bool normalized) {
+  const int vocabSize = logits->shape()[1];
+  const int rows = logits->shape().elements() / vocabSize;
+  const int numBatches = beamSizes.size();
+
+  size_t total = 0;
+  for(auto beamSize : beamSizes)
+    total += beamSize;
+
+  // later steps use the sentence offsets, beam sizes and costs left behind
+  // by gNextBeams of the previous step
+  if(isFirst) {
+    // rows are interleaved, sentence i owns rows i, i + batch, ... of which
+    // the first beamSizes[i] hold live hypotheses (one row in the first step)
+    std::vector<int> cummulatedBeamSizes(numBatches + 1, 0);
+    std::vector<int> batchFirstElementIdxs(numBatches + 1, 0);
+    for(int i = 0; i < numBatches; ++i) {
+      cummulatedBeamSizes[i + 1] = cummulatedBeamSizes[i] + beamSizes[i];
+      size_t hyps = beamSizes[i] > 0 ? 1 : 0;
+      batchFirstElementIdxs[i + 1] = batchFirstElementIdxs[i] + hyps * vocabSize;
+    }
+    HANDLE_ERROR( cudaMemcpyAsync(d_batchPosition, batchFirstElementIdxs.data(),
+                                  (numBatches + 1) * sizeof(int),
+                                  cudaMemcpyHostToDevice, stream_) );
+    HANDLE_ERROR( cudaMemcpyAsync(d_cumBeamSizes, cummulatedBeamSizes.data(),
+                                  (numBatches + 1) * sizeof(int),
+                                  cudaMemcpyHostToDevice, stream_) );
+    HANDLE_ERROR( cudaMemsetAsync(d_costs, 0, rows * sizeof(float), stream_) );
+
+    std::vector<float> finished(numBatches, -3.40282e+38f);
+    HANDLE_ERROR( cudaMemcpyAsync(d_finished, finished.data(), numBatches * sizeof(float),
+                                  cudaMemcpyHostToDevice, stream_) );
+    step_ = 0;
+  }
+  ++step_;
+
+  if(normalized)
+    gCostShifts<<<(rows + TOPK_THREADS - 1) / TOPK_THREADS, TOPK_THREADS, 0, stream_>>>
+      (d_shifts, d_costs, rows);
+  else
+    gRowShifts<<<rows, TOPK_THREADS, 0, stream_>>>
+      (d_shifts, logits->data(), d_costs, vocabSize);
+
+  topK(logits->data(), numBatches, d_shifts, vocabSize, unk, true);
+
+  gNextBeams<<<1, TOPK_THREADS, (3 * numBatches + 1) * sizeof(int) + numBatches * sizeof(float), stream_>>>
+    (d_hypIdxs, d_embIdxs, d_costs, d_batchPosition, d_cumBeamSizes, d_finished,
+     d_res_idx, d_res, d_words, numBatches, vocabSize,
+     threshold_, maxPerParent_, step_, maxLength_);
+
+  GetPairs(total, outKeys, outCosts);
+}
+
 void NthElement::GetPairs(size_t number,
                     std::vector<unsigned>& outKeys,
                     std::vector<float>& outValues) {
@@ -349,7 +533,7 @@ void NthElement::GetPairs(size_t number,
 
 void NthElement::getValueByKey(std::vector<float>& out, float* d_in) {
   gGetValueByKey<<<1, lastN, 0, stream_>>>
-    (d_in, d_breakdown, h_res_idx, lastN);
+    (d_in, d_breakdown, d_res_idx, lastN);
 
   HANDLE_ERROR( cudaMemcpyAsync(out.data(), d_breakdown, lastN * sizeof(float),
                                 cudaMemcpyDeviceToHost, stream_) );
@@ -8,20 +8,68 @@
 
 namespace marian {
 
+/**
+ * Top-k selection and beam bookkeeping of BeamSearch on the GPU. There is no
+ * host implementation, construction throws for graphs on CPU_DEVICE, which
+ * leaves CPU translation to greedy decoding of a single model.
+ */
 class NthElement {
   public:
     NthElement() = delete;
     NthElement(const NthElement &copy) = delete;
-    NthElement(size_t maxBeamSize, size_t maxBatchSize, cudaStream_t stream);
+    NthElement(size_t maxBeamSize, size_t maxBatchSize,
+               size_t device, cudaStream_t stream);
     virtual ~NthElement();
 
     void getNBestList(float* probs, const std::vector<int>& batchFirstElementIdxs,
-                              const std::vector<int>& cummulatedBeamSizes);
+                      const std::vector<int>& cummulatedBeamSizes,
+                      const float* shifts = nullptr, int cols = 0, int unk = -1,
+                      bool interleaved = false);
 
     void getNBestList(const std::vector<size_t>& beamSizes, Tensor Probs,
                       std::vector<float>& outCosts, std::vector<unsigned>& outKeys,
                       const bool isFirst=false);
 
+    /**
+     * @brief Fused decoder scoring. Selects the k best of log-softmax(logits)
+     * plus the cost of each row's hypothesis, with word  unk  excluded. The
+     * normalized scores are computed on the fly and never written to memory,
+     * pass normalized = true for logits which already are log-probabilities.
+     * Pass unk = -1 to keep every word.
+     *
+     * Rows are laid out as the decoder states, hypothesis h of sentence b is
+     * row h * beamSizes.size() + b. Keys are flat indices row * vocabulary +
+     * word, the results of sentence b follow those of the sentences before
+     * it. Finished sentences have beam size 0 and contribute no results.
+     *
+     * The beams of the next step stay on the device: hypotheses ending in EOS
+     * or pruned by setPruning() and sentences without any other hypothesis
+     * are dropped, the costs of
+     * the remaining ones are used by the next call and their rows and words
+     * are left in hypIndices() and embIndices(). Only the keys and costs
+     * are copied to the host. The first step starts from zero costs.
+     */
+    void getNBestList(const std::vector<size_t>& beamSizes, Tensor logits,
+                      int unk,
+                      std::vector<float>& outCosts, std::vector<unsigned>& outKeys,
+                      const bool isFirst=false, const bool normalized=false);
+
+    /**
+     * @brief Pruning of the next beams, see BeamSearch::pruneBeam. A threshold
+     * and maxPerParent of 0 turn the respective rule off, maxLength bounds the
+     * normalization of live hypotheses for stopping sentences early.
+     */
+    void setPruning(float threshold, size_t maxPerParent, size_t maxLength);
+
+    /** @brief Maps result columns to target words, e.g. of a shortlist, empty for the identity */
+    void setWords(const std::vector<size_t>& words);
+
+    /** @brief Per row of the next step, the row of the state it extends */
+    const float* hypIndices() const { return d_hypIdxs; }
+
+    /** @brief Per row of the next step, the word it extends */
+    const float* embIndices() const { return d_embIdxs; }
+
     void GetPairs(size_t number,
                   std::vector<unsigned>& outKeys,
                   std::vector<float>& outValues);
@@ -29,7 +77,7 @@ class NthElement {
     void getValueByKey(std::vector<float>& out, float* d_in);
 
   private:
-    const int BLOCK_SIZE = 512;
+    // number of blocks sharing the scores of one sentence in the top-k pass
     const int NUM_BLOCKS;
     cudaStream_t stream_;
     int *d_ind;
@@ -43,9 +91,23 @@ class NthElement {
     float *h_res;
 
     float  *d_breakdown;
+    float  *d_costs;
+    float  *d_shifts;
     int    *d_batchPosition;
     int    *d_cumBeamSizes;
+    float  *d_hypIdxs;
+    float  *d_embIdxs;
+    int    *d_words{nullptr};
+    float  *d_finished;
+
+    float threshold_{0};
+    int maxPerParent_{0};
+    float maxLength_{1000};
+    float step_{0};
     size_t lastN;
+
+    void topK(float* probs, int numBatches, const float* shifts,
+              int cols, int unk, bool interleaved);
 };
 
 }
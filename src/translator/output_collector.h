@@ -0,0 +1,56 @@
+#pragma once
+
+#include <iostream>
+#include <map>
+#include <string>
+
+namespace marian {
+
+/**
+ * @brief Writes translations in the order of their line numbers.
+ *
+ * Translations arriving before their predecessors, e.g. from length-sorted
+ * batches or from several translators, wait in a buffer until every earlier
+ * line has been written. Lines are not flushed one by one, see sync().
+ */
+class OutputCollector {
+  private:
+    std::ostream& out_;
+    std::map<size_t, std::string> pending_;
+    size_t next_{0};
+
+  public:
+    OutputCollector(std::ostream& out = std::cout)
+     : out_(out) {}
+
+    void write(size_t lineNo, const std::string& line) {
+      pending_[lineNo] = line;
+      while(!pending_.empty() && pending_.begin()->first == next_) {
+        out_ << pending_.begin()->second << '\n';
+        pending_.erase(pending_.begin());
+        next_++;
+      }
+    }
+
+    /** @brief Writes whatever is still buffered, in line order */
+    void flush() {
+      for(auto& line : pending_)
+        out_ << line.second << '\n';
+      if(!pending_.empty())
+        next_ = pending_.rbegin()->first + 1;
+      pending_.clear();
+      out_.flush();
+    }
+
+    /** @brief Flushes the lines written so far to the stream */
+    void sync() {
+      out_.flush();
+    }
+
+    /** @brief Number of translations waiting for an earlier line */
+    size_t buffered() const {
+      return pending_.size();
+    }
+};
+
+}
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common/definitions.h"
+#include "common/shape.h"
+#include "data/types.h"
+
+namespace marian {
+
+/**
+ * @brief What BeamSearch::translatePrefix() keeps of a sentence between the
+ * requests of a session: per model the encoder context and the decoder
+ * states along the target prefix decoded so far. states[k] are the states
+ * after the first k prefix words were fed back, states[0] the start states.
+ */
+struct PrefixState {
+  struct Model {
+    Shape contextShape;
+    std::vector<float> context;
+    std::vector<Shape> stateShapes;
+    std::vector<std::vector<std::vector<float>>> states;
+  };
+
+  Words source;
+  Words prefix;
+  std::vector<Model> models;
+
+  size_t bytes() const {
+    size_t sum = (source.size() + prefix.size()) * sizeof(Word) + 128;
+    for(auto& model : models) {
+      sum += model.context.size() * sizeof(float);
+      for(auto& position : model.states)
+        for(auto& state : position)
+          sum += state.size() * sizeof(float);
+    }
+    return sum;
+  }
+};
+
+/**
+ * @brief PrefixStates of interactive translation sessions, e.g. of a
+ * post-editing client that asks for a new continuation whenever the user
+ * extends the accepted prefix.
+ *
+ * Entries are evicted least recently used first once their estimated size
+ * exceeds maxBytes. A state is used by one request at a time, sessions are
+ * expected not to overlap their requests. All methods are thread-safe.
+ */
+class PrefixCache {
+  private:
+    struct Entry {
+      std::string session;
+      Ptr<PrefixState> state;
+      size_t bytes;
+    };
+
+    typedef std::list<Entry> Entries;
+
+    std::mutex mutex_;
+    // most recently used first
+    Entries entries_;
+    std::unordered_map<std::string, Entries::iterator> index_;
+
+    size_t maxBytes_;
+    size_t bytes_{0};
+    size_t hits_{0};
+    size_t misses_{0};
+
+    void evict() {
+      while(bytes_ > maxBytes_ && !entries_.empty()) {
+        bytes_ -= entries_.back().bytes;
+        index_.erase(entries_.back().session);
+        entries_.pop_back();
+      }
+    }
+
+  public:
+    PrefixCache(size_t maxBytes) : maxBytes_(maxBytes) {}
+
+    /** @brief State of  session , a new empty one if it is unknown or was evicted */
+    Ptr<PrefixState> get(const std::string& session) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = index_.find(session);
+      if(it == index_.end()) {
+        misses_++;
+        return New<PrefixState>();
+      }
+      entries_.splice(entries_.begin(), entries_, it->second);
+      hits_++;
+      return it->second->state;
+    }
+
+    /** @brief Stores  state  for  session  after a request updated it */
+    void put(const std::string& session, Ptr<PrefixState> state) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = index_.find(session);
+      if(it != index_.end()) {
+        bytes_ -= it->second->bytes;
+        entries_.erase(it->second);
+        index_.erase(it);
+      }
+      entries_.push_front({session, state, state->bytes()});
+      index_[session] = entries_.begin();
+      bytes_ += entries_.front().bytes;
+      evict();
+    }
+
+    size_t hits() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return hits_;
+    }
+
+    size_t misses() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return misses_;
+    }
+
+    size_t size() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return entries_.size();
+    }
+
+    /** @brief Drops all sessions, e.g. after the model changed */
+    void clear() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      entries_.clear();
+      index_.clear();
+      bytes_ = 0;
+    }
+
+    /** @brief Estimated memory used by the entries */
+    size_t bytes() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return bytes_;
+    }
+};
+
+}
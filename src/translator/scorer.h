@@ -0,0 +1,177 @@
+#pragma once
+
+#include <future>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "marian.h"
+#include "training/config.h"
+#include "data/corpus.h"
+#include "models/multi_gnmt.h"
+#include "models/gnmt.h"
+#include "models/dl4mt.h"
+#include "common/thread_pool.h"
+
+namespace marian {
+
+/** @brief Log-probability of a sentence pair and, if requested, of its target words */
+struct SentenceScore {
+  size_t lineNo;
+  float score;
+  std::vector<float> words;
+};
+
+class ScorerBase {
+  public:
+    virtual std::vector<SentenceScore> score(Ptr<data::CorpusBatch>) = 0;
+
+    /**
+     * @brief As score() for a batch with repeated sources, e.g. the candidates
+     * of an n-best list: the encoder runs once per sentence of  sources , the
+     * distinct sources, and sentence b of the batch reads  sourceRows[b] .
+     */
+    virtual std::vector<SentenceScore> score(Ptr<data::CorpusBatch> batch,
+                                             Ptr<data::CorpusBatch> sources,
+                                             const std::vector<size_t>& sourceRows) = 0;
+
+    virtual Ptr<ExpressionGraph> graph() = 0;
+};
+
+/**
+ * @brief Forced decoding of the target side of a batch with the model of
+ * --model: the training graph of the builder in inference mode, one forward
+ * pass per batch, no search and no gradients. The per-sentence and per-word
+ * costs are the named nodes "cost_sentences" and "cost_words" of the cost
+ * layer. With  owner  the parameters of its graph on the same device are
+ * read, see ExpressionGraph::shareParams().
+ */
+template <class Model>
+class Scorer : public ScorerBase {
+  private:
+    Ptr<ExpressionGraph> graph_;
+    Ptr<Model> builder_;
+    bool wordScores_;
+
+    /** @brief Scores of the sentences of  batch  after the forward pass */
+    std::vector<SentenceScore> collect(Ptr<data::CorpusBatch> batch) {
+      std::vector<float> sentences;
+      graph_->get("cost_sentences")->val()->get(sentences);
+
+      // time-major like the batch, sentence b of step k at k * dimBatch + b
+      std::vector<float> words;
+      if(wordScores_)
+        graph_->get("cost_words")->val()->get(words);
+
+      auto& target = (*batch)[batch->sets() - 1];
+      auto& ids = batch->getSentenceIds();
+      size_t dimBatch = batch->size();
+
+      std::vector<SentenceScore> scores;
+      for(size_t b = 0; b < dimBatch; ++b) {
+        scores.push_back({ids.empty() ? b : ids[b], -sentences[b], {}});
+        if(wordScores_)
+          for(size_t k = 0; k < target.batchWidth(); ++k)
+            if(target.mask()[k * dimBatch + b] > 0)
+              scores.back().words.push_back(-words[k * dimBatch + b]);
+      }
+      return scores;
+    }
+
+  public:
+    Scorer(Ptr<Config> options, size_t device, Ptr<ScorerBase> owner = nullptr)
+     : graph_(New<ExpressionGraph>()),
+       builder_(New<Model>(options, keywords::inference=true)),
+       wordScores_(options->get<bool>("word-scores")) {
+      graph_->setDevice(device);
+      graph_->setInference(true);
+      if(owner)
+        graph_->shareParams(owner->graph());
+      else
+        builder_->load(graph_, options->get<std::string>("model"));
+    }
+
+    std::vector<SentenceScore> score(Ptr<data::CorpusBatch> batch) {
+      cudaSetDevice(graph_->getDevice());
+      builder_->build(graph_, batch);
+      graph_->forward();
+      return collect(batch);
+    }
+
+    std::vector<SentenceScore> score(Ptr<data::CorpusBatch> batch,
+                                     Ptr<data::CorpusBatch> sources,
+                                     const std::vector<size_t>& sourceRows) {
+      cudaSetDevice(graph_->getDevice());
+      builder_->buildShared(graph_, batch, sources, sourceRows);
+      graph_->forward();
+      return collect(batch);
+    }
+
+    Ptr<ExpressionGraph> graph() {
+      return graph_;
+    }
+};
+
+/** @brief Scorer for the model type given by --type, see Scorer for  owner  */
+inline Ptr<ScorerBase> createScorer(Ptr<Config> options,
+                                    size_t device,
+                                    Ptr<ScorerBase> owner = nullptr) {
+  auto type = options->get<std::string>("type");
+  if(type == "gnmt")
+    return New<Scorer<GNMT>>(options, device, owner);
+  else if(type == "multi-gnmt")
+    return New<Scorer<MultiGNMT>>(options, device, owner);
+  else
+    return New<Scorer<DL4MT>>(options, device, owner);
+}
+
+/**
+ * @brief Scores batches in parallel with --graphs-per-device scorers on every
+ * device of --devices, as TranslatorPool does for translation. Results come
+ * back through futures.
+ */
+class ScorerPool {
+  private:
+    std::vector<Ptr<ScorerBase>> scorers_;
+    std::mutex mutex_;
+    size_t assigned_{0};
+    ThreadPool pool_;
+
+    static size_t workers(Ptr<Config> options) {
+      return options->get<std::vector<int>>("devices").size()
+             * std::max((size_t)1, options->get<size_t>("graphs-per-device"));
+    }
+
+  public:
+    ScorerPool(Ptr<Config> options)
+     : pool_(workers(options), workers(options)) {
+      size_t copies = std::max((size_t)1, options->get<size_t>("graphs-per-device"));
+      for(auto device : options->get<std::vector<int>>("devices")) {
+        auto owner = createScorer(options, device);
+        scorers_.push_back(owner);
+        for(size_t copy = 1; copy < copies; ++copy)
+          scorers_.push_back(createScorer(options, device, owner));
+      }
+    }
+
+    size_t size() const {
+      return scorers_.size();
+    }
+
+    /** @brief Scores  batch , with  sources  see ScorerBase::score() */
+    std::future<std::vector<SentenceScore>> score(Ptr<data::CorpusBatch> batch,
+                                                  Ptr<data::CorpusBatch> sources = nullptr,
+                                                  std::vector<size_t> sourceRows = {}) {
+      auto task = [this, sources, sourceRows](Ptr<data::CorpusBatch> batch) {
+        thread_local Ptr<ScorerBase> scorer;
+        if(!scorer) {
+          std::lock_guard<std::mutex> lock(mutex_);
+          scorer = scorers_[assigned_++];
+        }
+        return sources ? scorer->score(batch, sources, sourceRows) : scorer->score(batch);
+      };
+      return pool_.enqueue(task, batch);
+    }
+};
+
+}
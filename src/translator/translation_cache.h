@@ -0,0 +1,177 @@
+#pragma once
+
+#include <fstream>
+#include <list>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <boost/functional/hash.hpp>
+
+#include "common/logging.h"
+#include "data/types.h"
+
+namespace marian {
+
+/**
+ * @brief Exact-match cache of translations keyed by the source word ids.
+ *
+ * Entries are evicted least recently used first once their estimated size
+ * exceeds maxBytes. With a path, entries of earlier runs are read from the
+ * file on construction, the file is rewritten with the surviving entries and
+ * every new entry is appended to it. All methods are thread-safe.
+ */
+class TranslationCache {
+  private:
+    struct Entry {
+      Words source;
+      Words target;
+    };
+
+    typedef std::list<Entry> Entries;
+
+    std::mutex mutex_;
+    // most recently used first
+    Entries entries_;
+    std::unordered_map<Words, Entries::iterator, boost::hash<Words>> index_;
+
+    size_t maxBytes_;
+    size_t bytes_{0};
+    size_t hits_{0};
+    size_t misses_{0};
+
+    std::string path_;
+    std::ofstream journal_;
+
+    static size_t bytes(const Entry& entry) {
+      // words of both sides plus list node, key copy and bucket
+      return 2 * entry.source.size() * sizeof(Word)
+             + entry.target.size() * sizeof(Word)
+             + 96;
+    }
+
+    static void write(std::ostream& out, const Entry& entry) {
+      for(auto w : entry.source)
+        out << w << " ";
+      out << "|||";
+      for(auto w : entry.target)
+        out << " " << w;
+      out << "\n";
+    }
+
+    bool insert(const Words& source, const Words& target) {
+      if(index_.count(source))
+        return false;
+
+      entries_.push_front({source, target});
+      index_[source] = entries_.begin();
+      bytes_ += bytes(entries_.front());
+
+      while(bytes_ > maxBytes_ && !entries_.empty()) {
+        bytes_ -= bytes(entries_.back());
+        index_.erase(entries_.back().source);
+        entries_.pop_back();
+      }
+      return index_.count(source) > 0;
+    }
+
+    void load(const std::string& path) {
+      std::ifstream in(path);
+      std::string line;
+      while(std::getline(in, line)) {
+        size_t sep = line.find("|||");
+        if(sep == std::string::npos)
+          continue;
+
+        Words source, target;
+        Word w;
+        std::istringstream src(line.substr(0, sep));
+        while(src >> w)
+          source.push_back(w);
+        std::istringstream trg(line.substr(sep + 3));
+        while(trg >> w)
+          target.push_back(w);
+
+        // later lines are more recent
+        auto it = index_.find(source);
+        if(it != index_.end()) {
+          bytes_ -= bytes(*it->second);
+          entries_.erase(it->second);
+          index_.erase(it);
+        }
+        insert(source, target);
+      }
+    }
+
+  public:
+    TranslationCache(size_t maxBytes, const std::string& path = "")
+     : maxBytes_(maxBytes), path_(path) {
+      if(path.empty())
+        return;
+
+      load(path);
+      LOG(info, "Loaded {} cached translations from {}", entries_.size(), path);
+
+      journal_.open(path, std::ios::trunc);
+      for(auto it = entries_.rbegin(); it != entries_.rend(); ++it)
+        write(journal_, *it);
+      journal_.flush();
+    }
+
+    /** @brief Looks up  source , on a hit copies its translation into  target */
+    bool get(const Words& source, Words& target) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      auto it = index_.find(source);
+      if(it == index_.end()) {
+        misses_++;
+        return false;
+      }
+      entries_.splice(entries_.begin(), entries_, it->second);
+      target = it->second->target;
+      hits_++;
+      return true;
+    }
+
+    void put(const Words& source, const Words& target) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if(insert(source, target) && journal_.is_open()) {
+        write(journal_, entries_.front());
+        journal_.flush();
+      }
+    }
+
+    size_t hits() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return hits_;
+    }
+
+    size_t misses() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return misses_;
+    }
+
+    size_t size() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return entries_.size();
+    }
+
+    /** @brief Drops all entries and truncates the file, e.g. after the model changed */
+    void clear() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      entries_.clear();
+      index_.clear();
+      bytes_ = 0;
+      if(journal_.is_open()) {
+        journal_.close();
+        journal_.open(path_, std::ios::trunc);
+      }
+    }
+
+    /** @brief Estimated memory used by the entries */
+    size_t bytes() {
+      std::lock_guard<std::mutex> lock(mutex_);
+      return bytes_;
+    }
+};
+
+}
@@ -0,0 +1,263 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <future>
+#include <mutex>
+#include <string>
+
+#include "marian.h"
+#include "training/config.h"
+#include "data/corpus.h"
+#include "data/shortlist.h"
+#include "models/multi_gnmt.h"
+#include "models/gnmt.h"
+#include "models/dl4mt.h"
+
+#include "translator/beam_search.h"
+#include "common/thread_pool.h"
+#include "common/numa.h"
+#include "kernels/tensor_operators_cpu.h"
+
+namespace marian {
+
+class TranslatorBase {
+  public:
+    virtual std::vector<Translation> translate(Ptr<data::CorpusBatch>) = 0;
+
+    /**
+     * @brief Translates with the search options  search  and the shortlist
+     *  shortlist  instead of the translator's, nullptr keeps its shortlist
+     */
+    virtual std::vector<Translation> translate(Ptr<data::CorpusBatch>,
+                                               const SearchOptions& search,
+                                               Ptr<data::Shortlist> shortlist) = 0;
+
+    /** @brief See BeamSearch::translatePrefix() */
+    virtual Words translatePrefix(Ptr<data::CorpusBatch>, const Words&, Ptr<PrefixState>) = 0;
+
+    /** @brief One graph per model of the ensemble */
+    virtual const std::vector<Ptr<ExpressionGraph>>& graphs() = 0;
+
+    /** @brief Accumulates the time of all later translations in  profile , nullptr stops */
+    virtual void setProfile(Ptr<SearchProfile> profile) = 0;
+
+    /** @brief Streams the stable prefixes of all later translations, see BeamSearch::setStream() */
+    virtual void setStream(StreamCallback stream) = 0;
+};
+
+/** @brief Shortlist given by the option  key , --shortlist by default, nullptr without */
+inline Ptr<data::Shortlist> loadShortlist(Ptr<Config> options,
+                                          const std::string& key = "shortlist") {
+  if(!options->has(key))
+    return nullptr;
+
+  auto paths = options->get<std::vector<std::string>>("vocabs");
+  auto srcVocab = New<Vocab>();
+  srcVocab->load(paths.front());
+  auto trgVocab = New<Vocab>();
+  trgVocab->load(paths.back());
+  return New<data::Shortlist>(options->get<std::string>(key),
+                              srcVocab, trgVocab,
+                              options->get<size_t>("shortlist-best"),
+                              options->get<size_t>("shortlist-frequent"));
+}
+
+/**
+ * @brief Translates with the model of --model or the ensemble of --models,
+ * every model is loaded into its own graph on  device , or with  owner  the
+ * graphs read the parameters of its graphs, see ExpressionGraph::shareParams().
+ */
+template <class Model>
+class Translator : public TranslatorBase {
+  private:
+    Ptr<Config> options_;
+    std::vector<Ptr<ExpressionGraph>> graphs_;
+    std::vector<float> weights_;
+    Ptr<ThreadPool> pool_;
+    Ptr<data::Shortlist> shortlist_;
+    Ptr<SearchProfile> profile_;
+    StreamCallback stream_;
+
+  public:
+    Translator(Ptr<Config> options,
+               size_t device,
+               Ptr<data::Shortlist> shortlist,
+               Ptr<TranslatorBase> owner = nullptr)
+    : options_(options),
+      shortlist_(shortlist) {
+      std::vector<std::string> models;
+      if(options_->has("models"))
+        models = options_->get<std::vector<std::string>>("models");
+      else
+        models.push_back(options_->get<std::string>("model"));
+
+      weights_.resize(models.size(), 1.f);
+      if(options_->has("weights"))
+        weights_ = options_->get<std::vector<float>>("weights");
+      UTIL_THROW_IF2(weights_.size() != models.size(),
+                     "Got " << weights_.size() << " weights for "
+                     << models.size() << " models");
+
+      for(size_t i = 0; i < models.size(); ++i) {
+        auto graph = New<ExpressionGraph>();
+        graph->setPriority(priority::high);
+        graph->setDevice(device);
+        graph->setInference(true);
+        reserveWorkspace(graph, options_, false);
+        graph->setQuantized(options_->get<bool>("int8"));
+        graph->setBlockSparse(options_->get<float>("block-sparse"));
+        graph->setHalfContext(options_->get<bool>("half-context"));
+        graph->setStreams(options_->get<size_t>("streams"));
+        graph->setGemmAutotune(options_->get<bool>("gemm-autotune"),
+                               options_->get<std::string>("gemm-autotune-cache"));
+        if(owner)
+          graph->shareParams(owner->graphs()[i]);
+        else
+          New<Model>(options_, keywords::inference=true)->load(graph, models[i]);
+        graphs_.push_back(graph);
+      }
+
+      if(graphs_.size() > 1)
+        pool_ = New<ThreadPool>(graphs_.size(), graphs_.size());
+    }
+
+    std::vector<Translation> translate(Ptr<data::CorpusBatch> batch) {
+      auto search = New<BeamSearch<Model>>(options_, graphs_, weights_,
+                                           pool_, shortlist_);
+      search->setProfile(profile_);
+      search->setStream(stream_);
+      return search->translate(batch);
+    }
+
+    std::vector<Translation> translate(Ptr<data::CorpusBatch> batch,
+                                       const SearchOptions& options,
+                                       Ptr<data::Shortlist> shortlist) {
+      auto search = New<BeamSearch<Model>>(options_, options, graphs_, weights_,
+                                           pool_, shortlist ? shortlist : shortlist_);
+      search->setProfile(profile_);
+      search->setStream(stream_);
+      return search->translate(batch);
+    }
+
+    Words translatePrefix(Ptr<data::CorpusBatch> batch,
+                          const Words& prefix,
+                          Ptr<PrefixState> state) {
+      auto search = New<BeamSearch<Model>>(options_, graphs_, weights_,
+                                           pool_, shortlist_);
+      search->setProfile(profile_);
+      return search->translatePrefix(batch, prefix, state);
+    }
+
+    void setProfile(Ptr<SearchProfile> profile) {
+      profile_ = profile;
+    }
+
+    void setStream(StreamCallback stream) {
+      stream_ = stream;
+    }
+
+    const std::vector<Ptr<ExpressionGraph>>& graphs() {
+      return graphs_;
+    }
+
+};
+
+/** @brief Translator for the model type given by --type, see Translator for  owner  */
+inline Ptr<TranslatorBase> createTranslator(Ptr<Config> options,
+                                            size_t device,
+                                            Ptr<data::Shortlist> shortlist,
+                                            Ptr<TranslatorBase> owner = nullptr) {
+  auto type = options->get<std::string>("type");
+  if(type == "gnmt")
+    return New<Translator<GNMT>>(options, device, shortlist, owner);
+  else if(type == "multi-gnmt")
+    return New<Translator<MultiGNMT>>(options, device, shortlist, owner);
+  else
+    return New<Translator<DL4MT>>(options, device, shortlist, owner);
+}
+
+/**
+ * @brief Translates batches in parallel with --graphs-per-device translators
+ * on every device of --devices, each graph runs on its own stream.
+ *
+ * translate() hands a batch to the next idle worker thread and blocks while
+ * all of them are busy and as many batches are waiting, so a reader cannot
+ * run ahead of the devices. Results come back through futures, callers
+ * restore the input order from the line numbers. The translators of a device
+ * share the parameters of its first one, the models are held once per device.
+ *
+ * With --cpu-threads, that many translators decode on the CPU instead, every
+ * one on its own worker thread with --cpu-intra-threads helpers of its own,
+ * see cpu::setThreads(). --cpu-affinity binds them to disjoint cores.
+ */
+class TranslatorPool {
+  private:
+    std::vector<Ptr<TranslatorBase>> translators_;
+    std::mutex mutex_;
+    size_t assigned_{0};
+    // cores per worker with --cpu-affinity, 0 without
+    size_t cores_{0};
+    ThreadPool pool_;
+
+    static std::vector<size_t> devices(Ptr<Config> options) {
+      if(options->get<size_t>("cpu-threads") > 0)
+        return {CPU_DEVICE};
+      std::vector<size_t> devices;
+      for(auto device : options->get<std::vector<int>>("devices"))
+        devices.push_back(device);
+      return devices;
+    }
+
+    static size_t copies(Ptr<Config> options) {
+      if(options->get<size_t>("cpu-threads") > 0)
+        return options->get<size_t>("cpu-threads");
+      return std::max((size_t)1, options->get<size_t>("graphs-per-device"));
+    }
+
+    static size_t workers(Ptr<Config> options) {
+      return devices(options).size() * copies(options);
+    }
+
+  public:
+    TranslatorPool(Ptr<Config> options)
+     : pool_(workers(options), workers(options)) {
+      if(options->get<size_t>("cpu-threads") > 0) {
+        cpu::setThreads(options->get<size_t>("cpu-intra-threads"));
+        if(options->get<bool>("cpu-affinity"))
+          cores_ = cpu::threads();
+      }
+
+      // contexts and handles of all devices come up while the shortlist loads
+      auto warm = warmUpDevices(devices(options), copies(options));
+      auto shortlist = loadShortlist(options);
+      warm.wait();
+      for(auto device : devices(options)) {
+        auto owner = createTranslator(options, device, shortlist);
+        translators_.push_back(owner);
+        for(size_t copy = 1; copy < copies(options); ++copy)
+          translators_.push_back(createTranslator(options, device, shortlist, owner));
+      }
+    }
+
+    size_t size() const {
+      return translators_.size();
+    }
+
+    std::future<std::vector<Translation>> translate(Ptr<data::CorpusBatch> batch) {
+      auto task = [this](Ptr<data::CorpusBatch> batch) {
+        // every worker thread keeps one translator and with it one graph
+        thread_local Ptr<TranslatorBase> translator;
+        if(!translator) {
+          std::lock_guard<std::mutex> lock(mutex_);
+          if(cores_ > 0)
+            numa::bindCores(assigned_ * cores_, cores_);
+          translator = translators_[assigned_++];
+        }
+        return translator->translate(batch);
+      };
+      return pool_.enqueue(task, batch);
+    }
+};
+
+}